@@ -1,9 +1,13 @@
 
 #include <lliowd.h>
+#include <lliowd_shm.h>
 
 #include <errno.h>
 
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/poll.h>
 
@@ -12,9 +16,153 @@
 #include <stdio.h>
 #include <fcntl.h>
 
+#ifndef LLIOWD_NO_THREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#define UNIX_PATH_MAX 108
+
+// -2: connection in progress; -1: failed; -3: using the shared page; -4: watched by lliowd_watcher.
 static int lliowd_connfd = -1;
 static int lliowd_watchfd = -2;
 
+// Nonzero while a watcher thread is blocked on the inotify fd and nothing has arrived on it,
+// so that lliowd_ok_fast (see lliowd.h) can skip calling lliowd_ok.
+int lliowd_valid = 0;
+
+#ifndef LLIOWD_NO_THREAD
+
+static int lliowd_watcher_fd = -1;
+
+static void* lliowd_watcher(void* arg) {
+
+  struct pollfd waitfd;
+  waitfd.fd = lliowd_watcher_fd;
+  waitfd.events = POLLIN;
+
+  // Sleep until the inotify fd becomes readable (or breaks), then stop vouching for our files.
+  while(poll(&waitfd, 1, -1) == -1 && errno == EINTR)
+    ;
+
+  __atomic_store_n(&lliowd_valid, 0, __ATOMIC_RELAXED);
+  return 0;
+
+}
+
+// The watcher doesn't survive fork: a child goes back to polling the fd itself.
+static void lliowd_atfork_child() {
+
+  if(lliowd_watchfd == -4)
+    lliowd_watchfd = __atomic_load_n(&lliowd_valid, __ATOMIC_RELAXED) ? lliowd_watcher_fd : -1;
+  __atomic_store_n(&lliowd_valid, 0, __ATOMIC_RELAXED);
+
+}
+
+// Hand the inotify fd to a watcher thread. On failure we carry on polling it in lliowd_ok.
+static void lliowd_start_watcher() {
+
+  static int tried = 0;
+  if(tried)
+    return;
+  tried = 1;
+
+  if(pthread_atfork(0, 0, lliowd_atfork_child))
+    return;
+
+  // Keep the program's signals away from the watcher.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  lliowd_watcher_fd = lliowd_watchfd;
+  __atomic_store_n(&lliowd_valid, 1, __ATOMIC_RELAXED);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+
+  if(pthread_create(&thread, &attr, lliowd_watcher, 0))
+    __atomic_store_n(&lliowd_valid, 0, __ATOMIC_RELAXED);
+  else
+    lliowd_watchfd = -4;
+
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+
+}
+
+#endif
+
+// In shared-memory mode, our slot in the daemon's page and the state it had at startup.
+static const struct lliowd_shm_slot* lliowd_shm_slot = 0;
+static uint64_t lliowd_shm_state;
+
+// Try to find this program in the page published by lliowd -s. Returns 1 if we
+// can rely on it from now on; otherwise the caller falls back to the socket.
+static int lliowd_shm_init(const char* homedir) {
+
+  char path[UNIX_PATH_MAX + 16];
+  if(snprintf(path, sizeof(path), "%s/.lliowd-shm", homedir) >= (int)sizeof(path))
+    return 0;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1)
+    return 0;
+
+  // A daemon must be holding the page up to date:
+  struct stat st;
+  if(flock(fd, LOCK_SH | LOCK_NB) == 0 || errno != EWOULDBLOCK || 
+     fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct lliowd_shm_header)) {
+    close(fd);
+    return 0;
+  }
+
+  void* map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return 0;
+
+  struct lliowd_shm_header* header = (struct lliowd_shm_header*)map;
+  if(header->magic != LLIOWD_SHM_MAGIC || header->version != LLIOWD_SHM_VERSION || !header->nslots ||
+     st.st_size < (off_t)(sizeof(struct lliowd_shm_header) + header->nslots * sizeof(struct lliowd_shm_slot))) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  char exebuf[LLIOWD_SHM_NAME_MAX];
+  ssize_t rlret = readlink("/proc/self/exe", exebuf, LLIOWD_SHM_NAME_MAX);
+  if(rlret < 0 || rlret == LLIOWD_SHM_NAME_MAX) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+  exebuf[rlret] = '\0';
+
+  struct lliowd_shm_slot* slots = lliowd_shm_slots(header);
+  for(uint32_t i = 0, idx = lliowd_shm_hash(exebuf) % header->nslots; i != header->nslots; ++i, idx = (idx + 1) % header->nslots) {
+
+    if(!slots[idx].name[0])
+      break;
+
+    if(!strcmp(slots[idx].name, exebuf)) {
+
+      lliowd_shm_slot = &slots[idx];
+      lliowd_shm_state = __atomic_load_n(&lliowd_shm_slot->state, __ATOMIC_ACQUIRE);
+      // Invalid already: no need for the socket to tell us the same thing.
+      lliowd_watchfd = (lliowd_shm_state & 1) ? -3 : -1;
+      return 1;
+
+    }
+
+  }
+
+  munmap(map, st.st_size);
+  return 0;
+
+}
+
 static void lliowd_getwatchfd() {
 
   // lliowd_connfd is alive. Either retrieve lliowd_watchfd from it,
@@ -65,10 +213,12 @@ static void lliowd_getwatchfd() {
 
 }
 
-#define UNIX_PATH_MAX 108
-
 void lliowd_init() {
 
+  const char* shmhome = getenv("HOME");
+  if(shmhome && lliowd_shm_init(shmhome))
+    return;
+
   lliowd_connfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
   if(lliowd_connfd == -1) {
 
@@ -118,7 +268,27 @@ void lliowd_init() {
 
 int lliowd_ok() {
 
-  if(lliowd_watchfd == -1) {
+  if(lliowd_watchfd == -4) {
+
+    // The watcher thread has the fd; it clears lliowd_valid once anything arrives on it.
+    if(__atomic_load_n(&lliowd_valid, __ATOMIC_RELAXED))
+      return 1;
+
+    lliowd_watchfd = -1;
+    return 0;
+
+  }
+  else if(lliowd_watchfd == -3) {
+
+    // Shared-memory mode: still valid as long as nothing has changed since startup.
+    if(__atomic_load_n(&lliowd_shm_slot->state, __ATOMIC_ACQUIRE) == lliowd_shm_state)
+      return 1;
+
+    lliowd_watchfd = -1;
+    return 0;
+
+  }
+  else if(lliowd_watchfd == -1) {
 
     // Couldn't connect to the daemon, or did and it said
     // not to use specialised code, or an earlier check has already failed.
@@ -184,6 +354,11 @@ int lliowd_ok() {
 
   }
 
+#ifndef LLIOWD_NO_THREAD
+  // From now on, let a thread wait on the fd so that checks needn't make a syscall each.
+  lliowd_start_watcher();
+#endif
+
   // All is well! Use specialised code:
 
   return 1;
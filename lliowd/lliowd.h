@@ -1,4 +1,3 @@
-
 #ifndef LLIOWD_H
 #define LLIOWD_H
 
@@ -6,4 +5,17 @@ void lliowd_init();
 
 int lliowd_ok();
 
+// Set by the client library while it can vouch for our files without a syscall.
+extern int lliowd_valid;
+
+// Equivalent to lliowd_ok(), but inlinable: once a check has succeeded, later ones are just a load
+// until the daemon reports a change. LLPE emits the same thing given -llpe-inline-lliowd-check.
+static inline int lliowd_ok_fast() {
+
+  if(__atomic_load_n(&lliowd_valid, __ATOMIC_RELAXED))
+    return 1;
+  return lliowd_ok();
+
+}
+
 #endif
@@ -0,0 +1,52 @@
+#ifndef LLIOWD_SHM_H
+#define LLIOWD_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Layout of the shared page published by lliowd at $HOME/.lliowd-shm.
+// Programs are found by hashing their binary name into an open-addressed table.
+// A slot's state is (generation << 1) | valid: the daemon bumps the generation whenever it
+// changes, both when files change and when they are re-validated, so a client that saw a valid
+// state at startup need only check the state is unchanged. The daemon holds an exclusive flock on the file
+// while it is running, and invalidates every slot when it exits.
+
+#define LLIOWD_SHM_MAGIC 0x6c6c696f
+#define LLIOWD_SHM_VERSION 1
+#define LLIOWD_SHM_NAME_MAX 248
+
+struct lliowd_shm_header {
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nslots;
+  uint32_t pad;
+
+};
+
+struct lliowd_shm_slot {
+
+  uint64_t state;
+  char name[LLIOWD_SHM_NAME_MAX];
+
+};
+
+static inline uint32_t lliowd_shm_hash(const char* name) {
+
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for(; *name; ++name) {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return h;
+
+}
+
+static inline struct lliowd_shm_slot* lliowd_shm_slots(struct lliowd_shm_header* header) {
+
+  return (struct lliowd_shm_slot*)(header + 1);
+
+}
+
+#endif
@@ -4,6 +4,12 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <time.h>
 
 #include <openssl/sha.h>
 
@@ -11,8 +17,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include <lliowd_shm.h>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <sstream>
 #include <fstream>
@@ -21,25 +37,73 @@ using namespace std;
 
 #define UNIX_PATH_MAX 108
 
-// watch_fd is set to -1 if files are already non-matching.
+// Each distinct file any program was specialised against is watched once, under one inotify
+// instance that only we read, and fans out to the programs that depend on it. Its status and
+// digests are worked out at most once per validation round, however many programs share it.
+struct watched_file {
+
+  std::string name;
+  int wd;
+  std::vector<size_t> progs;
+
+  uint64_t round;
+  bool stat_ok;
+  struct stat st;
+  // Indexed by whether the digest is SHA-256 (otherwise SHA-1).
+  bool have_digest[2];
+  std::string digest[2];
+
+};
+
+std::vector<struct watched_file> files;
+std::unordered_map<std::string, size_t> files_by_name;
+std::unordered_map<int, std::vector<size_t> > files_by_wd;
+static int inotify_fd = -1;
+static uint64_t validation_round = 1;
+
+// A program's dependency on a file: the recorded mtime and digest, and whether the
+// specialisation also depends on its metadata (it was stat'ed), so that a rewrite with the same contents won't do.
+struct prog_file {
+
+  size_t file;
+  time_t mtime;
+  std::string hash;
+  bool sha256;
+  bool stat_dependent;
+
+};
+
+// watch_fd is the handle given to clients, an eventfd that we make readable when any of the
+// program's files change, or -1 if its files are non-matching. While they are, we try to
+// re-validate them once they have been left alone for a while, at revalidate_at; 0 means wait for the next change.
 struct spec_program {
 
   std::string binary_name;
+  std::vector<prog_file> files;
   int watch_fd;
+  uint64_t revalidate_at;
 
 };
 
 std::vector<struct spec_program> progs;
 
-static struct spec_program* findprog(const char* name) {
+// Index into progs by binary name, built once the config is parsed.
+std::unordered_map<std::string, size_t> progs_by_name;
+
+static void index_progs() {
+
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i)
+    progs_by_name[progs[i].binary_name] = i;
 
-  std::string names(name);
+}
+
+static struct spec_program* findprog(const char* name) {
 
-  for(std::vector<struct spec_program>::iterator it = progs.begin(), itend = progs.end(); it != itend; ++it)
-    if(it->binary_name == names)
-      return &*it;
+  std::unordered_map<std::string, size_t>::iterator findit = progs_by_name.find(name);
+  if(findit == progs_by_name.end())
+    return 0;
   
-  return 0;
+  return &progs[findit->second];
 
 }
 
@@ -56,10 +120,119 @@ static int firstnonws(std::string& s) {
 
 }
 
-static void mark_failed(struct spec_program& prog) {
+// Cache of SHA-256 digests shared with LLPE (see -llpe-digest-cache): each line gives
+// "dev inode mtime-seconds mtime-nanoseconds size digest", and the last line for a key wins.
+struct digest_key {
 
-  close(prog.watch_fd);
-  prog.watch_fd = -1;
+  uint64_t dev, ino, mtime_sec, mtime_nsec, size;
+
+  bool operator<(const digest_key& other) const {
+
+    if(dev != other.dev)
+      return dev < other.dev;
+    if(ino != other.ino)
+      return ino < other.ino;
+    if(mtime_sec != other.mtime_sec)
+      return mtime_sec < other.mtime_sec;
+    if(mtime_nsec != other.mtime_nsec)
+      return mtime_nsec < other.mtime_nsec;
+    return size < other.size;
+
+  }
+
+};
+
+static const char* digest_cache_name = 0;
+static std::map<digest_key, std::string> digest_cache;
+
+static void load_digest_cache() {
+
+  ifstream ifs(digest_cache_name);
+  std::string line;
+
+  while(getline(ifs, line)) {
+
+    istringstream iss(line);
+    digest_key key;
+    std::string digest;
+    if(!(iss >> key.dev >> key.ino >> key.mtime_sec >> key.mtime_nsec >> key.size >> digest))
+      continue;
+    if(digest.size() != SHA256_DIGEST_LENGTH * 2)
+      continue;
+
+    digest_cache[key] = digest;
+
+  }
+
+}
+
+static void add_cached_digest(const digest_key& key, const std::string& digest) {
+
+  digest_cache[key] = digest;
+
+  if(!digest_cache_name)
+    return;
+
+  std::ostringstream oss;
+  oss << key.dev << " " << key.ino << " " << key.mtime_sec << " " << key.mtime_nsec << " " << key.size << " " << digest << "\n";
+  std::string line = oss.str();
+
+  // Append whole lines in one write, so concurrent writers don't interleave.
+  int cachefd = open(digest_cache_name, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if(cachefd != -1) {
+    if(write(cachefd, line.data(), line.size()) != (ssize_t)line.size())
+      cerr << "Warning: failed to update " << digest_cache_name << "\n";
+    close(cachefd);
+  }
+
+}
+
+// Hash filefd's contents with SHA-256 (or SHA-1 for old configurations), giving a lowercase hex digest.
+static bool hash_file(int filefd, bool sha256, std::string& out) {
+
+  SHA256_CTX ctx256;
+  SHA_CTX ctx1;
+
+  if(sha256 ? !SHA256_Init(&ctx256) : !SHA1_Init(&ctx1)) {
+
+    cerr << "SHA init failed\n";
+    exit(1);
+
+  }
+
+  char readbuf[65536];
+  ssize_t thisread;
+
+  while((thisread = read(filefd, readbuf, sizeof(readbuf))) > 0) {
+
+    if(sha256 ? !SHA256_Update(&ctx256, readbuf, thisread) : !SHA1_Update(&ctx1, readbuf, thisread)) {
+
+      cerr << "SHA update failed\n";
+      exit(1);
+
+    }
+
+  }
+
+  if(thisread == -1)
+    return false;
+
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  if(sha256 ? !SHA256_Final(hash, &ctx256) : !SHA1_Final(hash, &ctx1)) {
+
+    cerr << "SHA final failed\n";
+    exit(1);
+
+  }
+
+  static const char hexdigits[] = "0123456789abcdef";
+  out.clear();
+  for(int i = 0, ilim = sha256 ? SHA256_DIGEST_LENGTH : SHA_DIGEST_LENGTH; i != ilim; ++i) {
+    out.push_back(hexdigits[hash[i] / 16]);
+    out.push_back(hexdigits[hash[i] % 16]);
+  }
+
+  return true;
 
 }
 
@@ -85,17 +258,8 @@ static void parse_config(const char* confname) {
       // Start new program
       progs.push_back(spec_program());
       progs.back().binary_name = line;
-
-      int new_watch = inotify_init();
-
-      if(new_watch == -1) {
-
-	cerr << "Inotify open failed\n";
-	exit(1);
-
-      }
-
-      progs.back().watch_fd = new_watch;
+      progs.back().watch_fd = -1;
+      progs.back().revalidate_at = 0;
 
       cout << "Adding program " << progs.back().binary_name << "\n";
 
@@ -109,14 +273,10 @@ static void parse_config(const char* confname) {
 
       }
 
-      // Already failed?
-      if(progs.back().watch_fd == -1)
-	continue;
-
       // New file
       std::string fline(line, wsoff);
 
-      // Last two fields: expected unix time (decimal), expected sha256 hash (hex)
+      // Last two fields: expected unix time (decimal, prefixed S if stat-dependent), expected sha256 hash (hex)
       unsigned hashstart = fline.find_last_of(" ");
       if(hashstart == std::string::npos || hashstart == 0) {
 
@@ -133,138 +293,640 @@ static void parse_config(const char* confname) {
 
       }
       
+      prog_file file;
       std::string fname(fline, 0, timestart);
 
-      // Add an inotify watch *before* verifying file, to avoid race.
-      if(inotify_add_watch(progs.back().watch_fd, fname.c_str(), IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY) == -1) {
+      std::string timestr(fline, timestart + 1, hashstart - timestart);
+      file.stat_dependent = timestr[0] == 'S';
+      if(file.stat_dependent)
+	timestr.erase(0, 1);
 
-	cerr << "Failed adding watch: " << fname << "\n";
-	mark_failed(progs.back());
-	continue;
+      {
+	std::istringstream iss(timestr);
+	if(!(iss >> file.mtime)) {
+
+	  cerr << "Bad line " << fline << "\n";
+	  exit(1);
 
+	}
       }
 
-      // First of all: file exists?
-      struct stat filestat;
-      if(stat(fname.c_str(), &filestat) == -1) {
+      // Parse hash given in config. LLPE used to write SHA-1; it now writes SHA-256.
+      std::string hashstr(fline, hashstart + 1);
+      file.sha256 = hashstr.size() == SHA256_DIGEST_LENGTH * 2;
+
+      if(!file.sha256 && hashstr.size() != SHA_DIGEST_LENGTH * 2) {
 
-	cerr << fname << ": not found\n";
-	mark_failed(progs.back());
-	continue;
+	cerr << hashstr << " wrong length (expected " << (SHA256_DIGEST_LENGTH * 2) << " or " << (SHA_DIGEST_LENGTH * 2) << ", got " << hashstr.size() << ")\n";
+	exit(1);
 
       }
 
-      std::string timestr(fline, timestart + 1, hashstart - timestart);
+      for(unsigned i = 0; i != hashstr.size(); ++i)
+	hashstr[i] = tolower(hashstr[i]);
 
-      // mtimes match?
-      {
-	std::istringstream iss(timestr);
-	time_t expected_time;
-	iss >> expected_time;
+      file.hash = hashstr;
 
-	if(expected_time != filestat.st_mtime) {
+      std::unordered_map<std::string, size_t>::iterator findit = files_by_name.find(fname);
+      if(findit == files_by_name.end()) {
 
-	  cerr << fname << ": bad mtime (expected " << expected_time << ", got " << filestat.st_mtime << "\n";
-	  mark_failed(progs.back());
-	  continue;
+	file.file = files.size();
+	files.push_back(watched_file());
+	files.back().name = fname;
+	files.back().wd = -1;
+	files.back().round = 0;
+	files_by_name[fname] = file.file;
 
-	}
       }
+      else {
 
-      // Get hash of the real file:
+	file.file = findit->second;
 
-      unsigned char realhash[SHA_DIGEST_LENGTH];
-      {
-	SHA_CTX hashctx;
-	if(!SHA1_Init(&hashctx)) {
+      }
 
-	  cerr << "SHA1_Init\n";
-	  exit(1);
+      std::vector<size_t>& fileprogs = files[file.file].progs;
+      if(fileprogs.empty() || fileprogs.back() != progs.size() - 1)
+	fileprogs.push_back(progs.size() - 1);
 
-	}
-	
-	int filefd = open(fname.c_str(), O_RDONLY);
-	if(filefd == -1) {
-	  
-	  cerr << "Cannot open " << fname << "\n";
-	  mark_failed(progs.back());
-	  continue;
+      progs.back().files.push_back(file);
 
-	}
-	
-	char readbuf[4096];
-	int thisread;
+    }
 
-	while((thisread = read(filefd, readbuf, 4096)) > 0) {
+  }
 
- 	  if(!SHA1_Update(&hashctx, readbuf, thisread)) {
+}
 
-	    cerr << "SHA1_Update\n";
-	    exit(1);
+static const uint32_t watch_mask = IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF;
 
-	  }
+// (Re-)add the watch on a file by name, in case it has been replaced since we last looked.
+static bool watch_file(size_t file_idx) {
 
-	}
+  struct watched_file& file = files[file_idx];
 
-	if(thisread == -1) {
+  int wd = inotify_add_watch(inotify_fd, file.name.c_str(), watch_mask);
+  if(wd != file.wd) {
 
-	  cerr << "Read failed for " << fname << "\n";
-	  mark_failed(progs.back());
-	  close(filefd);
-	  continue;
+    if(file.wd != -1) {
+      std::vector<size_t>& oldfiles = files_by_wd[file.wd];
+      oldfiles.erase(std::find(oldfiles.begin(), oldfiles.end(), file_idx));
+      if(oldfiles.empty())
+	files_by_wd.erase(file.wd);
+    }
 
-	}
+    file.wd = wd;
+    if(wd != -1)
+      files_by_wd[wd].push_back(file_idx);
 
-	if(!SHA1_Final(realhash, &hashctx)) {
+  }
 
-	  cerr << "SHA1_Final\n";
-	  exit(1);
+  if(wd == -1) {
 
-	}
+    cerr << "Failed adding watch: " << file.name << "\n";
+    return false;
 
-	close(filefd);
+  }
 
-      }
+  return true;
 
-      // Parse hash given in config:
-      unsigned char expectedhash[SHA_DIGEST_LENGTH];
-      std::string hashstr(fline, hashstart + 1);
+}
 
-      if(hashstr.size() != SHA_DIGEST_LENGTH * 2) {
+static void start_round(struct watched_file& file) {
 
-	cerr << hashstr << " wrong length (expected " << (SHA_DIGEST_LENGTH * 2) << ", got " << hashstr.size() << ")\n";
-	exit(1);
+  if(file.round == validation_round)
+    return;
 
-      }
+  file.round = validation_round;
+  file.stat_ok = stat(file.name.c_str(), &file.st) == 0;
+  file.have_digest[0] = file.have_digest[1] = false;
 
-      {
-	istringstream iss(hashstr);
-	for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+}
 
-	  char hexchars[3];
-	  iss.get(hexchars, 3);
-	  hexchars[2] = '\0';
-	  expectedhash[i] = (char)strtol(hexchars, 0, 16);
+static struct digest_key file_digest_key(const struct watched_file& file) {
 
-	}
-      }
+  struct digest_key key = { (uint64_t)file.st.st_dev, (uint64_t)file.st.st_ino, (uint64_t)file.st.st_mtim.tv_sec,
+			    (uint64_t)file.st.st_mtim.tv_nsec, (uint64_t)file.st.st_size };
+  return key;
 
-      if(memcmp(expectedhash, realhash, SHA_DIGEST_LENGTH) != 0) {
+}
 
-	cerr << "Hash bad match: expected: " << hashstr << ", got: ";
-	for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+static bool hash_path(const std::string& name, bool sha256, std::string& out) {
 
-	  cerr << std::hex << (unsigned int)realhash[i];
+  int filefd = open(name.c_str(), O_RDONLY);
+  if(filefd == -1)
+    return false;
 
-	}
-	cerr << "\n";
+  bool ret = hash_file(filefd, sha256, out);
+  close(filefd);
+  return ret;
+
+}
+
+// Get a file's digest for this round, from the digest cache if this exact file was hashed before.
+static bool get_digest(size_t file_idx, bool sha256) {
+
+  struct watched_file& file = files[file_idx];
+  start_round(file);
+
+  if(!file.stat_ok)
+    return false;
+
+  if(file.have_digest[sha256])
+    return true;
+
+  struct digest_key key = file_digest_key(file);
+
+  std::map<digest_key, std::string>::iterator cacheit = digest_cache.find(key);
+  if(sha256 && cacheit != digest_cache.end()) {
+
+    file.digest[sha256] = cacheit->second;
+
+  }
+  else {
+
+    if(!hash_path(file.name, sha256, file.digest[sha256])) {
+
+      cerr << "Read failed for " << file.name << "\n";
+      return false;
+
+    }
+
+    if(sha256)
+      add_cached_digest(key, file.digest[sha256]);
+
+  }
+
+  file.have_digest[sha256] = true;
+  return true;
+
+}
 
-	mark_failed(progs.back());
+// At startup, hash every file that some program needs and the digest cache doesn't know,
+// once per file and spread across cores.
+static void hash_all_files() {
+
+  std::vector<std::pair<size_t, bool> > jobs;
+  std::vector<bool> queued(files.size() * 2, false);
+
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i) {
+
+    for(std::vector<prog_file>::iterator it = progs[i].files.begin(), itend = progs[i].files.end(); it != itend; ++it) {
+
+      struct watched_file& file = files[it->file];
+      start_round(file);
+      if(!file.stat_ok || queued[it->file * 2 + it->sha256])
+	continue;
+      if(it->sha256 && digest_cache.count(file_digest_key(file)))
 	continue;
 
+      queued[it->file * 2 + it->sha256] = true;
+      jobs.push_back(std::make_pair(it->file, it->sha256));
+
+    }
+
+  }
+
+  std::vector<std::string> digests(jobs.size());
+  std::vector<char> ok(jobs.size(), 0);
+  std::atomic<size_t> next_job(0);
+
+  struct hasher {
+
+    static void run(std::vector<std::pair<size_t, bool> >* jobs, std::vector<std::string>* digests,
+		    std::vector<char>* ok, std::atomic<size_t>* next_job) {
+
+      size_t job;
+      while((job = (*next_job)++) < jobs->size())
+	(*ok)[job] = hash_path(files[(*jobs)[job].first].name, (*jobs)[job].second, (*digests)[job]);
+
+    }
+
+  };
+
+  unsigned nthreads = std::thread::hardware_concurrency();
+  if(!nthreads)
+    nthreads = 1;
+  if(nthreads > jobs.size())
+    nthreads = jobs.size();
+
+  std::vector<std::thread> threads;
+  for(unsigned i = 0; i != nthreads; ++i)
+    threads.push_back(std::thread(hasher::run, &jobs, &digests, &ok, &next_job));
+  for(unsigned i = 0; i != nthreads; ++i)
+    threads[i].join();
+
+  // Failures are left for get_digest to retry and report.
+  for(size_t i = 0, ilim = jobs.size(); i != ilim; ++i) {
+
+    if(!ok[i])
+      continue;
+
+    struct watched_file& file = files[jobs[i].first];
+    bool sha256 = jobs[i].second;
+    file.digest[sha256] = digests[i];
+    file.have_digest[sha256] = true;
+    if(sha256)
+      add_cached_digest(file_digest_key(file), digests[i]);
+
+  }
+
+}
+
+// Check one file against a program's config entry. At startup the mtime must match; after a change only
+// the contents need to, unless the program depends on the file's metadata too.
+static bool verify_file(const prog_file& pfile, bool check_mtime) {
+
+  struct watched_file& file = files[pfile.file];
+  start_round(file);
+
+  // First of all: file exists?
+  if(!file.stat_ok) {
+
+    cerr << file.name << ": not found\n";
+    return false;
+
+  }
+
+  // mtimes match?
+  if((check_mtime || pfile.stat_dependent) && pfile.mtime != file.st.st_mtime) {
+
+    cerr << file.name << ": bad mtime (expected " << pfile.mtime << ", got " << file.st.st_mtime << "\n";
+    return false;
+
+  }
+
+  if(!get_digest(pfile.file, pfile.sha256))
+    return false;
+
+  if(file.digest[pfile.sha256] != pfile.hash) {
+
+    cerr << "Hash bad match: expected: " << pfile.hash << ", got: " << file.digest[pfile.sha256] << "\n";
+    return false;
+
+  }
+
+  return true;
+
+}
+
+// Files that change are re-hashed once they have been left alone this long (editors and
+// configuration tools often rewrite a file several times over), and if that doesn't restore
+// them, and some can't be watched (e.g. they are missing), we look again after retry_ms.
+static const uint64_t debounce_ms = 500;
+static const uint64_t retry_ms = 5000;
+
+static uint64_t now_ms() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
+// Check all of prog's files, and if they match give it a new client handle.
+static void validate_prog(struct spec_program& prog, bool startup) {
+
+  prog.revalidate_at = 0;
+
+  // Add the inotify watches *before* verifying files, to avoid a race.
+  for(std::vector<prog_file>::iterator it = prog.files.begin(), itend = prog.files.end(); it != itend; ++it) {
+
+    if(!watch_file(it->file)) {
+      prog.revalidate_at = now_ms() + retry_ms;
+      return;
+    }
+
+  }
+
+  for(std::vector<prog_file>::iterator it = prog.files.begin(), itend = prog.files.end(); it != itend; ++it) {
+
+    if(!verify_file(*it, startup))
+      return;
+
+  }
+
+  prog.watch_fd = eventfd(0, EFD_CLOEXEC);
+  if(prog.watch_fd == -1) {
+
+    cerr << "eventfd failed for " << prog.binary_name << "\n";
+    prog.revalidate_at = now_ms() + retry_ms;
+    return;
+
+  }
+
+  cout << "Verified " << prog.binary_name << "\n";
+
+}
+
+enum reply_result {
+
+  REPLY_SENT,
+  REPLY_FAILED,
+  REPLY_RETRY
+
+};
+
+// Tell a client whether its files are valid: a zero byte if not, otherwise a one byte
+// accompanied by the inotify handle watching its files.
+static enum reply_result send_reply(int connfd, int watch_fd) {
+
+  ssize_t n;
+
+  if(watch_fd == -1) {
+
+    // Couldn't verify this program's files
+    n = send(connfd, "\0", 1, MSG_NOSIGNAL);
+
+  }
+  else {
+
+    // The program's files were good at startup, and hopefully remain so! Send the inotify handle:
+    struct msghdr hdr;
+    struct iovec data;
+
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+
+    char dummy = '\x01';
+    data.iov_base = &dummy;
+    data.iov_len = sizeof(dummy);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = NULL;
+    hdr.msg_namelen = 0;
+    hdr.msg_iov = &data;
+    hdr.msg_iovlen = 1;
+    hdr.msg_flags = 0;
+
+    hdr.msg_control = cmsgbuf;
+    hdr.msg_controllen = CMSG_LEN(sizeof(int));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+
+    *(int*)CMSG_DATA(cmsg) = watch_fd;
+
+    n = sendmsg(connfd, &hdr, MSG_NOSIGNAL);
+
+  }
+
+  if(n == -1) {
+
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+      return REPLY_RETRY;
+
+    cerr << "sendmsg failed\n";
+    return REPLY_FAILED;
+
+  }
+
+  return REPLY_SENT;
+
+}
+
+// Connections whose reply must wait for socket buffer space, and the program they are for.
+std::unordered_map<int, size_t> pending_replies;
+
+// Identify the program at the other end of connfd and answer it. All the work is non-blocking,
+// so a single thread keeps up with bursts of clients; each client process connects once
+// (see lliowd_init), so there is nothing to gain by caching per pid, and a pid-keyed cache
+// would give wrong answers when pids are reused.
+static void serve_client(int epollfd, int connfd) {
+
+  struct ucred otherendcreds;
+  socklen_t otherendcredslen = sizeof(struct ucred);
+  if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &otherendcreds, &otherendcredslen) == -1) {
+
+    fprintf(stderr, "getsockopt failed\n");
+    close(connfd);
+    return;
+
+  }
+
+  char pathbuf[128];
+  sprintf(pathbuf, "/proc/%d/exe", otherendcreds.pid);
+
+  char exebuf[4096];
+  ssize_t rlret = readlink(pathbuf, exebuf, 4096);
+  if(rlret < 0 || rlret == 4096) {
+
+    cerr << "Path name too long for " << pathbuf << "\n";
+    close(connfd);
+    return;
+
+  }
+
+  exebuf[rlret] = '\0';
+
+  struct spec_program* prog = findprog(exebuf);
+  if(!prog) {
+
+    cerr << "No such program " << exebuf << "\n";
+    close(connfd);
+    return;
+
+  }
+
+  if(send_reply(connfd, prog->watch_fd) == REPLY_RETRY) {
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.fd = connfd;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) == 0) {
+      pending_replies[connfd] = prog - &progs[0];
+      return;
+    }
+
+    cerr << "epoll_ctl failed\n";
+
+  }
+
+  close(connfd);
+
+}
+
+// The shared page (see lliowd_shm.h), and which program each inotify handle belongs to.
+static struct lliowd_shm_header* shm_header = 0;
+static size_t shm_size = 0;
+static std::vector<struct lliowd_shm_slot*> prog_slots;
+
+static void invalidate_slot(struct lliowd_shm_slot* slot) {
+
+  uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+  if(state & 1)
+    __atomic_store_n(&slot->state, ((state >> 1) + 1) << 1, __ATOMIC_RELEASE);
+
+}
+
+// Mark a slot valid again under a new generation, so that clients which saw the old one stay failed.
+static void revalidate_slot(struct lliowd_shm_slot* slot) {
+
+  uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+  if(!(state & 1))
+    __atomic_store_n(&slot->state, (((state >> 1) + 1) << 1) | 1, __ATOMIC_RELEASE);
+
+}
+
+static struct lliowd_shm_slot* prog_slot(size_t prog_idx) {
+
+  return prog_idx < prog_slots.size() ? prog_slots[prog_idx] : 0;
+
+}
+
+static void invalidate_all_and_exit(int) {
+
+  for(size_t i = 0, ilim = prog_slots.size(); i != ilim; ++i) {
+    if(prog_slots[i])
+      invalidate_slot(prog_slots[i]);
+  }
+
+  _exit(0);
+
+}
+
+// Publish every program's validity at $HOME/.lliowd-shm, so that clients can check it
+// without a round trip to us. The page is built under a temporary name and renamed into place,
+// so that a client never sees it half-built and clients of a previous daemon keep their own copy.
+static void create_shm(const char* homedir) {
+
+  uint32_t nslots = 1;
+  while(nslots < progs.size() * 2)
+    nslots *= 2;
+
+  std::string path = std::string(homedir) + "/.lliowd-shm";
+  std::string temppath = path + ".tmp";
+  unlink(temppath.c_str());
+
+  int shmfd = open(temppath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if(shmfd == -1) {
+
+    cerr << "Failed to create " << temppath << "; clients will use the socket\n";
+    return;
+
+  }
+
+  shm_size = sizeof(struct lliowd_shm_header) + nslots * sizeof(struct lliowd_shm_slot);
+  void* map = MAP_FAILED;
+  if(ftruncate(shmfd, shm_size) == 0)
+    map = mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+
+  // Clients take the exclusive lock as a sign the page is being kept up to date.
+  // Keep shmfd open for as long as we run to hold it.
+  if(map == MAP_FAILED || flock(shmfd, LOCK_EX | LOCK_NB) == -1) {
+
+    cerr << "Failed to map " << temppath << "; clients will use the socket\n";
+    if(map != MAP_FAILED)
+      munmap(map, shm_size);
+    close(shmfd);
+    unlink(temppath.c_str());
+    return;
+
+  }
+
+  shm_header = (struct lliowd_shm_header*)map;
+  struct lliowd_shm_slot* slots = lliowd_shm_slots(shm_header);
+  prog_slots.resize(progs.size(), 0);
+
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i) {
+
+    // Clients with names too long to fit fall back to the socket.
+    const std::string& name = progs[i].binary_name;
+    if(name.size() >= LLIOWD_SHM_NAME_MAX)
+      continue;
+
+    uint32_t idx = lliowd_shm_hash(name.c_str()) % nslots;
+    while(slots[idx].name[0] && strcmp(slots[idx].name, name.c_str()))
+      idx = (idx + 1) % nslots;
+
+    // Duplicate config entries: the last one wins, as for findprog.
+    strcpy(slots[idx].name, name.c_str());
+    slots[idx].state = progs[i].watch_fd == -1 ? 0 : 1;
+    prog_slots[i] = &slots[idx];
+
+  }
+
+  shm_header->nslots = nslots;
+  shm_header->version = LLIOWD_SHM_VERSION;
+  __atomic_store_n(&shm_header->magic, LLIOWD_SHM_MAGIC, __ATOMIC_RELEASE);
+
+  if(rename(temppath.c_str(), path.c_str()) == -1)
+    cerr << "Failed to rename " << temppath << "; clients will use the socket\n";
+
+  signal(SIGTERM, invalidate_all_and_exit);
+  signal(SIGINT, invalidate_all_and_exit);
+  signal(SIGHUP, invalidate_all_and_exit);
+
+}
+
+// Something happened to prog's files: stop vouching for them. Signalling the old handle tells
+// the clients holding it; new clients are told the files are bad until we re-validate them.
+static void invalidate_prog(size_t prog_idx) {
+
+  struct spec_program& prog = progs[prog_idx];
+
+  cout << "Files changed for " << prog.binary_name << "\n";
+
+  if(struct lliowd_shm_slot* slot = prog_slot(prog_idx))
+    invalidate_slot(slot);
+
+  uint64_t one = 1;
+  if(write(prog.watch_fd, &one, sizeof(one)) != sizeof(one))
+    cerr << "Failed to signal clients of " << prog.binary_name << "\n";
+  close(prog.watch_fd);
+  prog.watch_fd = -1;
+
+}
+
+// Re-hash prog's files now they have settled, and publish a new generation if they match again.
+static void revalidate_prog(size_t prog_idx) {
+
+  struct spec_program& prog = progs[prog_idx];
+
+  validate_prog(prog, false);
+  if(prog.watch_fd == -1)
+    return;
+
+  cout << "Files restored for " << prog.binary_name << "\n";
+  if(struct lliowd_shm_slot* slot = prog_slot(prog_idx))
+    revalidate_slot(slot);
+
+}
+
+// Fan the events queued on our inotify handle out to the programs watching each file.
+static void read_file_events() {
+
+  char eventbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t nread;
+  uint64_t now = now_ms();
+
+  while((nread = read(inotify_fd, eventbuf, sizeof(eventbuf))) > 0) {
+
+    for(char* p = eventbuf; p < eventbuf + nread; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+
+      struct inotify_event* ev = (struct inotify_event*)p;
+      std::unordered_map<int, std::vector<size_t> >::iterator findit = files_by_wd.find(ev->wd);
+      if(findit == files_by_wd.end())
+	continue;
+
+      for(std::vector<size_t>::iterator fit = findit->second.begin(), fitend = findit->second.end(); fit != fitend; ++fit) {
+
+	std::vector<size_t>& fileprogs = files[*fit].progs;
+	for(std::vector<size_t>::iterator pit = fileprogs.begin(), pitend = fileprogs.end(); pit != pitend; ++pit) {
+
+	  if(progs[*pit].watch_fd != -1)
+	    invalidate_prog(*pit);
+	  progs[*pit].revalidate_at = now + debounce_ms;
+
+	}
+
+	// The watch is gone (the file was deleted or replaced); re-validation will add a new one.
+	if(ev->mask & IN_IGNORED)
+	  files[*fit].wd = -1;
+
       }
 
-      cout << "Verified " << fname << "\n";
+      if(ev->mask & IN_IGNORED)
+	files_by_wd.erase(findit);
 
     }
 
@@ -272,9 +934,26 @@ static void parse_config(const char* confname) {
 
 }
 
+// Milliseconds until the next program is due to be re-validated, for epoll_wait.
+static int next_timeout() {
+
+  uint64_t next = 0;
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i) {
+    if(progs[i].revalidate_at && (!next || progs[i].revalidate_at < next))
+      next = progs[i].revalidate_at;
+  }
+
+  if(!next)
+    return -1;
+
+  uint64_t now = now_ms();
+  return next <= now ? 0 : (int)(next - now);
+
+}
+
 static int createlistensock() {
 
-  int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if(listenfd == -1) {
 
     fprintf(stderr, "Socket\n");
@@ -309,7 +988,8 @@ static int createlistensock() {
 
   }
 
-  if(listen(listenfd, 5) == -1) {
+  // Specialised programs may start in bursts: allow the kernel to queue as many as it will.
+  if(listen(listenfd, SOMAXCONN) == -1) {
 
     fprintf(stderr, "Listen failed\n");
     exit(1);
@@ -323,102 +1003,124 @@ static int createlistensock() {
 int main(int argc, char** argv) {
 
   if(argc < 2) {
-    fprintf(stderr, "Usage: lliowd config_file\n");
+    fprintf(stderr, "Usage: lliowd config_file [digest_cache_file]\n");
     exit(1);
   }
 
+  if(argc >= 3) {
+    digest_cache_name = argv[2];
+    load_digest_cache();
+  }
+
   parse_config(argv[1]);
 
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(inotify_fd == -1) {
+
+    cerr << "Inotify open failed\n";
+    exit(1);
+
+  }
+
+  // Watch everything before hashing anything, to avoid a race.
+  for(size_t i = 0, ilim = files.size(); i != ilim; ++i)
+    watch_file(i);
+
+  hash_all_files();
+
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i)
+    validate_prog(progs[i], true);
+
+  index_progs();
+
   int listenfd = createlistensock();
 
-  while(1) {
+  create_shm(getenv("HOME"));
 
-    struct sockaddr_un otherend;
-    socklen_t otherendlen;
-    int connfd = accept(listenfd, (struct sockaddr*)&otherend, &otherendlen);
+  int epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if(epollfd == -1) {
 
-    if(connfd == -1) {
-      fprintf(stderr, "Accept failed\n");
-      continue;
-    }
+    fprintf(stderr, "epoll_create1 failed\n");
+    exit(1);
 
-    struct ucred otherendcreds;
-    socklen_t otherendcredslen = sizeof(struct ucred);
-    if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &otherendcreds, &otherendcredslen) == -1) {
+  }
 
-      fprintf(stderr, "getsockopt failed\n");
-      close(connfd);
-      continue;
+  struct epoll_event inotifyev;
+  inotifyev.events = EPOLLIN;
+  inotifyev.data.fd = inotify_fd;
+  if(epoll_ctl(epollfd, EPOLL_CTL_ADD, inotify_fd, &inotifyev) == -1) {
 
-    }
+    fprintf(stderr, "epoll_ctl failed\n");
+    exit(1);
 
-    char pathbuf[128];
-    sprintf(pathbuf, "/proc/%d/exe", otherendcreds.pid);
+  }
 
-    char exebuf[4096];
-    ssize_t rlret = readlink(pathbuf, exebuf, 4096);
-    if(rlret < 0 || rlret == 4096) {
+  struct epoll_event listenev;
+  listenev.events = EPOLLIN;
+  listenev.data.fd = listenfd;
+  if(epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &listenev) == -1) {
 
-      cerr << "Path name too long for " << pathbuf << "\n";
-      close(connfd);
-      continue;
+    fprintf(stderr, "epoll_ctl failed\n");
+    exit(1);
 
-    }
+  }
 
-    exebuf[rlret] = '\0';
+  while(1) {
 
-    struct spec_program* prog = findprog(exebuf);
-    if(!prog) {
+    struct epoll_event events[64];
+    int nevents = epoll_wait(epollfd, events, 64, next_timeout());
 
-      cerr << "No such program " << exebuf << "\n";
-      close(connfd);
+    if(nevents == -1) {
+      if(errno != EINTR)
+	fprintf(stderr, "epoll_wait failed\n");
       continue;
-
     }
 
-    if(prog->watch_fd == -1) {
+    for(int i = 0; i != nevents; ++i) {
 
-      // Couldn't verify this program's files
-      if(send(connfd, "\0", 1, MSG_NOSIGNAL) == -1)
-	cerr << "Write failed\n";
+      int fd = events[i].data.fd;
 
-    }
-    else {
+      if(fd == listenfd) {
 
-      // The program's files were good at startup, and hopefully remain so! Send the inotify handle:
-      struct msghdr hdr;
-      struct iovec data;
+	// Drain the accept queue.
+	int connfd;
+	while((connfd = accept4(listenfd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	  serve_client(epollfd, connfd);
 
-      char cmsgbuf[CMSG_SPACE(sizeof(int))];
+	if(errno != EAGAIN && errno != EWOULDBLOCK)
+	  fprintf(stderr, "Accept failed\n");
 
-      char dummy = '\x01';
-      data.iov_base = &dummy;
-      data.iov_len = sizeof(dummy);
+      }
+      else if(fd == inotify_fd) {
 
-      memset(&hdr, 0, sizeof(hdr));
-      hdr.msg_name = NULL;
-      hdr.msg_namelen = 0;
-      hdr.msg_iov = &data;
-      hdr.msg_iovlen = 1;
-      hdr.msg_flags = 0;
+	// Some programs' files changed, or are still changing: put off re-validating them.
+	read_file_events();
 
-      hdr.msg_control = cmsgbuf;
-      hdr.msg_controllen = CMSG_LEN(sizeof(int));
+      }
+      else {
 
-      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
-      cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
-      cmsg->cmsg_level = SOL_SOCKET;
-      cmsg->cmsg_type  = SCM_RIGHTS;
+	// A reply that didn't fit in the socket buffer first time around.
+	std::unordered_map<int, size_t>::iterator findit = pending_replies.find(fd);
+	if(findit == pending_replies.end())
+	  continue;
 
-      *(int*)CMSG_DATA(cmsg) = prog->watch_fd;
+	int watch_fd = progs[findit->second].watch_fd;
+	if(send_reply(fd, watch_fd) != REPLY_RETRY) {
+	  pending_replies.erase(findit);
+	  close(fd);
+	}
 
-      int n = sendmsg(connfd, &hdr, MSG_NOSIGNAL);
-      if(n == -1)
-	cerr << "sendmsg failed\n";
+      }
 
     }
 
-    close(connfd);
+    // Files shared by several programs due now are looked at once between them.
+    ++validation_round;
+    uint64_t now = now_ms();
+    for(size_t i = 0, ilim = progs.size(); i != ilim; ++i) {
+      if(progs[i].revalidate_at && progs[i].revalidate_at <= now)
+	revalidate_prog(i);
+    }
 
   }
 
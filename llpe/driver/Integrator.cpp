@@ -17,6 +17,11 @@
 #include <wx/sizer.h>
 #include <wx/dataview.h>
 #include <wx/bitmap.h>
+#include <wx/thread.h>
+#include <wx/msgqueue.h>
+
+#include <algorithm>
+#include <map>
 
 #include <errno.h>
 #include <string.h>
@@ -61,10 +66,35 @@ class IntegratorApp : public wxApp {
 
 static char workdir[] = "/tmp/integrator_XXXXXX";
 
+// Running dot is by far the slowest part of showing a context, so it happens on a pool
+// of worker threads and its results are kept for as long as the contexts' stats don't change.
+// The DOT itself must still be written on the GUI thread, as describeAsDOT reads analysis state.
+
+// A command for a worker: run 'command', then notify the frame quoting 'id'.
+// An empty command tells the worker to exit.
+struct DOTRenderJob {
+
+  std::string command;
+  uint32_t id;
+
+};
+
+struct DOTRender {
+
+  std::string pngpath;
+  uint32_t id;
+  bool ready;
+  bool failed;
+
+};
+
+typedef std::pair<IntegrationAttempt*, bool> DOTRenderKey;
+
 class IntegratorFrame: public wxFrame
 {
   
   IntegrationAttempt* currentIA;
+  IntegratorTag* currentTag;
   wxBitmap* currentBitmap;
   wxStaticBitmap* image;
   wxBoxSizer* imagePanelSizer;
@@ -74,12 +104,20 @@ class IntegratorFrame: public wxFrame
   IntegratorTag* searchLastIA;
   wxString searchLastString;
 
-  std::string dotpath;
-  std::string pngpath;
-  std::string dotcommand;
+  // Renders by (context, brief), and the keys of every job issued, indexed by job id.
+  std::map<DOTRenderKey, DOTRender> renders;
+  std::vector<DOTRenderKey> renderKeys;
+  std::vector<std::string> renderCommands;
+
+  wxMessageQueue<DOTRenderJob> renderQueue;
+  std::vector<wxThread*> renderThreads;
   
   bool brief;
 
+  DOTRender* requestRender(IntegrationAttempt*, bool brief);
+  void prefetchRenders(IntegratorTag*);
+  void showRender(DOTRender*);
+
 public:
 
   IntegratorFrame(const wxString& title, const wxPoint& pos, const wxSize& size);
@@ -90,8 +128,10 @@ public:
   void OnSelectionChanged(wxDataViewEvent&);
   void OnSearchFunctions(wxCommandEvent&);
   void OnSearchFunctionsNext(wxCommandEvent&);
+  void OnRenderDone(wxThreadEvent&);
 
   void redrawImage();
+  void invalidateRenders();
 
   DECLARE_EVENT_TABLE()
 
@@ -104,7 +144,40 @@ enum
   ID_SelectionChanged,
   ID_BriefToggle,
   ID_SearchFunctions,
-  ID_SearchFunctionsNext
+  ID_SearchFunctionsNext,
+  ID_RenderDone
+};
+
+class DOTRenderThread : public wxThread {
+
+  wxMessageQueue<DOTRenderJob>& queue;
+  wxEvtHandler* notify;
+
+public:
+
+  DOTRenderThread(wxMessageQueue<DOTRenderJob>& q, wxEvtHandler* n) : wxThread(wxTHREAD_JOINABLE), queue(q), notify(n) {}
+
+  virtual ExitCode Entry() {
+
+    while(1) {
+
+      DOTRenderJob job;
+      if(queue.Receive(job) != wxMSGQUEUE_NO_ERROR || job.command.empty())
+	break;
+
+      int ret = system(job.command.c_str());
+
+      wxThreadEvent* event = new wxThreadEvent(wxEVT_THREAD, ID_RenderDone);
+      event->SetInt(job.id);
+      event->SetExtraLong(ret);
+      wxQueueEvent(notify, event);
+
+    }
+
+    return 0;
+
+  }
+
 };
 
 BEGIN_EVENT_TABLE(IntegratorFrame, wxFrame)
@@ -114,6 +187,7 @@ BEGIN_EVENT_TABLE(IntegratorFrame, wxFrame)
   EVT_MENU(ID_SearchFunctions, IntegratorFrame::OnSearchFunctions)
   EVT_MENU(ID_SearchFunctionsNext, IntegratorFrame::OnSearchFunctionsNext)
   EVT_DATAVIEW_SELECTION_CHANGED(ID_TreeView, IntegratorFrame::OnSelectionChanged)
+  EVT_THREAD(ID_RenderDone, IntegratorFrame::OnRenderDone)
 END_EVENT_TABLE()
 
 bool IntegratorApp::OnInit() {
@@ -261,15 +335,6 @@ public:
 
   }
 
-  void notifyStatsChanged(IntegratorTag* Tag) {
-    
-    ValueChanged(wxDataViewItem((void*)Tag), 2);
-
-    for(std::vector<IntegratorTag*>::iterator it = Tag->children.begin(), itend = Tag->children.end(); it != itend; ++it)
-      notifyStatsChanged(*it);
-
-  }
-
   bool SetValue(const wxVariant& val, const wxDataViewItem& item, unsigned int column) {
 
     if(column != 3)
@@ -311,9 +376,11 @@ public:
       ItemsDeleted(item, changed);
     */
 
-    // All other contexts will have recalculated their stats too.
-    notifyStatsChanged(RootTag);
+    // Only the toggled context and its ancestors' totals have changed.
+    for(IntegratorTag* it = tag; it; it = it->parent)
+      ValueChanged(wxDataViewItem((void*)it), 2);
 
+    Parent->invalidateRenders();
     Parent->redrawImage();
 
     return true;
@@ -394,24 +461,33 @@ public:
 };
 
 IntegratorFrame::IntegratorFrame(const wxString& title, const wxPoint& pos, const wxSize& size)
-  : wxFrame(NULL, -1, title, pos, size), currentIA(0), brief(true) {
+  : wxFrame(NULL, -1, title, pos, size), currentIA(0), currentTag(0), brief(true) {
 
   if(!mkdtemp(workdir)) {
     errs() << "Failed to create a temporary directory: " << strerror(errno) << "\n";
     exit(1);
   }
 
-  {
-    raw_string_ostream ROS(dotpath);
-    ROS << workdir << "/out.dot";
-  }
-  {
-    raw_string_ostream ROS(pngpath);
-    ROS << workdir << "/out.png";
+  int nThreads = wxThread::GetCPUCount();
+  if(nThreads < 1)
+    nThreads = 1;
+  else if(nThreads > 4)
+    nThreads = 4;
+
+  for(int i = 0; i != nThreads; ++i) {
+
+    wxThread* T = new DOTRenderThread(renderQueue, this);
+    if(T->Run() != wxTHREAD_NO_ERROR) {
+      delete T;
+      break;
+    }
+    renderThreads.push_back(T);
+
   }
-  {
-    raw_string_ostream ROS(dotcommand);
-    ROS << "dot " << dotpath << " -o " << pngpath << " -Tpng";
+
+  if(renderThreads.empty()) {
+    errs() << "Failed to start any DOT rendering threads\n";
+    exit(1);
   }
 
   searchLastString = "";
@@ -492,64 +568,158 @@ void IntegratorFrame::OnBriefToggle(wxCommandEvent& WXUNUSED(event)) {
 
 void IntegratorFrame::OnClose(wxCloseEvent& WXUNUSED(event)) {
 
-  std::string command;
-  raw_string_ostream ROS(command);
-  ROS << "rm -rf " << workdir;
-  ROS.flush();
+  // Stop the workers before deleting the files they might be writing.
+  for(uint32_t i = 0, ilim = renderThreads.size(); i != ilim; ++i) {
+    DOTRenderJob stop;
+    stop.id = 0;
+    renderQueue.Post(stop);
+  }
 
-  if(system(command.c_str()) != 0) {
+  for(uint32_t i = 0, ilim = renderThreads.size(); i != ilim; ++i) {
+    renderThreads[i]->Wait();
+    delete renderThreads[i];
+  }
 
-    errs() << "Warning: failed to delete " << workdir << "\n";
+  renderThreads.clear();
 
-  }
+  if(sys::fs::remove_directories(workdir))
+    errs() << "Warning: failed to delete " << workdir << "\n";
 
   Destroy();
 
 }
 
-void IntegratorFrame::redrawImage() {
+// Find or start a rendering of IA. The result is only usable once 'ready' is set.
+DOTRender* IntegratorFrame::requestRender(IntegrationAttempt* IA, bool brief) {
 
-  if(!currentIA)
-    return;
+  DOTRenderKey key = std::make_pair(IA, brief);
+  std::map<DOTRenderKey, DOTRender>::iterator findit = renders.find(key);
+  if(findit != renders.end())
+    return &findit->second;
 
-  delete currentBitmap;
-  currentBitmap = 0;
+  uint32_t id = renderKeys.size();
+  renderKeys.push_back(key);
+
+  DOTRender& R = renders[key];
+  R.id = id;
+  R.ready = false;
+  R.failed = false;
+
+  std::string dotpath;
+  {
+    raw_string_ostream ROS(R.pngpath);
+    ROS << workdir << "/render" << id << ".png";
+    raw_string_ostream ROS2(dotpath);
+    ROS2 << workdir << "/render" << id << ".dot";
+  }
 
   std::error_code error;
   std::string otherpath;
-  raw_fd_ostream RFO(dotpath.c_str(), error, sys::fs::F_None);
-  currentIA->describeAsDOT(RFO, otherpath, brief);
-  RFO.close();
+  {
+    raw_fd_ostream RFO(dotpath.c_str(), error, sys::fs::F_None);
+    if(!error)
+      IA->describeAsDOT(RFO, otherpath, brief);
+  }
 
   if(error) {
 
     errs() << "Failed to open " << dotpath << ": " << error.message() << "\n";
+    R.ready = true;
+    R.failed = true;
+    renderCommands.push_back(std::string());
+    return &R;
 
   }
-  else {
 
-    std::string thiscmd;
-    if(otherpath.size()) {
-      raw_string_ostream RSO(thiscmd);
-      RSO << "dot " << otherpath << " -o " << pngpath << " -Tpng";
-    }
-    else {
-      thiscmd = dotcommand;
-    }
+  // Committed contexts refer to the DOT saved before they were committed.
+  DOTRenderJob job;
+  {
+    raw_string_ostream RSO(job.command);
+    RSO << "dot " << (otherpath.size() ? otherpath : dotpath) << " -o " << R.pngpath << " -Tpng";
+  }
+  job.id = id;
+  renderCommands.push_back(job.command);
 
-    if(int ret = system(thiscmd.c_str()) != 0) {
+  renderQueue.Post(job);
+  return &R;
 
-      errs() << "Failed to run '" << thiscmd << "' (returned " << ret << ")\n";
-	
-    }
-    else {
+}
 
-      currentBitmap = new wxBitmap(_(pngpath), wxBITMAP_TYPE_PNG);
+// Enabling or disabling any context changes every context's stats, so any existing
+// render might be stale. Jobs already queued still run, but their results are ignored.
+void IntegratorFrame::invalidateRenders() {
+
+  renders.clear();
+
+}
+
+// Queue renders of the contexts the user is likely to look at next:
+// the parent context, neighbouring siblings and the first few children.
+// Loop tags have no picture of their own, so look through them to their iterations.
+static void addPrefetchTags(IntegratorTag* tag, std::vector<IntegratorTag*>& out, uint32_t limit) {
+
+  if(!tag || out.size() >= limit)
+    return;
+
+  if(tag->type == IntegratorTypeIA) {
+    out.push_back(tag);
+    return;
+  }
+
+  for(std::vector<IntegratorTag*>::iterator it = tag->children.begin(),
+	itend = tag->children.end(); it != itend && out.size() < limit; ++it) {
+
+    if((*it)->type == IntegratorTypeIA)
+      out.push_back(*it);
+
+  }
+
+}
+
+void IntegratorFrame::prefetchRenders(IntegratorTag* tag) {
+
+  std::vector<IntegratorTag*> toRender;
+
+  IntegratorTag* parent = tag->parent;
+  if(parent && parent->type == IntegratorTypePA)
+    parent = parent->parent;
+  addPrefetchTags(parent, toRender, 1);
+
+  if(tag->parent) {
+
+    std::vector<IntegratorTag*>& siblings = tag->parent->children;
+    std::vector<IntegratorTag*>::iterator findit = std::find(siblings.begin(), siblings.end(), tag);
+    if(findit != siblings.end()) {
+
+      if(findit != siblings.begin())
+	addPrefetchTags(*(findit - 1), toRender, 3);
+      if(findit + 1 != siblings.end())
+	addPrefetchTags(*(findit + 1), toRender, 3);
 
     }
 
   }
 
+  for(std::vector<IntegratorTag*>::iterator it = tag->children.begin(),
+	itend = tag->children.end(); it != itend && toRender.size() < 6; ++it) {
+
+    addPrefetchTags(*it, toRender, 6);
+
+  }
+
+  for(std::vector<IntegratorTag*>::iterator it = toRender.begin(), itend = toRender.end(); it != itend; ++it)
+    requestRender((IntegrationAttempt*)(*it)->ptr, brief);
+
+}
+
+void IntegratorFrame::showRender(DOTRender* R) {
+
+  delete currentBitmap;
+  currentBitmap = 0;
+
+  if(R && !R->failed)
+    currentBitmap = new wxBitmap(_(R->pngpath), wxBITMAP_TYPE_PNG);
+
   if(!currentBitmap)
     currentBitmap = new wxBitmap(1, 1);
 
@@ -558,6 +728,50 @@ void IntegratorFrame::redrawImage() {
 
 }
 
+void IntegratorFrame::redrawImage() {
+
+  if(!currentIA)
+    return;
+
+  DOTRender* R = requestRender(currentIA, brief);
+
+  // If it isn't ready yet, show nothing; OnRenderDone will draw it when it is.
+  showRender(R->ready ? R : 0);
+
+  if(currentTag)
+    prefetchRenders(currentTag);
+
+}
+
+void IntegratorFrame::OnRenderDone(wxThreadEvent& event) {
+
+  uint32_t id = event.GetInt();
+  long ret = event.GetExtraLong();
+
+  if(id >= renderKeys.size())
+    return;
+
+  std::map<DOTRenderKey, DOTRender>::iterator findit = renders.find(renderKeys[id]);
+
+  // Superseded by invalidateRenders?
+  if(findit == renders.end() || findit->second.id != id)
+    return;
+
+  DOTRender& R = findit->second;
+  R.ready = true;
+
+  if(ret != 0) {
+
+    errs() << "Failed to run '" << renderCommands[id] << "' (returned " << ret << ")\n";
+    R.failed = true;
+
+  }
+
+  if(renderKeys[id].first == currentIA && renderKeys[id].second == brief)
+    showRender(&R);
+
+}
+
 void IntegratorFrame::OnSelectionChanged(wxDataViewEvent& event) {
 
   wxDataViewItem item = event.GetItem();
@@ -566,6 +780,7 @@ void IntegratorFrame::OnSelectionChanged(wxDataViewEvent& event) {
   if(tag && tag->type == IntegratorTypeIA) {
 
     currentIA = (IntegrationAttempt*)(tag->ptr);
+    currentTag = tag;
     redrawImage();
 
   }
@@ -580,7 +795,7 @@ void IntegratorFrame::OnSearchFunctionsNext(wxCommandEvent& event) {
     searchLastIA = IHP->getRootTag();
 
   std::string stdSearchString(searchLastString.mb_str());
-  IntegratorTag* IA = searchFunctions(IHP->getRootTag(), stdSearchString, searchLastIA);
+  IntegratorTag* IA = IHP->searchTags(stdSearchString, searchLastIA);
 
   if(IA) {
     wxDataViewItem key((void*)IA);
@@ -608,6 +823,9 @@ bool LLPEPass::runOnModule(Module& M) {
 
   IHP = &getAnalysis<LLPEAnalysisPass>();
 
+  if(IHP->batchMode)
+    return false;
+
   if(!AcceptAllInt) {
   
     int argc = 0;
@@ -624,6 +842,9 @@ bool LLPEPass::runOnModule(Module& M) {
 
   IHP->commit();
 
+  if(!IHP->fastExitOutput.empty())
+    IHP->fastExit(M);
+
   return false;
 
 }
@@ -0,0 +1,413 @@
+// llpe-driver: run the whole specialisation pipeline in one process. The pre-passes that prepare a program
+// for LLPE (see scripts/prepare-int.sh), the LLPE pass itself and the cleanup passes that follow it are
+// scheduled through a single pass manager over one in-memory module, so the module is only parsed and
+// written once per job where chaining opt invocations would round-trip the bitcode through each step.
+//
+// With -llpe-cache-dir, finished jobs are also cached, like ccache: a job is keyed by a digest of its input
+// bitcode, its options and the LLPE modules' identity. Its output and stats are stored along with digests
+// of the files it depended on, taken from LLPE's input manifest (-llpe-write-input-manifest).
+// A later job with the same key whose dependencies are unchanged copies the stored results instead of running.
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeWriterPass.h"
+#include "llvm/IR/IRPrintingPasses.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::init("-"));
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"), cl::value_desc("filename"), cl::init("-"));
+static cl::opt<bool> OutputAssembly("S", cl::desc("Write LLVM assembly rather than bitcode"));
+static cl::opt<bool> NoVerify("disable-verify", cl::desc("Don't verify the specialised module"));
+static cl::opt<std::string> CacheDir("llpe-cache-dir", cl::desc("Reuse and store finished jobs' results here"), cl::value_desc("directory"));
+
+// The defaults follow scripts/prepare-int.sh: rotate loops so they can be peeled, clean up the
+// results of rotation, then put loops in the canonical form LLPE analyses.
+static cl::list<std::string> PrePasses("llpe-pre-passes", cl::CommaSeparated, cl::desc("Passes run before LLPE"));
+static cl::opt<bool> SkipPrePasses("llpe-prepared", cl::desc("The input has already been prepared: run no pre-passes"));
+// Function bodies are then read from the bitcode only as LLPE reaches them. Pre-passes would read them all.
+static cl::opt<bool> LazyLoad("llpe-lazy-load", cl::desc("Read function bodies on demand (requires -llpe-prepared)"));
+// LLPE leaves a lot of empty blocks lying about.
+static cl::list<std::string> PostPasses("llpe-post-passes", cl::CommaSeparated, cl::desc("Passes run after LLPE"));
+
+static const char* DefaultPrePasses[] = { "functionattrs", "mergereturn", "loop-rotate", "instcombine", "jump-threading",
+					  "simplifycfg", "globalopt", "loop-simplify", "lcssa", 0 };
+static const char* DefaultPostPasses[] = { "jump-threading", 0 };
+
+// The LLPE modules, unless -load names others. Set by CMake to the libraries built alongside this tool.
+#ifndef LLPE_MAIN_LIB
+#define LLPE_MAIN_LIB "LLVMLLPEMain.so"
+#endif
+#ifndef LLPE_DRIVER_LIB
+#define LLPE_DRIVER_LIB "LLVMLLPEDriver.so"
+#endif
+
+// The LLPE modules register their passes and options on load, so they must be loaded before
+// the command line is parsed. Loading them again via -load is harmless.
+static void loadLLPEModule(const char* Path) {
+
+  std::string Err;
+  if(sys::DynamicLibrary::LoadLibraryPermanently(Path, &Err)) {
+    errs() << "Failed to load " << Path << ": " << Err << "\n";
+    exit(1);
+  }
+
+}
+
+static void addPassByName(legacy::PassManager& PM, StringRef Name) {
+
+  const PassInfo* PI = PassRegistry::getPassRegistry()->getPassInfo(Name);
+  if((!PI) || !PI->getNormalCtor()) {
+    errs() << "No such pass: " << Name << "\n";
+    exit(1);
+  }
+
+  PM.add(PI->createPass());
+
+}
+
+static void addPasses(legacy::PassManager& PM, cl::list<std::string>& Names, const char** Defaults) {
+
+  if(Names.empty()) {
+    for(uint32_t i = 0; Defaults[i]; ++i)
+      addPassByName(PM, Defaults[i]);
+  }
+  else {
+    for(cl::list<std::string>::iterator it = Names.begin(), itend = Names.end(); it != itend; ++it)
+      addPassByName(PM, *it);
+  }
+
+}
+
+// Job cache (see top of file).
+
+static std::string digestToString(MD5& Hash) {
+
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  SmallString<32> Str;
+  MD5::stringifyResult(Result, Str);
+  return Str.str().str();
+
+}
+
+static std::string getFileMD5(const std::string& Path) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Buf = MemoryBuffer::getFile(Path);
+  if(!Buf)
+    return "missing";
+
+  MD5 Hash;
+  Hash.update((*Buf)->getBuffer());
+  return digestToString(Hash);
+
+}
+
+// Options that name where results go don't affect them.
+static bool isOutputArg(StringRef Arg, bool& takesNext) {
+
+  takesNext = (Arg == "-o" || Arg == "--o");
+  return takesNext || Arg.startswith("-o=") || Arg.startswith("--o=") || 
+    Arg.startswith("-llpe-cache-dir") || Arg.startswith("--llpe-cache-dir");
+
+}
+
+static void addLibraryIdentity(MD5& Hash, const char* Path) {
+
+  Hash.update(StringRef(Path));
+  sys::fs::file_status Status;
+  if(!sys::fs::status(Path, Status)) {
+    std::string Id = utostr(Status.getSize()) + " " + utostr(Status.getLastModificationTime().time_since_epoch().count());
+    Hash.update(StringRef(Id));
+  }
+
+}
+
+static std::string getJobKey(int argc, char** argv, MemoryBuffer& Input) {
+
+  MD5 Hash;
+  Hash.update(StringRef("llpe-job-1"));
+  Hash.update(Input.getBuffer());
+
+  for(int i = 1; i < argc; ++i) {
+
+    StringRef Arg(argv[i]);
+    bool takesNext;
+    if(isOutputArg(Arg, takesNext)) {
+      if(takesNext)
+	++i;
+      continue;
+    }
+    // The input is identified by its contents, not its name.
+    if(Arg == InputFilename)
+      continue;
+
+    Hash.update(Arg);
+    Hash.update(StringRef("\0", 1));
+
+  }
+
+  if(!getenv("LLPE_NO_DEFAULT_MODULES")) {
+    addLibraryIdentity(Hash, LLPE_MAIN_LIB);
+    addLibraryIdentity(Hash, LLPE_DRIVER_LIB);
+  }
+
+  return digestToString(Hash);
+
+}
+
+static bool copyFile(const std::string& From, const std::string& To) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Buf = MemoryBuffer::getFile(From);
+  if(!Buf)
+    return false;
+
+  std::error_code EC;
+  raw_fd_ostream Out(To, EC, sys::fs::F_None);
+  if(EC)
+    return false;
+  Out << (*Buf)->getBuffer();
+  return true;
+
+}
+
+// Write Data to Path via a temporary, so concurrent jobs never see part of an entry.
+static bool writeCacheFile(const std::string& Path, StringRef Data) {
+
+  std::string Temp = Path + ".tmp" + utostr(sys::Process::getProcessId());
+  {
+    std::error_code EC;
+    raw_fd_ostream Out(Temp, EC, sys::fs::F_None);
+    if(EC)
+      return false;
+    Out << Data;
+  }
+  return !sys::fs::rename(Temp, Path);
+
+}
+
+static const char* StatsSuffixes[] = { "", ".json", ".contexts.json", 0 };
+
+// If the job keyed Key is cached and its dependencies are unchanged, write its output to Out and its
+// stats to StatsFile (if any) and return true.
+static bool tryCacheHit(const std::string& Key, raw_ostream& Out, const std::string& StatsFile) {
+
+  std::string Entry = CacheDir + "/" + Key;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Deps = MemoryBuffer::getFile(Entry + ".deps");
+  if(!Deps)
+    return false;
+
+  SmallVector<StringRef, 16> Lines;
+  (*Deps)->getBuffer().split(Lines, '\n', -1, false);
+  for(uint32_t i = 0, ilim = Lines.size(); i != ilim; ++i) {
+
+    std::pair<StringRef, StringRef> DigestAndPath = Lines[i].split(' ');
+    if(getFileMD5(DigestAndPath.second.str()) != DigestAndPath.first)
+      return false;
+
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Output = MemoryBuffer::getFile(Entry + ".out");
+  if(!Output)
+    return false;
+
+  if(!StatsFile.empty()) {
+    for(uint32_t i = 0; StatsSuffixes[i]; ++i)
+      copyFile(Entry + ".stats" + StatsSuffixes[i], StatsFile + StatsSuffixes[i]);
+  }
+
+  Out << (*Output)->getBuffer();
+  return true;
+
+}
+
+// Store a finished job's output, stats and dependencies, the latter read from its input manifest.
+static void storeCacheEntry(const std::string& Key, StringRef Output, const std::string& StatsFile, const std::string& ManifestFile) {
+
+  std::string Entry = CacheDir + "/" + Key;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Manifest = MemoryBuffer::getFile(ManifestFile);
+  if(!Manifest) {
+    errs() << "Warning: no input manifest written; not caching this job\n";
+    return;
+  }
+
+  std::string Deps;
+  SmallVector<StringRef, 16> Lines;
+  (*Manifest)->getBuffer().split(Lines, '\n', -1, false);
+  for(uint32_t i = 0, ilim = Lines.size(); i != ilim; ++i) {
+
+    // input-file and read-file lines are "kind path digest".
+    std::pair<StringRef, StringRef> KindAndRest = Lines[i].split(' ');
+    if(KindAndRest.first != "input-file" && KindAndRest.first != "read-file")
+      continue;
+
+    std::string Path = KindAndRest.second.rsplit(' ').first.str();
+    Deps += getFileMD5(Path) + " " + Path + "\n";
+
+  }
+
+  if(!writeCacheFile(Entry + ".out", Output)) {
+    errs() << "Warning: failed to write to cache directory " << CacheDir << "\n";
+    return;
+  }
+
+  if(!StatsFile.empty()) {
+    for(uint32_t i = 0; StatsSuffixes[i]; ++i) {
+      ErrorOr<std::unique_ptr<MemoryBuffer> > Stats = MemoryBuffer::getFile(StatsFile + StatsSuffixes[i]);
+      if(Stats)
+	writeCacheFile(Entry + ".stats" + StatsSuffixes[i], (*Stats)->getBuffer());
+    }
+  }
+
+  // Written last: its presence marks the entry complete.
+  writeCacheFile(Entry + ".deps", Deps);
+
+}
+
+// Get the value of string option Name, registered by the LLPE modules, or null if there's no such option.
+static cl::opt<std::string>* getLLPEStringOption(StringRef Name) {
+
+  return static_cast<cl::opt<std::string>*>(cl::getRegisteredOptions().lookup(Name));
+
+}
+
+int main(int argc, char** argv) {
+
+  PassRegistry& Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+  initializeScalarOpts(Registry);
+  initializeInstCombine(Registry);
+  initializeIPO(Registry);
+
+  if(!getenv("LLPE_NO_DEFAULT_MODULES")) {
+    loadLLPEModule(LLPE_MAIN_LIB);
+    loadLLPEModule(LLPE_DRIVER_LIB);
+  }
+
+  cl::ParseCommandLineOptions(argc, argv, "LLPE whole-pipeline driver\n");
+
+  if(LazyLoad && !SkipPrePasses) {
+    errs() << "-llpe-lazy-load requires -llpe-prepared\n";
+    return 1;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Input = MemoryBuffer::getFileOrSTDIN(InputFilename);
+  if(!Input) {
+    errs() << "Failed to read " << InputFilename << ": " << Input.getError().message() << "\n";
+    return 1;
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::F_None);
+  if(EC) {
+    errs() << "Failed to open " << OutputFilename << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  std::string JobKey, StatsFile, ManifestFile;
+  bool tempManifest = false;
+  if(!CacheDir.empty()) {
+
+    cl::opt<std::string>* StatsOpt = getLLPEStringOption("llpe-stats-file");
+    cl::opt<std::string>* ManifestOpt = getLLPEStringOption("llpe-write-input-manifest");
+    if(!ManifestOpt) {
+      errs() << "LLPE modules not loaded: -llpe-cache-dir can't be used\n";
+      return 1;
+    }
+
+    JobKey = getJobKey(argc, argv, **Input);
+    if(StatsOpt)
+      StatsFile = *StatsOpt;
+
+    if(tryCacheHit(JobKey, Out.os(), StatsFile)) {
+      Out.keep();
+      return 0;
+    }
+
+    // LLPE records the job's dependencies in its input manifest.
+    ManifestFile = *ManifestOpt;
+    if(ManifestFile.empty()) {
+      ManifestFile = CacheDir + "/" + JobKey + ".manifest" + utostr(sys::Process::getProcessId());
+      *ManifestOpt = ManifestFile;
+      tempManifest = true;
+    }
+
+  }
+
+  LLVMContext Context;
+  SMDiagnostic Diag;
+  // LLPE reads everything left unread once it finishes, before the post-passes run.
+  std::unique_ptr<Module> M = LazyLoad ? getLazyIRModule(std::move(*Input), Diag, Context) :
+    parseIR((*Input)->getMemBufferRef(), Diag, Context);
+  if(!M) {
+    Diag.print(argv[0], errs());
+    return 1;
+  }
+
+  // When caching, collect the output to store it as well.
+  std::string OutputData;
+  raw_string_ostream OutputStream(OutputData);
+  raw_ostream& OS = CacheDir.empty() ? static_cast<raw_ostream&>(Out.os()) : OutputStream;
+
+  legacy::PassManager PM;
+  PM.add(new TargetLibraryInfoWrapperPass(TargetLibraryInfoImpl(Triple(M->getTargetTriple()))));
+
+  if(!SkipPrePasses)
+    addPasses(PM, PrePasses, DefaultPrePasses);
+  addPassByName(PM, "llpe");
+  addPasses(PM, PostPasses, DefaultPostPasses);
+
+  if(!NoVerify)
+    PM.add(createVerifierPass());
+
+  if(OutputAssembly)
+    PM.add(createPrintModulePass(OS));
+  else
+    PM.add(createBitcodeWriterPass(OS));
+
+  PM.run(*M);
+
+  if(!CacheDir.empty()) {
+
+    OutputStream.flush();
+    Out.os() << OutputData;
+    storeCacheEntry(JobKey, OutputData, StatsFile, ManifestFile);
+    if(tempManifest)
+      sys::fs::remove(ManifestFile);
+
+  }
+
+  Out.keep();
+
+  return 0;
+
+}
@@ -36,15 +36,20 @@
 #include "llvm/Support/RecyclingAllocator.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 
+#include <atomic>
 #include <limits.h>
+#include <list>
+#include <map>
+#include <new>
 #include <string>
 #include <vector>
 
+#include <sys/stat.h>
+
 #define LPDEBUG(x) LLVM_DEBUG(do { printDebugHeader(dbgs()); dbgs() << ": " << x; } while(0))
 
 namespace llvm {
 
-class AAResults;
 class PHINode;
 class NonLocalDepResult;
 class LoadInst;
@@ -60,6 +65,7 @@ class CmpInst;
 class InlineAttempt;
 class PeelAttempt;
 class LLPEAnalysisPass;
+struct DOTTreeWriter;
 class Function;
 class DataLayout;
 class Loop;
@@ -81,12 +87,13 @@ class ShadowLoopInvar;
 class TargetLibraryInfo;
 class ShadowBB;
 class TrackedStore;
+struct ConstantImage;
+struct FileSnapshot;
+class MemoryBuffer;
+struct LibrarySummary;
+struct LibrarySummaryInfo;
 
-#ifndef LLVM_EFFICIENT_PRINTING
-class PersistPrinter { };
-#else
-class PersistPrinter; // Opaque here, defined in AsmWriter
-#endif
+class PersistPrinter; // Opaque here, defined in Print.cpp
 
 inline void release_assert_fail(const char* str) {
 
@@ -98,7 +105,6 @@ inline void release_assert_fail(const char* str) {
 #define release_assert(x) if(!(x)) { release_assert_fail(#x); }
 
 extern const DataLayout* GlobalTD;
-extern AAResults* GlobalAA;
 extern TargetLibraryInfo* GlobalTLI;
 extern LLPEAnalysisPass* GlobalIHP;
 
@@ -200,6 +206,41 @@ struct SpecialLocationDescriptor {
 
 };
 
+// Lookup tables over one vector of path conditions, so that queries about a particular value
+// or block needn't scan every condition. Entries are positions in the vector, in order.
+struct PathConditionIndex {
+
+  typedef std::pair<uint32_t, BasicBlock*> BlockKey;
+  typedef std::pair<BlockKey, uint32_t> InstKey;
+  typedef SmallVector<uint32_t, 1> Entries;
+
+  // Keyed by (instStackIdx, instBB, instIdx) and (fromStackIdx, fromBB) respectively.
+  DenseMap<InstKey, Entries> byInst;
+  DenseMap<BlockKey, Entries> byFromBlock;
+
+  void add(const PathCondition& C, uint32_t idx) {
+
+    byInst[std::make_pair(std::make_pair(C.instStackIdx, C.instBB), C.instIdx)].push_back(idx);
+    byFromBlock[std::make_pair(C.fromStackIdx, C.fromBB)].push_back(idx);
+
+  }
+
+  const Entries* findInst(uint32_t stackIdx, BasicBlock* BB, uint32_t instIdx) const {
+
+    DenseMap<InstKey, Entries>::const_iterator it = byInst.find(std::make_pair(std::make_pair(stackIdx, BB), instIdx));
+    return it == byInst.end() ? 0 : &it->second;
+
+  }
+
+  const Entries* findFromBlock(uint32_t stackIdx, BasicBlock* BB) const {
+
+    DenseMap<BlockKey, Entries>::const_iterator it = byFromBlock.find(std::make_pair(stackIdx, BB));
+    return it == byFromBlock.end() ? 0 : &it->second;
+
+  }
+
+};
+
 struct PathConditions {
 
   std::vector<PathCondition> IntPathConditions;
@@ -209,6 +250,67 @@ struct PathConditions {
   std::vector<PathCondition> StreamPathConditions;
   std::vector<PathFunc> FuncPathConditions;
 
+  PathConditionIndex IntIndex;
+  PathConditionIndex AsDefIntIndex;
+  PathConditionIndex StringIndex;
+  PathConditionIndex IntmemIndex;
+  PathConditionIndex StreamIndex;
+  // Positions in FuncPathConditions, keyed by (stackIdx, BB).
+  DenseMap<PathConditionIndex::BlockKey, PathConditionIndex::Entries> FuncIndex;
+
+  PathFunc& addFunc(const PathFunc& newFunc) {
+
+    FuncIndex[std::make_pair(newFunc.stackIdx, newFunc.BB)].push_back(FuncPathConditions.size());
+    FuncPathConditions.push_back(newFunc);
+    return FuncPathConditions.back();
+
+  }
+
+  const PathConditionIndex::Entries* findFuncsAt(uint32_t stackIdx, BasicBlock* BB) const {
+
+    DenseMap<PathConditionIndex::BlockKey, PathConditionIndex::Entries>::const_iterator it = FuncIndex.find(std::make_pair(stackIdx, BB));
+    return it == FuncIndex.end() ? 0 : &it->second;
+
+  }
+
+  // Can the verifiers of several function path conditions at one block be combined into one call?
+  bool funcsBatchable(const PathConditionIndex::Entries& Funcs) const {
+
+    if(Funcs.size() < 2)
+      return false;
+
+    for(PathConditionIndex::Entries::const_iterator it = Funcs.begin(), itend = Funcs.end(); it != itend; ++it) {
+
+      const PathFunc& PF = FuncPathConditions[*it];
+      FunctionType* FT = PF.VerifyF->getFunctionType();
+      if(FT->isVarArg() || FT->getNumParams() != PF.args.size() || !FT->getReturnType()->isIntegerTy())
+	return false;
+
+    }
+
+    return true;
+
+  }
+
+  // The number of checks the function path conditions at BB take: with batch set, one if they can be combined.
+  uint32_t countFuncsAt(uint32_t stackIdx, BasicBlock* BB, bool batch) const {
+
+    const PathConditionIndex::Entries* Funcs = findFuncsAt(stackIdx, BB);
+    if(!Funcs)
+      return 0;
+    if(batch && funcsBatchable(*Funcs))
+      return 1;
+    return Funcs->size();
+
+  }
+
+  static void addTo(std::vector<PathCondition>& Conds, PathConditionIndex& Index, PathCondition& newCond) {
+
+    Index.add(newCond, Conds.size());
+    Conds.push_back(newCond);
+
+  }
+
   void addForType(PathCondition newCond, PathConditionTypes Ty) {
 
     switch(Ty) {
@@ -217,21 +319,21 @@ struct PathConditions {
       {
 	if(newCond.instStackIdx == newCond.fromStackIdx &&
 	   newCond.instBB == newCond.fromBB) {
-	  AsDefIntPathConditions.push_back(newCond);
+	  addTo(AsDefIntPathConditions, AsDefIntIndex, newCond);
 	}
 	else {
-	  IntPathConditions.push_back(newCond); 
+	  addTo(IntPathConditions, IntIndex, newCond);
 	}
 	break;
       }
     case PathConditionTypeIntmem:
     case PathConditionTypeFptrmem:
     case PathConditionTypeGlobalInit:
-      IntmemPathConditions.push_back(newCond); break;
+      addTo(IntmemPathConditions, IntmemIndex, newCond); break;
     case PathConditionTypeString:
-      StringPathConditions.push_back(newCond); break;
+      addTo(StringPathConditions, StringIndex, newCond); break;
     case PathConditionTypeStream:
-      StreamPathConditions.push_back(newCond); break;
+      addTo(StreamPathConditions, StreamIndex, newCond); break;
     }
 
   }
@@ -298,30 +400,46 @@ struct IHPFunctionInfo {
   bool NoModRef;
   const IHPLocationMRInfo *LocationDetails;
   const IHPLocationMRInfo* (*getLocationDetailsFor)(ShadowValue);
+  // The memory the call may read through its arguments, as a null-terminated list in the same form,
+  // for DSE. If null the call may read anything reachable from any pointer argument.
+  const IHPLocationMRInfo* RefDetails;
 
 };
 
 struct OpenStatus {
 
-  std::string Name;
+  uint32_t filenameId;
   bool success;
 
-OpenStatus(std::string N, bool Success) : Name(N), success(Success) { }
-OpenStatus() : Name(""), success(false) {}
+OpenStatus(const std::string& N, bool Success) : filenameId(internFDFilename(N)), success(Success) { }
+OpenStatus() : filenameId(0), success(false) {}
+
+  const std::string& getFilename() const { return getFDFilename(filenameId); }
 
 };
 
 struct ReadFile {
 
-  std::string name;
+  uint32_t filenameId;
   uint64_t incomingOffset;
   uint32_t readSize;
   bool needsSeek;
   bool isFifo;
+  // Stdio reads (see -llpe-stdio-model) take their stream and buffer from other arguments than read();
+  // bufArg is -1 if the call returns its data rather than writing a buffer (e.g. fgetc).
+  bool isStdio;
+  uint8_t fdArg;
+  int8_t bufArg;
+  // fgets writes a NUL after the bytes read.
+  bool nulTerminate;
 
-ReadFile(std::string n, uint64_t IO, uint32_t RS, bool _isFifo) : name(n), incomingOffset(IO), readSize(RS), needsSeek(true), isFifo(_isFifo) { }
+ReadFile(const std::string& n, uint64_t IO, uint32_t RS, bool _isFifo) : filenameId(internFDFilename(n)), incomingOffset(IO), readSize(RS), needsSeek(true), isFifo(_isFifo), isStdio(false), fdArg(0), bufArg(1), nulTerminate(false) { }
 
-ReadFile() : name(), incomingOffset(0), readSize(0), needsSeek(true) { }
+ReadFile() : filenameId(0), incomingOffset(0), readSize(0), needsSeek(true), isStdio(false), fdArg(0), bufArg(1), nulTerminate(false) { }
+
+  const std::string& getFilename() const { return getFDFilename(filenameId); }
+  // Bytes written to the buffer argument.
+  uint64_t writeSize() const { return bufArg < 0 ? 0 : readSize + (nulTerminate ? 1 : 0); }
 
 };
 
@@ -336,6 +454,242 @@ SeekFile() : name(), newOffset(0), MayDelete(false) { }
 
 };
 
+// What specialisation has seen of the file at some path, taken when it is first looked at and then
+// used by every stat, open, seek and read evaluated and by the lliowd configuration, so that all of
+// them describe the same version of the file (see getFileSnapshot).
+struct FileSnapshot {
+
+  // The result of the first stat: statErrno is the error if statRet is -1.
+  int statRet;
+  int statErrno;
+  struct stat st;
+  // Hex SHA-256 of the contents, once something has asked for it (see LLIO.cpp).
+  std::string digest;
+  // The most recently read window of the file's bytes (see getFileBytes).
+  uint64_t windowStart;
+  MemoryBuffer* window;
+
+FileSnapshot() : statRet(-1), statErrno(0), windowStart(0), window(0) { }
+
+  bool matches(const struct stat& Other) const;
+
+};
+
+// The bytes a resolved read call last produced, and the file range they came from (see getReadCallBytes).
+struct ReadBytesMemo {
+
+  uint32_t filenameId;
+  uint64_t offset;
+  uint64_t size;
+  Constant* bytes;
+
+ReadBytesMemo() : filenameId(0), offset(0), size(0), bytes(0) { }
+
+};
+
+// Per-loop record of general-case fixpoint analysis (see IntegrationAttempt::analyseLoop).
+// Times include inner loops and calls analysed within the loop body.
+struct LoopFixpointStats {
+
+  uint32_t analyses;
+  uint64_t iterations;
+  uint64_t maxIterations;
+  uint32_t widened;
+  // Nested analyses skipped because nothing the loop reads had changed (see NestedLoopResult).
+  uint32_t reused;
+  // Instruction evaluations saved because nothing they depend on changed since the previous iteration.
+  uint64_t skippedEvals;
+  double seconds;
+
+LoopFixpointStats() : analyses(0), iterations(0), maxIterations(0), widened(0), reused(0), skippedEvals(0), seconds(0) {}
+
+};
+
+// Tracks the rounds of one general-case loop analysis, so that a side-effect-free instruction whose
+// operands haven't changed since the last round can keep its result rather than being re-evaluated.
+// Values only get worse round on round and the loop body is walked in dominator order, so any block
+// analysed last round is analysed again, and an operand change since an instruction's last evaluation
+// must have happened during this round (see analyseBlockInstructions).
+struct LoopRoundTracker {
+
+  IntegrationAttempt* ctx;
+  const ShadowLoopInvar* L;
+  uint32_t round;
+  // Value of LLPEAnalysisPass::loopRoundClock at the start of this round.
+  uint32_t roundStart;
+  // The last round in which each block of L (indexed from its header) was analysed to completion.
+  std::vector<uint32_t> blockRounds;
+  uint64_t skippedEvals;
+  LoopRoundTracker* parent;
+
+LoopRoundTracker(IntegrationAttempt* _ctx, const ShadowLoopInvar* _L, uint32_t nBlocks, LoopRoundTracker* _parent) :
+  ctx(_ctx), L(_L), round(0), roundStart(0), blockRounds(nBlocks, 0), skippedEvals(0), parent(_parent) {}
+
+};
+
+// The converged result of a loop analysed within an enclosing loop's fixpoint. If the next round of the
+// enclosing loop reaches this loop with the same preheader stores, and nothing the loop body uses has
+// changed since, analysing it again would reach the same fixpoint, so its exit stores are issued again instead.
+// Holds references on the preheader stores, so that pointer equality means they are unchanged,
+// and on the store each exit edge passed on, so it can be passed on again.
+struct NestedLoopExit {
+
+  ShadowBB* BB;
+  OrdinaryLocalStore* localStore;
+  FDStore* fdStore;
+
+NestedLoopExit(ShadowBB* _BB, OrdinaryLocalStore* LS, FDStore* FS) : BB(_BB), localStore(LS), fdStore(FS) {}
+
+};
+
+struct NestedLoopResult {
+
+  // LLPEAnalysisPass::loopRoundClock just after the analysis finished.
+  uint32_t clock;
+  OrdinaryLocalStore* preheaderStore;
+  FDStore* preheaderFDStore;
+  // One entry per live exit edge.
+  std::vector<NestedLoopExit> exits;
+
+  void release();
+
+};
+
+// Per-context record for the -llpe-stats-file contexts report, taken as each
+// function or loop iteration context is counted before commit.
+struct ContextStats {
+
+  uint64_t seqNumber;
+  int64_t parentSeqNumber; // -1 for the root
+  std::string function;
+  std::string loopHeader; // Empty for function contexts
+  int iteration; // -1 for function contexts
+  int stackDepth;
+  bool enabled;
+  uint32_t instructions;
+  uint32_t eliminated;
+  uint32_t checks;
+  uint64_t fixpointIterations; // General-case analysis of loops in this context
+  double analysisSeconds; // Excluding child contexts
+  uint32_t retainedStores; // Distinct store maps referenced by this context's blocks
+
+};
+
+// Pipeline phases timed for the -llpe-stats-file report. Phases nest (e.g. children are
+// committed during the parent's analysis); each is charged only its own time.
+enum LLPEPhase {
+
+  PHASE_ANALYSIS,
+  PHASE_TENTATIVE_LOADS,
+  PHASE_DSE,
+  PHASE_BENEFIT,
+  PHASE_DIE,
+  PHASE_COMMIT,
+  PHASE_POSTCOMMIT,
+  PHASE_FIXNONLOCAL,
+  PHASE_MAX
+
+};
+
+struct PhaseTimer {
+
+  PhaseTimer(LLPEPhase);
+  ~PhaseTimer();
+
+};
+
+// Similarly charges analysis time to individual contexts, when stats are being gathered.
+struct ContextTimer {
+
+  bool active;
+
+  ContextTimer(IntegrationAttempt*);
+  ~ContextTimer();
+
+};
+
+// With LLPE_PROFILE_EVAL defined (cmake -DLLPE_PROFILE_EVAL=ON), count and time the instructions
+// evaluated, keyed by opcode and by function, and print a summary when analysis finishes.
+// Each scope is charged its own time excluding nested scopes (e.g. an expanded call's body).
+// Otherwise LLPE_EVAL_PROFILE_SCOPE compiles to nothing.
+enum EvalProfileSite {
+
+  EVAL_PROFILE_ANALYSE,
+  EVAL_PROFILE_FORWARD_LOAD,
+  EVAL_PROFILE_MULTI,
+  EVAL_PROFILE_SITES
+
+};
+
+#ifdef LLPE_PROFILE_EVAL
+
+struct EvalProfileScope {
+
+  EvalProfileSite site;
+  const Instruction* I;
+  uint64_t start;
+  uint64_t childTicks;
+  EvalProfileScope* outer;
+
+  EvalProfileScope(EvalProfileSite, const Instruction*);
+  ~EvalProfileScope();
+
+};
+
+void printEvalProfile(raw_ostream&);
+
+#define LLPE_EVAL_PROFILE_SCOPE(Site, I) EvalProfileScope llpeEvalProfileScope(Site, I)
+
+#else
+
+#define LLPE_EVAL_PROFILE_SCOPE(Site, I)
+
+#endif
+
+// Diagnostics from the verbose modes go to a buffered sink (see Log.cpp), filtered by category.
+// LLPE_LOG(C) << ... writes one record if category C is enabled, and evaluates nothing otherwise.
+// Each record is assembled privately and appended whole, so records from different threads don't interleave.
+enum LogCategory {
+
+  LOG_SHARING,
+  LOG_OVERDEF,
+  LOG_DSE,
+  LOG_TL,
+  LOG_CATEGORIES
+
+};
+
+extern uint32_t logCategoryMask;
+
+inline bool logEnabled(LogCategory C) {
+
+  return logCategoryMask & (1U << C);
+
+}
+
+class LogRecord {
+
+  LogCategory category;
+  std::string text;
+  raw_string_ostream RSO;
+
+ public:
+
+ LogRecord(LogCategory C) : category(C), RSO(text) { }
+  ~LogRecord();
+
+  raw_ostream& stream() { return RSO; }
+
+};
+
+#define LLPE_LOG(C) if(!llvm::logEnabled(C)) { } else llvm::LogRecord(C).stream()
+
+const char* getLogCategoryName(LogCategory);
+void initLog(const std::string& Path, bool JSON, uint32_t Mask);
+void flushLog();
+
+#define READDEPTHBUCKETS 16
+
 struct GlobalStats {
   
   uint32_t dynamicFunctions;
@@ -359,10 +713,103 @@ struct GlobalStats {
   uint32_t threadChecks;
   uint32_t condChecks;
 
+  uint32_t dominatorTrees;
+
+  uint64_t readCacheHits;
+  uint64_t readCacheMisses;
+
+  // Histogram of the number of stacked maps each store read walks (last bucket: READDEPTHBUCKETS or more),
+  // and the number of stacks squashed by getWritableStoreFor.
+  uint64_t readDepths[READDEPTHBUCKETS];
+  uint64_t flattenedMultis;
+
+  uint32_t mergedFunctions;
+  uint64_t mergedInstructions;
+
+  uint64_t callMemoHits;
+  uint64_t callMemoEntries;
+  uint64_t nativeStringCalls;
+  uint64_t tripProbeSkips;
+  uint64_t discardedPeelIterations;
+  uint64_t rerolledLoops;
+  uint64_t rerolledIterations;
+  uint64_t memcpyBytesCopied;
+  uint64_t memcpyBytesReferenced;
+  uint64_t constantImages;
+  uint64_t constantImageReads;
+  uint64_t forwardedValues;
+  uint64_t forwardingLoads;
+  uint64_t threadLocalAtomics;
+  uint64_t staticHeapAllocations;
+  uint64_t staticHeapBytes;
+  uint64_t multiloadsFailedEarly;
+  uint64_t constantStringHits;
+  uint64_t constantStringMisses;
+  uint64_t compactedHeapObjects;
+  // Peel attempts that failed to terminate, so the loop's general case was analysed as well,
+  // and the time spent peeling them.
+  uint64_t unterminatedPeels;
+  double unterminatedPeelSeconds;
+  uint64_t readOnlyIndirectCalls;
+  uint64_t userIndexedFunctions;
+  // Shared contexts unshared by getWritableCopyFrom, and how many of those copied the existing analysis.
+  uint64_t sharingBreaks;
+  uint64_t sharingBreakCopies;
+  // Sharing dependencies matched only once compared in canonical form.
+  uint64_t deepSharingMatches;
+  uint64_t fileWindowLoads;
+  uint64_t fileWindowReads;
+  uint64_t synthConstantReuses;
+  uint64_t synthInstructionReuses;
+  uint64_t contextBudgetsExceeded;
+  uint64_t spilledSlabs;
+  uint64_t spilledSlabBytes;
+  uint64_t failureCounterSites;
+  uint32_t sharedLandingPads;
+  uint64_t sharedLandingPadBlocks;
+  uint64_t vectorLaneInsts;
+  uint64_t summarisedAllocations;
+  uint64_t skippedClobbers;
+  // Library entry point calls answered from an imported summary, and summaries recorded for export.
+  uint64_t librarySummaryHits;
+  uint64_t librarySummariesExported;
+  uint64_t inertStoreWalksSkipped;
+  uint64_t readBytesMemoHits;
+  uint64_t intRangeCmpFolds;
+  uint64_t impliedPathConditionChecks;
+  uint64_t prunedFunctions;
+  uint64_t prunedGlobalVariables;
+  uint64_t closedFormLoopExits;
+  uint64_t tabledRecursiveCalls;
+  uint64_t mergedConstantGlobals;
+  uint64_t mergedConstantBytes;
+  uint64_t redirectedReadBuffers;
+  uint64_t redirectedReadBytes;
+  uint64_t boundedAllocations;
+
+  DenseMap<BasicBlock*, LoopFixpointStats> loopFixpoints;
+
+  double phaseSeconds[PHASE_MAX];
+  SmallVector<LLPEPhase, 4> phaseStack;
+  double phaseStartTime;
+
+  std::vector<ContextStats> contexts;
+  SmallVector<IntegrationAttempt*, 16> contextStack;
+  double contextStartTime;
+
 GlobalStats() : dynamicFunctions(0), dynamicContexts(0), dynamicBlocks(0), dynamicInsts(0),
     disabledContexts(0), resolvedBranches(0), constantInstructions(0), pointerInstructions(0),
     setInstructions(0), unknownInstructions(0), deadInstructions(0), residualBlocks(0),
-    residualInstructions(0), mallocChecks(0), fileChecks(0), threadChecks(0), condChecks(0) {}
+    residualInstructions(0), mallocChecks(0), fileChecks(0), threadChecks(0), condChecks(0),
+    dominatorTrees(0), readCacheHits(0), readCacheMisses(0), flattenedMultis(0), mergedFunctions(0),
+    mergedInstructions(0), callMemoHits(0), callMemoEntries(0), nativeStringCalls(0), tripProbeSkips(0), discardedPeelIterations(0), rerolledLoops(0), rerolledIterations(0), memcpyBytesCopied(0), memcpyBytesReferenced(0), constantImages(0), constantImageReads(0), forwardedValues(0), forwardingLoads(0), threadLocalAtomics(0), staticHeapAllocations(0), staticHeapBytes(0), multiloadsFailedEarly(0), constantStringHits(0), constantStringMisses(0), compactedHeapObjects(0), unterminatedPeels(0), unterminatedPeelSeconds(0), readOnlyIndirectCalls(0), userIndexedFunctions(0), sharingBreaks(0), sharingBreakCopies(0), deepSharingMatches(0), fileWindowLoads(0), fileWindowReads(0), synthConstantReuses(0), synthInstructionReuses(0), contextBudgetsExceeded(0), spilledSlabs(0), spilledSlabBytes(0), failureCounterSites(0), sharedLandingPads(0), sharedLandingPadBlocks(0), vectorLaneInsts(0), summarisedAllocations(0), skippedClobbers(0), librarySummaryHits(0), librarySummariesExported(0), inertStoreWalksSkipped(0), readBytesMemoHits(0), intRangeCmpFolds(0), impliedPathConditionChecks(0), prunedFunctions(0), prunedGlobalVariables(0), closedFormLoopExits(0), tabledRecursiveCalls(0), mergedConstantGlobals(0), mergedConstantBytes(0), redirectedReadBuffers(0), redirectedReadBytes(0), boundedAllocations(0), phaseStartTime(0), contextStartTime(0) {
+
+    for(uint32_t i = 0; i < PHASE_MAX; ++i)
+      phaseSeconds[i] = 0;
+    for(uint32_t i = 0; i < READDEPTHBUCKETS; ++i)
+      readDepths[i] = 0;
+
+  }
 
   void print(raw_ostream& Out) {
 
@@ -383,9 +830,71 @@ GlobalStats() : dynamicFunctions(0), dynamicContexts(0), dynamicBlocks(0), dynam
     Out << "File checks: " << fileChecks << "\n";
     Out << "Thread checks: " << threadChecks << "\n";
     Out << "Cond checks: " << condChecks << "\n";
+    Out << "Dominator trees built: " << dominatorTrees << "\n";
+    Out << "Read cache hits / misses: " << readCacheHits << " / " << readCacheMisses << "\n";
+    Out << "Flattened multis: " << flattenedMultis << "\n";
+    Out << "Identical functions merged (functions / instructions): " << mergedFunctions << " / " << mergedInstructions << "\n";
+    Out << "Memoised calls (hits / entries): " << callMemoHits << " / " << callMemoEntries << "\n";
+    Out << "Natively evaluated library calls: " << nativeStringCalls << "\n";
+    Out << "Loops not peeled due to trip-count probe: " << tripProbeSkips << "\n";
+    Out << "Non-terminating peel iterations freed early: " << discardedPeelIterations << "\n";
+    Out << "Re-rolled peeled loops (loops / iterations): " << rerolledLoops << " / " << rerolledIterations << "\n";
+    Out << "Bytes copied by copy instructions (copied / referenced): " << memcpyBytesCopied << " / " << memcpyBytesReferenced << "\n";
+    Out << "Constant images (built / reads): " << constantImages << " / " << constantImageReads << "\n";
+    Out << "Values forwarded between residual functions (values / loads): " << forwardedValues << " / " << forwardingLoads << "\n";
+    Out << "Atomic RMWs on thread-local objects emitted as plain stores: " << threadLocalAtomics << "\n";
+    Out << "Heap allocations made static (allocations / bytes): " << staticHeapAllocations << " / " << staticHeapBytes << "\n";
+    Out << "Multiloads failed before reading: " << multiloadsFailedEarly << "\n";
+    Out << "Constant string cache hits / misses: " << constantStringHits << " / " << constantStringMisses << "\n";
+    Out << "Freed heap objects compacted out of stores: " << compactedHeapObjects << "\n";
+    Out << "Peel attempts that did not terminate (attempts / seconds): " << unterminatedPeels << " / " << unterminatedPeelSeconds << "\n";
+    Out << "Indirect calls to read-only candidate sets: " << readOnlyIndirectCalls << "\n";
+    Out << "Functions needing user indices: " << userIndexedFunctions << "\n";
+    Out << "Shared contexts unshared: " << sharingBreaks << " (" << sharingBreakCopies << " copied rather than re-analysed from scratch)\n";
+    Out << "Sharing dependencies matched by deep comparison: " << deepSharingMatches << "\n";
+    Out << "File read windows (loaded / reads): " << fileWindowLoads << " / " << fileWindowReads << "\n";
+    Out << "Synthesised pointers reused (constants / instructions): " << synthConstantReuses << " / " << synthInstructionReuses << "\n";
+    Out << "Contexts that exceeded their budget: " << contextBudgetsExceeded << "\n";
+    Out << "Context slabs mapped from the spill file (slabs / bytes): " << spilledSlabs << " / " << spilledSlabBytes << "\n";
+    Out << "Specialised-to-unspecialised edges given failure counters: " << failureCounterSites << "\n";
+    Out << "Landing pad regions shared (regions / blocks removed): " << sharedLandingPads << " / " << sharedLandingPadBlocks << "\n";
+    Out << "Vector instructions evaluated lane-wise: " << vectorLaneInsts << "\n";
+    Out << "Loop allocations given a site summary: " << summarisedAllocations << "\n";
+    Out << "Store clobbers skipped as already done: " << skippedClobbers << "\n";
+    Out << "Library summaries (hits / exported): " << librarySummaryHits << " / " << librarySummariesExported << "\n";
+    Out << "TL / DSE walks skipped over memory-inert calls: " << inertStoreWalksSkipped << "\n";
+    Out << "Resolved reads reusing their last bytes: " << readBytesMemoHits << "\n";
+    Out << "Comparisons decided by integer ranges: " << intRangeCmpFolds << "\n";
+    Out << "Path condition checks implied by the store: " << impliedPathConditionChecks << "\n";
+    Out << "Functions unreachable from the root: " << prunedFunctions << "\n";
+    Out << "Global variables unreachable from the root: " << prunedGlobalVariables << "\n";
+    Out << "Unexpanded loop exits counted in closed form: " << closedFormLoopExits << "\n";
+    Out << "Recursive calls reusing an identical call's analysis: " << tabledRecursiveCalls << "\n";
+    Out << "Identical constant globals merged (globals / bytes): " << mergedConstantGlobals << " / " << mergedConstantBytes << "\n";
+    Out << "Read buffers replaced by file data (buffers / bytes): " << redirectedReadBuffers << " / " << redirectedReadBytes << "\n";
+    Out << "Unknown-size allocations given a size bound: " << boundedAllocations << "\n";
+    Out << "Read depths:";
+    for(uint32_t i = 0; i < READDEPTHBUCKETS; ++i) {
+      if(readDepths[i])
+	Out << " " << (i + 1) << (i + 1 == READDEPTHBUCKETS ? "+" : "") << ":" << readDepths[i];
+    }
+    Out << "\n";
+    Out << "Merges avoided by sharing (maps / frames / heaps / subtrees / objects): " << GlobalMergeSharing.maps << " / "
+	<< GlobalMergeSharing.frames << " / " << GlobalMergeSharing.heaps << " / " << GlobalMergeSharing.subtrees << " / "
+	<< GlobalMergeSharing.objects << "\n";
+    printLoopFixpoints(Out);
 
   }
 
+  void printLoopFixpoints(raw_ostream& Out);
+
+  void enterPhase(LLPEPhase);
+  void exitPhase();
+  void printPhasesJSON(raw_ostream& Out);
+  void printContextsJSON(raw_ostream& Out);
+  void enterContext(IntegrationAttempt*);
+  void exitContext();
+
 };
 
 struct ArgStore {
@@ -398,6 +907,63 @@ ArgStore(uint32_t hi) : heapIdx(hi) {}
 
 };
 
+enum NativeStringOp {
+
+  NSO_STRLEN,
+  NSO_STRCMP,
+  NSO_STRNCMP,
+  NSO_MEMCMP,
+  NSO_MEMCHR,
+  NSO_STRCHR,
+  NSO_MEMCPY
+
+};
+
+// What analyseInstruction may do with a call to a particular function, other than fold or expand it
+// (see LLPEAnalysisPass::getCallClass):
+#define CALLCLASS_VFS 1
+#define CALLCLASS_NATIVESTRING 2
+#define CALLCLASS_SUMMARY 4
+
+// Which VFS call a CALLCLASS_VFS callee is, so that the VFS handlers dispatch on it rather than
+// comparing names. Those after VFSCALL_FOPEN take a stream and are only used with -llpe-stdio-model.
+enum VFSCallKind {
+
+  VFSCALL_NONE,
+  VFSCALL_OPEN,
+  VFSCALL_READ,
+  VFSCALL_RECVFROM,
+  VFSCALL_SEEK,
+  VFSCALL_CLOSE,
+  VFSCALL_STAT,
+  VFSCALL_FSTAT,
+  VFSCALL_ISATTY,
+  VFSCALL_FOPEN,
+  VFSCALL_FGETC,
+  VFSCALL_FGETS,
+  VFSCALL_FREAD,
+  VFSCALL_FCLOSE,
+  VFSCALL_FSEEK,
+  VFSCALL_REWIND,
+  VFSCALL_FTELL,
+  VFSCALL_FEOF,
+  VFSCALL_FERROR,
+  VFSCALL_CLEARERR,
+  // Other calls on a stream, which leave its position unknown:
+  VFSCALL_STDIO_OTHER
+
+};
+
+struct CallClassInfo {
+
+  uint8_t flags;
+  uint8_t vfsKind;
+  uint8_t streamArg;
+
+CallClassInfo() : flags(0), vfsKind(VFSCALL_NONE), streamArg(0) {}
+
+};
+
 class LLPEAnalysisPass : public ModulePass {
 
  public:
@@ -417,15 +983,19 @@ class LLPEAnalysisPass : public ModulePass {
    DenseMap<ShadowInstruction*, std::string> optimisticForwardStatus;
 
    const DataLayout* TD;
-   AAResults* AA;
 
    InlineAttempt* RootIA;
 
-   DenseMap<const GlobalVariable*, std::string> GVCache;
-   DenseMap<const GlobalVariable*, std::string> GVCacheBrief;
-
-   DenseMap<const Function*, DenseMap<const Value*, std::string>* > functionTextCache;
-   DenseMap<const Function*, DenseMap<const Value*, std::string>* > briefFunctionTextCache;
+   // Least-recently-used cache of value text representations, most recent first:
+   struct CachedValueText {
+     const Value* V;
+     std::string full;
+     std::string brief;
+   };
+   typedef std::list<CachedValueText> ValueTextList;
+   ValueTextList valueTextLRU;
+   DenseMap<const Value*, ValueTextList::iterator> valueTextCache;
+   unsigned valueTextCacheLimit;
 
    DenseMap<GlobalVariable*, uint64_t> shadowGlobalsIdx;
 
@@ -437,11 +1007,16 @@ class LLPEAnalysisPass : public ModulePass {
 
    std::vector<IntegratorTag> tags;
    IntegratorTag* rootTag;
+   // Every tag under rootTag in preorder, with the short header of each that describes a context,
+   // so that the GUI's search needn't walk the tree formatting headers each time.
+   std::vector<std::pair<IntegratorTag*, std::string> > tagSearchIndex;
+   DenseMap<IntegratorTag*, uint32_t> tagSearchPositions;
 
    // Pass identifier
    static char ID;
 
    DenseMap<Function*, DominatorTree*> DTs;
+   DominatorTree* getDT(Function*);
 
    ImprovedValSetMulti::MapTy::Allocator IMapAllocator;
 
@@ -450,7 +1025,8 @@ class LLPEAnalysisPass : public ModulePass {
 
    SmallPtrSet<Function*, 8> splitFunctions;
 
-   DenseMap<Function*, std::vector<InlineAttempt*> > IAsByFunction;
+   // Sharable IAs, indexed by function and argument fingerprint.
+   DenseMap<std::pair<Function*, uint64_t>, std::vector<InlineAttempt*> > IAsByFunction;
 
    PathConditions pathConditions;
 
@@ -460,6 +1036,34 @@ class LLPEAnalysisPass : public ModulePass {
    SmallDenseMap<Function*, ReallocatorFn, 4> reallocatorFunctions;
    SmallDenseMap<Function*, Function*> modelFunctions;
    SmallPtrSet<Function*, 4> yieldFunctions;
+   // Call result memoisation (see CallMemo.cpp):
+   SmallPtrSet<Function*, 4> memoFunctions;
+   bool memoPureCalls;
+   StringMap<Constant*> callMemo;
+   // Library entry point summaries (see LibrarySummary.cpp): the functions to summarise or that have
+   // imported summaries, each one's fingerprint, summaries read from -llpe-import-summary, and those
+   // recorded this run for -llpe-export-summary.
+   SmallPtrSet<Function*, 4> summaryFunctions;
+   DenseMap<Function*, LibrarySummaryInfo*> librarySummaryInfo;
+   DenseMap<Function*, std::vector<LibrarySummary*> > importedSummaries;
+   std::vector<LibrarySummary*> exportedSummaries;
+   std::string summaryExportFile;
+   // Flattened images of large constant aggregates (see ConstantImage.cpp). Null if too big.
+   DenseMap<Constant*, ConstantImage*> constantImages;
+   // Every file looked at during specialisation, by path as given.
+   StringMap<FileSnapshot*> fileSnapshots;
+   // Strings decoded by getConstantString, as interned filename IDs. Those read from constant globals
+   // are keyed by (global, offset); those read from the store by (multi stamp, offset).
+   DenseMap<std::pair<GlobalVariable*, int64_t>, uint32_t> constantGVStrings;
+   DenseMap<std::pair<uint64_t, int64_t>, uint32_t> storeStrings;
+   // Library routines evaluated natively when their arguments are known (see NativeStringOps.cpp):
+   DenseMap<Function*, NativeStringOp> nativeStringFunctions;
+   // CALLCLASS_* flags and VFS call kind for each callee seen so far.
+   DenseMap<Function*, CallClassInfo> callClasses;
+   // Pointers built by getGVOffset, by (global, offset, type), and by synthCommittedPointer from
+   // non-constant bases, by (block, base, offset, type). Entries go null if the pointer is deleted.
+   DenseMap<std::pair<std::pair<Constant*, int64_t>, Type*>, WeakVH> gvOffsets;
+   DenseMap<std::pair<std::pair<BasicBlock*, Value*>, std::pair<int64_t, Type*> >, WeakVH> synthPointers;
 
    ArgStore* argStores;
 
@@ -477,45 +1081,109 @@ class LLPEAnalysisPass : public ModulePass {
    DenseMap<ShadowValue, std::vector<std::pair<ShadowValue, uint32_t> > > indirectDIEUsers;
    // Of a successful copy instruction, records the values read.
    DenseMap<ShadowInstruction*, SmallVector<IVSRange, 4> > memcpyValues;
+   // ...or, for a whole-object copy that shared its source's store, that store and the copy size,
+   // from which memcpyValues is filled in on demand (see getMemcpyValues).
+   DenseMap<ShadowInstruction*, std::pair<ImprovedValSet*, uint64_t> > memcpySnapshots;
 
    DenseMap<ShadowInstruction*, OpenStatus*> forwardableOpenCalls;
    DenseMap<ShadowInstruction*, ReadFile> resolvedReadCalls;
    DenseMap<ShadowInstruction*, SeekFile> resolvedSeekCalls;
+   // Keyed by (call, NUL-terminated), so fgets' lookahead and its buffer write each have one.
+   DenseMap<std::pair<ShadowInstruction*, uint32_t>, ReadBytesMemo> readBytesMemos;
 
    void addSharableFunction(InlineAttempt*);
    void removeSharableFunction(InlineAttempt*);
+   void updateSharableFunction(InlineAttempt*);
    InlineAttempt* findIAMatching(ShadowInstruction*);
 
    ShadowGV* shadowGlobals;
 
-   std::vector<AllocData> heap;
-   std::vector<FDGlobalState> fds;
+   // Chunked so that growing these never moves their entries (and re-registers all their PatchRefs' handles).
+   ChunkedVector<AllocData> heap;
+   ChunkedVector<FDGlobalState> fds;
+   // Interned FD filenames; index 0 is the empty name.
+   std::vector<std::string> fdFilenames;
+   StringMap<uint32_t> fdFilenameIds;
 
    RecyclingAllocator<BumpPtrAllocator, ImprovedValSetSingle> IVSAllocator;
+   RecyclingAllocator<BumpPtrAllocator, ImprovedValSetMulti> IVMAllocator;
 
    bool verboseOverdef;
    bool enableSharing;
    bool verboseSharing;
+   bool deepSharingCompare;
+   bool modelStdio;
    bool verbosePCs;
+   // -llpe-batch-path-funcs: check all function path conditions at a block with one call to a generated
+   // function that runs their verifiers in turn. Generated functions are cached by verifier sequence.
+   bool batchPathFuncs;
+   std::map<std::vector<Function*>, Function*> batchedPathFuncVerifiers;
    bool useGlobalInitialisers;
 
    Function* llioPreludeFn;
    int llioPreludeStackIdx;
    std::string llioConfigFile;
    std::vector<std::string> llioDependentFiles;
+   // Parallel to llioDependentFiles: set if a stat result for the file was folded in, so that lliowd
+   // must not accept a rewritten copy with the same contents.
+   std::vector<bool> llioStatDependencies;
+   std::string digestCacheFile;
+
+   // Command-line inputs to this specialisation (option name, value), and files they name,
+   // for the input manifest (see -llpe-write-input-manifest).
+   std::string inputManifestFile;
+   std::vector<std::pair<std::string, std::string> > specInputs;
+   std::vector<std::string> specInputFiles;
 
    DenseSet<ShadowInstruction*> barrierInstructions;
 
    bool programSingleThreaded;
    bool omitChecks;
    bool omitMallocChecks;
+   uint32_t allocSiteLimit;
+   bool coalesceChecks;
+   bool inlineLliowdCheck;
+   // -llpe-count-failures, and the failed blocks created so far, from which
+   // instrumentFailurePaths finds the edges into unspecialised code.
+   bool countFailures;
+   std::vector<WeakVH> failedBlockHandles;
+   // -llpe-export-variant: tag for the specialised root when this output is to be linked
+   // with others specialised for different inputs (see scripts/link-variants.py).
+   std::string exportVariant;
+   // -llpe-block-map: where to write which context each committed block came from, since
+   // committed blocks are only named with -int-verbose-names.
+   std::string blockMapFile;
+   std::vector<std::pair<WeakVH, uint32_t> > committedBlockContexts;
+   // -llpe-runtime-report-table: where to write the messages of runtime diagnostics. When given, each
+   // diagnostic site passes only its index in runtimeReports to one shared reporting function.
+   std::string runtimeReportTable;
+   std::vector<std::string> runtimeReports;
+   bool mergeIdenticalFunctions;
+   bool shareLandingPads;
+   bool staticHeap;
+   // Set if a free or realloc might release any heap object, or if specialised code
+   // can branch to unspecialised code; either rules out -llpe-static-heap.
+   bool heapMayBeFreedVaguely;
+   bool committedFailedBlocks;
+   // Set once any heap object is known freed, after which returns try to compact the heap.
+   bool heapObjectsFreed;
+   // Advanced at the start of every loop fixpoint round; instructions record it when their value changes.
+   uint32_t loopRoundClock;
+   // The innermost loop currently being analysed for a fixpoint, or null.
+   LoopRoundTracker* loopRoundTracker;
+   // -llpe-loop-eval-all: re-evaluate every instruction in every fixpoint round.
+   bool loopEvalAll;
 
    DenseSet<std::pair<IntegrationAttempt*, const ShadowLoopInvar*> > latchStoresRetained;
+   DenseMap<std::pair<IntegrationAttempt*, const ShadowLoopInvar*>, NestedLoopResult*> nestedLoopResults;
 
    GlobalStats stats;
 
    DenseMap<IntegrationAttempt*, std::string> shortHeaders;
    DenseMap<ShadowInstruction*, TrackedStore*> trackedStores;
+   // Memcpys committed for resolved reads, with the global holding the bytes they copy;
+   // see redirectReadOnlyReadBuffers.
+   std::vector<std::pair<WeakVH, GlobalVariable*> > committedReadCopies;
    DenseMap<ShadowInstruction*, TrackedAlloc*> trackedAllocs;
    DenseMap<Value*, uint32_t> committedHeapAllocations;
    DenseMap<Value*, uint32_t> committedFDs;
@@ -527,17 +1195,55 @@ class LLPEAnalysisPass : public ModulePass {
    bool emitFakeDebug;
    DenseMap<Function*, DebugLoc> fakeDebugLocs;
    DISubroutineType* fakeDebugType;
+   // -llpe-emit-debug-locs: keep committed instructions' source locations (see getDebugInlinedAt).
+   bool emitDebugLocs;
 
    std::string statsFile;
+   // If set, write the committed module here and exit without tearing anything down (see fastExit).
+   std::string fastExitOutput;
    unsigned maxContexts;
-
-   explicit LLPEAnalysisPass() : ModulePass(ID), cacheDisabled(false) { 
+   // Budget for, and running estimate of, specialised instructions committed (see Selective.cpp):
+   unsigned maxOutputInsts;
+   uint64_t outputInsts;
+   unsigned loopWidenIters;
+   bool loopTripProbe;
+   unsigned maxPeelIterations;
+   // Per-context analysis budgets in seconds and megabytes of peak RSS growth, or 0 for none.
+   unsigned contextTimeLimit;
+   unsigned contextMemLimit;
+   unsigned rerollMinIterations;
+   unsigned multiFlattenDepth;
+   // Set when -llpe-batch or -llpe-server has written each job's output itself, so there is nothing left to commit.
+   bool batchMode;
+
+   explicit LLPEAnalysisPass() : ModulePass(ID), valueTextCacheLimit(0), cacheDisabled(false) { 
 
      mallocAlignment = 0;
+     batchMode = false;
+     memoPureCalls = false;
+     heapMayBeFreedVaguely = false;
+     committedFailedBlocks = false;
+     heapObjectsFreed = false;
+     loopRoundClock = 0;
+     loopRoundTracker = 0;
 
    }
 
    bool runOnModule(Module& Ms);
+   bool specialiseRoot(Module& M);
+   void runBatch(Module& M);
+   void runServer(Module& M);
+   void runMicroBench(Module& M, const std::vector<std::string>& Names);
+   void buildDominatorTrees(Module&);
+   // Functions, variables and aliases reachable from the root, found by findReachableGlobals before
+   // analysis starts. Empty means no pruning was done, and everything counts as reachable.
+   DenseSet<const GlobalValue*> reachableGlobals;
+   void findReachableGlobals(Function& Root);
+   void countUnreachableGlobals(Module&);
+   bool isReachableGlobal(const GlobalValue* GV) {
+     return reachableGlobals.empty() || reachableGlobals.count(GV);
+   }
+   bool usedOnlyFromUnreachableCode(const Value* V);
 
    void print(raw_ostream &OS, const Module* M) const;
 
@@ -545,9 +1251,8 @@ class LLPEAnalysisPass : public ModulePass {
 
    // Caching text representations of instructions:
 
-   DenseMap<const Value*, std::string>& getFunctionCache(const Function* F, bool brief);
-   DenseMap<const GlobalVariable*, std::string>& getGVCache(bool brief);
-   void populateGVCaches(const Module*);
+   CachedValueText& getCachedText(const Value* V);
+   void addCachedText(const Value* V, const std::string& full, const std::string& brief);
    virtual void printValue(raw_ostream& ROS, const Value* V, bool brief);
    virtual void printValue(raw_ostream& ROS, ShadowValue V, bool brief);
    void disableValueCache();
@@ -557,7 +1262,7 @@ class LLPEAnalysisPass : public ModulePass {
    void setParam(InlineAttempt* IA, long Idx, Constant* Val);
    void parseArgs(Function& F, std::vector<Constant*>&, uint32_t& argvIdx);
    void parseArgsPostCreation(InlineAttempt* IA);
-   void parsePathConditions(cl::list<std::string>& L, PathConditionTypes Ty, InlineAttempt* IA);
+   void parsePathConditions(std::vector<std::string>& L, PathConditionTypes Ty, InlineAttempt* IA);
    void createSpecialLocations();
    void createPointerArguments(InlineAttempt*);
 
@@ -615,18 +1320,37 @@ class LLPEAnalysisPass : public ModulePass {
    ShadowFunctionInvar* getFunctionInvarInfo(Function& F);
    ShadowLoopInvar* getLoopInfo(ShadowFunctionInvar* FInfo,
 				DenseMap<BasicBlock*, uint32_t>& BBIndices, 
-				const Loop* L,
-				DominatorTree*,
+				const ShadowLoopShape& L,
 				ShadowLoopInvar* Parent);
 
+   // Persistent cache of function invariant information:
+   std::string invarCacheDir;
+   std::string getInvarCachePath(Function& F);
+   bool readInvarCache(Function& F, std::vector<BasicBlock*>& TopOrderedBlocks, std::vector<ShadowLoopShape>& Loops);
+   void writeInvarCache(Function& F, std::vector<BasicBlock*>& TopOrderedBlocks, std::vector<ShadowLoopShape>& Loops);
+
+   // Export of the whole context tree as graphs (see -llpe-graphs-dir, -llpe-graphs-archive):
+   std::string graphOutputDir;
+   std::string graphArchivePath;
+   void writeGraphs();
+
+   // Block execution counts (see -llpe-block-profile), used to weight IntBenefit scores:
+   DenseMap<BasicBlock*, uint64_t> blockProfile;
+   void loadBlockProfile(Module& M, std::string& Filename);
+
    void initShadowGlobals(Module&, uint32_t extraSlots);
+   void allocateReferencedGlobals(Module&);
    uint64_t getShadowGlobalIndex(GlobalVariable* GV) {
      return shadowGlobalsIdx[GV];
    }
 
    InlineAttempt* getRoot() { return RootIA; }
    IntegratorTag* getRootTag() { return rootTag; }
+   void buildTagSearchIndex();
+   IntegratorTag* searchTags(const std::string& search, IntegratorTag* startAt);
    void commit();
+   void sweepDeadConstants(Module& M);
+   void fastExit(Module& M);
 
    IntegratorTag* newTag() {
      
@@ -634,15 +1358,34 @@ class LLPEAnalysisPass : public ModulePass {
 
    }
 
-   uint32_t countPathConditionsAtBlockStart(ShadowBBInvar* BB, IntegrationAttempt* IA);
+   uint32_t countPathConditionsAtBlockStart(ShadowBBInvar* BB, IntegrationAttempt* IA, bool includeImplied = false);
+   Function* getBatchedPathFuncVerifier(const std::vector<Function*>& VerifyFs);
    BasicBlock* parsePCBlock(Function* fStack, std::string& bbName);
    int64_t parsePCInst(BasicBlock* bb, Module* M, std::string& instIndexStr);
    void writeLliowdConfig();
+   void writeInputManifest();
+   void loadLibrarySummaries(Module&, const std::string&);
+   void writeLibrarySummaries();
+   LibrarySummaryInfo* getLibrarySummaryInfo(Function*);
 
    void initMRInfo(Module*);
+   void addMRInfo(Module*, const std::string&);
+   void initStdioMRInfo(Module*);
+   CallClassInfo getCallClassInfo(Function*);
+   uint8_t getCallClass(Function* F) { return getCallClassInfo(F).flags; }
    IHPFunctionInfo* getMRInfo(Function*);
 
    void postCommitStats();
+   void mergeIdenticalCommittedFunctions();
+   void mergeIdenticalConstantGlobals(Module&);
+   void redirectReadOnlyReadBuffers();
+   void shareIdenticalLandingPads();
+   void instrumentFailurePaths();
+   void exportAsVariant();
+   void writeBlockMap();
+   void writeRuntimeReportTable();
+   void finishCommittedDebugLocs();
+   void makeHeapAllocationsStatic();
 
    void fixNonLocalUses();
    void initGlobalFDStore();
@@ -694,12 +1437,14 @@ inline void printSV(raw_ostream& RSO, ShadowValue V) {
 
 inline ImprovedValSetSingle* newIVS() {
 
+  GlobalIVSCounter.alloc();
   return new (GlobalIHP->IVSAllocator.Allocate()) ImprovedValSetSingle();
 
 }
 
 inline ImprovedValSetSingle* newOverdefIVS() {
 
+  GlobalIVSCounter.alloc();
   return new (GlobalIHP->IVSAllocator.Allocate()) ImprovedValSetSingle(ValSetTypeUnknown, true);
 
 }
@@ -708,6 +1453,28 @@ inline void deleteIVS(ImprovedValSetSingle* I) {
 
   I->~ImprovedValSetSingle();
   GlobalIHP->IVSAllocator.Deallocate(I);
+  GlobalIVSCounter.free();
+
+}
+
+// Multis are all pool-allocated, unlike singles which may also be new'd for use in LocStores.
+
+inline ImprovedValSetMulti* newIVM(uint64_t ASize) {
+
+  return new (GlobalIHP->IVMAllocator.Allocate()) ImprovedValSetMulti(ASize);
+
+}
+
+inline ImprovedValSetMulti* copyIVM(const ImprovedValSetMulti* IVM) {
+
+  return new (GlobalIHP->IVMAllocator.Allocate()) ImprovedValSetMulti(*IVM);
+
+}
+
+inline void deleteIVM(ImprovedValSetMulti* I) {
+
+  I->~ImprovedValSetMulti();
+  GlobalIHP->IVMAllocator.Deallocate(I);
 
 }
 
@@ -716,12 +1483,13 @@ inline void deleteIV(ImprovedValSet* I) {
   if(ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(I))
     deleteIVS(IVS);
   else
-    delete cast<ImprovedValSetMulti>(I);
+    deleteIVM(cast<ImprovedValSetMulti>(I));
   
 }
 
 inline ImprovedValSetSingle* copyIVS(const ImprovedValSetSingle* IVS) {
 
+  GlobalIVSCounter.alloc();
   return new (GlobalIHP->IVSAllocator.Allocate()) ImprovedValSetSingle(*IVS);  
 
 }
@@ -731,7 +1499,7 @@ inline ImprovedValSet* copyIV(const ImprovedValSet* IV) {
   if(const ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(IV))
     return copyIVS(IVS);
   else
-    return new ImprovedValSetMulti(*cast<ImprovedValSetMulti>(IV));
+    return copyIVM(cast<ImprovedValSetMulti>(IV));
 
 }
 
@@ -789,24 +1557,39 @@ inline bool copyImprovedVal(ShadowValue V, ImprovedValSet*& OutPB) {
 raw_ostream& operator<<(raw_ostream&, const IntegrationAttempt&);
 
 // PartialVal: a byte array with support functions for turning it into a Constant. 
+// Values of up to InlineBytes are stored inline rather than on the heap.
 struct PartialVal {
 
+  static const uint64_t InlineBytes = 64;
+
   uint64_t* partialBuf;
-  bool* partialValidBuf;
+  // One bit per byte of partialBuf, set once that byte is defined.
+  uint64_t* partialValidMask;
   uint64_t partialBufBytes;
   bool loadFinished;
 
+  uint64_t inlineBuf[InlineBytes / 8];
+  uint64_t inlineValidMask[InlineBytes / 64];
+
   bool addPartialVal(PartialVal& PV, const DataLayout* TD, std::string* error);
   bool isComplete();
   void combineWith(uint8_t* Other, uint64_t FirstDef, uint64_t FirstNotDef);
   void combineWith(PartialVal& Other, uint64_t FirstDef, uint64_t FirstNotDef);
   bool combineWith(Constant* C, uint64_t ConstOffset, uint64_t FirstDef, uint64_t FirstNotDef, std::string* error);
+  void fill(uint8_t Val);
   
   PartialVal(uint64_t nBytes);
   PartialVal(const PartialVal& Other);
   PartialVal& operator=(const PartialVal& Other);
   ~PartialVal();
 
+ private:
+
+  uint64_t maskWords() const { return (partialBufBytes + 63) / 64; }
+  void allocate();
+  void release();
+  bool allValid() const;
+
 };
 
 class UnaryPred {
@@ -832,22 +1615,28 @@ inline bool operator==(const ImprovedValSetSingle& PB1, const ImprovedValSetSing
     return false;
 
   if(PB1.Overdef)
-    return true;
+    return PB1.RangeBits == PB2.RangeBits && (PB1.RangeBits == 0 || (PB1.RangeLo == PB2.RangeLo && PB1.RangeHi == PB2.RangeHi));
 
   if(PB1.Values.size() != PB2.Values.size())
     return false;
 
-  // These are sets, so changing the order like this is acceptable
-  ImprovedValSetSingle* MPB1 = const_cast<ImprovedValSetSingle*>(&PB1);
-  ImprovedValSetSingle* MPB2 = const_cast<ImprovedValSetSingle*>(&PB2);
+  // These are sets, but usually built in the same order, so try a pointwise comparison first.
+  // Failing that check membership both ways for the remainder, which for sets no bigger than
+  // PBMAX is cheaper than sorting (and doesn't modify the operands).
+  uint32_t n = PB1.Values.size();
+  uint32_t i = 0;
+  while(i != n && PB1.Values[i] == PB2.Values[i])
+    ++i;
 
-  std::sort(MPB1->Values.begin(), MPB1->Values.end());
-  std::sort(MPB2->Values.begin(), MPB2->Values.end());
+  for(; i != n; ++i) {
 
-  for(unsigned i = 0; i < PB1.Values.size(); ++i)
-    if(PB1.Values[i] != PB2.Values[i])
+    if(std::find(PB2.Values.begin(), PB2.Values.end(), PB1.Values[i]) == PB2.Values.end())
+      return false;
+    if(std::find(PB1.Values.begin(), PB1.Values.end(), PB2.Values[i]) == PB1.Values.end())
       return false;
 
+  }
+
   return true;
 
 }
@@ -908,6 +1697,10 @@ class IAWalker {
  protected:
   WLItem makeWL(uint32_t x, ShadowBB* y) { return std::make_pair(x, y); }
 
+  // Whole-block items are recorded by stamping ShadowBB::walkEpoch with Epoch when this walker
+  // owns the stamps (only one walker can at a time); anything else goes in Visited.
+  uint64_t Epoch;
+  bool ownsStamps;
   DenseSet<WLItem> Visited;
   SmallVector<std::pair<WLItem, void*>, 8> Worklist1;
   SmallVector<std::pair<WLItem, void*>, 8> Worklist2;
@@ -929,6 +1722,8 @@ class IAWalker {
     return 0;
   }
   virtual void walkInternal() = 0;
+  virtual uint32_t wholeBlockIdx(ShadowBB*) = 0;
+  bool markVisited(WLItem);
 
   void* initialContext;
 
@@ -936,11 +1731,8 @@ class IAWalker {
 
   bool doIgnoreEdges;
 
- IAWalker(void* IC = 0, bool ign = false) : PList(&Worklist1), CList(&Worklist2), initialContext(IC), doIgnoreEdges(ign) {
-    
-    Contexts.push_back(initialContext);
-
- }
+  IAWalker(void* IC = 0, bool ign = false);
+  virtual ~IAWalker();
 
   void walk();
   void queueWalkFrom(uint32_t idx, ShadowBB*, void* context, bool copyContext);
@@ -956,6 +1748,7 @@ class BackwardIAWalker : public IAWalker {
   
   WalkInstructionResult walkFromInst(uint32_t, ShadowBB*, void* Ctx, ShadowInstruction*& StoppedCI);
   virtual void walkInternal();
+  virtual uint32_t wholeBlockIdx(ShadowBB* BB);
 
  public:
 
@@ -970,6 +1763,7 @@ class ForwardIAWalker : public IAWalker {
   
   WalkInstructionResult walkFromInst(uint32_t, ShadowBB*, void* Ctx, ShadowInstruction*& StoppedCI);
   virtual void walkInternal();
+  virtual uint32_t wholeBlockIdx(ShadowBB*) { return 0; }
   
  public:
 
@@ -1021,6 +1815,11 @@ protected:
 
   ShadowBB** BBs;
   uint32_t nBBs;
+  // Storage for all the ShadowBBs this context might create, with their instructions
+  // and successor flags, allocated when the first is created (see createBB).
+  char* bbSlab;
+  ShadowInstruction* slabInsts;
+  bool* slabSuccs;
   // BBsOffset: offset from indices in the BBs array to invarInfo.BBs.
   // For inlineAttempts this is 0; for loop iterations it is the index of the loop's header
   // within the invar info.
@@ -1032,6 +1831,10 @@ protected:
   bool integrationGoodnessValid;
   uint64_t residualInstructionsHere;
 
+  // For the -llpe-stats-file contexts report:
+  double analysisSeconds;
+  uint64_t fixpointIterationsHere;
+
   DenseMap<const ShadowLoopInvar*, PeelAttempt*> peelChildren;
 
   uint32_t pendingEdges;
@@ -1050,6 +1853,15 @@ protected:
 
   bool mayUnwind;
 
+  // Memory path conditions that, the last time their block was analysed, the store already
+  // showed to hold. Their runtime checks are implied by whatever established that and are not emitted.
+  DenseSet<PathCondition*> impliedPathConditions;
+
+  // The values the induction variables of unexpanded child loops hold when the loop exits, where the
+  // trip count could be found (see findClosedFormExitValues). Exit phis use these in place of the
+  // instructions' general-case values.
+  DenseMap<ShadowInstruction*, ShadowValue> closedFormExitValues;
+
  IntegrationAttempt(LLPEAnalysisPass* Pass, Function& _F, 
 		    const ShadowLoopInvar* _L, int depth, int sdepth) : 
     improvableInstructions(0),
@@ -1060,8 +1872,11 @@ protected:
     pass(Pass),
     F(_F),
     L(_L),
+    bbSlab(0),
     totalIntegrationGoodness(0),
     integrationGoodnessValid(false),
+    analysisSeconds(0),
+    fixpointIterationsHere(0),
     peelChildren(1),
     pendingEdges(0),
     barrierState(BARRIER_NONE),
@@ -1086,6 +1901,7 @@ protected:
   virtual bool edgeIsDead(ShadowBBInvar* BB1I, ShadowBBInvar* BB2I);
   bool edgeIsDeadRising(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I, bool ignoreThisScope = false);
   bool blockIsDeadRising(ShadowBBInvar& BBI);
+  void noteCFGChange();
 
   virtual bool entryBlockIsCertain() = 0;
   virtual bool entryBlockAssumed() = 0;
@@ -1128,6 +1944,7 @@ protected:
   ShadowBBInvar* getBBInvar(uint32_t idx) const;
   ShadowBB* createBB(uint32_t blockIdx);
   ShadowBB* createBB(ShadowBBInvar*);
+  void freeBBs();
   ShadowInstructionInvar* getInstInvar(uint32_t blockidx, uint32_t instidx);
   virtual ShadowInstruction* getInstFalling(ShadowBBInvar* BB, uint32_t instIdx) = 0;
   ShadowInstruction* getInst(uint32_t blockIdx, uint32_t instIdx);
@@ -1140,6 +1957,13 @@ protected:
   bool analyseBlockInstructions(ShadowBB* BB, bool inLoopAnalyser, bool inAnyLoop);
   bool analyseInstruction(ShadowInstruction* SI, bool inLoopAnalyser, bool inAnyLoop, bool& loadedVarargsHere, bool& bail);
   bool analyseLoop(const ShadowLoopInvar*, bool nestedLoop);
+  bool loopInputsChangedSince(const ShadowLoopInvar*, uint32_t clock);
+  bool tryReuseNestedLoop(const ShadowLoopInvar*);
+  void releaseNestedLoopResult(const ShadowLoopInvar*);
+  bool firstIterationValueUnknown(const ShadowLoopInvar* L, ShadowInstructionInvar* SII, uint32_t OpIdx, uint32_t depth);
+  bool loopProbablyUnbounded(const ShadowLoopInvar* L);
+  bool getSimpleInductionVar(const ShadowLoopInvar* L, ShadowInstruction* PN, APInt& Start, APInt& Step, ShadowInstructionInvar*& IncII);
+  void findClosedFormExitValues(const ShadowLoopInvar* L);
   void releaseLatchStores(const ShadowLoopInvar*);
   virtual void getInitialStore(bool inLoopAnalyser) = 0;
   // Toplevel, execute-only version:
@@ -1150,7 +1974,7 @@ protected:
   // Constant propagation:
   virtual bool tryEvaluateHeaderPHI(ShadowInstruction* SI, bool& resultValid, ImprovedValSet*& result);
   bool tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& loadedVararg);
-  bool getNewResult(ShadowInstruction* SI, ImprovedValSet*& NewResult, bool& loadedVararg);
+  bool getNewResult(ShadowInstruction* SI, ImprovedValSet*& NewResult, bool& loadedVararg, ImprovedValSetSingle* MergeScratch = 0);
   bool tryEvaluateOrdinaryInst(ShadowInstruction* SI, ImprovedValSet*& NewPB);
   bool tryEvaluateOrdinaryInst(ShadowInstruction* SI, ImprovedValSetSingle& NewPB, std::pair<ValSetType, ImprovedVal>* Ops, uint32_t OpIdx);
   void tryEvaluateResult(ShadowInstruction* SI, 
@@ -1159,6 +1983,7 @@ protected:
 			 unsigned char* needsRuntimeCheck);
   bool tryFoldBitwiseOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, ValSetType& ImpType, ImprovedVal& Improved);
   unsigned getAlignment(ShadowValue);
+  bool getKnownLowBits(const ImprovedVal& IV, uint64_t& KnownMask, uint64_t& KnownBits);
   bool tryFoldPtrAsIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, ValSetType& ImpType, ImprovedVal& Improved);
   bool tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, ValSetType& ImpType, ImprovedVal& Improved, unsigned char* needsRuntimeCheck);
   bool tryFoldNonConstCmp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, ValSetType& ImpType, ImprovedVal& Improved);
@@ -1166,9 +1991,10 @@ protected:
   void getExitPHIOperands(ShadowInstruction* SI, uint32_t valOpIdx, SmallVector<ShadowValue, 1>& ops, SmallVector<ShadowBB*, 1>* BBs = 0);
   void getOperandRising(ShadowInstruction* SI, uint32_t valOpIdx, ShadowBBInvar* ExitingBB, ShadowBBInvar* ExitedBB, SmallVector<ShadowValue, 1>& ops, SmallVector<ShadowBB*, 1>* BBs);
   void getCommittedExitPHIOperands(ShadowInstruction* SI, uint32_t valOpIdx, SmallVector<ShadowValue, 1>& ops, SmallVector<ShadowBB*, 1>* BBs);
-  bool tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*& NewPB);
-  bool getMergeValue(SmallVector<ShadowValue, 4>& Vals, ImprovedValSet*& NewPB);
+  bool tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*& NewPB, ImprovedValSetSingle* Scratch = 0);
+  bool getMergeValue(SmallVector<ShadowValue, 4>& Vals, ImprovedValSet*& NewPB, ImprovedValSetSingle* Scratch = 0);
   bool tryEvaluateMultiInst(ShadowInstruction* I, ImprovedValSet*& NewPB);
+  bool tryEvaluateVectorInst(ShadowInstruction* SI, ImprovedValSet*& NewIV, bool anyMultis);
   bool tryEvaluateMultiCmp(ShadowInstruction* SI, ImprovedValSet*& NewIV);
   MultiCmpResult tryEvaluateMultiEq(ShadowInstruction* SI);
   bool tryGetPathValue(ShadowValue V, ShadowBB* UserBlock, std::pair<ValSetType, ImprovedVal>& Result);
@@ -1195,15 +2021,17 @@ protected:
 
   InlineAttempt* getInlineAttempt(ShadowInstruction* CI) {
     // Only calls and invokes use tSD at the moment, so no need for a check.
-    return (InlineAttempt*)CI->typeSpecificData;
+    return (InlineAttempt*)CI->getTypeSpecificData();
   }
   virtual bool stackIncludesCallTo(Function*) = 0;
   bool shouldInlineFunction(ShadowInstruction*, Function*);
   InlineAttempt* getOrCreateInlineAttempt(ShadowInstruction* CI, bool& created, bool& needsAnalyse);
-  bool callCanExpand(ShadowInstruction* Call, InlineAttempt*& Result);
+  bool callCanExpand(ShadowInstruction* Call, InlineAttempt*& Result, bool& recursive);
+  bool isOverContextBudget();
   bool analyseExpandableCall(ShadowInstruction* SI, bool& changed, bool inLoopAnalyser, bool inAnyLoop);
  
   PeelAttempt* getPeelAttempt(const ShadowLoopInvar*);
+  void getOrderedPeelChildren(SmallVectorImpl<PeelAttempt*>&);
   PeelAttempt* getOrCreatePeelAttempt(const ShadowLoopInvar*);
 
   // Load forwarding:
@@ -1212,9 +2040,18 @@ protected:
   bool tryResolveLoadFromVararg(ShadowInstruction* LoadI, ImprovedValSet*& Result);
   bool tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*& NewPB, bool& loadedVararg);
   bool getConstantString(ShadowValue Ptr, ShadowInstruction* SearchFrom, std::string& Result);
+  bool getCallMemoKey(ShadowInstruction* SI, std::string& Key);
+  bool tryUseCallMemo(ShadowInstruction* SI, const std::string& Key);
+  void noteCallMemo(ShadowInstruction* SI, const std::string& Key);
+  bool tryUseLibrarySummary(ShadowInstruction* SI);
+  bool canSummariseCall(ShadowInstruction* SI);
+  void noteLibrarySummary(ShadowInstruction* SI);
+  bool tryNativeStringCall(ShadowInstruction* SI);
   virtual void applyMemoryPathConditions(ShadowBB*, bool inLoopAnalyser, bool inAnyLoop);
+  void applyPathConditionsFromBlock(std::vector<PathCondition>&, PathConditionIndex&, PathConditionTypes, ShadowBB*, uint32_t, bool inLoopAnalyser);
   void applyMemoryPathConditionsFrom(ShadowBB*, PathConditions&, uint32_t, bool inLoopAnalyser, bool inAnyLoop);
-  void applyPathCondition(PathCondition*, PathConditionTypes, ShadowBB*, uint32_t);
+  void applyPathCondition(PathCondition*, PathConditionTypes, ShadowBB*, uint32_t, bool inLoopAnalyser);
+  uint32_t countImpliedPathConditions(BasicBlock* BB);
 
   AllocData* getAllocData(ShadowValue);
   ShadowInstruction* getAllocInst(ShadowValue V);
@@ -1234,6 +2071,8 @@ protected:
   virtual ReadFile* tryGetReadFile(ShadowInstruction* CI);
   bool tryPromoteOpenCall(ShadowInstruction* CI);
   bool tryResolveVFSCall(ShadowInstruction*);
+  bool tryPromoteFopenCall(ShadowInstruction*, Function*);
+  bool tryResolveStdioCall(ShadowInstruction*, Function*, const CallClassInfo&);
   bool executeStatCall(ShadowInstruction* SI, Function* F, std::string& Filename);
   WalkInstructionResult isVfsCallUsingFD(ShadowInstruction* VFSCall, ShadowInstruction* FD, bool ignoreClose);
   virtual void resolveReadCall(ShadowInstruction*, struct ReadFile);
@@ -1243,6 +2082,7 @@ protected:
   bool isUnusedReadCall(ShadowInstruction*);
   OpenStatus& getOpenStatus(ShadowInstruction*);
   void tryKillAllVFSOps();
+  bool containsFDUsers();
   void initialiseFDStore(FDStore*);
 
   // Load forwarding extensions for varargs:
@@ -1251,10 +2091,12 @@ protected:
   // Dead store and allocation elim:
 
   void DSEHandleRead(ShadowValue PtrOp, uint64_t Size, ShadowBB* BB);
+  void DSEHandleCallArgReads(ShadowInstruction* I, Function* F, ShadowBB* BB);
   void DSEHandleWrite(ShadowValue PtrOp, uint64_t Size, ShadowInstruction* Writer, ShadowBB* BB);
   void tryKillStoresInLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool disableWrites, bool latchToHeader = false);
   void tryKillStoresInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool disableWrites);
   void DSEAnalyseInstruction(ShadowInstruction* I, bool commitDisabledHere, bool disableWrites, bool enterCalls, bool& bail);
+  void DSEAnalyseInstructions(ShadowBB* BB, uint32_t& from, uint32_t to);
 
   // User visitors:
   
@@ -1288,8 +2130,12 @@ protected:
   // Estimating inlining / unrolling benefit:
 
   virtual void findProfitableIntegration();
+  int64_t getOwnIntegrationGoodness();
+  void updateIntegrationGoodness(int64_t Delta);
   virtual void findResidualFunctions(DenseSet<Function*>&, DenseMap<Function*, unsigned>&);
   int64_t getResidualInstructions();
+  int64_t estimateOutputInstructions();
+  void collectBudgetCandidates(std::vector<PeelAttempt*>&);
 
   // DOT export:
 
@@ -1303,7 +2149,7 @@ protected:
   void describeAsDOT(raw_ostream& Out, std::string& otherpath, bool brief);
   std::string getValueColour(ShadowValue, std::string& textColour, bool plain = false);
   std::string getGraphPath(std::string prefix);
-  void describeTreeAsDOT(std::string path);
+  void describeTreeAsDOT(const std::string& path, DOTTreeWriter& W);
   virtual bool getSpecialEdgeDescription(ShadowBBInvar* FromBB, ShadowBBInvar* ToBB, raw_ostream& Out) = 0;
   bool blockLiveInAnyScope(ShadowBBInvar* BB);
   virtual void printPathConditions(raw_ostream& Out, ShadowBBInvar* BBI, ShadowBB* BB);
@@ -1322,6 +2168,7 @@ protected:
   // Data export for the Integrator pass:
 
   virtual std::string getShortHeader() = 0;
+  virtual void describeContextStats(ContextStats&) = 0;
   bool hasChildren();
   virtual bool canDisable() = 0;
   unsigned getTotalInstructions();
@@ -1354,6 +2201,7 @@ protected:
   bool trySynthMTI(ShadowInstruction* I, BasicBlock* emitBB);
   Value* trySynthVal(ShadowValue* I, Type* targetType, ValSetType Ty, const ImprovedVal& IV, BasicBlock* emitBB);
   bool trySynthInst(ShadowInstruction* I, BasicBlock* emitBB, Value*& Result);
+  bool tryEmitThreadLocalRMW(ShadowInstruction* I, BasicBlock* emitBB);
   bool trySynthArg(ShadowArg* A, BasicBlock* emitBB, Value*& Result);
   void emitOrSynthInst(ShadowInstruction* I, ShadowBB* BB, SmallVector<CommittedBlock, 1>::iterator& emitBB);
   void commitLoopInstructions(const ShadowLoopInvar* ScopeL, uint32_t& i);
@@ -1368,12 +2216,16 @@ protected:
   Value* getCommittedValueOrBlock(ShadowInstruction* I, uint32_t idx, ConstantInt*& failValue, BasicBlock*& failBlock);
   BasicBlock* getInvokeNormalSuccessor(ShadowInstruction*, bool& toCheckBlock);
   void releaseMemoryPostCommit();
+  bool discardPeelAttempt(PeelAttempt* LPA);
+  void rerollPeeledLoops();
   BasicBlock* createBasicBlock(LLVMContext& Ctx, const Twine& Name, Function* AddF, bool isEntryBlock, bool isFailedBlock);
   BasicBlock* CloneBasicBlockFrom(const BasicBlock* BB,
 				  ValueToValueMapTy& VMap,
 				  const Twine &NameSuffix, 
 				  Function* F,
-				  uint32_t startIdx);
+				  uint32_t startIdx,
+				  uint32_t endIdx);
+  void setCommittedDebugLoc(Instruction* NewI);
   void addPatchRequest(ShadowValue Needed, Instruction* PatchI, uint32_t PatchOp);
   virtual void inheritCommitBlocksAndFunctions(std::vector<BasicBlock*>& NewCBs, std::vector<BasicBlock*>& NewFCBs, std::vector<Function*>& NewFs) = 0;
   void markAllocationsAndFDsCommitted();
@@ -1409,20 +2261,24 @@ protected:
   virtual void populateFailedHeaderPHIs(const ShadowLoopInvar*);
   Value* emitCompareCheck(Value* realInst, const ImprovedValSetSingle* IVS, BasicBlock* emitBB);
   Instruction* emitCompositeCheck(Value*, Value*, BasicBlock* emitBB);
+  Instruction* emitMemcmpCheck(Value*, Constant*, BasicBlock* emitBB);
   Value* emitAsExpectedCheck(ShadowInstruction* SI, BasicBlock* emitBB);
   SmallVector<CommittedBlock, 1>::iterator emitExitPHIChecks(SmallVector<CommittedBlock, 1>::iterator emitIt, ShadowBB* BB);
   Value* emitMemcpyCheck(ShadowInstruction* SI, BasicBlock* emitBB);
   SmallVector<CommittedBlock, 1>::iterator emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterator emitIt, ShadowInstruction* SI);
+  SmallVector<CommittedBlock, 1>::iterator emitCoalescedLoadChecks(SmallVector<CommittedBlock, 1>::iterator emitIt, ShadowBB* BB, uint32_t lastIdx);
   SmallVector<CommittedBlock, 1>::iterator emitPathConditionChecks(ShadowBB* BB);
   ShadowValue getPathConditionSV(uint32_t instStackIdx, BasicBlock* instBB, uint32_t instIdx);
   ShadowValue getPathConditionSV(PathCondition& Cond);
   void emitPathConditionCheck(PathCondition& Cond, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
-  void emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
+  void emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionIndex& Index, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
   void emitPathConditionChecks2(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& it);
+  Value* getPathFuncVerifyArg(PathFunc& PF, uint32_t argIdx, BasicBlock* emitBlock);
+  void emitBatchedPathFuncCheck(ShadowBB* BB, PathConditions& PC, const PathConditionIndex::Entries& Funcs, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
   bool hasSpecialisedCompanion(ShadowBBInvar* BBI);
   void gatherPathConditionEdges(uint32_t bbIdx, uint32_t instIdx, SmallVector<std::pair<Value*, BasicBlock*>, 4>* preds, SmallVector<std::pair<BasicBlock*, IntegrationAttempt*>, 4>* IApreds);
   virtual void noteAsExpectedChecks(ShadowBB* BB);
-  void noteAsExpectedChecksFrom(ShadowBB* BB, std::vector<PathCondition>& PCs, uint32_t stackIdx);
+  void noteAsExpectedChecksFrom(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx);
   bool requiresBreakCode(ShadowInstruction*);
   bool subblockEndsWithSpecialTest(uint32_t idx,
 				   SmallVector<std::pair<BasicBlock*, uint32_t>, 1>::iterator it, 
@@ -1446,6 +2302,7 @@ protected:
   void findTentativeLoadsInUnboundedLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool secondPass);
   void TLAnalyseInstruction(ShadowInstruction&, bool commitDisabledHere, bool secondPass, bool inLoopAnalyser);
   bool requiresRuntimeCheck2(ShadowValue V, bool includeSpecialChecks);
+  virtual bool checkMadeByFirstIteration(ShadowInstruction* SI) { return false; }
   bool containsTentativeLoads();
   void addCheckpointFailedBlocks();
   void squashUnavailableObjects(ShadowInstruction& SI, ImprovedValSet*, bool inLoopAnalyser);
@@ -1497,6 +2354,8 @@ class PeelIteration : public IntegrationAttempt {
 public:
 
   PeelIteration(LLPEAnalysisPass* Pass, IntegrationAttempt* P, PeelAttempt* PP, Function& F, int iter, int depth);
+
+  PeelAttempt* getParentPA() { return parentPA; }
  
   IntegrationAttempt* parent;
 
@@ -1528,6 +2387,7 @@ public:
   virtual void collectAllLoopStats(); 
 
   virtual std::string getShortHeader(); 
+  virtual void describeContextStats(ContextStats&);
 
   virtual bool canDisable(); 
   virtual bool isEnabled(); 
@@ -1554,6 +2414,7 @@ public:
   virtual void emitPHINode(ShadowBB* BB, ShadowInstruction* I, BasicBlock* emitBB);
   virtual bool tryEvaluateHeaderPHI(ShadowInstruction* SI, bool& resultValid, ImprovedValSet*& result);
   virtual void visitExitPHI(ShadowInstructionInvar* UserI, DIVisitor& Visitor);
+  virtual bool checkMadeByFirstIteration(ShadowInstruction* SI);
 
   virtual void getInitialStore(bool inLoopAnalyser);
 
@@ -1583,6 +2444,14 @@ public:
 
 class ProcessExternalCallback;
 
+enum DeadRisingStatus {
+
+  DEADRISING_UNKNOWN,
+  DEADRISING_DEAD,
+  DEADRISING_ALIVE
+
+};
+
 class PeelAttempt {
    // Not a subclass of IntegrationAttempt -- this is just a helper.
 
@@ -1620,8 +2489,22 @@ class PeelAttempt {
    PeelIteration* getOrCreateIteration(unsigned iter); 
 
    void visitVariant(ShadowInstructionInvar* VI, DIVisitor& Visitor); 
+   // During the parent context's DIE, whether any iteration keeps each in-loop user
+   // of an invariant alive (for users that don't care which operand is asked about).
+   DenseMap<ShadowInstructionInvar*, bool> DIEUserLive;
+   // With -llpe-alloc-site-limit, the allocations each in-loop allocation site has made in distinct
+   // heap objects so far, and the heap index of the summary object that stands for any beyond that.
+   DenseMap<ShadowInstructionInvar*, std::pair<uint32_t, int32_t> > allocSites;
+   // Whether each block of L, then each successor edge, is dead in every iteration (as found by walking
+   // them and their own child loops), indexed from the header: DEADRISING_UNKNOWN until first asked.
+   // Forgotten when the CFG of any context within changes; deadRisingConsulted notes whether there's anything to forget.
+   std::vector<uint8_t> deadRisingCache;
+   bool deadRisingConsulted;
+   bool blockIsDeadInAllIterations(ShadowBBInvar& BBI);
+   bool edgeIsDeadInAllIterations(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I);
+   bool clearDeadRisingCache();
    
-   void describeTreeAsDOT(std::string path); 
+   void describeTreeAsDOT(const std::string& path, DOTTreeWriter& W); 
 
    void collectStats(); 
    void printHeader(raw_ostream& OS) const; 
@@ -1641,6 +2524,9 @@ class PeelAttempt {
 
    int64_t getResidualInstructions(); 
    void findProfitableIntegration();
+   void updateIntegrationGoodness(int64_t Delta);
+   int64_t estimateOutputInstructions();
+   int64_t getUnpeeledInstructions();
 
    bool isTerminated() {
      return Iterations.back()->iterStatus == IterationStatusFinal;
@@ -1674,16 +2560,29 @@ IATargetInfo(uint32_t tCB, uint32_t tCI, uint32_t tSD) :
 
 };
 
+struct CanonicalStore;
+
 struct SharingState {
 
   OrdinaryLocalStore* storeAtEntry;
   DenseMap<ShadowValue, ImprovedValSet*> externalDependencies;
+  // Locations read during analysis; externalDependencies is filled in from these only once
+  // the context has been analysed and could be shared.
+  DenseSet<ShadowValue> dependencyReads;
+  bool dependenciesMaterialised;
+  // Canonical forms of externalDependencies, built as needed by storesEqualDeep.
+  DenseMap<ShadowValue, CanonicalStore*> canonicalDependencies;
   SmallPtrSet<ShadowInstruction*, 4> escapingMallocs;
+  uint64_t argsFingerprint;
 
-SharingState() : storeAtEntry(0) { }
+SharingState() : storeAtEntry(0), dependenciesMaterialised(false), argsFingerprint(0) { }
 
 };
 
+#define FDUSE_UNKNOWN 0
+#define FDUSE_NO 1
+#define FDUSE_YES 2
+
 class InlineAttempt : public IntegrationAttempt { 
 
  public:
@@ -1697,6 +2596,9 @@ class InlineAttempt : public IntegrationAttempt {
   IntegrationAttempt* uniqueParent;
 
   Function* CommitF;
+  DILocation* debugInlinedAt;
+  bool debugInlinedAtValid;
+  DILocation* getDebugInlinedAt();
   Function::iterator firstFailedBlock;
   std::vector<BasicBlock*> CommitBlocks;
   std::vector<BasicBlock*> CommitFailedBlocks;
@@ -1723,18 +2625,30 @@ class InlineAttempt : public IntegrationAttempt {
   bool isPathCondition : 1;
   bool enabled : 1;
   bool isStackTop : 1;
+  bool overBudget : 1;
+  // Memo for mayUseFDs: FDUSE_UNKNOWN until first asked.
+  uint8_t fdUseSummary;
 
   IATargetInfo* targetCallInfo;
 
+  // When analysis of this context began, for -llpe-context-time-limit and -llpe-context-mem-limit.
+  double budgetStartTime;
+  long budgetStartRSS;
+  void startBudget();
+
   SharingState* sharing;
 
-  DominatorTree* DT;
   SmallDenseMap<uint32_t, uint32_t, 8>* blocksReachableOnFailure;
   std::vector<SmallVector<std::pair<BasicBlock*, uint32_t>, 1> > failedBlocks;
   ValueToValueMapTy* failedBlockMap;
   // Indexes from CLONED instruction/block to replacement PHI node to use in that block.
   DenseMap<std::pair<Instruction*, BasicBlock*>, PHINode*>* PHIForwards;
   DenseSet<PHINode*>* ForwardingPHIs;
+  // Per block, the value-independent reasons failed-path forwarding must merge at its top, found once
+  // for all of the function's forwarded values (FAILMERGE_* flags; see getFailedMergeKind).
+  std::vector<uint8_t>* failedMergeKinds;
+  // Scratch for createForwardingPHIs, reused across forwarded values.
+  std::vector<std::pair<Instruction*, uint32_t> > forwardPredBlocks;
 
   TLLocalStore* backupTlStore;
   DSELocalStore* backupDSEStore;
@@ -1756,6 +2670,7 @@ class InlineAttempt : public IntegrationAttempt {
   }
 
   bool isOwnCallUnused(); 
+  bool mayUseFDs();
 
   virtual bool getSpecialEdgeDescription(ShadowBBInvar* FromBB, ShadowBBInvar* ToBB, raw_ostream& Out); 
   
@@ -1765,6 +2680,7 @@ class InlineAttempt : public IntegrationAttempt {
   virtual void collectAllLoopStats(); 
 
   virtual std::string getShortHeader(); 
+  virtual void describeContextStats(ContextStats&);
 
   virtual bool canDisable(); 
   virtual bool isEnabled(); 
@@ -1776,11 +2692,20 @@ class InlineAttempt : public IntegrationAttempt {
 
   int64_t NonFPArgIdxToArgIdx(int64_t idx);
   int64_t FPArgIdxToArgIdx(int64_t idx);
+  // The vararg indices of the non-FP and FP varargs in order, built from varArgIdxsCaller's
+  // arguments on first use by the two functions above. Incomplete if a vararg of
+  // another type stopped the lists short.
+  SmallVector<int64_t, 4> nonFPVarArgIdxs;
+  SmallVector<int64_t, 4> fpVarArgIdxs;
+  ShadowInstruction* varArgIdxsCaller;
+  bool varArgIdxsComplete;
+  void buildVarArgIdxs();
 
   virtual bool stackIncludesCallTo(Function*); 
 
   virtual void findResidualFunctions(DenseSet<Function*>&, DenseMap<Function*, unsigned>&); 
   virtual void findProfitableIntegration(); 
+  void applyOutputBudget();
 
   virtual WalkInstructionResult queuePredecessorsBW(ShadowBB* FromBB, BackwardIAWalker* Walker, void* ctx);
   virtual void queueSuccessorsFW(ShadowBB* BB, ForwardIAWalker* Walker, void* ctx);
@@ -1810,11 +2735,17 @@ class InlineAttempt : public IntegrationAttempt {
   // Function sharing:
 
   void clearExternalDependencies();
+  void materialiseDependencies();
+  void releaseSharingState();
   virtual void sharingInit();
   void dumpSharingState();
   virtual void sharingCleanup();
   bool matchesCallerEnvironment(ShadowInstruction* SI);
+  bool storesEqualDeep(ShadowValue V, ImprovedValSet* CallStore, ImprovedValSet* DepStore);
+  uint64_t getArgsFingerprint();
   InlineAttempt* getWritableCopyFrom(ShadowInstruction* SI);
+  bool canCopyAnalysis();
+  void copyAnalysisTo(InlineAttempt* Copy);
   void dropReferenceFrom(ShadowInstruction* SI);
 
   virtual IntegrationAttempt* getIAForScopeFalling(const ShadowLoopInvar* Scope);
@@ -1847,6 +2778,8 @@ class InlineAttempt : public IntegrationAttempt {
   void gatherSpecToUnspecEdges(uint32_t predBlockIdx, uint32_t BBIdx, ShadowInstIdx predOp, 
 			       Value* predV, SmallVector<std::pair<Value*, BasicBlock*>, 4>& newPreds);
   bool isSimpleMergeBlock(uint32_t i);
+  uint8_t getFailedMergeKind(uint32_t BBIdx);
+  bool failedLoopHasBreaks(const ShadowLoopInvar* LInfo);
   BasicBlock::iterator skipMergePHIs(BasicBlock::iterator it);
   void createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruction* NewI);
   Value* getLocalFailedValue(Value* V, BasicBlock*);
@@ -1864,6 +2797,7 @@ class InlineAttempt : public IntegrationAttempt {
   void tryKillStores(bool commitDisabledHere, bool disableWrites);
 
   void findTentativeLoads(bool commitDisabledHere, bool secondPass);
+  bool canSkipStoreWalks();
 
   virtual void printPathConditions(raw_ostream& Out, ShadowBBInvar* BBI, ShadowBB* BB);
   virtual void noteAsExpectedChecks(ShadowBB* BB);
@@ -1931,7 +2865,7 @@ IAIterator(const IAIterator& other) : parent(other.parent), blockIdx(other.block
       
 	for(; instIdx < parent->BBs[blockIdx]->insts.size(); ++instIdx) {
 	  
-	  if(parent->BBs[blockIdx]->insts[instIdx].typeSpecificData)
+	  if(parent->BBs[blockIdx]->insts[instIdx].getTypeSpecificData())
 	    return;
 	  
 	}
@@ -1973,7 +2907,7 @@ IAIterator(const IAIterator& other) : parent(other.parent), blockIdx(other.block
 
     release_assert(blockIdx < parent->nBBs);
     ShadowInstruction* SI = &parent->BBs[blockIdx]->insts[instIdx];
-    D = std::make_pair(SI, (InlineAttempt*)SI->typeSpecificData);
+    D = std::make_pair(SI, (InlineAttempt*)SI->getTypeSpecificData());
     return D;
     
   }
@@ -2028,14 +2962,17 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  Constant* getConstReplacement(Value*, IntegrationAttempt*);
  Constant* intFromBytes(const uint64_t*, unsigned, unsigned, llvm::LLVMContext&);
  
- // Implemented in Transforms/Integrator/SimpleVFSEval.cpp, so only usable with -integrator
- bool getFileBytes(std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors);
+ // Implemented in VFSOps.cpp. Yields a ConstantDataArray (or ConstantAggregateZero if the bytes are all zero).
+ bool getFileBytes(const std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, Constant*& arrayBytes, LLVMContext& Context, std::string& errors);
+ bool getReadCallBytes(ShadowInstruction* SI, const std::string& Filename, uint64_t Offset, uint64_t Size, bool nulTerminate, Constant*& arrayBytes, std::string& errors);
+ FileSnapshot* getFileSnapshot(const std::string& Filename);
+ int getSnapshotStat(const std::string& Filename, struct stat& St);
 
  // Implemented in VMCore/AsmWriter.cpp, since that file contains a bunch of useful private classes
  // if LLVM has been patched appropriately; otherwise stubbed out with simple implementations in Print.cpp.
  PersistPrinter* getPersistPrinter(Module*);
  void getInstructionsText(PersistPrinter*, const Function* IF, DenseMap<const Value*, std::string>& IMap, DenseMap<const Value*, std::string>& BriefMap);
- void getGVText(PersistPrinter*, const Module* M, DenseMap<const GlobalVariable*, std::string>& GVMap, DenseMap<const GlobalVariable*, std::string>& BriefGVMap);
+ void getGVText(PersistPrinter*, const Module* M, const GlobalVariable* Want, DenseMap<const GlobalVariable*, std::string>& GVMap, DenseMap<const GlobalVariable*, std::string>& BriefGVMap);
 
  bool isGlobalIdentifiedObject(ShadowValue VC);
  bool shouldQueueOnInst(Instruction* I, IntegrationAttempt* ICtx);
@@ -2051,6 +2988,7 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  bool instructionCounts(Instruction* I);
 
  Function* getCalledFunction(ShadowInstruction*);
+ bool getCalledFunctionCandidates(ShadowInstruction*, SmallVector<Function*, 4>& Candidates, uint32_t maxCandidates);
 
  int64_t getSpilledVarargAfter(ShadowInstruction* CI, int64_t OldArg);
 
@@ -2076,6 +3014,10 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void getIVSSubVals(const ImprovedValSetSingle& Src, uint64_t Offset, uint64_t Size, int64_t OffsetAbove, SmallVector<IVSRange, 4>& Dest);
  void getIVSSubVal(const ImprovedValSetSingle& Src, uint64_t Offset, uint64_t Size, ImprovedValSetSingle& Dest);
  void getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetSize, int64_t OffsetAbove, SmallVector<IVSRange, 4>& Dest);
+ bool readConstantImage(Constant* C, uint64_t Offset, uint64_t Size, int64_t OffsetAbove, SmallVector<IVSRange, 4>& Dest);
+ void openSpillFile(const std::string& Path);
+ void* allocContextSlab(uint64_t Size);
+ void freeContextSlab(void* Slab);
  Constant* valsToConst(SmallVector<IVSRange, 4>& subVals, uint64_t TargetSize, Type* targetType);
  void getConstSubVal(ShadowValue FromSV, uint64_t Offset, uint64_t TargetSize, Type* TargetType, ImprovedValSetSingle& Result);
  Constant* getSubConst(Constant* FromC, uint64_t Offset, uint64_t TargetSize, Type* targetType = 0);
@@ -2091,14 +3033,16 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void readValRangeMulti(ShadowValue& V, uint64_t Offset, uint64_t Size, ShadowBB* ReadBB, SmallVector<IVSRange, 4>& Results);
  void executeMemcpyInst(ShadowInstruction* MemcpySI);
  void executeVaCopyInst(ShadowInstruction* SI);
- void executeAllocInst(ShadowInstruction* SI, AllocData&, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx);
+ void executeAllocInst(ShadowInstruction* SI, AllocData&, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx, uint64_t SizeBound = ULONG_MAX);
  void executeAllocaInst(ShadowInstruction* SI);
  void executeMallocLikeInst(ShadowInstruction* SI);
  void executeReallocInst(ShadowInstruction* SI, Function*);
  void executeFreeInst(ShadowInstruction* SI, Function*);
  void executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& SrcPtrSet, uint64_t Size, ShadowInstruction*);
+ SmallVector<IVSRange, 4>* getMemcpyValues(ShadowInstruction* CopySI);
+ void forgetMemcpyValues(ShadowInstruction* CopySI);
  void executeVaStartInst(ShadowInstruction* SI);
- void executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uint64_t FileOffset, uint64_t Size);
+ void executeReadInst(ShadowInstruction* ReadSI, ShadowValue Ptr, std::string& Filename, uint64_t FileOffset, uint64_t Size, bool nulTerminate = false);
  void executeUnexpandedCall(ShadowInstruction* SI);
  bool clobberSyscallModLocations(Function* F, ShadowInstruction* SI);
  void executeWriteInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& ValPB, uint64_t PtrSize, ShadowInstruction*);
@@ -2120,9 +3064,8 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  ShadowValue& getAllocWithIdx(int32_t);
  AllocData& addHeapAlloc(ShadowInstruction*);
 
- IntegratorTag* searchFunctions(IntegratorTag* thisTag, std::string&, IntegratorTag*& startAt);
 
- GlobalVariable* getStringArray(std::string& bytes, Module& M, bool addNull=false);
+ GlobalVariable* getStringArray(StringRef bytes, Module& M, bool addNull=false);
 
  uint32_t findBlock(ShadowFunctionInvar* SFI, BasicBlock* BB);
  uint32_t findBlock(ShadowFunctionInvar* SFI, StringRef name);
@@ -2133,17 +3076,25 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  Value* getValAsType(Value* V, Type* Ty, BasicBlock* insertAtEnd);
 
  void valueEscaped(ShadowValue, ShadowBB*);
- void intersectSets(DenseSet<ShadowValue>* Target, MutableArrayRef<DenseSet<ShadowValue>* > Merge);
+ const char* getForwardFailureName(unsigned char);
+ void materializeBody(Function&);
+ void materializeModule(Module&);
+ void TLDump(IntegrationAttempt*);
+ void DSEDump(IntegrationAttempt*);
 
  bool requiresRuntimeCheck(ShadowValue V, bool includeSpecialChecks);
- PHINode* makePHI(Type* Ty, const Twine& Name, BasicBlock* emitBB);
+ PHINode* makePHI(Type* Ty, const Twine& Name, BasicBlock* emitBB, uint32_t NumReservedValues = 0);
  
  void printPathCondition(PathCondition& PC, PathConditionTypes t, ShadowBB* BB, raw_ostream& Out, bool HTMLEscaped);
  void emitRuntimePrint(BasicBlock* BB, std::string& message, Value* param, Instruction* insertBefore = 0);
+ BranchInst* createCheckBranch(Value* Cond, bool failIfTrue, BasicBlock* passTarget, BasicBlock* failTarget, BasicBlock* emitBB);
  void escapePercent(std::string&);
+ bool checkCoalescesWithNext(ShadowBB* BB, uint32_t idx);
+ bool checkCoalescesWithPrev(ShadowBB* BB, uint32_t idx);
+ void coalesceVFSChecks(ShadowBB* BB);
 
  void clearAsExpectedChecks(ShadowBB*);
- void noteLLIODependency(std::string&);
+ void noteLLIODependency(std::string&, bool statted = false);
 
  const GlobalValue* getUnderlyingGlobal(const GlobalValue* V);
 
@@ -2182,8 +3133,11 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  Module* getGlobalModule();
  void setAllNeededTop(DSELocalStore*);
  bool IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, SmallVector<uint64_t, 4>& OpInts, ValSetType& ImpType, ImprovedVal& Improved);
+ bool IHPFoldIntSets(ShadowInstruction* SI, ImprovedValSetSingle& NewPB);
+ void IHPMergeIntRanges(SmallVector<ShadowValue, 4>& Vals, ImprovedValSetSingle& NewPB);
+ unsigned getGlobalAlignment(GlobalVariable* GV);
  void DeleteDeadInstruction(Instruction *I);
- void createTopOrderingFrom(BasicBlock* BB, std::vector<BasicBlock*>& Result, SmallSet<BasicBlock*, 8>& Visited, LoopInfo* LI, const Loop* MyL);
+ void createTopOrderingFrom(BasicBlock* BB, std::vector<BasicBlock*>& Result, LoopInfo* LI, Function::iterator excludeFrom);
 
  extern char ihp_workdir[];
  extern bool IHPSaveDOTFiles;
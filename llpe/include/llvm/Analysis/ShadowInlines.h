@@ -44,6 +44,68 @@ template<typename T> class ImmutableArray {
 
 };
 
+// Append-only sequence kept in fixed-size chunks, so that elements never move once added: growing it
+// copies nothing, and references to its elements stay valid.
+template<typename T, unsigned ChunkShift = 10> class ChunkedVector {
+
+  std::vector<T*> chunks;
+  size_t n;
+
+  static const size_t ChunkSize = ((size_t)1) << ChunkShift;
+
+  ChunkedVector(const ChunkedVector&);
+  ChunkedVector& operator=(const ChunkedVector&);
+
+ public:
+
+ ChunkedVector() : n(0) { }
+
+  ~ChunkedVector() {
+    clear();
+  }
+
+  T& operator[](size_t i) {
+    return chunks[i >> ChunkShift][i & (ChunkSize - 1)];
+  }
+
+  const T& operator[](size_t i) const {
+    return chunks[i >> ChunkShift][i & (ChunkSize - 1)];
+  }
+
+  size_t size() const {
+    return n;
+  }
+
+  bool empty() const {
+    return n == 0;
+  }
+
+  T& back() {
+    return (*this)[n - 1];
+  }
+
+  void push_back(const T& V) {
+
+    if((n >> ChunkShift) == chunks.size())
+      chunks.push_back((T*)::operator new(ChunkSize * sizeof(T)));
+    new(&chunks[n >> ChunkShift][n & (ChunkSize - 1)]) T(V);
+    ++n;
+
+  }
+
+  void clear() {
+
+    for(size_t i = 0; i != n; ++i)
+      (*this)[i].~T();
+    for(typename std::vector<T*>::iterator it = chunks.begin(), itend = chunks.end(); it != itend; ++it)
+      ::operator delete(*it);
+    chunks.clear();
+    n = 0;
+
+  }
+
+};
+
 // Just a tagged union of the types of values that can come out of getOperand.
 enum ShadowValType {
 
@@ -111,6 +173,12 @@ enum ValSetType {
 
 };
 
+// With LLPE_PACKED_VALUES ShadowValues and ImprovedVals are packed to 4-byte alignment, removing the padding
+// after the type tag: ShadowValue shrinks from 16 to 12 bytes and ImprovedVal from 24 to 20. This costs some
+// misaligned 8-byte accesses (cheap on x86-64 and AArch64) to save memory in large value sets and stores.
+#ifdef LLPE_PACKED_VALUES
+#pragma pack(push, 4)
+#endif
 struct ShadowValue {
 
   ShadowValType t;
@@ -244,6 +312,11 @@ ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
 
 };
 
+#ifdef LLPE_PACKED_VALUES
+#pragma pack(pop)
+static_assert(sizeof(ShadowValue) == 12, "Unexpected packed ShadowValue size");
+#endif
+
 inline bool operator==(ShadowValue V1, ShadowValue V2) {
   if(V1.t != V2.t)
     return false;
@@ -381,8 +454,59 @@ template<> struct DenseMapInfo<ShadowValue> {
 
 #define PBMAX 16
 
+// The set size beyond which a value becomes overdef. Normally PBMAX, but lowered
+// while widening a slow-converging loop (see IntegrationAttempt::analyseLoop).
+extern uint32_t GlobalPBMax;
+
+// Whether integer sets that overflow may be kept as intervals. Off within the general loop fixpoint,
+// where a growing interval would never converge (see IntConstFold.cpp).
+extern bool GlobalIntRanges;
+
+// Counts objects of a particular kind for the -llpe-stats-file report.
+struct AllocCounter {
+
+  uint64_t allocated;
+  uint64_t live;
+  uint64_t peak;
+
+  void alloc() {
+    ++allocated;
+    if(++live > peak)
+      peak = live;
+  }
+
+  void free() {
+    --live;
+  }
+
+};
+
+extern AllocCounter GlobalIVSCounter;
+extern AllocCounter GlobalMultiCounter;
+extern AllocCounter GlobalTreeNodeCounter;
+extern AllocCounter GlobalStoreMapCounter;
+extern AllocCounter GlobalFrameChunkCounter;
+extern AllocCounter GlobalContextCounter;
+
+// Counts store merges (see MergeBlockVisitor) skipped because every incoming version
+// was pointer-identical, by the level at which sharing was detected.
+struct MergeSharingCounter {
+
+  uint64_t maps;
+  uint64_t frames;
+  uint64_t heaps;
+  uint64_t subtrees;
+  uint64_t objects;
+
+};
+
+extern MergeSharingCounter GlobalMergeSharing;
+
 bool functionIsBlacklisted(Function*);
 
+#ifdef LLPE_PACKED_VALUES
+#pragma pack(push, 4)
+#endif
 struct ImprovedVal {
 
   ShadowValue V;
@@ -450,6 +574,11 @@ ImprovedVal(ShadowValue _V, int64_t _O = LLONG_MAX) : V(_V), Offset(_O) { }
 
 };
 
+#ifdef LLPE_PACKED_VALUES
+#pragma pack(pop)
+static_assert(sizeof(ImprovedVal) == 20, "Unexpected packed ImprovedVal size");
+#endif
+
 inline bool operator==(ImprovedVal V1, ImprovedVal V2) {
   return (V1.V == V2.V && V1.Offset == V2.Offset);
 }
@@ -482,6 +611,60 @@ typedef std::pair<std::pair<uint64_t, uint64_t>, ImprovedValSetSingle> IVSRange;
 
 #define SAFE_DROP_REF(x) do { if(x->dropReference()) x = 0; } while(0);
 
+// Reference count for the copy-on-write store structures (object stores, frames, heaps, FD tables).
+// StoreRefCount<false> is a plain counter; StoreRefCount<true> is atomic, for analyses that share stores
+// between threads. The CoW protocol is the same for both: a holder may write a structure in place only
+// when it sees a count of 1, because then no other holder exists and none can appear without a reference
+// to copy from. Otherwise it copies the structure and gives up its reference through the ordinary release
+// path, never a bare decrement, since another holder may break the same structure concurrently and the
+// original must then be freed by whichever of them releases it last. Which one stores use is chosen at
+// build time by LLPE_THREADSAFE_STORES; the plain one compiles to exactly the integer it replaces.
+template<bool Atomic> class StoreRefCount;
+
+template<> class StoreRefCount<false> {
+
+  uint32_t n;
+
+public:
+
+  StoreRefCount(uint32_t i = 1) : n(i) {}
+  operator uint32_t() const { return n; }
+  StoreRefCount& operator=(uint32_t i) { n = i; return *this; }
+  uint32_t operator++() { return ++n; }
+  uint32_t operator--() { return --n; }
+  uint32_t operator++(int) { return n++; }
+  uint32_t operator--(int) { return n--; }
+
+};
+
+template<> class StoreRefCount<true> {
+
+  std::atomic<uint32_t> n;
+
+public:
+
+  StoreRefCount(uint32_t i = 1) : n(i) {}
+  StoreRefCount(const StoreRefCount& Other) : n((uint32_t)Other) {}
+  StoreRefCount& operator=(const StoreRefCount& Other) { n.store((uint32_t)Other, std::memory_order_relaxed); return *this; }
+  StoreRefCount& operator=(uint32_t i) { n.store(i, std::memory_order_relaxed); return *this; }
+  // Acquire, so that seeing 1 orders our writes after other holders' last reads before they released.
+  operator uint32_t() const { return n.load(std::memory_order_acquire); }
+  // New references are only made from existing ones, so taking one needs no ordering.
+  uint32_t operator++() { return n.fetch_add(1, std::memory_order_relaxed) + 1; }
+  uint32_t operator--() { return n.fetch_sub(1, std::memory_order_acq_rel) - 1; }
+  uint32_t operator++(int) { return n.fetch_add(1, std::memory_order_relaxed); }
+  uint32_t operator--(int) { return n.fetch_sub(1, std::memory_order_acq_rel); }
+
+};
+
+#ifdef LLPE_THREADSAFE_STORES
+typedef StoreRefCount<true> RefCount;
+#define LLPE_STORE_POOL_TLS thread_local
+#else
+typedef StoreRefCount<false> RefCount;
+#define LLPE_STORE_POOL_TLS
+#endif
+
 struct ImprovedValSet {
 
   bool isMulti;
@@ -502,11 +685,16 @@ struct ImprovedValSetSingle : public ImprovedValSet {
   ValSetType SetType;
   SmallVector<ImprovedVal, 1> Values;
   bool Overdef;
-
- ImprovedValSetSingle() : ImprovedValSet(false), SetType(ValSetTypeUnknown), Overdef(false) { }
- ImprovedValSetSingle(ValSetType T) : ImprovedValSet(false), SetType(T), Overdef(false) { }
- ImprovedValSetSingle(ValSetType T, bool OD) : ImprovedValSet(false), SetType(T), Overdef(OD) { }
- ImprovedValSetSingle(ImprovedVal V, ValSetType T) : ImprovedValSet(false), SetType(T), Overdef(false) {
+  // An overdef scalar may still be bounded: if RangeBits is non-zero, every value is an integer of that
+  // width lying, taken as signed, within [RangeLo, RangeHi] (see setOverdefRange).
+  uint32_t RangeBits;
+  int64_t RangeLo;
+  int64_t RangeHi;
+
+ ImprovedValSetSingle() : ImprovedValSet(false), SetType(ValSetTypeUnknown), Overdef(false), RangeBits(0), RangeLo(0), RangeHi(0) { }
+ ImprovedValSetSingle(ValSetType T) : ImprovedValSet(false), SetType(T), Overdef(false), RangeBits(0), RangeLo(0), RangeHi(0) { }
+ ImprovedValSetSingle(ValSetType T, bool OD) : ImprovedValSet(false), SetType(T), Overdef(OD), RangeBits(0), RangeLo(0), RangeHi(0) { }
+ ImprovedValSetSingle(ImprovedVal V, ValSetType T) : ImprovedValSet(false), SetType(T), Overdef(false), RangeBits(0), RangeLo(0), RangeHi(0) {
     Values.push_back(V);
   }
 
@@ -576,8 +764,11 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
     release_assert(V.V.t != SHADOWVAL_INVAL);
 
-    if(Overdef)
+    // Nothing could keep a range up to date incrementally, so one more value loses it.
+    if(Overdef) {
+      RangeBits = 0;
       return *this;
+    }
 
     if(SetType == ValSetTypePB) {
 
@@ -603,7 +794,7 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
     Values.push_back(V);
 
-    if(Values.size() > PBMAX)
+    if(Values.size() > GlobalPBMax)
       setOverdef();
     
     return *this;
@@ -658,6 +849,7 @@ struct ImprovedValSetSingle : public ImprovedValSet {
   ImprovedValSetSingle& merge(ImprovedValSetSingle& OtherPB) {
     if(!OtherPB.isInitialised())
       return *this;
+    RangeBits = 0;
     if(OtherPB.Overdef) {
       if(OtherPB.SetType == ValSetTypePB)
 	SetType = ValSetTypePB;
@@ -710,15 +902,32 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
     Values.clear();
     Overdef = true;
+    RangeBits = 0;
+
+  }
+
+  // Overdef, but known to be a Bits-wide integer within [Lo, Hi] taken as signed.
+  void setOverdefRange(uint32_t Bits, int64_t Lo, int64_t Hi) {
+
+    setOverdef();
+    SetType = ValSetTypeScalar;
+    RangeBits = Bits;
+    RangeLo = Lo;
+    RangeHi = Hi;
 
   }
 
+  bool hasRange() const {
+    return Overdef && RangeBits != 0;
+  }
+
   void set(ImprovedVal V, ValSetType T) {
 
     Values.clear();
     Values.push_back(V);
     SetType = T;
     Overdef = false;
+    RangeBits = 0;
 
   }
 
@@ -781,21 +990,35 @@ struct HalfOpenWithMerge {
 
 };
 
+// How many extents an ImprovedValSetMulti's map holds in its inline root leaf, before it needs heap nodes.
+// LLVM's default is sized to fit its leaves in a few cache lines, which for ImprovedValSetSingle values
+// means only a handful of extents; a larger root keeps many-field objects a flat sorted array at the
+// cost of a bigger map in every multi. Set with cmake -DLLPE_MULTI_ROOT_EXTENTS=N and compare with
+// -llpe-microbench=multi-write,multi-read -llpe-microbench-object-size=SIZE.
+#ifdef LLPE_MULTI_ROOT_EXTENTS
+#define LLPE_MULTI_ROOT_LEAF LLPE_MULTI_ROOT_EXTENTS
+#else
+#define LLPE_MULTI_ROOT_LEAF IntervalMapImpl::NodeSizer<uint64_t, ImprovedValSetSingle>::LeafSize
+#endif
+
 struct ImprovedValSetMulti : public ImprovedValSet {
 
-  typedef IntervalMap<uint64_t, ImprovedValSetSingle, IntervalMapImpl::NodeSizer<uint64_t, ImprovedValSetSingle>::LeafSize, HalfOpenNoMerge> MapTy;
+  typedef IntervalMap<uint64_t, ImprovedValSetSingle, LLPE_MULTI_ROOT_LEAF, HalfOpenNoMerge> MapTy;
   typedef MapTy::iterator MapIt;
   typedef MapTy::const_iterator ConstMapIt;
   MapTy Map;
-  uint32_t MapRefCount;
+  RefCount MapRefCount;
   ImprovedValSet* Underlying;
   uint64_t CoveredBytes;
   uint64_t AllocSize;
+  // Unique for every (object, contents) pair: assigned on construction and renewed
+  // whenever the map is modified in place. Keys the readValRange cache.
+  uint64_t Stamp;
 
   ImprovedValSetMulti(uint64_t ASize);
   ImprovedValSetMulti(const ImprovedValSetMulti& other);
 
-  virtual ~ImprovedValSetMulti() {}
+  virtual ~ImprovedValSetMulti() { GlobalMultiCounter.free(); }
 
   static bool classof(const ImprovedValSet* IVS) { return IVS->isMulti; }
   virtual bool dropReference();
@@ -806,6 +1029,7 @@ struct ImprovedValSetMulti : public ImprovedValSet {
     MapRefCount++;
     return this;
   }
+  void refreshStamp();
 
   virtual bool isWhollyUnknown() const {
     return false;
@@ -838,6 +1062,22 @@ ShadowInstIdx(uint32_t b, uint32_t i) : blockIdx(b), instIdx(i) { }
 
 class ShadowBBInvar;
 
+// Which of tryEvaluateResult's folds apply to an instruction, fixed when its invariant info is built.
+enum EvalKind {
+
+  EVALKIND_GENERIC,
+  EVALKIND_CAST,
+  EVALKIND_INTCAST, /* zext, sext, trunc: also int-foldable */
+  EVALKIND_ICMP,
+  EVALKIND_FCMP,
+  EVALKIND_GEP,
+  EVALKIND_PTRARITH, /* add, sub, and, or: may be pointer-as-int or bitwise ops */
+  EVALKIND_INTOP, /* other binary ops IHPFoldIntOp handles */
+  EVALKIND_EXTRACTVALUE,
+  EVALKIND_LOAD
+
+};
+
 struct ShadowInstructionInvar {
   
   uint32_t idx;
@@ -846,6 +1086,7 @@ struct ShadowInstructionInvar {
   ImmutableArray<ShadowInstIdx> operandIdxs;
   ImmutableArray<ShadowInstIdx> userIdxs;
   ImmutableArray<uint32_t> operandBBs;
+  uint8_t evalKind;
 
 };
 
@@ -928,6 +1169,9 @@ LocStore(const LocStore& other) : store(other.store) {}
     return store && isa<ImprovedValSetMulti>(store) && cast<ImprovedValSetMulti>(store)->MapRefCount == 2;
   }
 
+  // Heap object idx is certainly freed, so may be dropped from the heap (see ShadowBB::compactHeap).
+  bool isDeadObject(uint32_t idx);
+
 };
 
 enum AllocTestedState {
@@ -949,11 +1193,37 @@ struct AllocData {
   std::vector<std::pair<WeakVH, uint32_t> > PatchRefs;
   Type* allocType;
   Value* committedVal;
+  // Heap objects only: set if the object's pointer was ever stored, passed to unexpanded code
+  // or freed, on any path.
+  bool mayEscape;
+  // Set if the allocation is committed in a context that runs no more than once.
+  bool committedOnce;
+  // Heap objects only: set if the object summarises every allocation an in-loop site makes
+  // beyond -llpe-alloc-site-limit, so that a pointer to it may mean any one of them.
+  bool isSummary;
+  // Alignment of the object's base address, noted when it is allocated; 0 if unknown.
+  uint32_t alignment;
+  // Allocations only: if storeSize is unknown (ULONG_MAX), an upper limit on it taken from the
+  // values the size operand might have, or ULONG_MAX if there is none.
+  uint64_t sizeBound;
 
   bool isAvailable();
 
 };
 
+// Why a load's value couldn't be forwarded. This is always recorded, in ShadowInstruction::forwardFailure;
+// the text report in LLPEAnalysisPass::optimisticForwardStatus is only built with -llpe-verbose-overdef.
+enum ForwardFailure {
+
+  FORWARD_FAIL_NONE,
+  FORWARD_FAIL_VAGUE_POINTER, /* the load's pointer has no known target */
+  FORWARD_FAIL_EARLY, /* some target is known overdefined without reading the rest (multiloadMustFail) */
+  FORWARD_FAIL_UNKNOWN_VALUE, /* some target holds no known value for the bytes read */
+  FORWARD_FAIL_COERCE, /* a known value couldn't be read as the load's type */
+  FORWARD_FAIL_MERGE /* the values read from different targets don't merge */
+
+};
+
 enum ThreadLocalState {
 
   TLS_MUSTCHECK, /* instruction might have been clobbered by other threads; check at runtime */
@@ -967,20 +1237,38 @@ enum ThreadLocalState {
 #define RUNTIME_CHECK_READ_LLIOWD 2
 #define RUNTIME_CHECK_READ_MEMCMP 3
 
+// Fields of a ShadowInstruction that are only used by calls or by commit, kept apart from the
+// analysis fields in a parallel array, ShadowBB::coldInsts, that is only allocated when one is set.
+struct ShadowInstructionCold {
+
+  Value* committedVal;
+  void* typeSpecificData;
+
+ShadowInstructionCold() : committedVal(0), typeSpecificData(0) {}
+
+};
+
 struct ShadowInstruction {
 
   ShadowBB* parent;
   ShadowInstructionInvar* invar;
   InstArgImprovement i;
-  Value* committedVal;
   // Of a load, memcpy or realloc, is there no need to check for thread interference?
   unsigned char isThreadLocal;
   unsigned char needsRuntimeCheck;
   unsigned char dieStatus;
-  void* typeSpecificData;
+  // Of a load, a ForwardFailure.
+  unsigned char forwardFailure;
+  // LLPEAnalysisPass::loopRoundClock when this instruction's value last changed.
+  uint32_t changeStamp;
 
   void initTypeSpecificData();
 
+  inline Value* getCommittedVal();
+  inline void setCommittedVal(Value*);
+  inline void* getTypeSpecificData();
+  inline void setTypeSpecificData(void*);
+
   uint32_t getNumOperands() {
     return invar->operandIdxs.size();
   }
@@ -1002,9 +1290,7 @@ struct ShadowInstruction {
       return getNumOperands() - 3;
   }
 
-  uint32_t getNumUsers() {
-    return invar->userIdxs.size();
-  }
+  inline uint32_t getNumUsers();
 
   ShadowInstruction* getUser(uint32_t i);
 
@@ -1053,8 +1339,22 @@ struct ShadowArgInvar {
 struct ShadowGV {
 
   GlobalVariable* G;
+  // Filled in on first use (see LLPEAnalysisPass::initShadowGlobals); use the accessors.
   uint64_t storeSize;
   int32_t allocIdx;
+  bool initialised;
+
+  void init();
+  uint64_t getStoreSize() {
+    if(!initialised)
+      init();
+    return storeSize;
+  }
+  int32_t getAllocIdx() {
+    if(!initialised)
+      init();
+    return allocIdx;
+  }
 
 };
 
@@ -1065,6 +1365,8 @@ struct ShadowArg {
   InstArgImprovement i;  
   Value* committedVal;
   unsigned char dieStatus;
+  // As ShadowInstruction::changeStamp.
+  uint32_t changeStamp;
   WeakVH patchInst;
 
   Type* getType() {
@@ -1094,6 +1396,13 @@ struct ShadowBBInvar {
   ImmutableArray<ShadowInstructionInvar> insts;
   const ShadowLoopInvar* outerScope;
   const ShadowLoopInvar* naturalScope;
+  // Of a switch with many cases, the successor slot each case value leads to; otherwise null.
+  DenseMap<ConstantInt*, uint32_t>* switchCases;
+  // For each of predIdxs, the first and last of that predecessor's successor slots that lead here.
+  ImmutableArray<std::pair<uint32_t, uint32_t> > predSlots;
+  // Total instructions and successors of the blocks before this one (see IntegrationAttempt::createBB).
+  uint32_t instsBefore;
+  uint32_t succsBefore;
 
   inline ShadowBBInvar* getPred(uint32_t i);
   inline uint32_t preds_size();
@@ -1103,14 +1412,111 @@ struct ShadowBBInvar {
 
 };
 
+// Membership bits for ObjectSetChunk::Bits consecutive object keys, shared between copies of an ObjectSet
+// like FDStoreChunks are between FDStores.
+struct ObjectSetChunk {
+
+  static const uint32_t Bits = 1024;
+  static const uint32_t Words = Bits / 64;
+
+  RefCount refCount;
+  // Key of bit 0 of words[0]; a multiple of Bits.
+  uint64_t firstKey;
+  uint64_t words[Words];
+
+ObjectSetChunk(uint64_t k) : refCount(1), firstKey(k) { std::fill(words, words + Words, 0); }
+ObjectSetChunk(const ObjectSetChunk& Other) : refCount(1), firstKey(Other.firstKey) { std::copy(Other.words, Other.words + Words, words); }
+
+};
+
+// A set of stack and heap objects, stored as bits keyed by (frame, index) in chunks that exist only
+// where the set has members. Copying a set takes a reference on each chunk, writing a member copies its
+// chunk if shared, and intersection works a word at a time, without hashing. Values that are not objects
+// are never members.
+class ObjectSet {
+
+  // Sorted by firstKey, none empty.
+  SmallVector<ObjectSetChunk*, 4> chunks;
+
+  typedef SmallVector<ObjectSetChunk*, 4>::iterator ChunkIt;
+  typedef SmallVector<ObjectSetChunk*, 4>::const_iterator ConstChunkIt;
+
+  static bool getKey(const ShadowValue& V, uint64_t& Key) {
+    if(!V.isPtrIdx())
+      return false;
+    Key = (((uint64_t)(V.u.PtrOrFd.frame + 1)) << 32) | V.u.PtrOrFd.idx;
+    return true;
+  }
+
+  static bool chunkLT(const ObjectSetChunk* C, uint64_t firstKey) { return C->firstKey < firstKey; }
+
+  static void release(ObjectSetChunk* C) {
+    if(!--C->refCount)
+      delete C;
+  }
+
+  void retainAll() {
+    for(ChunkIt it = chunks.begin(), itend = chunks.end(); it != itend; ++it)
+      ++(*it)->refCount;
+  }
+
+  void releaseAll() {
+    for(ChunkIt it = chunks.begin(), itend = chunks.end(); it != itend; ++it)
+      release(*it);
+  }
+
+  ObjectSetChunk* getWritableChunk(ChunkIt it);
+
+public:
+
+  ObjectSet() {}
+  ObjectSet(const ObjectSet& Other) : chunks(Other.chunks) { retainAll(); }
+  ~ObjectSet() { releaseAll(); }
+
+  ObjectSet& operator=(const ObjectSet& Other) {
+    if(this != &Other) {
+      releaseAll();
+      chunks = Other.chunks;
+      retainAll();
+    }
+    return *this;
+  }
+
+  bool count(const ShadowValue& V) const {
+
+    uint64_t Key;
+    if(!getKey(V, Key))
+      return false;
+
+    uint64_t First = Key & ~((uint64_t)ObjectSetChunk::Bits - 1);
+    ConstChunkIt it = std::lower_bound(chunks.begin(), chunks.end(), First, chunkLT);
+    if(it == chunks.end() || (*it)->firstKey != First)
+      return false;
+
+    uint64_t Off = Key - First;
+    return !!((*it)->words[Off / 64] & (((uint64_t)1) << (Off % 64)));
+
+  }
+
+  void insert(const ShadowValue& V);
+  void erase(const ShadowValue& V);
+  void eraseFrame(int32_t Frame);
+  void intersectWith(const ObjectSet& Other);
+  bool isSubsetOf(const ObjectSet& Other) const;
+  void getMembers(std::vector<ShadowValue>& Out) const;
+
+};
+
 struct OrdinaryStoreExtraState {
 
   // Objects that are certainly not effected by thread yields.
-  DenseSet<ShadowValue> threadLocalObjects;
+  ObjectSet threadLocalObjects;
   // Objects that are certainly not reachable from objects older than specialisation start
-  DenseSet<ShadowValue> noAliasOldObjects;
+  ObjectSet noAliasOldObjects;
   // Objects all of whose pointers are known, and therefore are not aliased by unknown pointers.
-  DenseSet<ShadowValue> unescapedObjects;
+  ObjectSet unescapedObjects;
+  // The objects spared by the last ShadowBB::clobberAllExcept (see LocalStoreMap::onlyClobberSaved).
+  ObjectSet clobberSave;
 
   void copyFrom(const OrdinaryStoreExtraState& es) { *this = es; }
   static void doMerge(LocalStoreMap<LocStore, OrdinaryStoreExtraState>* toMap, 
@@ -1144,6 +1550,25 @@ typedef SmallVector<TrackedStore*, 1> DSEMapEntry;
 
 typedef IntervalMap<uint64_t, DSEMapEntry, IntervalMapImpl::NodeSizer<uint64_t, DSEMapEntry>::LeafSize, HalfOpenNoMerge> DSEMapTy;
 
+// Compact alternative to DSEMapTy used while every tracked byte of an object lies within
+// its first DSESMALLMAPSIZE bytes: each writer in the map, with a bitset of the bytes it
+// holds references to. A writer appears at most once and always holds at least one byte.
+#define DSESMALLMAPSIZE 256
+#define DSESMALLMAPWORDS (DSESMALLMAPSIZE / 64)
+
+struct DSESmallMapEntry {
+
+  TrackedStore* Store;
+  uint64_t Bytes[DSESMALLMAPWORDS];
+
+};
+
+struct DSESmallMap {
+
+  SmallVector<DSESmallMapEntry, 2> Entries;
+
+};
+
 struct TrackedAlloc {
 
   ShadowInstruction* SI;
@@ -1165,12 +1590,19 @@ class DSEStoreExtraState;
 
 struct DSEMapPointer {
 
+  // Exactly one of M and S is set for a valid map.
   DSEMapTy* M;
+  DSESmallMap* S;
   TrackedAlloc* A;
   
-DSEMapPointer() : M(0), A(0) {}
-DSEMapPointer(DSEMapTy* _M, TrackedAlloc* _A) : M(_M), A(_A) {}
-DSEMapPointer(const DSEMapPointer& other) : M(other.M), A(other.A) {}
+DSEMapPointer() : M(0), S(0), A(0) {}
+DSEMapPointer(DSEMapTy* _M, TrackedAlloc* _A) : M(_M), S(0), A(_A) {}
+DSEMapPointer(DSESmallMap* _S, TrackedAlloc* _A) : M(0), S(_S), A(_A) {}
+DSEMapPointer(const DSEMapPointer& other) : M(other.M), S(other.S), A(other.A) {}
+
+  const void* getMap() const {
+    return M ? (const void*)M : (const void*)S;
+  }
 
   static DSEMapPointer& getEmptyStore() {
 
@@ -1180,19 +1612,20 @@ DSEMapPointer(const DSEMapPointer& other) : M(other.M), A(other.A) {}
 
   static bool LT(const DSEMapPointer* a, const DSEMapPointer* b) {
 
-    return a->M < b->M;
+    return a->getMap() < b->getMap();
 
   }
 
   static bool EQ(const DSEMapPointer* a, const DSEMapPointer* b) {
 
-    return a->M == b->M;
+    return a->getMap() == b->getMap();
 
   }
 
   static LocalStoreMap<DSEMapPointer, DSEStoreExtraState>* getMapForBlock(ShadowBB* BB);
-  bool isValid() { return !!M; }
+  bool isValid() { return M || S; }
   void checkMergedResult() { }
+  void promote();
   DSEMapPointer getReadableCopy();
   bool dropReference();
   void release();
@@ -1221,7 +1654,37 @@ struct DSEStoreExtraState {
 
 // Define types for the TL store:
 
-typedef IntervalMap<uint64_t, bool, IntervalMapImpl::NodeSizer<uint64_t, bool>::LeafSize, HalfOpenWithMerge> TLMapTy;
+// The TL store only records which bytes of an object are known good, so use one bit per byte.
+// Objects of up to 64 bytes (the usual case) fit the inline word; larger ones get a heap block
+// which grows to cover the highest good byte.
+struct TLBitmap {
+
+  // Words in use; the first is held inline when there is only one.
+  uint32_t NWords;
+  union {
+    uint64_t Inline;
+    uint64_t* Heap;
+  } u;
+
+TLBitmap() : NWords(1) { u.Inline = 0; }
+  TLBitmap(const TLBitmap& other);
+  ~TLBitmap() { if(NWords > 1) delete[] u.Heap; }
+
+  uint64_t* words() { return NWords > 1 ? u.Heap : &u.Inline; }
+  const uint64_t* words() const { return NWords > 1 ? u.Heap : &u.Inline; }
+
+  bool isGood(uint64_t Start, uint64_t Stop) const;
+  void markGood(uint64_t Start, uint64_t Stop);
+  void intersect(const TLBitmap& other);
+  void clear();
+  void print(raw_ostream& RSO) const;
+
+private:
+  TLBitmap& operator=(const TLBitmap&);
+  void grow(uint32_t NewWords);
+
+};
+
 
 class TLMapPointer;
 extern TLMapPointer TLEmptyMapPtr;
@@ -1229,10 +1692,10 @@ class TLStoreExtraState;
 
 struct TLMapPointer {
 
-  TLMapTy* M;
+  TLBitmap* M;
 
 TLMapPointer() : M(0) {}
-TLMapPointer(TLMapTy* _M) : M(_M) {}
+TLMapPointer(TLBitmap* _M) : M(_M) {}
 TLMapPointer(const TLMapPointer& other) : M(other.M) {}
 
   static TLMapPointer& getEmptyStore() {
@@ -1281,22 +1744,45 @@ struct TLStoreExtraState {
 
 #include "SharedTree.h"
 
+// Filenames are interned (see VFSOps.cpp) so that FD tables are cheap to copy.
+uint32_t internFDFilename(const std::string&);
+const std::string& getFDFilename(uint32_t);
+
 struct FDState {
 
-  std::string filename;
+  uint32_t filenameId;
   uint64_t pos;
   bool clean;
+  // The stdio end-of-file indicator, for streams modelled by -llpe-stdio-model.
+  bool eof;
+
+FDState() : filenameId(0), pos((uint64_t)-1), clean(false), eof(false) {}
+FDState(const std::string& fn) : filenameId(internFDFilename(fn)), pos(0), clean(false), eof(false) {}
+
+  const std::string& getFilename() const { return getFDFilename(filenameId); }
+
+};
 
-FDState() : filename(""), pos((uint64_t)-1), clean(false) {}
-FDState(std::string fn) : filename(fn), pos(0), clean(false) {}
-FDState(const FDState& Other) : filename(Other.filename), pos(Other.pos), clean(Other.clean) {}
+// FD tables are held in fixed-size chunks shared between copies of a store,
+// so that updating one FD copies only its chunk.
+struct FDStoreChunk {
+
+  static const uint32_t Size = 16;
+
+  RefCount refCount;
+  FDState fds[Size];
+
+FDStoreChunk() : refCount(1) {}
+FDStoreChunk(const FDStoreChunk& Other) : refCount(1) { std::copy(Other.fds, Other.fds + Size, fds); }
 
 };
 
 struct FDStore {
 
-  uint32_t refCount;
-  std::vector<FDState> fds;
+  RefCount refCount;
+  // Entries at or beyond nfds are always default-constructed.
+  uint32_t nfds;
+  std::vector<FDStoreChunk*> chunks;
 
   bool dropReference() {
 
@@ -1315,13 +1801,79 @@ struct FDStore {
       return this;
 
     release_assert(refCount);
-    refCount--;
-    return new FDStore(*this);
+    FDStore* newStore = new FDStore(*this);
+    dropReference();
+    return newStore;
+
+  }
+
+  uint32_t size() const { return nfds; }
+
+  const FDState& get(uint32_t i) const {
+
+    return chunks[i / FDStoreChunk::Size]->fds[i % FDStoreChunk::Size];
+
+  }
+
+  // Get FD i for writing, breaking its chunk's CoW if necessary.
+  FDState& getWritableFD(uint32_t i) {
+
+    FDStoreChunk*& C = chunks[i / FDStoreChunk::Size];
+    if(C->refCount != 1) {
+      FDStoreChunk* Old = C;
+      C = new FDStoreChunk(*Old);
+      if(!--Old->refCount)
+	delete Old;
+    }
+    return C->fds[i % FDStoreChunk::Size];
+
+  }
+
+  void resize(uint32_t n) {
+
+    uint32_t nChunks = (n + FDStoreChunk::Size - 1) / FDStoreChunk::Size;
+
+    if(n < nfds) {
+
+      for(uint32_t i = nChunks, ilim = chunks.size(); i != ilim; ++i) {
+	if(!--chunks[i]->refCount)
+	  delete chunks[i];
+      }
+      chunks.resize(nChunks);
+
+      for(uint32_t i = n, ilim = std::min(nfds, nChunks * FDStoreChunk::Size); i < ilim; ++i)
+	getWritableFD(i) = FDState();
+
+    }
+    else {
+
+      while(chunks.size() < nChunks)
+	chunks.push_back(new FDStoreChunk());
+
+    }
+
+    nfds = n;
 
   }
+
+  void clear() { resize(0); }
   
-FDStore() : refCount(1), fds() {}
-FDStore(const FDStore& Other) : refCount(1), fds(Other.fds) {}
+FDStore() : refCount(1), nfds(0), chunks() {}
+FDStore(const FDStore& Other) : refCount(1), nfds(Other.nfds), chunks(Other.chunks) {
+
+  for(std::vector<FDStoreChunk*>::iterator it = chunks.begin(), itend = chunks.end(); it != itend; ++it)
+    ++(*it)->refCount;
+
+}
+
+~FDStore() {
+
+  for(std::vector<FDStoreChunk*>::iterator it = chunks.begin(), itend = chunks.end(); it != itend; ++it) {
+    if(!--(*it)->refCount)
+      delete *it;
+  }
+
+}
 
 };
 
@@ -1358,6 +1910,8 @@ struct ShadowBB {
   bool* succsAlive;
   ShadowBBStatus status;
   ImmutableArray<ShadowInstruction> insts;
+  // Cold fields of insts, or null if none has been set.
+  ShadowInstructionCold* coldInsts;
 
   OrdinaryLocalStore* localStore;
   DSELocalStore* dseStore;
@@ -1369,13 +1923,22 @@ struct ShadowBB {
   bool useSpecialVarargMerge;
   bool inAnyLoop;
 
+  // IAWalker::Epoch of the walker that last queued this whole block (see IAWalker::markVisited).
+  uint64_t walkEpoch;
+
+  // insts and succsAlive belong to the context's block slab.
   ~ShadowBB() {
 
-    delete[] &(insts[0]);
-    delete[] succsAlive;
+    delete[] coldInsts;
 
   }
 
+  ShadowInstructionCold& getColdInst(ShadowInstruction* SI) {
+    if(!coldInsts)
+      coldInsts = new ShadowInstructionCold[insts.size()];
+    return coldInsts[SI - &(insts[0])];
+  }
+
   bool isMarkedCertain() {
     return status == BBSTATUS_CERTAIN;
   }
@@ -1384,11 +1947,41 @@ struct ShadowBB {
     return status == BBSTATUS_CERTAIN || status == BBSTATUS_ASSUMED;
   }
 
+  // Get the range [firstSlot, lastSlot) of our successor slots that might lead to BB2I.
+  // Returns false if there are none.
+  bool getEdgeSlots(ShadowBBInvar* BB2I, uint32_t& firstSlot, uint32_t& lastSlot) {
+
+    firstSlot = 0;
+    lastSlot = invar->succIdxs.size();
+
+    // A switch dispatching to many blocks has many successors but each target has few predecessors:
+    // if that list is shorter, use it to find which of our successor slots can lead to BB2I.
+    if(BB2I->predIdxs.size() < invar->succIdxs.size()) {
+
+      uint32_t i = 0, ilim = BB2I->predIdxs.size();
+      for(; i != ilim && BB2I->predIdxs[i] != invar->idx; ++i) { }
+
+      if(i == ilim)
+	return false;
+
+      firstSlot = BB2I->predSlots[i].first;
+      lastSlot = BB2I->predSlots[i].second + 1;
+
+    }
+
+    return true;
+
+  }
+
   bool edgeIsDead(ShadowBBInvar* BB2I) {
 
     bool foundLiveEdge = false;
+    uint32_t firstSlot, lastSlot;
+
+    if(!getEdgeSlots(BB2I, firstSlot, lastSlot))
+      return true;
 
-    for(uint32_t i = 0; i < invar->succIdxs.size() && !foundLiveEdge; ++i) {
+    for(uint32_t i = firstSlot; i < lastSlot && !foundLiveEdge; ++i) {
 
       if(BB2I->idx == invar->succIdxs[i]) {
 
@@ -1410,11 +2003,13 @@ struct ShadowBB {
   LocStore* getReadableStoreFor(const ShadowValue& V);
   void pushStackFrame(InlineAttempt*);
   void popStackFrame();
+  void compactHeap();
+  void dropFreedObject(ShadowValue V);
   void setAllObjectsMayAliasOld();
   void setAllObjectsThreadGlobal();
   void clobberMayAliasOldObjects();
   void clobberGlobalObjects();
-  void clobberAllExcept(DenseSet<ShadowValue>& Save, bool verbose);
+  void clobberAllExcept(const ObjectSet& Save, bool verbose);
   BasicBlock* getCommittedBreakBlockAt(uint32_t);
   DSEMapPointer* getWritableDSEStore(ShadowValue O);
   TLMapPointer* getWritableTLStore(ShadowValue O);
@@ -1454,6 +2049,24 @@ struct ShadowBB {
 
 };
 
+inline Value* ShadowInstruction::getCommittedVal() {
+  return parent->coldInsts ? parent->coldInsts[this - &(parent->insts[0])].committedVal : 0;
+}
+
+inline void* ShadowInstruction::getTypeSpecificData() {
+  return parent->coldInsts ? parent->coldInsts[this - &(parent->insts[0])].typeSpecificData : 0;
+}
+
+inline void ShadowInstruction::setCommittedVal(Value* V) {
+  if(V || parent->coldInsts)
+    parent->getColdInst(this).committedVal = V;
+}
+
+inline void ShadowInstruction::setTypeSpecificData(void* D) {
+  if(D || parent->coldInsts)
+    parent->getColdInst(this).typeSpecificData = D;
+}
+
 struct FDStoreMerger : public ShadowBBVisitor {
 
   FDStore* newStore;
@@ -1484,6 +2097,16 @@ struct ShadowLoopInvar {
   bool alwaysIterate;
   struct ShadowLoopInvar* parent;
   SmallVector<ShadowLoopInvar*, 1> childLoops;
+  // Might the loop's blocks, including those of child loops, write memory through a pointer not statically
+  // based on a particular alloca or global? If not, writtenGlobals lists (sorted) the globals they might write.
+  bool mayWriteUnknown;
+  std::vector<GlobalVariable*> writtenGlobals;
+
+  bool mayWriteGlobal(GlobalVariable* GV) const {
+
+    return mayWriteUnknown || std::binary_search(writtenGlobals.begin(), writtenGlobals.end(), GV);
+
+  }
 
   bool contains(const ShadowLoopInvar* Other) const {
 
@@ -1498,6 +2121,21 @@ struct ShadowLoopInvar {
   
 };
 
+// A loop's structure in terms of block indices, as derived from LoopInfo or read back
+// from the invariant cache. Used to build ShadowLoopInvars.
+struct ShadowLoopShape {
+
+  uint32_t headerIdx;
+  uint32_t preheaderIdx;
+  uint32_t latchIdx;
+  uint32_t nBlocks;
+  std::vector<uint32_t> exitingBlocks;
+  std::vector<uint32_t> exitBlocks;
+  std::vector<std::pair<uint32_t, uint32_t> > exitEdges;
+  std::vector<ShadowLoopShape> childLoops;
+
+};
+
 class PathConditions;
 
 struct ShadowFunctionInvar {
@@ -1505,14 +2143,42 @@ struct ShadowFunctionInvar {
   ImmutableArray<ShadowBBInvar> BBs;
   ImmutableArray<ShadowArgInvar> Args;
   int32_t frameSize;
+  // Does the function contain nothing the TL and DSE passlets act on: no memory access, calls or
+  // pointer comparisons (which may become malloc checks)? Then walking its contexts can't change their stores.
+  bool memoryInert;
   
   PathConditions* pathConditions;
   SmallVector<ShadowLoopInvar*, 4> TopLevelLoops;
+  // Have the instructions' and arguments' userIdxs been built yet? (See buildUserIdxs)
+  bool userIdxsBuilt;
+  // Every instruction's operandIdxs (and a phi's operandBBs) and every instruction's and argument's
+  // userIdxs are consecutive runs of these, in block and instruction order, arguments' users last.
+  ShadowInstIdx* operandPool;
+  uint32_t* operandBBPool;
+  ShadowInstIdx* userPool;
   
-ShadowFunctionInvar() : frameSize(0), pathConditions(0) {}
+ShadowFunctionInvar() : frameSize(0), memoryInert(false), pathConditions(0), userIdxsBuilt(false), operandPool(0), operandBBPool(0), userPool(0) {}
 
 };
 
+void buildUserIdxs(ShadowFunctionInvar*);
+
+inline ImmutableArray<ShadowInstIdx>& getUserIdxs(ShadowInstructionInvar* SII) {
+  if(!SII->parent->F->userIdxsBuilt)
+    buildUserIdxs(SII->parent->F);
+  return SII->userIdxs;
+}
+
+inline ImmutableArray<ShadowInstIdx>& getUserIdxs(ShadowFunctionInvar* SFI, ShadowArgInvar* SAI) {
+  if(!SFI->userIdxsBuilt)
+    buildUserIdxs(SFI);
+  return SAI->userIdxs;
+}
+
+uint32_t ShadowInstruction::getNumUsers() {
+  return getUserIdxs(invar).size();
+}
+
 ShadowBBInvar* ShadowBBInvar::getPred(uint32_t i) {
   return &(F->BBs[predIdxs[i]]);
 }
@@ -1632,7 +2298,7 @@ inline LLVMContext& ShadowValue::getLLVMContext() const {
 inline void ShadowValue::setCommittedVal(Value* V) {
   switch(t) {
   case SHADOWVAL_INST:
-    u.I->committedVal = V;
+    u.I->setCommittedVal(V);
     break;
   case SHADOWVAL_ARG:
     u.A->committedVal = V;
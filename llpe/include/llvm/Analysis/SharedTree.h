@@ -10,6 +10,10 @@
 #define HEAPTREEORDER 16
 #define HEAPTREEORDERLOG2 4
 
+// Heaps with up to this many objects are kept in a flat sorted array (SharedFlatHeap)
+// rather than a tree.
+#define HEAPFLATMAX 64
+
 #define LFV3(x) do {} while(0)
 //#define LFV3(x) x
 
@@ -19,19 +23,26 @@ template<class ChildType, class ExtraState> struct SharedTreeNode {
 
   // These point to SharedTreeNodes or ChildTypes if this is the bottom layer.
   void* children[HEAPTREEORDER];
-  int refCount;
+  RefCount refCount;
 
 SharedTreeNode() : refCount(1) {
 
   memset(children, 0, sizeof(void*) * HEAPTREEORDER);
+  GlobalTreeNodeCounter.alloc();
 
 }
 
+  ~SharedTreeNode() { GlobalTreeNodeCounter.free(); }
+
   bool dropReference(uint32_t idx, uint32_t height, std::vector<ShadowValue>* simplified);
   ChildType* getReadableStoreFor(uint32_t idx, uint32_t height);
   ChildType* getOrCreateStoreFor(uint32_t idx, uint32_t height, bool* isNewStore);
   SharedTreeNode* getWritableNode(uint32_t height);
   void mergeHeaps(SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>& others, bool allOthersClobbered, uint32_t height, uint32_t idx, MergeBlockVisitor<ChildType, ExtraState>* visitor);
+  bool hasDeadObjects(uint32_t idx, uint32_t height);
+  uint32_t removeDeadObjects(uint32_t idx, uint32_t height);
+  bool removeObject(uint32_t idx, uint32_t height);
+  bool isEmpty();
   void print(raw_ostream&, bool brief, uint32_t height, uint32_t idx);
 
 };
@@ -169,13 +180,123 @@ SharedTreeNode<ChildType, ExtraState>::getWritableNode(uint32_t height) {
 
   }
 
-  // Drop ref to this node.
-  --refCount;
+  // Drop ref to this node. This frees it if another holder broke it at the same time and has already let go.
+  dropReference(0, height, 0);
 
   return newNode;
 
 }
 
+template<class ChildType, class ExtraState> 
+bool SharedTreeNode<ChildType, ExtraState>::hasDeadObjects(uint32_t idx, uint32_t height) {
+
+  for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+
+    if(!children[i])
+      continue;
+
+    if(height == 0) {
+      if(((ChildType*)children[i])->isDeadObject(idx + i))
+	return true;
+    }
+    else if(((SharedTreeNode*)children[i])->hasDeadObjects(idx + (i << (height * HEAPTREEORDERLOG2)), height - 1)) {
+      return true;
+    }
+
+  }
+
+  return false;
+
+}
+
+// Drop objects that are certainly freed. This node is already writable; subtrees are only
+// CoW broken if they contain something to drop.
+template<class ChildType, class ExtraState> 
+uint32_t SharedTreeNode<ChildType, ExtraState>::removeDeadObjects(uint32_t idx, uint32_t height) {
+
+  uint32_t removed = 0;
+
+  for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+
+    if(!children[i])
+      continue;
+
+    if(height == 0) {
+
+      ChildType* child = (ChildType*)children[i];
+      if(child->isDeadObject(idx + i)) {
+	child->dropReference();
+	delete child;
+	children[i] = 0;
+	++removed;
+      }
+
+    }
+    else {
+
+      uint32_t childIdx = idx + (i << (height * HEAPTREEORDERLOG2));
+      SharedTreeNode* child = (SharedTreeNode*)children[i];
+      if(!child->hasDeadObjects(childIdx, height - 1))
+	continue;
+
+      child = child->getWritableNode(height - 1);
+      children[i] = child;
+      removed += child->removeDeadObjects(childIdx, height - 1);
+      if(child->isEmpty()) {
+	child->dropReference(childIdx, height - 1, 0);
+	children[i] = 0;
+      }
+
+    }
+
+  }
+
+  return removed;
+
+}
+
+// Drop object idx alone, CoW breaking only the path down to it. This node is already writable.
+template<class ChildType, class ExtraState> 
+bool SharedTreeNode<ChildType, ExtraState>::removeObject(uint32_t idx, uint32_t height) {
+
+  uint32_t nextChild = (idx >> (height * HEAPTREEORDERLOG2)) & (HEAPTREEORDER-1);
+  if(!children[nextChild])
+    return false;
+
+  if(height == 0) {
+
+    ChildType* child = (ChildType*)children[nextChild];
+    child->dropReference();
+    delete child;
+    children[nextChild] = 0;
+    return true;
+
+  }
+
+  SharedTreeNode* child = ((SharedTreeNode*)children[nextChild])->getWritableNode(height - 1);
+  children[nextChild] = child;
+  bool removed = child->removeObject(idx, height - 1);
+  if(child->isEmpty()) {
+    child->dropReference(idx, height - 1, 0);
+    children[nextChild] = 0;
+  }
+
+  return removed;
+
+}
+
+template<class ChildType, class ExtraState> 
+bool SharedTreeNode<ChildType, ExtraState>::isEmpty() {
+
+  for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+    if(children[i])
+      return false;
+  }
+
+  return true;
+
+}
+
 static bool derefLT(void** a, void** b) {
   if(!a)
     return !!b;
@@ -225,6 +346,43 @@ template<class Base> struct IndirectComp {
 ShadowValue& getAllocWithIdx(int32_t);
 uint64_t getHeapAllocSize(ShadowValue V);
 
+// Merge the stores for heap object idx. incomingPtrs points to each incoming version of the object, including
+// target, which is writable; a null entry means the object is absent from that heap.
+// Shared by the tree and flat heap representations.
+template<class ChildType, class ExtraState> 
+void mergeHeapObject(void** target, SmallVector<void**, 4>& incomingPtrs, uint32_t idx, MergeBlockVisitor<ChildType, ExtraState>* visitor) {
+
+  std::sort(incomingPtrs.begin(), incomingPtrs.end(), IndirectComp<ChildType>::LT);
+  SmallVector<void**, 4>::iterator uniqend = std::unique(incomingPtrs.begin(), incomingPtrs.end(), IndirectComp<ChildType>::EQ);
+      
+  // This object never differs?
+  if(std::distance(incomingPtrs.begin(), uniqend) == 1) {
+    ++GlobalMergeSharing.objects;
+    return;
+  }
+
+  // Merge each child value.
+  for(SmallVector<void**, 4>::iterator it = incomingPtrs.begin(); it != uniqend; ++it) {
+	
+    if(*it == target)
+      continue;
+
+    uint64_t ASize = getHeapAllocSize(ShadowValue::getPtrIdx(-1, idx));
+
+    ChildType* mergeFromStore;
+    if(!*it)
+      mergeFromStore = &ChildType::getEmptyStore();
+    else
+      mergeFromStore = (ChildType*)(**it);
+
+    // mergeStores takes care of CoW break if necessary.
+    ChildType::mergeStores(mergeFromStore, (ChildType*)*target, ASize, visitor);
+    ((ChildType*)*target)->checkMergedResult();
+      
+  }
+
+}
+
 template<class ChildType, class ExtraState> 
 void SharedTreeNode<ChildType, ExtraState>
   ::mergeHeaps(SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>& others, 
@@ -289,6 +447,26 @@ void SharedTreeNode<ChildType, ExtraState>
     if(!children[i])
       continue;
 
+    // Fast path: every other tree shares this subtree or object, so there's nothing to merge.
+    bool allShared = true;
+    for(typename SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>::iterator it = others.begin(), itend = others.end();
+	it != itend && allShared; ++it) {
+
+      if((!*it) || (*it)->children[i] != children[i])
+	allShared = false;
+
+    }
+
+    if(allShared) {
+
+      if(height == 0)
+	++GlobalMergeSharing.objects;
+      else
+	++GlobalMergeSharing.subtrees;
+      continue;
+
+    }
+
     // Unique children regardless of whether they're further levels of TreeNode
     // or ChildTypes. In the former case this avoids merges of identical subtrees
     // in the latter it skips merging ChildTypes that are shared (as determined by ChildType::EQ)
@@ -310,32 +488,7 @@ void SharedTreeNode<ChildType, ExtraState>
 
     if(height == 0) {
 
-      std::sort(incomingPtrs.begin(), incomingPtrs.end(), IndirectComp<ChildType>::LT);
-      SmallVector<void**, 4>::iterator uniqend = std::unique(incomingPtrs.begin(), incomingPtrs.end(), IndirectComp<ChildType>::EQ);
-      
-      // This subtree never differs?
-      if(std::distance(incomingPtrs.begin(), uniqend) == 1)
-	continue;
-
-      // Merge each child value.
-      for(SmallVector<void**, 4>::iterator it = incomingPtrs.begin(); it != uniqend; ++it) {
-	
-	if(*it == &(children[i]))
-	  continue;
-
-	uint64_t ASize = getHeapAllocSize(ShadowValue::getPtrIdx(-1, idx + i));
-
-	ChildType* mergeFromStore;
-	if(!*it)
-	  mergeFromStore = &ChildType::getEmptyStore();
-	else
-	  mergeFromStore = (ChildType*)(**it);
-
-	// mergeStores takes care of CoW break if necessary.
-	ChildType::mergeStores(mergeFromStore, (ChildType*)children[i], ASize, visitor);
-	((ChildType*)children[i])->checkMergedResult();
-      
-      }
+      mergeHeapObject(&(children[i]), incomingPtrs, idx + i, visitor);
 
     }
     else {
@@ -344,8 +497,10 @@ void SharedTreeNode<ChildType, ExtraState>
       SmallVector<void**, 4>::iterator uniqend = std::unique(incomingPtrs.begin(), incomingPtrs.end(), derefEQ);
       
       // This subtree never differs?
-      if(std::distance(incomingPtrs.begin(), uniqend) == 1)
+      if(std::distance(incomingPtrs.begin(), uniqend) == 1) {
+	++GlobalMergeSharing.subtrees;
 	continue;
+      }
 
       // Recursively merge this child.
       // CoW break this subtree if necessary.
@@ -400,12 +555,325 @@ template<class ChildType, class ExtraState> void SharedTreeNode<ChildType, Extra
 
 }
 
+static uint32_t getRequiredHeight(uint32_t idx) {
+
+  uint32_t height = 0;
+
+  do {
+
+    idx >>= HEAPTREEORDERLOG2;
+    ++height;
+
+  } while(idx);
+
+  return height;
+
+}
+
+// A heap describing few objects: (heap index, ChildType*) pairs sorted by index.
+// Lookup is a binary search over a contiguous array instead of a walk down the tree, and a CoW break
+// copies only the objects present. Refcounted and CoW'd just like a SharedTreeNode at height 0.
+template<class ChildType, class ExtraState> struct SharedFlatHeap {
+
+  typedef std::pair<uint32_t, void*> EntryType;
+  typedef SmallVector<EntryType, 8> EntryList;
+
+  EntryList entries;
+  RefCount refCount;
+
+SharedFlatHeap() : refCount(1) { }
+
+  static bool entryLT(const EntryType& E, uint32_t idx) { return E.first < idx; }
+  typename EntryList::iterator findEntry(uint32_t idx) {
+    return std::lower_bound(entries.begin(), entries.end(), idx, entryLT);
+  }
+
+  bool dropReference(std::vector<ShadowValue>* simplified);
+  ChildType* getReadableStoreFor(uint32_t idx);
+  ChildType* getOrCreateStoreFor(uint32_t idx, bool* isNewStore);
+  SharedFlatHeap* getWritableHeap();
+  SharedTreeNode<ChildType, ExtraState>* buildTree(uint32_t height);
+  uint32_t requiredTreeHeight() { return getRequiredHeight(entries.back().first); }
+  void mergeHeaps(SmallVector<SharedFlatHeap<ChildType, ExtraState>*, 4>& others, bool allOthersClobbered, MergeBlockVisitor<ChildType, ExtraState>* visitor);
+  bool hasDeadObjects();
+  uint32_t removeDeadObjects();
+  bool removeObject(uint32_t idx);
+  void print(raw_ostream&, bool brief);
+
+};
+
+template<class ChildType, class ExtraState> 
+bool SharedFlatHeap<ChildType, ExtraState>::hasDeadObjects() {
+
+  for(typename EntryList::iterator it = entries.begin(), itend = entries.end(); it != itend; ++it) {
+    if(((ChildType*)it->second)->isDeadObject(it->first))
+      return true;
+  }
+
+  return false;
+
+}
+
+// As SharedTreeNode::removeDeadObjects; this heap is already writable.
+template<class ChildType, class ExtraState> 
+uint32_t SharedFlatHeap<ChildType, ExtraState>::removeDeadObjects() {
+
+  typename EntryList::iterator writeit = entries.begin();
+
+  for(typename EntryList::iterator it = entries.begin(), itend = entries.end(); it != itend; ++it) {
+
+    ChildType* child = (ChildType*)it->second;
+    if(child->isDeadObject(it->first)) {
+      child->dropReference();
+      delete child;
+    }
+    else {
+      *(writeit++) = *it;
+    }
+
+  }
+
+  uint32_t removed = std::distance(writeit, entries.end());
+  entries.erase(writeit, entries.end());
+  return removed;
+
+}
+
+// As SharedTreeNode::removeObject; this heap is already writable.
+template<class ChildType, class ExtraState> 
+bool SharedFlatHeap<ChildType, ExtraState>::removeObject(uint32_t idx) {
+
+  typename EntryList::iterator it = findEntry(idx);
+  if(it == entries.end() || it->first != idx)
+    return false;
+
+  ChildType* child = (ChildType*)it->second;
+  child->dropReference();
+  delete child;
+  entries.erase(it);
+  return true;
+
+}
+
+template<class ChildType, class ExtraState> 
+bool SharedFlatHeap<ChildType, ExtraState>::dropReference(std::vector<ShadowValue>* simplified) {
+
+  if(--refCount)
+    return false;
+
+  LFV3(errs() << "Freeing flat heap " << this << "\n");
+
+  for(typename EntryList::iterator it = entries.begin(), itend = entries.end(); it != itend; ++it) {
+
+    ChildType* child = (ChildType*)it->second;
+
+    if(simplified && child->derefWillAllowSimplify())
+      simplified->push_back(ShadowValue::getPtrIdx(-1, it->first));
+
+    child->dropReference();
+    delete child;
+
+  }
+
+  delete this;
+  return true;
+
+}
+
+template<class ChildType, class ExtraState> 
+ChildType* SharedFlatHeap<ChildType, ExtraState>::getReadableStoreFor(uint32_t idx) {
+
+  typename EntryList::iterator it = findEntry(idx);
+  if(it == entries.end() || it->first != idx)
+    return 0;
+  return (ChildType*)it->second;
+
+}
+
+template<class ChildType, class ExtraState> 
+ChildType* SharedFlatHeap<ChildType, ExtraState>::getOrCreateStoreFor(uint32_t idx, bool* isNewStore) {
+
+  // This heap already known writable.
+
+  typename EntryList::iterator it = findEntry(idx);
+  if(it != entries.end() && it->first == idx) {
+    *isNewStore = false;
+    return (ChildType*)it->second;
+  }
+
+  *isNewStore = true;
+  ChildType* newStore = new ChildType();
+  entries.insert(it, std::make_pair(idx, (void*)newStore));
+  return newStore;
+
+}
+
+template<class ChildType, class ExtraState> 
+SharedFlatHeap<ChildType, ExtraState>* SharedFlatHeap<ChildType, ExtraState>::getWritableHeap() {
+
+  if(refCount == 1)
+    return this;
+
+  // COW break this heap.
+  SharedFlatHeap* newHeap = new SharedFlatHeap();
+  newHeap->entries.reserve(entries.size());
+
+  for(typename EntryList::iterator it = entries.begin(), itend = entries.end(); it != itend; ++it)
+    newHeap->entries.push_back(std::make_pair(it->first, (void*)new ChildType(((ChildType*)it->second)->getReadableCopy())));
+
+  // Drop ref to this heap (see StoreRefCount on why this isn't a bare decrement).
+  dropReference(0);
+
+  return newHeap;
+
+}
+
+// Build a tree of the given height whose leaves are this heap's objects. The objects are not copied:
+// either the caller takes ownership of them (promotion to a tree) or the tree is a temporary view,
+// to be freed using freeTreeView.
+template<class ChildType, class ExtraState> 
+SharedTreeNode<ChildType, ExtraState>* SharedFlatHeap<ChildType, ExtraState>::buildTree(uint32_t height) {
+
+  SharedTreeNode<ChildType, ExtraState>* root = new SharedTreeNode<ChildType, ExtraState>();
+
+  for(typename EntryList::iterator it = entries.begin(), itend = entries.end(); it != itend; ++it) {
+
+    SharedTreeNode<ChildType, ExtraState>* node = root;
+    for(uint32_t h = height - 1; h != 0; --h) {
+
+      uint32_t nextChild = (it->first >> (h * HEAPTREEORDERLOG2)) & (HEAPTREEORDER-1);
+      if(!node->children[nextChild])
+	node->children[nextChild] = new SharedTreeNode<ChildType, ExtraState>();
+      node = (SharedTreeNode<ChildType, ExtraState>*)node->children[nextChild];
+
+    }
+
+    node->children[it->first & (HEAPTREEORDER-1)] = it->second;
+
+  }
+
+  return root;
+
+}
+
+// Free a tree built by buildTree without freeing the objects it points to.
+template<class ChildType, class ExtraState> 
+void freeTreeView(SharedTreeNode<ChildType, ExtraState>* node, uint32_t height) {
+
+  if(height != 0) {
+
+    for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+      if(node->children[i])
+	freeTreeView((SharedTreeNode<ChildType, ExtraState>*)node->children[i], height - 1);
+    }
+
+  }
+
+  delete node;
+
+}
+
+template<class ChildType, class ExtraState> 
+void SharedFlatHeap<ChildType, ExtraState>
+  ::mergeHeaps(SmallVector<SharedFlatHeap<ChildType, ExtraState>*, 4>& others, 
+	       bool allOthersClobbered, MergeBlockVisitor<ChildType, ExtraState>* visitor) {
+
+  // Same rules as for SharedTreeNode::mergeHeaps: all members of others are known to differ from this heap,
+  // which is already writable, and a null member of others describes an empty heap.
+  // First intersect or union the set of objects, then merge each object.
+
+  for(typename SmallVector<SharedFlatHeap*, 4>::iterator it = others.begin(), itend = others.end(); it != itend; ++it) {
+
+    SharedFlatHeap* other = *it;
+
+    if(allOthersClobbered) {
+
+      // Drop each of our objects that doesn't occur in other.
+      typename EntryList::iterator writeit = entries.begin();
+      for(typename EntryList::iterator readit = entries.begin(), readend = entries.end(); readit != readend; ++readit) {
+
+	if(other && other->getReadableStoreFor(readit->first))
+	  *(writeit++) = *readit;
+	else
+	  delete ((ChildType*)readit->second);
+
+      }
+
+      entries.erase(writeit, entries.end());
+
+    }
+    else if(other) {
+
+      // Add base versions of objects that occur in other but not this heap.
+      EntryList merged;
+      merged.reserve(entries.size() + other->entries.size());
+
+      typename EntryList::iterator thisit = entries.begin(), thisend = entries.end();
+      for(typename EntryList::iterator otherit = other->entries.begin(), otherend = other->entries.end(); otherit != otherend; ++otherit) {
+
+	while(thisit != thisend && thisit->first < otherit->first)
+	  merged.push_back(*(thisit++));
+
+	if(thisit != thisend && thisit->first == otherit->first)
+	  merged.push_back(*(thisit++));
+	else
+	  merged.push_back(std::make_pair(otherit->first, (void*)new ChildType(ChildType::getEmptyStore().getReadableCopy())));
+
+      }
+
+      merged.append(thisit, thisend);
+      entries.swap(merged);
+
+    }
+
+  }
+
+  // Now merge each object.
+  for(typename EntryList::iterator entryit = entries.begin(), entryend = entries.end(); entryit != entryend; ++entryit) {
+
+    SmallVector<void**, 4> incomingPtrs;
+    incomingPtrs.reserve(others.size() + 1);
+
+    incomingPtrs.push_back(&(entryit->second));
+
+    for(typename SmallVector<SharedFlatHeap*, 4>::iterator it = others.begin(), itend = others.end(); it != itend; ++it) {
+
+      typename EntryList::iterator findit;
+      if((!*it) || (findit = (*it)->findEntry(entryit->first)) == (*it)->entries.end() || findit->first != entryit->first)
+	incomingPtrs.push_back(0);
+      else
+	incomingPtrs.push_back(&(findit->second));
+
+    }
+
+    mergeHeapObject(&(entryit->second), incomingPtrs, entryit->first, visitor);
+
+  }
+
+}
+
+template<class ChildType, class ExtraState> void SharedFlatHeap<ChildType, ExtraState>::print(raw_ostream& RSO, bool brief) {
+
+  for(typename EntryList::iterator it = entries.begin(), itend = entries.end(); it != itend; ++it) {
+
+    printSV(RSO, getAllocWithIdx(it->first));
+    RSO << ": ";
+    ((ChildType*)it->second)->print(RSO, brief);
+    RSO << "\n";
+
+  }
+
+}
+
+// The heap: empty (root and flat both null), a flat heap (flat set) or a tree (root set, of the given height).
+// Heaps start flat and are promoted to trees when they grow beyond HEAPFLATMAX objects.
 template<class ChildType, class ExtraState> struct SharedTreeRoot {
 
   SharedTreeNode<ChildType, ExtraState>* root;
   uint32_t height;
+  SharedFlatHeap<ChildType, ExtraState>* flat;
 
-SharedTreeRoot() : root(0), height(0) { }
+SharedTreeRoot() : root(0), height(0), flat(0) { }
   void clear(std::vector<ShadowValue>* simplified);
   bool dropReference(std::vector<ShadowValue>* simplified);
   ChildType* getReadableStoreFor(const ShadowValue& V);
@@ -413,28 +881,90 @@ SharedTreeRoot() : root(0), height(0) { }
   void growToHeight(uint32_t newHeight);
   void grow(uint32_t idx);
   bool mustGrowFor(uint32_t idx);
+  void promoteFlat();
+  bool hasDeadObjects();
+  uint32_t removeDeadObjects();
+  bool removeObject(uint32_t idx);
+  bool isEmpty() const { return !(root || flat); }
 
 };
 
-static uint32_t getRequiredHeight(uint32_t idx) {
+template<class ChildType, class ExtraState> bool SharedTreeRoot<ChildType, ExtraState>::hasDeadObjects() {
 
-  uint32_t height = 0;
+  if(flat)
+    return flat->hasDeadObjects();
+  else if(root)
+    return root->hasDeadObjects(0, height - 1);
+  else
+    return false;
 
-  do {
+}
 
-    idx >>= HEAPTREEORDERLOG2;
-    ++height;
+// Drop certainly-freed objects, which absent objects are equivalent to, so that later copies
+// and merges of this heap needn't carry them. Returns the number dropped.
+template<class ChildType, class ExtraState> uint32_t SharedTreeRoot<ChildType, ExtraState>::removeDeadObjects() {
 
-  } while(idx);
+  uint32_t removed;
 
-  return height;
+  if(flat) {
+
+    flat = flat->getWritableHeap();
+    removed = flat->removeDeadObjects();
+
+  }
+  else if(root) {
+
+    root = root->getWritableNode(height - 1);
+    removed = root->removeDeadObjects(0, height - 1);
+
+  }
+  else {
+
+    return 0;
+
+  }
+
+  if((flat && flat->entries.empty()) || (root && root->isEmpty()))
+    clear(0);
+
+  return removed;
+
+}
+
+// Drop the single object idx, as removeDeadObjects would if it is certainly freed. Returns true if it was present.
+template<class ChildType, class ExtraState> bool SharedTreeRoot<ChildType, ExtraState>::removeObject(uint32_t idx) {
+
+  bool removed;
+
+  if(flat) {
+
+    flat = flat->getWritableHeap();
+    removed = flat->removeObject(idx);
+
+  }
+  else if(root && getRequiredHeight(idx) <= height) {
+
+    root = root->getWritableNode(height - 1);
+    removed = root->removeObject(idx, height - 1);
+
+  }
+  else {
+
+    return false;
+
+  }
+
+  if((flat && flat->entries.empty()) || (root && root->isEmpty()))
+    clear(0);
+
+  return removed;
 
 }
 
 template<class ChildType, class ExtraState> ChildType* SharedTreeRoot<ChildType, ExtraState>::getReadableStoreFor(const ShadowValue& V) {
 
   // Empty heap?
-  if(height == 0)
+  if(isEmpty())
     return 0;
 
   // Is a valid allocation instruction?
@@ -442,6 +972,9 @@ template<class ChildType, class ExtraState> ChildType* SharedTreeRoot<ChildType,
   if(idx < 0)
     return 0;
 
+  if(flat)
+    return flat->getReadableStoreFor((uint32_t)idx);
+
   if(getRequiredHeight(idx) > height)
     return 0;
 
@@ -491,9 +1024,18 @@ template<class ChildType, class ExtraState> ChildType* SharedTreeRoot<ChildType,
 
   if(!root) {
 
-    // Empty heap.
-    root = new SharedTreeNode<ChildType, ExtraState>();
-    height = getRequiredHeight(idx);
+    // Empty or flat heap.
+    if(!flat)
+      flat = new SharedFlatHeap<ChildType, ExtraState>();
+    else
+      flat = flat->getWritableHeap();
+
+    ChildType* ret = flat->getOrCreateStoreFor((uint32_t)idx, isNewStore);
+
+    if(flat->entries.size() > HEAPFLATMAX)
+      promoteFlat();
+
+    return ret;
 
   }
   else if(mustGrowFor(idx)) {
@@ -511,8 +1053,25 @@ template<class ChildType, class ExtraState> ChildType* SharedTreeRoot<ChildType,
 
 }
 
+// Convert a writable flat heap to a tree, which takes over its objects.
+template<class ChildType, class ExtraState> void SharedTreeRoot<ChildType, ExtraState>::promoteFlat() {
+
+  release_assert(flat && flat->refCount == 1 && "Promoting a shared flat heap?");
+
+  height = flat->requiredTreeHeight();
+  root = flat->buildTree(height);
+  delete flat;
+  flat = 0;
+
+}
+
 template<class ChildType, class ExtraState> void SharedTreeRoot<ChildType, ExtraState>::clear(std::vector<ShadowValue>* simplified) {
 
+  if(flat) {
+    flat->dropReference(simplified);
+    flat = 0;
+  }
+
   if(height == 0)
     return;
   root->dropReference(0, height - 1, simplified);
@@ -528,14 +1087,110 @@ template<class ChildType, class ExtraState> bool SharedTreeRoot<ChildType, Extra
 
 }
 
+// Stack frames are split into chunks of FRAMECHUNKSIZE slots. Like the leaves of a SharedTreeNode, chunks
+// are refcounted and CoW broken individually, so writing one local in a shared frame copies only the chunk
+// holding it, and chunks that are never written are never allocated. Chunks are all one size, and freed
+// ones are pooled for reuse rather than returned to the allocator, which deep call paths churn through.
+#define FRAMECHUNKSIZE 8
+#define FRAMECHUNKSIZELOG2 3
+
+template<class ChildType> struct SharedFrameChunk {
+
+  ChildType slots[FRAMECHUNKSIZE];
+  RefCount refCount;
+
+  static std::vector<SharedFrameChunk*>& pool() {
+    static LLPE_STORE_POOL_TLS std::vector<SharedFrameChunk*> freeChunks;
+    return freeChunks;
+  }
+
+  static SharedFrameChunk* create() {
+
+    GlobalFrameChunkCounter.alloc();
+
+    std::vector<SharedFrameChunk*>& freeChunks = pool();
+    SharedFrameChunk* newChunk;
+    if(freeChunks.empty()) {
+      newChunk = new SharedFrameChunk();
+    }
+    else {
+      newChunk = freeChunks.back();
+      freeChunks.pop_back();
+    }
+
+    newChunk->refCount = 1;
+    return newChunk;
+
+  }
+
+  // Slots are left invalid when a chunk returns to the pool. firstIdx is the frame index of slots[0].
+  bool dropReference(uint32_t stack_depth, uint32_t firstIdx, std::vector<ShadowValue>* simplified) {
+
+    if(--refCount)
+      return false;
+
+    for(uint32_t i = 0; i < FRAMECHUNKSIZE; ++i) {
+      if(!slots[i].isValid())
+	continue;
+      if(simplified && slots[i].derefWillAllowSimplify())
+	simplified->push_back(ShadowValue::getPtrIdx(stack_depth, firstIdx + i));
+      slots[i].dropReference();
+      slots[i] = ChildType();
+    }
+
+    GlobalFrameChunkCounter.free();
+    pool().push_back(this);
+    return true;
+
+  }
+
+  SharedFrameChunk* getWritableChunk() {
+
+    if(refCount == 1)
+      return this;
+
+    SharedFrameChunk* newChunk = create();
+    for(uint32_t i = 0; i < FRAMECHUNKSIZE; ++i) {
+      if(slots[i].isValid())
+	newChunk->slots[i] = slots[i].getReadableCopy();
+    }
+
+    dropReference(0, 0, 0);
+    return newChunk;
+
+  }
+
+};
+
 template<class ChildType, class ExtraState> struct SharedStoreMap {
 
-  std::vector<ChildType> store;
-  uint32_t refCount;
+  typedef SharedFrameChunk<ChildType> ChunkType;
+
+  // A null chunk has no valid slots.
+  SmallVector<ChunkType*, 4> chunks;
+  uint32_t nSlots;
+  RefCount refCount;
   InlineAttempt* IA;
   bool empty;
 
-SharedStoreMap(InlineAttempt* _IA, uint32_t initSize) : store(initSize), refCount(1), IA(_IA), empty(true) { }
+SharedStoreMap(InlineAttempt* _IA, uint32_t initSize) : chunks((initSize + FRAMECHUNKSIZE - 1) >> FRAMECHUNKSIZELOG2, (ChunkType*)0), 
+    nSlots(initSize), refCount(1), IA(_IA), empty(true) { }
+
+  uint32_t size() const { return nSlots; }
+  ChunkType* getChunkFor(uint32_t i) const {
+    return i < nSlots ? chunks[i >> FRAMECHUNKSIZELOG2] : 0;
+  }
+  // Returns null if slot i doesn't hold a valid store.
+  ChildType* getReadableSlot(uint32_t i) const {
+    ChunkType* C = getChunkFor(i);
+    if(!C)
+      return 0;
+    ChildType* ret = &(C->slots[i & (FRAMECHUNKSIZE - 1)]);
+    return ret->isValid() ? ret : 0;
+  }
+  ChildType& getWritableSlot(uint32_t i);
+  void clearSlot(uint32_t i);
+  void resize(uint32_t newSize);
 
   SharedStoreMap* getWritableStoreMap();
   bool dropReference(uint32_t stack_depth, std::vector<ShadowValue>* simplified);
@@ -545,6 +1200,49 @@ SharedStoreMap(InlineAttempt* _IA, uint32_t initSize) : store(initSize), refCoun
 
 };
 
+// This frame must be writable. Breaks sharing of slot i's chunk, and grows the frame if need be.
+template<class ChildType, class ExtraState> ChildType& SharedStoreMap<ChildType, ExtraState>::getWritableSlot(uint32_t i) {
+
+  if(i >= nSlots)
+    resize(i + 1);
+
+  ChunkType*& C = chunks[i >> FRAMECHUNKSIZELOG2];
+  if(!C)
+    C = ChunkType::create();
+  else
+    C = C->getWritableChunk();
+
+  return C->slots[i & (FRAMECHUNKSIZE - 1)];
+
+}
+
+template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, ExtraState>::clearSlot(uint32_t i) {
+
+  ChildType& slot = getWritableSlot(i);
+  slot.dropReference();
+  slot = ChildType();
+
+}
+
+template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, ExtraState>::resize(uint32_t newSize) {
+
+  for(uint32_t i = newSize; i < nSlots; ++i) {
+    if(getReadableSlot(i))
+      clearSlot(i);
+  }
+
+  // Any chunks beyond the new end now hold no valid slots.
+  uint32_t newChunks = (newSize + FRAMECHUNKSIZE - 1) >> FRAMECHUNKSIZELOG2;
+  for(uint32_t i = newChunks; i < chunks.size(); ++i) {
+    if(chunks[i])
+      chunks[i]->dropReference(0, 0, 0);
+  }
+
+  chunks.resize(newChunks, (ChunkType*)0);
+  nSlots = newSize;
+
+}
+
 template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState>* SharedStoreMap<ChildType, ExtraState>::getWritableStoreMap() {
 
   // Refcount == 1 means we can just write in place.
@@ -553,20 +1251,20 @@ template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState
     return this;
   }
 
-  // COW break: copy the map and either share or copy its entries.
-  LFV3(errs() << "COW break local map " << this << " with " << store.size() << " entries\n");
-  SharedStoreMap* newMap = new SharedStoreMap(IA, store.size());
+  // COW break: copy the map, sharing its chunks.
+  LFV3(errs() << "COW break local map " << this << " with " << nSlots << " entries\n");
+  SharedStoreMap* newMap = new SharedStoreMap(IA, 0);
+  newMap->chunks = chunks;
+  newMap->nSlots = nSlots;
+  newMap->empty = empty;
 
-  uint32_t i = 0;
-  for(typename std::vector<ChildType>::iterator it = store.begin(), it2 = store.end(); it != it2; ++it, ++i) {
-    if(!it->isValid())
-      continue;
-    newMap->store[i] = it->getReadableCopy();
-    newMap->empty = false;
+  for(typename SmallVector<ChunkType*, 4>::iterator it = newMap->chunks.begin(), itend = newMap->chunks.end(); it != itend; ++it) {
+    if(*it)
+      (*it)->refCount++;
   }
 
-  // Drop reference on the existing map (can't destroy it):
-  refCount--;
+  // Drop reference on the existing map (only destroys it if another holder broke it concurrently):
+  dropReference(0, 0);
   
   return newMap;
 
@@ -597,25 +1295,21 @@ template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, Extra
 
   release_assert(refCount <= 1 && "clear() against shared map?");
 
-  // Drop references to any maps this points to;
-  uint32_t i = 0;
-  for(typename std::vector<ChildType>::iterator it = store.begin(), itend = store.end(); it != itend; ++it, ++i) {
-    if(!it->isValid())
-      continue;
-    if(simplified && it->derefWillAllowSimplify())
-      simplified->push_back(ShadowValue::getPtrIdx(stack_depth, i));
-    it->dropReference();
+  // Drop references to any chunks this points to;
+  for(uint32_t i = 0, ilim = chunks.size(); i != ilim; ++i) {
+    if(chunks[i])
+      chunks[i]->dropReference(stack_depth, i << FRAMECHUNKSIZELOG2, simplified);
   }
 
-  store.clear();
-  store.resize(allocFrameSize(IA));
+  nSlots = allocFrameSize(IA);
+  chunks.assign((nSlots + FRAMECHUNKSIZE - 1) >> FRAMECHUNKSIZELOG2, (ChunkType*)0);
   empty = true;
 
 }
 
 template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState>* SharedStoreMap<ChildType, ExtraState>::getEmptyMap(uint32_t stack_depth) {
 
-  if(!store.size())
+  if(!nSlots)
     return this;
   else if(refCount == 1) {
     clear(stack_depth, 0);
@@ -623,7 +1317,7 @@ template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState
   }
   else {
     dropReference(stack_depth, 0);
-    return new SharedStoreMap<ChildType, ExtraState>(IA, store.size());
+    return new SharedStoreMap<ChildType, ExtraState>(IA, nSlots);
   }
 
 }
@@ -656,12 +1350,15 @@ ShadowValue getStackAllocationWithIndex(InlineAttempt*, uint32_t);
 
 template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, ExtraState>::print(raw_ostream& RSO, bool brief) {
 
-  uint32_t i = 0;
-  for(typename std::vector<ChildType>::iterator it = store.begin(), itend = store.end(); it != itend; ++it, ++i) {
+  for(uint32_t i = 0; i != nSlots; ++i) {
+
+    ChildType* slot = getReadableSlot(i);
+    if(!slot)
+      continue;
 
     printSV(RSO, getStackAllocationWithIndex(IA, i));
     RSO << ": ";
-    it->print(RSO, brief);
+    slot->print(RSO, brief);
     RSO << "\n";
 
   }
@@ -673,16 +1370,21 @@ template<class ChildType, class ExtraState> struct LocalStoreMap {
   typedef SharedStoreMap<ChildType, ExtraState> FrameType;
   typedef SharedTreeRoot<ChildType, ExtraState> RootType;
   typedef SharedTreeNode<ChildType, ExtraState> NodeType;
+  typedef SharedFlatHeap<ChildType, ExtraState> FlatType;
 
   SmallVector<FrameType*, 4> frames;
   RootType heap;
 
   bool allOthersClobbered;
-  uint32_t refCount;
+  // Set when the map was clobbered down to es.clobberSave and no entry has been created since,
+  // so that every object it holds is in that set.
+  bool onlyClobberSaved;
+  RefCount refCount;
 
   ExtraState es;
 
-LocalStoreMap(uint32_t s) : frames(s), heap(), allOthersClobbered(false), refCount(1) {}
+LocalStoreMap(uint32_t s) : frames(s), heap(), allOthersClobbered(false), onlyClobberSaved(false), refCount(1) { GlobalStoreMapCounter.alloc(); }
+  ~LocalStoreMap() { GlobalStoreMapCounter.free(); }
 
   void clear();
   LocalStoreMap* getEmptyMap();
@@ -692,7 +1394,7 @@ LocalStoreMap(uint32_t s) : frames(s), heap(), allOthersClobbered(false), refCou
   bool empty();
   void copyEmptyFrames(SmallVector<SharedStoreMap<ChildType, ExtraState>*, 4>&);
   void copyFramesFrom(const LocalStoreMap<ChildType, ExtraState>&);
-  std::vector<ChildType>& getWritableFrame(int32_t frameNo);
+  FrameType* getWritableFrame(int32_t frameNo);
   void pushStackFrame(InlineAttempt*);
   void popStackFrame();
   ChildType* getReadableStoreFor(const ShadowValue& V);
@@ -706,19 +1408,23 @@ ChildType* LocalStoreMap<ChildType, ExtraState>::getOrCreateStoreFor(ShadowValue
   int32_t frameNo = V.getFrameNo();
   if(frameNo != -1) {
 
-    std::vector<ChildType>& frameMap = getWritableFrame(frameNo);
-    frames[frameNo]->empty = false;
+    FrameType* frame = getWritableFrame(frameNo);
+    frame->empty = false;
     int32_t framePos = V.getFramePos();
     release_assert(framePos >= 0 && "Stack entry without an index?");
-    if(frameMap.size() <= (uint32_t)framePos)
-      frameMap.resize(framePos + 1);
-    *isNewStore = !(frameMap[framePos].isValid());
-    return &(frameMap[framePos]);
+    ChildType& slot = frame->getWritableSlot((uint32_t)framePos);
+    *isNewStore = !(slot.isValid());
+    if(*isNewStore)
+      onlyClobberSaved = false;
+    return &slot;
 
   }
   else {
 
-    return heap.getOrCreateStoreFor(V, isNewStore);
+    ChildType* ret = heap.getOrCreateStoreFor(V, isNewStore);
+    if(*isNewStore)
+      onlyClobberSaved = false;
+    return ret;
 
   }
 
@@ -731,16 +1437,7 @@ template<class ChildType, class ExtraState> ChildType* LocalStoreMap<ChildType,
     return heap.getReadableStoreFor(V);
   else {
 
-    std::vector<ChildType>& frame = frames[frameNo]->store;
-    uint32_t frameIdx = V.getFramePos();
-    if(frame.size() <= frameIdx)
-      return 0;
-
-    ChildType* ret = &(frame[frameIdx]);
-    if(!ret->isValid())
-      return 0;
-    else
-      return ret;
+    return frames[frameNo]->getReadableSlot(V.getFramePos());
 
   }
   
@@ -755,19 +1452,20 @@ template<class ChildType, class ExtraState> LocalStoreMap<ChildType, ExtraState>
   newMap->copyFramesFrom(*this);
 
   newMap->allOthersClobbered = allOthersClobbered;
+  newMap->onlyClobberSaved = onlyClobberSaved;
 
-  // Can't destory, as refCount > 1
-  --refCount;
+  // Only destroys this if another holder broke it concurrently.
+  dropReference();
 
   return newMap;
 
 }
 
-template<class ChildType, class ExtraState> std::vector<ChildType>& LocalStoreMap<ChildType, ExtraState>::getWritableFrame(int32_t frameNo) {
+template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState>* LocalStoreMap<ChildType, ExtraState>::getWritableFrame(int32_t frameNo) {
 
   release_assert(frameNo >= 0 && frameNo < (int32_t)frames.size());
   frames[frameNo] = frames[frameNo]->getWritableStoreMap();
-  return frames[frameNo]->store;
+  return frames[frameNo];
 
 }
 
@@ -781,7 +1479,7 @@ template<class ChildType, class ExtraState> void LocalStoreMap<ChildType, ExtraS
 
 template<class ChildType, class ExtraState> bool LocalStoreMap<ChildType, ExtraState>::empty() {
 
-  if(heap.height != 0)
+  if(!heap.isEmpty())
     return false;
 
   for(uint32_t i = 0; i < frames.size(); ++i) {
@@ -802,10 +1500,11 @@ template<class ChildType, class ExtraState> LocalStoreMap<ChildType, ExtraState>
     return this;
   }
   else {
-    // Can't free the map (refcount > 1)
-    --refCount;
+    // Copy the frame list before giving up our reference, which frees the map if
+    // another holder broke it concurrently.
     LocalStoreMap<ChildType, ExtraState>* newMap = new LocalStoreMap<ChildType, ExtraState>(frames.size());
     newMap->copyEmptyFrames(frames);
+    dropReference();
     return newMap;
   }
 
@@ -830,6 +1529,8 @@ template<class ChildType, class ExtraState> void LocalStoreMap<ChildType, ExtraS
   heap = other.heap;
   if(heap.root)
     heap.root->refCount++;
+  if(heap.flat)
+    heap.flat->refCount++;
 
   for(uint32_t i = 0; i < frames.size(); ++i) {
 
@@ -891,7 +1592,9 @@ template<class ChildType, class ExtraState> void LocalStoreMap<ChildType, ExtraS
     frames[i]->print(RSO, brief);
   }
   errs() << "--- End stack ---\n--- Heap ---\n";
-  if(!heap.root)
+  if(heap.flat)
+    heap.flat->print(RSO, brief);
+  else if(!heap.root)
     errs() << "(empty)\n";
   else
     heap.root->print(RSO, brief, heap.height - 1, 0);
@@ -925,18 +1628,22 @@ template<class ChildType, class ExtraState> struct MergeBlockVisitor : public Sh
 };
 
 // Comparator for finding the best target heap: we want the tallest heap, and of those, we favour a writable one. Finally compare pointers.
+// Flat and empty heaps have height 0 and so sort after all trees.
 template<class ChildType, class ExtraState> bool rootTallerThan(const LocalStoreMap<ChildType, ExtraState>* r1, const LocalStoreMap<ChildType, ExtraState>* r2) {
 
   if(r1->heap.height != r2->heap.height)
     return r1->heap.height > r2->heap.height;
 
-  return r1->heap.root > r2->heap.root;
+  if(r1->heap.root != r2->heap.root)
+    return r1->heap.root > r2->heap.root;
+
+  return r1->heap.flat > r2->heap.flat;
   
 }
 
 template<class ChildType, class ExtraState> bool rootsEqual(const LocalStoreMap<ChildType, ExtraState>* r1, const LocalStoreMap<ChildType, ExtraState>* r2) {
 
-  return r1->heap.root == r2->heap.root && r1->heap.height == r2->heap.height;
+  return r1->heap.root == r2->heap.root && r1->heap.height == r2->heap.height && r1->heap.flat == r2->heap.flat;
 
 }
 
@@ -970,12 +1677,52 @@ void MergeBlockVisitor<ChildType, ExtraState>::
   typename SmallVector<MapType*, 4>::iterator uniqend = std::unique(incomingRoots.begin(), incomingRoots.end(), rootsEqual<ChildType, ExtraState>);
   
   // Heaps never differ?
-  if(std::distance(incomingRoots.begin(), uniqend) == 1)
+  if(std::distance(incomingRoots.begin(), uniqend) == 1) {
+    ++GlobalMergeSharing.heaps;
+    return;
+  }
+
+  release_assert(!incomingRoots[0]->heap.isEmpty() && "If heaps differ at least one must be initialised!");
+
+  if(incomingRoots[0]->heap.height == 0) {
+
+    // No trees involved: merge flat heaps.
+    if(!toMap->heap.flat)
+      toMap->heap.flat = new SharedFlatHeap<ChildType, ExtraState>();
+    else
+      toMap->heap.flat = toMap->heap.flat->getWritableHeap();
+
+    SmallVector<SharedFlatHeap<ChildType, ExtraState>*, 4> flats;
+    for(typename SmallVector<MapType*, 4>::iterator it = incomingRoots.begin(); it != uniqend; ++it) {
+
+      if(toMap->heap.flat != (*it)->heap.flat)
+	flats.push_back((*it)->heap.flat);
+
+    }
+
+    toMap->heap.flat->mergeHeaps(flats, toMap->allOthersClobbered, this);
+
+    if(toMap->heap.flat->entries.empty()) {
+      delete toMap->heap.flat;
+      toMap->heap.flat = 0;
+    }
+    else if(toMap->heap.flat->entries.size() > HEAPFLATMAX) {
+      toMap->heap.promoteFlat();
+    }
+
     return;
 
-  release_assert(incomingRoots[0]->heap.height != 0 && "If heaps differ at least one must be initialised!");
+  }
+
+  // At least one tree: merge as trees, viewing any flat heaps as trees for the duration.
+
+  if(toMap->heap.flat) {
 
-  if(!toMap->heap.root) {
+    toMap->heap.flat = toMap->heap.flat->getWritableHeap();
+    toMap->heap.promoteFlat();
+
+  }
+  else if(!toMap->heap.root) {
 
     // Target has no heap at all yet -- make one.
     toMap->heap.root = new NodeType();
@@ -989,12 +1736,21 @@ void MergeBlockVisitor<ChildType, ExtraState>::
 
   }
 
-  // Grow the target heap to the tallest height seen.
-  if(toMap->heap.height != incomingRoots[0]->heap.height)
-    toMap->heap.growToHeight(incomingRoots[0]->heap.height);
+  // Grow the target heap to the tallest height seen, including the height needed to hold any flat heap.
+  uint32_t targetHeight = incomingRoots[0]->heap.height;
+  for(typename SmallVector<MapType*, 4>::iterator it = incomingRoots.begin(); it != uniqend; ++it) {
+
+    if((*it)->heap.flat)
+      targetHeight = std::max(targetHeight, (*it)->heap.flat->requiredTreeHeight());
+
+  }
+
+  if(toMap->heap.height < targetHeight)
+    toMap->heap.growToHeight(targetHeight);
 
   // Start the tree merge:
   SmallVector<NodeType*, 4> roots;
+  SmallVector<NodeType*, 4> flatViews;
   for(typename SmallVector<MapType*, 4>::iterator it = incomingRoots.begin(); it != uniqend; ++it) {
 
     if(toMap->heap.root == (*it)->heap.root)
@@ -1002,6 +1758,15 @@ void MergeBlockVisitor<ChildType, ExtraState>::
 
     LocalStoreMap<ChildType, ExtraState>* thisMap = *it;
 
+    if(thisMap->heap.flat) {
+
+      NodeType* view = thisMap->heap.flat->buildTree(toMap->heap.height);
+      flatViews.push_back(view);
+      roots.push_back(view);
+      continue;
+
+    }
+
     // Temporarily grow heaps that are shorter than the target to make the merge easier to code.
     // Leave their height attribute unchanged as an indicator we need to undo this shortly.
     // These maps might be shared so it's important they are seen unmodified ouside this function.
@@ -1023,7 +1788,7 @@ void MergeBlockVisitor<ChildType, ExtraState>::
       continue;
 
     LocalStoreMap<ChildType, ExtraState>* thisMap = *it;
-    uint32_t tempFramesToRemove = incomingRoots[0]->heap.height - thisMap->heap.height;
+    uint32_t tempFramesToRemove = toMap->heap.height - thisMap->heap.height;
 
     for(uint32_t i = 0; i < tempFramesToRemove; ++i) {
       NodeType* removeNode = thisMap->heap.root;
@@ -1034,6 +1799,9 @@ void MergeBlockVisitor<ChildType, ExtraState>::
 
   }  
 
+  for(typename SmallVector<NodeType*, 4>::iterator it = flatViews.begin(), itend = flatViews.end(); it != itend; ++it)
+    freeTreeView(*it, toMap->heap.height - 1);
+
 }
 
 uint64_t getAllocSize(InlineAttempt*, uint32_t idx);
@@ -1052,12 +1820,13 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
   typename SmallVector<FrameType*, 4>::iterator uniqend = std::unique(incomingFrames.begin(), incomingFrames.end());
 
   // Frames never differ?
-  if(std::distance(incomingFrames.begin(), uniqend) == 1)
+  if(std::distance(incomingFrames.begin(), uniqend) == 1) {
+    ++GlobalMergeSharing.frames;
     return;
+  }
 
   // CoW break stack frame if necessary
   FrameType* mergeToFrame = toMap->frames[idx] = toMap->frames[idx]->getWritableStoreMap();
-  std::vector<ChildType>& mergeToStore = mergeToFrame->store;
 
   InlineAttempt* thisFrameIA = mergeToFrame->IA;
 
@@ -1067,7 +1836,6 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
     FrameType* mergeFromFrame = *it;
     if(mergeFromFrame == mergeToFrame)
       continue;
-    std::vector<ChildType>& mergeFromStore = mergeFromFrame->store;
 
     if(toMap->allOthersClobbered) {
       
@@ -1076,17 +1844,15 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
 
       // Remove any existing mappings in mergeToFrame that do not occur in mergeFromFrame:
 
-      for(uint32_t i = 0, ilim = mergeToStore.size(); i != ilim; ++i) {
+      for(uint32_t i = 0, ilim = mergeToFrame->size(); i != ilim; ++i) {
 
-	if(mergeToStore[i].isValid() && (i >= mergeFromStore.size() || !mergeFromStore[i].isValid())) {
-	  mergeToStore[i].dropReference();
-	  mergeToStore[i] = ChildType();
-	}
+	if(mergeToFrame->getReadableSlot(i) && !mergeFromFrame->getReadableSlot(i))
+	  mergeToFrame->clearSlot(i);
 
       }
 
-      if(mergeToStore.size() > mergeFromStore.size())
-	mergeToStore.resize(mergeFromStore.size());
+      if(mergeToFrame->size() > mergeFromFrame->size())
+	mergeToFrame->resize(mergeFromFrame->size());
 
     }
     else {
@@ -1098,13 +1864,13 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
       // This will get overwritten below but creates the asymmetry that 
       // x in mergeFromFrame -> x in mergeToFrame.
 
-      if(mergeFromStore.size() > mergeToStore.size())
-	mergeToStore.resize(mergeFromStore.size());
+      if(mergeFromFrame->size() > mergeToFrame->size())
+	mergeToFrame->resize(mergeFromFrame->size());
 
-      for(uint32_t i = 0, ilim = mergeFromStore.size(); i != ilim; ++i) {
+      for(uint32_t i = 0, ilim = mergeFromFrame->size(); i != ilim; ++i) {
 	  
-	if(mergeFromStore[i].isValid() && !mergeToStore[i].isValid()) {
-	  mergeToStore[i] = ChildType::getEmptyStore().getReadableCopy();
+	if(mergeFromFrame->getReadableSlot(i) && !mergeToFrame->getReadableSlot(i)) {
+	  mergeToFrame->getWritableSlot(i) = ChildType::getEmptyStore().getReadableCopy();
 	  mergeToFrame->empty = false;
 	}
 	
@@ -1118,16 +1884,35 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
   // Note that in the allOthersClobbered case this only merges in
   // information from locations explicitly mentioned in all incoming frames.
 
-  for(uint32_t i = 0, ilim = mergeToStore.size(); i != ilim; ++i) {
+  for(uint32_t i = 0, ilim = mergeToFrame->size(); i != ilim; ++i) {
 
-    if(!mergeToStore[i].isValid())
-      continue;
+    // Skip whole chunks that every incoming frame shares.
+    if((i & (FRAMECHUNKSIZE - 1)) == 0) {
+
+      typename FrameType::ChunkType* toChunk = mergeToFrame->getChunkFor(i);
+      bool chunkShared = true;
+      for(typename SmallVector<FrameType*, 4>::iterator incit = incomingFrames.begin(); incit != uniqend && chunkShared; ++incit) {
+	if((*incit)->getChunkFor(i) != toChunk)
+	  chunkShared = false;
+      }
+
+      if(chunkShared) {
+	i += (FRAMECHUNKSIZE - 1);
+	if(i >= ilim)
+	  break;
+	continue;
+      }
 
-    ChildType* mergeToLoc = &(mergeToStore[i]);
+    }
+
+    ChildType* mergeToLoc = mergeToFrame->getReadableSlot(i);
+    if(!mergeToLoc)
+      continue;
 
     uint64_t mergeSize = getAllocSize(thisFrameIA, i);
 
     SmallVector<ChildType*, 4> incomingStores;
+    bool allShared = true;
 
     for(typename SmallVector<SharedStoreMap<ChildType, ExtraState>*, 4>::iterator incit = incomingFrames.begin(); incit != uniqend; ++incit) {
 
@@ -1135,17 +1920,27 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
       if(mergeFromFrame == mergeToFrame)
 	continue;
 
-      ChildType* mergeFromLoc;
-
-      if(mergeFromFrame->store.size() > i && mergeFromFrame->store[i].isValid())
-	mergeFromLoc = &(mergeFromFrame->store[i]);
-      else
+      ChildType* mergeFromLoc = mergeFromFrame->getReadableSlot(i);
+      if(!mergeFromLoc)
 	mergeFromLoc = &(ChildType::getEmptyStore());
 
+      if(!ChildType::EQ(mergeFromLoc, mergeToLoc))
+	allShared = false;
+
       incomingStores.push_back(mergeFromLoc);
 
     }
 
+    // Fast path: all incoming frames share this object with the target.
+    if(allShared) {
+      ++GlobalMergeSharing.objects;
+      continue;
+    }
+
+    // Only now break sharing of the chunk holding this slot. The incoming stores stay valid:
+    // any chunk copied here is still referenced by the frame it was shared with.
+    mergeToLoc = &(mergeToFrame->getWritableSlot(i));
+
     std::sort(incomingStores.begin(), incomingStores.end(), ChildType::LT);
     typename SmallVector<ChildType*, 4>::iterator storeuniqend = 
       std::unique(incomingStores.begin(), incomingStores.end(), ChildType::EQ);
@@ -1229,6 +2024,7 @@ void MergeBlockVisitor<ChildType, ExtraState>::doMerge() {
       mergeFrames(mergeMap, firstMergeFrom, uniqend, i);
 
     mergeHeaps(mergeMap, firstMergeFrom, uniqend);
+    mergeMap->onlyClobberSaved = false;
 
     ExtraState::doMerge(mergeMap, firstMergeFrom, uniqend, verbose);
 
@@ -1238,6 +2034,7 @@ void MergeBlockVisitor<ChildType, ExtraState>::doMerge() {
   else {
 
     // No stores differ; just use #0
+    ++GlobalMergeSharing.maps;
     newMap = incomingStores[0];
     retainMap = newMap;
 
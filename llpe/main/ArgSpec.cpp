@@ -11,6 +11,7 @@
 
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include <string>
 
 #include "llvm/Analysis/LLPE.h"
@@ -28,10 +29,11 @@
 
 using namespace llvm;
 
-// Read a file into a std::string
-static void readWholeFile(std::string& path, std::string& out, bool addnewline) {
+// Map a newline-delimited input file into a private, writable buffer that the loaders below
+// compact in place. The buffer always ends with a newline.
+static std::unique_ptr<WritableMemoryBuffer> mapInputFile(std::string& path) {
 
-  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
+  ErrorOr<std::unique_ptr<WritableMemoryBuffer>> MB = WritableMemoryBuffer::getFile(path);
   if(std::error_code ec = MB.getError()) {
 
     errs() << "Failed to load from " << path << ": " << ec.message() << "\n";
@@ -39,15 +41,67 @@ static void readWholeFile(std::string& path, std::string& out, bool addnewline)
 
   }
 
-  out = (*MB)->getBuffer();
-  if(addnewline && (out.size() == 0 || out[out.size() - 1] != '\n')) {
-    out += '\n';
-  }  
+  std::unique_ptr<WritableMemoryBuffer> Buf = std::move(*MB);
+  size_t Size = Buf->getBufferSize();
+  if(Size == 0 || Buf->getBufferStart()[Size - 1] != '\n') {
+
+    // Only this case needs a copy, to make room for the terminator.
+    std::unique_ptr<WritableMemoryBuffer> Ext = WritableMemoryBuffer::getNewUninitMemBuffer(Size + 1, path);
+    memcpy(Ext->getBufferStart(), Buf->getBufferStart(), Size);
+    Ext->getBufferStart()[Size] = '\n';
+    Buf = std::move(Ext);
+
+  }
+
+  return Buf;
 
 }
 
+// Walks the lines of a mapped input. Lines the caller keeps are moved down over any that were
+// dropped and nul-terminated, so that the finished prefix can be used as the constant string directly.
+struct InputLines {
+
+  char* Buf;
+  size_t Size;
+  size_t ReadIdx;
+  size_t WriteIdx;
+
+InputLines(WritableMemoryBuffer& MB) : Buf(MB.getBufferStart()), Size(MB.getBufferSize()), ReadIdx(0), WriteIdx(0) {}
+
+  // Fetch the next line, without its newline.
+  bool next(StringRef& Line) {
+
+    if(ReadIdx == Size)
+      return false;
+
+    char* Start = Buf + ReadIdx;
+    char* End = (char*)memchr(Start, '\n', Size - ReadIdx);
+    Line = StringRef(Start, End - Start);
+    ReadIdx = (End - Buf) + 1;
+    return true;
+
+  }
+
+  // Keep Line, which must be the line just returned by next. Returns its offset in the compacted string.
+  size_t keep(StringRef Line) {
+
+    size_t Start = WriteIdx;
+    if(Line.data() != Buf + WriteIdx)
+      memmove(Buf + WriteIdx, Line.data(), Line.size());
+    WriteIdx += Line.size();
+    Buf[WriteIdx++] = '\0';
+    return Start;
+
+  }
+
+  StringRef compacted() const {
+    return StringRef(Buf, WriteIdx);
+  }
+
+};
+
 // Create a new constant global pointing to a maybe-null-terminated string
-GlobalVariable* llvm::getStringArray(std::string& bytes, Module& M, bool addNull) {
+GlobalVariable* llvm::getStringArray(StringRef bytes, Module& M, bool addNull) {
 
   Constant* EnvInit = ConstantDataArray::getString(M.getContext(), bytes, addNull);  
   return new GlobalVariable(M, EnvInit->getType(), true, GlobalValue::PrivateLinkage, EnvInit, "spec_env_str");
@@ -55,7 +109,7 @@ GlobalVariable* llvm::getStringArray(std::string& bytes, Module& M, bool addNull
 }
 
 // Create an array of pointers into a constant string, as seen in C's argv and env pointers.
-static Constant* getStringPtrArray(std::string& bytes, std::vector<size_t>& lineStarts, Module& M) {
+static Constant* getStringPtrArray(StringRef bytes, std::vector<size_t>& lineStarts, Module& M) {
 
   GlobalVariable* EnvInitG = getStringArray(bytes, M);
 
@@ -91,49 +145,32 @@ static Constant* getStringPtrArray(std::string& bytes, std::vector<size_t>& line
 // Fetch a newline-delimited command-line (saves escaping spaces etc) and provide a char** argv replacement.
 void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx, unsigned& argc) {
 
-  std::string argvtext;
-  readWholeFile(path, argvtext, true);
-
-  size_t startidx = 0;
+  std::unique_ptr<WritableMemoryBuffer> MB = mapInputFile(path);
+  InputLines Lines(*MB);
 
   std::vector<int> lineStarts;
 
-  for(size_t findidx = argvtext.find('\n'); findidx != std::string::npos; findidx = argvtext.find('\n', startidx)) {
+  StringRef Line;
+  while(Lines.next(Line)) {
 
     bool foundalpha = false;
 
-    for(size_t i = startidx; i != findidx; ++i) {
+    for(size_t i = 0; i != Line.size(); ++i) {
 
-      if(!isspace(argvtext[i]))
+      if(!isspace(Line[i]))
 	foundalpha = true;
 
     }
 
-    bool isUnknown = false;
-    if(!argvtext.compare(startidx, findidx - startidx, "__undef__")) {
+    if(Line == "__undef__")
       lineStarts.push_back(-1);
-      isUnknown = true;
-    }
-
-    if((!foundalpha) || isUnknown) {
-
-      argvtext.erase(startidx, (findidx - startidx) + 1);
-      // Start search again from the same index.
-
-    }
-    else {
-
-      argvtext.replace(findidx, 1, 1, '\0');
-      lineStarts.push_back(startidx);
-      
-      startidx = findidx + 1;
-
-    }
+    else if(foundalpha)
+      lineStarts.push_back(Lines.keep(Line));
 
   }
 
   argc = lineStarts.size();
-  GlobalVariable* ArgvConsts = getStringArray(argvtext, *(F->getParent()));
+  GlobalVariable* ArgvConsts = getStringArray(Lines.compacted(), *(F->getParent()));
 
   BasicBlock& EntryBB = F->getEntryBlock();
   BasicBlock::iterator BI = EntryBB.begin();
@@ -178,24 +215,22 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
 // Fetch an environment (newline-delimited key=value settings) from path and provide a constant suitable for replacing the char** environ pointer.
 Constant* LLPEAnalysisPass::loadEnvironment(Module& M, std::string& path) {
 
-  std::string useenv;
-  readWholeFile(path, useenv, true);
-
-  size_t startidx = 0;
+  std::unique_ptr<WritableMemoryBuffer> MB = mapInputFile(path);
+  InputLines Lines(*MB);
 
   std::vector<size_t> lineStarts;
-  std::vector<bool> lineUnknown;
 
-  for(size_t findidx = useenv.find('\n'); findidx != std::string::npos; findidx = useenv.find('\n', startidx)) {
+  StringRef Line;
+  while(Lines.next(Line)) {
 
     bool foundalpha = false;
     bool foundequals = false;
 
-    for(size_t i = startidx; i != findidx; ++i) {
+    for(size_t i = 0; i != Line.size(); ++i) {
 
-      if(useenv[i] == '=')
+      if(Line[i] == '=')
 	foundequals = true;
-      if(!isspace(useenv[i]))
+      if(!isspace(Line[i]))
 	foundalpha = true;
 
     }
@@ -204,25 +239,19 @@ Constant* LLPEAnalysisPass::loadEnvironment(Module& M, std::string& path) {
 
       if(foundalpha) {
 
-	errs() << "Warning: discarded junk " << useenv.substr(startidx, findidx - startidx) << "\n";
+	errs() << "Warning: discarded junk " << Line << "\n";
 
       }
 
-      useenv.erase(startidx, (findidx - startidx) + 1);
-      // Start search again from the same index.
-
     }
     else {
 
-      useenv.replace(findidx, 1, 1, '\0');
-      lineStarts.push_back(startidx);
-      lineUnknown.push_back(false);
-      startidx = findidx + 1;
+      lineStarts.push_back(Lines.keep(Line));
 
     }
 
   }
 
-  return getStringPtrArray(useenv, lineStarts, M);
+  return getStringPtrArray(Lines.compacted(), lineStarts, M);
   
 }
@@ -17,6 +17,7 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
 
 using namespace llvm;
 
@@ -25,58 +26,68 @@ using namespace llvm;
 // This represents partial results when bytewise re-interpreting data.
 // The internal byte array is represented as a uint64_t array because
 // this is what the LLVM core reinterpreting function requires.
+// Validity is tracked one bit per byte so that merging and completeness tests
+// work a word at a time.
 
 PartialVal::PartialVal(uint64_t nbytes) : partialBufBytes(nbytes), loadFinished(false) {
 
-  uint64_t nqwords = (nbytes + 7) / 8;
-  partialBuf = new uint64_t[nqwords];
+  allocate();
+  memset(partialValidMask, 0, maskWords() * sizeof(uint64_t));
 
-  partialValidBuf = new bool[nbytes];
-  for(uint64_t i = 0; i < nbytes; ++i)
-    partialValidBuf[i] = false;
+}
+
+void PartialVal::allocate() {
+
+  if(partialBufBytes <= InlineBytes) {
+    partialBuf = inlineBuf;
+    partialValidMask = inlineValidMask;
+  }
+  else {
+    partialBuf = new uint64_t[(partialBufBytes + 7) / 8];
+    partialValidMask = new uint64_t[maskWords()];
+  }
 
 }
 
-PartialVal& PartialVal::operator=(const PartialVal& Other) {
+void PartialVal::release() {
 
-  if(partialBuf) {
+  if(partialBuf != inlineBuf) {
     delete[] partialBuf;
-    partialBuf = 0;
-  }
-  if(partialValidBuf) {
-    delete[] partialValidBuf;
-    partialValidBuf = 0;
+    delete[] partialValidMask;
   }
 
-  partialBuf = new uint64_t[(Other.partialBufBytes + 7) / 8];
-  memcpy(partialBuf, Other.partialBuf, Other.partialBufBytes);
+  partialBuf = inlineBuf;
+  partialValidMask = inlineValidMask;
+
+}
+
+PartialVal& PartialVal::operator=(const PartialVal& Other) {
+
+  if(&Other == this)
+    return *this;
 
-  partialValidBuf = new bool[Other.partialBufBytes];
-  memcpy(partialValidBuf, Other.partialValidBuf, Other.partialBufBytes);
+  release();
 
   partialBufBytes = Other.partialBufBytes;
   loadFinished = Other.loadFinished;
 
+  allocate();
+  memcpy(partialBuf, Other.partialBuf, partialBufBytes);
+  memcpy(partialValidMask, Other.partialValidMask, maskWords() * sizeof(uint64_t));
+
   return *this;
 
 }
 
-PartialVal::PartialVal(const PartialVal& Other) {
+PartialVal::PartialVal(const PartialVal& Other) : partialBuf(inlineBuf), partialValidMask(inlineValidMask) {
 
-  partialBuf = 0;
-  partialValidBuf = 0;
   (*this) = Other;
 
 }
 
 PartialVal::~PartialVal() {
 
-  if(partialBuf) {
-    delete[] partialBuf;
-  }
-  if(partialValidBuf) {
-    delete[] partialValidBuf;
-  }
+  release();
 
 }
 
@@ -86,38 +97,70 @@ bool PartialVal::isComplete() {
 
 }
 
+// Mask of bits [lo, hi) within a word, 0 <= lo < hi <= 64.
+static inline uint64_t bitRange(uint64_t lo, uint64_t hi) {
+
+  uint64_t below = hi == 64 ? ~(uint64_t)0 : (((uint64_t)1) << hi) - 1;
+  return below & ~((((uint64_t)1) << lo) - 1);
+
+}
+
+bool PartialVal::allValid() const {
+
+  uint64_t fullWords = partialBufBytes / 64;
+  for(uint64_t i = 0; i != fullWords; ++i) {
+    if(partialValidMask[i] != ~(uint64_t)0)
+      return false;
+  }
+
+  uint64_t tail = partialBufBytes % 64;
+  return !tail || (partialValidMask[fullWords] & bitRange(0, tail)) == bitRange(0, tail);
+
+}
+
 // Copy bytes in from the given buffer, targeting the range (FirstDef-FirstNotDef], marking each valid.
 void PartialVal::combineWith(uint8_t* Other, uint64_t FirstDef, uint64_t FirstNotDef) {
 
   assert(FirstDef < partialBufBytes);
   assert(FirstNotDef <= partialBufBytes);
 
-  // Avoid rewriting bytes which have already been defined
-  for(uint64_t i = 0; i < (FirstNotDef - FirstDef); ++i) {
-    if(partialValidBuf[FirstDef + i]) {
-      continue;
-    }
-    else {
-      ((unsigned char*)partialBuf)[FirstDef + i] = Other[i]; 
-    }
-  }
+  uint8_t* bytes = (uint8_t*)partialBuf;
 
-  loadFinished = true;
-  // Meaning of the predicate: stop at the boundary, or bail out if there's no more setting to do
-  // and there's no hope we've finished.
-  for(uint64_t i = 0; i < partialBufBytes && (loadFinished || i < FirstNotDef); ++i) {
+  // Avoid rewriting bytes which have already been defined: copy whole runs where
+  // a word's part of the range is wholly undefined, otherwise byte by byte.
+  for(uint64_t word = FirstDef / 64; FirstDef < FirstNotDef && word <= (FirstNotDef - 1) / 64; ++word) {
+
+    uint64_t wordStart = word * 64;
+    uint64_t lo = std::max(FirstDef, wordStart) - wordStart;
+    uint64_t hi = std::min(FirstNotDef, wordStart + 64) - wordStart;
+    uint64_t want = bitRange(lo, hi);
+    uint64_t fresh = want & ~partialValidMask[word];
 
-    if(i >= FirstDef && i < FirstNotDef) {
-      partialValidBuf[i] = true;
+    if(fresh == want) {
+      memcpy(bytes + wordStart + lo, Other + (wordStart + lo - FirstDef), hi - lo);
     }
     else {
-      if(!partialValidBuf[i]) {
-	loadFinished = false;
+      for(; fresh; fresh &= fresh - 1) {
+	uint64_t i = wordStart + countTrailingZeros(fresh);
+	bytes[i] = Other[i - FirstDef];
       }
     }
 
+    partialValidMask[word] |= want;
+
   }
 
+  loadFinished = allValid();
+
+}
+
+// Define every byte as Val.
+void PartialVal::fill(uint8_t Val) {
+
+  memset(partialBuf, Val, partialBufBytes);
+  memset(partialValidMask, 0xff, maskWords() * sizeof(uint64_t));
+  loadFinished = true;
+
 }
 
 void PartialVal::combineWith(PartialVal& Other, uint64_t FirstDef, uint64_t FirstNotDef) {
@@ -175,17 +218,10 @@ bool llvm::addIVToPartialVal(const ImprovedVal& IV, ValSetType SetType, uint64_t
 
     // Splat of i8:
     uint8_t SplatVal = (uint8_t)(cast<ConstantInt>(DefC)->getLimitedValue());
-    PartialVal NewPV(Size);
-    
-    uint8_t* buffer = (uint8_t*)NewPV.partialBuf;
-    bool* validBuf = (bool*)NewPV.partialValidBuf;
-    
-    for(uint64_t i = 0; i < Size; ++i) {
-      buffer[i] = SplatVal;
-      validBuf[i] = true;
-    }
+    uint8_t* tempBuf = (uint8_t*)alloca(Size);
+    memset(tempBuf, SplatVal, Size);
 
-    PV->combineWith(NewPV, PVOffset, PVOffset + Size);
+    PV->combineWith(tempBuf, PVOffset, PVOffset + Size);
     return true;
     
   }
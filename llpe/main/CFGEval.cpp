@@ -106,18 +106,19 @@ bool IntegrationAttempt::createEntryBlock() {
 
 }
 
-// Set edge from block-instance BB with terminator TI to Target alive. Return true
+// Set the edge leaving block-instance BB by successor slot Slot alive. Return true
 // if the edge status changed (i.e. it was not already marked alive)
-static bool setEdgeAlive(Instruction* TI, ShadowBB* BB, BasicBlock* Target) {
+static bool setEdgeAlive(ShadowBB* BB, uint32_t Slot) {
 
-  const unsigned NumSucc = TI->getNumSuccessors();
-  bool changed = false;
+  ShadowBBInvar* TargetBBI = &BB->invar->F->BBs[BB->invar->succIdxs[Slot]];
+  uint32_t firstSlot, lastSlot;
+  BB->getEdgeSlots(TargetBBI, firstSlot, lastSlot);
 
-  for (unsigned I = 0; I != NumSucc; ++I) {
+  bool changed = false;
 
-    BasicBlock* thisTarget = TI->getSuccessor(I);
+  for (uint32_t I = firstSlot; I != lastSlot; ++I) {
 
-    if(thisTarget == Target) {
+    if(BB->invar->succIdxs[I] == TargetBBI->idx) {
 
       // Mark this edge alive. In some cases there may be multiple copies of the edge
       // e.g. for several switch cases with the same destination.
@@ -133,6 +134,20 @@ static bool setEdgeAlive(Instruction* TI, ShadowBB* BB, BasicBlock* Target) {
 
 }
 
+// Get the successor slot switch SwI in BB takes given condition C.
+static uint32_t getSwitchSlot(SwitchInst* SwI, ShadowBB* BB, ConstantInt* C) {
+
+  if(DenseMap<ConstantInt*, uint32_t>* Cases = BB->invar->switchCases) {
+
+    DenseMap<ConstantInt*, uint32_t>::iterator findit = Cases->find(C);
+    return findit == Cases->end() ? 0 : findit->second;
+
+  }
+
+  return SwI->findCaseValue(C)->getSuccessorIndex();
+
+}
+
 // Is BB1I -> BB2I known to be infeasible in this context?
 bool IntegrationAttempt::edgeIsDead(ShadowBBInvar* BB1I, ShadowBBInvar* BB2I) {
 
@@ -163,22 +178,8 @@ bool IntegrationAttempt::edgeIsDeadRising(ShadowBBInvar& BB1I, ShadowBBInvar& BB
   if(BB1I.naturalScope == L)
     return false;
   
-  if(PeelAttempt* LPA = getPeelAttempt(immediateChildLoop(L, BB1I.naturalScope))) {
-
-    if(LPA->isTerminated()) {
-
-      for(unsigned i = 0; i < LPA->Iterations.size(); ++i) {
-	  
-	if(!LPA->Iterations[i]->edgeIsDeadRising(BB1I, BB2I))
-	  return false;
-	
-      }
-
-      return true;
-
-    }
-
-  }
+  if(PeelAttempt* LPA = getPeelAttempt(immediateChildLoop(L, BB1I.naturalScope)))
+    return LPA->edgeIsDeadInAllIterations(BB1I, BB2I);
     
   return false;
 
@@ -193,24 +194,116 @@ bool IntegrationAttempt::blockIsDeadRising(ShadowBBInvar& BBI) {
   if(BBI.naturalScope == L)
     return true;
 
-  if(PeelAttempt* LPA = getPeelAttempt(immediateChildLoop(L, BBI.naturalScope))) {
+  if(PeelAttempt* LPA = getPeelAttempt(immediateChildLoop(L, BBI.naturalScope)))
+    return LPA->blockIsDeadInAllIterations(BBI);
+
+  return true;
+
+}
+
+// The rising queries above are made for every block and edge of a loop each time its contexts are summarised,
+// and each descends through every iteration of every enclosing loop, so the answers are cached per PeelAttempt.
+// Some context's blocks or edges just came alive, or its loop contexts changed: forget the cached answers
+// of each enclosing loop, stopping at one that hasn't been asked anything since it last forgot.
+void IntegrationAttempt::noteCFGChange() {
+
+  IntegrationAttempt* IA = this;
+  while(IA->L) {
+
+    PeelIteration* PI = (PeelIteration*)IA;
+    if(!PI->getParentPA()->clearDeadRisingCache())
+      return;
+    IA = PI->parent;
+
+  }
+
+}
+
+// Forget any cached rising answers. Returns true if any had been given since last time.
+bool PeelAttempt::clearDeadRisingCache() {
+
+  if(!deadRisingConsulted)
+    return false;
+
+  deadRisingCache.clear();
+  deadRisingConsulted = false;
+  return true;
+
+}
+
+// Get the cache slot for BBI (Slot == -1) or its successor edge Slot.
+static uint8_t& getDeadRisingEntry(PeelAttempt* PA, ShadowBBInvar& BBI, int32_t Slot) {
+
+  const ShadowLoopInvar* LInfo = PA->L;
+  ShadowBBInvar* HeaderBBI = &BBI.F->BBs[LInfo->headerIdx];
+
+  if(PA->deadRisingCache.empty()) {
+    ShadowBBInvar* LastBBI = &BBI.F->BBs[LInfo->headerIdx + LInfo->nBlocks - 1];
+    uint32_t nSuccs = (LastBBI->succsBefore + LastBBI->succIdxs.size()) - HeaderBBI->succsBefore;
+    PA->deadRisingCache.resize(LInfo->nBlocks + nSuccs, DEADRISING_UNKNOWN);
+  }
 
-    if(LPA->isTerminated()) {
+  if(Slot == -1)
+    return PA->deadRisingCache[BBI.idx - LInfo->headerIdx];
+  else
+    return PA->deadRisingCache[LInfo->nBlocks + (BBI.succsBefore - HeaderBBI->succsBefore) + Slot];
 
-      for(unsigned i = 0; i < LPA->Iterations.size(); ++i) {
+}
+
+// Is BBI, a block of L, unreachable in every iteration?
+bool PeelAttempt::blockIsDeadInAllIterations(ShadowBBInvar& BBI) {
+
+  deadRisingConsulted = true;
+  if(!isTerminated())
+    return true;
+
+  uint8_t& Entry = getDeadRisingEntry(this, BBI, -1);
+  if(Entry == DEADRISING_UNKNOWN) {
+
+    Entry = DEADRISING_DEAD;
+    for(unsigned i = 0; i < Iterations.size(); ++i) {
 	  
-	if(!LPA->Iterations[i]->blockIsDeadRising(BBI))
-	  return false;
-	
+      if(!Iterations[i]->blockIsDeadRising(BBI)) {
+	Entry = DEADRISING_ALIVE;
+	break;
       }
+	
+    }
+
+  }
+
+  return Entry == DEADRISING_DEAD;
+
+}
+
+// Is BB1I -> BB2I, an edge leaving a block of L, infeasible in every iteration?
+bool PeelAttempt::edgeIsDeadInAllIterations(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I) {
+
+  deadRisingConsulted = true;
+  if(!isTerminated())
+    return false;
 
-      return true;
+  // Duplicate edges (e.g. switch cases) share the first slot's answer.
+  uint32_t Slot = 0;
+  for(uint32_t ilim = BB1I.succIdxs.size(); Slot != ilim && BB1I.succIdxs[Slot] != BB2I.idx; ++Slot) {}
+  release_assert(Slot != BB1I.succIdxs.size() && "edgeIsDeadRising: not an edge");
 
+  uint8_t& Entry = getDeadRisingEntry(this, BB1I, Slot);
+  if(Entry == DEADRISING_UNKNOWN) {
+
+    Entry = DEADRISING_DEAD;
+    for(unsigned i = 0; i < Iterations.size(); ++i) {
+	  
+      if(!Iterations[i]->edgeIsDeadRising(BB1I, BB2I)) {
+	Entry = DEADRISING_ALIVE;
+	break;
+      }
+	
     }
 
   }
 
-  return true;
+  return Entry == DEADRISING_DEAD;
 
 }
 
@@ -312,29 +405,23 @@ bool IntegrationAttempt::checkBlockOutgoingEdges(ShadowInstruction* SI) {
 
   if(ConstCondition) {
 
-    BasicBlock* takenTarget = 0;
+    uint32_t takenSlot;
 
-    if(BranchInst* BI = dyn_cast_inst<BranchInst>(SI)) {
+    if(inst_is<BranchInst>(SI)) {
       // This ought to be a boolean.
       if(ConstCondition->isZero())
-	takenTarget = BI->getSuccessor(1);
+	takenSlot = 1;
       else
-	takenTarget = BI->getSuccessor(0);
+	takenSlot = 0;
     }
     else {
-      SwitchInst* SwI = cast_inst<SwitchInst>(SI);
-      SwitchInst::CaseIt targetidx = SwI->findCaseValue(ConstCondition);
-      takenTarget = targetidx->getCaseSuccessor();
+      takenSlot = getSwitchSlot(cast_inst<SwitchInst>(SI), SI->parent, ConstCondition);
     }
-    if(takenTarget) {
-      // We know where the instruction is going -- remove this block as a predecessor for its other targets.
-      LPDEBUG("Branch or switch instruction given known target: " << takenTarget->getName() << "\n");
 
-      return setEdgeAlive(SI->getInstruction(), SI->parent, takenTarget);
+    // We know where the instruction is going -- remove this block as a predecessor for its other targets.
+    LPDEBUG("Branch or switch instruction given known target: " << SI->parent->invar->F->BBs[SI->parent->invar->succIdxs[takenSlot]].BB->getName() << "\n");
 
-    }
-    
-    // Else fall through to set all alive.
+    return setEdgeAlive(SI->parent, takenSlot);
 
   }
 
@@ -352,9 +439,8 @@ bool IntegrationAttempt::checkBlockOutgoingEdges(ShadowInstruction* SI) {
 
     for (unsigned i = 0, ilim = IVS->Values.size(); i != ilim; ++i) {
       
-      SwitchInst::CaseIt targetit = Switch->findCaseValue(cast<ConstantInt>(getConstReplacement(IVS->Values[i].V)));
-      BasicBlock* target = targetit->getCaseSuccessor();
-      changed |= setEdgeAlive(SI->getInstruction(), SI->parent, target);
+      uint32_t slot = getSwitchSlot(Switch, SI->parent, cast<ConstantInt>(getConstReplacement(IVS->Values[i].V)));
+      changed |= setEdgeAlive(SI->parent, slot);
 
     }
 
@@ -384,6 +470,8 @@ bool IntegrationAttempt::tryEvaluateTerminator(ShadowInstruction* SI, bool thisB
 
   // Clarify branch target if possible:
   bool anyChange = checkBlockOutgoingEdges(SI);
+  if(anyChange)
+    noteCFGChange();
 
   // Return instruction breaks early to avoid the refcount juggling below:
   // a live return always has one successor, the call-merge.
@@ -403,6 +491,8 @@ bool IntegrationAttempt::tryEvaluateTerminator(ShadowInstruction* SI, bool thisB
       }
 
     }
+
+    SI->parent->compactHeap();
     
     return false;
   }
@@ -0,0 +1,121 @@
+//===-- CallMemo.cpp ------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "llpe-misc"
+
+using namespace llvm;
+
+// Memoisation of calls to side-effect-free functions whose results depend only on their arguments.
+// Two kinds qualify: those annotated readnone, with -llpe-memo-pure-calls, whose result is a function
+// of their argument values, and those named by -llpe-memo-function, which the user promises
+// have no side effects and read nothing beyond the nul-terminated strings their pointer arguments
+// point to (strcmp, strchr, atoi and friends). Once a call has been fully analysed to a constant
+// result, later calls with the same key take that result without creating a specialisation context.
+
+static bool callMemoReadsStrings(LLPEAnalysisPass* pass, Function* F, bool& readsStrings) {
+
+  readsStrings = pass->memoFunctions.count(F);
+  return readsStrings || (pass->memoPureCalls && F->doesNotAccessMemory());
+
+}
+
+// Describe SI's callee and arguments, as of SI's block's current store, into Key.
+// Returns false if the call can't be memoised.
+bool IntegrationAttempt::getCallMemoKey(ShadowInstruction* SI, std::string& Key) {
+
+  if(!inst_is<CallInst>(SI))
+    return false;
+
+  Function* F = getCalledFunction(SI);
+  bool readsStrings;
+  if((!F) || F->isVarArg() || !callMemoReadsStrings(pass, F, readsStrings))
+    return false;
+
+  raw_string_ostream RSO(Key);
+  RSO.write((const char*)&F, sizeof(Function*));
+
+  for(uint32_t i = 0, ilim = SI->getNumArgOperands(); i != ilim; ++i) {
+
+    ShadowValue Arg = SI->getCallArgOperand(i);
+    Constant* C = getConstReplacement(Arg);
+
+    if(readsStrings && F->getFunctionType()->getParamType(i)->isPointerTy() && !(C && C->isNullValue())) {
+
+      // Key on what the pointer points to, not where, so that strings built at runtime match too.
+      std::string Str;
+      if(!getConstantString(Arg, SI, Str))
+	return false;
+
+      uint64_t Len = Str.size();
+      RSO << 's';
+      RSO.write((const char*)&Len, sizeof(uint64_t));
+      RSO << Str;
+
+    }
+    else if(C) {
+
+      // Constants are uniqued, so the pointer identifies the value.
+      RSO << 'c';
+      RSO.write((const char*)&C, sizeof(Constant*));
+
+    }
+    else {
+
+      return false;
+
+    }
+
+  }
+
+  RSO.flush();
+  return true;
+
+}
+
+// Try to give SI a memoised result. Only calls that don't yet have a context are eligible,
+// so that we never abandon one that has already been analysed.
+bool IntegrationAttempt::tryUseCallMemo(ShadowInstruction* SI, const std::string& Key) {
+
+  if(getInlineAttempt(SI))
+    return false;
+
+  StringMap<Constant*>::iterator findit = pass->callMemo.find(Key);
+  if(findit == pass->callMemo.end())
+    return false;
+
+  LPDEBUG("Memoised result for " << itcache(SI) << ": " << itcache(findit->second) << "\n");
+  setReplacement(SI, findit->second);
+  ++pass->stats.callMemoHits;
+  return true;
+
+}
+
+// SI has been analysed by expanding it. If that yielded a constant that doesn't rest on
+// runtime checks or VFS state, remember it for subsequent calls with the same key.
+void IntegrationAttempt::noteCallMemo(ShadowInstruction* SI, const std::string& Key) {
+
+  InlineAttempt* IA = getInlineAttempt(SI);
+  if((!IA) || IA->isModel || IA->hasVFSOps || IA->mayUnwind || IA->readsTentativeData ||
+     IA->containsCheckedReads || IA->hasFailedReturnPath())
+    return;
+
+  Constant* C = getConstReplacement(SI);
+  if(!C)
+    return;
+
+  if(pass->callMemo.insert(std::make_pair(Key, C)).second)
+    ++pass->stats.callMemoEntries;
+
+}
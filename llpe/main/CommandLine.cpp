@@ -12,6 +12,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DIBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include <sstream>
 #include <string>
@@ -24,6 +25,7 @@ using namespace llvm;
 // One extra arg is declared in TopLevel.cpp: the root function name.
 
 static cl::opt<std::string> GraphOutputDirectory("llpe-graphs-dir", cl::init(""));
+static cl::opt<std::string> GraphArchive("llpe-graphs-archive", cl::init(""));
 static cl::opt<std::string> EnvFileAndIdx("spec-env", cl::init(""));
 static cl::opt<std::string> ArgvFileAndIdxs("spec-argv", cl::init(""));
 static cl::opt<unsigned> MallocAlignment("llpe-malloc-alignment", cl::init(1));
@@ -45,37 +47,79 @@ static cl::list<std::string> PathConditionsFptrmem("llpe-path-condition-fptrmem"
 static cl::list<std::string> PathConditionsFunc("llpe-path-condition-func", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsStream("llpe-path-condition-stream", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsGlobalInit("llpe-path-condition-global-unmodified", cl::ZeroOrMore);
+static cl::list<std::string> PathConditionFiles("llpe-path-conditions-file", cl::ZeroOrMore);
 static cl::opt<bool> SkipBenefitAnalysis("skip-benefit-analysis");
 static cl::opt<bool> SkipDIE("skip-llpe-die");
 static cl::opt<bool> SkipTL("skip-check-elim");
 static cl::opt<unsigned> MaxContexts("llpe-stop-after", cl::init(0));
+static cl::opt<unsigned> MaxOutputInsts("llpe-max-output-insts", cl::init(0));
+static cl::opt<unsigned> LoopWidenIters("llpe-loop-widen-iters", cl::init(0));
+static cl::opt<bool> LoopTripProbe("llpe-loop-trip-probe");
+static cl::opt<bool> LoopEvalAll("llpe-loop-eval-all");
+static cl::opt<unsigned> MaxPeelIterations("llpe-max-peel-iterations", cl::init(0));
+static cl::opt<unsigned> ContextTimeLimit("llpe-context-time-limit", cl::init(0));
+static cl::opt<unsigned> ContextMemLimit("llpe-context-mem-limit", cl::init(0));
+static cl::opt<unsigned> RerollMinIterations("llpe-reroll-min-iterations", cl::init(0));
+static cl::opt<unsigned> MultiFlattenDepth("llpe-multi-flatten-depth", cl::init(8));
 static cl::opt<bool> VerboseOverdef("llpe-verbose-overdef");
 static cl::opt<bool> EnableFunctionSharing("llpe-enable-sharing");
 static cl::opt<bool> VerboseFunctionSharing("llpe-verbose-sharing");
+static cl::opt<bool> DeepSharingCompare("llpe-sharing-deep-compare");
 static cl::opt<bool> UseGlobalInitialisers("llpe-use-global-initialisers");
 static cl::list<std::string> SpecialLocations("llpe-special-location", cl::ZeroOrMore);
 static cl::list<std::string> ModelFunctions("llpe-model-function", cl::ZeroOrMore);
 static cl::list<std::string> YieldFunctions("llpe-yield-function", cl::ZeroOrMore);
+static cl::list<std::string> ModRefFunctions("llpe-modref-function", cl::ZeroOrMore);
+static cl::list<std::string> ModelFiles("llpe-model-file", cl::ZeroOrMore);
+static cl::opt<bool> StdioModel("llpe-stdio-model");
+static cl::list<std::string> MemoFunctions("llpe-memo-function", cl::ZeroOrMore);
+static cl::opt<bool> MemoPureCalls("llpe-memo-pure-calls");
+static cl::list<std::string> SummaryFunctions("llpe-summary-function", cl::ZeroOrMore);
+static cl::opt<std::string> ExportSummaryFile("llpe-export-summary", cl::init(""));
+static cl::list<std::string> ImportSummaryFiles("llpe-import-summary", cl::ZeroOrMore);
+static cl::opt<bool> NativeStringOps("llpe-native-string-ops");
 static cl::list<std::string> TargetStack("llpe-target-stack", cl::ZeroOrMore);
 static cl::list<std::string> SimpleVolatiles("llpe-simple-volatile-load", cl::ZeroOrMore);
 static cl::list<std::string> LockDomains("llpe-lock-domain", cl::ZeroOrMore);
 static cl::list<std::string> PessimisticLocks("llpe-pessimistic-lock", cl::ZeroOrMore);
 static cl::opt<bool> DumpDSE("llpe-dump-dse");
 static cl::opt<bool> DumpTL("llpe-dump-tl");
+static cl::list<std::string> LogCategories("llpe-log", cl::CommaSeparated);
+static cl::opt<std::string> LogFile("llpe-log-file", cl::init(""));
+static cl::opt<std::string> LogFormat("llpe-log-format", cl::init("text"));
 static cl::list<std::string> ForceNoAliasArgs("llpe-force-noalias-arg", cl::ZeroOrMore);
 static cl::list<std::string> VarAllocators("llpe-allocator-fn", cl::ZeroOrMore);
 static cl::list<std::string> ConstAllocators("llpe-allocator-fn-const", cl::ZeroOrMore);
 static cl::opt<bool> VerbosePathConditions("llpe-verbose-path-conditions");
+static cl::opt<bool> BatchPathFuncs("llpe-batch-path-funcs");
 static cl::opt<std::string> LLIOPreludeFn("llpe-prelude-fn", cl::init(""));
 static cl::opt<int> LLIOPreludeStackIdx("llpe-prelude-stackidx", cl::init(-1));
 static cl::opt<std::string> LLIOConfFile("llpe-write-llio-conf", cl::init(""));
+static cl::opt<std::string> DigestCacheFile("llpe-digest-cache", cl::init(""));
+static cl::opt<std::string> InputManifestFile("llpe-write-input-manifest", cl::init(""));
 static cl::opt<std::string> StatsFile("llpe-stats-file", cl::init(""));
+static cl::opt<std::string> FastExitOutput("llpe-fast-exit", cl::init(""));
 static cl::list<std::string> NeverInline("llpe-never-inline", cl::ZeroOrMore);
 static cl::opt<bool> SingleThreaded("llpe-single-threaded");
 static cl::opt<bool> OmitChecks("llpe-omit-checks");
 static cl::opt<bool> OmitMallocChecks("llpe-omit-malloc-checks");
+static cl::opt<unsigned> AllocSiteLimit("llpe-alloc-site-limit", cl::init(0));
+static cl::opt<bool> CoalesceChecks("llpe-coalesce-checks");
+static cl::opt<bool> InlineLliowdCheck("llpe-inline-lliowd-check");
+static cl::opt<bool> CountFailures("llpe-count-failures");
+static cl::opt<std::string> ExportVariant("llpe-export-variant", cl::init(""));
+static cl::opt<std::string> BlockMapFile("llpe-block-map", cl::init(""));
+static cl::opt<std::string> RuntimeReportTable("llpe-runtime-report-table", cl::init(""));
+static cl::opt<bool> MergeIdenticalFunctions("llpe-merge-identical-functions");
+static cl::opt<bool> ShareLandingPads("llpe-share-landing-pads");
+static cl::opt<bool> StaticHeap("llpe-static-heap");
 static cl::list<std::string> SplitFunctions("llpe-force-split");
 static cl::opt<bool> EmitFakeDebug("llpe-emit-fake-debug");
+static cl::opt<bool> EmitDebugLocs("llpe-emit-debug-locs");
+static cl::opt<std::string> InvarCacheDir("llpe-invar-cache-dir", cl::init(""));
+static cl::opt<std::string> SpillFile("llpe-spill-file", cl::init(""));
+static cl::opt<std::string> BlockProfileFile("llpe-block-profile", cl::init(""));
+static cl::opt<unsigned> ValueTextCacheSize("llpe-text-cache-size", cl::init(65536));
 
 static void dieEnvUsage() {
 
@@ -119,6 +163,64 @@ static bool parseIntCommaString(const std::string& str, long& idx, std::string&
 
 }
 
+// Block names and instruction positions, indexed on first use since a large set of
+// path conditions may name the same function many times over.
+static DenseMap<Function*, StringMap<BasicBlock*> > BlockNameIndex;
+static DenseMap<BasicBlock*, std::vector<Instruction*> > InstructionIndex;
+
+// Parse a numeric block identifier "#N", where N is the block's index in LLPE's own topological
+// ordering (ShadowBBInvar::idx). These work whether or not the block has a name,
+// so it isn't necessary to run the nameblocks pass before referring to anonymous blocks.
+static bool parseBlockIndex(StringRef name, uint32_t& idx) {
+
+  if(name.size() < 2 || name[0] != '#')
+    return false;
+  return !name.substr(1).getAsInteger(10, idx);
+
+}
+
+// Returns null if F has no such block.
+static BasicBlock* lookupBlock(Function* F, const std::string& name) {
+
+  uint32_t idx;
+  if(parseBlockIndex(name, idx)) {
+
+    ShadowFunctionInvar* SFI = GlobalIHP->getFunctionInvarInfo(*F);
+    if(idx >= SFI->BBs.size())
+      return 0;
+    return SFI->BBs[idx].BB;
+
+  }
+
+  DenseMap<Function*, StringMap<BasicBlock*> >::iterator findit = BlockNameIndex.find(F);
+  if(findit == BlockNameIndex.end()) {
+
+    StringMap<BasicBlock*>& Index = BlockNameIndex[F];
+    // As for a linear search, the first block by a given name wins.
+    for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI)
+      Index.insert(std::make_pair((&*FI)->getName(), &*FI));
+    findit = BlockNameIndex.find(F);
+
+  }
+
+  StringMap<BasicBlock*>::iterator blockit = findit->second.find(name);
+  if(blockit != findit->second.end())
+    return blockit->second;
+
+  return 0;
+
+}
+
+static BasicBlock* findBlockRaw(Function* F, const std::string& name) {
+
+  if(BasicBlock* BB = lookupBlock(F, name))
+    return BB;
+
+  errs() << "Block " << name << " not found in " << F->getName() << "\n";
+  exit(1);
+
+}
+
 static void parseFB(const char* paramName, const std::string& arg, Module& M, Function*& F, BasicBlock*& BB1) {
 
   std::string FName, BB1Name;
@@ -137,16 +239,7 @@ static void parseFB(const char* paramName, const std::string& arg, Module& M, Fu
     exit(1);
   }
 
-  BB1 = 0;
-
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-
-    if(FI->getName() == BB1Name) {
-      BB1 = &*FI;
-      break;
-    }
-
-  }
+  BB1 = lookupBlock(F, BB1Name);
 
   if(!BB1) {
     errs() << "No such block " << BB1Name << " in " << FName << "\n";
@@ -177,16 +270,8 @@ static void parseFBB(const char* paramName, const std::string& arg, Module& M, F
     exit(1);
   }
 
-  BB1 = BB2 = 0;
-
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-
-    if(FI->getName() == BB1Name)
-      BB1 = &*FI;
-    if(FI->getName() == BB2Name)
-      BB2 = &*FI;
-
-  }
+  BB1 = lookupBlock(F, BB1Name);
+  BB2 = lookupBlock(F, BB2Name);
 
   if(!BB1) {
     errs() << "No such block " << BB1Name << " in " << FName << "\n";
@@ -221,14 +306,7 @@ static void parseFBI(const char* paramName, const std::string& arg, Module& M, F
     exit(1);
   }
 
-  BB = 0;
-
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-
-    if(FI->getName() == BBName)
-      BB = &*FI;
-
-  }
+  BB = lookupBlock(F, BBName);
 
   if(!BB) {
     errs() << "No such block " << BBName << " in " << FName << "\n";
@@ -293,6 +371,10 @@ static bool tryGetInteger(std::string& s, int64_t& out) {
 
 uint32_t llvm::findBlock(ShadowFunctionInvar* SFI, StringRef name) {
 
+  uint32_t idx;
+  if(parseBlockIndex(name, idx) && idx < SFI->BBs.size())
+    return idx;
+
   for(uint32_t i = 0; i < SFI->BBs.size(); ++i) {
     if(SFI->BBs[i].BB->getName() == name)
       return i;
@@ -315,15 +397,154 @@ uint32_t llvm::findBlock(ShadowFunctionInvar* SFI, BasicBlock* BB) {
 
 }
 
-static BasicBlock* findBlockRaw(Function* F, std::string& name) {
+static Instruction* findInstructionRaw(BasicBlock* BB, int64_t idx) {
 
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-    if((&*FI)->getName() == name)
-      return &*FI;
+  std::vector<Instruction*>& Index = InstructionIndex[BB];
+  if(Index.empty()) {
+    for(BasicBlock::iterator it = BB->begin(), itend = BB->end(); it != itend; ++it)
+      Index.push_back(&*it);
   }
 
-  errs() << "Block " << name << " not found\n";
-  exit(1);
+  if(idx < 0 || idx >= (int64_t)Index.size()) {
+    errs() << "Block " << BB->getName() << " has no instruction #" << idx << "\n";
+    exit(1);
+  }
+
+  return Index[idx];
+
+}
+
+// Path conditions by type, gathered from the command line and any -llpe-path-conditions-file.
+// Function path conditions aren't a PathConditionTypes, so they are kept separately.
+static std::vector<std::string> PathConditionSpecs[PathConditionTypeGlobalInit + 1];
+static std::vector<std::string> PathFuncSpecs;
+
+// Read a file of directives: one per line, giving its kind (a key of Kinds) then its argument.
+// Each argument is appended to the list Kinds gives for its kind. Blank lines and lines starting
+// with '#' are ignored. What names the sort of file in error messages.
+static void loadDirectivesFile(const std::string& Filename, StringMap<std::vector<std::string>*>& Kinds, const char* What) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFile(Filename, -1, false);
+  if(std::error_code EC = MB.getError()) {
+
+    errs() << "Failed to open " << What << " file " << Filename << ": " << EC.message() << "\n";
+    exit(1);
+
+  }
+
+  StringRef Rest = (*MB)->getBuffer();
+  uint32_t lineNo = 0;
+
+  while(!Rest.empty()) {
+
+    StringRef Line;
+    std::tie(Line, Rest) = Rest.split('\n');
+    ++lineNo;
+
+    Line = Line.trim();
+    if(Line.empty() || Line[0] == '#')
+      continue;
+
+    size_t typeEnd = Line.find_first_of(" \t");
+    StringMap<std::vector<std::string>*>::iterator findit = Kinds.find(Line.substr(0, typeEnd));
+    if(typeEnd == StringRef::npos || findit == Kinds.end()) {
+
+      errs() << Filename << ":" << lineNo << ": malformed " << What << " line\n";
+      exit(1);
+
+    }
+
+    findit->second->push_back(Line.substr(typeEnd).ltrim().str());
+
+  }
+
+}
+
+// Read a path condition file: one condition per line, giving the type (the suffix of the
+// equivalent -llpe-path-condition-* option, e.g. "int" or "global-unmodified") then the
+// condition as that option would take it.
+static void loadPathConditionsFile(const std::string& Filename) {
+
+  StringMap<std::vector<std::string>*> Types;
+  Types["int"] = &PathConditionSpecs[PathConditionTypeInt];
+  Types["fptr"] = &PathConditionSpecs[PathConditionTypeFptr];
+  Types["str"] = &PathConditionSpecs[PathConditionTypeString];
+  Types["intmem"] = &PathConditionSpecs[PathConditionTypeIntmem];
+  Types["fptrmem"] = &PathConditionSpecs[PathConditionTypeFptrmem];
+  Types["stream"] = &PathConditionSpecs[PathConditionTypeStream];
+  Types["global-unmodified"] = &PathConditionSpecs[PathConditionTypeGlobalInit];
+  Types["func"] = &PathFuncSpecs;
+
+  loadDirectivesFile(Filename, Types, "path condition");
+
+}
+
+// Descriptions of the environment the program runs in (allocators, special locations, model and
+// yield functions, library call mod/ref), gathered from the command line and any -llpe-model-file.
+static std::vector<std::string> SpecialLocationSpecs;
+static std::vector<std::string> ModelFunctionSpecs;
+static std::vector<std::string> YieldFunctionSpecs;
+static std::vector<std::string> VarAllocatorSpecs;
+static std::vector<std::string> ConstAllocatorSpecs;
+static std::vector<std::string> ModRefSpecs;
+
+// Read a model file, typically describing one C library: one directive per line, giving the
+// name of the equivalent option without its "llpe-" prefix (e.g. "allocator-fn" or
+// "modref-function") then its argument as that option would take it.
+static void loadModelFile(const std::string& Filename) {
+
+  StringMap<std::vector<std::string>*> Kinds;
+  Kinds["special-location"] = &SpecialLocationSpecs;
+  Kinds["model-function"] = &ModelFunctionSpecs;
+  Kinds["yield-function"] = &YieldFunctionSpecs;
+  Kinds["allocator-fn"] = &VarAllocatorSpecs;
+  Kinds["allocator-fn-const"] = &ConstAllocatorSpecs;
+  Kinds["modref-function"] = &ModRefSpecs;
+
+  loadDirectivesFile(Filename, Kinds, "model");
+
+}
+
+static void addSpecs(std::vector<std::string>& To, const cl::list<std::string>& Opt) {
+
+  To.insert(To.end(), Opt.begin(), Opt.end());
+
+}
+
+// Files come first, so that the command line can refine what they describe.
+static void collectModelSpecs() {
+
+  for(cl::list<std::string>::iterator it = ModelFiles.begin(), itend = ModelFiles.end(); it != itend; ++it)
+    loadModelFile(*it);
+
+  addSpecs(SpecialLocationSpecs, SpecialLocations);
+  addSpecs(ModelFunctionSpecs, ModelFunctions);
+  addSpecs(YieldFunctionSpecs, YieldFunctions);
+  addSpecs(VarAllocatorSpecs, VarAllocators);
+  addSpecs(ConstAllocatorSpecs, ConstAllocators);
+  addSpecs(ModRefSpecs, ModRefFunctions);
+
+}
+
+static void addPathConditions(PathConditionTypes Ty, const cl::list<std::string>& Opt) {
+
+  PathConditionSpecs[Ty].insert(PathConditionSpecs[Ty].end(), Opt.begin(), Opt.end());
+
+}
+
+static void collectPathConditions() {
+
+  addPathConditions(PathConditionTypeInt, PathConditionsInt);
+  addPathConditions(PathConditionTypeFptr, PathConditionsFptr);
+  addPathConditions(PathConditionTypeString, PathConditionsString);
+  addPathConditions(PathConditionTypeIntmem, PathConditionsIntmem);
+  addPathConditions(PathConditionTypeFptrmem, PathConditionsFptrmem);
+  addPathConditions(PathConditionTypeStream, PathConditionsStream);
+  addPathConditions(PathConditionTypeGlobalInit, PathConditionsGlobalInit);
+  PathFuncSpecs.insert(PathFuncSpecs.end(), PathConditionsFunc.begin(), PathConditionsFunc.end());
+
+  for(cl::list<std::string>::iterator it = PathConditionFiles.begin(), itend = PathConditionFiles.end(); it != itend; ++it)
+    loadPathConditionsFile(*it);
 
 }
 
@@ -389,13 +610,13 @@ int64_t LLPEAnalysisPass::parsePCInst(BasicBlock* bb, Module* M, std::string& in
 
 }
 
-void LLPEAnalysisPass::parsePathConditions(cl::list<std::string>& L, PathConditionTypes Ty, InlineAttempt* IA) {
+void LLPEAnalysisPass::parsePathConditions(std::vector<std::string>& L, PathConditionTypes Ty, InlineAttempt* IA) {
 
   uint32_t newGVIndex = 0;
   if(Ty == PathConditionTypeString)
     newGVIndex = std::distance(IA->F.getParent()->global_begin(), IA->F.getParent()->global_end());
 
-  for(cl::list<std::string>::iterator it = L.begin(), itend = L.end(); it != itend; ++it) {
+  for(std::vector<std::string>::iterator it = L.begin(), itend = L.end(); it != itend; ++it) {
 
     std::string fStackIdxStr;
     std::string bbName;
@@ -506,18 +727,15 @@ void LLPEAnalysisPass::parsePathConditions(cl::list<std::string>& L, PathConditi
 	int64_t assumeInt = getInteger(assumeStr, "Integer path condition");
 
 	Type* targetType;
-	if(bb) {
-	  BasicBlock::iterator it = bb->begin();
-	  std::advance(it, instIndex);
-	  Instruction* assumeInst = &*it;
-	  targetType = assumeInst->getType();
-	}
-	else if(bb == (BasicBlock*)ULONG_MAX) {
+	if(bb == (BasicBlock*)ULONG_MAX) {
 	  Function::arg_iterator it = fStack->arg_begin();
 	  std::advance(it, instIndex);
 	  Argument* A = &*it;
 	  targetType = A->getType();
 	}
+	else if(bb) {
+	  targetType = findInstructionRaw(bb, instIndex)->getType();
+	}
 	else {
 	  GlobalVariable* GV = IA->F.getParent()->getGlobalVariable(instIndexStr, true);
 	  targetType = GV->getType();
@@ -571,6 +789,8 @@ void LLPEAnalysisPass::parsePathConditions(cl::list<std::string>& L, PathConditi
 	shadowGlobals[newGVIndex].G = NewGV;
 	shadowGlobalsIdx[NewGV] = newGVIndex;
 	shadowGlobals[newGVIndex].storeSize = 0;
+	shadowGlobals[newGVIndex].allocIdx = -1;
+	shadowGlobals[newGVIndex].initialised = true;
 	++newGVIndex;
 	break;
       }
@@ -618,11 +838,113 @@ void LLPEAnalysisPass::parsePathConditions(cl::list<std::string>& L, PathConditi
 
 }
 
+static void noteSpecInputs(std::vector<std::pair<std::string, std::string> >& Inputs, const cl::list<std::string>& Opt) {
+
+  for(cl::list<std::string>::const_iterator it = Opt.begin(), itend = Opt.end(); it != itend; ++it)
+    Inputs.push_back(std::make_pair(Opt.ArgStr.str(), *it));
+
+}
+
+// Read a block execution count profile: one "function,block,count" line per block.
+// Blank lines and lines starting with '#' are ignored. Functions and blocks that are not
+// found are skipped with a warning, as the profile may have been gathered from an older build.
+void LLPEAnalysisPass::loadBlockProfile(Module& M, std::string& Filename) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFile(Filename, -1, false);
+  if(std::error_code EC = MB.getError()) {
+
+    errs() << "Failed to open block profile " << Filename << ": " << EC.message() << "\n";
+    exit(1);
+
+  }
+
+  std::istringstream istr((*MB)->getBuffer().str());
+  std::string line;
+  uint32_t lineNo = 0;
+
+  while(std::getline(istr, line)) {
+
+    ++lineNo;
+    if(line.empty() || line[0] == '#')
+      continue;
+
+    std::string fName, bbName, countStr;
+    {
+      std::istringstream lstr(line);
+      std::getline(lstr, fName, ',');
+      std::getline(lstr, bbName, ',');
+      std::getline(lstr, countStr, ',');
+    }
+
+    char* end;
+    uint64_t count = strtoull(countStr.c_str(), &end, 10);
+    if(countStr.empty() || *end) {
+
+      errs() << Filename << ":" << lineNo << ": malformed block profile line\n";
+      exit(1);
+
+    }
+
+    Function* ProfF = M.getFunction(fName);
+    BasicBlock* ProfBB = ProfF ? lookupBlock(ProfF, bbName) : 0;
+
+    if(!ProfBB) {
+
+      errs() << "Warning: block profile names unknown block " << fName << "," << bbName << "\n";
+      continue;
+
+    }
+
+    blockProfile[ProfBB] = count;
+
+  }
+
+}
+
 void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstants, uint32_t& argvIdxOut) {
 
   this->statsFile = StatsFile;
+  this->fastExitOutput = FastExitOutput;
   this->mallocAlignment = MallocAlignment;
   this->maxContexts = MaxContexts;
+  this->maxOutputInsts = MaxOutputInsts;
+  this->outputInsts = 0;
+  this->loopWidenIters = LoopWidenIters;
+  this->loopTripProbe = LoopTripProbe;
+  this->loopEvalAll = LoopEvalAll;
+  this->maxPeelIterations = MaxPeelIterations;
+  this->contextTimeLimit = ContextTimeLimit;
+  this->contextMemLimit = ContextMemLimit;
+  this->rerollMinIterations = RerollMinIterations;
+  this->multiFlattenDepth = MultiFlattenDepth;
+  this->invarCacheDir = InvarCacheDir;
+  if(!SpillFile.empty())
+    openSpillFile(SpillFile);
+  this->graphOutputDir = GraphOutputDirectory;
+  this->graphArchivePath = GraphArchive;
+  this->valueTextCacheLimit = ValueTextCacheSize;
+  this->inputManifestFile = InputManifestFile;
+
+  if(BlockProfileFile != "")
+    loadBlockProfile(*F.getParent(), BlockProfileFile);
+
+  // Record the inputs that vary between specialisations of the same program:
+  if(EnvFileAndIdx != "")
+    specInputs.push_back(std::make_pair(EnvFileAndIdx.ArgStr.str(), (std::string)EnvFileAndIdx));
+  if(ArgvFileAndIdxs != "")
+    specInputs.push_back(std::make_pair(ArgvFileAndIdxs.ArgStr.str(), (std::string)ArgvFileAndIdxs));
+  noteSpecInputs(specInputs, SpecialiseParams);
+  noteSpecInputs(specInputs, PathConditionsInt);
+  noteSpecInputs(specInputs, PathConditionsFptr);
+  noteSpecInputs(specInputs, PathConditionsString);
+  noteSpecInputs(specInputs, PathConditionsIntmem);
+  noteSpecInputs(specInputs, PathConditionsFptrmem);
+  noteSpecInputs(specInputs, PathConditionsFunc);
+  noteSpecInputs(specInputs, PathConditionsStream);
+  noteSpecInputs(specInputs, PathConditionsGlobalInit);
+  noteSpecInputs(specInputs, PathConditionFiles);
+  collectPathConditions();
+  collectModelSpecs();
   
   if(EnvFileAndIdx != "") {
 
@@ -632,6 +954,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
       dieEnvUsage();
 
     CHECK_ARG(idx, argConstants);
+    specInputFiles.push_back(EnvFile);
     Constant* Env = loadEnvironment(*(F.getParent()), EnvFile);
     argConstants[idx] = Env;
 
@@ -649,6 +972,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
       dieArgvUsage();
 
     unsigned argc;
+    specInputFiles.push_back(ArgvFile);
     loadArgv(&F, ArgvFile, argvIdx, argc);
     CHECK_ARG(argcIdx, argConstants);
     argConstants[argcIdx] = ConstantInt::get(Type::getInt32Ty(F.getContext()), argc);
@@ -828,7 +1152,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
-  for(cl::list<std::string>::const_iterator ArgI = SpecialLocations.begin(), ArgE = SpecialLocations.end(); ArgI != ArgE; ++ArgI) {
+  for(std::vector<std::string>::const_iterator ArgI = SpecialLocationSpecs.begin(), ArgE = SpecialLocationSpecs.end(); ArgI != ArgE; ++ArgI) {
 
     std::istringstream istr(*ArgI);
     std::string fName, sizeStr;
@@ -859,7 +1183,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
    
   }
 
-  for(cl::list<std::string>::const_iterator ArgI = ModelFunctions.begin(), ArgE = ModelFunctions.end(); ArgI != ArgE; ++ArgI) {
+  for(std::vector<std::string>::const_iterator ArgI = ModelFunctionSpecs.begin(), ArgE = ModelFunctionSpecs.end(); ArgI != ArgE; ++ArgI) {
 
     std::istringstream istr(*ArgI);
     std::string realFName, modelFName;
@@ -886,7 +1210,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
-  for(cl::list<std::string>::const_iterator ArgI = YieldFunctions.begin(), ArgE = YieldFunctions.end(); ArgI != ArgE; ++ArgI) {
+  for(std::vector<std::string>::const_iterator ArgI = YieldFunctionSpecs.begin(), ArgE = YieldFunctionSpecs.end(); ArgI != ArgE; ++ArgI) {
 
     Function* YieldF = F.getParent()->getFunction(*ArgI);
     if(!YieldF) {
@@ -899,6 +1223,64 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  this->memoPureCalls = MemoPureCalls;
+
+  for(cl::list<std::string>::const_iterator ArgI = MemoFunctions.begin(), ArgE = MemoFunctions.end(); ArgI != ArgE; ++ArgI) {
+
+    Function* MemoF = F.getParent()->getFunction(*ArgI);
+    if(!MemoF) {
+
+      errs() << "-llpe-memo-function: no such function " << *ArgI << "\n";
+      exit(1);
+
+    }
+    memoFunctions.insert(MemoF);
+
+  }
+
+  for(cl::list<std::string>::const_iterator ArgI = SummaryFunctions.begin(), ArgE = SummaryFunctions.end(); ArgI != ArgE; ++ArgI) {
+
+    Function* SumF = F.getParent()->getFunction(*ArgI);
+    if(!SumF) {
+
+      errs() << "-llpe-summary-function: no such function " << *ArgI << "\n";
+      exit(1);
+
+    }
+    summaryFunctions.insert(SumF);
+
+  }
+
+  this->summaryExportFile = ExportSummaryFile;
+  if((!summaryExportFile.empty()) && summaryFunctions.empty()) {
+
+    errs() << "-llpe-export-summary requires at least one -llpe-summary-function\n";
+    exit(1);
+
+  }
+
+  for(cl::list<std::string>::const_iterator ArgI = ImportSummaryFiles.begin(), ArgE = ImportSummaryFiles.end(); ArgI != ArgE; ++ArgI)
+    loadLibrarySummaries(*F.getParent(), *ArgI);
+
+  if(NativeStringOps) {
+
+    static const struct { const char* Name; NativeStringOp Op; } NativeOps[] = {
+      { "strlen", NSO_STRLEN },
+      { "strcmp", NSO_STRCMP },
+      { "strncmp", NSO_STRNCMP },
+      { "memcmp", NSO_MEMCMP },
+      { "memchr", NSO_MEMCHR },
+      { "strchr", NSO_STRCHR },
+      { "memcpy", NSO_MEMCPY }
+    };
+
+    for(uint32_t i = 0, ilim = sizeof(NativeOps) / sizeof(NativeOps[0]); i != ilim; ++i) {
+      if(Function* NativeF = F.getParent()->getFunction(NativeOps[i].Name))
+	nativeStringFunctions[NativeF] = NativeOps[i].Op;
+    }
+
+  }
+
   for(cl::list<std::string>::iterator it = TargetStack.begin(), 
 	itend = TargetStack.end(); it != itend; ++it) {
     
@@ -1048,8 +1430,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
     
   }
 
-  for(cl::list<std::string>::iterator it = VarAllocators.begin(),
-	itend = VarAllocators.end(); it != itend; ++it) {
+  for(std::vector<std::string>::iterator it = VarAllocatorSpecs.begin(),
+	itend = VarAllocatorSpecs.end(); it != itend; ++it) {
 
     std::string fName, idxStr, freeName, freeIdxStr;
 
@@ -1090,8 +1472,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
-  for(cl::list<std::string>::iterator it = ConstAllocators.begin(),
-	itend = ConstAllocators.end(); it != itend; ++it) {
+  for(std::vector<std::string>::iterator it = ConstAllocatorSpecs.begin(),
+	itend = ConstAllocatorSpecs.end(); it != itend; ++it) {
 
     std::string fName, sizeStr, freeName, freeIdxStr, reallocName, reallocPtrIdxStr, reallocSizeIdxStr;
 
@@ -1155,6 +1537,14 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  // Before any -llpe-modref-function directives, so they can override the stdio descriptions.
+  this->modelStdio = StdioModel;
+  if(modelStdio)
+    initStdioMRInfo(F.getParent());
+
+  for(std::vector<std::string>::iterator it = ModRefSpecs.begin(), itend = ModRefSpecs.end(); it != itend; ++it)
+    addMRInfo(F.getParent(), *it);
+
   for(cl::list<std::string>::iterator it = NeverInline.begin(), itend = NeverInline.end(); it != itend; ++it) {
 
     Function* IgnoreF = F.getParent()->getFunction(*it);
@@ -1192,14 +1582,56 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
     reallocatorFunctions[libcRealloc] = ReallocatorFn(0, 1);
   }
 
-  this->verboseOverdef = VerboseOverdef;
+  // The verbose flags enable their log categories, as does naming them in -llpe-log.
+  uint32_t logMask = 0;
+  if(VerboseFunctionSharing)
+    logMask |= (1U << LOG_SHARING);
+  if(VerboseOverdef)
+    logMask |= (1U << LOG_OVERDEF);
+  if(DumpDSE)
+    logMask |= (1U << LOG_DSE);
+  if(DumpTL)
+    logMask |= (1U << LOG_TL);
+
+  for(cl::list<std::string>::iterator it = LogCategories.begin(), itend = LogCategories.end(); it != itend; ++it) {
+
+    uint32_t i;
+    for(i = 0; i != LOG_CATEGORIES && *it != getLogCategoryName((LogCategory)i); ++i) { }
+    if(i == LOG_CATEGORIES) {
+      errs() << "-llpe-log: unknown category " << *it << " (expected sharing, overdef, dse or tl)\n";
+      exit(1);
+    }
+    logMask |= (1U << i);
+
+  }
+
+  if(LogFormat != "text" && LogFormat != "jsonl") {
+    errs() << "-llpe-log-format must be text or jsonl\n";
+    exit(1);
+  }
+
+  initLog(LogFile, LogFormat == "jsonl", logMask);
+
+  this->verboseOverdef = logEnabled(LOG_OVERDEF);
   this->enableSharing = EnableFunctionSharing;
-  this->verboseSharing = VerboseFunctionSharing;
+  this->verboseSharing = logEnabled(LOG_SHARING);
+  this->deepSharingCompare = DeepSharingCompare;
   this->verbosePCs = VerbosePathConditions;
+  this->batchPathFuncs = BatchPathFuncs;
   this->programSingleThreaded = SingleThreaded;
   this->useGlobalInitialisers = UseGlobalInitialisers;
   this->omitChecks = OmitChecks;
   this->omitMallocChecks = OmitMallocChecks;
+  this->allocSiteLimit = AllocSiteLimit;
+  this->coalesceChecks = CoalesceChecks;
+  this->inlineLliowdCheck = InlineLliowdCheck;
+  this->countFailures = CountFailures;
+  this->exportVariant = ExportVariant;
+  this->blockMapFile = BlockMapFile;
+  this->runtimeReportTable = RuntimeReportTable;
+  this->mergeIdenticalFunctions = MergeIdenticalFunctions;
+  this->shareLandingPads = ShareLandingPads;
+  this->staticHeap = StaticHeap;
   if(this->omitChecks && !this->programSingleThreaded) {
 
     errs() << "omit-checks currently requires single-threaded\n";
@@ -1224,7 +1656,9 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
   }
 
   this->llioConfigFile = LLIOConfFile;
+  this->digestCacheFile = DigestCacheFile;
   this->emitFakeDebug = EmitFakeDebug;
+  this->emitDebugLocs = EmitDebugLocs;
 
   if(this->emitFakeDebug) {
     DIBuilder DIB(*F.getParent());
@@ -1261,16 +1695,16 @@ void LLPEAnalysisPass::parseArgsPostCreation(InlineAttempt* IA) {
 
   }
 
-  parsePathConditions(PathConditionsInt, PathConditionTypeInt, IA);
-  parsePathConditions(PathConditionsFptr, PathConditionTypeFptr, IA);
-  parsePathConditions(PathConditionsString, PathConditionTypeString, IA);
-  parsePathConditions(PathConditionsIntmem, PathConditionTypeIntmem, IA);  
-  parsePathConditions(PathConditionsFptrmem, PathConditionTypeFptrmem, IA);
-  parsePathConditions(PathConditionsStream, PathConditionTypeStream, IA);
-  parsePathConditions(PathConditionsGlobalInit, PathConditionTypeGlobalInit, IA);
+  parsePathConditions(PathConditionSpecs[PathConditionTypeInt], PathConditionTypeInt, IA);
+  parsePathConditions(PathConditionSpecs[PathConditionTypeFptr], PathConditionTypeFptr, IA);
+  parsePathConditions(PathConditionSpecs[PathConditionTypeString], PathConditionTypeString, IA);
+  parsePathConditions(PathConditionSpecs[PathConditionTypeIntmem], PathConditionTypeIntmem, IA);  
+  parsePathConditions(PathConditionSpecs[PathConditionTypeFptrmem], PathConditionTypeFptrmem, IA);
+  parsePathConditions(PathConditionSpecs[PathConditionTypeStream], PathConditionTypeStream, IA);
+  parsePathConditions(PathConditionSpecs[PathConditionTypeGlobalInit], PathConditionTypeGlobalInit, IA);
 
-  for(cl::list<std::string>::iterator it = PathConditionsFunc.begin(), 
-	itend = PathConditionsFunc.end(); it != itend; ++it) {
+  for(std::vector<std::string>::iterator it = PathFuncSpecs.begin(), 
+	itend = PathFuncSpecs.end(); it != itend; ++it) {
 
     std::string fStackIdxStr;
     std::string bbName;
@@ -1361,8 +1795,7 @@ void LLPEAnalysisPass::parseArgsPostCreation(InlineAttempt* IA) {
 
     }
 
-    PC->FuncPathConditions.push_back(PathFunc(fStackIdx, assumeBlock, CallF, VerifyF));
-    PathFunc& newFunc = PC->FuncPathConditions.back();
+    PathFunc& newFunc = PC->addFunc(PathFunc(fStackIdx, assumeBlock, CallF, VerifyF));
 
     while(!istr.eof()) {
 
@@ -1411,6 +1844,6 @@ void LLPEAnalysisPass::parseArgsPostCreation(InlineAttempt* IA) {
 // Cheeky export for TopLevel.cpp's consumption:
 namespace llvm {
   size_t getStringPathConditionCount() {
-    return PathConditionsString.size();
+    return PathConditionSpecs[PathConditionTypeString].size();
   }
 }
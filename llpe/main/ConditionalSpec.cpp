@@ -12,6 +12,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Support/MathExtras.h"
@@ -96,7 +97,7 @@ void InlineAttempt::addBlockAndPreds(uint32_t idx, DenseSet<uint32_t>& Set) {
 // won't reach the target call.
 void InlineAttempt::setTargetCall(std::pair<BasicBlock*, uint32_t>& arg, uint32_t stackIdx) {
 
-  uint32_t blockIdx = findBlock(invarInfo, arg.first->getName());
+  uint32_t blockIdx = findBlock(invarInfo, arg.first);
   targetCallInfo = new IATargetInfo(blockIdx, arg.second, stackIdx);
 
   addBlockAndPreds(blockIdx, targetCallInfo->mayReachTarget);
@@ -205,44 +206,33 @@ bool IntegrationAttempt::tryGetPathValueFrom(PathConditions& PC, uint32_t myStac
     return false;
 
   std::vector<PathCondition>& PCs = asDef ? PC.AsDefIntPathConditions : PC.IntPathConditions;
+  PathConditionIndex& Index = asDef ? PC.AsDefIntIndex : PC.IntIndex;
 
-  for(std::vector<PathCondition>::iterator it = PCs.begin(), itend = PCs.end(); it != itend; ++it) {
-
-    // fromStackIdx must equal instStackIdx for integer assertions.
-
-    if(it->instStackIdx == myStackDepth) {
-      
-      bool match = false;
-
-      if(SI && 
-	 it->instBB == SI->parent->invar->BB &&
-	 it->instIdx == SI->invar->idx) {
-
-	if(getFunctionRoot()->DT->dominates(it->fromBB, UserBlock->invar->BB))
-	  match = true;
-
-      }
-      else if(SA &&
-	      it->instBB == (BasicBlock*)ULONG_MAX &&
-	      it->instIdx == SA->invar->A->getArgNo()) {
+  // fromStackIdx must equal instStackIdx for integer assertions.
+  // Arguments are identified by instBB == ULONG_MAX and instIdx == argument number.
+  const PathConditionIndex::Entries* Cands;
+  if(SI)
+    Cands = Index.findInst(myStackDepth, SI->parent->invar->BB, SI->invar->idx);
+  else
+    Cands = Index.findInst(myStackDepth, (BasicBlock*)ULONG_MAX, SA->invar->A->getArgNo());
 
-	match = true;
+  if(!Cands)
+    return false;
 
-      }
+  for(PathConditionIndex::Entries::const_iterator it = Cands->begin(), itend = Cands->end(); it != itend; ++it) {
 
-      if(match) {
+    PathCondition& Cond = PCs[*it];
 
-	// Make sure a failed version of the from-block and its successors is created:
-	uint32_t fromBlockIdx = findBlock(UserBlock->IA->invarInfo, it->fromBB);
-	getFunctionRoot()->markBlockAndSuccsReachableUnspecialised(fromBlockIdx, 0);
+    if(SI && !pass->getDT(&F)->dominates(Cond.fromBB, UserBlock->invar->BB))
+      continue;
 
-	Result.first = ValSetTypeScalar;
-	Result.second.V = it->u.val;
-	return true;
-	
-      }
+    // Make sure a failed version of the from-block and its successors is created:
+    uint32_t fromBlockIdx = findBlock(UserBlock->IA->invarInfo, Cond.fromBB);
+    getFunctionRoot()->markBlockAndSuccsReachableUnspecialised(fromBlockIdx, 0);
 
-    }
+    Result.first = ValSetTypeScalar;
+    Result.second.V = Cond.u.val;
+    return true;
 
   }
 
@@ -267,9 +257,54 @@ InlineAttempt* llvm::getIAWithTargetStackDepth(InlineAttempt* IA, uint32_t depth
 
 }
 
+// Does the memory at WritePtr already hold what memory path condition Cond asserts, according to BB's store?
+// If so whatever established that, an earlier check or the specialised code itself, implies Cond.
+// That is contingent on the object's contents, so a context sharing this one must agree about it.
+static bool pathConditionHolds(PathCondition* Cond, PathConditionTypes Ty, ImprovedValSetSingle& WritePtr, ShadowBB* BB) {
+
+  if(WritePtr.isWhollyUnknown() || WritePtr.SetType != ValSetTypePB || WritePtr.Values.size() != 1)
+    return false;
+
+  ImprovedVal& Ptr = WritePtr.Values[0];
+  if(Ptr.Offset == LLONG_MAX || Ptr.Offset < 0)
+    return false;
+
+  if(Ty == PathConditionTypeString) {
+
+    ConstantDataArray* CDA = cast<ConstantDataArray>(cast<GlobalVariable>(Cond->u.val)->getInitializer());
+    uint32_t Size = CDA->getNumElements();
+
+    SmallVector<IVSRange, 4> Current;
+    readValRangeMulti(Ptr.V, Ptr.Offset, Size, BB, Current);
+    if(valsToConst(Current, Size, CDA->getType()) != CDA)
+      return false;
+
+  }
+  else {
+
+    Type* CondTy = Cond->u.val->getType();
+    uint64_t Size = GlobalTD->getTypeStoreSize(CondTy);
+
+    ImprovedValSetSingle Current;
+    readValRange(Ptr.V, Ptr.Offset, Size, BB, Current, 0, 0);
+    if(Current.isWhollyUnknown() || Current.SetType != ValSetTypeScalar || Current.Values.size() != 1)
+      return false;
+    if(!Current.coerceToType(CondTy, Size, 0))
+      return false;
+
+    if(getSingleConstant(Current.Values[0].V) != Cond->u.val)
+      return false;
+
+  }
+
+  BB->IA->noteDependency(Ptr.V);
+  return true;
+
+}
+
 // Apply the given assumption (path condition) if it applies from block BB. If the user gave a target call stack, apply it only at the appropriate
 // depth; otherwise apply it to all instances of this function.
-void IntegrationAttempt::applyPathCondition(PathCondition* it, PathConditionTypes condty, ShadowBB* BB, uint32_t targetStackDepth) {
+void IntegrationAttempt::applyPathCondition(PathCondition* it, PathConditionTypes condty, ShadowBB* BB, uint32_t targetStackDepth, bool inLoopAnalyser) {
 
   // UINT_MAX signifies a path condition that applies to all instances of this function.
 
@@ -287,6 +322,12 @@ void IntegrationAttempt::applyPathCondition(PathCondition* it, PathConditionType
 
     }
 
+    // Note whether the check is redundant before the assumption is written. The loop analyser's store
+    // may be circular, with the assumption's own write coming round the latch, so trust only the final pass.
+    impliedPathConditions.erase(it);
+    if(condty != PathConditionTypeStream && (!inLoopAnalyser) && pathConditionHolds(it, condty, writePtr, BB))
+      impliedPathConditions.insert(it);
+
     if(condty == PathConditionTypeString) {
       
       GlobalVariable* GV = cast<GlobalVariable>(it->u.val);
@@ -310,9 +351,9 @@ void IntegrationAttempt::applyPathCondition(PathCondition* it, PathConditionType
       pass->fds.push_back(FDGlobalState(0, /* is a fifo */ true));
       /* Pseudo FD is born waiting for a representitive value */
       pass->fds.back().isCommitted = true; 
-      if(FDS->fds.size() <= newId)
-	FDS->fds.resize(newId + 1);
-      FDS->fds[newId] = FDState(std::string(fname));
+      if(FDS->size() <= newId)
+	FDS->resize(newId + 1);
+      FDS->getWritableFD(newId) = FDState(std::string(fname));
 
       ImprovedValSetSingle writeVal;
       writeVal.set(ImprovedVal(ShadowValue::getFdIdx(newId)), ValSetTypeFD);
@@ -348,29 +389,89 @@ void llvm::clearAsExpectedChecks(ShadowBB* BB) {
 }
 
 // If an assumption is to be made about any value in this function, flag it for runtime check generation.
-void IntegrationAttempt::noteAsExpectedChecksFrom(ShadowBB* BB, std::vector<PathCondition>& PCs, uint32_t stackIdx) {
+void IntegrationAttempt::noteAsExpectedChecksFrom(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx) {
 
-  for(std::vector<PathCondition>::iterator it = PCs.begin(), itend = PCs.end(); it != itend; ++it) {
+  const PathConditionIndex::Entries* Cands = PC.AsDefIntIndex.findFromBlock(stackIdx, BB->invar->BB);
+  if(!Cands)
+    return;
 
-    if(it->fromStackIdx == stackIdx && it->fromBB == BB->invar->BB) {
+  for(PathConditionIndex::Entries::const_iterator it = Cands->begin(), itend = Cands->end(); it != itend; ++it) {
 
-      release_assert(it->fromStackIdx == it->instStackIdx && it->fromBB == it->instBB);
+    PathCondition& Cond = PC.AsDefIntPathConditions[*it];
+    release_assert(Cond.fromStackIdx == Cond.instStackIdx && Cond.fromBB == Cond.instBB);
 
-      // This flag indicates the path condition should be checked on definition, rather than
-      // at the top of the block as for conditions that don't always apply.
-      BB->insts[it->instIdx].needsRuntimeCheck = RUNTIME_CHECK_AS_EXPECTED;
-      
-    }
+    // This flag indicates the path condition should be checked on definition, rather than
+    // at the top of the block as for conditions that don't always apply.
+    BB->insts[Cond.instIdx].needsRuntimeCheck = RUNTIME_CHECK_AS_EXPECTED;
+
+  }
+
+}
+
+// Does SII compute the same value in every iteration of L? True if it is free of side-effects
+// and memory access and all its operands are defined outside L or are themselves invariant.
+static bool isIterationInvariant(ShadowInstructionInvar* SII, const ShadowLoopInvar* L, uint32_t depth) {
+
+  if(depth > 8)
+    return false;
+
+  Instruction* I = SII->I;
+  if(isa<PHINode>(I) || isa<AllocaInst>(I) || I->mayReadOrWriteMemory() || I->mayHaveSideEffects() || I->isEHPad())
+    return false;
+
+  for(uint32_t i = 0, ilim = SII->operandIdxs.size(); i != ilim; ++i) {
+
+    ShadowInstIdx& op = SII->operandIdxs[i];
+    if(op.blockIdx == INVALID_BLOCK_IDX || op.instIdx == INVALID_INSTRUCTION_IDX)
+      continue;
+
+    ShadowBBInvar* opBBI = &SII->parent->F->BBs[op.blockIdx];
+    if(!L->contains(opBBI->naturalScope))
+      continue;
+
+    if(!isIterationInvariant(&opBBI->insts[op.instIdx], L, depth + 1))
+      return false;
 
   }
 
+  return true;
+
+}
+
+// An as-expected check on an iteration-invariant value in a block that runs on every trip
+// around the loop is redundant after the first iteration: that iteration's check has already
+// run before we can reach this one, and failing it leaves specialised code. This iteration
+// therefore needs neither the check nor a failed-block path for it.
+bool PeelIteration::checkMadeByFirstIteration(ShadowInstruction* SI) {
+
+  if(iterationCount == 0)
+    return false;
+
+  ShadowBBInvar* BBI = SI->parent->invar;
+  if(!pass->getDT(&F)->dominates(BBI->BB, getBBInvar(L->latchIdx)->BB))
+    return false;
+
+  if(!isIterationInvariant(SI->invar, L, 0))
+    return false;
+
+  ShadowBB* FirstBB = parentPA->Iterations[0]->getBB(*BBI);
+  if(!FirstBB)
+    return false;
+
+  ShadowInstruction* FirstSI = &FirstBB->insts[SI->invar->idx];
+  if(FirstSI->needsRuntimeCheck != RUNTIME_CHECK_AS_EXPECTED || !FirstSI->i.PB || 
+     !IVsEqualShallow(FirstSI->i.PB, SI->i.PB))
+    return false;
+
+  return parentPA->Iterations[0]->requiresRuntimeCheck2(ShadowValue(FirstSI), false);
+
 }
 
 // Flag required runtime checks that apply to all instances of this function.
 void IntegrationAttempt::noteAsExpectedChecks(ShadowBB* BB) {
 
   if(invarInfo->pathConditions)
-    noteAsExpectedChecksFrom(BB, invarInfo->pathConditions->AsDefIntPathConditions, UINT_MAX);
+    noteAsExpectedChecksFrom(BB, *invarInfo->pathConditions, UINT_MAX);
 
 }
 
@@ -378,7 +479,7 @@ void IntegrationAttempt::noteAsExpectedChecks(ShadowBB* BB) {
 void InlineAttempt::noteAsExpectedChecks(ShadowBB* BB) {
 
   if(targetCallInfo)
-    noteAsExpectedChecksFrom(BB, pass->pathConditions.AsDefIntPathConditions, targetCallInfo->targetStackDepth);
+    noteAsExpectedChecksFrom(BB, pass->pathConditions, targetCallInfo->targetStackDepth);
 
   IntegrationAttempt::noteAsExpectedChecks(BB);
 
@@ -403,28 +504,23 @@ void InlineAttempt::applyMemoryPathConditions(ShadowBB* BB, bool inLoopAnalyser,
 
 }
 
-void IntegrationAttempt::applyMemoryPathConditionsFrom(ShadowBB* BB, PathConditions& PC, uint32_t targetStackDepth, bool inLoopAnalyser, bool inAnyLoop) {
-
-  for(std::vector<PathCondition>::iterator it = PC.StringPathConditions.begin(),
-	itend = PC.StringPathConditions.end(); it != itend; ++it) {
+// Apply those of Conds that take effect from the start of BB.
+void IntegrationAttempt::applyPathConditionsFromBlock(std::vector<PathCondition>& Conds, PathConditionIndex& Index, PathConditionTypes Ty, ShadowBB* BB, uint32_t targetStackDepth, bool inLoopAnalyser) {
 
-    applyPathCondition(&*it, PathConditionTypeString, BB, targetStackDepth);
-
-  }
-
-  for(std::vector<PathCondition>::iterator it = PC.IntmemPathConditions.begin(),
-	itend = PC.IntmemPathConditions.end(); it != itend; ++it) {  
-
-    applyPathCondition(&*it, PathConditionTypeIntmem, BB, targetStackDepth);
+  const PathConditionIndex::Entries* Cands = Index.findFromBlock(targetStackDepth, BB->invar->BB);
+  if(!Cands)
+    return;
 
-  }
+  for(PathConditionIndex::Entries::const_iterator it = Cands->begin(), itend = Cands->end(); it != itend; ++it)
+    applyPathCondition(&Conds[*it], Ty, BB, targetStackDepth, inLoopAnalyser);
 
-  for(std::vector<PathCondition>::iterator it = PC.StreamPathConditions.begin(),
-	itend = PC.StreamPathConditions.end(); it != itend; ++it) {
+}
 
-    applyPathCondition(&*it, PathConditionTypeStream, BB, targetStackDepth);
+void IntegrationAttempt::applyMemoryPathConditionsFrom(ShadowBB* BB, PathConditions& PC, uint32_t targetStackDepth, bool inLoopAnalyser, bool inAnyLoop) {
 
-  }
+  applyPathConditionsFromBlock(PC.StringPathConditions, PC.StringIndex, PathConditionTypeString, BB, targetStackDepth, inLoopAnalyser);
+  applyPathConditionsFromBlock(PC.IntmemPathConditions, PC.IntmemIndex, PathConditionTypeIntmem, BB, targetStackDepth, inLoopAnalyser);
+  applyPathConditionsFromBlock(PC.StreamPathConditions, PC.StreamIndex, PathConditionTypeStream, BB, targetStackDepth, inLoopAnalyser);
 
   for(std::vector<PathFunc>::iterator it = PC.FuncPathConditions.begin(),
 	itend = PC.FuncPathConditions.end(); it != itend; ++it) {
@@ -540,6 +636,7 @@ void InlineAttempt::initFailedBlockCommit() {
     failedBlockMap = 0;
     PHIForwards = 0;
     ForwardingPHIs = 0;
+    failedMergeKinds = 0;
     return; 
   }
 
@@ -547,6 +644,7 @@ void InlineAttempt::initFailedBlockCommit() {
   failedBlockMap = new ValueToValueMapTy(NextPowerOf2((blocksReachableOnFailure->size() * 3) - 1));
   PHIForwards = new DenseMap<std::pair<Instruction*, BasicBlock*>, PHINode*>();
   ForwardingPHIs = new DenseSet<PHINode*>();
+  failedMergeKinds = new std::vector<uint8_t>(nBBs, 0);
 
 }
 
@@ -557,29 +655,15 @@ void InlineAttempt::finishFailedBlockCommit() {
   delete failedBlockMap; failedBlockMap = 0;
   delete PHIForwards; PHIForwards = 0;
   delete ForwardingPHIs; ForwardingPHIs = 0;
+  delete failedMergeKinds; failedMergeKinds = 0;
+  std::vector<std::pair<Instruction*, uint32_t> >().swap(forwardPredBlocks);
 
 }
 
-// Helper for matching (BB, stackIdx) tuples
-struct matchesFromIdx {
-
-  BasicBlock* BB;
-  uint32_t stackIdx;
-
-  bool operator()(PathCondition& C) { 
-
-    return C.fromBB == BB && C.fromStackIdx == stackIdx; 
-
-  }
-
-  matchesFromIdx(BasicBlock* _BB, uint32_t si) : BB(_BB), stackIdx(si) {}
-
-};
+static uint32_t countPathConditionsIn(BasicBlock* BB, uint32_t stackIdx, PathConditionIndex& Index) {
 
-static uint32_t countPathConditionsIn(BasicBlock* BB, uint32_t stackIdx, std::vector<PathCondition>& Conds) {
-
-  matchesFromIdx Pred(BB, stackIdx);
-  return std::count_if(Conds.begin(), Conds.end(), Pred);
+  const PathConditionIndex::Entries* Cands = Index.findFromBlock(stackIdx, BB);
+  return Cands ? Cands->size() : 0;
 
 }
 
@@ -587,26 +671,35 @@ static uint32_t countPathConditionsAtBlockStartIn(ShadowBBInvar* BB, uint32_t st
 
   BasicBlock* B = BB->BB;
 
-  uint32_t nPCs = countPathConditionsIn(B, stackIdx, PCs.IntPathConditions) +
-    countPathConditionsIn(B, stackIdx, PCs.StringPathConditions) +
-    countPathConditionsIn(B, stackIdx, PCs.IntmemPathConditions);
+  return countPathConditionsIn(B, stackIdx, PCs.IntIndex) +
+    countPathConditionsIn(B, stackIdx, PCs.StringIndex) +
+    countPathConditionsIn(B, stackIdx, PCs.IntmemIndex) +
+    PCs.countFuncsAt(stackIdx, B, GlobalIHP->batchPathFuncs);
+  
+}
+
+// The number of this context's memory path conditions from BB whose checks are implied (see pathConditionHolds).
+uint32_t IntegrationAttempt::countImpliedPathConditions(BasicBlock* BB) {
 
-  for(std::vector<PathFunc>::iterator it = PCs.FuncPathConditions.begin(),
-	itend = PCs.FuncPathConditions.end(); it != itend; ++it) {
+  uint32_t total = 0;
+  for(DenseSet<PathCondition*>::iterator it = impliedPathConditions.begin(),
+	itend = impliedPathConditions.end(); it != itend; ++it) {
 
-    if(it->stackIdx == stackIdx && it->BB == BB->BB)
-      ++nPCs;
+    if((*it)->fromBB == BB)
+      ++total;
 
   }
-  
-  return nPCs;
-  
+
+  return total;
+
 }
 
 // Returns the number of path conditions that will be checked /before the start of BB/.
 // This does not include conditions listed in AsDefIntPathConditions which are checked
-// as the instruction becomes defined (hence the name), in the midst of the block.
-uint32_t LLPEAnalysisPass::countPathConditionsAtBlockStart(ShadowBBInvar* BB, IntegrationAttempt* IA) {
+// as the instruction becomes defined (hence the name), in the midst of the block,
+// nor unless includeImplied is set those that IA found implied and so won't check.
+// Callers asking on behalf of every instance of a function should set includeImplied.
+uint32_t LLPEAnalysisPass::countPathConditionsAtBlockStart(ShadowBBInvar* BB, IntegrationAttempt* IA, bool includeImplied) {
 
   uint32_t total = 0;
   if(IA->invarInfo->pathConditions)
@@ -616,6 +709,9 @@ uint32_t LLPEAnalysisPass::countPathConditionsAtBlockStart(ShadowBBInvar* BB, In
   if(Info)
     total += countPathConditionsAtBlockStartIn(BB, Info->targetStackDepth, pathConditions);
 
+  if(!includeImplied)
+    total -= IA->countImpliedPathConditions(BB->BB);
+
   return total;
 
 }
@@ -665,6 +761,12 @@ void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditi
   if((stackIdx != UINT_MAX && stackIdx != Cond.fromStackIdx) || BB->invar->BB != Cond.fromBB)
     return;
 
+  // Implied by an earlier check or by the specialised code; no block was made for it.
+  if(impliedPathConditions.count(&Cond)) {
+    ++GlobalIHP->stats.impliedPathConditionChecks;
+    return;
+  }
+
   CommittedBlock& emitCB = *(emitBlockIt++);
   BasicBlock* emitBlock = emitCB.specBlock;
 
@@ -781,14 +883,155 @@ void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditi
   }
   
   release_assert(emitBlockIt->specBlock && failTarget && resultInst);
-  BranchInst::Create(emitBlockIt->specBlock, failTarget, resultInst, emitBlock);
+  createCheckBranch(resultInst, false, emitBlockIt->specBlock, failTarget, emitBlock);
+
+}
+
+void IntegrationAttempt::emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionIndex& Index, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
+
+  // Function-wide conditions (stackIdx == UINT_MAX) have fromStackIdx UINT_MAX too.
+  const PathConditionIndex::Entries* Cands = Index.findFromBlock(stackIdx, BB->invar->BB);
+  if(!Cands)
+    return;
+
+  for(PathConditionIndex::Entries::const_iterator it = Cands->begin(), itend = Cands->end(); it != itend; ++it)
+    emitPathConditionCheck(Conds[*it], Ty, BB, stackIdx, emitBlockIt);
+
+}
+
+// Get the committed value of PF's argIdx'th argument, to pass to its verifier.
+Value* IntegrationAttempt::getPathFuncVerifyArg(PathFunc& PF, uint32_t argIdx, BasicBlock* emitBlock) {
+
+  PathFuncArg& A = PF.args[argIdx];
+  ShadowValue argVal = getPathConditionSV(A.stackIdx, A.instBB, A.instIdx);
+  Value* Ret = getCommittedValue(argVal);
+
+  if(!Ret) {
+
+    // Path conditions can request args in other contexts if there is a target stack.
+    // They might be legitimately not committed yet; rather than use the patch-refs
+    // system again, just re-synthesise the instruction here.
+
+    ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(getIVSRef(argVal));
+    release_assert(IVS);
+    release_assert(IVS->Values.size() == 1);
+    Ret = trySynthVal(0, PF.VerifyF->getFunctionType()->getParamType(argIdx), IVS->SetType, IVS->Values[0], emitBlock);
+
+  }
+
+  release_assert(Ret);
+  return Ret;
 
 }
 
-void IntegrationAttempt::emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
+// Make a function that calls each of VerifyFs with its own slice of its arguments, stopping at the first to
+// return nonzero. It returns that verifier's result (or 1, if its type differs from the first verifier's), or zero.
+Function* LLPEAnalysisPass::getBatchedPathFuncVerifier(const std::vector<Function*>& VerifyFs) {
+
+  std::map<std::vector<Function*>, Function*>::iterator findit = batchedPathFuncVerifiers.find(VerifyFs);
+  if(findit != batchedPathFuncVerifiers.end())
+    return findit->second;
+
+  Module* M = getGlobalModule();
+  LLVMContext& Ctx = M->getContext();
+  Type* RetTy = VerifyFs[0]->getReturnType();
+
+  std::vector<Type*> ParamTys;
+  for(std::vector<Function*>::const_iterator it = VerifyFs.begin(), itend = VerifyFs.end(); it != itend; ++it) {
+    FunctionType* FT = (*it)->getFunctionType();
+    ParamTys.insert(ParamTys.end(), FT->param_begin(), FT->param_end());
+  }
+
+  FunctionType* BatchTy = FunctionType::get(RetTy, ParamTys, false);
+  Function* BatchF = Function::Create(BatchTy, GlobalValue::InternalLinkage, "__llpe_verify_batch", M);
+
+  Function::arg_iterator argit = BatchF->arg_begin();
+  BasicBlock* CallBB = BasicBlock::Create(Ctx, "", BatchF);
+
+  for(uint32_t i = 0, ilim = VerifyFs.size(); i != ilim; ++i) {
+
+    std::vector<Value*> Args;
+    for(uint32_t j = 0, jlim = VerifyFs[i]->getFunctionType()->getNumParams(); j != jlim; ++j, ++argit)
+      Args.push_back(&*argit);
+
+    Value* Result = CallInst::Create(VerifyFs[i], Args, "", CallBB);
+    Value* Failed = 0;
+    if(Result->getType() != RetTy || i + 1 != ilim)
+      Failed = new ICmpInst(*CallBB, CmpInst::ICMP_NE, Result, Constant::getNullValue(Result->getType()));
+    if(Result->getType() != RetTy)
+      Result = new ZExtInst(Failed, RetTy, "", CallBB);
+
+    if(i + 1 == ilim) {
+      ReturnInst::Create(Ctx, Result, CallBB);
+      break;
+    }
+
+    BasicBlock* FailBB = BasicBlock::Create(Ctx, "", BatchF);
+    BasicBlock* NextBB = BasicBlock::Create(Ctx, "", BatchF);
+    createCheckBranch(Failed, true, NextBB, FailBB, CallBB);
+    ReturnInst::Create(Ctx, Result, FailBB);
+    CallBB = NextBB;
+
+  }
+
+  batchedPathFuncVerifiers[VerifyFs] = BatchF;
+  return BatchF;
+
+}
+
+// Check all of Funcs, the function path conditions at the top of BB, with one call to a batched verifier
+// and one branch, taking a single committed block.
+void IntegrationAttempt::emitBatchedPathFuncCheck(ShadowBB* BB, PathConditions& PC, const PathConditionIndex::Entries& Funcs, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
+
+  CommittedBlock& emitCB = *(emitBlockIt++);
+  BasicBlock* emitBlock = emitCB.specBlock;
+
+  std::vector<Function*> VerifyFs;
+  std::vector<Value*> verifyArgs;
+
+  for(PathConditionIndex::Entries::const_iterator it = Funcs.begin(), itend = Funcs.end(); it != itend; ++it) {
+
+    PathFunc& PF = PC.FuncPathConditions[*it];
+    VerifyFs.push_back(PF.VerifyF);
+    for(uint32_t i = 0, ilim = PF.args.size(); i != ilim; ++i)
+      verifyArgs.push_back(getPathFuncVerifyArg(PF, i, emitBlock));
+
+  }
+
+  Function* BatchF = pass->getBatchedPathFuncVerifier(VerifyFs);
+  Value* VCall = CallInst::Create(BatchF, verifyArgs, VerboseNames ? "verifycall" : "", emitBlock);
+  Value* VCond = new ICmpInst(*emitBlock, CmpInst::ICMP_EQ, VCall, Constant::getNullValue(VCall->getType()), VerboseNames ? "verifycheck" : "");
+
+  BasicBlock* failTarget = getFunctionRoot()->failedBlocks[BB->invar->idx].front().first;
+
+  if(emitCB.specBlock != emitCB.breakBlock) {
+
+    std::string msg;
+    {
+      raw_string_ostream RSO(msg);
+      RSO << "Failed one of path functions";
+      for(std::vector<Function*>::iterator it = VerifyFs.begin(), itend = VerifyFs.end(); it != itend; ++it)
+	RSO << " " << (*it)->getName();
+      RSO << " in block " << BB->invar->BB->getName() << " / " << BB->IA->SeqNumber << ". Return code: ";
+    }
+
+    escapePercent(msg);
+
+    std::string pasted;
+    {
+      raw_string_ostream RSO(pasted);
+      RSO << msg << "%d\n";
+    }
+
+    emitRuntimePrint(emitCB.breakBlock, pasted, VCall);
+
+    BranchInst::Create(failTarget, emitCB.breakBlock);
+    failTarget = emitCB.breakBlock;
+
+  }
 
-  for(std::vector<PathCondition>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it)
-    emitPathConditionCheck(*it, Ty, BB, stackIdx, emitBlockIt);
+  release_assert(emitBlockIt->specBlock && failTarget && VCond);
+  createCheckBranch(VCond, false, emitBlockIt->specBlock, failTarget, emitBlock);
 
 }
 
@@ -796,13 +1039,23 @@ void IntegrationAttempt::emitPathConditionChecksIn(std::vector<PathCondition>& C
 void IntegrationAttempt::emitPathConditionChecks2(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
 
   // Integer, string and integer-memory checks are all straightforward check-and-branch affairs.
-  emitPathConditionChecksIn(PC.IntPathConditions, PathConditionTypeInt, BB, stackIdx, emitBlockIt);
-  emitPathConditionChecksIn(PC.StringPathConditions, PathConditionTypeString, BB, stackIdx, emitBlockIt);
-  emitPathConditionChecksIn(PC.IntmemPathConditions, PathConditionTypeIntmem, BB, stackIdx, emitBlockIt);
+  emitPathConditionChecksIn(PC.IntPathConditions, PC.IntIndex, PathConditionTypeInt, BB, stackIdx, emitBlockIt);
+  emitPathConditionChecksIn(PC.StringPathConditions, PC.StringIndex, PathConditionTypeString, BB, stackIdx, emitBlockIt);
+  emitPathConditionChecksIn(PC.IntmemPathConditions, PC.IntmemIndex, PathConditionTypeIntmem, BB, stackIdx, emitBlockIt);
 
   // Function path conditions specify that we should insert a call to a verifier function,
   // then check its return value is as required.
 
+  if(pass->batchPathFuncs) {
+
+    const PathConditionIndex::Entries* Funcs = PC.findFuncsAt(stackIdx, BB->invar->BB);
+    if(Funcs && PC.funcsBatchable(*Funcs)) {
+      emitBatchedPathFuncCheck(BB, PC, *Funcs, emitBlockIt);
+      return;
+    }
+
+  }
+
   for(std::vector<PathFunc>::iterator it = PC.FuncPathConditions.begin(), 
 	itend = PC.FuncPathConditions.end(); it != itend; ++it) {
 
@@ -816,30 +1069,8 @@ void IntegrationAttempt::emitPathConditionChecks2(ShadowBB* BB, PathConditions&
     
     // Call the verify function at runtime with arguments corresponding to those which were
     // passed to the path function during specialisation.
-
-    uint32_t i = 0;
-    for(SmallVector<PathFuncArg, 1>::iterator argit = it->args.begin(),
-	  argend = it->args.end(); argit != argend; ++argit, ++i) {
-
-      ShadowValue argVal = getPathConditionSV(argit->stackIdx, argit->instBB, argit->instIdx);
-      verifyArgs[i] = getCommittedValue(argVal);
-
-      if(!verifyArgs[i]) {
-
-	// Path conditions can request args in other contexts if there is a target stack.
-	// They might be legitimately not committed yet; rather than use the patch-refs
-	// system again, just re-synthesise the instruction here.
-
-	ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(getIVSRef(argVal));
-	release_assert(IVS);
-	release_assert(IVS->Values.size() == 1);
-	verifyArgs[i] = trySynthVal(0, it->VerifyF->getFunctionType()->getParamType(i), IVS->SetType, IVS->Values[0], emitBlock);
-
-      }
-
-      release_assert(verifyArgs[i]);
-      
-    }
+    for(uint32_t i = 0, ilim = it->args.size(); i != ilim; ++i)
+      verifyArgs[i] = getPathFuncVerifyArg(*it, i, emitBlock);
 
     Value* VCall = CallInst::Create(it->VerifyF, ArrayRef<Value*>(verifyArgs, it->args.size()), VerboseNames ? "verifycall" : "", emitBlock);
 
@@ -874,7 +1105,7 @@ void IntegrationAttempt::emitPathConditionChecks2(ShadowBB* BB, PathConditions&
     
     // Branch to next check or to failed block.
     release_assert(emitBlockIt->specBlock && failTarget && VCond);
-    BranchInst::Create(emitBlockIt->specBlock, failTarget, VCond, emitBlock);
+    createCheckBranch(VCond, false, emitBlockIt->specBlock, failTarget, emitBlock);
 
   }
 
@@ -1234,7 +1465,8 @@ uint32_t IntegrationAttempt::collectSpecIncomingEdges(uint32_t blockIdx, uint32_
   // OR if the NEXT instruction requires a special check.
   if(edges.size() == oldEdgesSize) {
 
-    if(requiresRuntimeCheck(ShadowValue(SI), false) || SI->needsRuntimeCheck == RUNTIME_CHECK_READ_MEMCMP)
+    if((requiresRuntimeCheck(ShadowValue(SI), false) && !checkCoalescesWithPrev(BB, instIdx)) || 
+       SI->needsRuntimeCheck == RUNTIME_CHECK_READ_MEMCMP)
       edges.push_back(std::make_pair(BB->getCommittedBreakBlockAt(instIdx), this));
 
   }
@@ -1301,7 +1533,7 @@ Value* IntegrationAttempt::getSpecValueAnyType(uint32_t blockIdx, uint32_t instI
     // and unspec incoming paths.
 
     ShadowInstruction* specI = getInst(blockIdx, instIdx);
-    if((!specI) || !specI->committedVal)
+    if((!specI) || !specI->getCommittedVal())
       return 0;
     else {
 
@@ -1562,6 +1794,88 @@ static PHINode* insertMergePHI(ShadowInstructionInvar& SI, SmallVector<std::pair
 
 }
 
+// Flags for getFailedMergeKind.
+#define FAILMERGE_KNOWN 1
+#define FAILMERGE_PATHCONDS 2 /* (b) path condition breaks to the top of the block */
+#define FAILMERGE_SPECTOUNSPEC 4 /* (a) unspec->spec edges due to ignored blocks */
+#define FAILMERGE_OTHER 8 /* (c) invoke breaks or (d) checked VFS instructions at the top */
+#define FAILMERGE_LOOPKNOWN 16
+#define FAILMERGE_LOOPBREAKS 32 /* Loop headers only: the loop has breaks; see failedLoopHasBreaks */
+
+// Find the reasons, independent of the value being forwarded, that failed-path forwarding must create
+// a merge at the top of block BBIdx. These are the same for every value createForwardingPHIs
+// forwards through the block, so are found once and kept until finishFailedBlockCommit.
+uint8_t InlineAttempt::getFailedMergeKind(uint32_t BBIdx) {
+
+  uint8_t& Kind = (*failedMergeKinds)[BBIdx];
+  if(Kind & FAILMERGE_KNOWN)
+    return Kind;
+
+  Kind |= FAILMERGE_KNOWN;
+  ShadowBBInvar* BBI = getBBInvar(BBIdx);
+
+  if(pass->countPathConditionsAtBlockStart(BBI, this, true))
+    Kind |= FAILMERGE_PATHCONDS;
+  if(isSimpleMergeBlock(BBIdx))
+    Kind |= FAILMERGE_SPECTOUNSPEC;
+
+  if(hasTopOfBlockVFSChecks(BBIdx))
+    Kind |= FAILMERGE_OTHER;
+
+  for(uint32_t j = 0, jlim = BBI->predIdxs.size(); j != jlim && !(Kind & FAILMERGE_OTHER); ++j) {
+
+    if(hasInvokeBreaks(BBI->predIdxs[j], BBIdx))
+      Kind |= FAILMERGE_OTHER;
+
+  }
+
+  return Kind;
+
+}
+
+// Are there any breaks in loop LInfo's body? These can be due to instruction checks
+// or path conditions but not can't-reach-target conditions. Noted against the loop header.
+bool InlineAttempt::failedLoopHasBreaks(const ShadowLoopInvar* LInfo) {
+
+  uint8_t& Kind = (*failedMergeKinds)[LInfo->headerIdx];
+  if(Kind & FAILMERGE_LOOPKNOWN)
+    return !!(Kind & FAILMERGE_LOOPBREAKS);
+
+  bool loopHasBreaks = false;
+  for(uint32_t j = LInfo->headerIdx, jlim = LInfo->latchIdx + 1; j != jlim && !loopHasBreaks; ++j) {
+
+    ShadowBBInvar* jbbi = getBBInvar(j);
+
+    // Block is broken into pieces due to a mid-block check?
+    if(failedBlocks[j].size() > 1)
+      loopHasBreaks = true;
+
+    // Will there be incoming edges from specialised code due to path conditions?
+    else if(pass->countPathConditionsAtBlockStart(jbbi, this, true))
+      loopHasBreaks = true;
+
+    // Do invoke instructions within the loop cause break edges on an existing block boundary?
+    else if(isa<InvokeInst>(jbbi->BB->getTerminator())) {
+
+      if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[0])->naturalScope) &&
+	 hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[0]))
+	loopHasBreaks = true;
+      else if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[1])->naturalScope) &&
+	      hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[1]))
+	loopHasBreaks = true;
+
+    }
+
+    else if(hasTopOfBlockVFSChecks(jbbi->idx))
+      loopHasBreaks = true;
+
+  }
+
+  (*failedMergeKinds)[LInfo->headerIdx] |= (FAILMERGE_LOOPKNOWN | (loopHasBreaks ? FAILMERGE_LOOPBREAKS : 0));
+  return loopHasBreaks;
+
+}
+
 void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruction* NewI) {
 
   // OrigSI is an instruction in the function being specialised; NewI is its failed clone.
@@ -1573,16 +1887,20 @@ void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruc
   // We should start merging from the block after wherever NewI is defined, and use NewI rather than anything 
   // directly derived from OrigSI when forwarding.
 
-  std::vector<std::pair<Instruction*, uint32_t> > predBlocks(1, std::make_pair(NewI, OrigSI.idx));
+  // The per-block vector is the function's scratch, kept between calls to save reallocating it.
+  std::vector<std::pair<Instruction*, uint32_t> >& predBlocks = forwardPredBlocks;
+  predBlocks.clear();
+  predBlocks.push_back(std::make_pair(NewI, OrigSI.idx));
 
   // 1. Find the predecessor blocks for each user, setting the vector cell for each (original program)
   // block that reaches a user to ULONG_MAX.
 
-  for(uint32_t i = 0, ilim = OrigSI.userIdxs.size(); i != ilim; ++i) {
+  ImmutableArray<ShadowInstIdx>& OrigUsers = getUserIdxs(&OrigSI);
+  for(uint32_t i = 0, ilim = OrigUsers.size(); i != ilim; ++i) {
 
-    ShadowBBInvar* UseBBI = getBBInvar(OrigSI.userIdxs[i].blockIdx);
+    ShadowBBInvar* UseBBI = getBBInvar(OrigUsers[i].blockIdx);
     // If the user is a PHI node then it effectively uses in the predecessor it draws from.
-    ShadowInstructionInvar& UseSI = UseBBI->insts[OrigSI.userIdxs[i].instIdx];
+    ShadowInstructionInvar& UseSI = UseBBI->insts[OrigUsers[i].instIdx];
     if(isa<PHINode>(UseSI.I)) {
 
       for(uint32_t j = 0, jlim = UseSI.operandIdxs.size(); j != jlim; ++j) {
@@ -1599,7 +1917,7 @@ void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruc
     }
     else {
 
-      markBBAndPreds(UseBBI, OrigSI.userIdxs[i].instIdx, predBlocks, OrigSI.parent);
+      markBBAndPreds(UseBBI, OrigUsers[i].instIdx, predBlocks, OrigSI.parent);
 
     }
 
@@ -1655,38 +1973,7 @@ void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruc
 	  release_assert(OrigSI.parent->idx <= LInfo->preheaderIdx);
 	  release_assert(OrigSI.parent->idx + predBlocks.size() >= LInfo->latchIdx);
 
-	  // Are there any breaks in the loop body? These can be due to instruction checks
-	  // or path conditions but not can't-reach-target conditions.
-
-	  bool loopHasBreaks = false;
-	  for(uint32_t j = LInfo->headerIdx, jlim = LInfo->latchIdx + 1; j != jlim && !loopHasBreaks; ++j) {
-
-	    ShadowBBInvar* jbbi = getBBInvar(j);
-
-	    // Block is broken into pieces due to a mid-block check?
-	    if(failedBlocks[j].size() > 1)
-	      loopHasBreaks = true;
-
-	    // Will there be incoming edges from specialised code due to path conditions?
-	    else if(pass->countPathConditionsAtBlockStart(jbbi, this))
-	      loopHasBreaks = true;
-
-	    // Do invoke instructions within the loop cause break edges on an existing block boundary?
-	    else if(isa<InvokeInst>(jbbi->BB->getTerminator())) {
-
-	      if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[0])->naturalScope) &&
-		 hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[0]))
-		loopHasBreaks = true;
-	      else if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[1])->naturalScope) &&
-		      hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[1]))
-		loopHasBreaks = true;
-
-	    }
-
-	    else if(hasTopOfBlockVFSChecks(jbbi->idx))
-	      loopHasBreaks = true;
-
-	  }
+	  bool loopHasBreaks = failedLoopHasBreaks(LInfo);
 
 	  Instruction* PreheaderInst = predBlocks[LInfo->preheaderIdx - OrigSI.parent->idx].first;
 
@@ -1760,30 +2047,13 @@ void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruc
 
       BasicBlock* insertBlock = failedBlocks[thisBlockIdx].front().first;
 
-      // Cases (a) and (b).
-
-      uint32_t nCondsHere = pass->countPathConditionsAtBlockStart(thisBBI, this);
-      bool isSpecToUnspec = isSimpleMergeBlock(thisBlockIdx);
-
-      bool shouldMergeHere = nCondsHere != 0 || isSpecToUnspec || headerPred.first != 0;
-
-      // Case (d): failing VFS instructions exist that will target the start of this block.
-      if((!shouldMergeHere) && hasTopOfBlockVFSChecks(thisBBI->idx))
-	shouldMergeHere = true;
-
-      if(!shouldMergeHere) {
-
-	// Case (c): invoke breaks, either due to checked invoke instruction
-	// or due to exceptional control flow that leads here.
-      
-	for(uint32_t j = 0, jlim = thisBBI->predIdxs.size(); j != jlim && !shouldMergeHere; ++j) {
+      // Cases (a) to (d) don't depend on the value.
 
-	  if(hasInvokeBreaks(thisBBI->predIdxs[j], thisBBI->idx))
-	    shouldMergeHere = true;
+      uint8_t mergeKind = getFailedMergeKind(thisBlockIdx);
+      bool condsHere = !!(mergeKind & FAILMERGE_PATHCONDS);
+      bool isSpecToUnspec = !!(mergeKind & FAILMERGE_SPECTOUNSPEC);
 
-	}
-
-      }
+      bool shouldMergeHere = (mergeKind & (FAILMERGE_PATHCONDS | FAILMERGE_SPECTOUNSPEC | FAILMERGE_OTHER)) || headerPred.first != 0;
 
       if(!shouldMergeHere) {
 
@@ -1829,7 +2099,7 @@ void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruc
 
 	}
 
-	if(nCondsHere) {
+	if(condsHere) {
 
 	  // Adds to specPreds for each loop iteration that can break here:
 	  gatherPathConditionEdges(thisBlockIdx, 0, 0, &specPreds);
@@ -2121,6 +2391,61 @@ void InlineAttempt::commitSimpleFailedBlock(uint32_t i) {
 
 }
 
+// With -llpe-coalesce-checks, a run of adjacent checked loads within a block instance shares one
+// combined check and failure edge, emitted after the last load. Failure resumes unspecialised
+// code after the first load of the run, repeating the rest, which is safe as loads have no side-effects.
+// Only the first load in a run is a split point or has a spec-to-unspec edge of its own.
+static bool isCoalescibleCheck(ShadowInstruction* SI) {
+
+  return inst_is<LoadInst>(SI) && requiresRuntimeCheck(ShadowValue(SI), false);
+
+}
+
+bool llvm::checkCoalescesWithNext(ShadowBB* BB, uint32_t idx) {
+
+  if(!GlobalIHP->coalesceChecks)
+    return false;
+
+  return idx + 1 < BB->insts.size() && isCoalescibleCheck(&BB->insts[idx]) && isCoalescibleCheck(&BB->insts[idx + 1]);
+
+}
+
+bool llvm::checkCoalescesWithPrev(ShadowBB* BB, uint32_t idx) {
+
+  return idx != 0 && checkCoalescesWithNext(BB, idx - 1);
+
+}
+
+// Likewise a run of lliowd-checked reads and stats within a block instance can share the first one's
+// lliowd_ok call: the later ones are demoted to unchecked, so that they make neither a split point nor
+// a failure edge of their own, and a failed check resumes unspecialised code before the first, which
+// then repeats every operation in the run for real. A run is broken by any other call, which might
+// yield or touch the files, and by any other check, which resumes unspecialised code mid-run.
+void llvm::coalesceVFSChecks(ShadowBB* BB) {
+
+  if(!GlobalIHP->coalesceChecks || GlobalIHP->omitChecks)
+    return;
+
+  bool inRun = false;
+  
+  for(uint32_t i = 0, ilim = BB->insts.size(); i != ilim; ++i) {
+
+    ShadowInstruction* SI = &BB->insts[i];
+
+    if(SI->needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD) {
+
+      if(inRun)
+	SI->needsRuntimeCheck = RUNTIME_CHECK_NONE;
+      inRun = true;
+
+    }
+    else if(inst_is<CallInst>(SI) || inst_is<InvokeInst>(SI) || requiresRuntimeCheck(ShadowValue(SI), true))
+      inRun = false;
+
+  }
+
+}
+
 // Fill in bool-vector splitInsts to indicate where this block's specialised-to-unspecialised
 // edges will be inserted due to introduced checks.
 void IntegrationAttempt::getLocalSplitInsts(ShadowBB* BB, bool* splitInsts) {
@@ -2140,6 +2465,10 @@ void IntegrationAttempt::getLocalSplitInsts(ShadowBB* BB, bool* splitInsts) {
       if(i + 1 != ilim && inst_is<PHINode>(SI) && inst_is<PHINode>(&BB->insts[i+1]))
 	continue;
 
+      // Coalesced load checks fail to the point after their first member:
+      if(checkCoalescesWithPrev(BB, i))
+	continue;
+
       // Special checks require a split BEFORE the instruction:
       if(SI->needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD) {
 
@@ -2198,12 +2527,13 @@ void IntegrationAttempt::getSplitInsts(ShadowBBInvar* BBI, bool* splitInsts) {
 
 }
 
-// Straightforward basic block cloning, optionally taking a suffix of the block rather than the whole thing.
+// Straightforward basic block cloning, taking instructions [startIdx, endIdx) of the block.
 BasicBlock* IntegrationAttempt::CloneBasicBlockFrom(const BasicBlock* BB,
 						    ValueToValueMapTy& VMap,
 						    const Twine &NameSuffix, 
 						    Function* F,
-						    uint32_t startIdx) {
+						    uint32_t startIdx,
+						    uint32_t endIdx) {
 
   BasicBlock *NewBB = createBasicBlock(BB->getContext(), "", F, false, /* isfailedblock= */ true);
   if (VerboseNames && BB->hasName()) NewBB->setName(BB->getName()+NameSuffix);
@@ -2212,10 +2542,11 @@ BasicBlock* IntegrationAttempt::CloneBasicBlockFrom(const BasicBlock* BB,
   BasicBlock::const_iterator II = BB->begin();
   std::advance(II, startIdx);
 
-  for (BasicBlock::const_iterator IE = BB->end(); II != IE; ++II) {
+  for (uint32_t i = startIdx; i != endIdx; ++II, ++i) {
     Instruction *NewInst = II->clone();
-    if (II->hasName())
+    if (VerboseNames && II->hasName())
       NewInst->setName(II->getName()+NameSuffix);
+    setCommittedDebugLoc(NewInst);
     NewBB->getInstList().push_back(NewInst);
     VMap[&*II] = NewInst;
     
@@ -2242,62 +2573,55 @@ void InlineAttempt::createFailedBlock(uint32_t idx) {
   uint32_t createFailedBlockFrom = it->second;
 
   ShadowBBInvar* BBI = getBBInvar(idx);
-  BasicBlock* NewBB = CloneBasicBlockFrom(BBI->BB, *failedBlockMap, "", CommitF, createFailedBlockFrom);
-
-  if(VerboseNames) {
-
-    std::string newName;
-    {
-      raw_string_ostream RSO(newName);
-      RSO << getCommittedBlockPrefix() << BBI->BB->getName() << " (failed)";
-    }
+  uint32_t nInsts = BBI->insts.size();
 
-    NewBB->setName(newName);
-
-  }
-
-  failedBlocks[idx].push_back(std::make_pair(NewBB, createFailedBlockFrom));
-  (*failedBlockMap)[BBI->BB] = NewBB;
-
-  bool splitInsts[BBI->insts.size()];
-  memset(splitInsts, 0, sizeof(bool) * BBI->insts.size());
+  bool splitInsts[nInsts];
+  memset(splitInsts, 0, sizeof(bool) * nInsts);
   getSplitInsts(BBI, splitInsts);
 
-  release_assert((!splitInsts[BBI->insts.size() - 1]) && "Can't split after terminator");
+  release_assert((!splitInsts[nInsts - 1]) && "Can't split after terminator");
 
-  uint32_t instsSinceLastSplit = 0;
-  for(uint32_t i = 0, ilim = BBI->insts.size(); i != ilim; ++i) {
+  // Find where each sub-block starts first, then clone each range of instructions straight into
+  // its own block. Cloning the whole block and splitting it afterwards would move the rest of the
+  // block at every split, which is quadratic in the number of checks made in the block.
+  SmallVector<uint32_t, 4> subBlockStarts;
+  subBlockStarts.push_back(createFailedBlockFrom);
+  for(uint32_t i = 0; i != nInsts; ++i) {
 
-    if(splitInsts[i]) {
+    // No need to split before the first sub-block.
+    if(splitInsts[i] && i + 1 > createFailedBlockFrom)
+      subBlockStarts.push_back(i + 1);
 
-      // No need to split (first sub-block?)
-      if(i + 1 == createFailedBlockFrom)
-	continue;
+  }
 
-      BasicBlock* toSplit = failedBlocks[idx].back().first;
-      uint32_t instsToSplit = std::min((i+1) - createFailedBlockFrom, instsSinceLastSplit + 1);
-      BasicBlock::iterator splitIterator = toSplit->begin();
-      std::advance(splitIterator, instsToSplit);
+  BasicBlock* prevBB = 0;
+  for(uint32_t i = 0, ilim = subBlockStarts.size(); i != ilim; ++i) {
 
-      std::string SplitName;
-      if(VerboseNames)
-	SplitName = (toSplit->getName() + ".checksplit").str();
+    uint32_t endIdx = i + 1 == ilim ? nInsts : subBlockStarts[i + 1];
+    BasicBlock* NewBB = CloneBasicBlockFrom(BBI->BB, *failedBlockMap, "", CommitF, subBlockStarts[i], endIdx);
 
-      BasicBlock* splitBlock = 
-	toSplit->splitBasicBlock(splitIterator, SplitName);
-      failedBlocks[idx].push_back(std::make_pair(splitBlock, i + 1));
+    if(VerboseNames) {
 
-      if(!CommitF)
-	CommitFailedBlocks.push_back(splitBlock);
+      std::string newName;
+      if(!prevBB) {
+	raw_string_ostream RSO(newName);
+	RSO << getCommittedBlockPrefix() << BBI->BB->getName() << " (failed)";
+      }
+      else {
+	newName = (prevBB->getName() + ".checksplit").str();
+      }
 
-      instsSinceLastSplit = 0;
+      NewBB->setName(newName);
 
     }
-    else {
-      
-      ++instsSinceLastSplit;
 
-    }
+    if(prevBB)
+      BranchInst::Create(NewBB, prevBB);
+    else
+      (*failedBlockMap)[BBI->BB] = NewBB;
+
+    failedBlocks[idx].push_back(std::make_pair(NewBB, subBlockStarts[i]));
+    prevBB = NewBB;
 
   }
 
@@ -2652,6 +2976,96 @@ void InlineAttempt::populateFailedBlock(uint32_t idx) {
   
 }
 
+// Aggregate checks at least this big are made with memcmp rather than element by element.
+static const uint64_t minMemcmpCheckBytes = 32;
+
+// Is every byte of a T in memory part of some element? Padding would be undefined in a spilled
+// copy, so comparing it bytewise could fail spuriously.
+static bool hasNoPadding(Type* T) {
+
+  if(ArrayType* AT = dyn_cast<ArrayType>(T))
+    return hasNoPadding(AT->getElementType()) &&
+      GlobalTD->getTypeAllocSize(AT->getElementType()) == GlobalTD->getTypeStoreSize(AT->getElementType());
+
+  if(StructType* ST = dyn_cast<StructType>(T)) {
+
+    const StructLayout* SL = GlobalTD->getStructLayout(ST);
+    uint64_t End = 0;
+    for(uint32_t i = 0, ilim = ST->getNumElements(); i != ilim; ++i) {
+      Type* ElTy = ST->getElementType(i);
+      if(SL->getElementOffset(i) != End || !hasNoPadding(ElTy))
+	return false;
+      End += GlobalTD->getTypeStoreSize(ElTy);
+    }
+    return End == GlobalTD->getTypeAllocSize(ST);
+
+  }
+
+  if(T->isIntegerTy())
+    return (T->getIntegerBitWidth() % 8) == 0;
+
+  return T->isPointerTy() || T->isFloatTy() || T->isDoubleTy();
+
+}
+
+// Check aggregate realInst == CV bytewise with memcmp, against a constant global holding CV.
+// A value we've only just loaded is compared where it lies (the load itself is left alone: it may
+// be the program's committed value, or be checked again); otherwise it is stored to a stack
+// slot made for the purpose, bounded with stacksave / stackrestore as checks may sit in loops.
+Instruction* IntegrationAttempt::emitMemcmpCheck(Value* realInst, Constant* CV, BasicBlock* emitBB) {
+
+  Module* M = getGlobalModule();
+  LLVMContext& Ctx = emitBB->getContext();
+  Type* Int8Ptr = Type::getInt8PtrTy(Ctx);
+  Type* VTy = CV->getType();
+
+  GlobalVariable* CVGlobal = new GlobalVariable(*M, VTy, true, GlobalValue::InternalLinkage, CV);
+  CVGlobal->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+  Value* RealPtr;
+  CallInst* SavedStack = 0;
+  LoadInst* LI = dyn_cast<LoadInst>(realInst);
+  if(LI && (!LI->isVolatile()) && LI->getParent() == emitBB && &emitBB->back() == LI) {
+
+    RealPtr = LI->getPointerOperand();
+
+  }
+  else {
+
+    Function* StackSave = Intrinsic::getDeclaration(M, Intrinsic::stacksave);
+    SavedStack = CallInst::Create(StackSave, VerboseNames ? "savedstack" : "", emitBB);
+    AllocaInst* Slot = new AllocaInst(VTy, GlobalTD->getAllocaAddrSpace(), VerboseNames ? "checkslot" : "", emitBB);
+    new StoreInst(realInst, Slot, emitBB);
+    RealPtr = Slot;
+
+  }
+
+  if(RealPtr->getType() != Int8Ptr)
+    RealPtr = new BitCastInst(RealPtr, Int8Ptr, VerboseNames ? "checkcast" : "", emitBB);
+
+  Type* IntTy = Type::getInt32Ty(Ctx);
+  Type* Int64Ty = Type::getInt64Ty(Ctx);
+  Type* MemcmpArgTys[3] = { Int8Ptr, Int8Ptr, Int64Ty };
+  FunctionType* MemcmpType = FunctionType::get(IntTy, ArrayRef<Type*>(MemcmpArgTys, 3), false);
+
+  Function* MemcmpFun = M->getFunction("memcmp");
+  if(!MemcmpFun)
+    MemcmpFun = cast<Function>(M->getOrInsertFunction("memcmp", MemcmpType).getCallee());
+
+  Value* MemcmpArgs[3] = { RealPtr, ConstantExpr::getBitCast(CVGlobal, Int8Ptr),
+			   ConstantInt::get(Int64Ty, GlobalTD->getTypeStoreSize(VTy)) };
+  CallInst* CmpCall = CallInst::Create(MemcmpFun, ArrayRef<Value*>(MemcmpArgs, 3), VerboseNames ? "memcmp_check" : "", emitBB);
+  CmpCall->setCallingConv(MemcmpFun->getCallingConv());
+
+  if(SavedStack) {
+    Function* StackRestore = Intrinsic::getDeclaration(M, Intrinsic::stackrestore);
+    CallInst::Create(StackRestore, SavedStack, "", emitBB);
+  }
+
+  return new ICmpInst(*emitBB, CmpInst::ICMP_EQ, CmpCall, Constant::getNullValue(IntTy), VerboseNames ? "check" : "");
+
+}
+
 // Synthesise a check that composite value realInst == CV.
 Instruction* IntegrationAttempt::emitCompositeCheck(Value* realInst, Value* CV, BasicBlock* emitBB) {
 
@@ -2670,14 +3084,16 @@ Instruction* IntegrationAttempt::emitCompositeCheck(Value* realInst, Value* CV,
 
   }
   
-  // Really I'd like to do memcmp to compare two aggregates, but they're value types
-  // and may not have addresses. In practice this path is only entered to deal with comparison
-  // against struct or array literals from the source program though, so unconditionally unrolling
-  // memcmp into value type compares is probably OK.
+  // Aggregates are value types and may not have addresses, so small ones are compared an element at
+  // a time. Large ones are compared with one memcmp against a constant copy instead, either in place
+  // if realInst was just loaded or else via a temporary stack slot.
 
   release_assert(isa<Constant>(CV));
   release_assert(realInst->getType() == CV->getType());
 
+  if(GlobalTD->getTypeStoreSize(VTy) >= minMemcmpCheckBytes && hasNoPadding(VTy))
+    return emitMemcmpCheck(realInst, cast<Constant>(CV), emitBB);
+
   CompositeType* CT = cast<CompositeType>(CV->getType());
   unsigned numElements;
   if(StructType* ST = dyn_cast<StructType>(CT))
@@ -2710,11 +3126,86 @@ Instruction* IntegrationAttempt::emitCompositeCheck(Value* realInst, Value* CV,
 
 }
 
+// Synth a check that integer realInst is one of the integers in IVS, cheaper than comparing against each.
+// A set spanning fewer than 64 values is tested against a bitmask: (mask >> (realInst - min)) & 1,
+// with an unsigned range check since the shift is only defined within range. Otherwise each run of
+// consecutive values is tested with a single unsigned compare, (realInst - lo) <= (hi - lo).
+// Returns null if IVS isn't a set of at least three integers of realInst's type.
+static Value* emitIntSetCheck(Value* realInst, const ImprovedValSetSingle* IVS, BasicBlock* emitBB) {
+
+  IntegerType* ITy = dyn_cast<IntegerType>(realInst->getType());
+  if((!ITy) || ITy->getBitWidth() > 64 || IVS->SetType != ValSetTypeScalar || IVS->Values.size() < 3)
+    return 0;
+
+  SmallVector<uint64_t, 16> Ints;
+  for(uint32_t i = 0, ilim = IVS->Values.size(); i != ilim; ++i) {
+
+    uint64_t Int;
+    if(IVS->Values[i].V.getNonPointerType() != ITy || !tryGetConstantInt(IVS->Values[i].V, Int))
+      return 0;
+    Ints.push_back(Int);
+
+  }
+
+  std::sort(Ints.begin(), Ints.end());
+  Ints.erase(std::unique(Ints.begin(), Ints.end()), Ints.end());
+
+  Type* I64 = Type::getInt64Ty(emitBB->getContext());
+  Value* Check = 0;
+
+  uint64_t Span = Ints.back() - Ints.front();
+  if(Span < 64) {
+
+    uint64_t Mask = 0;
+    for(uint32_t i = 0, ilim = Ints.size(); i != ilim; ++i)
+      Mask |= ((uint64_t)1) << (Ints[i] - Ints.front());
+
+    Value* Rel = BinaryOperator::CreateSub(realInst, ConstantInt::get(ITy, Ints.front()), VerboseNames ? "checkrel" : "", emitBB);
+    Value* InRange = new ICmpInst(*emitBB, CmpInst::ICMP_ULE, Rel, ConstantInt::get(ITy, Span), VerboseNames ? "checkrange" : "");
+    if(ITy != I64)
+      Rel = new ZExtInst(Rel, I64, "", emitBB);
+    Value* Shifted = BinaryOperator::CreateLShr(ConstantInt::get(I64, Mask), Rel, "", emitBB);
+    Value* Bit = new TruncInst(Shifted, Type::getInt1Ty(emitBB->getContext()), VerboseNames ? "checkbit" : "", emitBB);
+    return SelectInst::Create(InRange, Bit, ConstantInt::getFalse(emitBB->getContext()), VerboseNames ? "check" : "", emitBB);
+
+  }
+
+  for(uint32_t i = 0, ilim = Ints.size(); i != ilim;) {
+
+    uint32_t j = i + 1;
+    while(j != ilim && Ints[j] == Ints[j - 1] + 1)
+      ++j;
+
+    Value* newCheck;
+    if(j == i + 1) {
+      newCheck = new ICmpInst(*emitBB, CmpInst::ICMP_EQ, realInst, ConstantInt::get(ITy, Ints[i]), VerboseNames ? "check" : "");
+    }
+    else {
+      Value* Rel = BinaryOperator::CreateSub(realInst, ConstantInt::get(ITy, Ints[i]), VerboseNames ? "checkrel" : "", emitBB);
+      newCheck = new ICmpInst(*emitBB, CmpInst::ICMP_ULE, Rel, ConstantInt::get(ITy, Ints[j - 1] - Ints[i]), VerboseNames ? "checkrange" : "");
+    }
+
+    if(Check)
+      Check = BinaryOperator::CreateOr(newCheck, Check, "", emitBB);
+    else
+      Check = newCheck;
+
+    i = j;
+
+  }
+
+  return Check;
+
+}
+
 // Synth a check that realInst == IVS, or if IVS is looser than a constant value, realInst satisfies IVS.
 Value* IntegrationAttempt::emitCompareCheck(Value* realInst, const ImprovedValSetSingle* IVS, BasicBlock* emitBB) {
 
   release_assert(isa<Instruction>(realInst) && "Checked instruction must be residualised");
 
+  if(Value* IntSetCheck = emitIntSetCheck(realInst, IVS, emitBB))
+    return IntSetCheck;
+
   Value* thisCheck = 0;
   // If IVS is a set, synthesise a big-or check.
   for(uint32_t j = 0, jlim = IVS->Values.size(); j != jlim; ++j) {
@@ -2874,7 +3365,7 @@ IntegrationAttempt::emitExitPHIChecks(SmallVector<CommittedBlock, 1>::iterator e
   }
 
   release_assert(successTarget && failTarget && prevCheck);
-  BranchInst::Create(successTarget, failTarget, prevCheck, emitBB); 
+  createCheckBranch(prevCheck, false, successTarget, failTarget, emitBB);
 
   return emitIt;
 
@@ -2884,7 +3375,8 @@ IntegrationAttempt::emitExitPHIChecks(SmallVector<CommittedBlock, 1>::iterator e
 // of values. Check it actually did so at runtime.
 Value* IntegrationAttempt::emitMemcpyCheck(ShadowInstruction* SI, BasicBlock* emitBB) {
 
-  release_assert(GlobalIHP->memcpyValues.count(SI) && GlobalIHP->memcpyValues[SI].size() && "memcpyValues not set for checked copy?");
+  SmallVector<IVSRange, 4>* copyValues = getMemcpyValues(SI);
+  release_assert(copyValues && copyValues->size() && "memcpyValues not set for checked copy?");
 
   Value* prevCheck = 0;
   Value* writtenPtr = getCommittedValue(SI->getOperand(0));
@@ -2897,7 +3389,7 @@ Value* IntegrationAttempt::emitMemcpyCheck(ShadowInstruction* SI, BasicBlock* em
 
   uint64_t ptrOffset = cast<ImprovedValSetSingle>(SI->i.PB)->Values[0].Offset;
 
-  SmallVector<IVSRange, 4>& Vals = GlobalIHP->memcpyValues[SI];
+  SmallVector<IVSRange, 4>& Vals = *copyValues;
 
   for(SmallVector<IVSRange, 4>::iterator it = Vals.begin(), itend = Vals.end(); it != itend; ++it) {
 
@@ -2986,7 +3478,57 @@ IntegrationAttempt::emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterat
   }
 
   release_assert(successTarget && failTarget && Check);
-  BranchInst::Create(successTarget, failTarget, Check, emitBB);
+  createCheckBranch(Check, false, successTarget, failTarget, emitBB);
+
+  return emitIt;
+
+}
+
+// Emit a single check for the run of coalesced load checks ending at lastIdx (see checkCoalescesWithNext).
+// All of the loads share a committed block; on failure we branch to unspecialised code following
+// the first of them.
+SmallVector<CommittedBlock, 1>::iterator
+IntegrationAttempt::emitCoalescedLoadChecks(SmallVector<CommittedBlock, 1>::iterator emitIt, ShadowBB* BB, uint32_t lastIdx) {
+
+  CommittedBlock& emitCB = *(emitIt++);
+  BasicBlock* emitBB = emitCB.specBlock;
+
+  uint32_t firstIdx = lastIdx;
+  while(checkCoalescesWithPrev(BB, firstIdx))
+    --firstIdx;
+
+  Value* prevCheck = 0;
+  for(uint32_t i = firstIdx; i <= lastIdx; ++i) {
+
+    Value* thisCheck = emitAsExpectedCheck(&BB->insts[i], emitBB);
+    if(prevCheck)
+      prevCheck = BinaryOperator::CreateAnd(prevCheck, thisCheck, "", emitBB);
+    else
+      prevCheck = thisCheck;
+
+  }
+
+  BasicBlock* successTarget = emitIt->specBlock;
+  BasicBlock* failTarget = getFunctionRoot()->getSubBlockForInst(BB->invar->idx, firstIdx + 1);
+
+  if(emitCB.specBlock != emitCB.breakBlock) {
+
+    std::string msg;
+    {
+      raw_string_ostream RSO(msg);
+      RSO << "Failed checking loads " << itcache(&BB->insts[firstIdx]) << " to " << itcache(&BB->insts[lastIdx]) << " in " << BB->invar->BB->getName() << " / " << SeqNumber << "\n";
+    }
+    
+    escapePercent(msg);
+    emitRuntimePrint(emitCB.breakBlock, msg, 0);
+
+    BranchInst::Create(failTarget, emitCB.breakBlock);
+    failTarget = emitCB.breakBlock;
+    
+  }
+
+  release_assert(successTarget && failTarget && prevCheck);
+  createCheckBranch(prevCheck, false, successTarget, failTarget, emitBB);
 
   return emitIt;
 
@@ -3010,11 +3552,7 @@ void llvm::escapePercent(std::string& msg) {
 
 }
 
-// Emit a 'printf' call for debugging when specialisations are entered and exited.
-void llvm::emitRuntimePrint(BasicBlock* emitBB, std::string& message, Value* param, Instruction* insertBefore) {
-
-  Type* CharPtr = Type::getInt8PtrTy(emitBB->getContext());
-  Module* M = getGlobalModule();
+static Constant* getPrintf(LLVMContext& Ctx, Module* M) {
 
   static Constant* Printf = 0;
   if(!Printf) {
@@ -3024,21 +3562,125 @@ void llvm::emitRuntimePrint(BasicBlock* emitBB, std::string& message, Value* par
 
       errs() << "Warning: couldn't find a printf function for debug printing, will need to link against libc\n";
 
-      Type* Int32 = Type::getInt32Ty(emitBB->getContext());
-      FunctionType* PrintfTy = FunctionType::get(Int32, ArrayRef<Type*>(CharPtr), /*vararg=*/true);
+      Type* Int32 = Type::getInt32Ty(Ctx);
+      FunctionType* PrintfTy = FunctionType::get(Int32, ArrayRef<Type*>(Type::getInt8PtrTy(Ctx)), /*vararg=*/true);
 
       Printf = cast<Function>(M->getOrInsertFunction("printf", PrintfTy).getCallee());
     
     }
 
   }
+
+  return Printf;
+
+}
+
+// Get the function every runtime diagnostic site calls with -llpe-runtime-report-table: it is given the site's
+// index in that table and a value, and prints just those, so that each site costs a call rather than a string
+// and a printf. It's kept out of line and cold so the checked paths stay small.
+static Function* getRuntimeReportFunction(LLVMContext& Ctx, Module* M) {
+
+  static Function* ReportF = 0;
+  if(!ReportF) {
+
+    Type* Int32 = Type::getInt32Ty(Ctx);
+    Type* Int64 = Type::getInt64Ty(Ctx);
+    Type* ArgTys[2] = { Int32, Int64 };
+    FunctionType* ReportTy = FunctionType::get(Type::getVoidTy(Ctx), ArrayRef<Type*>(ArgTys, 2), false);
+    ReportF = Function::Create(ReportTy, GlobalValue::InternalLinkage, "__llpe_runtime_report", M);
+    ReportF->addFnAttr(Attribute::NoInline);
+    ReportF->addFnAttr(Attribute::Cold);
+
+    BasicBlock* BB = BasicBlock::Create(Ctx, "", ReportF);
+    Constant* FormatArray = ConstantDataArray::getString(Ctx, "LLPE runtime report %u: %lld\n", true);
+    GlobalVariable* FormatGlobal = new GlobalVariable(*M, FormatArray->getType(), true,
+						      GlobalValue::InternalLinkage, FormatArray);
+    FormatGlobal->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    
+    Function::arg_iterator AI = ReportF->arg_begin();
+    Value* Args[3];
+    Args[0] = ConstantExpr::getBitCast(FormatGlobal, Type::getInt8PtrTy(Ctx));
+    Args[1] = &*(AI++);
+    Args[2] = &*AI;
+    CallInst::Create(getPrintf(Ctx, M), ArrayRef<Value*>(Args, 3), "", BB);
+    ReturnInst::Create(Ctx, BB);
+
+  }
+
+  return ReportF;
+
+}
+
+// Weights for a check's outcome: failing means leaving specialised code for good, so it should be rare,
+// and layout, register allocation and any hot/cold splitting should favour the passing edge.
+static const uint32_t checkPassWeight = 2000;
+static const uint32_t checkFailWeight = 1;
+
+// Branch on runtime check Cond, which means failure if failIfTrue is set, marking the edge to failTarget unlikely.
+BranchInst* llvm::createCheckBranch(Value* Cond, bool failIfTrue, BasicBlock* passTarget, BasicBlock* failTarget, BasicBlock* emitBB) {
+
+  MDBuilder MDB(emitBB->getContext());
+  BranchInst* BI;
+
+  if(failIfTrue) {
+    BI = BranchInst::Create(failTarget, passTarget, Cond, emitBB);
+    BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(checkFailWeight, checkPassWeight));
+  }
+  else {
+    BI = BranchInst::Create(passTarget, failTarget, Cond, emitBB);
+    BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(checkPassWeight, checkFailWeight));
+  }
+
+  return BI;
+
+}
+
+// Emit a 'printf' call for debugging when specialisations are entered and exited.
+// With -llpe-runtime-report-table, the message goes in the table instead, and the site reports its index.
+void llvm::emitRuntimePrint(BasicBlock* emitBB, std::string& message, Value* param, Instruction* insertBefore) {
+
+  LLVMContext& Ctx = emitBB->getContext();
+  Type* CharPtr = Type::getInt8PtrTy(Ctx);
+  Module* M = getGlobalModule();
+
+  if(!GlobalIHP->runtimeReportTable.empty()) {
+
+    Type* Int64 = Type::getInt64Ty(Ctx);
+    Value* args[2];
+    args[0] = ConstantInt::get(Type::getInt32Ty(Ctx), GlobalIHP->runtimeReports.size());
+    GlobalIHP->runtimeReports.push_back(message);
+
+    args[1] = ConstantInt::get(Int64, 0);
+
+    Function* ReportF = getRuntimeReportFunction(Ctx, M);
+    CallInst* ReportCall;
+    if(insertBefore)
+      ReportCall = CallInst::Create(ReportF, ArrayRef<Value*>(args, 2), "", insertBefore);
+    else
+      ReportCall = CallInst::Create(ReportF, ArrayRef<Value*>(args, 2), "", emitBB);
+
+    if(param) {
+      Value* Widened;
+      if(param->getType()->isPointerTy())
+	Widened = new PtrToIntInst(param, Int64, "", ReportCall);
+      else
+	Widened = CastInst::CreateIntegerCast(param, Int64, /* isSigned = */ true, "", ReportCall);
+      ReportCall->setArgOperand(1, Widened);
+    }
+
+    return;
+
+  }
+
+  Constant* Printf = getPrintf(Ctx, M);
     
   uint32_t nParams = param ? 2 : 1;
   Value* args[nParams];
 
-  Constant* messageArray = ConstantDataArray::getString(emitBB->getContext(), message, true);
+  Constant* messageArray = ConstantDataArray::getString(Ctx, message, true);
   GlobalVariable* messageGlobal = new GlobalVariable(*M, messageArray->getType(), true,
 						     GlobalValue::InternalLinkage, messageArray);
+  messageGlobal->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
   Constant* castMessage = ConstantExpr::getBitCast(messageGlobal, CharPtr);
 
   
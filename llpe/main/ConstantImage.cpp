@@ -0,0 +1,187 @@
+//===-- ConstantImage.cpp -------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Analysis/LLPE.h"
+#include "llvm/Analysis/LLPECopyPaste.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+
+#include <algorithm>
+#include <string.h>
+
+#define DEBUG_TYPE "llpe-misc"
+
+using namespace llvm;
+
+// Flattened byte images of large constant aggregates, typically the initialisers of read-only tables.
+// Reading a sub-range of a nested ConstantArray or ConstantStruct otherwise walks the aggregate
+// from the top every time; with an image, the plain data in the range is a direct indexed read.
+// Anything that can't be expressed as bytes (pointers, constant expressions, undef) is listed
+// in a side table of relocations, each read by the usual means from the leaf constant it came from.
+// Images are built the first time a constant is read and kept for the lifetime of the pass.
+
+// Aggregates smaller than this are cheap enough to walk.
+static const uint64_t MinConstantImageSize = 256;
+// ...and bigger than this aren't worth the memory.
+static const uint64_t MaxConstantImageSize = 64 * 1024 * 1024;
+
+namespace llvm {
+
+struct ConstantImageReloc {
+
+  uint64_t Offset;
+  uint64_t Size;
+  Constant* C;
+
+ConstantImageReloc(uint64_t O, uint64_t S, Constant* _C) : Offset(O), Size(S), C(_C) {}
+
+};
+
+// Orders relocations by their end, to find the first one ending after a given offset.
+struct RelocEndsBefore {
+
+  bool operator()(uint64_t Offset, const ConstantImageReloc& R) const {
+    return Offset < R.Offset + R.Size;
+  }
+
+};
+
+struct ConstantImage {
+
+  std::vector<uint8_t> Bytes;
+  // Sorted by offset, non-overlapping.
+  std::vector<ConstantImageReloc> Relocs;
+
+};
+
+}
+
+// Write C, which lives at Offset within Img, into the image.
+static void flattenConstant(Constant* C, uint64_t Offset, ConstantImage* Img) {
+
+  uint64_t Size = GlobalTD->getTypeStoreSize(C->getType());
+
+  if(isa<ConstantAggregateZero>(C) || Size == 0)
+    return;
+
+  if(ConstantArray* CA = dyn_cast<ConstantArray>(C)) {
+
+    uint64_t ESize = GlobalTD->getTypeAllocSize(CA->getType()->getElementType());
+    for(uint32_t i = 0, ilim = CA->getNumOperands(); i != ilim; ++i)
+      flattenConstant(CA->getOperand(i), Offset + (i * ESize), Img);
+    return;
+
+  }
+
+  if(ConstantStruct* CS = dyn_cast<ConstantStruct>(C)) {
+
+    const StructLayout* SL = GlobalTD->getStructLayout(CS->getType());
+    for(uint32_t i = 0, ilim = CS->getNumOperands(); i != ilim; ++i)
+      flattenConstant(CS->getOperand(i), Offset + SL->getElementOffset(i), Img);
+    return;
+
+  }
+
+  bool isData = isa<ConstantDataSequential>(C) || isa<ConstantInt>(C) || isa<ConstantFP>(C);
+  if((!isData) || !XXXReadDataFromGlobal(C, 0, &Img->Bytes[Offset], Size, *GlobalTD))
+    Img->Relocs.push_back(ConstantImageReloc(Offset, Size, C));
+
+}
+
+// Get C's image, building it if need be. Returns null if C shouldn't have one.
+static ConstantImage* getConstantImage(Constant* C) {
+
+  if(!(isa<ConstantArray>(C) || isa<ConstantStruct>(C)))
+    return 0;
+
+  DenseMap<Constant*, ConstantImage*>::iterator findit = GlobalIHP->constantImages.find(C);
+  if(findit != GlobalIHP->constantImages.end())
+    return findit->second;
+
+  uint64_t Size = GlobalTD->getTypeStoreSize(C->getType());
+  if(Size < MinConstantImageSize)
+    return 0;
+
+  ConstantImage* Img = 0;
+  if(Size <= MaxConstantImageSize) {
+
+    Img = new ConstantImage();
+    Img->Bytes.resize(Size);
+    flattenConstant(C, 0, Img);
+    ++GlobalIHP->stats.constantImages;
+
+  }
+
+  GlobalIHP->constantImages[C] = Img;
+  return Img;
+
+}
+
+// Record Img[Offset:Offset+Size], which holds no relocations, as a constant extent.
+static void addImageBytes(ConstantImage* Img, uint64_t Offset, uint64_t Size, int64_t OffsetAbove, LLVMContext& Ctx, SmallVector<IVSRange, 4>& Dest) {
+
+  Constant* SubC;
+  if(Size <= 8) {
+
+    // constFromBytes reads whole words.
+    uint64_t Word = 0;
+    memcpy(&Word, &Img->Bytes[Offset], Size);
+    SubC = constFromBytes((unsigned char*)&Word, Type::getIntNTy(Ctx, Size * 8), GlobalTD);
+
+  }
+  else {
+
+    SubC = ConstantDataArray::get(Ctx, ArrayRef<uint8_t>(&Img->Bytes[Offset], Size));
+
+  }
+
+  std::pair<ValSetType, ImprovedVal> V = getValPB(SubC);
+  Dest.push_back(std::make_pair(std::make_pair(Offset + OffsetAbove, Offset + Size + OffsetAbove), ImprovedValSetSingle(V.second, V.first)));
+
+}
+
+// As getConstSubVals, for an in-bounds read of C[Offset:Offset+Size]. Returns false if C has no image,
+// in which case the caller should read it the usual way.
+bool llvm::readConstantImage(Constant* C, uint64_t Offset, uint64_t Size, int64_t OffsetAbove, SmallVector<IVSRange, 4>& Dest) {
+
+  ConstantImage* Img = getConstantImage(C);
+  if(!Img)
+    return false;
+
+  ++GlobalIHP->stats.constantImageReads;
+
+  uint64_t End = Offset + Size;
+  std::vector<ConstantImageReloc>::iterator it =
+    std::upper_bound(Img->Relocs.begin(), Img->Relocs.end(), Offset, RelocEndsBefore());
+
+  while(Offset != End) {
+
+    if(it != Img->Relocs.end() && it->Offset <= Offset) {
+
+      uint64_t PieceEnd = std::min(End, it->Offset + it->Size);
+      getConstSubVals(ShadowValue(it->C), Offset - it->Offset, PieceEnd - Offset, OffsetAbove + it->Offset, Dest);
+      Offset = PieceEnd;
+      ++it;
+
+    }
+    else {
+
+      uint64_t PieceEnd = (it == Img->Relocs.end()) ? End : std::min(End, it->Offset);
+      addImageBytes(Img, Offset, PieceEnd - Offset, OffsetAbove, C->getContext(), Dest);
+      Offset = PieceEnd;
+
+    }
+
+  }
+
+  return true;
+
+}
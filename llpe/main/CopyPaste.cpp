@@ -15,6 +15,8 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/DataLayout.h"
 
+#include <string.h>
+
 using namespace llvm;
 
 // Functions copy-and-pasted from LLVM main source, marginally preferred to trying to patch the source to export from version to version.
@@ -22,6 +24,13 @@ using namespace llvm;
 
 // Only needed to support ReadDataFromGlobal
 
+static bool hostIsLittleEndian() {
+
+  uint16_t Probe = 1;
+  return *((uint8_t*)&Probe) == 1;
+
+}
+
 /// FoldBitCast - Constant fold bitcast, symbolically evaluating it with
 /// DataLayout.  This always returns a non-null constant, but it may be a
 /// ConstantExpr if unfoldable.
@@ -277,6 +286,19 @@ bool llvm::XXXReadDataFromGlobal(Constant *C, uint64_t ByteOffset,
     // not reached.
   }
 
+  // LLPE addition: when a ConstantDataSequential's raw data is laid out as the target
+  // would store it, copy it wholesale rather than making a constant per element.
+  if (ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
+    StringRef Raw = CDS->getRawDataValues();
+    if (TD.isLittleEndian() == hostIsLittleEndian() &&
+        CDS->getElementByteSize() == TD.getTypeAllocSize(CDS->getElementType())) {
+      if (ByteOffset < Raw.size())
+        memcpy(CurPtr, Raw.data() + ByteOffset,
+               std::min((uint64_t)BytesLeft, Raw.size() - ByteOffset));
+      return true;
+    }
+  }
+
   if (isa<ConstantArray>(C) || isa<ConstantVector>(C) ||
       isa<ConstantDataSequential>(C)) {
     Type *EltTy = cast<SequentialType>(C->getType())->getElementType();
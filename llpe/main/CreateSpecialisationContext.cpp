@@ -11,6 +11,9 @@
 
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Timer.h"
+
+#include <sys/resource.h>
 
 #define DEBUG_TYPE "llpe-misc"
 
@@ -139,9 +142,79 @@ bool IntegrationAttempt::shouldInlineFunction(ShadowInstruction* SI, Function* F
 
 }
 
+static long getPeakRSS() {
+
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage))
+    return 0;
+  return usage.ru_maxrss;
+
+}
+
+void InlineAttempt::startBudget() {
+
+  if(!(pass->contextTimeLimit || pass->contextMemLimit))
+    return;
+
+  budgetStartTime = TimeRecord::getCurrentTime(false).getWallTime();
+  budgetStartRSS = getPeakRSS();
+
+}
+
+// Has this context, or one of the calls that led to it, exceeded -llpe-context-time-limit or -llpe-context-mem-limit?
+// Budgets cover a context and everything expanded within it. Once a context is over budget it stays that way:
+// what it has analysed so far stands, but no further calls or loop iterations within it are expanded,
+// so its remaining calls are treated as unexpanded and its remaining loops in the general case.
+// The root context is governed by the global limits instead.
+bool IntegrationAttempt::isOverContextBudget() {
+
+  if(!(pass->contextTimeLimit || pass->contextMemLimit))
+    return false;
+
+  double now = -1;
+  long RSS = -1;
+
+  for(InlineAttempt* IA = getFunctionRoot(); IA != pass->RootIA && IA->activeCaller; 
+      IA = IA->activeCaller->parent->IA->getFunctionRoot()) {
+
+    if(IA->overBudget)
+      return true;
+    if(!IA->budgetStartTime)
+      continue;
+
+    const char* exceeded = 0;
+    if(pass->contextTimeLimit) {
+      if(now < 0)
+	now = TimeRecord::getCurrentTime(false).getWallTime();
+      if(now - IA->budgetStartTime > pass->contextTimeLimit)
+	exceeded = "time";
+    }
+    if((!exceeded) && pass->contextMemLimit) {
+      if(RSS < 0)
+	RSS = getPeakRSS();
+      if((RSS - IA->budgetStartRSS) / 1024 > (long)pass->contextMemLimit)
+	exceeded = "memory";
+    }
+
+    if(exceeded) {
+      IA->overBudget = true;
+      ++pass->stats.contextBudgetsExceeded;
+      errs() << "Context " << IA->getShortHeader() << " exceeded its " << exceeded << " budget; expanding nothing further within it\n";
+      return true;
+    }
+
+  }
+
+  return false;
+
+}
+
 // Check all the possible reasons why call instruction SI shouldn't make a specialisation context.
+// Set 'recursive' if the only reason is that it would recurse off the certain path.
+
+bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Result, bool& recursive) {
 
-bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Result) {
+  recursive = false;
 
   if(InlineAttempt* IA = getInlineAttempt(SI)) {
     Result = IA;
@@ -153,6 +226,9 @@ bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Re
   if(pass->maxContexts != 0 && pass->IAs.size() > pass->maxContexts)
     return false;
 
+  if(isOverContextBudget())
+    return false;
+
   Function* FCalled = getCalledFunction(SI);
   if(!FCalled) {
     LPDEBUG("Ignored " << itcache(SI) << " because it's an uncertain indirect call\n");
@@ -164,11 +240,6 @@ bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Re
     return false;
   }
 
-  if(!shouldInlineFunction(SI, FCalled)) {
-    LPDEBUG("Ignored " << itcache(SI) << " because it shouldn't be inlined (not on certain path, and would cause recursion)\n");
-    return false;
-  }
-
   if(pass->yieldFunctions.count(FCalled))
     return false;
 
@@ -183,6 +254,12 @@ bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Re
     return false;
   }
 
+  if(!shouldInlineFunction(SI, FCalled)) {
+    LPDEBUG("Ignored " << itcache(SI) << " because it shouldn't be inlined (not on certain path, and would cause recursion)\n");
+    recursive = true;
+    return false;
+  }
+
   return true;
 
 }
@@ -213,15 +290,32 @@ InlineAttempt* IntegrationAttempt::getOrCreateInlineAttempt(ShadowInstruction* S
   created = false;
   
   InlineAttempt* Result;
-  if(!callCanExpand(SI, Result))
+  bool recursive;
+  if(!callCanExpand(SI, Result, recursive)) {
+
+    // Tabling: a recursive call that mustn't be analysed afresh can still use a finished analysis
+    // of an identical call (same arguments and relevant store contents), so the context tree grows
+    // with the number of distinct call shapes rather than the depth of recursion. Contexts still on
+    // the stack, including the callee's own ancestors, never match (see findIAMatching).
+    if(recursive) {
+      if(InlineAttempt* Share = pass->findIAMatching(SI)) {
+	LLPE_LOG(LOG_SHARING) << "TABLE: " << itcache(SI) << " #" << Share->SeqNumber << " (refs: " << Share->Callers.size() << ")";
+	++pass->stats.tabledRecursiveCalls;
+	SI->setTypeSpecificData(Share);
+	needsAnalyse = false;
+	return Share;
+      }
+    }
+
     return 0;
 
+  }
+
   needsAnalyse = false;
   
   // Found existing call. Already completely up to date?
   if(Result && Result->matchesCallerEnvironment(SI)) {
-    if(pass->verboseSharing)
-      errs() << "KEEP: " << itcache(SI) << " #" << Result->SeqNumber << "\n";
+    LLPE_LOG(LOG_SHARING) << "KEEP: " << itcache(SI) << " #" << Result->SeqNumber;
     return Result;
   }
   
@@ -229,16 +323,23 @@ InlineAttempt* IntegrationAttempt::getOrCreateInlineAttempt(ShadowInstruction* S
   // Try to find an existing IA we can simply use as-is.
   if(InlineAttempt* Share = pass->findIAMatching(SI)) {
     if(Result) {
-      if(pass->verboseSharing)
-	errs() << "DROP: " << itcache(SI) << " #" << Result->SeqNumber << "\n";
+      LLPE_LOG(LOG_SHARING) << "DROP: " << itcache(SI) << " #" << Result->SeqNumber;
       Result->dropReferenceFrom(SI);
     }
-    if(pass->verboseSharing)
-      errs() << "SHARE: " << itcache(SI) << " #" << Share->SeqNumber << " (refs: " << Share->Callers.size() << ")\n";
-    SI->typeSpecificData = Share;
+    LLPE_LOG(LOG_SHARING) << "SHARE: " << itcache(SI) << " #" << Share->SeqNumber << " (refs: " << Share->Callers.size() << ")";
+    SI->setTypeSpecificData(Share);
     return Share;
   }
 
+  // A tabled recursive call that no longer matches: breaking the share would analyse the recursion
+  // afresh, which shouldInlineFunction forbids, so leave the call unexpanded instead.
+  if(Result && Result->isShared() && !shouldInlineFunction(SI, getCalledFunction(SI))) {
+    LLPE_LOG(LOG_SHARING) << "UNTABLE: " << itcache(SI) << " #" << Result->SeqNumber;
+    Result->dropReferenceFrom(SI);
+    SI->setTypeSpecificData(0);
+    return 0;
+  }
+
   needsAnalyse = true;
 
   // CoW break existing IA if necessary and analyse it.
@@ -247,9 +348,8 @@ InlineAttempt* IntegrationAttempt::getOrCreateInlineAttempt(ShadowInstruction* S
       return Result;
     else {
       InlineAttempt* Unshared = Result->getWritableCopyFrom(SI);
-      if(pass->verboseSharing)
-	errs() << "BREAK: " << itcache(SI) << " #" << Result->SeqNumber << " -> #" << Unshared->SeqNumber << "\n";
-      SI->typeSpecificData = Unshared;
+      LLPE_LOG(LOG_SHARING) << "BREAK: " << itcache(SI) << " #" << Result->SeqNumber << " -> #" << Unshared->SeqNumber;
+      SI->setTypeSpecificData(Unshared);
       created = true;
       return Unshared;
     }
@@ -269,7 +369,7 @@ InlineAttempt* IntegrationAttempt::getOrCreateInlineAttempt(ShadowInstruction* S
 
   InlineAttempt* IA = new InlineAttempt(pass, *FCalled, SI, this->nesting_depth + 1);
   IA->isModel = isModel;
-  SI->typeSpecificData = IA;
+  SI->setTypeSpecificData(IA);
 
   checkTargetStack(SI, IA);
 
@@ -288,6 +388,7 @@ void PeelIteration::checkFinalIteration() {
   if(edgeIsDead(LatchBB, HeaderBB) || pass->assumeEndsAfter(&F, getBBInvar(L->headerIdx)->BB, iterationCount)) {
 
     iterStatus = IterationStatusFinal;
+    noteCFGChange();
 
   }
 
@@ -319,6 +420,8 @@ PeelIteration* PeelAttempt::getOrCreateIteration(unsigned iter) {
 
   PeelIteration* NewIter = new PeelIteration(pass, parent, this, F, iter, nesting_depth);
   Iterations.push_back(NewIter);
+  clearDeadRisingCache();
+  parent->noteCFGChange();
     
   return NewIter;
 
@@ -390,6 +493,7 @@ PeelIteration* PeelIteration::getOrCreateNextIteration() {
   }
 
   iterStatus = IterationStatusNonFinal;
+  noteCFGChange();
   LPDEBUG("Loop known to iterate: creating next iteration\n");
   return parentPA->getOrCreateIteration(this->iterationCount + 1);
 
@@ -406,6 +510,24 @@ PeelAttempt* IntegrationAttempt::getPeelAttempt(const ShadowLoopInvar* L) {
 
 }
 
+static bool peelHeaderBefore(PeelAttempt* A, PeelAttempt* B) {
+
+  return A->L->headerIdx < B->L->headerIdx;
+
+}
+
+// List peelChildren ordered by loop header index. Walks whose order may show in the committed
+// program should use this: iterating the map goes by pointer hash, which varies from run to run.
+void IntegrationAttempt::getOrderedPeelChildren(SmallVectorImpl<PeelAttempt*>& Out) {
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it)
+    Out.push_back(it->second);
+
+  std::sort(Out.begin(), Out.end(), peelHeaderBefore);
+
+}
+
 // Find an existing loop specialisation, or else check if it's appropriate to specialise
 // this loop per-iteration as opposed to analysing the general case of the loop body.
 PeelAttempt* IntegrationAttempt::getOrCreatePeelAttempt(const ShadowLoopInvar* NewL) {
@@ -418,6 +540,9 @@ PeelAttempt* IntegrationAttempt::getOrCreatePeelAttempt(const ShadowLoopInvar* N
 
   if(pass->maxContexts != 0 && pass->IAs.size() > pass->maxContexts)
     return 0;
+
+  if(isOverContextBudget())
+    return 0;
  
   // Preheaders only have one successor (the header), so this is enough.
   
@@ -97,13 +97,17 @@ public:
 
       if(UserI->parent->IA->isResolvedVFSCall(UserI)) {
 
-	if(V == UserI->getCallArgOperand(0) && !UserI->parent->IA->VFSCallWillUseFD(UserI))
+	ReadFile* RF = UserI->parent->IA->tryGetReadFile(UserI);
+	uint32_t fdArg = RF ? RF->fdArg : 0;
+	int32_t bufArg = RF ? RF->bufArg : 1;
+
+	if(V == UserI->getCallArgOperand(fdArg) && !UserI->parent->IA->VFSCallWillUseFD(UserI))
 	  return;
 	
 	// The buffer argument isn't needed if the read call will be deleted.
 	if(UserI->parent->IA->isUnusedReadCall(UserI)) {
 
-	  if(V == UserI->getCallArgOperand(1))
+	  if(bufArg != -1 && V == UserI->getCallArgOperand(bufArg))
 	    return;
 
 	}
@@ -337,24 +341,48 @@ void PeelAttempt::visitVariant(ShadowInstructionInvar* VI, DIVisitor& Visitor) {
   if(!isTerminated())
     Visitor.notifyUsersMissed();
 
+  if(!Visitor.shouldContinue())
+    return;
+
+  // Every iteration has been through DIE by the time any invariant is considered, so
+  // the verdict can't change. Calls are excluded because they care which argument
+  // the invariant is passed as; other users are alive or not regardless of operand.
+  bool cacheable = !(isa<CallInst>(VI->I) || isa<InvokeInst>(VI->I));
+  if(cacheable) {
+
+    DenseMap<ShadowInstructionInvar*, bool>::iterator findit = DIEUserLive.find(VI);
+    if(findit != DIEUserLive.end()) {
+      if(findit->second)
+	Visitor.notifyUsersMissed();
+      return;
+    }
+
+  }
+
   // Is this a header PHI? If so, this definition-from-outside can only matter for the preheader edge.
   if(VI->parent->naturalScope == L && VI->parent->idx == L->headerIdx && isa<PHINode>(VI->I)) {
 
     Visitor.visit(Iterations[0]->getInst(VI), Iterations[0], VI->parent->idx, VI->idx);
-    return;
 
   }
+  else {
 
-  for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), itend = Iterations.end(); it != itend; ++it) {
+    for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), itend = Iterations.end(); 
+	it != itend && Visitor.shouldContinue(); ++it) {
+
+      if(VI->parent->outerScope == L) {
+	Visitor.visit((*it)->getInst(VI), *it, VI->parent->idx, VI->idx);
+      }
+      else
+	(*it)->visitVariant(VI, Visitor);
 
-    if(VI->parent->outerScope == L) {
-      Visitor.visit((*it)->getInst(VI), *it, VI->parent->idx, VI->idx);
     }
-    else
-      (*it)->visitVariant(VI, Visitor);
 
   }
 
+  if(cacheable)
+    DIEUserLive[VI] = !Visitor.shouldContinue();
+
 }
   
 // Visitor.V is defined in-loop, used out-of-loop by UserI (but we require LCSSA form,
@@ -439,10 +467,10 @@ void IntegrationAttempt::visitUsers(ShadowValue V, DIVisitor& Visitor) {
 
   ImmutableArray<ShadowInstIdx>* Users;
   if(V.isInst()) {
-    Users = &(V.getInst()->invar->userIdxs);
+    Users = &getUserIdxs(V.getInst()->invar);
   }
   else {
-    Users = &(V.getArg()->invar->userIdxs);
+    Users = &getUserIdxs(V.getArg()->IA->invarInfo, V.getArg()->invar);
   }
   
   for(uint32_t i = 0; i < Users->size() && Visitor.shouldContinue(); ++i) {
@@ -767,6 +795,11 @@ void IntegrationAttempt::runDIE() {
 
   }
 
+  // No more invariants will ask after our child loops' users.
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it)
+    it->second->DIEUserLive.clear();
+
 }
 
 // Tag allocations and file descriptors that are used indirectly (via memory)
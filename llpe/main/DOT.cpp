@@ -23,6 +23,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include <string>
 
 using namespace llvm;
@@ -65,7 +70,7 @@ std::string IntegrationAttempt::getValueColour(ShadowValue SV, std::string& text
   }
 
   if(val_is<CallInst>(SV) || val_is<InvokeInst>(SV)) {
-    if(SV.u.I->typeSpecificData)
+    if(SV.u.I->getTypeSpecificData())
       return "yellow";
     else
       return "pink";
@@ -83,66 +88,72 @@ std::string IntegrationAttempt::getValueColour(ShadowValue SV, std::string& text
 
 }
 
-// Helper: shorten str to include at most maxlen characters from the original string,
-// plus some suffix.
-static std::string TruncStr(std::string str, unsigned maxlen) {
+// Helper: write at most maxlen characters of Str, plus a suffix if any were dropped.
+static void writeTruncated(raw_ostream& Out, StringRef Str, unsigned maxlen) {
 
-  if(str.size() > maxlen) {
+  if(Str.size() > maxlen)
+    Out << Str.substr(0, maxlen) << " ...";
+  else
+    Out << Str;
 
-    str.resize(maxlen);
-    str.append(" ...");
+}
 
-  }
+// Write Str replacing special characters with HTML escapes, and doubling backslashes (DOT
+// recognises both forms of escape sequence). Truncates like writeTruncated.
+// Writes directly to Out rather than building an escaped copy, as this runs for every
+// value in every exported graph.
+static void writeEscapedHTML(raw_ostream& Out, StringRef Str, unsigned maxlen = UINT_MAX) {
 
-  return str;
+  bool truncated = Str.size() > maxlen;
+  if(truncated)
+    Str = Str.substr(0, maxlen);
 
-}
+  size_t written = 0;
+  for(size_t i = 0, ilim = Str.size(); i != ilim; ++i) {
 
-// Replace special characters with HTML escapes, and double backslashes (DOT recognises
-// both forms of escape sequence)
-static std::string escapeHTML(std::string Str) {
-
-  for (unsigned i = 0; i != Str.length(); ++i) {
+    const char* Rep;
     switch (Str[i]) {
     case '&':
-      Str.replace(i, 1, "&amp;");
-      i += 4;
+      Rep = "&amp;";
       break;
     case '\\':
-      Str.insert(Str.begin()+i, '\\');
-      ++i;
+      Rep = "\\\\";
       break;
     case '\t':
-      Str.insert(Str.begin()+i, ' ');  // Convert to two spaces
-      ++i;
-      Str[i] = ' ';
+      Rep = "  ";  // Convert to two spaces
       break;
-    case '<': 
-      Str.replace(i, 1, "&lt;");
-      i += 3;
+    case '<':
+      Rep = "&lt;";
       break;
     case '>':
-      Str.replace(i, 1, "&gt;");
-      i += 3;
+      Rep = "&gt;";
       break;
     case '"':
-      Str.replace(i, 1, "&quot;");
-      i += 5;
+      Rep = "&quot;";
       break;
+    default:
+      continue;
     }
+
+    Out << Str.slice(written, i) << Rep;
+    written = i + 1;
+
   }
 
-  return Str;
+  Out << Str.substr(written);
+
+  if(truncated)
+    Out << " ...";
 
 }
 
 // Stringify V, with abbreviation and escaping.
-static std::string escapeHTMLValue(Value* V, IntegrationAttempt* IA, bool brief=false) {
+static void writeEscapedHTMLValue(raw_ostream& Out, Value* V, IntegrationAttempt* IA, bool brief=false) {
 
-  std::string Esc;
-  raw_string_ostream RSO(Esc);
+  SmallString<256> Buf;
+  raw_svector_ostream RSO(Buf);
   IA->printWithCache(V, RSO, brief);
-  return escapeHTML(TruncStr(RSO.str(), 500));
+  writeEscapedHTML(Out, RSO.str(), 500);
 
 }
 
@@ -195,16 +206,19 @@ void IntegrationAttempt::printRHS(ShadowValue SV, raw_ostream& Out) {
     if(optit != pass->optimisticForwardStatus.end()) {
       Out << "OPT (" << optit->second << "), ";
     }
+    else if(SI->forwardFailure != FORWARD_FAIL_NONE && inst_is<LoadInst>(SI)) {
+      Out << "OPT (" << getForwardFailureName(SI->forwardFailure) << "), ";
+    }
   }
   if(inst_is<CallInst>(SI)) {
     DenseMap<ShadowInstruction*, OpenStatus*>::iterator it = pass->forwardableOpenCalls.find(SI);
     if(it != pass->forwardableOpenCalls.end()) {
-      Out << it->second->Name << "(" << (it->second->success ? "success" : "not found") << ")";
+      Out << it->second->getFilename() << "(" << (it->second->success ? "success" : "not found") << ")";
     }
     else {
       DenseMap<ShadowInstruction*, ReadFile>::iterator it = pass->resolvedReadCalls.find(SI);
       if(it != pass->resolvedReadCalls.end())
-	Out << it->second.name << " (" << it->second.incomingOffset << "-" << it->second.incomingOffset + (it->second.readSize - 1) << ")";
+	Out << it->second.getFilename() << " (" << it->second.incomingOffset << "-" << it->second.incomingOffset + (it->second.readSize - 1) << ")";
     }
   }
 
@@ -230,7 +244,9 @@ bool PeelIteration::getSpecialEdgeDescription(ShadowBBInvar* FromBB, ShadowBBInv
   }
   else if(!L->contains(ToBB->naturalScope)) {
 
-    Out << "\"Exit block " << escapeHTML(ToBB->BB->getName()) << "\"";
+    Out << "\"Exit block ";
+    writeEscapedHTML(Out, ToBB->BB->getName());
+    Out << "\"";
     return true;
 
   }
@@ -317,14 +333,11 @@ void llvm::printPathCondition(PathCondition& PC, PathConditionTypes t, ShadowBB*
   }
   else {
 
-    std::string truncd;
-
-    {
-      raw_string_ostream RSO(truncd);
-      RSO << itcache(ShadowValue(PC.u.val), true);
-    }    
+    SmallString<128> truncd;
+    raw_svector_ostream RSO(truncd);
+    RSO << itcache(ShadowValue(PC.u.val), true);
 
-    Out << TruncStr(truncd, 100);
+    writeTruncated(Out, RSO.str(), 100);
 	
   }
 
@@ -473,7 +486,8 @@ void IntegrationAttempt::describeBlockAsDOT(ShadowBBInvar* BBI, ShadowBB* BB, co
   Out << "><font point-size=\"14\">";
   if(BBI->BB == getEntryBlock())
     Out << "Entry block: ";
-  Out << escapeHTML(BBI->BB->getName()) << " </font></td></tr>\n";
+  writeEscapedHTML(Out, BBI->BB->getName());
+  Out << " </font></td></tr>\n";
 
   bool isFunctionHeader = (!L) && (BBI->BB == &(F.getEntryBlock()));
 
@@ -501,22 +515,25 @@ void IntegrationAttempt::describeBlockAsDOT(ShadowBBInvar* BBI, ShadowBB* BB, co
       Vals.push_back(ShadowValue(&(BB->insts[i])));
   }
 
+  // Reused across rows to save reallocating for each value.
+  SmallString<256> RHSBuf;
+
   for(std::vector<ShadowValue>::iterator VI = Vals.begin(), VE = Vals.end(); VI != VE; ++VI) {
 
     std::string textColour;
     Out << "<tr><td border=\"0\" align=\"left\" bgcolor=\"" << getValueColour(*VI, textColour, plain) << "\">";
     if(!textColour.empty())
       Out << "<font color=\"" << textColour << "\">";
-    Out << escapeHTMLValue(VI->getBareVal(), this);
+    writeEscapedHTMLValue(Out, VI->getBareVal(), this);
     if(!textColour.empty())
       Out << "</font>";
     Out << "</td><td>";
-    std::string RHSStr;
-    raw_string_ostream RSO(RHSStr);
-    if(!plain)
+    if(!plain) {
+      RHSBuf.clear();
+      raw_svector_ostream RSO(RHSBuf);
       printRHS(*VI, RSO);
-    RSO.flush();
-    Out << escapeHTML(TruncStr(RSO.str(), 400));
+      writeEscapedHTML(Out, RSO.str(), 400);
+    }
     Out << "</td></tr>\n";
 
   }
@@ -849,7 +866,136 @@ std::string IntegrationAttempt::getGraphPath(std::string prefix) {
 
 }
 
-void PeelAttempt::describeTreeAsDOT(std::string path) {
+// Destination for describeTreeAsDOT's hierarchy of graphs: either real directories,
+// or entries in a tar archive. Paths use '/' separators and are relative to the destination.
+struct llvm::DOTTreeWriter {
+
+  // Reused for every graph, so a large tree doesn't reallocate a buffer per context.
+  std::string Buf;
+
+  virtual ~DOTTreeWriter() {}
+  virtual void addDirectory(const std::string& path) = 0;
+  virtual void addFile(const std::string& path, StringRef contents) = 0;
+
+};
+
+namespace {
+
+  struct DOTDirectoryWriter : public DOTTreeWriter {
+
+    std::string root;
+
+    DOTDirectoryWriter(const std::string& r) : root(r) {}
+
+    void addDirectory(const std::string& path) {
+
+      std::string full = root + "/" + path;
+      mkdir(full.c_str(), 0777);
+
+    }
+
+    void addFile(const std::string& path, StringRef contents) {
+
+      std::string full = root + "/" + path;
+      std::error_code error;
+      raw_fd_ostream os(full.c_str(), error, sys::fs::F_None);
+
+      if(error) {
+
+	errs() << "Failed to open " << full << ": " << error.message() << "\n";
+	return;
+
+      }
+
+      os << contents;
+
+    }
+
+  };
+
+  // Writes a GNU-format tar, using ././@LongLink entries for paths over 99 characters
+  // (nested call_ and loop_ directories easily exceed the ustar limits).
+  struct DOTTarWriter : public DOTTreeWriter {
+
+    raw_ostream& Out;
+    uint64_t mtime;
+
+    DOTTarWriter(raw_ostream& O) : Out(O), mtime(time(0)) {}
+
+    static void writeOctal(char* field, unsigned len, uint64_t val) {
+
+      field[len - 1] = '\0';
+      for(int i = len - 2; i >= 0; --i, val >>= 3)
+	field[i] = '0' + (val & 7);
+
+    }
+
+    void pad(uint64_t size) {
+
+      static const char zeroes[512] = { 0 };
+      if(size % 512)
+	Out.write(zeroes, 512 - (size % 512));
+
+    }
+
+    void writeHeader(StringRef name, char type, uint64_t size) {
+
+      if(name.size() > 99) {
+
+	writeHeader("././@LongLink", 'L', name.size() + 1);
+	Out << name << '\0';
+	pad(name.size() + 1);
+
+      }
+
+      char H[512];
+      memset(H, 0, 512);
+      memcpy(H, name.data(), std::min(name.size(), (size_t)99));
+      writeOctal(H + 100, 8, type == '5' ? 0755 : 0644);
+      writeOctal(H + 108, 8, 0);
+      writeOctal(H + 116, 8, 0);
+      writeOctal(H + 124, 12, size);
+      writeOctal(H + 136, 12, mtime);
+      H[156] = type;
+      memcpy(H + 257, "ustar  ", 8);
+
+      // The checksum is computed with its own field filled with spaces.
+      memset(H + 148, ' ', 8);
+      unsigned sum = 0;
+      for(unsigned i = 0; i != 512; ++i)
+	sum += (unsigned char)H[i];
+      writeOctal(H + 148, 7, sum);
+
+      Out.write(H, 512);
+
+    }
+
+    void addDirectory(const std::string& path) {
+
+      writeHeader(path + "/", '5', 0);
+
+    }
+
+    void addFile(const std::string& path, StringRef contents) {
+
+      writeHeader(path, '0', contents.size());
+      Out << contents;
+      pad(contents.size());
+
+    }
+
+    void finish() {
+
+      static const char zeroes[1024] = { 0 };
+      Out.write(zeroes, 1024);
+
+    }
+
+  };
+
+}
+
+void PeelAttempt::describeTreeAsDOT(const std::string& path, DOTTreeWriter& W) {
 
   unsigned i = 0;
   for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), it2 = Iterations.end(); it != it2; ++it, ++i) {
@@ -857,37 +1003,33 @@ void PeelAttempt::describeTreeAsDOT(std::string path) {
     std::string newPath;
     raw_string_ostream RSO(newPath);
     RSO << path << "/iter_" << i;
-    mkdir(RSO.str().c_str(), 0777);
-    (*it)->describeTreeAsDOT(RSO.str());
+    RSO.flush();
+    W.addDirectory(newPath);
+    (*it)->describeTreeAsDOT(newPath, W);
 
   }
 
 }
 
-void IntegrationAttempt::describeTreeAsDOT(std::string path) {
-
-  std::string graphPath = getGraphPath(path);
-
-  std::error_code error;
-  raw_fd_ostream os(graphPath.c_str(), error, sys::fs::F_None);
-
-  if(error) {
-
-    errs() << "Failed to open " << graphPath << ": " << error.message() << "\n";
-    return;
+void IntegrationAttempt::describeTreeAsDOT(const std::string& path, DOTTreeWriter& W) {
 
+  {
+    W.Buf.clear();
+    raw_string_ostream os(W.Buf);
+    std::string ign;
+    describeAsDOT(os, ign, false);
+    os.flush();
+    W.addFile(getGraphPath(path), W.Buf);
   }
 
-  std::string ign;
-  describeAsDOT(os, ign, false);
-
   for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it) {
 
     std::string newPath;
     raw_string_ostream RSO(newPath);
     RSO << path << "/loop_" << getBBInvar(it->first->headerIdx)->BB->getName();
-    mkdir(RSO.str().c_str(), 0777);
-    it->second->describeTreeAsDOT(RSO.str());
+    RSO.flush();
+    W.addDirectory(newPath);
+    it->second->describeTreeAsDOT(newPath, W);
 
   }
 
@@ -914,8 +1056,71 @@ void IntegrationAttempt::describeTreeAsDOT(std::string path) {
       RSO << callDesc.substr(2, callDesc.find_first_of('=') - 3);
     }
 
-    mkdir(RSO.str().c_str(), 0777);
-    it->second->describeTreeAsDOT(RSO.str());
+    RSO.flush();
+    W.addDirectory(newPath);
+    it->second->describeTreeAsDOT(newPath, W);
+
+  }
+
+}
+
+static void writeGraphArchive(raw_ostream& Out, InlineAttempt* RootIA) {
+
+  DOTTarWriter W(Out);
+  W.addDirectory("graphs");
+  RootIA->describeTreeAsDOT("graphs", W);
+  W.finish();
+
+}
+
+// Write the graphs for every context, either to -llpe-graphs-dir as a directory
+// hierarchy or to -llpe-graphs-archive as a single tar (gzipped if its name ends in .gz).
+void LLPEAnalysisPass::writeGraphs() {
+
+  if(!graphOutputDir.empty()) {
+
+    mkdir(graphOutputDir.c_str(), 0777);
+    DOTDirectoryWriter W(graphOutputDir);
+    RootIA->describeTreeAsDOT(".", W);
+
+  }
+
+  if(!graphArchivePath.empty()) {
+
+    if(StringRef(graphArchivePath).endswith(".gz")) {
+
+      // Compress through an external gzip, which then runs in parallel with the export.
+      std::string command;
+      raw_string_ostream RSO(command);
+      RSO << "gzip -c > '" << graphArchivePath << "'";
+      RSO.flush();
+
+      FILE* gzipPipe = popen(command.c_str(), "w");
+      if(!gzipPipe) {
+	errs() << "Failed to run '" << command << "': " << strerror(errno) << "\n";
+	return;
+      }
+
+      {
+	raw_fd_ostream RFO(fileno(gzipPipe), /* shouldClose = */ false);
+	writeGraphArchive(RFO, RootIA);
+      }
+
+      if(pclose(gzipPipe) != 0)
+	errs() << "Warning: gzip failed writing " << graphArchivePath << "\n";
+
+    }
+    else {
+
+      std::error_code error;
+      raw_fd_ostream RFO(graphArchivePath.c_str(), error, sys::fs::F_None);
+      if(error) {
+	errs() << "Failed to open " << graphArchivePath << ": " << error.message() << "\n";
+	return;
+      }
+      writeGraphArchive(RFO, RootIA);
+
+    }
 
   }
 
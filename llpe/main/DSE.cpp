@@ -19,6 +19,7 @@
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/Local.h"
@@ -134,7 +135,8 @@ void llvm::DeleteDeadInstruction(Instruction *I) {
 	if(GlobalVariable* GV = dyn_cast_or_null<GlobalVariable>(GetUnderlyingObject(C, *GlobalTD))) {
 	  
 	  GV->removeDeadConstantUsers();
-	  if(GV->use_empty() && GV->isDiscardableIfUnused())
+	  // Bodies not yet read from a lazily loaded module may still refer to it.
+	  if(GV->use_empty() && GV->isDiscardableIfUnused() && GV->getParent()->isMaterialized())
 	    GV->eraseFromParent();
 
 	}
@@ -190,9 +192,103 @@ void TrackedStore::derefBytes(uint64_t nBytes) {
 }
 
 static DSEMapTy::Allocator DSEMapAllocator;
-static DSEMapTy DSEEmptyMap(DSEMapAllocator);
+static DSESmallMap DSEEmptyMap;
 DSEMapPointer llvm::DSEEmptyMapPtr(&DSEEmptyMap, 0);
 
+// Helpers for DSESmallMap byte bitsets.
+
+// Set Mask to bytes [Start, Stop).
+static void getByteMask(uint64_t* Mask, uint64_t Start, uint64_t Stop) {
+
+  for(uint32_t i = 0; i != DSESMALLMAPWORDS; ++i) {
+
+    uint64_t wordStart = i * 64, wordStop = wordStart + 64;
+    if(Stop <= wordStart || Start >= wordStop) {
+      Mask[i] = 0;
+      continue;
+    }
+
+    uint64_t lo = std::max(Start, wordStart) - wordStart;
+    uint64_t hi = std::min(Stop, wordStop) - wordStart;
+    uint64_t bits = (hi == 64) ? ~0ULL : ((1ULL << hi) - 1);
+    Mask[i] = bits & ~((1ULL << lo) - 1);
+
+  }
+
+}
+
+static uint64_t countBytes(const uint64_t* Bytes) {
+
+  uint64_t ret = 0;
+  for(uint32_t i = 0; i != DSESMALLMAPWORDS; ++i)
+    ret += countPopulation(Bytes[i]);
+  return ret;
+
+}
+
+// Can the write or read (Offset, Offset + Size] be represented in a small map?
+static bool fitsSmallMap(int64_t Offset, uint64_t Size) {
+
+  return Offset >= 0 && Offset < DSESMALLMAPSIZE && Size <= (uint64_t)(DSESMALLMAPSIZE - Offset);
+
+}
+
+// Drop writers that have been found needed since they were entered, as GCStores does for large maps.
+static void GCStores(DSESmallMap* S) {
+
+  uint32_t out = 0;
+  for(uint32_t i = 0, ilim = S->Entries.size(); i != ilim; ++i) {
+
+    DSESmallMapEntry& E = S->Entries[i];
+    if(!E.Store->canKill())
+      E.Store->derefBytes(countBytes(E.Bytes));
+    else
+      S->Entries[out++] = E;
+
+  }
+
+  S->Entries.resize(out);
+
+}
+
+// Convert a small map to the general interval map representation, used when a writer
+// or reader strays outside the small map's range. Byte reference counts are unchanged.
+void DSEMapPointer::promote() {
+
+  release_assert(S && !M);
+
+  M = new DSEMapTy(DSEMapAllocator);
+
+  DSEMapEntry runEntry;
+  uint64_t runStart = 0;
+
+  for(uint64_t i = 0; i <= DSESMALLMAPSIZE; ++i) {
+
+    DSEMapEntry thisEntry;
+    if(i != DSESMALLMAPSIZE) {
+      for(uint32_t j = 0, jlim = S->Entries.size(); j != jlim; ++j) {
+	if(S->Entries[j].Bytes[i / 64] & (1ULL << (i % 64)))
+	  thisEntry.push_back(S->Entries[j].Store);
+      }
+    }
+
+    if(thisEntry != runEntry) {
+
+      if(!runEntry.empty())
+	M->insert(runStart, i, runEntry);
+      runEntry = thisEntry;
+      runStart = i;
+
+    }
+
+  }
+
+  if(S != &DSEEmptyMap)
+    delete S;
+  S = 0;
+
+}
+
 DSELocalStore* DSEMapPointer::getMapForBlock(ShadowBB* BB) {
 
   return BB->dseStore;
@@ -289,6 +385,21 @@ DSEMapPointer DSEMapPointer::getReadableCopy() {
   // Take the opportunity to exclude any stores that turn out to have been needed,
   // both here and at the target (the information is of no further value).
 
+  if(S) {
+
+    GCStores(S);
+
+    DSESmallMap* newSmall = new DSESmallMap(*S);
+    for(uint32_t i = 0, ilim = newSmall->Entries.size(); i != ilim; ++i)
+      newSmall->Entries[i].Store->outstandingBytes += countBytes(newSmall->Entries[i].Bytes);
+
+    if(A)
+      ++A->nRefs;
+
+    return DSEMapPointer(newSmall, A);
+
+  }
+
   DSEMapTy* newMap = new DSEMapTy(DSEMapAllocator);
     
   for(DSEMapTy::iterator it = M->begin(), itend = M->end(); it != itend;) {
@@ -342,6 +453,21 @@ void DSEMapPointer::release() {
   // The store entries themselves are not reference counted, so drop refs to all mentioned
   // TrackedStores and delete the map.
 
+  if(S) {
+
+    for(uint32_t i = 0, ilim = S->Entries.size(); i != ilim; ++i)
+      S->Entries[i].Store->derefBytes(countBytes(S->Entries[i].Bytes));
+    S->Entries.clear();
+
+    if(A) {
+      A->dropReference();
+      A = 0;
+    }
+
+    return;
+
+  }
+
   for(DSEMapTy::iterator it = M->begin(), itend = M->end(); it != itend; ++it) {
 
     uint64_t entrySize = (it.stop() - it.start());
@@ -366,7 +492,10 @@ void DSEMapPointer::release() {
 bool DSEMapPointer::dropReference() { 
     
   release();
-  delete M;
+  if(M)
+    delete M;
+  else if(S != &DSEEmptyMap)
+    delete S;
 
   return true;
 
@@ -381,32 +510,44 @@ static void setAllNeeded(DSEMapEntry* entry) {
 }
 
 // Mark all stores concering this object alive.
-static void setAllNeeded(DSEMapTy& M) {
+static void setAllNeeded(DSEMapPointer& P) {
 
-  for(DSEMapTy::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+  if(P.S) {
 
-    const DSEMapEntry& entry = it.value();
-    // See DSEMapPointer::release for justification of the const_cast.
-    setAllNeeded(const_cast<DSEMapEntry*>(&entry));
+    for(uint32_t i = 0, ilim = P.S->Entries.size(); i != ilim; ++i)
+      P.S->Entries[i].Store->isNeeded = true;
 
   }
+  else {
 
-}
-
-// Mark all stores affecting this stack frame needed.
-static void setAllNeeded(DSELocalStore::FrameType& frame) {
+    for(DSEMapTy::iterator it = P.M->begin(), itend = P.M->end(); it != itend; ++it) {
 
-  for(std::vector<DSEMapPointer>::iterator it = frame.store.begin(), itend = frame.store.end();
-      it != itend; ++it) {
+      const DSEMapEntry& entry = it.value();
+      // See DSEMapPointer::release for justification of the const_cast.
+      setAllNeeded(const_cast<DSEMapEntry*>(&entry));
 
-    if(it->isValid()) {
-      setAllNeeded(*it->M);
-      if(it->A)
-	it->A->isNeeded = true;
     }
 
   }
 
+  if(P.A)
+    P.A->isNeeded = true;
+
+}
+
+static void setAllNeeded(DSEMapPointer* child) {
+
+  if(child && child->isValid())
+    setAllNeeded(*child);
+
+}
+
+// Mark all stores affecting this stack frame needed.
+static void setAllNeeded(DSELocalStore::FrameType& frame) {
+
+  for(uint32_t i = 0, ilim = frame.size(); i != ilim; ++i)
+    setAllNeeded(frame.getReadableSlot(i));
+
 }
 
 // Mark all stores concering this heap node alive.
@@ -414,17 +555,8 @@ static void setAllNeeded(DSELocalStore::NodeType* node, uint32_t height) {
 
   if(height == 0) {
 
-    for(uint32_t i = 0, ilim = HEAPTREEORDER; i != ilim; ++i) {
-
-      DSEMapPointer* child = (DSEMapPointer*)node->children[i];
-	
-      if(child && child->isValid()) {
-	setAllNeeded(*child->M);
-	if(child->A)
-	  child->A->isNeeded = true;
-      }
-      
-    }
+    for(uint32_t i = 0, ilim = HEAPTREEORDER; i != ilim; ++i)
+      setAllNeeded((DSEMapPointer*)node->children[i]);
 
   }
   else {
@@ -453,7 +585,14 @@ void llvm::setAllNeededTop(DSELocalStore* store) {
 
   }
 
-  if(store->heap.height)
+  if(store->heap.flat) {
+
+    for(DSELocalStore::FlatType::EntryList::iterator it = store->heap.flat->entries.begin(),
+	  itend = store->heap.flat->entries.end(); it != itend; ++it)
+      setAllNeeded((DSEMapPointer*)it->second);
+
+  }
+  else if(store->heap.height)
     setAllNeeded(store->heap.root, store->heap.height - 1);
 
 }
@@ -462,7 +601,7 @@ void llvm::setAllNeededTop(DSELocalStore* store) {
 void DSEMapPointer::mergeStores(DSEMapPointer* mergeFrom, DSEMapPointer* mergeTo, uint64_t ASize, DSEMerger* Visitor) {
 
   // Just union the two stores together. They can't be the same store.
-  release_assert(mergeFrom != mergeTo && mergeFrom->M != mergeTo->M);
+  release_assert(mergeFrom != mergeTo && mergeFrom->getMap() != mergeTo->getMap());
 
   // Merge the allocation tracking: target map should have it if it doesn't already.
   if((!mergeTo->A) && mergeFrom->A) {
@@ -472,6 +611,52 @@ void DSEMapPointer::mergeStores(DSEMapPointer* mergeFrom, DSEMapPointer* mergeTo
 
   }
 
+  if(mergeFrom->S)
+    GCStores(mergeFrom->S);
+  if(mergeTo->S)
+    GCStores(mergeTo->S);
+
+  if(mergeFrom->S && mergeFrom->S->Entries.empty())
+    return;
+
+  if(mergeFrom->S && mergeTo->S) {
+
+    // Union each writer's byte set into the target, referencing any newly-covered bytes.
+    for(uint32_t i = 0, ilim = mergeFrom->S->Entries.size(); i != ilim; ++i) {
+
+      DSESmallMapEntry& fromEntry = mergeFrom->S->Entries[i];
+      DSESmallMapEntry* toEntry = 0;
+
+      for(uint32_t j = 0, jlim = mergeTo->S->Entries.size(); j != jlim && !toEntry; ++j) {
+	if(mergeTo->S->Entries[j].Store == fromEntry.Store)
+	  toEntry = &mergeTo->S->Entries[j];
+      }
+
+      if(!toEntry) {
+	mergeTo->S->Entries.push_back(fromEntry);
+	fromEntry.Store->outstandingBytes += countBytes(fromEntry.Bytes);
+	continue;
+      }
+
+      uint64_t newBytes[DSESMALLMAPWORDS];
+      for(uint32_t j = 0; j != DSESMALLMAPWORDS; ++j) {
+	newBytes[j] = fromEntry.Bytes[j] & ~toEntry->Bytes[j];
+	toEntry->Bytes[j] |= fromEntry.Bytes[j];
+      }
+      fromEntry.Store->outstandingBytes += countBytes(newBytes);
+
+    }
+
+    return;
+
+  }
+
+  // Mixed representations: merge as interval maps.
+  if(mergeFrom->S)
+    mergeFrom->promote();
+  if(mergeTo->S)
+    mergeTo->promote();
+
   // The union should be per-byte, so insert a split in mergeTo whereever one exists in mergeFrom.
   // Take the opportunity to garbage collect: anything with isNeeded set should be omitted.
 
@@ -629,6 +814,50 @@ void DSEMapPointer::useWriters(int64_t Offset, uint64_t Size) {
 
   uint64_t End = (uint64_t)(Offset + Size);
 
+  if(S) {
+
+    // All our records lie in [0, DSESMALLMAPSIZE), so clip the read to that range,
+    // treating reads that start out of range as reading everything.
+    uint64_t Start, Stop;
+    if(Offset < 0) {
+      Start = 0;
+      Stop = DSESMALLMAPSIZE;
+    }
+    else if(Offset >= DSESMALLMAPSIZE) {
+      return;
+    }
+    else {
+      Start = Offset;
+      Stop = (Size >= DSESMALLMAPSIZE - Start) ? DSESMALLMAPSIZE : Start + Size;
+    }
+
+    uint64_t Mask[DSESMALLMAPWORDS];
+    getByteMask(Mask, Start, Stop);
+
+    // As below, writers that are found needed are dropped from the map entirely.
+    uint32_t out = 0;
+    for(uint32_t i = 0, ilim = S->Entries.size(); i != ilim; ++i) {
+
+      DSESmallMapEntry& E = S->Entries[i];
+      bool overlaps = false;
+      for(uint32_t j = 0; j != DSESMALLMAPWORDS && !overlaps; ++j)
+	overlaps = !!(E.Bytes[j] & Mask[j]);
+
+      if(overlaps) {
+	E.Store->isNeeded = true;
+	E.Store->derefBytes(countBytes(E.Bytes));
+      }
+      else {
+	S->Entries[out++] = E;
+      }
+
+    }
+
+    S->Entries.resize(out);
+    return;
+
+  }
+
   // Knock out whole map entries wherever they overlap, because records with isNeeded = true
   // are never any use and are only retained to save from having to keep a reverse index
   // from TrackedStores to maps they are stored in.
@@ -654,6 +883,45 @@ void DSEMapPointer::setWriter(int64_t Offset, uint64_t Size, ShadowInstruction*
   
   uint64_t End = (uint64_t)(Offset + Size);
 
+  if(S && !fitsSmallMap(Offset, Size))
+    promote();
+
+  if(S) {
+
+    uint64_t Mask[DSESMALLMAPWORDS];
+    getByteMask(Mask, Offset, End);
+
+    uint32_t out = 0;
+    for(uint32_t i = 0, ilim = S->Entries.size(); i != ilim; ++i) {
+
+      DSESmallMapEntry& E = S->Entries[i];
+      uint64_t overwritten = 0;
+      bool remaining = false;
+      for(uint32_t j = 0; j != DSESMALLMAPWORDS; ++j) {
+	overwritten += countPopulation(E.Bytes[j] & Mask[j]);
+	E.Bytes[j] &= ~Mask[j];
+	remaining |= !!E.Bytes[j];
+      }
+
+      // derefBytes might free the store, but only if it has no bytes left here.
+      TrackedStore* Store = E.Store;
+      if(remaining)
+	S->Entries[out++] = E;
+      if(overwritten)
+	Store->derefBytes(overwritten);
+
+    }
+
+    S->Entries.resize(out);
+
+    DSESmallMapEntry newEntry;
+    newEntry.Store = new TrackedStore(SI, Size);
+    memcpy(newEntry.Bytes, Mask, sizeof(Mask));
+    S->Entries.push_back(newEntry);
+    return;
+
+  }
+
   for(DSEMapTy::iterator it = M->find(Offset), itend = M->end(); it != itend && it.start() < End;) {
 
     if(((int64_t)it.start()) < Offset) {
@@ -706,7 +974,9 @@ DSEMapPointer* ShadowBB::getWritableDSEStore(ShadowValue O) {
   DSEMapPointer* ret = dseStore->getOrCreateStoreFor(O, &isNewStore);
 
   if(isNewStore) {
-    ret->M = new DSEMapTy(DSEMapAllocator);
+    // Start small; setWriter promotes to an interval map if need be.
+    ret->M = 0;
+    ret->S = new DSESmallMap();
     // The TrackedAlloc will be filled in for Allocas and mallocs by our caller.
     ret->A = 0;
   }
@@ -840,9 +1110,9 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 
     DenseMap<ShadowInstruction*, ReadFile>::iterator RI = pass->resolvedReadCalls.find(I);
     DenseMap<Function*, specialfunctions>::iterator findit;
-    if(RI != pass->resolvedReadCalls.end()) {
+    if(RI != pass->resolvedReadCalls.end() && RI->second.bufArg != -1) {
       
-      DSEHandleWrite(I->getCallArgOperand(1), RI->second.readSize, I, BB);
+      DSEHandleWrite(I->getCallArgOperand(RI->second.bufArg), RI->second.writeSize(), I, BB);
 
     }
 
@@ -897,6 +1167,11 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
       if(!enterCalls)
 	return;
 
+      if(IA->canSkipStoreWalks()) {
+	++pass->stats.inertStoreWalksSkipped;
+	return;
+      }
+
       IA->BBs[0]->dseStore = BB->dseStore;
       IA->tryKillStores(commitDisabledHere || (!IA->isEnabled()), disableWrites);
       doDSECallMerge(BB, IA);
@@ -920,8 +1195,8 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 
 	// Repeat this, as a way of effectively sparing it from being needed because
 	// the read requires a runtime check.
-	if(requiresRuntimeCheck(ShadowValue(I), true))	
-	  DSEHandleWrite(I->getCallArgOperand(1), RI->second.readSize, I, BB);
+	if(requiresRuntimeCheck(ShadowValue(I), true) && RI->second.bufArg != -1)
+	  DSEHandleWrite(I->getCallArgOperand(RI->second.bufArg), RI->second.writeSize(), I, BB);
 
       }
       else if((F = getCalledFunction(I)) && 
@@ -966,9 +1241,8 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 	if(F->doesNotAccessMemory())
 	  return;
 
-	// Known system calls may read from any pointer-typed argument,
-	// pending more accurate definition of their read behaviour.
-	// We'll assume they don't write at the moment, since the definitions
+	// Known system calls read what their ref description gives, or else may read from any
+	// pointer-typed argument. We'll assume they don't write at the moment, since the definitions
 	// in VFSCallModRef are /worst/ case write assumptions used for clobbering,
 	// whereas here we need /conservative/ always-overwrites information.
 
@@ -979,29 +1253,46 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 	  if(FI->NoModRef)
 	    return;
 
-	  FunctionType* FType = F->getFunctionType();
-
-	  for(uint32_t arg = 0, arglim = I->getNumArgOperands(); arg != arglim; ++arg) {
+	  if(const IHPLocationMRInfo* Refs = FI->RefDetails) {
 
-	    // Can't hold a pointer?
-	    if(GlobalTD->getTypeStoreSize(FType->getParamType(arg)) < 8)
-	      return;
+	    for(uint32_t i = 0; Refs[i].Location; ++i) {
 
-	    // Known not a pointer?
-	    ShadowValue argval = I->getCallArgOperand(arg);
-	    ImprovedValSetSingle argivs;
-	    if(getImprovedValSetSingle(argval, argivs)) {
+	      ShadowValue RefV;
+	      uint64_t RefSize = 0;
+	      if(Refs[i].Location->getLocation) {
+		Refs[i].Location->getLocation(ShadowValue(I), RefV, RefSize);
+	      }
+	      else {
+		if(Refs[i].Location->argIndex >= I->getNumArgOperands())
+		  continue;
+		RefV = I->getCallArgOperand(Refs[i].Location->argIndex);
+		RefSize = Refs[i].Location->argSize;
+	      }
 
-	      if(argivs.SetType == ValSetTypeScalar || argivs.SetType == ValSetTypeFD)
-		return;
+	      if(!RefV.isInval())
+		DSEHandleRead(RefV, RefSize, BB);
 
 	    }
 
-	    // OK, assume the call reads any amount through the pointer.
-	    DSEHandleRead(argval, MemoryLocation::UnknownSize, BB);
+	  }
+	  else {
+
+	    DSEHandleCallArgReads(I, F, BB);
 
 	  }
 	    
+	}
+	else if(F->doesNotReadMemory()) {
+
+	  // Declared to only write memory, which as above we don't count on.
+	  return;
+
+	}
+	else if(F->onlyAccessesArgMemory()) {
+
+	  // Declared argmemonly: as for an undescribed system call.
+	  DSEHandleCallArgReads(I, F, BB);
+
 	}
 	else {
 
@@ -1068,6 +1359,52 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 
 }
 
+// Unexpanded call I to F may read any amount through each of its pointer arguments, except
+// those declared readnone or writeonly.
+void IntegrationAttempt::DSEHandleCallArgReads(ShadowInstruction* I, Function* F, ShadowBB* BB) {
+
+  CallBase* CB = cast<CallBase>(I->invar->I);
+
+  for(uint32_t arg = 0, arglim = I->getNumArgOperands(); arg != arglim; ++arg) {
+
+    // Can't hold a pointer?
+    if(GlobalTD->getTypeStoreSize(CB->getArgOperand(arg)->getType()) < 8)
+      continue;
+
+    if(arg < F->arg_size() && (F->hasParamAttribute(arg, Attribute::ReadNone) || F->hasParamAttribute(arg, Attribute::WriteOnly)))
+      continue;
+
+    // Known not a pointer?
+    ShadowValue argval = I->getCallArgOperand(arg);
+    ImprovedValSetSingle argivs;
+    if(getImprovedValSetSingle(argval, argivs)) {
+
+      if(argivs.SetType == ValSetTypeScalar || argivs.SetType == ValSetTypeFD)
+	continue;
+
+    }
+
+    // OK, assume the call reads any amount through the pointer.
+    DSEHandleRead(argval, MemoryLocation::UnknownSize, BB);
+
+  }
+
+}
+
+// Update the DSE store for BB's instructions [from, to), which have been evaluated, and advance from to match.
+void IntegrationAttempt::DSEAnalyseInstructions(ShadowBB* BB, uint32_t& from, uint32_t to) {
+
+  for(; from != to; ++from) {
+
+    bool bail = false;
+    DSEAnalyseInstruction(&BB->insts[from], /* commit disabled = */false, 
+			  /*disable writes=*/false, 
+			  /*enter calls =*/false, bail);
+
+  }
+
+}
+
 // Try to kill all stores in this context. Generally DSE processes an instruction at a time,
 // but this recursive-descent path is used when analysing unbounded loops and recursion.
 void InlineAttempt::tryKillStores(bool commitDisabledHere, bool disableWrites) {
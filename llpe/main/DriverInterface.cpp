@@ -144,38 +144,52 @@ IntegratorTag* PeelAttempt::createTag(IntegratorTag* parent) {
 
 }
 
-IntegratorTag* llvm::searchFunctions(IntegratorTag* thisTag, std::string& search, IntegratorTag*& startAt) {
+static void addToTagSearchIndex(IntegratorTag* thisTag, std::vector<std::pair<IntegratorTag*, std::string> >& Index) {
 
-  if(startAt == thisTag) {
-    
-    startAt = 0;
+  std::string Header;
+  if(thisTag->type == IntegratorTypeIA)
+    Header = ((IntegrationAttempt*)thisTag->ptr)->getShortHeader();
+  Index.push_back(std::make_pair(thisTag, Header));
 
-  }
-  else if(!startAt) {
-    
-    if(thisTag->type == IntegratorTypeIA) {
+  for(std::vector<IntegratorTag*>::iterator it = thisTag->children.begin(), 
+	itend = thisTag->children.end(); it != itend; ++it)
+    addToTagSearchIndex(*it, Index);
 
-      IntegrationAttempt* IA = (IntegrationAttempt*)thisTag->ptr;
+}
 
-      if(IA->getShortHeader().find(search) != std::string::npos) {
-      
-	return thisTag;
+// Record each tag's header once, when the tag tree is created.
+void LLPEAnalysisPass::buildTagSearchIndex() {
 
-      }
+  tagSearchIndex.clear();
+  tagSearchPositions.clear();
+  addToTagSearchIndex(rootTag, tagSearchIndex);
 
-    }
+  for(uint32_t i = 0, ilim = tagSearchIndex.size(); i != ilim; ++i)
+    tagSearchPositions[tagSearchIndex[i].first] = i;
+
+}
+
+// Find the first context tag after startAt in preorder whose header contains search,
+// or starting at the root if startAt is null. Returns null if there are no more matches.
+IntegratorTag* LLPEAnalysisPass::searchTags(const std::string& search, IntegratorTag* startAt) {
+
+  uint32_t i = 0;
+  if(startAt) {
+
+    DenseMap<IntegratorTag*, uint32_t>::iterator findit = tagSearchPositions.find(startAt);
+    release_assert(findit != tagSearchPositions.end() && "Search from unknown tag?");
+    i = findit->second + 1;
 
   }
 
-  for(std::vector<IntegratorTag*>::iterator it = thisTag->children.begin(), 
-	itend = thisTag->children.end(); it != itend; ++it) {
+  for(uint32_t ilim = tagSearchIndex.size(); i != ilim; ++i) {
 
-    if(IntegratorTag* SubRes = searchFunctions(*it, search, startAt))
-      return SubRes;
+    std::pair<IntegratorTag*, std::string>& Entry = tagSearchIndex[i];
+    if(Entry.first->type == IntegratorTypeIA && Entry.second.find(search) != std::string::npos)
+      return Entry.first;
 
   }
 
   return 0;
 
 }
-
@@ -60,8 +60,9 @@ namespace llvm {
 
 // Evaluate a merge instruction (phi or select). These produce set-typed values if more than
 // one outcome is possible, and mark symbolic pointers and file descriptors as 'escaped' if this
-// leads to their being members of an overdefined ("could be anything") set.
-bool IntegrationAttempt::tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*& NewPB) {
+// leads to their being members of an overdefined ("could be anything") set. A single-valued
+// result is built in Scratch, if given, rather than a newly allocated set.
+bool IntegrationAttempt::tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*& NewPB, ImprovedValSetSingle* Scratch) {
 
   // The case for a resolved select instruction has already been handled.
 
@@ -87,7 +88,7 @@ bool IntegrationAttempt::tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*&
 
   }
 
-  bool ret = getMergeValue(Vals, NewPB);
+  bool ret = getMergeValue(Vals, NewPB, Scratch);
   ImprovedValSetSingle* NewIVS;
   if(NewPB && (NewIVS = dyn_cast<ImprovedValSetSingle>(NewPB)) && NewIVS->isWhollyUnknown()) {
 
@@ -101,8 +102,9 @@ bool IntegrationAttempt::tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*&
 }
 
 // Merge a vector of values into an ImprovedValSet, if possible. Any fundamentally
-// incompatible values will set NewPB overdefined.
-bool IntegrationAttempt::getMergeValue(SmallVector<ShadowValue, 4>& Vals, ImprovedValSet*& NewPB) {
+// incompatible values will set NewPB overdefined. If Scratch is given, a single-valued result
+// is merged into it (and NewPB pointed at it) instead of a new set from the IVS allocator.
+bool IntegrationAttempt::getMergeValue(SmallVector<ShadowValue, 4>& Vals, ImprovedValSet*& NewPB, ImprovedValSetSingle* Scratch) {
 
   bool anyInfo = false;
   bool verbose = false;
@@ -128,21 +130,25 @@ bool IntegrationAttempt::getMergeValue(SmallVector<ShadowValue, 4>& Vals, Improv
     if(Vals.size() > 1)
       NewPB = newOverdefIVS();
     else
-      NewPB = new ImprovedValSetMulti(*cast<ImprovedValSetMulti>(getIVSRef(Vals[0])));
+      NewPB = copyIVM(cast<ImprovedValSetMulti>(getIVSRef(Vals[0])));
     return true;
 
   }
   else {
 
-    ImprovedValSetSingle* NewIVS = newIVS();
+    ImprovedValSetSingle* NewIVS = Scratch ? Scratch : newIVS();
     NewPB = NewIVS;
   
+    // Once overdefined, further values can't change the result.
     for(SmallVector<ShadowValue, 4>::iterator it = Vals.begin(), it2 = Vals.end(); it != it2 && !NewIVS->Overdef; ++it) {
     
       addValToPB(*it, *NewIVS);
 
     }
 
+    if(NewIVS->Overdef)
+      IHPMergeIntRanges(Vals, *NewIVS);
+
     if(verbose)
       errs() << "=== END PHI MERGE\n";
 
@@ -249,8 +255,19 @@ void IntegrationAttempt::getOperandRising(ShadowInstruction* SI, uint32_t valOpI
 
   ShadowInstIdx valOp = SI->invar->operandIdxs[valOpIdx];
   ShadowValue NewOp;
-  if(valOp.instIdx != INVALID_INSTRUCTION_IDX && valOp.blockIdx != INVALID_BLOCK_IDX)
-    NewOp = getInst(valOp.blockIdx, valOp.instIdx);
+  if(valOp.instIdx != INVALID_INSTRUCTION_IDX && valOp.blockIdx != INVALID_BLOCK_IDX) {
+
+    ShadowInstruction* OpSI = getInst(valOp.blockIdx, valOp.instIdx);
+    NewOp = OpSI;
+
+    // An unexpanded loop's counted exit value, if known (see findClosedFormExitValues):
+    if(OpSI && ExitingBB->naturalScope != L) {
+      DenseMap<ShadowInstruction*, ShadowValue>::iterator findit = closedFormExitValues.find(OpSI);
+      if(findit != closedFormExitValues.end())
+	NewOp = findit->second;
+    }
+
+  }
   else
     NewOp = SI->getOperand(valOpIdx);
 
@@ -388,6 +405,15 @@ bool IntegrationAttempt::tryFoldOpenCmp(ShadowInstruction* SI, std::pair<ValSetT
     return false;
   }
 
+  // A stream FD from fopen is never null: compare it as though null were a negative FD.
+  if(!CmpIntValid) {
+    Constant* OtherC = getSingleConstant(flip ? op0 : op1);
+    if(OtherC && isa<ConstantPointerNull>(OtherC)) {
+      CmpInt = -1;
+      CmpIntValid = true;
+    }
+  }
+
   if(CmpIntValid) {
     
     Improved.V = getOpenCmpResult(CmpI, CmpInt, flip);
@@ -709,6 +735,10 @@ static bool heapPointerAlreadyTested(ShadowValue& V, ShadowInstruction* TestI) {
   uint32_t heapIdx = V.getHeapKey();
   AllocData& AD = GlobalIHP->heap[heapIdx];
 
+  // A summary object stands for many allocations, and testing one says nothing about the others.
+  if(AD.isSummary)
+    return false;
+
   // Has the allocation already been tested?
   if(AD.allocTested == AllocTested)
     return true;
@@ -819,6 +849,10 @@ bool IntegrationAttempt::tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValS
     // Can't make progress if either pointer is vague:
     if(Ops[0].second.Offset == LLONG_MAX || Ops[1].second.Offset == LLONG_MAX)
       return false;
+
+    // ...or if the base summarises several allocations, which the pointers might refer to different ones of.
+    if(op0.isPtrIdx() && op0.getFrameNo() == -1 && GlobalIHP->heap[op0.getHeapKey()].isSummary)
+      return false;
     
     // Always do a signed test here, assuming that negative indexing off a pointer won't wrap the address
     // space and end up with something large and positive.
@@ -883,8 +917,17 @@ unsigned LLPEAnalysisPass::getMallocAlignment() {
   return mallocAlignment;
 }
 
-// Fetch alignment if V is a known allocation, and its allocation instruction / global gives an
-// alignment or the user has informed us about the heap allocation alignment.
+// A global's alignment: as given, or if unspecified the target will choose one compatible with its type.
+unsigned llvm::getGlobalAlignment(GlobalVariable* GV) {
+
+  if(unsigned Align = GV->getAlignment())
+    return Align;
+  return GlobalTD->getABITypeAlignment(GV->getType()->getElementType());
+
+}
+
+// Fetch alignment if V is a known allocation: the alignment noted when it was allocated (see AllocData),
+// or for a constant global the one it is given. Returns 1 if we don't know.
 unsigned IntegrationAttempt::getAlignment(ShadowValue V) {
 
   unsigned Align = 1;
@@ -892,25 +935,13 @@ unsigned IntegrationAttempt::getAlignment(ShadowValue V) {
   if(V.isPtrIdx()) {
 
     AllocData* AD = getAllocData(V);
-      
-    if(V.getFrameNo() == -1) {
-
-      // Careful, can't use the instruction as it might be committed.
-      if(AD->allocValue.isInst())
-	Align = pass->getMallocAlignment();
-      else if(AD->allocValue.isGV()) {
-	GlobalValue* GV = cast<GlobalValue>(AD->allocValue.getGV()->G);
-	Align = GV->getAlignment();
-      }
+    if(AD->alignment)
+      Align = AD->alignment;
 
-    }
-    else {
-	  
-      // Alloca instructions are never committed when in scope.
-      AllocaInst* AI = cast_inst<AllocaInst>(AD->allocValue.getInst());
-      Align = AI->getAlignment();
-	  
-    }
+  }
+  else if(V.isGV()) {
+
+    Align = getGlobalAlignment(V.getGV()->G);
 
   }
 
@@ -918,8 +949,27 @@ unsigned IntegrationAttempt::getAlignment(ShadowValue V) {
 
 }
 
+// Find the low bits of pointer IV's address that are known regardless of where its object is placed:
+// those below the object's alignment, fixed by its offset. Only the largest power of two dividing
+// the alignment is used, in case -llpe-malloc-alignment gave something odd.
+bool IntegrationAttempt::getKnownLowBits(const ImprovedVal& IV, uint64_t& KnownMask, uint64_t& KnownBits) {
+
+  if(IV.Offset == LLONG_MAX)
+    return false;
+
+  uint64_t Align = getAlignment(IV.V);
+  Align &= -Align;
+  if(Align <= 1)
+    return false;
+
+  KnownMask = Align - 1;
+  KnownBits = ((uint64_t)IV.Offset) & KnownMask;
+  return true;
+
+}
+
 // Evaluate pointer arithmetic, other than that using getelementptr. We support addition, subtraction,
-// discovering alignment if we know it, and setting/getting the least significant bits, again if we know
+// discovering alignment if we know it, and setting/getting/flipping the least significant bits, again if we know
 // the pointer's alignment so this is predictable.
 bool IntegrationAttempt::tryFoldPtrAsIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, ValSetType& ImpType, ImprovedVal& Improved) {
 
@@ -933,6 +983,7 @@ bool IntegrationAttempt::tryFoldPtrAsIntOp(ShadowInstruction* SI, std::pair<ValS
   case Instruction::Sub:
   case Instruction::And:
   case Instruction::Or:
+  case Instruction::Xor:
     break;
   default:
     return false;
@@ -1045,10 +1096,11 @@ bool IntegrationAttempt::tryFoldPtrAsIntOp(ShadowInstruction* SI, std::pair<ValS
     return true;
 
   }
-  else if(BOp->getOpcode() == Instruction::And) {
+  else {
 
-    // Common technique to discover a pointer's alignment -- and it with a small integer.
-    // Answer if we can.
+    // And, or or xor with a constant: common techniques to discover a pointer's alignment (p & 7),
+    // round it down (p & -8) or get, set and flip tag bits kept below the alignment.
+    // Answer if the constant only reads or changes bits that getKnownLowBits can predict.
 
     do {
 
@@ -1061,42 +1113,48 @@ bool IntegrationAttempt::tryFoldPtrAsIntOp(ShadowInstruction* SI, std::pair<ValS
 	break;
 
       uint64_t MaskC;
-      int64_t SignedMaskC;
       if(!tryGetConstantInt(Ops[1].second.V, MaskC))
 	break;
 
-      SignedMaskC = (int64_t)MaskC;
-
-      if(Ops[0].second.Offset == LLONG_MAX || Ops[0].second.Offset < 0)
+      uint64_t KnownMask, KnownBits;
+      if(!getKnownLowBits(Ops[0].second, KnownMask, KnownBits))
 	break;
 
+      uint32_t Bits = cast<IntegerType>(BOp->getType())->getBitWidth();
+      uint64_t TyMask = Bits >= 64 ? ~(uint64_t)0 : ((((uint64_t)1) << Bits) - 1);
       uint64_t UOff = (uint64_t)Ops[0].second.Offset;
 
-      unsigned Align = getAlignment(Ops[0].second.V);
-      
-      if(Align > MaskC) {
-      
-	ImpType = ValSetTypeScalar;
-	Improved.V = ShadowValue::getInt(BOp->getType(), MaskC & UOff);
+      if(!(MaskC & ~KnownMask)) {
+
+	if(BOp->getOpcode() == Instruction::And) {
+	  ImpType = ValSetTypeScalar;
+	  Improved.V = ShadowValue::getInt(BOp->getType(), MaskC & KnownBits);
+	}
+	else {
+	  // Only the offset's low bits change, so this is p + (offset | mask) or p + (offset ^ mask).
+	  ImpType = ValSetTypePB;
+	  Improved = ImprovedVal(Ops[0].second.V, (int64_t)(BOp->getOpcode() == Instruction::Or ? (UOff | MaskC) : (UOff ^ MaskC)));
+	}
 	return true;
 
       }
-      else if(SignedMaskC < 0 && (-SignedMaskC) <= Align) {
+      else if(BOp->getOpcode() == Instruction::And && !((~MaskC) & TyMask & ~KnownMask)) {
 	
 	// In this case the instruction is masking off bits that are known zero in the original allocation;
-	// thus it is masking only the Offset.
+	// thus it is masking only the Offset. Bits above the type's width stay set, for a negative offset.
 	ImpType = ValSetTypePB;
 	Improved.V = Ops[0].second.V;
-	Improved.Offset = UOff & MaskC;
+	Improved.Offset = (int64_t)(UOff & (MaskC | ~TyMask));
 	return true;
 
       }
 
     } while(0);
 
-    // Otherwise, the usual rule: the and op cannot take a pointer into a different allocated object.
+    // Otherwise, the usual rule: the and / or op cannot take a pointer into a different allocated object.
+    // Xor might, if it flips high bits, so we give up.
     
-    if(Op0Ptr || Op1Ptr) {
+    if(BOp->getOpcode() != Instruction::Xor && (Op0Ptr || Op1Ptr)) {
 
       std::pair<ValSetType, ImprovedVal>& PtrV = Op0Ptr ? Ops[0] : Ops[1];
 
@@ -1107,55 +1165,6 @@ bool IntegrationAttempt::tryFoldPtrAsIntOp(ShadowInstruction* SI, std::pair<ValS
 
     }
 
-  }
-  else if(BOp->getOpcode() == Instruction::Or) {
-
-    // Or may be used to set offset bits, similar to the And case above subtracting from it.
-
-    do {
-
-      if(Op1Ptr) {
-	std::swap(Op0Ptr, Op1Ptr);
-	std::swap(Ops[0], Ops[1]);
-      }
-
-      if((!Op0Ptr) || Op1Ptr)
-	break;
-
-      uint64_t MaskC;
-      if(!tryGetConstantInt(Ops[1].second.V, MaskC))
-	break;
-
-      if(Ops[0].second.Offset == LLONG_MAX || Ops[0].second.Offset < 0)
-	break;
-
-      uint64_t UOff = (uint64_t)Ops[0].second.Offset;
-      unsigned Align = getAlignment(Ops[0].second.V);
-      
-      if(Align > MaskC) {
-      
-	ImpType = ValSetTypePB;
-	Improved = ImprovedVal(Ops[0].second.V, MaskC | UOff);
-	return true;
-
-      }
-
-    } while(0);
-
-    // Otherwise, the usual rule: the and op cannot take a pointer into a different allocated object.
-    
-    if(Op0Ptr || Op1Ptr) {
-
-      std::pair<ValSetType, ImprovedVal>& PtrV = Op0Ptr ? Ops[0] : Ops[1];
-
-      ImpType = ValSetTypePB;
-      Improved.V = PtrV.second.V;
-      Improved.Offset = LLONG_MAX;
-      return true;
-
-    }
-
-
   }
 
   return false;
@@ -1327,9 +1336,16 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
   
   Instruction* I = SI->invar->I;
 
-  // Try a special case for forwarding FDs: they can be passed through any cast preserving 32 bits.
-  // We optimistically pass vararg cookies through all casts.
-  if(inst_is<CastInst>(SI)) {
+  uint8_t evalKind = SI->invar->evalKind;
+
+  switch(evalKind) {
+
+  case EVALKIND_CAST:
+  case EVALKIND_INTCAST:
+  {
+
+    // Try a special case for forwarding FDs: they can be passed through any cast preserving 32 bits.
+    // We optimistically pass vararg cookies through all casts.
 
     CastInst* CI = cast_inst<CastInst>(SI);
     Type* SrcTy = CI->getSrcTy();
@@ -1363,23 +1379,30 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
     }
 
     // Otherwise pass scalars through the normal constant folder.
+    break;
 
   }
 
-  if(inst_is<CmpInst>(SI)) {
+  case EVALKIND_ICMP:
+  case EVALKIND_FCMP:
+  {
 
     if(tryFoldOpenCmp(SI, Ops, ImpType, Improved))
       return;
-    if(inst_is<ICmpInst>(SI) && tryFoldPointerCmp(SI, Ops, ImpType, Improved, needsRuntimeCheck))
+    if(evalKind == EVALKIND_ICMP && tryFoldPointerCmp(SI, Ops, ImpType, Improved, needsRuntimeCheck))
       return;
     if(tryFoldNonConstCmp(SI, Ops, ImpType, Improved))
       return;
 
     // Otherwise fall through to normal const folding.
+    break;
 
   }
 
-  else if(GetElementPtrInst* GEP = dyn_cast<GetElementPtrInst>(I)) {
+  case EVALKIND_GEP:
+  {
+
+    GetElementPtrInst* GEP = cast<GetElementPtrInst>(I);
 
     if(Ops[0].first == ValSetTypePB) {
 
@@ -1490,7 +1513,8 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
 	  
   }
 
-  else if(I->getOpcode() == Instruction::Add || I->getOpcode() == Instruction::Sub || I->getOpcode() == Instruction::And || I->getOpcode() == Instruction::Or) {
+  case EVALKIND_PTRARITH:
+  {
 
     if(I->getOpcode() == Instruction::Add && Ops[0].first == ValSetTypeVarArg) {
       ImpType = ValSetTypeVarArg;
@@ -1501,10 +1525,12 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
       return;
     if(tryFoldBitwiseOp(SI, Ops, ImpType, Improved))
       return;
+    break;
 	    
   }
 
-  else if(I->getOpcode() == Instruction::ExtractValue) {
+  case EVALKIND_EXTRACTVALUE:
+  {
 
     // Missing from ConstantFoldInstOperands for some reason.
 
@@ -1527,12 +1553,18 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
 
   }
 
+  default:
+    break;
+
+  }
+
   // Try the special constant folder that avoids creating ConstantInts
   // These are uniqued and stay alive forever, which can consume a *lot* of memory,
   // so this path handles the common case of integer unary and binary operations.
 
   SmallVector<uint64_t, 4> intOperands;
-  bool allOpsInts = true;
+  bool allOpsInts = (evalKind == EVALKIND_INTCAST || evalKind == EVALKIND_ICMP || 
+		     evalKind == EVALKIND_PTRARITH || evalKind == EVALKIND_INTOP);
 
   for(unsigned i = 0, ilim = I->getNumOperands(); i != ilim && allOpsInts; i++) {
 
@@ -1599,7 +1631,9 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
 
   Constant* newConst = 0;
 
-  if (const CmpInst *CI = dyn_cast<CmpInst>(I)) {
+  if(evalKind == EVALKIND_ICMP || evalKind == EVALKIND_FCMP) {
+
+    const CmpInst* CI = cast<CmpInst>(I);
    
     // Rare corner case: we get here but the compare args are not of the same type.
     // Example: comparing a constant against ptrtoint(null).
@@ -1623,7 +1657,7 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
     newConst = ConstantFoldCompareInstOperands(CI->getPredicate(), instOperands[0], instOperands[1], *GlobalTD);
 
   }
-  else if(isa<LoadInst>(I))
+  else if(evalKind == EVALKIND_LOAD)
     newConst = ConstantFoldLoadFromConstPtr(instOperands[0], I->getType(), *GlobalTD);
   else
     newConst = ConstantFoldInstOperands(I, instOperands, *GlobalTD, GlobalTLI);
@@ -1944,6 +1978,8 @@ static void flattenIVM(ImprovedValSetMulti* InIVM, uint64_t resSize, int64_t Shi
 
 bool IntegrationAttempt::tryEvaluateMultiInst(ShadowInstruction* SI, ImprovedValSet*& NewIV) {
 
+  LLPE_EVAL_PROFILE_SCOPE(EVAL_PROFILE_MULTI, SI->invar->I);
+
   // Currently supported operations on multis:
   // * Equality, inequality
   // * Shift right and left by constant amount
@@ -2040,7 +2076,7 @@ bool IntegrationAttempt::tryEvaluateMultiInst(ShadowInstruction* SI, ImprovedVal
       }
       else if(!ComplexValuesInRange) {
 	
-	if(overdefInRange || setProduct > PBMAX) {
+	if(overdefInRange || setProduct > GlobalPBMax) {
 	  NewIV = newOverdefIVS();
 	  return true;
 	}
@@ -2057,7 +2093,7 @@ bool IntegrationAttempt::tryEvaluateMultiInst(ShadowInstruction* SI, ImprovedVal
       else {
 
 	// Make a new IVM, but offset and trimmed.
-	ImprovedValSetMulti* NewIVM = new ImprovedValSetMulti(InIVM->AllocSize);
+	ImprovedValSetMulti* NewIVM = newIVM(InIVM->AllocSize);
 	NewIV = NewIVM;
 
 	for(ImprovedValSetMulti::MapIt it = InIVM->Map.begin(), endit = InIVM->Map.end(); it != endit; ++it) {	
@@ -2205,7 +2241,7 @@ bool IntegrationAttempt::tryEvaluateMultiInst(ShadowInstruction* SI, ImprovedVal
 	// FD or pointer components retained, but necessarily aren't the whole thing.
 	// Create a new multi, with each individual part masked appropriately.
 
-	ImprovedValSetMulti* NewIVM = new ImprovedValSetMulti(IVM->AllocSize);
+	ImprovedValSetMulti* NewIVM = newIVM(IVM->AllocSize);
 	NewIV = NewIVM;
 	for(ImprovedValSetMulti::MapIt it = IVM->Map.begin(), endit = IVM->Map.end(); it != endit; ++it) {
 
@@ -2294,12 +2330,17 @@ bool IntegrationAttempt::tryEvaluateOrdinaryInst(ShadowInstruction* SI, Improved
 
   }
 
+  if(tryEvaluateVectorInst(SI, NewPB, anyMultis))
+    return true;
+
   if(anyMultis) {
     return tryEvaluateMultiInst(SI, NewPB);
   }
   else {
     ImprovedValSetSingle* NewIVS = newIVS();
     NewPB = NewIVS;
+    if(IHPFoldIntSets(SI, *NewIVS))
+      return true;
     std::vector<std::pair<ValSetType, ImprovedVal> > Ops(SI->getNumOperands());
     return tryEvaluateOrdinaryInst(SI, *NewIVS, &Ops[0], 0);
   }
@@ -2309,7 +2350,8 @@ bool IntegrationAttempt::tryEvaluateOrdinaryInst(ShadowInstruction* SI, Improved
 // Evaluate general instruction SI. Dispatch to the load-forwarding code or use the ordinary
 // evaluation code in this file as appropriate. Return true if we set NewResult. Set loadedVararg
 // if this context becomes 'tainted' by reading varargs.
-bool IntegrationAttempt::getNewResult(ShadowInstruction* SI, ImprovedValSet*& NewResult, bool& loadedVararg) {
+// MergeScratch is passed on to tryEvaluateMerge for phi and select instructions.
+bool IntegrationAttempt::getNewResult(ShadowInstruction* SI, ImprovedValSet*& NewResult, bool& loadedVararg, ImprovedValSetSingle* MergeScratch) {
 
   // Special case the merge instructions:
   bool tryMerge = false;
@@ -2364,7 +2406,7 @@ bool IntegrationAttempt::getNewResult(ShadowInstruction* SI, ImprovedValSet*& Ne
 
   if(tryMerge) {
 
-    tryEvaluateMerge(SI, NewResult);
+    tryEvaluateMerge(SI, NewResult, MergeScratch);
     if(!NewResult)
       return true;
     if(ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(NewResult))
@@ -2463,8 +2505,12 @@ bool IntegrationAttempt::tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& l
   ImprovedValSet* NewPB = 0;
   bool NewPBValid;
 
+  // Merges, which dominate fixpoint iteration, are evaluated here and only allocated
+  // if their result changes.
+  ImprovedValSetSingle MergeScratch;
+
   ShadowInstruction* SI = V.getInst();
-  NewPBValid = getNewResult(SI, NewPB, loadedVararg);
+  NewPBValid = getNewResult(SI, NewPB, loadedVararg, &MergeScratch);
 
   // AFAIK only void calls can be rejected this way.
   if(!NewPB)
@@ -2489,6 +2535,19 @@ bool IntegrationAttempt::tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& l
 
   if((!OldPBValid) || !IVsEqualShallow(OldPB, NewPB)) {
 
+    if(NewPB == &MergeScratch) {
+
+      // Singles are never shared, so an old single can simply be overwritten.
+      if(OldPBSingle) {
+	*OldPBSingle = MergeScratch;
+	NewPB = OldPBSingle;
+      }
+      else {
+	NewPB = copyIVS(&MergeScratch);
+      }
+
+    }
+
     if(pass->verboseOverdef) {
       if(ShadowInstruction* I = V.getInst()) {
 	if(!inst_is<LoadInst>(I)) {
@@ -2502,15 +2561,17 @@ bool IntegrationAttempt::tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& l
     }
 
     if(ShadowInstruction* SI = V.getInst()) {
-      if(SI->i.PB)
+      if(SI->i.PB && SI->i.PB != NewPB)
 	deleteIV(SI->i.PB);
       SI->i.PB = NewPB;
+      SI->changeStamp = pass->loopRoundClock;
     }
     else {
       ShadowArg* SA = V.getArg();
-      if(SA->i.PB)
+      if(SA->i.PB && SA->i.PB != NewPB)
 	deleteIV(SA->i.PB);
       SA->i.PB = NewPB;
+      SA->changeStamp = pass->loopRoundClock;
     }
 
     bool verbose = false;
@@ -2534,7 +2595,8 @@ bool IntegrationAttempt::tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& l
   else {
 
     // New result not needed.
-    deleteIV(NewPB);
+    if(NewPB != &MergeScratch)
+      deleteIV(NewPB);
 
   }
 
@@ -0,0 +1,139 @@
+//===-- EvalProfile.cpp ---------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Optional profile of where the analysis spends its time, by IR opcode and by function
+// (see LLPE_EVAL_PROFILE_SCOPE). Compiled only with LLPE_PROFILE_EVAL defined.
+
+#include "llvm/Analysis/LLPE.h"
+
+#ifdef LLPE_PROFILE_EVAL
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+using namespace llvm;
+
+static uint64_t readTicks() {
+
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#endif
+
+}
+
+struct EvalProfileCounter {
+
+  uint64_t count;
+  uint64_t ticks;
+
+EvalProfileCounter() : count(0), ticks(0) {}
+
+};
+
+static EvalProfileCounter opcodeCounters[EVAL_PROFILE_SITES][Instruction::OtherOpsEnd];
+static DenseMap<const Function*, EvalProfileCounter> functionCounters[EVAL_PROFILE_SITES];
+static EvalProfileScope* currentScope = 0;
+
+static const char* siteNames[EVAL_PROFILE_SITES] = {
+  "analyseInstruction", "tryForwardLoadPB", "tryEvaluateMultiInst"
+};
+
+EvalProfileScope::EvalProfileScope(EvalProfileSite S, const Instruction* _I) : site(S), I(_I), childTicks(0), outer(currentScope) {
+
+  currentScope = this;
+  start = readTicks();
+
+}
+
+EvalProfileScope::~EvalProfileScope() {
+
+  uint64_t total = readTicks() - start;
+  uint64_t self = total > childTicks ? total - childTicks : 0;
+
+  EvalProfileCounter& OC = opcodeCounters[site][I->getOpcode()];
+  ++OC.count;
+  OC.ticks += self;
+
+  EvalProfileCounter& FC = functionCounters[site][I->getParent()->getParent()];
+  ++FC.count;
+  FC.ticks += self;
+
+  currentScope = outer;
+  if(outer)
+    outer->childTicks += total;
+
+}
+
+struct EvalProfileCmp {
+
+  bool operator()(const std::pair<std::string, EvalProfileCounter>& A, const std::pair<std::string, EvalProfileCounter>& B) {
+    return A.second.ticks > B.second.ticks;
+  }
+
+};
+
+static void printCounters(raw_ostream& Out, std::vector<std::pair<std::string, EvalProfileCounter> >& Counters, uint32_t limit) {
+
+  std::sort(Counters.begin(), Counters.end(), EvalProfileCmp());
+
+  for(uint32_t i = 0, ilim = std::min((uint32_t)Counters.size(), limit); i != ilim; ++i) {
+
+    EvalProfileCounter& C = Counters[i].second;
+    Out << "    " << Counters[i].first << ": " << C.count << " evaluations, " << C.ticks << " ticks";
+    if(C.count)
+      Out << " (" << format("%.1f", (double)C.ticks / C.count) << " per evaluation)";
+    Out << "\n";
+
+  }
+
+}
+
+// Print each site's costliest opcodes and functions, in self ticks.
+void llvm::printEvalProfile(raw_ostream& Out) {
+
+  for(uint32_t site = 0; site != EVAL_PROFILE_SITES; ++site) {
+
+    std::vector<std::pair<std::string, EvalProfileCounter> > Opcodes;
+    for(uint32_t op = 0; op != Instruction::OtherOpsEnd; ++op) {
+      if(opcodeCounters[site][op].count)
+	Opcodes.push_back(std::make_pair(std::string(Instruction::getOpcodeName(op)), opcodeCounters[site][op]));
+    }
+
+    if(Opcodes.empty())
+      continue;
+
+    std::vector<std::pair<std::string, EvalProfileCounter> > Functions;
+    for(DenseMap<const Function*, EvalProfileCounter>::iterator it = functionCounters[site].begin(),
+	  itend = functionCounters[site].end(); it != itend; ++it)
+      Functions.push_back(std::make_pair(it->first->getName().str(), it->second));
+
+    Out << "Evaluation profile for " << siteNames[site] << ":\n";
+    Out << "  By opcode:\n";
+    printCounters(Out, Opcodes, UINT_MAX);
+    Out << "  By function (top 30):\n";
+    printCounters(Out, Functions, 30);
+
+  }
+
+}
+
+#endif
@@ -10,6 +10,10 @@
 #include "llvm/Analysis/LLPE.h"
 #include "llvm/IR/Function.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Analysis/LLPECopyPaste.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 
 // The function sharing code should permit identical invocations of a particular function to share analysis results.
 // However the feature hasn't been tested in some time and is almost certainly bitrotted.
@@ -21,17 +25,39 @@
 using namespace llvm;
 
 // The external dependencies are the memory locations, FDs etc that indirectly flow information into
-// this function.
+// this function. While the function is analysed only the set of locations read is kept; their values
+// at entry are copied once analysis finishes (see materialiseDependencies).
 void InlineAttempt::clearExternalDependencies() {
 
   for(DenseMap<ShadowValue, ImprovedValSet*>::iterator it = sharing->externalDependencies.begin(), 
 	it2 = sharing->externalDependencies.end(); it != it2; ++it) {
 
-    it->second->dropReference();
+    if(it->second)
+      it->second->dropReference();
     
   }
    
   sharing->externalDependencies.clear();
+  sharing->dependencyReads.clear();
+  sharing->dependenciesMaterialised = false;
+
+  for(DenseMap<ShadowValue, CanonicalStore*>::iterator it = sharing->canonicalDependencies.begin(),
+	itend = sharing->canonicalDependencies.end(); it != itend; ++it)
+    delete it->second;
+
+  sharing->canonicalDependencies.clear();
+
+}
+
+// Free the sharing description once no future call can match against it.
+void InlineAttempt::releaseSharingState() {
+
+  if(!sharing)
+    return;
+
+  clearExternalDependencies();
+  delete sharing;
+  sharing = 0;
 
 }
 
@@ -63,27 +89,34 @@ void InlineAttempt::sharingInit() {
 // Print our dependencies for debugging purposes.
 void InlineAttempt::dumpSharingState() {
 
-  errs() << F.getName() << " / " << SeqNumber << ":";
+  // One record, so that the dump stays together.
+  LogRecord Record(LOG_SHARING);
+  raw_ostream& Out = Record.stream();
+
+  Out << F.getName() << " / " << SeqNumber << ":";
 
   if(isUnsharable()) {
-    errs() << " UNSHARABLE\n";
+    Out << " UNSHARABLE\n";
   }
   else {
 
-    errs() << "\n";
+    Out << "\n";
 
     for(DenseMap<ShadowValue, ImprovedValSet*>::iterator it = sharing->externalDependencies.begin(),
 	  itend = sharing->externalDependencies.end(); it != itend; ++it) {
 
-      errs() << itcache(it->first) << ": ";
-      it->second->print(errs(), true);
-      errs() << "\n";
+      Out << itcache(it->first) << ": ";
+      if(it->second)
+	it->second->print(Out, true);
+      else
+	Out << "(not in entry store)";
+      Out << "\n";
 
     }
 
   }
 
-  errs() << "=== end " << F.getName() << " / " << SeqNumber << " ===\n\n";
+  Out << "=== end " << F.getName() << " / " << SeqNumber << " ===\n";
 
 }
 
@@ -95,9 +128,6 @@ void InlineAttempt::sharingCleanup() {
   if(!pass->enableSharing)
     return;
 
-  if(sharing->storeAtEntry)
-    sharing->storeAtEntry->dropReference();
-
   SmallVector<ShadowInstruction*, 4> toRemove;
 
   // Eliminate escaping mallocs that are known to be freed, both as dependencies and escapes.
@@ -149,19 +179,20 @@ void InlineAttempt::sharingCleanup() {
   for(SmallVector<ShadowInstruction*, 4>::iterator it = toRemove.begin(),
 	itend = toRemove.end(); it != itend; ++it) {
 
-    if(pass->verboseSharing) {
-      
-      errs() << "Eliminate dependency on freed heap location " << itcache(*it) << "\n";
-
-    }
+    LLPE_LOG(LOG_SHARING) << "Eliminate dependency on freed heap location " << itcache(*it);
 
     sharing->escapingMallocs.erase(*it);
-    DenseMap<ShadowValue, ImprovedValSet*>::iterator findit = sharing->externalDependencies.find(ShadowValue(*it));
-    if(findit != sharing->externalDependencies.end()) {
-      findit->second->dropReference();
-      sharing->externalDependencies.erase(findit);
-    }
+    sharing->dependencyReads.erase(ShadowValue(*it));
+
+  }
+
+  // Only a context that might be shared needs the values it depended upon.
+  if(!isUnsharable())
+    materialiseDependencies();
 
+  if(sharing->storeAtEntry) {
+    sharing->storeAtEntry->dropReference();
+    sharing->storeAtEntry = 0;
   }
 
   if(pass->verboseSharing)
@@ -169,6 +200,23 @@ void InlineAttempt::sharingCleanup() {
 
 }
 
+// Copy the value at entry of every location we read into externalDependencies, for matchesCallerEnvironment.
+// When sharing is enabled the base store is only used for initialisers, so storeAtEntry
+// holds the most up-to-date value of each.
+void InlineAttempt::materialiseDependencies() {
+
+  for(DenseSet<ShadowValue>::iterator it = sharing->dependencyReads.begin(),
+	itend = sharing->dependencyReads.end(); it != itend; ++it) {
+
+    LocStore* saveStore = sharing->storeAtEntry->getReadableStoreFor(*it);
+    sharing->externalDependencies[*it] = saveStore ? saveStore->store->getReadableCopy() : 0;
+
+  }
+
+  sharing->dependenciesMaterialised = true;
+
+}
+
 void IntegrationAttempt::noteVFSOp() {
 
   if(!pass->enableSharing)
@@ -200,20 +248,7 @@ void IntegrationAttempt::noteDependency(ShadowValue V) {
 
   }
 
-  std::pair<DenseMap<ShadowValue, ImprovedValSet*>::iterator, bool> it = Root->sharing->externalDependencies.insert(std::make_pair(V, (ImprovedValSet*)0));
-
-  // Already registered?
-  if(!it.second)
-    return;
-
-  // When sharing is enabled the base store is only used for initialisers. Therefore
-  // this must be the most up-to-date value at function entry.
-
-  LocStore* saveStore = Root->sharing->storeAtEntry->getReadableStoreFor(V);
-  if(!saveStore)
-    return;
-
-  it.first->second = saveStore->store->getReadableCopy();
+  Root->sharing->dependencyReads.insert(V);
 
 }
 
@@ -240,12 +275,12 @@ void IntegrationAttempt::mergeChildDependencies(InlineAttempt* ChildIA) {
   if(ChildIA->hasVFSOps)
     noteVFSOp();
 
-  for(DenseMap<ShadowValue, ImprovedValSet*>::iterator it = ChildIA->sharing->externalDependencies.begin(),
-	it2 = ChildIA->sharing->externalDependencies.end(); it != it2; ++it) {
+  for(DenseSet<ShadowValue>::iterator it = ChildIA->sharing->dependencyReads.begin(),
+	it2 = ChildIA->sharing->dependencyReads.end(); it != it2; ++it) {
 
     // Note this might record a different dependency to our child if this function or a sibling
     // has altered a relevant location since we entered this function.
-    noteDependency(it->first);
+    noteDependency(*it);
       
   }
     
@@ -265,6 +300,10 @@ bool InlineAttempt::matchesCallerEnvironment(ShadowInstruction* SI) {
   if(!pass->enableSharing)
     return false;
 
+  // Dependencies not recorded: this context was unsharable when last analysed.
+  if(!sharing->dependenciesMaterialised)
+    return false;
+
   // Differing vararg counts?
   if(SI->getNumArgOperands() != argShadows.size())
     return false;
@@ -281,8 +320,8 @@ bool InlineAttempt::matchesCallerEnvironment(ShadowInstruction* SI) {
   }
 
   // Check all memory locations upon which we depend match the values at the proposed callsite.
-  // TODO: consider using deep equality test here if we find too many false negatives due to 
-  // e.g. identical structures being produced by different means leading to different representations.
+  // With -llpe-sharing-deep-compare, locations whose representations differ are compared again
+  // in canonical form, since identical contents can be produced by different means.
 
   for(DenseMap<ShadowValue, ImprovedValSet*>::iterator it = sharing->externalDependencies.begin(),
 	itend = sharing->externalDependencies.end(); it != itend; ++it) {
@@ -290,14 +329,270 @@ bool InlineAttempt::matchesCallerEnvironment(ShadowInstruction* SI) {
     // Note that if function sharing is enabled the base store is only used to represent initialisers
     // in order to facilitate creating a copy of the store at function entry.
     LocStore* callsiteStore = SI->parent->getReadableStoreFor(it->first);
-    if(!callsiteStore)
+    if((!callsiteStore) || !it->second)
+      return false;
+
+    if(!IVsEqualShallow(callsiteStore->store, it->second)) {
+
+      if(!(pass->deepSharingCompare && storesEqualDeep(it->first, callsiteStore->store, it->second)))
+	return false;
+
+    }
+
+  }
+
+  return true;
+
+}
+
+// Fingerprints used to index sharable functions: any two argument values that IVMatchesVal could
+// consider equal must get the same fingerprint. All overdefined sets therefore share one fingerprint,
+// as do all multi-part sets (we don't want to walk their interval maps), and the rest are hashed
+// independent of the order of their values, since these are sets.
+
+static const uint64_t OverdefFingerprint = 1;
+static const uint64_t MultiFingerprint = 2;
+
+static uint64_t getValFingerprint(const ImprovedVal& IV) {
+
+  return hash_combine(DenseMapInfo<ShadowValue>::getHashValue(IV.V), IV.Offset);
+
+}
+
+static uint64_t getIVFingerprint(ImprovedValSet* IV) {
+
+  if(!IV)
+    return 0;
+
+  ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(IV);
+  if(!IVS)
+    return MultiFingerprint;
+
+  if(IVS->Overdef)
+    return OverdefFingerprint;
+
+  uint64_t ValsHash = 0;
+  for(uint32_t i = 0, ilim = IVS->Values.size(); i != ilim; ++i)
+    ValsHash += getValFingerprint(IVS->Values[i]);
+
+  return hash_combine((unsigned)IVS->SetType, IVS->Values.size(), ValsHash);
+
+}
+
+// Fingerprint the value V passed at a callsite. Returns false if V has no value yet, in which case
+// it can't match anything.
+static bool getArgFingerprint(ShadowValue V, uint64_t& Out) {
+
+  ImprovedValSet* IV = 0;
+  std::pair<ValSetType, ImprovedVal> Single;
+  getIVOrSingleVal(V, IV, Single);
+
+  if(IV) {
+    Out = getIVFingerprint(IV);
+    return true;
+  }
+
+  if(V.isInst() || V.isArg())
+    return false;
+
+  if(Single.first == ValSetTypeOverdef)
+    Out = OverdefFingerprint;
+  else
+    Out = hash_combine((unsigned)Single.first, (size_t)1, getValFingerprint(Single.second));
+  return true;
+
+}
+
+// Canonical forms of symbolic memory objects, for comparing objects whose contents are the same but
+// whose representations differ, for example because they were written in a different order or by
+// different means (a memset and then stores, or one large store), or because one is a multi laid
+// over several underlying maps and the other is a single flat map. The whole object is read through
+// any Underlying chain into a list of extents; runs of plain data are then held as bytes regardless
+// of how they were divided, and neighbouring unknown extents are merged.
+
+// Don't expand splats bigger than this into bytes.
+static const uint64_t MaxCanonicalSplat = 4096;
+
+namespace llvm {
+
+struct CanonicalExtent {
+
+  uint64_t Start;
+  uint64_t Stop;
+  bool isData;
+  // If isData, the extent's contents; otherwise its value.
+  std::vector<uint8_t> Bytes;
+  ImprovedValSetSingle Val;
+
+  bool operator==(const CanonicalExtent& Other) const {
+    if(Start != Other.Start || Stop != Other.Stop || isData != Other.isData)
       return false;
+    if(isData)
+      return Bytes == Other.Bytes;
+    return Val == Other.Val;
+  }
+
+};
+
+struct CanonicalStore {
+
+  std::vector<CanonicalExtent> Extents;
+  uint64_t Hash;
+
+};
+
+}
+
+// If IVS has a plain-data value, append its Size bytes to Bytes.
+static bool getExtentBytes(const ImprovedValSetSingle& IVS, uint64_t Size, std::vector<uint8_t>& Bytes) {
+
+  if(IVS.Overdef || IVS.Values.size() != 1 || !IVS.Values[0].V.isVal())
+    return false;
+
+  Constant* C = dyn_cast<Constant>(IVS.Values[0].V.getVal());
+  if(!C)
+    return false;
+
+  if(IVS.SetType == ValSetTypeScalarSplat) {
+
+    ConstantInt* CI = dyn_cast<ConstantInt>(C);
+    if((!CI) || CI->getBitWidth() != 8 || Size > MaxCanonicalSplat)
+      return false;
+    Bytes.insert(Bytes.end(), Size, (uint8_t)CI->getZExtValue());
+    return true;
+
+  }
+
+  if(IVS.SetType != ValSetTypeScalar)
+    return false;
+  if(!(isa<ConstantInt>(C) || isa<ConstantFP>(C) || isa<ConstantDataSequential>(C) || isa<ConstantAggregateZero>(C)))
+    return false;
+
+  uint64_t OldSize = Bytes.size();
+  Bytes.resize(OldSize + Size);
+  if(isa<ConstantAggregateZero>(C))
+    return true;
+  if(XXXReadDataFromGlobal(C, 0, &Bytes[OldSize], Size, *GlobalTD))
+    return true;
+
+  Bytes.resize(OldSize);
+  return false;
+
+}
+
+static void getCanonicalStore(ImprovedValSet* IV, uint64_t ASize, CanonicalStore& Out) {
+
+  SmallVector<IVSRange, 4> Raw;
+  readValRangeMultiFrom(0, ASize, IV, Raw, 0, ASize);
+
+  for(SmallVector<IVSRange, 4>::iterator it = Raw.begin(), itend = Raw.end(); it != itend; ++it) {
+
+    uint64_t Start = it->first.first, Stop = it->first.second;
+    CanonicalExtent* Last = Out.Extents.empty() ? 0 : &Out.Extents.back();
+    bool Adjacent = Last && Last->Stop == Start;
+
+    if(Adjacent && Last->isData && getExtentBytes(it->second, Stop - Start, Last->Bytes)) {
+      Last->Stop = Stop;
+      continue;
+    }
+
+    if(Adjacent && (!Last->isData) && it->second.isWhollyUnknown() && Last->Val.isWhollyUnknown() &&
+       it->second.SetType == Last->Val.SetType) {
+      Last->Stop = Stop;
+      continue;
+    }
+
+    Out.Extents.push_back(CanonicalExtent());
+    CanonicalExtent& New = Out.Extents.back();
+    New.Start = Start;
+    New.Stop = Stop;
+    New.isData = getExtentBytes(it->second, Stop - Start, New.Bytes);
+    if(!New.isData)
+      New.Val = it->second;
+
+  }
+
+  uint64_t Hash = ASize;
+  for(std::vector<CanonicalExtent>::iterator it = Out.Extents.begin(), itend = Out.Extents.end(); it != itend; ++it) {
+
+    uint64_t ExtentHash;
+    if(it->isData)
+      ExtentHash = hash_combine_range(it->Bytes.begin(), it->Bytes.end());
+    else
+      ExtentHash = getIVFingerprint(&it->Val);
+    Hash = hash_combine(Hash, it->Start, it->Stop, it->isData, ExtentHash);
+
+  }
+
+  Out.Hash = Hash;
+
+}
+
+// Do the objects whose value according to our dependencies is DepStore, and according to a
+// prospective caller is CallStore, have the same contents? The canonical form of DepStore is
+// kept with our dependencies, since it is compared against every prospective caller.
+bool InlineAttempt::storesEqualDeep(ShadowValue V, ImprovedValSet* CallStore, ImprovedValSet* DepStore) {
+
+  if((!CallStore) || !DepStore)
+    return false;
+
+  // Two singles were already compared as sets; there is no other representation of their contents.
+  if(!(CallStore->isMulti || DepStore->isMulti))
+    return false;
+
+  uint64_t ASize = CallStore->isMulti ? cast<ImprovedValSetMulti>(CallStore)->AllocSize : cast<ImprovedValSetMulti>(DepStore)->AllocSize;
+  if(CallStore->isMulti && DepStore->isMulti && cast<ImprovedValSetMulti>(DepStore)->AllocSize != ASize)
+    return false;
+  if(ASize == ULONG_MAX)
+    return false;
+
+  CanonicalStore*& DepCanon = sharing->canonicalDependencies[V];
+  if(!DepCanon) {
+    DepCanon = new CanonicalStore();
+    getCanonicalStore(DepStore, ASize, *DepCanon);
+  }
+
+  CanonicalStore CallCanon;
+  getCanonicalStore(CallStore, ASize, CallCanon);
+
+  if(CallCanon.Hash != DepCanon->Hash || CallCanon.Extents != DepCanon->Extents)
+    return false;
+
+  ++pass->stats.deepSharingMatches;
+  return true;
+
+}
 
-    if(!IVsEqualShallow(callsiteStore->store, it->second))
+static uint64_t combineArgFingerprints(const SmallVector<uint64_t, 4>& Args) {
+
+  return hash_combine_range(Args.begin(), Args.end());
+
+}
+
+uint64_t InlineAttempt::getArgsFingerprint() {
+
+  SmallVector<uint64_t, 4> Args;
+  for(uint32_t i = 0, ilim = argShadows.size(); i != ilim; ++i)
+    Args.push_back(getIVFingerprint(argShadows[i].i.PB));
+
+  return combineArgFingerprints(Args);
+
+}
+
+// Get the fingerprint an IA would need to match call SI, or return false if it can't match any.
+static bool getCallFingerprint(ShadowInstruction* SI, uint64_t& Out) {
+
+  SmallVector<uint64_t, 4> Args;
+  for(uint32_t i = 0, ilim = SI->getNumArgOperands(); i != ilim; ++i) {
+
+    uint64_t ArgFP;
+    if(!getArgFingerprint(SI->getCallArgOperand(i), ArgFP))
       return false;
+    Args.push_back(ArgFP);
 
   }
 
+  Out = combineArgFingerprints(Args);
   return true;
 
 }
@@ -308,7 +603,8 @@ void LLPEAnalysisPass::addSharableFunction(InlineAttempt* IA) {
   if(!enableSharing)
     return;
 
-  IAsByFunction[&IA->F].push_back(IA);
+  IA->sharing->argsFingerprint = IA->getArgsFingerprint();
+  IAsByFunction[std::make_pair(&IA->F, IA->sharing->argsFingerprint)].push_back(IA);
   IA->registeredSharable = true;
 
 }
@@ -318,7 +614,7 @@ void LLPEAnalysisPass::removeSharableFunction(InlineAttempt* IA) {
   if(!enableSharing)
     return;
 
-  std::vector<InlineAttempt*>& IAs = IAsByFunction[&IA->F];
+  std::vector<InlineAttempt*>& IAs = IAsByFunction[std::make_pair(&IA->F, IA->sharing->argsFingerprint)];
   std::vector<InlineAttempt*>::iterator findit = std::find(IAs.begin(), IAs.end(), IA);
   release_assert(findit != IAs.end() && "Function unshared twice?");
   IAs.erase(findit);
@@ -326,8 +622,23 @@ void LLPEAnalysisPass::removeSharableFunction(InlineAttempt* IA) {
 
 }
 
+// IA has been re-analysed, perhaps with different arguments: move it to the right bucket.
+void LLPEAnalysisPass::updateSharableFunction(InlineAttempt* IA) {
+
+  if(!enableSharing)
+    return;
+
+  if(IA->getArgsFingerprint() == IA->sharing->argsFingerprint)
+    return;
+
+  removeSharableFunction(IA);
+  addSharableFunction(IA);
+
+}
+
 // Before trying to analyse the call at SI, see if we can find an existing analysis
 // that sufficiently resembles the current circumstances to re-use.
+// Only IAs whose argument fingerprint matches need a full comparison.
 InlineAttempt* LLPEAnalysisPass::findIAMatching(ShadowInstruction* SI) {
 
   if(!enableSharing)
@@ -335,7 +646,12 @@ InlineAttempt* LLPEAnalysisPass::findIAMatching(ShadowInstruction* SI) {
   
   Function* FCalled = getCalledFunction(SI);
 
-  DenseMap<Function*, std::vector<InlineAttempt*> >::iterator findit = IAsByFunction.find(FCalled);
+  uint64_t Fingerprint;
+  if(!getCallFingerprint(SI, Fingerprint))
+    return 0;
+
+  DenseMap<std::pair<Function*, uint64_t>, std::vector<InlineAttempt*> >::iterator findit = 
+    IAsByFunction.find(std::make_pair(FCalled, Fingerprint));
   if(findit == IAsByFunction.end())
     return 0;
 
@@ -366,7 +682,11 @@ InlineAttempt* LLPEAnalysisPass::findIAMatching(ShadowInstruction* SI) {
 // to re-use an existing analysis, but at a subsequent pass it becomes clear the analysis can't actually
 // be shared.
 
-// This is currently maximally lazy: it makes a blank IA.
+// Where the analysis holds nothing that belongs to this context alone (see canCopyAnalysis), the copy
+// starts from our analysed state rather than from scratch: it keeps our block statuses and instruction
+// results, and our child calls, which become shared between us and the copy and are themselves
+// only re-analysed or unshared if the copy's circumstances turn out to differ at those callsites.
+// Otherwise it is a blank IA.
 InlineAttempt* InlineAttempt::getWritableCopyFrom(ShadowInstruction* SI) {
 
   release_assert(pass->enableSharing && "getWritableCopyFrom without sharing enabled?");
@@ -376,7 +696,88 @@ InlineAttempt* InlineAttempt::getWritableCopyFrom(ShadowInstruction* SI) {
   SmallVector<ShadowInstruction*, 1>:: iterator findit = std::find(Callers.begin(), Callers.end(), SI);
   release_assert(findit != Callers.end() && "CoW break IA with bad caller?");
   Callers.erase(findit);
+
+  ++pass->stats.sharingBreaks;
+  if(canCopyAnalysis()) {
+    copyAnalysisTo(Copy);
+    ++pass->stats.sharingBreakCopies;
+  }
   
   return Copy;
 
 }
+
+// Can getWritableCopyFrom start a copy of this context from its existing results? Not if any of them
+// might refer to objects allocated here (the copy would conflate its allocations with ours), to loop
+// iterations (which belong to us), or to failure paths and checks that are recorded against us,
+// nor if any child call's results might do the same.
+bool InlineAttempt::canCopyAnalysis() {
+
+  if(!localAllocas.empty() || !peelChildren.empty() || F.isVarArg())
+    return false;
+  if(sharing && !sharing->escapingMallocs.empty())
+    return false;
+  if(targetCallInfo || invarInfo->pathConditions || isPathCondition)
+    return false;
+  if(containsCheckedReads || (blocksReachableOnFailure && !blocksReachableOnFailure->empty()))
+    return false;
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+    if(it->second->isUnsharable())
+      return false;
+  }
+
+  return true;
+
+}
+
+// Give Copy, a fresh context for the same function, our analysis results. Each is marked changed at the
+// current round since nothing that reads them has seen them through Copy.
+void InlineAttempt::copyAnalysisTo(InlineAttempt* Copy) {
+
+  for(uint32_t i = 0, ilim = argShadows.size(); i != ilim; ++i) {
+
+    if(argShadows[i].i.PB)
+      Copy->argShadows[i].i.PB = copyIV(argShadows[i].i.PB);
+    Copy->argShadows[i].changeStamp = pass->loopRoundClock;
+
+  }
+
+  for(uint32_t i = 0; i != nBBs; ++i) {
+
+    ShadowBB* BB = BBs[i];
+    if(!BB)
+      continue;
+
+    ShadowBB* NewBB = Copy->createBB(i + BBsOffset);
+    NewBB->status = BB->status;
+    NewBB->inAnyLoop = BB->inAnyLoop;
+    for(uint32_t j = 0, jlim = BB->invar->succIdxs.size(); j != jlim; ++j)
+      NewBB->succsAlive[j] = BB->succsAlive[j];
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction* SI = &BB->insts[j];
+      ShadowInstruction* NewSI = &NewBB->insts[j];
+
+      if(SI->i.PB)
+	NewSI->i.PB = copyIV(SI->i.PB);
+      NewSI->changeStamp = pass->loopRoundClock;
+
+      if(inst_is<CallInst>(SI) || inst_is<InvokeInst>(SI)) {
+
+	if(InlineAttempt* Child = getInlineAttempt(SI)) {
+
+	  NewSI->setTypeSpecificData(Child);
+	  Child->Callers.push_back(NewSI);
+	  Child->uniqueParent = 0;
+
+	}
+
+      }
+
+    }
+
+  }
+
+}
@@ -34,6 +34,54 @@ using namespace llvm;
 // The backward walker is currently unused. The forward and backward walkers are also somewhat diverged in feature terms
 // due to the particular needs of previous subclasses.
 
+// Walkers queue each (start instruction, block) pair at most once. Nearly all items are whole
+// blocks, so rather than hashing those, the walker claims a fresh epoch number and stamps the
+// ShadowBBs it queues. A walker constructed while another owns the stamps (e.g. one started
+// from another's callback) falls back to the Visited set for everything.
+
+static uint64_t nextWalkEpoch = 1;
+static IAWalker* stampOwner = 0;
+
+IAWalker::IAWalker(void* IC, bool ign) : Epoch(nextWalkEpoch++), PList(&Worklist1), CList(&Worklist2), initialContext(IC), doIgnoreEdges(ign) {
+
+  ownsStamps = !stampOwner;
+  if(ownsStamps)
+    stampOwner = this;
+
+  Contexts.push_back(initialContext);
+
+}
+
+IAWalker::~IAWalker() {
+
+  if(ownsStamps)
+    stampOwner = 0;
+
+}
+
+// Note wl visited; returns false if it already was.
+bool IAWalker::markVisited(WLItem wl) {
+
+  ShadowBB* BB = wl.second;
+  if(ownsStamps && wl.first == wholeBlockIdx(BB)) {
+
+    if(BB->walkEpoch == Epoch)
+      return false;
+    BB->walkEpoch = Epoch;
+    return true;
+
+  }
+
+  return Visited.insert(wl).second;
+
+}
+
+uint32_t BackwardIAWalker::wholeBlockIdx(ShadowBB* BB) {
+
+  return BB->insts.size();
+
+}
+
 // Make a backward walker starting from BB / instIdx. initialCtx is an arbitrary context object passed to the visit function;
 // AlreadyVisited may mark some paths already done, and doIgnoreEdges dictates whether the visitor cares about edges
 // leading to unspecialised code.
@@ -46,11 +94,13 @@ BackwardIAWalker::BackwardIAWalker(uint32_t instIdx, ShadowBB* BB, bool skipFirs
   
   WLItem firstItem = makeWL(instIdx, BB);
 
-  if(AlreadyVisited)
-    Visited = *AlreadyVisited;
+  if(AlreadyVisited) {
+    for(DenseSet<WLItem>::iterator it = AlreadyVisited->begin(), itend = AlreadyVisited->end(); it != itend; ++it)
+      markVisited(*it);
+  }
 
   PList->push_back(std::make_pair(firstItem, initialCtx));
-  Visited.insert(firstItem);
+  markVisited(firstItem);
 
 }
 
@@ -249,7 +299,7 @@ void IAWalker::queueWalkFrom(uint32_t idx, ShadowBB* BB, void* Ctx, bool shouldC
 
   WLItem wl = makeWL(idx, BB);
 
-  if(Visited.insert(wl).second) {
+  if(markVisited(wl)) {
     if(shouldCopyContext) {
       Ctx = copyContext(Ctx);
       Contexts.push_back(Ctx);
@@ -398,7 +448,7 @@ ForwardIAWalker::ForwardIAWalker(uint32_t idx, ShadowBB* BB, bool skipFirst, voi
 
   WLItem firstWL = makeWL(idx, BB);
 
-  Visited.insert(firstWL);
+  markVisited(firstWL);
   PList->push_back(std::make_pair(firstWL, initialCtx));
   
 }
@@ -186,6 +186,87 @@ void IntegrationAttempt::findResidualFunctions(DenseSet<Function*>& ElimFunction
 
 }
 
+// How many times does BB run per entry to a context starting at EntryBB, according to the
+// block profile? Without profile data for both blocks assume once, as for a static count.
+static double getBlockProfileWeight(BasicBlock* BB, BasicBlock* EntryBB) {
+
+  DenseMap<BasicBlock*, uint64_t>& Profile = GlobalIHP->blockProfile;
+  if(Profile.empty())
+    return 1.0;
+
+  DenseMap<BasicBlock*, uint64_t>::iterator BBit = Profile.find(BB);
+  DenseMap<BasicBlock*, uint64_t>::iterator Entryit = Profile.find(EntryBB);
+  if(BBit == Profile.end() || Entryit == Profile.end())
+    return 1.0;
+
+  // Context never entered during profiling: everything in it is cold.
+  if(Entryit->second == 0)
+    return 0.0;
+
+  return ((double)BBit->second) / Entryit->second;
+
+}
+
+// The part of this context's integration goodness that doesn't come from its enabled children:
+// residual instructions count against us, and eliminated instructions in our own blocks, including
+// those of loops we won't unroll, count for us.
+int64_t IntegrationAttempt::getOwnIntegrationGoodness() {
+
+  // 1. Points for residual instructions introduced:
+  int64_t newInstPenalty = extraInstructionPoints * getResidualInstructions();
+  int64_t ownGoodness = -newInstPenalty;
+
+  // 2. Points for instructions which *would* be performed but are eliminated.
+  // This differs from the elimdInstructions value in that dead blocks are not counted
+  // since they wouldn't get run at all. With a block profile, each block's points are
+  // scaled by how often it runs per entry to this context, so cold paths earn little
+  // in return for their code size.
+
+  BasicBlock* EntryBB = getEntryBlock();
+
+  for(uint32_t i = 0; i < nBBs; ++i) {
+
+    ShadowBB* BB = BBs[i];
+    if(!BB)
+      continue;
+   
+    const ShadowLoopInvar* BBL = BB->invar->outerScope;
+    
+    if(L != BBL && ((!L) || L->contains(BBL))) {
+
+      DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator findit = peelChildren.find(immediateChildLoop(L, BBL));
+
+      // Count unexpanded loops as ours:
+      if(findit == peelChildren.end() || (!findit->second->isEnabled()) || (!findit->second->isTerminated()))
+	BBL = L;
+
+    }
+
+    if(L == BBL) {
+
+      int64_t blockPoints = 0;
+
+      for(uint32_t j = 0; j < BB->insts.size(); ++j) {
+
+	ShadowInstruction* I = &(BB->insts[j]);
+	if(willBeReplacedOrDeleted(ShadowValue(I)))
+	  blockPoints += eliminatedInstructionPoints;
+
+      }
+
+      if(blockPoints)
+	blockPoints = (int64_t)((blockPoints * getBlockProfileWeight(BB->invar->BB, EntryBB)) + 0.5);
+
+      ownGoodness += blockPoints;
+
+    }
+
+  }
+
+  return ownGoodness;
+
+}
+
 // Determine (roughly) whether it will be profitable to specialise this context.
 void PeelAttempt::findProfitableIntegration() {
 
@@ -246,56 +327,14 @@ void IntegrationAttempt::findProfitableIntegration() {
     
   }
 
-  // OK, calculate own integration goodness:
-  // 1. Points for residual instructions introduced:
-  int64_t newInstPenalty = extraInstructionPoints * getResidualInstructions();
-  totalIntegrationGoodness -= newInstPenalty;
-
-  // 2. Points for instructions which *would* be performed but are eliminated.
-  // This differs from the elimdInstructions value in that dead blocks are not counted
-  // since they wouldn't get run at all.
-
-  int64_t timeBonus = 0;
-
-  for(uint32_t i = 0; i < nBBs; ++i) {
-
-    ShadowBB* BB = BBs[i];
-    if(!BB)
-      continue;
-   
-    const ShadowLoopInvar* BBL = BB->invar->outerScope;
-    
-    if(L != BBL && ((!L) || L->contains(BBL))) {
-
-      DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator findit = peelChildren.find(immediateChildLoop(L, BBL));
-
-      // Count unexpanded loops as ours:
-      if(findit == peelChildren.end() || (!findit->second->isEnabled()) || (!findit->second->isTerminated()))
-	BBL = L;
-
-    }
-
-    if(L == BBL) {
-
-      for(uint32_t j = 0; j < BB->insts.size(); ++j) {
-
-	ShadowInstruction* I = &(BB->insts[j]);
-	if(willBeReplacedOrDeleted(ShadowValue(I))) {
-	  totalIntegrationGoodness += eliminatedInstructionPoints;
-	  timeBonus += eliminatedInstructionPoints;
-	}
-
-      }
-
-    }
-
-  }
+  // OK, add our own integration goodness:
+  totalIntegrationGoodness += getOwnIntegrationGoodness();
 
   integrationGoodnessValid = true;
 
   intBenefitProgress();
 
-  //errs() << getShortHeader() << ": int-goodness " << totalIntegrationGoodness << " (child: " << childIntegrationGoodness << ", codesize: " << newInstPenalty << ", timebonus: " << timeBonus << ")\n";
+  //errs() << getShortHeader() << ": int-goodness " << totalIntegrationGoodness << " (child: " << childIntegrationGoodness << ")\n";
 
 }
 
@@ -320,6 +359,40 @@ void InlineAttempt::findProfitableIntegration() {
 
 }
 
+// Context Child has been enabled or disabled after findProfitableIntegration, for example from the
+// GUI, changing our goodness by Delta. Rather than recomputing whole subtrees, adjust the totals along
+// the path to the root, stopping at contexts that haven't been evaluated, are disabled (and so don't
+// count towards their parent) or are shared (and so have no unique parent).
+void IntegrationAttempt::updateIntegrationGoodness(int64_t Delta) {
+
+  if(!integrationGoodnessValid)
+    return;
+
+  totalIntegrationGoodness += Delta;
+
+  if(!isEnabled())
+    return;
+
+  // Loop iterations count towards their PeelAttempt rather than directly to the enclosing context.
+  if(L)
+    ((PeelIteration*)this)->getParentPA()->updateIntegrationGoodness(Delta);
+  else if(IntegrationAttempt* Parent = getUniqueParent())
+    Parent->updateIntegrationGoodness(Delta);
+
+}
+
+void PeelAttempt::updateIntegrationGoodness(int64_t Delta) {
+
+  if(!integrationGoodnessValid)
+    return;
+
+  totalIntegrationGoodness += Delta;
+
+  if(enabled)
+    parent->updateIntegrationGoodness(Delta);
+
+}
+
 // Does this instruction count for accounting / performance measurement? Essentially: can this possibly be improved?
 bool llvm::instructionCounts(Instruction* I) {
 
@@ -9,35 +9,39 @@
 
 #include "llvm/Analysis/LLPE.h"
 
-// A clone of part of the LLVM base constant folder, specialised to work over ImprovedVals instead of Constants.
-bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, SmallVector<uint64_t, 4>& OpInts, ValSetType& ImpType, ImprovedVal& Improved) {
+#include "llvm/IR/InstrTypes.h"
 
-  ImpType = ValSetTypeScalar;
+using namespace llvm;
+
+// A clone of part of the LLVM base constant folder, specialised to work over integers instead of Constants.
+// Fold SI over the NumOps integers OpInts, of bit widths OpWidths. Returns false if the operation isn't
+// handled here; otherwise sets Result, or Undef if the result is undefined.
+static bool foldInts(ShadowInstruction* SI, uint32_t NumOps, const uint64_t* OpInts, const uint32_t* OpWidths, uint64_t& Result, bool& Undef) {
+
+  Undef = false;
 
-  if(OpInts.size() == 1) {
+  if(NumOps == 1) {
 
     // Note that because only integers are handled this way at the moment
     // none of the int <-> FP casts are handled.
     // Bitcast, ptrtoint and inttoptr are all handled on different paths.
     // That only leaves extension and truncation of integers!
 
-    Type* DestTy = SI->getType();
-    uint32_t DestBitWidth = cast<IntegerType>(DestTy)->getBitWidth();
-    IntegerType* SourceTy = cast<IntegerType>(Ops[0].second.V.getNonPointerType());
-    APInt SourceAP(SourceTy->getBitWidth(), OpInts[0]);
+    uint32_t DestBitWidth = cast<IntegerType>(SI->getType())->getBitWidth();
+    APInt SourceAP(OpWidths[0], OpInts[0]);
       
     switch (SI->invar->I->getOpcode()) {
 
     default:
       return false;
     case Instruction::ZExt:
-      Improved = ImprovedVal(ShadowValue::getInt(DestTy, SourceAP.zext(DestBitWidth).getLimitedValue()));
+      Result = SourceAP.zext(DestBitWidth).getLimitedValue();
       break;
     case Instruction::SExt:
-      Improved = ImprovedVal(ShadowValue::getInt(DestTy, SourceAP.sext(DestBitWidth).getLimitedValue()));
+      Result = SourceAP.sext(DestBitWidth).getLimitedValue();
       break;
     case Instruction::Trunc:
-      Improved = ImprovedVal(ShadowValue::getInt(DestTy, SourceAP.trunc(DestBitWidth).getLimitedValue()));
+      Result = SourceAP.trunc(DestBitWidth).getLimitedValue();
       break;
 
     }
@@ -45,75 +49,94 @@ bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal
     return true;
 
   }
-  else if(OpInts.size() == 2) {
+  else if(NumOps == 2) {
 
-    const APInt C1V(cast<IntegerType>(SI->getOperand(0).getNonPointerType())->getBitWidth(), OpInts[0]);
-    const APInt C2V(cast<IntegerType>(SI->getOperand(1).getNonPointerType())->getBitWidth(), OpInts[1]);
+    const APInt C1V(OpWidths[0], OpInts[0]);
+    const APInt C2V(OpWidths[1], OpInts[1]);
     switch (SI->invar->I->getOpcode()) {
     default:
       return false;
+    case Instruction::ICmp: {
+      bool BoolResult;
+      switch(cast<CmpInst>(SI->invar->I)->getPredicate()) {
+      default:
+	return false;
+      case CmpInst::ICMP_EQ:  BoolResult = C1V.eq(C2V); break;
+      case CmpInst::ICMP_NE:  BoolResult = C1V.ne(C2V); break;
+      case CmpInst::ICMP_UGT: BoolResult = C1V.ugt(C2V); break;
+      case CmpInst::ICMP_UGE: BoolResult = C1V.uge(C2V); break;
+      case CmpInst::ICMP_ULT: BoolResult = C1V.ult(C2V); break;
+      case CmpInst::ICMP_ULE: BoolResult = C1V.ule(C2V); break;
+      case CmpInst::ICMP_SGT: BoolResult = C1V.sgt(C2V); break;
+      case CmpInst::ICMP_SGE: BoolResult = C1V.sge(C2V); break;
+      case CmpInst::ICMP_SLT: BoolResult = C1V.slt(C2V); break;
+      case CmpInst::ICMP_SLE: BoolResult = C1V.sle(C2V); break;
+      }
+      Result = BoolResult;
+      break;
+    }
     case Instruction::Add:     
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), (C1V + C2V).getLimitedValue()));
+      Result = (C1V + C2V).getLimitedValue();
       break;
     case Instruction::Sub:     
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), (C1V - C2V).getLimitedValue()));
+      Result = (C1V - C2V).getLimitedValue();
       break;
     case Instruction::Mul:     
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), (C1V * C2V).getLimitedValue()));
+      Result = (C1V * C2V).getLimitedValue();
       break;
     case Instruction::UDiv:
       assert(C2V != 0 && "Div by zero not handled yet");
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), C1V.udiv(C2V).getLimitedValue()));
+      Result = C1V.udiv(C2V).getLimitedValue();
       break;
     case Instruction::SDiv:
       assert(C2V != 0 && "Div by zero not handled yet");
       if (C2V.isAllOnesValue() && C1V.isMinSignedValue())
-	Improved = ImprovedVal(ShadowValue(UndefValue::get(SI->getType())));   // MIN_INT / -1 -> undef
+	Undef = true;   // MIN_INT / -1 -> undef
       else
-	Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), C1V.sdiv(C2V).getLimitedValue()));
+	Result = C1V.sdiv(C2V).getLimitedValue();
       break;
     case Instruction::URem:
       assert(C2V != 0 && "Div by zero not handled yet");
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), C1V.urem(C2V).getLimitedValue()));
+      Result = C1V.urem(C2V).getLimitedValue();
       break;
     case Instruction::SRem:
       assert(C2V != 0 && "Div by zero not handled yet");
       if (C2V.isAllOnesValue() && C1V.isMinSignedValue())
-	Improved = ImprovedVal(ShadowValue(UndefValue::get(SI->getType())));   // MIN_INT % -1 -> undef
+	Undef = true;   // MIN_INT % -1 -> undef
       else
-	Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), C1V.srem(C2V).getLimitedValue()));
+	Result = C1V.srem(C2V).getLimitedValue();
       break;
     case Instruction::And:
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), (C1V & C2V).getLimitedValue()));
+      Result = (C1V & C2V).getLimitedValue();
       break;
     case Instruction::Or:
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), (C1V | C2V).getLimitedValue()));
+      Result = (C1V | C2V).getLimitedValue();
       break;
     case Instruction::Xor:
-      Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), (C1V ^ C2V).getLimitedValue()));
+      Result = (C1V ^ C2V).getLimitedValue();
       break;
     case Instruction::Shl: {
       uint32_t shiftAmt = C2V.getZExtValue();
       if (shiftAmt < C1V.getBitWidth())
-	Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), C1V.shl(shiftAmt).getLimitedValue()));
+	Result = C1V.shl(shiftAmt).getLimitedValue();
       else
-	Improved = ImprovedVal(ShadowValue(UndefValue::get(SI->getType()))); // too big shift is undef
+	Undef = true; // too big shift is undef
       break;
     }
     case Instruction::LShr: {
       uint32_t shiftAmt = C2V.getZExtValue();
       if (shiftAmt < C1V.getBitWidth())
-	Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), C1V.lshr(shiftAmt).getLimitedValue()));
+	Result = C1V.lshr(shiftAmt).getLimitedValue();
       else
-	Improved = ImprovedVal(ShadowValue(UndefValue::get(SI->getType()))); // too big shift is undef
+	Undef = true; // too big shift is undef
       break;
     }
     case Instruction::AShr: {
       uint32_t shiftAmt = C2V.getZExtValue();
       if (shiftAmt < C1V.getBitWidth())
-	Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), C1V.ashr(shiftAmt).getLimitedValue()));
+	Result = C1V.ashr(shiftAmt).getLimitedValue();
       else
-	Improved = ImprovedVal(ShadowValue(UndefValue::get(SI->getType()))); // too big shift is undef
+	Undef = true; // too big shift is undef
       break;
     }
     }
@@ -125,3 +148,566 @@ bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal
   return false;
 
 }
+
+bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, SmallVector<uint64_t, 4>& OpInts, ValSetType& ImpType, ImprovedVal& Improved) {
+
+  uint32_t OpWidths[2];
+  if(OpInts.size() == 1)
+    OpWidths[0] = cast<IntegerType>(Ops[0].second.V.getNonPointerType())->getBitWidth();
+  else if(OpInts.size() == 2) {
+    OpWidths[0] = cast<IntegerType>(SI->getOperand(0).getNonPointerType())->getBitWidth();
+    OpWidths[1] = cast<IntegerType>(SI->getOperand(1).getNonPointerType())->getBitWidth();
+  }
+  else
+    return false;
+
+  uint64_t Result;
+  bool Undef;
+  if(!foldInts(SI, OpInts.size(), &OpInts[0], OpWidths, Result, Undef))
+    return false;
+
+  ImpType = ValSetTypeScalar;
+  if(Undef)
+    Improved = ImprovedVal(ShadowValue(UndefValue::get(SI->getType())));
+  else
+    Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), Result));
+  return true;
+
+}
+
+// Get V, which should be an integer of type Ty, in Out.
+static bool getFoldableInt(ShadowValue V, Type* Ty, uint64_t& Out) {
+
+  return tryGetConstantInt(V, Out) && V.getNonPointerType() == Ty;
+
+}
+
+// Integer intervals: a set of integers that outgrows GlobalPBMax is kept as overdef together with the
+// range its values lie within, taken as signed (see ImprovedValSetSingle::setOverdefRange), so that
+// comparisons against it, such as loop-bound and table-index checks, can still be decided. Ranges pass
+// through add, sub, mul, shifts, the bitwise ops, unsigned division and remainder and integer casts;
+// anything that might wrap, and any other operation, loses them. New ranges are only made outside the
+// general loop fixpoint (see GlobalIntRanges), but existing ones are used everywhere.
+
+struct IntRange {
+
+  int64_t Lo;
+  int64_t Hi;
+
+IntRange() : Lo(0), Hi(0) { }
+IntRange(int64_t L, int64_t H) : Lo(L), Hi(H) { }
+
+};
+
+static int64_t signExtendInt(uint64_t V, uint32_t Bits) {
+
+  if(Bits >= 64)
+    return (int64_t)V;
+  return ((int64_t)(V << (64 - Bits))) >> (64 - Bits);
+
+}
+
+static bool fitsSigned(int64_t V, uint32_t Bits) {
+
+  if(Bits >= 64)
+    return true;
+  int64_t Limit = ((int64_t)1) << (Bits - 1);
+  return V >= -Limit && V < Limit;
+
+}
+
+static void extendRange(IntRange& R, int64_t V) {
+
+  R.Lo = std::min(R.Lo, V);
+  R.Hi = std::max(R.Hi, V);
+
+}
+
+// Get the range of integer operand OpV, of width Bits: a constant, a set of constants or a range.
+static bool getOperandRange(ShadowValue OpV, IntegerType* OpTy, IntRange& R) {
+
+  uint32_t Bits = OpTy->getBitWidth();
+  uint64_t OpInt;
+
+  if(OpV.isInst() || OpV.isArg()) {
+
+    ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(getIVSRef(OpV));
+    if(!IVS)
+      return false;
+
+    if(IVS->hasRange()) {
+      if(IVS->RangeBits != Bits)
+	return false;
+      R = IntRange(IVS->RangeLo, IVS->RangeHi);
+      return true;
+    }
+
+    if(IVS->isWhollyUnknown() || IVS->SetType != ValSetTypeScalar)
+      return false;
+
+    for(uint32_t i = 0, ilim = IVS->Values.size(); i != ilim; ++i) {
+      if(!getFoldableInt(IVS->Values[i].V, OpTy, OpInt))
+	return false;
+      int64_t V = signExtendInt(OpInt, Bits);
+      if(i == 0)
+	R = IntRange(V, V);
+      else
+	extendRange(R, V);
+    }
+
+    return true;
+
+  }
+  else if(getFoldableInt(OpV, OpTy, OpInt)) {
+
+    int64_t V = signExtendInt(OpInt, Bits);
+    R = IntRange(V, V);
+    return true;
+
+  }
+
+  return false;
+
+}
+
+// The unsigned image of R, if it's contiguous (R doesn't span -1 to 0).
+static bool getUnsignedRange(const IntRange& R, uint32_t Bits, uint64_t& Lo, uint64_t& Hi) {
+
+  if(R.Lo < 0 && R.Hi >= 0)
+    return false;
+
+  uint64_t Mask = Bits >= 64 ? ~(uint64_t)0 : ((((uint64_t)1) << Bits) - 1);
+  Lo = ((uint64_t)R.Lo) & Mask;
+  Hi = ((uint64_t)R.Hi) & Mask;
+  return true;
+
+}
+
+// Decide comparison Pred between ranges A and B. Returns 1 or 0 if it's certainly true or false, -1 if not known.
+static int decideRangeCmp(CmpInst::Predicate Pred, const IntRange& A, const IntRange& B, uint32_t Bits) {
+
+  switch(Pred) {
+
+  case CmpInst::ICMP_EQ:
+  case CmpInst::ICMP_NE:
+    {
+      int Eq;
+      if(A.Hi < B.Lo || B.Hi < A.Lo)
+	Eq = 0;
+      else if(A.Lo == A.Hi && B.Lo == B.Hi)
+	Eq = 1;
+      else
+	return -1;
+      return Pred == CmpInst::ICMP_EQ ? Eq : !Eq;
+    }
+  case CmpInst::ICMP_SLT:
+    return A.Hi < B.Lo ? 1 : (A.Lo >= B.Hi ? 0 : -1);
+  case CmpInst::ICMP_SLE:
+    return A.Hi <= B.Lo ? 1 : (A.Lo > B.Hi ? 0 : -1);
+  case CmpInst::ICMP_SGT:
+    return A.Lo > B.Hi ? 1 : (A.Hi <= B.Lo ? 0 : -1);
+  case CmpInst::ICMP_SGE:
+    return A.Lo >= B.Hi ? 1 : (A.Hi < B.Lo ? 0 : -1);
+  default:
+    break;
+
+  }
+
+  uint64_t ALo, AHi, BLo, BHi;
+  if((!getUnsignedRange(A, Bits, ALo, AHi)) || !getUnsignedRange(B, Bits, BLo, BHi))
+    return -1;
+
+  switch(Pred) {
+  case CmpInst::ICMP_ULT:
+    return AHi < BLo ? 1 : (ALo >= BHi ? 0 : -1);
+  case CmpInst::ICMP_ULE:
+    return AHi <= BLo ? 1 : (ALo > BHi ? 0 : -1);
+  case CmpInst::ICMP_UGT:
+    return ALo > BHi ? 1 : (AHi <= BLo ? 0 : -1);
+  case CmpInst::ICMP_UGE:
+    return ALo >= BHi ? 1 : (AHi < BLo ? 0 : -1);
+  default:
+    return -1;
+  }
+
+}
+
+// The smallest all-ones mask covering non-negative V.
+static int64_t coveringMask(int64_t V) {
+
+  uint64_t M = (uint64_t)V;
+  M |= M >> 1;
+  M |= M >> 2;
+  M |= M >> 4;
+  M |= M >> 8;
+  M |= M >> 16;
+  M |= M >> 32;
+  return (int64_t)M;
+
+}
+
+// Set R to the range of A op B over the four corners, if none overflows Bits. Op is 0 for mul, 1 for shl.
+static bool cornerRange(int Op, const IntRange& A, const IntRange& B, uint32_t Bits, IntRange& R) {
+
+  int64_t As[2] = { A.Lo, A.Hi };
+  int64_t Bs[2] = { B.Lo, B.Hi };
+
+  for(uint32_t i = 0; i != 4; ++i) {
+
+    int64_t X = As[i & 1], Y = Bs[i >> 1], V;
+    if(Op == 1) {
+      if(__builtin_mul_overflow(X, ((int64_t)1) << Y, &V))
+	return false;
+    }
+    else if(__builtin_mul_overflow(X, Y, &V)) {
+      return false;
+    }
+
+    if(!fitsSigned(V, Bits))
+      return false;
+
+    if(i == 0)
+      R = IntRange(V, V);
+    else
+      extendRange(R, V);
+
+  }
+
+  return true;
+
+}
+
+// The bits known in every member of R, of width Bits: those in the common prefix of its unsigned
+// image's bounds. If R spans -1 to 0 its top bit differs, so nothing is known.
+static void getRangeKnownBits(const IntRange& R, uint32_t Bits, uint64_t& Zero, uint64_t& One) {
+
+  uint64_t Mask = Bits >= 64 ? ~(uint64_t)0 : ((((uint64_t)1) << Bits) - 1);
+  uint64_t Lo = ((uint64_t)R.Lo) & Mask;
+  uint64_t Hi = ((uint64_t)R.Hi) & Mask;
+
+  uint64_t Known = ~((uint64_t)coveringMask((int64_t)(Lo ^ Hi))) & Mask;
+  One = Lo & Known;
+  Zero = (~Lo) & Known;
+
+}
+
+// The range of values with known bits Zero and One, if its sign bit is known.
+static bool getKnownBitsRange(uint64_t Zero, uint64_t One, uint32_t Bits, IntRange& R) {
+
+  uint64_t Mask = Bits >= 64 ? ~(uint64_t)0 : ((((uint64_t)1) << Bits) - 1);
+  uint64_t Unknown = (~(Zero | One)) & Mask;
+  if(Unknown & (((uint64_t)1) << (Bits - 1)))
+    return false;
+
+  R = IntRange(signExtendInt(One, Bits), signExtendInt(One | Unknown, Bits));
+  return true;
+
+}
+
+// And, or and xor over ranges: the usual bounds, narrowed by the bits known in each operand, so that
+// e.g. masking the flag bits out of a word whose high bits are known gives the same answer every time.
+static bool foldBitwiseRanges(unsigned Opcode, const IntRange& A, const IntRange& B, uint32_t Bits, IntRange& R) {
+
+  bool haveBound = true;
+
+  if(Opcode == Instruction::And) {
+    if(A.Lo >= 0 && B.Lo >= 0)
+      R = IntRange(0, std::min(A.Hi, B.Hi));
+    else if(A.Lo >= 0)
+      R = IntRange(0, A.Hi);
+    else if(B.Lo >= 0)
+      R = IntRange(0, B.Hi);
+    else
+      haveBound = false;
+  }
+  else if(A.Lo < 0 || B.Lo < 0) {
+    haveBound = false;
+  }
+  else {
+    R = IntRange(Opcode == Instruction::Or ? std::max(A.Lo, B.Lo) : 0, coveringMask(std::max(A.Hi, B.Hi)));
+  }
+
+  uint64_t AZero, AOne, BZero, BOne, Zero, One;
+  getRangeKnownBits(A, Bits, AZero, AOne);
+  getRangeKnownBits(B, Bits, BZero, BOne);
+
+  if(Opcode == Instruction::And) {
+    Zero = AZero | BZero;
+    One = AOne & BOne;
+  }
+  else if(Opcode == Instruction::Or) {
+    Zero = AZero & BZero;
+    One = AOne | BOne;
+  }
+  else {
+    Zero = (AZero & BZero) | (AOne & BOne);
+    One = (AZero & BOne) | (AOne & BZero);
+  }
+
+  IntRange KnownR;
+  if(!getKnownBitsRange(Zero, One, Bits, KnownR))
+    return haveBound;
+
+  if(haveBound)
+    R = IntRange(std::max(R.Lo, KnownR.Lo), std::min(R.Hi, KnownR.Hi));
+  else
+    R = KnownR;
+  return true;
+
+}
+
+// Transfer function for SI over operand ranges Ops, of width Bits. Returns false if the result can't be bounded.
+static bool foldIntRanges(ShadowInstruction* SI, const IntRange* Ops, uint32_t Bits, IntRange& R) {
+
+  const IntRange& A = Ops[0];
+  const IntRange& B = Ops[1];
+  uint32_t DestBits = cast<IntegerType>(SI->getType())->getBitWidth();
+
+  switch(SI->invar->I->getOpcode()) {
+
+  case Instruction::SExt:
+    R = A;
+    return true;
+  case Instruction::ZExt:
+    if(A.Lo >= 0) {
+      R = A;
+      return true;
+    }
+    if(A.Hi < 0 && Bits < 63 && DestBits > Bits) {
+      int64_t Wrap = ((int64_t)1) << Bits;
+      R = IntRange(A.Lo + Wrap, A.Hi + Wrap);
+      return true;
+    }
+    return false;
+  case Instruction::Trunc:
+    R = A;
+    return fitsSigned(A.Lo, DestBits) && fitsSigned(A.Hi, DestBits);
+
+  case Instruction::Add:
+    return !(__builtin_add_overflow(A.Lo, B.Lo, &R.Lo) || __builtin_add_overflow(A.Hi, B.Hi, &R.Hi) ||
+	     !fitsSigned(R.Lo, Bits) || !fitsSigned(R.Hi, Bits));
+  case Instruction::Sub:
+    return !(__builtin_sub_overflow(A.Lo, B.Hi, &R.Lo) || __builtin_sub_overflow(A.Hi, B.Lo, &R.Hi) ||
+	     !fitsSigned(R.Lo, Bits) || !fitsSigned(R.Hi, Bits));
+  case Instruction::Mul:
+    return cornerRange(0, A, B, Bits, R);
+  case Instruction::Shl:
+    if(B.Lo < 0 || B.Hi >= (int64_t)Bits || B.Hi >= 63)
+      return false;
+    return cornerRange(1, A, B, Bits, R);
+  case Instruction::LShr:
+    if(A.Lo < 0 || B.Lo < 0 || B.Hi >= (int64_t)Bits)
+      return false;
+    R = IntRange(A.Lo >> B.Hi, A.Hi >> B.Lo);
+    return true;
+  case Instruction::AShr:
+    if(B.Lo < 0 || B.Hi >= (int64_t)Bits)
+      return false;
+    R = IntRange(std::min(A.Lo >> B.Lo, A.Lo >> B.Hi), std::max(A.Hi >> B.Lo, A.Hi >> B.Hi));
+    return true;
+
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+    return foldBitwiseRanges(SI->invar->I->getOpcode(), A, B, Bits, R);
+
+  case Instruction::UDiv:
+    if(A.Lo < 0 || B.Lo <= 0)
+      return false;
+    R = IntRange(A.Lo / B.Hi, A.Hi / B.Lo);
+    return true;
+  case Instruction::URem:
+    if(A.Lo < 0 || B.Lo <= 0)
+      return false;
+    R = IntRange(0, std::min(A.Hi, B.Hi - 1));
+    return true;
+
+  default:
+    return false;
+
+  }
+
+}
+
+// Fold SI, at least one of whose operands is a range, the others being sets or constants as for IHPFoldIntSets.
+static bool foldWithRanges(ShadowInstruction* SI, uint32_t NumOps, ImprovedValSetSingle& NewPB) {
+
+  IntRange Ops[2];
+  uint32_t Bits = 0;
+
+  for(uint32_t i = 0; i != NumOps; ++i) {
+    IntegerType* OpTy = cast<IntegerType>(SI->invar->I->getOperand(i)->getType());
+    if(!getOperandRange(SI->getOperand(i), OpTy, Ops[i]))
+      return false;
+    Bits = OpTy->getBitWidth();
+  }
+
+  if(SI->invar->evalKind == EVALKIND_ICMP) {
+
+    if(NumOps != 2)
+      return false;
+
+    int Result = decideRangeCmp(cast<CmpInst>(SI->invar->I)->getPredicate(), Ops[0], Ops[1], Bits);
+    if(Result == -1)
+      return false;
+
+    ++GlobalIHP->stats.intRangeCmpFolds;
+    NewPB.set(ImprovedVal(ShadowValue::getInt(SI->getType(), (uint64_t)Result)), ValSetTypeScalar);
+    return true;
+
+  }
+
+  if(!GlobalIntRanges)
+    return false;
+
+  IntRange R;
+  if(!foldIntRanges(SI, Ops, Bits, R))
+    return false;
+
+  uint32_t DestBits = cast<IntegerType>(SI->getType())->getBitWidth();
+  if(R.Lo == R.Hi)
+    NewPB.set(ImprovedVal(ShadowValue::getInt(SI->getType(), (uint64_t)R.Lo)), ValSetTypeScalar);
+  else
+    NewPB.setOverdefRange(DestBits, R.Lo, R.Hi);
+  return true;
+
+}
+
+// Phi and select merges of integer sets that outgrow GlobalPBMax, leaving NewPB overdef: give it the range
+// covering every incoming value, if they are all integer constants, sets or ranges.
+void llvm::IHPMergeIntRanges(SmallVector<ShadowValue, 4>& Vals, ImprovedValSetSingle& NewPB) {
+
+  if((!GlobalIntRanges) || Vals.empty())
+    return;
+
+  IntegerType* Ty = dyn_cast<IntegerType>(Vals[0].getNonPointerType());
+  if((!Ty) || Ty->getBitWidth() > 64)
+    return;
+
+  IntRange R;
+  for(uint32_t i = 0, ilim = Vals.size(); i != ilim; ++i) {
+
+    IntRange ValR;
+    if(!getOperandRange(Vals[i], Ty, ValR))
+      return;
+
+    if(i == 0)
+      R = ValR;
+    else {
+      extendRange(R, ValR.Lo);
+      extendRange(R, ValR.Hi);
+    }
+
+  }
+
+  NewPB.setOverdefRange(Ty->getBitWidth(), R.Lo, R.Hi);
+
+}
+
+// Fold SI over every combination of its operands' values where each is a set of integers,
+// as tryEvaluateOrdinaryInst would one combination at a time, but deduplicating results as plain integers
+// so that a ShadowValue (and for unusual widths, a ConstantInt) is only made for each distinct result.
+// Returns false, leaving NewPB alone, if any operand isn't a known integer set or any combination isn't
+// handled by foldInts, which the general path must then deal with. Operands that are ranges, and results
+// too many for a set, are handled as ranges (see above).
+bool llvm::IHPFoldIntSets(ShadowInstruction* SI, ImprovedValSetSingle& NewPB) {
+
+  uint8_t evalKind = SI->invar->evalKind;
+  if(!(evalKind == EVALKIND_INTCAST || evalKind == EVALKIND_ICMP || 
+       evalKind == EVALKIND_PTRARITH || evalKind == EVALKIND_INTOP))
+    return false;
+
+  uint32_t NumOps = SI->getNumOperands();
+  if(NumOps == 0 || NumOps > 2 || !SI->getType()->isIntegerTy())
+    return false;
+
+  SmallVector<uint64_t, 4> OpSets[2];
+  uint32_t OpWidths[2];
+  bool anyRange = false;
+
+  for(uint32_t i = 0; i != NumOps; ++i) {
+
+    IntegerType* OpTy = dyn_cast<IntegerType>(SI->invar->I->getOperand(i)->getType());
+    if((!OpTy) || OpTy->getBitWidth() > 64)
+      return false;
+    OpWidths[i] = OpTy->getBitWidth();
+
+    ShadowValue OpV = SI->getOperand(i);
+    uint64_t OpInt;
+
+    if(OpV.isInst() || OpV.isArg()) {
+
+      ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(getIVSRef(OpV));
+      if(IVS && IVS->hasRange()) {
+	anyRange = true;
+	continue;
+      }
+
+      if((!IVS) || IVS->isWhollyUnknown() || IVS->SetType != ValSetTypeScalar)
+	return false;
+
+      for(uint32_t j = 0, jlim = IVS->Values.size(); j != jlim; ++j) {
+	if(!getFoldableInt(IVS->Values[j].V, OpTy, OpInt))
+	  return false;
+	OpSets[i].push_back(OpInt);
+      }
+
+    }
+    else if(getFoldableInt(OpV, OpTy, OpInt)) {
+      OpSets[i].push_back(OpInt);
+    }
+    else {
+      return false;
+    }
+
+  }
+
+  if(anyRange)
+    return foldWithRanges(SI, NumOps, NewPB);
+
+  // A unary operation pairs each operand with a dummy second operand.
+  if(NumOps == 1)
+    OpSets[1].push_back(0);
+
+  // One more than GlobalPBMax results is enough to know the result is overdefined, unless it
+  // may become a range, when every combination must be seen to find the bounds.
+  SmallVector<uint64_t, 16> Results;
+  bool keepRange = GlobalIntRanges;
+  uint32_t ResBits = cast<IntegerType>(SI->getType())->getBitWidth();
+  IntRange ResRange;
+
+  for(uint32_t i = 0, ilim = OpSets[0].size(); i != ilim && (keepRange || Results.size() <= GlobalPBMax); ++i) {
+
+    for(uint32_t j = 0, jlim = OpSets[1].size(); j != jlim && (keepRange || Results.size() <= GlobalPBMax); ++j) {
+
+      uint64_t Ints[2] = { OpSets[0][i], OpSets[1][j] };
+      uint64_t Result;
+      bool Undef;
+      if((!foldInts(SI, NumOps, Ints, OpWidths, Result, Undef)) || Undef)
+	return false;
+
+      int64_t SResult = signExtendInt(Result, ResBits);
+      if(i == 0 && j == 0)
+	ResRange = IntRange(SResult, SResult);
+      else
+	extendRange(ResRange, SResult);
+
+      if(Results.size() <= GlobalPBMax && std::find(Results.begin(), Results.end(), Result) == Results.end())
+	Results.push_back(Result);
+
+    }
+
+  }
+
+  if(keepRange && Results.size() > GlobalPBMax) {
+    NewPB.setOverdefRange(ResBits, ResRange.Lo, ResRange.Hi);
+    return true;
+  }
+
+  Type* ResTy = SI->getType();
+  for(uint32_t i = 0, ilim = Results.size(); i != ilim && !NewPB.Overdef; ++i)
+    NewPB.mergeOne(ValSetTypeScalar, ImprovedVal(ShadowValue::getInt(ResTy, Results[i])));
+
+  return true;
+
+}
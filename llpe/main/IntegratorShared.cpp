@@ -195,7 +195,7 @@ std::pair<ValSetType, ImprovedVal> llvm::getValPB(Value* V) {
 	if(!Op1.second.V.isGV())
 	  break;
 
-	uint64_t GlobalAlign = Op1.second.V.u.GV->G->getAlignment();
+	uint64_t GlobalAlign = getGlobalAlignment(Op1.second.V.u.GV->G);
 	if(GlobalAlign == 0 || GlobalAlign == 1)
 	  break;
 
@@ -310,17 +310,23 @@ static Function* getReplacementFunction(ShadowValue CCalledV) {
 
 }
 
-Function* llvm::getCalledFunction(ShadowInstruction* SI) {
-
-  ShadowValue Op;
+static ShadowValue getCalledOperand(ShadowInstruction* SI) {
 
   if(inst_is<CallInst>(SI))
-    Op = SI->getOperandFromEnd(1);
+    return SI->getOperandFromEnd(1);
   else if(inst_is<InvokeInst>(SI))
-    Op = SI->getOperandFromEnd(3);
+    return SI->getOperandFromEnd(3);
   else
     release_assert(0 && "getCalledFunction called on non-call, non-invoke inst");
 
+  return ShadowValue();
+
+}
+
+Function* llvm::getCalledFunction(ShadowInstruction* SI) {
+
+  ShadowValue Op = getCalledOperand(SI);
+
   // Shouldn't usually happen, but isCopyInst() called from the DOT printer
   // can run into this situation when drawing in-loop blocks from an outer context.
   if(Op.isInval())
@@ -330,6 +336,42 @@ Function* llvm::getCalledFunction(ShadowInstruction* SI) {
 
 }
 
+// For an indirect call with no single target, find the functions it might call. Succeeds if the callee
+// is known to be one of at most maxCandidates functions (null aside), returned in Candidates.
+bool llvm::getCalledFunctionCandidates(ShadowInstruction* SI, SmallVector<Function*, 4>& Candidates, uint32_t maxCandidates) {
+
+  ShadowValue Op = getCalledOperand(SI);
+  if(Op.isInval())
+    return false;
+
+  ImprovedValSetSingle PB;
+  if((!getImprovedValSetSingle(Op.stripPointerCasts(), PB)) || PB.Overdef)
+    return false;
+
+  for(unsigned i = 0; i < PB.Values.size(); ++i) {
+
+    Constant* ThisVal = dyn_cast_or_null<Constant>(PB.Values[i].V.getVal());
+    if(!ThisVal)
+      return false;
+    if(ThisVal->isNullValue())
+      continue;
+
+    Function* F = dyn_cast<Function>(ThisVal->stripPointerCasts());
+    if((!F) || (PB.SetType == ValSetTypePB && PB.Values[i].Offset != 0))
+      return false;
+
+    if(std::find(Candidates.begin(), Candidates.end(), F) == Candidates.end())
+      Candidates.push_back(F);
+
+    if(Candidates.size() > maxCandidates)
+      return false;
+
+  }
+
+  return !Candidates.empty();
+
+}
+
 bool ImprovedValSetSingle::dropReference() {
 
   // Singles can never be shared
@@ -352,7 +394,7 @@ bool ImprovedValSetMulti::dropReference() {
     if(Underlying)
       Underlying->dropReference();
     
-    delete this;
+    deleteIVM(this);
 
   }
   else {
@@ -415,7 +457,9 @@ void llvm::printPB(raw_ostream& out, ImprovedValSetSingle PB, bool brief) {
     out << "Old-overdef"; return;
   }
 
-  if(PB.Overdef)
+  if(PB.hasRange())
+    out << "Overdef [" << PB.RangeLo << ", " << PB.RangeHi << "] i" << PB.RangeBits;
+  else if(PB.Overdef)
     out << "Overdef";
   else {
     out << "{ ";
@@ -442,3 +486,13 @@ void llvm::printPB(raw_ostream& out, ImprovedValSetSingle PB, bool brief) {
 const DataLayout* llvm::GlobalTD;
 TargetLibraryInfo* llvm::GlobalTLI;
 LLPEAnalysisPass* llvm::GlobalIHP;
+uint32_t llvm::GlobalPBMax = PBMAX;
+bool llvm::GlobalIntRanges = true;
+
+AllocCounter llvm::GlobalIVSCounter;
+AllocCounter llvm::GlobalMultiCounter;
+AllocCounter llvm::GlobalTreeNodeCounter;
+AllocCounter llvm::GlobalStoreMapCounter;
+AllocCounter llvm::GlobalFrameChunkCounter;
+AllocCounter llvm::GlobalContextCounter;
+MergeSharingCounter llvm::GlobalMergeSharing;
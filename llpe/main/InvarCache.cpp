@@ -0,0 +1,276 @@
+//===-- InvarCache.cpp ----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define DEBUG_TYPE "llpe-misc"
+
+using namespace llvm;
+
+// Functions to save and restore the expensive-to-compute parts of a function's invariant
+// information between runs (see -llpe-invar-cache-dir).
+// The block top-ordering and loop nest are both functions of the CFG alone, so an entry
+// is keyed by a digest of the CFG shape and stores only block indices: it remains valid
+// whatever happens to the instructions within the blocks, and the cheap per-instruction
+// parts of the ShadowFunctionInvar are rebuilt as usual.
+
+// File layout: an array of uint32_t. Header (magic, version, #blocks), then for each block
+// in top order its position in F's block list, then the number of top-level loops followed
+// by each loop in preorder (see writeLoopShape).
+
+static const uint32_t InvarCacheMagic = 0x4c4c5049;
+static const uint32_t InvarCacheVersion = 1;
+
+// Digest F's control flow graph: block count, then each block's successors
+// in terms of block-list positions.
+static void getCFGDigest(Function& F, std::string& Out) {
+
+  DenseMap<BasicBlock*, uint32_t> Positions;
+  uint32_t i = 0;
+  for(Function::iterator it = F.begin(), itend = F.end(); it != itend; ++it, ++i)
+    Positions[&*it] = i;
+
+  std::vector<uint32_t> Words;
+  Words.push_back(i);
+
+  for(Function::iterator it = F.begin(), itend = F.end(); it != itend; ++it) {
+
+    BasicBlock* BB = &*it;
+    succ_iterator SI = succ_begin(BB), SE = succ_end(BB);
+    Words.push_back(std::distance(SI, SE));
+    for(; SI != SE; ++SI)
+      Words.push_back(Positions[*SI]);
+
+  }
+
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char*)Words.data(), Words.size() * sizeof(uint32_t), hash);
+
+  raw_string_ostream RSO(Out);
+  for(int j = 0; j < SHA_DIGEST_LENGTH; ++j) {
+
+    if(hash[j]/16 == 0)
+      RSO << '0';
+    RSO.write_hex(hash[j]);
+
+  }
+
+}
+
+std::string LLPEAnalysisPass::getInvarCachePath(Function& F) {
+
+  std::string Path;
+  raw_string_ostream RSO(Path);
+
+  std::string Digest;
+  getCFGDigest(F, Digest);
+
+  RSO << invarCacheDir << "/" << Digest << ".inv";
+  RSO.flush();
+  return Path;
+
+}
+
+static void writeLoopShape(const ShadowLoopShape& L, std::vector<uint32_t>& Words) {
+
+  Words.push_back(L.headerIdx);
+  Words.push_back(L.preheaderIdx);
+  Words.push_back(L.latchIdx);
+  Words.push_back(L.nBlocks);
+
+  Words.push_back(L.exitingBlocks.size());
+  Words.insert(Words.end(), L.exitingBlocks.begin(), L.exitingBlocks.end());
+
+  Words.push_back(L.exitBlocks.size());
+  Words.insert(Words.end(), L.exitBlocks.begin(), L.exitBlocks.end());
+
+  Words.push_back(L.exitEdges.size());
+  for(uint32_t i = 0, ilim = L.exitEdges.size(); i != ilim; ++i) {
+    Words.push_back(L.exitEdges[i].first);
+    Words.push_back(L.exitEdges[i].second);
+  }
+
+  Words.push_back(L.childLoops.size());
+  for(uint32_t i = 0, ilim = L.childLoops.size(); i != ilim; ++i)
+    writeLoopShape(L.childLoops[i], Words);
+
+}
+
+// Reader over a cache file, checking every access against the buffer bounds.
+// Any malformed or truncated file causes a miss.
+struct InvarCacheReader {
+
+  const uint32_t* Words;
+  uint64_t nWords;
+  uint64_t Pos;
+  uint32_t nBlocks;
+  bool Failed;
+
+InvarCacheReader(const uint32_t* W, uint64_t N, uint32_t NB) : Words(W), nWords(N), Pos(0), nBlocks(NB), Failed(false) {}
+
+  uint32_t next() {
+
+    if(Pos >= nWords) {
+      Failed = true;
+      return 0;
+    }
+    return Words[Pos++];
+
+  }
+
+  uint32_t nextBlock() {
+
+    uint32_t Ret = next();
+    if(Ret >= nBlocks)
+      Failed = true;
+    return Ret;
+
+  }
+
+  uint32_t nextCount() {
+
+    // No list in a loop description can be longer than the function.
+    uint32_t Ret = next();
+    if(Ret > nBlocks)
+      Failed = true;
+    return Failed ? 0 : Ret;
+
+  }
+
+  void readLoopShape(ShadowLoopShape& L) {
+
+    L.headerIdx = nextBlock();
+    L.preheaderIdx = nextBlock();
+    L.latchIdx = nextBlock();
+    L.nBlocks = nextCount();
+
+    for(uint32_t i = 0, ilim = nextCount(); i != ilim && !Failed; ++i)
+      L.exitingBlocks.push_back(nextBlock());
+
+    for(uint32_t i = 0, ilim = nextCount(); i != ilim && !Failed; ++i)
+      L.exitBlocks.push_back(nextBlock());
+
+    for(uint32_t i = 0, ilim = nextCount(); i != ilim && !Failed; ++i) {
+      uint32_t From = nextBlock();
+      L.exitEdges.push_back(std::make_pair(From, nextBlock()));
+    }
+
+    uint32_t nChildren = nextCount();
+    L.childLoops.resize(nChildren);
+    for(uint32_t i = 0; i != nChildren && !Failed; ++i)
+      readLoopShape(L.childLoops[i]);
+
+  }
+
+};
+
+// Try to retrieve the top-ordering and loop nest for F. Returns false on a miss.
+bool LLPEAnalysisPass::readInvarCache(Function& F, std::vector<BasicBlock*>& TopOrderedBlocks, std::vector<ShadowLoopShape>& Loops) {
+
+  std::string Path = getInvarCachePath(F);
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFile(Path, -1, false);
+  if(MB.getError())
+    return false;
+
+  StringRef Buf = (*MB)->getBuffer();
+  if(Buf.size() % sizeof(uint32_t))
+    return false;
+
+  uint32_t nBlocks = F.size();
+  InvarCacheReader R((const uint32_t*)Buf.data(), Buf.size() / sizeof(uint32_t), nBlocks);
+
+  if(R.next() != InvarCacheMagic || R.next() != InvarCacheVersion || R.next() != nBlocks)
+    return false;
+
+  std::vector<BasicBlock*> ByPosition;
+  ByPosition.reserve(nBlocks);
+  for(Function::iterator it = F.begin(), itend = F.end(); it != itend; ++it)
+    ByPosition.push_back(&*it);
+
+  // Check the ordering really is a permutation before trusting it.
+  std::vector<bool> Seen(nBlocks, false);
+  for(uint32_t i = 0; i != nBlocks && !R.Failed; ++i) {
+
+    uint32_t Pos = R.nextBlock();
+    if(R.Failed || Seen[Pos])
+      return false;
+    Seen[Pos] = true;
+    TopOrderedBlocks.push_back(ByPosition[Pos]);
+
+  }
+
+  uint32_t nLoops = R.nextCount();
+  Loops.resize(nLoops);
+  for(uint32_t i = 0; i != nLoops && !R.Failed; ++i)
+    R.readLoopShape(Loops[i]);
+
+  if(R.Failed || R.Pos != R.nWords) {
+
+    TopOrderedBlocks.clear();
+    Loops.clear();
+    return false;
+
+  }
+
+  return true;
+
+}
+
+// Save F's top-ordering and loop nest. Failure to write is not an error, just a future miss.
+void LLPEAnalysisPass::writeInvarCache(Function& F, std::vector<BasicBlock*>& TopOrderedBlocks, std::vector<ShadowLoopShape>& Loops) {
+
+  DenseMap<BasicBlock*, uint32_t> Positions;
+  uint32_t i = 0;
+  for(Function::iterator it = F.begin(), itend = F.end(); it != itend; ++it, ++i)
+    Positions[&*it] = i;
+
+  std::vector<uint32_t> Words;
+  Words.push_back(InvarCacheMagic);
+  Words.push_back(InvarCacheVersion);
+  Words.push_back(TopOrderedBlocks.size());
+
+  for(std::vector<BasicBlock*>::iterator it = TopOrderedBlocks.begin(), itend = TopOrderedBlocks.end(); it != itend; ++it)
+    Words.push_back(Positions[*it]);
+
+  Words.push_back(Loops.size());
+  for(std::vector<ShadowLoopShape>::iterator it = Loops.begin(), itend = Loops.end(); it != itend; ++it)
+    writeLoopShape(*it, Words);
+
+  std::string Path = getInvarCachePath(F);
+
+  // Write to a temporary and rename so that concurrent runs never see a partial file.
+  std::string TempPath;
+  {
+    raw_string_ostream RSO(TempPath);
+    RSO << Path << ".tmp" << getpid();
+  }
+
+  {
+    std::error_code error;
+    raw_fd_ostream RFO(TempPath.c_str(), error, sys::fs::F_None);
+    if(error) {
+      LLVM_DEBUG(dbgs() << "Failed to open " << TempPath << ": " << error.message() << "\n");
+      return;
+    }
+    RFO.write((const char*)Words.data(), Words.size() * sizeof(uint32_t));
+  }
+
+  if(rename(TempPath.c_str(), Path.c_str()) != 0)
+    unlink(TempPath.c_str());
+
+}
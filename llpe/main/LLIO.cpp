@@ -8,13 +8,17 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Analysis/LLPE.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <map>
+
 #define DEBUG_TYPE "llpe-misc"
 
 using namespace llvm;
@@ -22,34 +26,96 @@ using namespace llvm;
 // Functions to write a summary of the files consumed in this specialisation,
 // for consumption by the LLIO watch daemon (lliowd).
 
-// Compute SHA-1 hash of Filename:
+// Digests are SHA-256, which OpenSSL computes with the SHA extensions where the CPU has them.
+// Since many specialisations typically depend on the same large files, digests can be
+// shared between runs (and with lliowd) through a cache file (see -llpe-digest-cache).
+// Each line gives "dev inode mtime-seconds mtime-nanoseconds size digest"; the last line
+// for a given key wins, and writers only ever append whole lines.
 
-static bool getFileSha1(std::string& Filename, unsigned char* hash) {
+struct FileDigestKey {
 
-  SHA_CTX hashctx;
-  if(!SHA1_Init(&hashctx)) {
+  uint64_t dev, ino, mtimeSec, mtimeNsec, size;
 
-    errs() << "SHA1_Init\n";
-    return false;
+  bool operator<(const FileDigestKey& Other) const {
+
+    if(dev != Other.dev)
+      return dev < Other.dev;
+    if(ino != Other.ino)
+      return ino < Other.ino;
+    if(mtimeSec != Other.mtimeSec)
+      return mtimeSec < Other.mtimeSec;
+    if(mtimeNsec != Other.mtimeNsec)
+      return mtimeNsec < Other.mtimeNsec;
+    return size < Other.size;
 
   }
-	
-  int filefd = open(Filename.c_str(), O_RDONLY);
-  if(filefd == -1) {
-	  
-    errs() << "Cannot open " << Filename << "\n";
+
+};
+
+static std::map<FileDigestKey, std::string> digestCache;
+static bool digestCacheLoaded = false;
+
+static void loadDigestCache() {
+
+  digestCacheLoaded = true;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFile(GlobalIHP->digestCacheFile, -1, false);
+  if(MB.getError())
+    return;
+
+  StringRef Buf = (*MB)->getBuffer();
+  while(!Buf.empty()) {
+
+    std::pair<StringRef, StringRef> Split = Buf.split('\n');
+    Buf = Split.second;
+
+    SmallVector<StringRef, 6> Fields;
+    Split.first.split(Fields, ' ', -1, false);
+    if(Fields.size() != 6 || Fields[5].size() != SHA256_DIGEST_LENGTH * 2)
+      continue;
+
+    FileDigestKey Key;
+    if(Fields[0].getAsInteger(10, Key.dev) || Fields[1].getAsInteger(10, Key.ino) ||
+       Fields[2].getAsInteger(10, Key.mtimeSec) || Fields[3].getAsInteger(10, Key.mtimeNsec) ||
+       Fields[4].getAsInteger(10, Key.size))
+      continue;
+
+    digestCache[Key] = Fields[5].str();
+
+  }
+
+}
+
+static void printDigest(raw_ostream& Out, unsigned char* hash) {
+
+  for(int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+
+    if(hash[i]/16 == 0)
+      Out << '0';
+    Out.write_hex(hash[i]);
+
+  }
+
+}
+
+static bool hashFile(int filefd, std::string& Filename, unsigned char* hash) {
+
+  SHA256_CTX hashctx;
+  if(!SHA256_Init(&hashctx)) {
+
+    errs() << "SHA256_Init\n";
     return false;
 
   }
-	
-  char readbuf[4096];
-  int thisread;
 
-  while((thisread = read(filefd, readbuf, 4096)) > 0) {
+  static char readbuf[65536];
+  ssize_t thisread;
+
+  while((thisread = read(filefd, readbuf, sizeof(readbuf))) > 0) {
 
-    if(!SHA1_Update(&hashctx, readbuf, thisread)) {
+    if(!SHA256_Update(&hashctx, readbuf, thisread)) {
 
-      errs() << "SHA1_Update\n";
+      errs() << "SHA256_Update\n";
       return false;
 
     }
@@ -59,30 +125,116 @@ static bool getFileSha1(std::string& Filename, unsigned char* hash) {
   if(thisread == -1) {
 
     errs() << "Read failed for " << Filename << "\n";
-    close(filefd);
     return false;
 
   }
 
-  if(!SHA1_Final(hash, &hashctx)) {
+  if(!SHA256_Final(hash, &hashctx)) {
+
+    errs() << "SHA256_Final\n";
+    return false;
+
+  }
+
+  return true;
+
+}
+
+// Get the hex digest of Filename, from the cache if it has one matching the file's current identity.
+// The file must still be the version specialisation snapshotted, or the digest would vouch for
+// contents that specialisation never saw.
+static bool getFileDigest(std::string& Filename, std::string& Digest) {
+
+  FileSnapshot* Snap = getFileSnapshot(Filename);
+  if(!Snap->digest.empty()) {
+    Digest = Snap->digest;
+    return true;
+  }
+
+  int filefd = open(Filename.c_str(), O_RDONLY);
+  if(filefd == -1) {
+	  
+    errs() << "Cannot open " << Filename << "\n";
+    return false;
+
+  }
+
+  struct stat st;
+  if(fstat(filefd, &st) != 0 || !Snap->matches(st)) {
 
-    errs() << "SHA1_Final\n";
+    errs() << Filename << " changed during specialisation; the specialised program must not be used\n";
     close(filefd);
-    return false;;
+    exit(1);
 
   }
 
+  bool useCache = !GlobalIHP->digestCacheFile.empty();
+  FileDigestKey Key;
+
+  if(useCache) {
+
+    Key.dev = st.st_dev;
+    Key.ino = st.st_ino;
+    Key.mtimeSec = st.st_mtim.tv_sec;
+    Key.mtimeNsec = st.st_mtim.tv_nsec;
+    Key.size = st.st_size;
+
+    if(!digestCacheLoaded)
+      loadDigestCache();
+
+    std::map<FileDigestKey, std::string>::iterator findit = digestCache.find(Key);
+    if(findit != digestCache.end()) {
+
+      Digest = Snap->digest = findit->second;
+      close(filefd);
+      return true;
+
+    }
+
+  }
+
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  bool ret = hashFile(filefd, Filename, hash);
   close(filefd);
+
+  if(!ret)
+    return false;
+
+  {
+    raw_string_ostream RSO(Digest);
+    printDigest(RSO, hash);
+  }
+  Snap->digest = Digest;
+
+  if(useCache) {
+
+    digestCache[Key] = Digest;
+
+    std::string Line;
+    {
+      raw_string_ostream RSO(Line);
+      RSO << Key.dev << " " << Key.ino << " " << Key.mtimeSec << " " << Key.mtimeNsec << " " << Key.size << " " << Digest << "\n";
+    }
+
+    int cachefd = open(GlobalIHP->digestCacheFile.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if(cachefd != -1) {
+      if(write(cachefd, Line.data(), Line.size()) != (ssize_t)Line.size())
+	errs() << "Warning: failed to update " << GlobalIHP->digestCacheFile << "\n";
+      close(cachefd);
+    }
+
+  }
+
   return true;
 
 }
 
-// Get modification time of filename.
+// Get modification time of filename, as of its snapshot.
 
 static time_t getFileMtime(std::string& filename) {
 
   struct stat st;
-  int ret = ::stat(filename.c_str(), &st);
+  int ret = getSnapshotStat(filename, st);
   if(ret == -1) {
 
     errs() << "Failed to stat " << filename << "\n";
@@ -94,7 +246,8 @@ static time_t getFileMtime(std::string& filename) {
   
 }
 
-// Write the lliowd configuration file relating to this specialisation run. It gives the mtime and SHA-1 of each file referenced.
+// Write the lliowd configuration file relating to this specialisation run. It gives the mtime and SHA-256 of each file referenced.
+// The mtime is prefixed with S if the file was stat'ed, telling lliowd that the file's metadata matters as well as its contents.
 
 void LLPEAnalysisPass::writeLliowdConfig() {
 
@@ -139,25 +292,65 @@ void LLPEAnalysisPass::writeLliowdConfig() {
 
     StringRef printPath(relPath.data(), relPath.size());
 
-    Out << "\t" << printPath << " " << getFileMtime(*it) << " ";
+    Out << "\t" << printPath << " ";
+    if(llioStatDependencies[it - llioDependentFiles.begin()])
+      Out << "S";
+    Out << getFileMtime(*it) << " ";
+
+    std::string Digest;
+    if(getFileDigest(*it, Digest))
+      Out << Digest << "\n";
+
+  }
+
+}
 
-    unsigned char hash[SHA_DIGEST_LENGTH];
+static void writeManifestFile(raw_ostream& Out, const char* Kind, std::string& Filename) {
 
-    if(getFileSha1(*it, hash)) {
+  SmallVector<char, 256> absPath(Filename.begin(), Filename.end());
+  llvm::sys::fs::make_absolute(absPath);
 
-      for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+  Out << Kind << " " << StringRef(absPath.data(), absPath.size()) << " ";
 
-	if(hash[i]/16 == 0)
-	  Out << '0';
-	Out.write_hex(hash[i]);
+  std::string Digest;
+  if(getFileDigest(Filename, Digest))
+    Out << Digest;
+  else
+    Out << "missing";
+  Out << "\n";
 
-      }
+}
 
-      Out << "\n";
+// Write a manifest of everything outside the program and fixed options that this specialisation
+// depended upon: the varying command-line inputs, the files they named, and the files read
+// by the specialised code. Two runs over the same module and options with identical manifests
+// produce the same specialisation, so a driver running many configurations can diff manifests
+// and only re-specialise those that changed.
+void LLPEAnalysisPass::writeInputManifest() {
 
-    }
+  std::error_code openerror;
+  raw_fd_ostream Out(inputManifestFile.c_str(), openerror, sys::fs::F_None);
+  if(openerror) {
+
+    errs() << "Failed to open " << inputManifestFile << ": " << openerror.message() << "\n";
+    return;
 
   }
 
+  Out << "module " << RootIA->F.getParent()->getModuleIdentifier() << "\n";
+  Out << "root " << RootIA->F.getName() << "\n";
+
+  for(std::vector<std::pair<std::string, std::string> >::iterator it = specInputs.begin(),
+	itend = specInputs.end(); it != itend; ++it)
+    Out << "input " << it->first << " " << it->second << "\n";
+
+  for(std::vector<std::string>::iterator it = specInputFiles.begin(),
+	itend = specInputFiles.end(); it != itend; ++it)
+    writeManifestFile(Out, "input-file", *it);
+
+  for(std::vector<std::string>::iterator it = llioDependentFiles.begin(),
+	itend = llioDependentFiles.end(); it != itend; ++it)
+    writeManifestFile(Out, "read-file", *it);
+
 }
 
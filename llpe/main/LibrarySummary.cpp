@@ -0,0 +1,944 @@
+//===-- LibrarySummary.cpp ------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Analysis/LLPE.h"
+#include "llvm/Analysis/LLPECopyPaste.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "llpe-misc"
+
+using namespace llvm;
+
+// Summaries of library entry points, so that programs linked against the same library needn't each
+// re-analyse its startup code. -llpe-summary-function names the entry points (e.g. stdio or locale
+// initialisation) and -llpe-export-summary=FILE records, for each call to one that was analysed
+// outside any loop, what it did to the store; a later job with -llpe-import-summary=FILE applies
+// that instead of creating a specialisation context for the call.
+//
+// A summary is keyed by a fingerprint of the entry point's library code: every function and global
+// reachable from it (through calls, function pointers and initialisers), described without anything
+// module-specific like slot numbers or metadata, so the same library linked into another program
+// gives the same fingerprint. The writable globals among them form the call's ref set. A call is
+// summarised, and a summary applied, only when its arguments are integer or null constants and
+// every global in its ref set still holds its initialiser, so the call's inputs are exactly those
+// fingerprinted; its mod set is the globals it leaves holding something else, recorded with their
+// final contents and the call's return value. An imported summary's call is left unexpanded, so
+// the specialised program runs the original library code; what is saved is the analysis.
+
+namespace llvm {
+
+// A scalar constant (int, float, double, a null pointer or plain bytes) or a pointer to a global.
+struct SummaryValue {
+
+  Constant* C;
+  GlobalValue* Target;
+  int64_t TargetOffset;
+  uint64_t Size;
+
+SummaryValue() : C(0), Target(0), TargetOffset(0), Size(0) { }
+
+};
+
+struct SummaryWrite {
+
+  GlobalVariable* G;
+  uint64_t Offset;
+  SummaryValue Val;
+
+};
+
+struct LibrarySummary {
+
+  Function* F;
+  std::string Hash;
+  std::vector<Constant*> Args;
+  bool hasReturn;
+  SummaryValue Return;
+  std::vector<SummaryWrite> Writes;
+
+LibrarySummary() : F(0), hasReturn(false) { }
+
+};
+
+struct LibrarySummaryInfo {
+
+  std::string Hash;
+  std::vector<GlobalVariable*> Refs;
+
+};
+
+}
+
+// Describes an entry point's library code into an MD5 digest, collecting its ref set on the way.
+struct SummaryFingerprint {
+
+  LibrarySummaryInfo* Info;
+  std::vector<GlobalValue*> Worklist;
+  SmallPtrSet<const Value*, 32> Seen;
+  SmallPtrSet<Type*, 16> SeenTypes;
+  std::string Buf;
+  raw_string_ostream RSO;
+  MD5 Hash;
+
+SummaryFingerprint(LibrarySummaryInfo* I) : Info(I), RSO(Buf) { }
+
+  void noteValue(const Value* V);
+  void noteType(Type* T);
+  void describeType(Type* T);
+  void describeOperand(const Value* V, DenseMap<const Value*, uint32_t>& Locals);
+  void describeFunction(Function* F);
+  void describeGlobal(GlobalVariable* G);
+  void run(Function* F);
+
+};
+
+// Queue any globals V is or mentions.
+void SummaryFingerprint::noteValue(const Value* V) {
+
+  if(!Seen.insert(V).second)
+    return;
+
+  if(const GlobalValue* GV = dyn_cast<GlobalValue>(V)) {
+    Worklist.push_back(const_cast<GlobalValue*>(GV));
+  }
+  else if(const Constant* C = dyn_cast<Constant>(V)) {
+    for(Constant::const_op_iterator it = C->op_begin(), itend = C->op_end(); it != itend; ++it)
+      noteValue(*it);
+  }
+
+}
+
+// Named structs print as their name alone, so give each one's layout once.
+void SummaryFingerprint::noteType(Type* T) {
+
+  if(!SeenTypes.insert(T).second)
+    return;
+
+  if(StructType* ST = dyn_cast<StructType>(T)) {
+    if(ST->hasName()) {
+      RSO << " " << ST->getName() << (ST->isOpaque() ? " opaque" : " =");
+      for(StructType::element_iterator it = ST->element_begin(), itend = ST->element_end(); it != itend; ++it)
+	RSO << " " << **it;
+    }
+  }
+
+  for(Type::subtype_iterator it = T->subtype_begin(), itend = T->subtype_end(); it != itend; ++it)
+    noteType(*it);
+
+}
+
+void SummaryFingerprint::describeType(Type* T) {
+
+  RSO << *T;
+  noteType(T);
+
+}
+
+void SummaryFingerprint::describeOperand(const Value* V, DenseMap<const Value*, uint32_t>& Locals) {
+
+  DenseMap<const Value*, uint32_t>::iterator findit = Locals.find(V);
+
+  if(findit != Locals.end()) {
+    RSO << " %" << findit->second;
+  }
+  else if(isa<MetadataAsValue>(V)) {
+    RSO << " md";
+  }
+  else if(const GlobalValue* GV = dyn_cast<GlobalValue>(V)) {
+    RSO << " @" << GV->getName();
+    noteValue(GV);
+  }
+  else if(const Constant* C = dyn_cast<Constant>(V)) {
+    RSO << " ";
+    C->print(RSO);
+    noteValue(C);
+  }
+  else if(const InlineAsm* IA = dyn_cast<InlineAsm>(V)) {
+    RSO << " asm \"" << IA->getAsmString() << "\" \"" << IA->getConstraintString() << "\"";
+  }
+  else {
+    RSO << " ?";
+  }
+
+}
+
+// Describe F's body by opcode, type and operand, numbering its own values by position.
+void SummaryFingerprint::describeFunction(Function* F) {
+
+  RSO << "F " << F->getName() << " ";
+  describeType(F->getFunctionType());
+
+  if(F->isDeclaration()) {
+    RSO << " declare\n";
+    return;
+  }
+
+  materializeBody(*F);
+
+  DenseMap<const Value*, uint32_t> Locals;
+  uint32_t N = 0;
+  for(Function::arg_iterator it = F->arg_begin(), itend = F->arg_end(); it != itend; ++it)
+    Locals[&*it] = N++;
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+    Locals[&*BI] = N++;
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II)
+      Locals[&*II] = N++;
+  }
+
+  RSO << "\n";
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    RSO << "b" << Locals[&*BI] << "\n";
+
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II) {
+
+      Instruction* I = &*II;
+      if(isa<DbgInfoIntrinsic>(I))
+	continue;
+
+      RSO << I->getOpcodeName() << " ";
+      describeType(I->getType());
+
+      if(CmpInst* CI = dyn_cast<CmpInst>(I))
+	RSO << " p" << CI->getPredicate();
+      else if(AllocaInst* AI = dyn_cast<AllocaInst>(I)) {
+	RSO << " ";
+	describeType(AI->getAllocatedType());
+      }
+      else if(GetElementPtrInst* GEP = dyn_cast<GetElementPtrInst>(I)) {
+	RSO << " ";
+	describeType(GEP->getSourceElementType());
+      }
+      else if(ExtractValueInst* EV = dyn_cast<ExtractValueInst>(I)) {
+	for(ExtractValueInst::idx_iterator it = EV->idx_begin(), itend = EV->idx_end(); it != itend; ++it)
+	  RSO << " i" << *it;
+      }
+      else if(InsertValueInst* IV = dyn_cast<InsertValueInst>(I)) {
+	for(InsertValueInst::idx_iterator it = IV->idx_begin(), itend = IV->idx_end(); it != itend; ++it)
+	  RSO << " i" << *it;
+      }
+
+      for(Instruction::op_iterator it = I->op_begin(), itend = I->op_end(); it != itend; ++it)
+	describeOperand(*it, Locals);
+
+      RSO << "\n";
+
+    }
+
+  }
+
+}
+
+void SummaryFingerprint::describeGlobal(GlobalVariable* G) {
+
+  RSO << "G " << G->getName() << (G->isConstant() ? " const " : " ");
+  describeType(G->getValueType());
+
+  if(G->hasDefinitiveInitializer()) {
+    RSO << " ";
+    G->getInitializer()->print(RSO);
+    noteValue(G->getInitializer());
+  }
+
+  RSO << "\n";
+
+  if(!G->isConstant())
+    Info->Refs.push_back(G);
+
+}
+
+void SummaryFingerprint::run(Function* F) {
+
+  noteValue(F);
+
+  while(!Worklist.empty()) {
+
+    GlobalValue* GV = Worklist.back();
+    Worklist.pop_back();
+
+    if(Function* WorkF = dyn_cast<Function>(GV))
+      describeFunction(WorkF);
+    else if(GlobalVariable* G = dyn_cast<GlobalVariable>(GV))
+      describeGlobal(G);
+    else {
+      RSO << "A " << GV->getName() << "\n";
+      if(GlobalAlias* GA = dyn_cast<GlobalAlias>(GV))
+	noteValue(GA->getAliasee());
+    }
+
+    RSO.flush();
+    Hash.update(Buf);
+    Buf.clear();
+
+  }
+
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  SmallString<32> Str;
+  MD5::stringifyResult(Result, Str);
+  Info->Hash = Str.str().str();
+
+}
+
+LibrarySummaryInfo* LLPEAnalysisPass::getLibrarySummaryInfo(Function* F) {
+
+  DenseMap<Function*, LibrarySummaryInfo*>::iterator findit = librarySummaryInfo.find(F);
+  if(findit != librarySummaryInfo.end())
+    return findit->second;
+
+  LibrarySummaryInfo* Info = new LibrarySummaryInfo();
+  SummaryFingerprint Fingerprint(Info);
+  Fingerprint.run(F);
+
+  librarySummaryInfo[F] = Info;
+  return Info;
+
+}
+
+// Does G, as of BB's store, still hold its initialiser, as initialiseStore put it there?
+static bool isPristineGlobal(ShadowBB* BB, GlobalVariable* G) {
+
+  if((!GlobalIHP->useGlobalInitialisers) || (!G->hasDefinitiveInitializer()) || BB->localStore->allOthersClobbered)
+    return false;
+
+  ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(G)];
+  // Don't give the global a slot now: it would read as undefined rather than its initialiser.
+  if(!SGV->initialised)
+    return false;
+
+  LocStore* LS = BB->getReadableStoreFor(ShadowValue(SGV));
+  if(!LS)
+    return false;
+
+  ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(LS->store);
+  if((!IVS) || IVS->Overdef || IVS->Values.size() != 1)
+    return false;
+
+  Constant* Init = G->getInitializer();
+  if(isa<ConstantAggregateZero>(Init))
+    return IVS->SetType == ValSetTypeScalarSplat && getSingleConstant(IVS->Values[0].V)->isNullValue();
+
+  std::pair<ValSetType, ImprovedVal> InitIV = getValPB(Init);
+  if(IVS->SetType != InitIV.first)
+    return false;
+  if(InitIV.first == ValSetTypeScalar)
+    return getSingleConstant(IVS->Values[0].V) == getSingleConstant(InitIV.second.V);
+  return IVS->Values[0] == InitIV.second;
+
+}
+
+static bool allRefsPristine(ShadowBB* BB, LibrarySummaryInfo* Info) {
+
+  for(std::vector<GlobalVariable*>::iterator it = Info->Refs.begin(), itend = Info->Refs.end(); it != itend; ++it) {
+    if(!isPristineGlobal(BB, *it))
+      return false;
+  }
+
+  return true;
+
+}
+
+// Names are written space-separated.
+static bool isSummaryName(StringRef Name) {
+
+  return (!Name.empty()) && Name.find_first_of(" \t\r\n") == StringRef::npos;
+
+}
+
+static bool isSummaryArg(Constant* C) {
+
+  if(!C)
+    return false;
+  if(ConstantInt* CI = dyn_cast<ConstantInt>(C))
+    return CI->getBitWidth() <= 64;
+  return C->isNullValue() && C->getType()->isPointerTy();
+
+}
+
+// Express scalar C, occupying Size bytes, as a SummaryValue.
+static bool getSummaryConstant(Constant* C, uint64_t Size, SummaryValue& Out) {
+
+  if(GlobalTD->getTypeStoreSize(C->getType()) != Size)
+    return false;
+
+  Out.Size = Size;
+  LLVMContext& Ctx = C->getContext();
+
+  if(ConstantInt* CI = dyn_cast<ConstantInt>(C)) {
+    if(CI->getBitWidth() <= 64) {
+      Out.C = C;
+      return true;
+    }
+  }
+  else if(isa<ConstantFP>(C)) {
+    if(C->getType()->isFloatTy() || C->getType()->isDoubleTy()) {
+      Out.C = C;
+      return true;
+    }
+  }
+  else if(C->getType()->isPointerTy()) {
+    if(!C->isNullValue())
+      return false;
+    Out.C = Constant::getNullValue(Type::getInt8PtrTy(Ctx));
+    return true;
+  }
+
+  // Otherwise only plain data will do, as bytes.
+  SmallVector<uint8_t, 16> Bytes(Size);
+  if(!XXXReadDataFromGlobal(C, 0, Bytes.data(), Size, *GlobalTD))
+    return false;
+
+  Out.C = ConstantDataArray::get(Ctx, Bytes);
+  return true;
+
+}
+
+// Express the Size-byte value IVS as a SummaryValue.
+static bool getSummaryValue(const ImprovedValSetSingle& IVS, uint64_t Size, SummaryValue& Out, LLVMContext& Ctx) {
+
+  if(IVS.Overdef || IVS.Values.size() != 1)
+    return false;
+
+  const ImprovedVal& IV = IVS.Values[0];
+
+  switch(IVS.SetType) {
+
+  case ValSetTypeScalar:
+    return getSummaryConstant(getSingleConstant(IV.V), Size, Out);
+
+  case ValSetTypeScalarSplat:
+    {
+      ConstantInt* Byte = dyn_cast<ConstantInt>(getSingleConstant(IV.V));
+      if((!Byte) || Byte->getBitWidth() != 8)
+	return false;
+      SmallVector<uint8_t, 16> Bytes(Size, (uint8_t)Byte->getZExtValue());
+      Out.C = ConstantDataArray::get(Ctx, Bytes);
+      Out.Size = Size;
+      return true;
+    }
+
+  case ValSetTypePB:
+    {
+      if(IV.Offset == LLONG_MAX || Size != GlobalTD->getPointerSize())
+	return false;
+
+      if(IV.V.isGV())
+	Out.Target = IV.V.getGV()->G;
+      else if(Function* F = dyn_cast_or_null<Function>(IV.V.getVal()))
+	Out.Target = F;
+      else
+	return false;
+
+      if(!isSummaryName(Out.Target->getName()))
+	return false;
+
+      Out.TargetOffset = IV.Offset;
+      Out.Size = Size;
+      return true;
+    }
+
+  default:
+    return false;
+
+  }
+
+}
+
+static ShadowValue getSummaryTarget(GlobalValue* GV) {
+
+  if(GlobalVariable* G = dyn_cast<GlobalVariable>(GV))
+    return ShadowValue(&GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(G)]);
+  return ShadowValue(GV);
+
+}
+
+static void getSummaryIVS(const SummaryValue& V, ImprovedValSetSingle& Out) {
+
+  if(V.Target) {
+    Out.set(ImprovedVal(getSummaryTarget(V.Target), V.TargetOffset), ValSetTypePB);
+  }
+  else {
+    std::pair<ValSetType, ImprovedVal> VPB = getValPB(V.C);
+    Out.set(VPB.second, VPB.first);
+  }
+
+}
+
+// Is SI's call one to summarise for -llpe-export-summary? Its inputs must be those that
+// the fingerprint describes, so this must be asked before the call is analysed.
+bool IntegrationAttempt::canSummariseCall(ShadowInstruction* SI) {
+
+  if(pass->summaryExportFile.empty() || !inst_is<CallInst>(SI))
+    return false;
+
+  Function* F = getCalledFunction(SI);
+  if((!F) || F->isDeclaration() || !pass->summaryFunctions.count(F) || !isSummaryName(F->getName()))
+    return false;
+
+  Type* RetTy = F->getReturnType();
+  if(!(RetTy->isVoidTy() || RetTy->isIntegerTy() || RetTy->isFloatTy() || RetTy->isDoubleTy() || RetTy->isPointerTy()))
+    return false;
+
+  for(uint32_t i = 0, ilim = SI->getNumArgOperands(); i != ilim; ++i) {
+    if(!isSummaryArg(getConstReplacement(SI->getCallArgOperand(i))))
+      return false;
+  }
+
+  return allRefsPristine(SI->parent, pass->getLibrarySummaryInfo(F));
+
+}
+
+// SI, approved by canSummariseCall, has been analysed by expanding it. If the analysis
+// reached definite conclusions, record its effects for export.
+void IntegrationAttempt::noteLibrarySummary(ShadowInstruction* SI) {
+
+  InlineAttempt* IA = getInlineAttempt(SI);
+  if((!IA) || IA->isModel || IA->hasVFSOps || IA->mayUnwind || IA->readsTentativeData ||
+     IA->containsCheckedReads || IA->hasFailedReturnPath())
+    return;
+
+  Function* F = &IA->F;
+  LibrarySummaryInfo* Info = pass->getLibrarySummaryInfo(F);
+  LLVMContext& Ctx = F->getContext();
+
+  LibrarySummary* S = new LibrarySummary();
+  S->F = F;
+  S->Hash = Info->Hash;
+
+  for(uint32_t i = 0, ilim = SI->getNumArgOperands(); i != ilim; ++i)
+    S->Args.push_back(getConstReplacement(SI->getCallArgOperand(i)));
+
+  // A later call with the same arguments under the same (pristine) inputs behaves the same.
+  for(std::vector<LibrarySummary*>::iterator it = pass->exportedSummaries.begin(),
+	itend = pass->exportedSummaries.end(); it != itend; ++it) {
+    if((*it)->F == F && (*it)->Args == S->Args) {
+      delete S;
+      return;
+    }
+  }
+
+  Type* RetTy = F->getReturnType();
+  if(!RetTy->isVoidTy()) {
+
+    ImprovedValSetSingle* RetIVS = dyn_cast_or_null<ImprovedValSetSingle>(SI->i.PB);
+    if((!RetIVS) || !getSummaryValue(*RetIVS, GlobalTD->getTypeStoreSize(RetTy), S->Return, Ctx)) {
+      delete S;
+      return;
+    }
+    S->hasReturn = true;
+
+  }
+
+  for(std::vector<GlobalVariable*>::iterator it = Info->Refs.begin(), itend = Info->Refs.end(); it != itend; ++it) {
+
+    GlobalVariable* G = *it;
+    if(isPristineGlobal(SI->parent, G))
+      continue;
+
+    if(!isSummaryName(G->getName())) {
+      delete S;
+      return;
+    }
+
+    ShadowValue GV(&pass->shadowGlobals[pass->getShadowGlobalIndex(G)]);
+    SmallVector<IVSRange, 4> Results;
+    readValRangeMulti(GV, 0, GV.getGV()->getStoreSize(), SI->parent, Results);
+
+    for(SmallVector<IVSRange, 4>::iterator RI = Results.begin(), RE = Results.end(); RI != RE; ++RI) {
+
+      SummaryWrite W;
+      W.G = G;
+      W.Offset = RI->first.first;
+      if(!getSummaryValue(RI->second, RI->first.second - RI->first.first, W.Val, Ctx)) {
+	delete S;
+	return;
+      }
+      S->Writes.push_back(W);
+
+    }
+
+  }
+
+  pass->exportedSummaries.push_back(S);
+  ++pass->stats.librarySummariesExported;
+
+}
+
+// Try to give SI's call the effects an imported summary recorded, leaving it unexpanded.
+bool IntegrationAttempt::tryUseLibrarySummary(ShadowInstruction* SI) {
+
+  if((!inst_is<CallInst>(SI)) || getInlineAttempt(SI))
+    return false;
+
+  Function* F = getCalledFunction(SI);
+  DenseMap<Function*, std::vector<LibrarySummary*> >::iterator findit = pass->importedSummaries.find(F);
+  if(findit == pass->importedSummaries.end())
+    return false;
+
+  LibrarySummary* S = 0;
+  for(std::vector<LibrarySummary*>::iterator it = findit->second.begin(), itend = findit->second.end();
+      it != itend && !S; ++it) {
+
+    LibrarySummary* Cand = *it;
+    if(Cand->Args.size() != SI->getNumArgOperands())
+      continue;
+
+    bool match = true;
+    for(uint32_t i = 0, ilim = Cand->Args.size(); i != ilim && match; ++i) {
+
+      Constant* C = getConstReplacement(SI->getCallArgOperand(i));
+      if(!isSummaryArg(C))
+	return false;
+      if(isa<ConstantInt>(C))
+	match = C == Cand->Args[i];
+      else
+	match = Cand->Args[i]->isNullValue() && Cand->Args[i]->getType()->isPointerTy();
+
+    }
+
+    if(match)
+      S = Cand;
+
+  }
+
+  if((!S) || !allRefsPristine(SI->parent, pass->getLibrarySummaryInfo(F)))
+    return false;
+
+  Type* RetTy = SI->invar->I->getType();
+  if(S->hasReturn && S->Return.C && !S->Return.C->isNullValue() && S->Return.C->getType() != RetTy)
+    return false;
+
+  LPDEBUG("Library summary for " << itcache(SI) << ": " << S->Writes.size() << " writes\n");
+
+  for(std::vector<SummaryWrite>::iterator it = S->Writes.begin(), itend = S->Writes.end(); it != itend; ++it) {
+
+    ImprovedValSetSingle PtrSet;
+    PtrSet.set(ImprovedVal(getSummaryTarget(it->G), it->Offset), ValSetTypePB);
+    ImprovedValSetSingle ValPB;
+    getSummaryIVS(it->Val, ValPB);
+    executeWriteInst(0, PtrSet, ValPB, it->Val.Size, SI);
+
+  }
+
+  if(S->hasReturn) {
+
+    if(S->Return.C) {
+      setReplacement(SI, S->Return.C->isNullValue() ? Constant::getNullValue(RetTy) : S->Return.C);
+    }
+    else {
+      if(SI->i.PB)
+	deleteIV(SI->i.PB);
+      ImprovedValSetSingle* NewIVS = newIVS();
+      getSummaryIVS(S->Return, *NewIVS);
+      SI->i.PB = NewIVS;
+    }
+
+  }
+
+  ++pass->stats.librarySummaryHits;
+  return true;
+
+}
+
+static void printSummaryValue(raw_ostream& Out, const SummaryValue& V) {
+
+  if(V.Target) {
+    Out << "ptr " << V.Target->getName() << " " << V.TargetOffset;
+  }
+  else if(ConstantInt* CI = dyn_cast<ConstantInt>(V.C)) {
+    Out << "int " << CI->getBitWidth() << " " << CI->getZExtValue();
+  }
+  else if(ConstantFP* FP = dyn_cast<ConstantFP>(V.C)) {
+    Out << (FP->getType()->isFloatTy() ? "float " : "double ") << FP->getValueAPF().bitcastToAPInt().getZExtValue();
+  }
+  else if(V.C->getType()->isPointerTy()) {
+    Out << "null";
+  }
+  else {
+    SmallVector<uint8_t, 16> Bytes(V.Size);
+    XXXReadDataFromGlobal(V.C, 0, Bytes.data(), V.Size, *GlobalTD);
+    Out << "bytes ";
+    for(uint64_t i = 0; i < V.Size; ++i)
+      Out << format("%02x", Bytes[i]);
+  }
+
+}
+
+void LLPEAnalysisPass::writeLibrarySummaries() {
+
+  std::error_code openerror;
+  raw_fd_ostream Out(summaryExportFile.c_str(), openerror, sys::fs::F_None);
+  if(openerror) {
+
+    errs() << "Failed to open " << summaryExportFile << ": " << openerror.message() << "\n";
+    return;
+
+  }
+
+  Out << "# LLPE library summaries (see -llpe-import-summary)\n";
+
+  for(std::vector<LibrarySummary*>::iterator it = exportedSummaries.begin(), itend = exportedSummaries.end(); it != itend; ++it) {
+
+    LibrarySummary* S = *it;
+    Out << "summary " << S->F->getName() << " " << S->Hash << "\n";
+
+    for(std::vector<Constant*>::iterator AI = S->Args.begin(), AE = S->Args.end(); AI != AE; ++AI) {
+
+      SummaryValue Arg;
+      Arg.C = *AI;
+      Out << "arg ";
+      printSummaryValue(Out, Arg);
+      Out << "\n";
+
+    }
+
+    if(S->hasReturn) {
+      Out << "return ";
+      printSummaryValue(Out, S->Return);
+      Out << "\n";
+    }
+
+    // The ref set, for the reader's benefit: importers recompute it along with the fingerprint.
+    LibrarySummaryInfo* Info = getLibrarySummaryInfo(S->F);
+    for(std::vector<GlobalVariable*>::iterator RI = Info->Refs.begin(), RE = Info->Refs.end(); RI != RE; ++RI)
+      Out << "ref " << (*RI)->getName() << "\n";
+
+    for(std::vector<SummaryWrite>::iterator WI = S->Writes.begin(), WE = S->Writes.end(); WI != WE; ++WI) {
+      Out << "write " << WI->G->getName() << " " << WI->Offset << " ";
+      printSummaryValue(Out, WI->Val);
+      Out << "\n";
+    }
+
+  }
+
+}
+
+// Parse the value starting at Fields[i]. Returns false if it is malformed or names
+// something this module lacks.
+static bool parseSummaryValue(Module& M, SmallVectorImpl<StringRef>& Fields, uint32_t i, SummaryValue& Out) {
+
+  if(i >= Fields.size())
+    return false;
+
+  LLVMContext& Ctx = M.getContext();
+  StringRef Kind = Fields[i];
+  uint64_t N, Val;
+
+  if(Kind == "int") {
+
+    if(Fields.size() != i + 3 || Fields[i + 1].getAsInteger(10, N) || N == 0 || N > 64 || Fields[i + 2].getAsInteger(10, Val))
+      return false;
+    Out.C = ConstantInt::get(IntegerType::get(Ctx, N), Val);
+
+  }
+  else if(Kind == "float" || Kind == "double") {
+
+    if(Fields.size() != i + 2 || Fields[i + 1].getAsInteger(10, Val))
+      return false;
+    bool isFloat = Kind == "float";
+    Constant* Bits = ConstantInt::get(IntegerType::get(Ctx, isFloat ? 32 : 64), Val);
+    Out.C = ConstantExpr::getBitCast(Bits, isFloat ? Type::getFloatTy(Ctx) : Type::getDoubleTy(Ctx));
+
+  }
+  else if(Kind == "null") {
+
+    if(Fields.size() != i + 1)
+      return false;
+    Out.C = Constant::getNullValue(Type::getInt8PtrTy(Ctx));
+
+  }
+  else if(Kind == "ptr") {
+
+    int64_t Offset;
+    if(Fields.size() != i + 3 || Fields[i + 2].getAsInteger(10, Offset))
+      return false;
+    GlobalValue* Target = M.getNamedValue(Fields[i + 1]);
+    if((!Target) || !(isa<GlobalVariable>(Target) || isa<Function>(Target)))
+      return false;
+    Out.Target = Target;
+    Out.TargetOffset = Offset;
+    Out.Size = GlobalTD->getPointerSize();
+    return true;
+
+  }
+  else if(Kind == "bytes") {
+
+    if(Fields.size() != i + 2 || Fields[i + 1].empty() || (Fields[i + 1].size() % 2))
+      return false;
+    StringRef Hex = Fields[i + 1];
+    SmallVector<uint8_t, 16> Bytes;
+    for(uint32_t j = 0; j < Hex.size(); j += 2) {
+      if(Hex.substr(j, 2).getAsInteger(16, Val))
+	return false;
+      Bytes.push_back((uint8_t)Val);
+    }
+    Out.C = ConstantDataArray::get(Ctx, Bytes);
+
+  }
+  else {
+
+    return false;
+
+  }
+
+  Out.Size = GlobalTD->getTypeStoreSize(Out.C->getType());
+  return true;
+
+}
+
+// Read a summary file written by -llpe-export-summary. Summaries of functions this module lacks,
+// or whose library code differs from the code they were made from, are skipped.
+void LLPEAnalysisPass::loadLibrarySummaries(Module& M, const std::string& Filename) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFile(Filename, -1, false);
+  if(std::error_code EC = MB.getError()) {
+
+    errs() << "Failed to open summary file " << Filename << ": " << EC.message() << "\n";
+    exit(1);
+
+  }
+
+  std::vector<LibrarySummary*> Loaded;
+  // Set while skipping the lines of a summary we can't use.
+  bool skipping = false;
+  StringRef Rest = (*MB)->getBuffer();
+  uint32_t lineNo = 0;
+
+  while(!Rest.empty()) {
+
+    StringRef Line;
+    std::tie(Line, Rest) = Rest.split('\n');
+    ++lineNo;
+
+    Line = Line.trim();
+    if(Line.empty() || Line[0] == '#')
+      continue;
+
+    SmallVector<StringRef, 8> Fields;
+    SplitString(Line, Fields);
+
+    bool malformed = false;
+
+    if(Fields[0] == "summary") {
+
+      if(Fields.size() != 3) {
+	malformed = true;
+      }
+      else {
+
+	Function* F = M.getFunction(Fields[1]);
+	skipping = (!F) || F->isDeclaration();
+	if(!skipping) {
+	  LibrarySummary* S = new LibrarySummary();
+	  S->F = F;
+	  S->Hash = Fields[2].str();
+	  Loaded.push_back(S);
+	}
+
+      }
+
+    }
+    else if(Loaded.empty() && !skipping) {
+
+      malformed = true;
+
+    }
+    else if(skipping || Fields[0] == "ref") {
+
+      // The ref set is recomputed from the module.
+      continue;
+
+    }
+    else {
+
+      LibrarySummary* S = Loaded.back();
+      SummaryValue V;
+
+      if(Fields[0] == "arg") {
+
+	if(!parseSummaryValue(M, Fields, 1, V) || V.Target)
+	  malformed = true;
+	else
+	  S->Args.push_back(V.C);
+
+      }
+      else if(Fields[0] == "return") {
+
+	if(!parseSummaryValue(M, Fields, 1, S->Return))
+	  skipping = true;
+	else
+	  S->hasReturn = true;
+
+      }
+      else if(Fields[0] == "write") {
+
+	SummaryWrite W;
+	W.G = M.getNamedGlobal(Fields.size() > 1 ? Fields[1] : "");
+	if(Fields.size() < 4 || Fields[2].getAsInteger(10, W.Offset))
+	  malformed = true;
+	else if((!W.G) || W.G->isConstant() || !parseSummaryValue(M, Fields, 3, W.Val))
+	  skipping = true;
+	else
+	  S->Writes.push_back(W);
+
+      }
+      else {
+
+	malformed = true;
+
+      }
+
+      // Drop a summary naming something this module lacks.
+      if(skipping) {
+	delete S;
+	Loaded.pop_back();
+      }
+
+    }
+
+    if(malformed) {
+
+      errs() << Filename << ":" << lineNo << ": malformed summary line\n";
+      exit(1);
+
+    }
+
+  }
+
+  for(std::vector<LibrarySummary*>::iterator it = Loaded.begin(), itend = Loaded.end(); it != itend; ++it) {
+
+    LibrarySummary* S = *it;
+    if(getLibrarySummaryInfo(S->F)->Hash != S->Hash) {
+
+      errs() << "Warning: ignoring summary of " << S->F->getName() << " from " << Filename << ": library code differs\n";
+      delete S;
+      continue;
+
+    }
+
+    importedSummaries[S->F].push_back(S);
+    summaryFunctions.insert(S->F);
+
+  }
+
+}
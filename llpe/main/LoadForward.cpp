@@ -21,6 +21,7 @@
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LLPECopyPaste.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
@@ -50,9 +51,19 @@ static void checkIVSNull(ImprovedValSetSingle& IVS) {
 // We use an IntervalMap (named Map) to describe how component IVSes are laid out.
 // They might describe a whole object, or if Underlying is set describe an overlay
 // atop that map.
-ImprovedValSetMulti::ImprovedValSetMulti(uint64_t ASize) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(0), CoveredBytes(0), AllocSize(ASize) { }
 
-ImprovedValSetMulti::ImprovedValSetMulti(const ImprovedValSetMulti& other) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(other.Underlying), CoveredBytes(other.CoveredBytes), AllocSize(other.AllocSize) {
+// Stamp 0 is never issued, marking an empty read cache slot.
+static uint64_t nextMultiStamp = 1;
+
+ImprovedValSetMulti::ImprovedValSetMulti(uint64_t ASize) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(0), CoveredBytes(0), AllocSize(ASize), Stamp(nextMultiStamp++) { 
+
+  GlobalMultiCounter.alloc();
+
+}
+
+ImprovedValSetMulti::ImprovedValSetMulti(const ImprovedValSetMulti& other) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(other.Underlying), CoveredBytes(other.CoveredBytes), AllocSize(other.AllocSize), Stamp(nextMultiStamp++) {
+
+  GlobalMultiCounter.alloc();
 
   if(Underlying)
     Underlying = Underlying->getReadableCopy();
@@ -65,6 +76,13 @@ ImprovedValSetMulti::ImprovedValSetMulti(const ImprovedValSetMulti& other) : Imp
 
 }
 
+// Called before modifying a map in place, so read cache entries for its old contents can't match.
+void ImprovedValSetMulti::refreshStamp() {
+
+  Stamp = nextMultiStamp++;
+
+}
+
 // Only declare multis equal when the topmost map is trivially equal.
 // It still might be possible to flatten the maps to discover they represent the same information.
 bool llvm::operator==(const ImprovedValSetMulti& PB1, const ImprovedValSetMulti& PB2) {
@@ -198,6 +216,47 @@ static bool shouldMultiload(ImprovedValSetSingle& PB) {
 
 }
 
+// Will reading any of LIPB's targets certainly give overdef, and so the whole multiload too?
+// Only catches cases found without reading the targets' stores, so that with a large pointer set
+// we don't read every target up to the one that fails.
+static bool multiloadMustFail(ShadowInstruction* LI, ImprovedValSetSingle& LIPB) {
+
+  for(uint32_t i = 0, ilim = LIPB.Values.size(); i != ilim; ++i) {
+
+    ShadowValue& V = LIPB.Values[i].V;
+
+    if(Value* Val = V.getVal()) {
+
+      if(isa<ConstantPointerNull>(Val) || isa<UndefValue>(Val))
+	continue;
+
+    }
+
+    if(ShadowGV* SGV = V.getGV()) {
+      if(SGV->G->isConstant())
+	continue;
+    }
+
+    if(LIPB.Values[i].Offset < 0)
+      return true;
+
+    LocStore* Store = LI->parent->getReadableStoreFor(V);
+    if(!Store) {
+      if(LI->parent->localStore->allOthersClobbered)
+	return true;
+      continue;
+    }
+
+    ImprovedValSetSingle* StoreIVS = dyn_cast<ImprovedValSetSingle>(Store->store);
+    if(StoreIVS && StoreIVS->Overdef)
+      return true;
+
+  }
+
+  return false;
+
+}
+
 // Try to execute load LI which reads from a set of 2+ pointers.
 static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::string* report) {
 
@@ -212,7 +271,19 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
 
   std::unique_ptr<raw_string_ostream> RSO(report ? new raw_string_ostream(*report) : 0);
 
+  // If a failure reason is wanted, find it the long way.
+  if(LIPB.Values.size() > 1 && !report && multiloadMustFail(LI, LIPB)) {
+
+    LI->isThreadLocal = TLS_NEVERCHECK;
+    LI->forwardFailure = FORWARD_FAIL_EARLY;
+    ++GlobalIHP->stats.multiloadsFailedEarly;
+    NewPB->setOverdef();
+    return true;
+
+  }
+
   LI->isThreadLocal = TLS_NEVERCHECK;
+  LI->forwardFailure = FORWARD_FAIL_NONE;
 
   for(uint32_t i = 0, ilim = LIPB.Values.size(); i != ilim && !NewPB->Overdef; ++i) {
 
@@ -255,13 +326,18 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
     if(!ThisPB.isWhollyUnknown()) {
       if(!ThisPB.coerceToType(LI->getType(), LoadSize, ThisError.get())) {
 	NewPB->setOverdef();
+	LI->forwardFailure = FORWARD_FAIL_COERCE;
       }
       else {
 	NewPB->merge(ThisPB);
+	if(NewPB->Overdef)
+	  LI->forwardFailure = FORWARD_FAIL_MERGE;
       }
     }
     else {
       NewPB->merge(ThisPB);
+      if(NewPB->Overdef)
+	LI->forwardFailure = FORWARD_FAIL_UNKNOWN_VALUE;
     }
 
     if(RSO.get()) {
@@ -287,9 +363,32 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
 
 }
 
+const char* llvm::getForwardFailureName(unsigned char F) {
+
+  switch(F) {
+  case FORWARD_FAIL_NONE:
+    return "none";
+  case FORWARD_FAIL_VAGUE_POINTER:
+    return "vague pointer";
+  case FORWARD_FAIL_EARLY:
+    return "target overdefined";
+  case FORWARD_FAIL_UNKNOWN_VALUE:
+    return "unknown value";
+  case FORWARD_FAIL_COERCE:
+    return "type mismatch";
+  case FORWARD_FAIL_MERGE:
+    return "merge";
+  default:
+    return "?";
+  }
+
+}
+
 // Fish a value out of the block-local or value store for LI.
 bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*& NewPB, bool& loadedVararg) {
 
+  LLPE_EVAL_PROFILE_SCOPE(EVAL_PROFILE_FORWARD_LOAD, LI->invar->I);
+
   ImprovedValSetSingle ConstResult;
   std::unique_ptr<std::string> error(pass->verboseOverdef ? new std::string() : 0);
 
@@ -321,6 +420,7 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
 
     // Load from a vague pointer -> Overdef.
     ret = true;
+    LI->forwardFailure = FORWARD_FAIL_VAGUE_POINTER;
     if(error.get()) {
       raw_string_ostream RSO(*error);
       RSO << "Load vague ";
@@ -338,8 +438,14 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
 
   }
 
-  if(error.get())
-    pass->optimisticForwardStatus[LI] = *error;
+  if(error.get()) {
+    if(error->empty())
+      pass->optimisticForwardStatus.erase(LI);
+    else {
+      pass->optimisticForwardStatus[LI] = *error;
+      LLPE_LOG(LOG_OVERDEF) << itcache(LI) << ": " << *error;
+    }
+  }
    
   return ret;
 
@@ -353,7 +459,7 @@ int32_t ShadowValue::getHeapKey() const {
 
   case SHADOWVAL_GV:
     release_assert(!u.GV->G->isConstant());
-    return u.GV->allocIdx;
+    return u.GV->getAllocIdx();
   case SHADOWVAL_OTHER:
     {
       Function* KeyF = cast<Function>(u.V);
@@ -383,7 +489,7 @@ uint64_t ShadowValue::getAllocSize(OrdinaryLocalStore* M) const {
   case SHADOWVAL_PTRIDX:
     return getAllocData(M)->storeSize;
   case SHADOWVAL_GV:
-    return u.GV->storeSize;
+    return u.GV->getStoreSize();
   case SHADOWVAL_OTHER:
     return GlobalIHP->specialLocations[cast<Function>(u.V)].storeSize;
   case SHADOWVAL_ARG:
@@ -487,6 +593,45 @@ static int logReadDepth(ImprovedValSet* IVS, uint32_t depth) {
   
 }
 
+// Number of stacked maps a read from IVS may have to visit.
+static uint32_t getStoreDepth(ImprovedValSet* IVS) {
+
+  uint32_t depth = 1;
+  while(ImprovedValSetMulti* IVM = dyn_cast<ImprovedValSetMulti>(IVS)) {
+
+    if(!IVM->Underlying)
+      break;
+    IVS = IVM->Underlying;
+    ++depth;
+
+  }
+
+  return depth;
+
+}
+
+// Populate empty Multi M with the flattened contents of the whole of stack IVS, so that
+// M no longer needs an underlying map.
+static void flattenMultiInto(ImprovedValSetMulti* M, ImprovedValSet* IVS) {
+
+  SmallVector<IVSRange, 4> Vals;
+  readValRangeMultiFrom(0, M->AllocSize, IVS, Vals, 0, M->AllocSize);
+
+  ImprovedValSetMulti::MapIt insertit = M->Map.end();
+  for(SmallVector<IVSRange, 4>::iterator it = Vals.begin(), itend = Vals.end(); it != itend; ++it) {
+
+    if(it->first.first == it->first.second)
+      continue;
+    insertit.insert(it->first.first, it->first.second, it->second);
+    insertit = M->Map.end();
+
+  }
+
+  M->Underlying = 0;
+  M->CoveredBytes = M->AllocSize;
+
+}
+
 // Get a writable symbolic object for V, to be written at Offset - Offset+Size.
 // willWriteSingleObject permits a shortcut in which we allocate space for a single object instead of an extent-list
 // as needed for structs etc.
@@ -528,7 +673,7 @@ LocStore* ShadowBB::getWritableStoreFor(ShadowValue& V, int64_t Offset, uint64_t
     }
     else {
       // Defer the rest of the multimap to the base object.
-      ImprovedValSetMulti* M = new ImprovedValSetMulti(ASize);
+      ImprovedValSetMulti* M = newIVM(ASize);
       if(writeWholeObject) {
 	M->Underlying = 0;
       }
@@ -581,7 +726,7 @@ LocStore* ShadowBB::getWritableStoreFor(ShadowValue& V, int64_t Offset, uint64_t
     // a single to a multi with that single as base.
     if(!ret->store->isWritableMulti()) {
 
-      ImprovedValSetMulti* NewIMap = new ImprovedValSetMulti(ASize);
+      ImprovedValSetMulti* NewIMap = newIVM(ASize);
       if(isa<ImprovedValSetMulti>(ret->store))
 	LFV3(errs() << "Break shared multi " << ret->store << " -> " << NewIMap << "\n");
       else
@@ -590,6 +735,16 @@ LocStore* ShadowBB::getWritableStoreFor(ShadowValue& V, int64_t Offset, uint64_t
 	NewIMap->Underlying = 0;
 	ret->store->dropReference();
       }
+      else if(GlobalIHP->multiFlattenDepth && isa<ImprovedValSetMulti>(ret->store) && ASize != ULONG_MAX &&
+	      getStoreDepth(ret->store) >= GlobalIHP->multiFlattenDepth) {
+	// Stacking another layer would make the object too slow to read: squash the existing
+	// stack into the new map instead.
+	LFV3(errs() << "Flatten deep stack " << ret->store << " into " << NewIMap << "\n");
+	NewIMap->AllocSize = std::max(ASize, cast<ImprovedValSetMulti>(ret->store)->AllocSize);
+	flattenMultiInto(NewIMap, ret->store);
+	ret->store->dropReference();
+	++GlobalIHP->stats.flattenedMultis;
+      }
       else {
 	NewIMap->Underlying = ret->store;
 	// M's refcount remains unchanged, it's just now referenced as a base rather than
@@ -874,6 +1029,37 @@ void llvm::readValRangeFrom(ShadowValue& V, uint64_t Offset, uint64_t Size, Shad
 
 }
 
+// Direct-mapped cache of readValRange results for objects whose store is a multi.
+// Entries are never explicitly invalidated: a write restamps the multi, so stale entries simply miss.
+#define READCACHESIZE 1024
+
+struct ReadCacheEntry {
+
+  uint64_t Stamp;
+  uint64_t Offset;
+  uint64_t Size;
+  uint64_t ASize;
+  ImprovedValSetSingle Result;
+
+ReadCacheEntry() : Stamp(0), Offset(0), Size(0), ASize(0) { }
+
+};
+
+static ReadCacheEntry ReadCache[READCACHESIZE];
+
+// An object allocated during specialisation, as opposed to a global or stack object.
+static bool isHeapObject(const ShadowValue& V) {
+
+  return V.isPtrIdx() && V.getFrameNo() == -1;
+
+}
+
+static ReadCacheEntry& getReadCacheEntry(uint64_t Stamp, uint64_t Offset, uint64_t Size, uint64_t ASize) {
+
+  return ReadCache[hash_combine(Stamp, Offset, Size, ASize) % READCACHESIZE];
+
+}
+
 // Try to read V[Offset:Offset+Size], in the context of ReadBB, storing the result in Result or ResultMulti if an extent-list is necessary.
 // In debug builds, give a verbose error report as 'error'.
 void llvm::readValRange(ShadowValue& V, int64_t Offset, uint64_t Size, ShadowBB* ReadBB, ImprovedValSetSingle& Result, ImprovedValSetMulti** ResultMulti, std::string* error) {
@@ -892,7 +1078,8 @@ void llvm::readValRange(ShadowValue& V, int64_t Offset, uint64_t Size, ShadowBB*
 
   LocStore* firstStore = ReadBB->getReadableStoreFor(V);
   if(!firstStore) {
-    if(ReadBB->localStore->allOthersClobbered) {
+    // Heap objects missing from the store may have been freed and compacted away (see compactHeap).
+    if(ReadBB->localStore->allOthersClobbered || isHeapObject(V)) {
       LFV3(errs() << "Location not in local map and allOthersClobbered\n");
       Result.setOverdef();
       return;
@@ -920,6 +1107,31 @@ void llvm::readValRange(ShadowValue& V, int64_t Offset, uint64_t Size, ShadowBB*
   */
 
   LocStore::simplifyStore(firstStore);
+
+  // Multis are copy-on-write and restamped whenever modified in place, so a stamp hit means
+  // the same bytes are being read out of the same contents. Singles are freely mutated, so
+  // aren't cached; neither are reads whose failure reason is wanted.
+  ReadCacheEntry* CacheEntry = 0;
+  uint64_t ASize = 0;
+  ImprovedValSetMulti* CacheIVM = dyn_cast<ImprovedValSetMulti>(firstStore->store);
+  if(CacheIVM && !error && !Result.isInitialised()) {
+
+    ASize = ReadBB->getAllocSize(V);
+    CacheEntry = &getReadCacheEntry(CacheIVM->Stamp, Offset, Size, ASize);
+    if(CacheEntry->Stamp == CacheIVM->Stamp && CacheEntry->Offset == (uint64_t)Offset &&
+       CacheEntry->Size == Size && CacheEntry->ASize == ASize) {
+
+      ++GlobalIHP->stats.readCacheHits;
+      Result = CacheEntry->Result;
+      return;
+
+    }
+
+    ++GlobalIHP->stats.readCacheMisses;
+
+  }
+
+  ++GlobalIHP->stats.readDepths[std::min(getStoreDepth(firstStore->store), (uint32_t)READDEPTHBUCKETS) - 1];
   
   readValRangeFrom(V, Offset, Size, ReadBB, firstStore->store, Result, ResultPV, shouldTryMulti, error);
 
@@ -932,6 +1144,17 @@ void llvm::readValRange(ShadowValue& V, int64_t Offset, uint64_t Size, ShadowBB*
 
     delete ResultPV;
 
+  }
+
+  // Reads that would retry as a multi aren't cached, as the retry's outcome depends on the caller.
+  if(CacheEntry && !shouldTryMulti) {
+
+    CacheEntry->Stamp = CacheIVM->Stamp;
+    CacheEntry->Offset = Offset;
+    CacheEntry->Size = Size;
+    CacheEntry->ASize = ASize;
+    CacheEntry->Result = Result;
+
   }
   else if(shouldTryMulti && ResultMulti) {
 
@@ -953,7 +1176,7 @@ void llvm::readValRange(ShadowValue& V, int64_t Offset, uint64_t Size, ShadowBB*
 
     if(anyGoodValues) {
 
-      ImprovedValSetMulti* IVM = new ImprovedValSetMulti(ReadBB->getAllocSize(V));
+      ImprovedValSetMulti* IVM = newIVM(ReadBB->getAllocSize(V));
       ImprovedValSetMulti::MapIt it = IVM->Map.begin();
 
       for(unsigned i = 0, iend = Results.size(); i != iend; ++i) {
@@ -1535,6 +1758,10 @@ void llvm::getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetS
 
   }
 
+  // Large aggregates are read from a flattened image instead.
+  if(readConstantImage(FromC, Offset, TargetSize, OffsetAbove, Dest))
+    return;
+
   // Reading a sub-value. Cases:
   // * Array type / Struct type: Grab sub-elements whole as far as possible.
   // * ConstantDataSequential / ConstantAggregateZero / vectors / primitives: Do byte-wise constant extraction.
@@ -1794,6 +2021,7 @@ void llvm::replaceRangeWithPB(ImprovedValSet* Target, const ImprovedValSetSingle
   else {
     
     ImprovedValSetMulti* M = cast<ImprovedValSetMulti>(Target);
+    M->refreshStamp();
 
     if(Size == ULONG_MAX) {
 
@@ -1921,6 +2149,74 @@ void llvm::clearRange(ImprovedValSetMulti* M, uint64_t Offset, uint64_t Size) {
 
 }
 
+// Copying from an object that was filled in piecemeal produces long runs of small scalar
+// extents. Runs of at least this many adjacent constants are stored as a single byte array,
+// which keeps the target's extent map small and lets later partial overwrites and reads
+// work on the raw bytes rather than splitting many small constants.
+static const uint32_t MinCoalesceExtents = 8;
+
+static bool isCoalescableExtent(const IVSRange& R) {
+
+  const ImprovedValSetSingle& S = R.second;
+  if(S.isWhollyUnknown() || S.SetType != ValSetTypeScalar || S.Values.size() != 1)
+    return false;
+
+  // Undef would read as zero bytes, losing the fact that it's undefined.
+  Constant* C = getSingleConstant(S.Values[0].V);
+  return C && !isa<UndefValue>(C);
+
+}
+
+// Write In to Out, replacing runs of coalescable extents with byte-array constants.
+// Returns false, leaving Out unspecified, if there was nothing to coalesce.
+static bool coalesceScalarExtents(const SmallVector<IVSRange, 4>& In, SmallVector<IVSRange, 4>& Out) {
+
+  if(In.size() < MinCoalesceExtents)
+    return false;
+
+  bool Changed = false;
+
+  for(uint32_t i = 0, ilim = In.size(); i != ilim;) {
+
+    uint32_t RunEnd = i;
+    while(RunEnd != ilim && isCoalescableExtent(In[RunEnd]) &&
+	  (RunEnd == i || In[RunEnd].first.first == In[RunEnd - 1].first.second))
+      ++RunEnd;
+
+    if(RunEnd - i < MinCoalesceExtents) {
+      Out.push_back(In[i]);
+      ++i;
+      continue;
+    }
+
+    uint64_t RunStart = In[i].first.first;
+    SmallVector<uint8_t, 64> Buffer(In[RunEnd - 1].first.second - RunStart);
+
+    bool Read = true;
+    for(uint32_t j = i; j != RunEnd && Read; ++j) {
+      const IVSRange& R = In[j];
+      Read = XXXReadDataFromGlobal(getSingleConstant(R.second.Values[0].V), 0, &Buffer[R.first.first - RunStart],
+				   R.first.second - R.first.first, *GlobalTD);
+    }
+
+    if(!Read) {
+      Out.append(In.begin() + i, In.begin() + RunEnd);
+    }
+    else {
+      Constant* Bytes = ConstantDataArray::get(GInt8->getContext(), ArrayRef<uint8_t>(Buffer));
+      std::pair<ValSetType, ImprovedVal> V = getValPB(Bytes);
+      Out.push_back(IVSR(RunStart, RunStart + Buffer.size(), ImprovedValSetSingle(V.second, V.first)));
+      Changed = true;
+    }
+
+    i = RunEnd;
+
+  }
+
+  return Changed;
+
+}
+
 // Target is a symbolic memory object. Overwrite Target[Offset:Offset+Size] with extent-list NewVals.
 void llvm::replaceRangeWithPBs(ImprovedValSet* Target, const SmallVector<IVSRange, 4>& NewVals, uint64_t Offset, uint64_t Size) {
 
@@ -1931,13 +2227,17 @@ void llvm::replaceRangeWithPBs(ImprovedValSet* Target, const SmallVector<IVSRang
   else {
     
     ImprovedValSetMulti* M = cast<ImprovedValSetMulti>(Target);
+    M->refreshStamp();
+
+    SmallVector<IVSRange, 4> Coalesced;
+    const SmallVector<IVSRange, 4>& Vals = coalesceScalarExtents(NewVals, Coalesced) ? Coalesced : NewVals;
 
     clearRange(M, Offset, Size);
     ImprovedValSetMulti::MapIt it = M->Map.find(Offset);
 
-    for(unsigned i = 0, iend = NewVals.size(); i != iend; ++i) {
+    for(unsigned i = 0, iend = Vals.size(); i != iend; ++i) {
 
-      const IVSRange& RangeVal = NewVals[i];
+      const IVSRange& RangeVal = Vals[i];
       it.insert(RangeVal.first.first, RangeVal.first.second, RangeVal.second);
       ++it;
 
@@ -2213,7 +2513,7 @@ void llvm::readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet*
       if(!IVM->Underlying) {
 
 	// No underlying map means undefined value below.
-	uint64_t UndefSize = Size - Offset;
+	uint64_t UndefSize = Size;
 	Type* UndefType = IntegerType::get(GInt8Ptr->getContext(), UndefSize * 8);
 	Value* UD = UndefValue::get(UndefType);
 	Results.push_back(IVSR(Offset, Offset + Size, ImprovedValSetSingle(ImprovedVal(UD), ValSetTypeScalar)));	
@@ -2254,7 +2554,7 @@ void llvm::readValRangeMulti(ShadowValue& V, uint64_t Offset, uint64_t Size, Sha
 
   LocStore* firstStore = ReadBB->getReadableStoreFor(V);
   if(!firstStore) {
-    if(ReadBB->localStore->allOthersClobbered) {
+    if(ReadBB->localStore->allOthersClobbered || isHeapObject(V)) {
       LFV3(errs() << "Location not in local map and allOthersClobbered\n");
       Results.push_back(IVSR(Offset, Offset+Size, ImprovedValSetSingle(ValSetTypeUnknown, true)));
       return;
@@ -2311,13 +2611,17 @@ void llvm::executeVaCopyInst(ShadowInstruction* SI) {
 
 }
 
-void llvm::executeAllocInst(ShadowInstruction* SI, AllocData& AD, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx) {
+void llvm::executeAllocInst(ShadowInstruction* SI, AllocData& AD, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx, uint64_t SizeBound) {
 
   // Represent the store by a big undef value at the start, or if !AllocType (implying AllocSize
-  // == ULONG_MAX, unknown size), start with a big Overdef.
+  // == ULONG_MAX, unknown size), start with a big Overdef. If the size is unknown but bounded, the
+  // object is undef up to the bound: the rest can't be accessed whatever the size turns out to be.
  
   ImprovedValSetSingle* initVal;
 
+  if((!AllocType) && SizeBound != ULONG_MAX)
+    AllocType = ArrayType::get(Type::getInt8Ty(SI->invar->I->getContext()), SizeBound);
+
   if(AllocType) {
     Constant* Undef = UndefValue::get(AllocType);
     ImprovedVal IV(ShadowValue(Undef), 0);
@@ -2333,12 +2637,16 @@ void llvm::executeAllocInst(ShadowInstruction* SI, AllocData& AD, Type* AllocTyp
   localStore.store = initVal;
 
   AD.storeSize = AllocSize;
+  AD.sizeBound = AllocSize == ULONG_MAX ? SizeBound : AllocSize;
   // AD.allocIdx was already set by our caller.
   AD.allocVague = false;
   AD.allocTested = AllocUnchecked;
   AD.allocValue = ShadowValue(SI);
   AD.isCommitted = false;
   AD.allocType = SI->getType();
+  AD.mayEscape = false;
+  AD.committedOnce = false;
+  AD.isSummary = false;
 
   // Note that the new object is unreachable from old objects, thread-local and unescaped.
   SI->parent->localStore = SI->parent->localStore->getWritableFrameList();
@@ -2352,13 +2660,50 @@ void llvm::executeAllocInst(ShadowInstruction* SI, AllocData& AD, Type* AllocTyp
 
 }
 
-static void markVagueAllocation(ShadowInstruction* SI) {
+static void markVagueAllocation(ShadowInstruction* SI, uint64_t SizeBound = 0) {
 
   ImprovedValSetSingle* IVS = cast<ImprovedValSetSingle>(SI->i.PB);
   release_assert(SI->i.PB && isa<ImprovedValSetSingle>(SI->i.PB) && IVS->SetType == ValSetTypePB);
-  IVS->Values[0].V.getAllocData(SI->parent->localStore)->allocVague = true;
+  AllocData* AD = IVS->Values[0].V.getAllocData(SI->parent->localStore);
+  AD->allocVague = true;
   //errs() << "Allocation " << itcache(SI) << " in " << SI->parent->IA->SeqNumber << " vague\n";
 
+  // A later instance may be bigger than the first: bytes beyond the old bound read as overdef,
+  // but the bound must still cover every instance for whole-object copies.
+  if(AD->storeSize == ULONG_MAX && SizeBound > AD->sizeBound)
+    AD->sizeBound = SizeBound;
+
+}
+
+// If allocation size SizeV is known to be one of a set of integers, return the largest, else ULONG_MAX.
+static uint64_t getAllocSizeBound(ShadowValue SizeV) {
+
+  ImprovedValSetSingle IVS;
+  if((!getImprovedValSetSingle(SizeV, IVS)) || IVS.isWhollyUnknown() || IVS.SetType != ValSetTypeScalar || IVS.Values.empty())
+    return ULONG_MAX;
+
+  uint64_t Bound = 0;
+  for(uint32_t i = 0, ilim = IVS.Values.size(); i != ilim; ++i) {
+
+    uint64_t Int;
+    if(!tryGetConstantInt(IVS.Values[i].V, Int))
+      return ULONG_MAX;
+    Bound = std::max(Bound, Int);
+
+  }
+
+  return Bound;
+
+}
+
+// Get V's exact size if known, or else its size bound (ULONG_MAX if it has neither).
+static uint64_t getAllocSizeLimit(ShadowBB* BB, ShadowValue V) {
+
+  uint64_t Size = BB->getAllocSize(V);
+  if(Size != ULONG_MAX || !V.isPtrIdx())
+    return Size;
+  return V.getAllocData(BB->localStore)->sizeBound;
+
 }
 
 void llvm::executeAllocaInst(ShadowInstruction* SI) {
@@ -2396,6 +2741,7 @@ void llvm::executeAllocaInst(ShadowInstruction* SI) {
   parentIA->localAllocas.push_back(AllocData());  
   AllocData& AD = parentIA->localAllocas.back();
   AD.allocIdx = allocIdx;
+  AD.alignment = AI->getAlignment() ? AI->getAlignment() : GlobalTD->getABITypeAlignment(AI->getAllocatedType());
   
   executeAllocInst(SI, AD, allocType, allocType ? GlobalTD->getTypeStoreSize(allocType) : ULONG_MAX, parentIA->stack_depth, allocIdx);
 
@@ -2410,10 +2756,68 @@ AllocData& llvm::addHeapAlloc(ShadowInstruction* SI) {
 
 }
 
+// With -llpe-alloc-site-limit=K, an allocation site in a peeled loop gets a distinct heap object in
+// each of its first K iterations, and all later ones share one summary object. Otherwise a loop that
+// mallocs per iteration would create as many objects (each with its own store entries, carried through
+// every later iteration) as it runs iterations. The summary is vague, so stores to it are weak, and a
+// pointer to it may mean any of the objects it stands for, so it is never synthesised or assumed
+// null-tested, and pointers into it are never ordered against one another.
+// Returns the site's entry if SI should use its summary, or null if it should allocate as usual.
+static std::pair<uint32_t, int32_t>* getAllocSiteSummary(ShadowInstruction* SI) {
+
+  uint32_t Limit = GlobalIHP->allocSiteLimit;
+  if(!Limit || !SI->parent->IA->L)
+    return 0;
+
+  PeelAttempt* PA = static_cast<PeelIteration*>(SI->parent->IA)->getParentPA();
+  std::pair<uint32_t, int32_t>& Site = PA->allocSites.insert(std::make_pair(SI->invar, std::make_pair(0U, -1))).first->second;
+
+  if(Site.first < Limit) {
+    ++Site.first;
+    return 0;
+  }
+
+  return &Site;
+
+}
+
+static void executeHeapAllocInst(ShadowInstruction* SI, Type* allocType, uint64_t allocSize, uint64_t sizeBound) {
+
+  std::pair<uint32_t, int32_t>* Summary = getAllocSiteSummary(SI);
+
+  if(Summary && Summary->second != -1) {
+
+    // Point at the existing summary without reinitialising it: its contents are
+    // whatever any earlier instance left there.
+    ImprovedValSetSingle* NewIVS = newIVS();
+    SI->i.PB = NewIVS;
+    NewIVS->set(ImprovedVal(ShadowValue::getPtrIdx(-1, Summary->second), 0), ValSetTypePB);
+    ++GlobalIHP->stats.summarisedAllocations;
+    return;
+
+  }
+
+  AllocData& AD = addHeapAlloc(SI);
+  AD.alignment = GlobalIHP->getMallocAlignment();
+  executeAllocInst(SI, AD, allocType, allocSize, -1, GlobalIHP->heap.size() - 1, sizeBound);
+  if(allocSize == ULONG_MAX && sizeBound != ULONG_MAX)
+    ++GlobalIHP->stats.boundedAllocations;
+
+  if(Summary) {
+
+    Summary->second = AD.allocIdx;
+    AD.allocVague = true;
+    AD.isSummary = true;
+    ++GlobalIHP->stats.summarisedAllocations;
+
+  }
+
+}
+
 static void executeMallocInst2(ShadowInstruction* SI, AllocatorFn& param) {
 
   if(SI->i.PB) {
-    markVagueAllocation(SI);
+    markVagueAllocation(SI, param.isConstantSize ? 0 : getAllocSizeBound(SI->getCallArgOperand(param.sizeArg)));
     return;
   }
 
@@ -2428,8 +2832,8 @@ static void executeMallocInst2(ShadowInstruction* SI, AllocatorFn& param) {
 
   SI->parent->IA->noteMalloc(SI);
 
-  AllocData& AD = addHeapAlloc(SI);
-  executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, GlobalIHP->heap.size() - 1);
+  executeHeapAllocInst(SI, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX,
+		       AllocSize ? ULONG_MAX : getAllocSizeBound(SI->getCallArgOperand(param.sizeArg)));
   
 }
 
@@ -2440,10 +2844,33 @@ void llvm::executeMallocLikeInst(ShadowInstruction* SI) {
 
 }
 
+// Note that the heap objects Ptr might point to could be released by a free or realloc.
+static void noteHeapRelease(ShadowValue Ptr) {
+
+  ImprovedValSetSingle PtrSet;
+  if(!getImprovedValSetSingle(Ptr, PtrSet))
+    return;
+
+  if(PtrSet.isWhollyUnknown() || PtrSet.SetType != ValSetTypePB) {
+    if(!PtrSet.isOldValue())
+      GlobalIHP->heapMayBeFreedVaguely = true;
+    return;
+  }
+
+  for(uint32_t i = 0, ilim = PtrSet.Values.size(); i != ilim; ++i) {
+    ShadowValue& V = PtrSet.Values[i].V;
+    if(V.isPtrIdx() && V.getFrameNo() == -1)
+      GlobalIHP->heap[V.getHeapKey()].mayEscape = true;
+  }
+
+}
+
 void llvm::executeFreeInst(ShadowInstruction* SI, Function* FreeF) {
 
   DeallocatorFn& De = GlobalIHP->deallocatorFunctions[FreeF];
 
+  noteHeapRelease(SI->getCallArgOperand(De.arg));
+
   ShadowInstruction* FreedPtr = SI->getCallArgOperand(De.arg).getInst();
   if(!FreedPtr)
     return;
@@ -2460,8 +2887,10 @@ void llvm::executeFreeInst(ShadowInstruction* SI, Function* FreeF) {
 
   ImprovedValSetSingle TagIVS;
   TagIVS.SetType = ValSetTypeDeallocated;
+  GlobalIHP->heapObjectsFreed = true;
 
   executeWriteInst(0, *FreedIVS, TagIVS, SI->parent->getAllocSize(FreedIVS->Values[0].V), SI);
+  SI->parent->dropFreedObject(FreedIVS->Values[0].V);
 
 }
 
@@ -2479,17 +2908,18 @@ void llvm::executeReallocInst(ShadowInstruction* SI, Function* F) {
 
     SI->parent->IA->noteMalloc(SI);
 
-    AllocData& AD = addHeapAlloc(SI);
-    executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, GlobalIHP->heap.size() - 1);
+    executeHeapAllocInst(SI, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX,
+			 AllocSize ? ULONG_MAX : getAllocSizeBound(SI->getCallArgOperand(Re.sizeArg)));
 
   }
   else {
 
-    markVagueAllocation(SI);
+    markVagueAllocation(SI, getAllocSizeBound(SI->getCallArgOperand(Re.sizeArg)));
 
   }
 
   ShadowValue SrcPtr = SI->getCallArgOperand(Re.ptrArg);
+  noteHeapRelease(SrcPtr);
   ImprovedValSetSingle SrcPtrSet;
   release_assert(getImprovedValSetSingle(SrcPtr, SrcPtrSet) && "Realloc from uninitialised PB?");
   if(!(SrcPtrSet.isWhollyUnknown() || SrcPtrSet.SetType == ValSetTypePB))
@@ -2504,7 +2934,11 @@ void llvm::executeReallocInst(ShadowInstruction* SI, Function* F) {
   }
   else {
 
-    CopySize = SI->parent->getAllocSize(SrcPtrSet.Values[0].V);
+    // Realloc copies the lesser of the old and new sizes. Where either is only bounded, copying
+    // up to the bound is still exact: source bytes past its real size are undefined, and so are
+    // destination bytes past its own.
+    CopySize = std::min(getAllocSizeLimit(SI->parent, SrcPtrSet.Values[0].V),
+			getAllocSizeLimit(SI->parent, cast<ImprovedValSetSingle>(SI->i.PB)->Values[0].V));
 
   }
 
@@ -2558,13 +2992,111 @@ void llvm::writeExtents(SmallVector<IVSRange, 4>& copyValues, ShadowValue& Ptr,
 
 }
 
+// Whether any layer of a stack of overlaid stores may hold anything but plain scalars.
+static bool storeStackMayContainPointers(ImprovedValSet* IV) {
+
+  while(IV) {
+
+    ImprovedValSetMulti* IVM = dyn_cast<ImprovedValSetMulti>(IV);
+    if(!IVM)
+      return cast<ImprovedValSetSingle>(IV)->SetType != ValSetTypeScalar && cast<ImprovedValSetSingle>(IV)->SetType != ValSetTypeScalarSplat;
+
+    for(ImprovedValSetMulti::MapIt it = IVM->Map.begin(), itend = IVM->Map.end(); it != itend; ++it) {
+
+      ValSetType SetType = it.value().SetType;
+      if(SetType != ValSetTypeScalar && SetType != ValSetTypeScalarSplat)
+	return true;
+
+    }
+
+    IV = IVM->Underlying;
+
+  }
+
+  return false;
+
+}
+
+// A copy of the whole of one object over the whole of another, same-sized object needn't
+// read the source extent by extent: the destination can share the source's copy-on-write store,
+// which gets copied only when one of them is next written. What it read is kept as a reference
+// to the same store, from which memcpyValues is built if anything asks for it.
+// Only applies to stores of plain scalars: copying pointers or FDs must propagate flags to
+// the objects they refer to.
+static bool tryShareCopiedStore(ImprovedVal& Dest, ImprovedVal& Src, uint64_t Size, ShadowInstruction* CopySI) {
+
+  ShadowBB* BB = CopySI->parent;
+
+  if(Dest.Offset != 0 || Src.Offset != 0 || Dest.V == Src.V || Src.V.getGV() || Src.V.isVal())
+    return false;
+
+  if(Size == ULONG_MAX || BB->getAllocSize(Src.V) != Size || BB->getAllocSize(Dest.V) != Size)
+    return false;
+
+  LocStore* SrcStore = BB->getReadableStoreFor(Src.V);
+  if((!SrcStore) || !isa<ImprovedValSetMulti>(SrcStore->store) || storeStackMayContainPointers(SrcStore->store))
+    return false;
+
+  // Take the source's store before finding the destination one, which might disturb it.
+  ImprovedValSet* Shared = SrcStore->store->getReadableCopy();
+
+  LocStore* DestStore = BB->getWritableStoreFor(Dest.V, 0, Size, true);
+  if(!DestStore) {
+    Shared->dropReference();
+    return false;
+  }
+
+  DestStore->store->dropReference();
+  DestStore->store = Shared;
+  checkStore(DestStore->store, Dest.V);
+
+  GlobalIHP->memcpySnapshots[CopySI] = std::make_pair(Shared->getReadableCopy(), Size);
+  GlobalIHP->stats.memcpyBytesReferenced += Size;
+  return true;
+
+}
+
+// Get the values CopySI read if it worked, filling them in if it shared a store instead.
+SmallVector<IVSRange, 4>* llvm::getMemcpyValues(ShadowInstruction* CopySI) {
+
+  DenseMap<ShadowInstruction*, SmallVector<IVSRange, 4> >::iterator findit = GlobalIHP->memcpyValues.find(CopySI);
+  if(findit != GlobalIHP->memcpyValues.end())
+    return &findit->second;
+
+  DenseMap<ShadowInstruction*, std::pair<ImprovedValSet*, uint64_t> >::iterator snapit = GlobalIHP->memcpySnapshots.find(CopySI);
+  if(snapit == GlobalIHP->memcpySnapshots.end())
+    return 0;
+
+  ImprovedValSet* Snapshot = snapit->second.first;
+  uint64_t Size = snapit->second.second;
+  GlobalIHP->memcpySnapshots.erase(snapit);
+
+  SmallVector<IVSRange, 4>& Vals = GlobalIHP->memcpyValues[CopySI];
+  readValRangeMultiFrom(0, Size, Snapshot, Vals, 0, Size);
+  Snapshot->dropReference();
+  return &Vals;
+
+}
+
+void llvm::forgetMemcpyValues(ShadowInstruction* CopySI) {
+
+  GlobalIHP->memcpyValues.erase(CopySI);
+
+  DenseMap<ShadowInstruction*, std::pair<ImprovedValSet*, uint64_t> >::iterator snapit = GlobalIHP->memcpySnapshots.find(CopySI);
+  if(snapit != GlobalIHP->memcpySnapshots.end()) {
+    snapit->second.first->dropReference();
+    GlobalIHP->memcpySnapshots.erase(snapit);
+  }
+
+}
+
 void llvm::executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& SrcPtrSet, uint64_t Size, ShadowInstruction* CopySI) {
 
   ShadowBB* BB = CopySI->parent;
 
   LFV3(errs() << "Start copy inst\n");
 
-  GlobalIHP->memcpyValues.erase(CopySI);
+  forgetMemcpyValues(CopySI);
 
   // No need to check the copy instruction is as expected in any of the coming failure cases.
   CopySI->isThreadLocal = TLS_NEVERCHECK;
@@ -2632,6 +3164,11 @@ void llvm::executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, Impro
     BB->localStore->es.threadLocalObjects.count(SrcPtrSet.Values[0].V) ? 
     TLS_NEVERCHECK : TLS_MUSTCHECK;
 
+  if(tryShareCopiedStore(PtrSet.Values[0], SrcPtrSet.Values[0], Size, CopySI))
+    return;
+
+  GlobalIHP->stats.memcpyBytesCopied += Size;
+
   SmallVector<IVSRange, 4>& copyValues = GlobalIHP->memcpyValues[CopySI];
 
   readValRangeMulti(SrcPtrSet.Values[0].V, SrcPtrSet.Values[0].Offset, Size, BB, copyValues);
@@ -2699,11 +3236,11 @@ void llvm::executeVaStartInst(ShadowInstruction* SI) {
 
 }
 
-void llvm::executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uint64_t FileOffset, uint64_t Size) {
+// Write Filename[FileOffset:FileOffset+Size] through Ptr, followed by a NUL if nulTerminate is set.
+void llvm::executeReadInst(ShadowInstruction* ReadSI, ShadowValue Ptr, std::string& Filename, uint64_t FileOffset, uint64_t Size, bool nulTerminate) {
 
   LFV3(errs() << "Start read inst\n");
 
-  ShadowValue Ptr = ReadSI->getCallArgOperand(1);
   ImprovedValSetSingle PtrSet;
   release_assert(getImprovedValSetSingle(Ptr, PtrSet) && "Write through uninitialised PB (read)?");
   if(!(PtrSet.isWhollyUnknown() || PtrSet.SetType == ValSetTypePB))
@@ -2718,18 +3255,17 @@ void llvm::executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uin
   }
   else {
 
-    std::vector<Constant*> constBytes;
+    Constant* ByteArray;
     std::string errors;
-    LLVMContext& Context = Ptr.getLLVMContext();
-    if(getFileBytes(Filename, FileOffset, Size, constBytes, Context,  errors)) {
-      ArrayType* ArrType = ArrayType::get(IntegerType::get(Context, 8), constBytes.size());
-      Constant* ByteArray = ConstantArray::get(ArrType, constBytes);
+    if(getReadCallBytes(ReadSI, Filename, FileOffset, Size, nulTerminate, ByteArray, errors)) {
+
       WriteIVS = ImprovedValSetSingle(ImprovedVal(ByteArray, 0), ValSetTypeScalar);
+
     }
 
   }
 
-  executeWriteInst(&Ptr, PtrSet, WriteIVS, Size, ReadSI);
+  executeWriteInst(&Ptr, PtrSet, WriteIVS, nulTerminate ? Size + 1 : Size, ReadSI);
 
 }
 
@@ -3045,8 +3581,8 @@ bool llvm::clobberSyscallModLocations(Function* F, ShadowInstruction* SI) {
     if((CI = dyn_cast_inst<CallInst>(SI)) && GlobalIHP->pessimisticLocks.count(CI)) {
 
       // A pessimistic lock clobbers the domain over which it operates.
-      // If one is specified, clobber those objects; otherwise just return false
-      // to clobber everything.
+      // If one is specified, clobber those objects; otherwise clobber every object
+      // another thread could have written.
       // Optimistic locks have no effect here and are accounted for in the
       // tentative loads phase.
 
@@ -3070,8 +3606,8 @@ bool llvm::clobberSyscallModLocations(Function* F, ShadowInstruction* SI) {
       }
       else {
 
-	// Clobber all objects.
-	return false;
+	// Objects that are still thread-local can't have been published to anyone else.
+	SI->parent->clobberGlobalObjects();
 
       }
 
@@ -3200,6 +3736,21 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
       deleteIV(SI->i.PB);
     SI->i.PB = newOverdefIVS();
 
+    // ...but if the callee is one of a few functions, none of which write memory, the call is harmless.
+    SmallVector<Function*, 4> Candidates;
+    if(getCalledFunctionCandidates(SI, Candidates, 4)) {
+
+      bool allReadOnly = true;
+      for(SmallVector<Function*, 4>::iterator it = Candidates.begin(), itend = Candidates.end(); it != itend && allReadOnly; ++it)
+	allReadOnly = (*it)->onlyReadsMemory();
+
+      if(allReadOnly) {
+	++GlobalIHP->stats.readOnlyIndirectCalls;
+	return;
+      }
+
+    }
+
   }
 
   bool clobbersMemory = true;
@@ -3224,7 +3775,7 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
     executeWriteInst(0, OD, OD, MemoryLocation::UnknownSize, SI);
     // Functions that clobber FD state happen to be the same.
     FDStore* FDS = SI->parent->getWritableFDStore();
-    FDS->fds.clear();
+    FDS->clear();
     
   }
     
@@ -3243,11 +3794,7 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
 void ShadowBB::setAllObjectsMayAliasOld() {
 
   localStore = localStore->getWritableFrameList();
-
-  DenseSet<ShadowValue>* preservePtr[1] = { &localStore->es.unescapedObjects };
-
-  intersectSets(&localStore->es.noAliasOldObjects,
-		MutableArrayRef<DenseSet<ShadowValue>* >(preservePtr));
+  localStore->es.noAliasOldObjects.intersectWith(localStore->es.unescapedObjects);
 
 }
 
@@ -3256,11 +3803,7 @@ void ShadowBB::setAllObjectsThreadGlobal() {
   localStore = localStore->getWritableFrameList();
 
   // Preserve unescaped objects from losing their thread-local status.
-  
-  DenseSet<ShadowValue>* preservePtr[1] = { &localStore->es.unescapedObjects };
-
-  intersectSets(&localStore->es.threadLocalObjects, 
-		MutableArrayRef<DenseSet<ShadowValue>* >(preservePtr));
+  localStore->es.threadLocalObjects.intersectWith(localStore->es.unescapedObjects);
 
 }
 
@@ -3268,11 +3811,23 @@ void ShadowBB::setAllObjectsThreadGlobal() {
 // This is used when e.g. writing through an unknown pointer, but one which is known
 // not to alias objects that predate specialistion, or not to alias unescaped
 // thread-local objects, or...
-void ShadowBB::clobberAllExcept(DenseSet<ShadowValue>& Save, bool verbose) {
+// The rebuild is skipped if the store was last clobbered to a subset of Save and has gained no entries
+// since, so that it holds only objects Save spares anyway: typically a run of unexpanded calls.
+void ShadowBB::clobberAllExcept(const ObjectSet& Save, bool verbose) {
+
+  if(localStore->allOthersClobbered && localStore->onlyClobberSaved && localStore->es.clobberSave.isSubsetOf(Save)) {
+    ++GlobalIHP->stats.skippedClobbers;
+    return;
+  }
+
+  // Save belongs to the map we're about to replace.
+  ObjectSet Spared(Save);
 
   std::vector<std::pair<ShadowValue, ImprovedValSet*> > SaveVals;
+  std::vector<ShadowValue> SaveObjects;
+  Spared.getMembers(SaveObjects);
 
-  for(DenseSet<ShadowValue>::iterator it = Save.begin(), itend = Save.end(); it != itend; ++it) {
+  for(std::vector<ShadowValue>::iterator it = SaveObjects.begin(), itend = SaveObjects.end(); it != itend; ++it) {
 
     LocStore* CurrentVal = getReadableStoreFor(*it);
     if(!CurrentVal)
@@ -3297,6 +3852,9 @@ void ShadowBB::clobberAllExcept(DenseSet<ShadowValue>& Save, bool verbose) {
 
   }
 
+  localStore->es.clobberSave = Spared;
+  localStore->onlyClobberSaved = true;
+
 }
 
 void ShadowBB::clobberMayAliasOldObjects() {
@@ -3325,6 +3883,9 @@ void ShadowBB::clobberGlobalObjects() {
 // but the initial allocation site?
 static void pointerEscaped(const ShadowValue V, ShadowBB* BB) {
 
+  if(V.isPtrIdx() && V.getFrameNo() == -1)
+    GlobalIHP->heap[V.getHeapKey()].mayEscape = true;
+
   if(BB->localStore->es.unescapedObjects.count(V)) {
 
     BB->localStore = BB->localStore->getWritableFrameList();
@@ -3640,10 +4201,7 @@ static void scalarSplatToScalar(ImprovedValSetSingle& IVS, Type* targetType) {
     uint64_t Size = GlobalTD->getTypeStoreSize(targetType);
     PartialVal PV(Size);
     uint8_t SplatVal = (uint8_t)cast<ConstantInt>(IVS.Values[i].V.getVal())->getLimitedValue();
-    memset(PV.partialBuf, SplatVal, Size);
-    for(uint64_t i = 0; i != Size; ++i)
-      PV.partialValidBuf[i] = true;
-    PV.loadFinished = true;
+    PV.fill(SplatVal);
     Constant* PVC = PVToConst(PV, Size, targetType->getContext());
     IVS.Values[i] = ImprovedVal(ShadowValue(PVC));
 
@@ -3748,7 +4306,12 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
     }
 
     // Deallocated is always overridden by a definition from the other side.
+    // Our single isn't shared, so another single can be copied straight over it.
     if(IVS->SetType == ValSetTypeDeallocated) {
+      if(ImprovedValSetSingle* IVS2 = dyn_cast<ImprovedValSetSingle>(mergeFromStore->store)) {
+	*IVS = *IVS2;
+	return;
+      }
       mergeToStore->store->dropReference();
       mergeToStore->store = mergeFromStore->store->getReadableCopy();
       return;
@@ -3768,6 +4331,15 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
     if(IVS->SetType == ValSetTypeDeallocated)
       return;
 
+    // Merging with a wholly overdefined store clobbers every byte, so don't bother
+    // splitting the target into ranges only to overdef each one.
+    if(IVS->Overdef) {
+      LFV3(errs() << "Source clobbered, clobber target\n");
+      mergeToStore->store->dropReference();
+      mergeToStore->store = IVS->getReadableCopy();
+      return;
+    }
+
   }
 
   // Get an IVS list for each side that contains gaps where there is a common ancestor:
@@ -3941,6 +4513,7 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
     if(mergeToStore->store->isWritableMulti()) {
       ImprovedValSetMulti* M = cast<ImprovedValSetMulti>(mergeToStore->store);
       LFV3(errs() << "Using existing writable multi " << M << "\n");
+      M->refreshStamp();
       M->Map.clear();
       if(M->Underlying)
 	M->Underlying->dropReference();
@@ -3948,7 +4521,7 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
     }
     else {
       mergeToStore->store->dropReference();
-      newStore = new ImprovedValSetMulti(ASize);
+      newStore = newIVM(ASize);
       LFV3(errs() << "Drop existing store " << mergeToStore->store << ", allocate new multi " << newStore << "\n");
     }	
 
@@ -3998,7 +4571,7 @@ void LocStore::simplifyStore(LocStore* LS) {
 
     // IVM2 becomes the new head.
     LS->store = IVM2;
-    delete IVM;
+    deleteIVM(IVM);
 
     /*
     errs() << "Result:\n";
@@ -4009,97 +4582,199 @@ void LocStore::simplifyStore(LocStore* LS) {
 
 }
 
-static bool sizeLT(const DenseSet<ShadowValue>* a, const DenseSet<ShadowValue>* b) {
+ObjectSetChunk* ObjectSet::getWritableChunk(ChunkIt it) {
 
-  return a->size() < b->size();
+  if((*it)->refCount != 1) {
+    ObjectSetChunk* Old = *it;
+    *it = new ObjectSetChunk(*Old);
+    release(Old);
+  }
+  return *it;
 
 }
 
-// mergeBegin -> mergeEnd are already listed smallest set first.
-void llvm::intersectSets(DenseSet<ShadowValue>* Target, MutableArrayRef<DenseSet<ShadowValue>* > Merge) {
+void ObjectSet::insert(const ShadowValue& V) {
 
-  SmallVector<ShadowValue, 8> toKeep;
+  uint64_t Key;
+  release_assert(getKey(V, Key) && "Non-object added to an object set");
 
-  MutableArrayRef<DenseSet<ShadowValue>* >::iterator mergeBegin = Merge.begin(), mergeEnd = Merge.end();
-  std::sort(mergeBegin, mergeEnd, sizeLT);
+  uint64_t First = Key & ~((uint64_t)ObjectSetChunk::Bits - 1);
+  ChunkIt it = std::lower_bound(chunks.begin(), chunks.end(), First, chunkLT);
+  ObjectSetChunk* C;
+  if(it == chunks.end() || (*it)->firstKey != First) {
+    C = new ObjectSetChunk(First);
+    chunks.insert(it, C);
+  }
+  else {
+    C = getWritableChunk(it);
+  }
 
-  if(Target->size() < (*mergeBegin)->size()) {
+  uint64_t Off = Key - First;
+  C->words[Off / 64] |= (((uint64_t)1) << (Off % 64));
 
-    for(DenseSet<ShadowValue>::iterator it = Target->begin(), itend = Target->end(); it != itend; ++it) {
+}
 
-      bool keepThis = true;
-      for(MutableArrayRef<DenseSet<ShadowValue>* >::iterator findit = mergeBegin; findit != mergeEnd && keepThis; ++findit) {
+void ObjectSet::erase(const ShadowValue& V) {
 
-	if(!(*findit)->count(*it))
-	  keepThis = false;
+  if(!count(V))
+    return;
 
+  uint64_t Key;
+  getKey(V, Key);
+  uint64_t First = Key & ~((uint64_t)ObjectSetChunk::Bits - 1);
+  ChunkIt it = std::lower_bound(chunks.begin(), chunks.end(), First, chunkLT);
+  ObjectSetChunk* C = getWritableChunk(it);
+
+  uint64_t Off = Key - First;
+  C->words[Off / 64] &= ~(((uint64_t)1) << (Off % 64));
+
+  for(uint32_t i = 0; i != ObjectSetChunk::Words; ++i) {
+    if(C->words[i])
+      return;
+  }
+
+  release(C);
+  chunks.erase(it);
+
+}
+
+// Drop every object of stack frame Frame. A frame's keys are a contiguous run of whole chunks,
+// so this releases those chunks without looking at their bits.
+void ObjectSet::eraseFrame(int32_t Frame) {
+
+  uint64_t First = ((uint64_t)(Frame + 1)) << 32;
+  uint64_t Stop = ((uint64_t)(Frame + 2)) << 32;
+
+  ChunkIt it = std::lower_bound(chunks.begin(), chunks.end(), First, chunkLT);
+  ChunkIt endit = std::lower_bound(it, chunks.end(), Stop, chunkLT);
+  if(it == endit)
+    return;
+
+  for(ChunkIt relit = it; relit != endit; ++relit)
+    release(*relit);
+  chunks.erase(it, endit);
+
+}
+
+// Keep only the members that Other shares. Chunks that are identical, or whose bits are all
+// in Other, are left shared.
+void ObjectSet::intersectWith(const ObjectSet& Other) {
+
+  uint32_t nKept = 0;
+  ConstChunkIt otherit = Other.chunks.begin(), otherend = Other.chunks.end();
+
+  for(uint32_t i = 0, ilim = chunks.size(); i != ilim; ++i) {
+
+    ObjectSetChunk* C = chunks[i];
+    while(otherit != otherend && (*otherit)->firstKey < C->firstKey)
+      ++otherit;
+
+    if(otherit == otherend || (*otherit)->firstKey != C->firstKey) {
+      release(C);
+      continue;
+    }
+
+    const ObjectSetChunk* O = *otherit;
+    if(O != C) {
+
+      bool anyKept = false, anyLost = false;
+      for(uint32_t w = 0; w != ObjectSetChunk::Words; ++w) {
+	if(C->words[w] & O->words[w])
+	  anyKept = true;
+	if(C->words[w] & ~O->words[w])
+	  anyLost = true;
       }
 
-      if(keepThis)
-	toKeep.push_back(*it);
+      if(!anyKept) {
+	release(C);
+	continue;
+      }
+
+      if(anyLost) {
+	C = getWritableChunk(chunks.begin() + i);
+	for(uint32_t w = 0; w != ObjectSetChunk::Words; ++w)
+	  C->words[w] &= O->words[w];
+      }
 
     }
 
+    chunks[nKept++] = C;
+
   }
-  else {
 
-    MutableArrayRef<DenseSet<ShadowValue>* >::iterator othersBegin = mergeBegin;
-    ++othersBegin;
+  chunks.resize(nKept);
 
-    for(DenseSet<ShadowValue>::iterator it = (*mergeBegin)->begin(), 
-	  itend = (*mergeBegin)->end(); it != itend; ++it) {
+}
 
-      bool keepThis = Target->count(*it);
-      for(MutableArrayRef<DenseSet<ShadowValue>* >::iterator findit = othersBegin; findit != mergeEnd && keepThis; ++findit) {
+bool ObjectSet::isSubsetOf(const ObjectSet& Other) const {
 
-	if(!(*findit)->count(*it))
-	  keepThis = false;
+  ConstChunkIt otherit = Other.chunks.begin(), otherend = Other.chunks.end();
 
-      }
+  for(ConstChunkIt it = chunks.begin(), itend = chunks.end(); it != itend; ++it) {
 
-      if(keepThis)
-	toKeep.push_back(*it);
-      
+    while(otherit != otherend && (*otherit)->firstKey < (*it)->firstKey)
+      ++otherit;
+
+    if(otherit == otherend || (*otherit)->firstKey != (*it)->firstKey)
+      return false;
+
+    if(*otherit == *it)
+      continue;
+
+    for(uint32_t w = 0; w != ObjectSetChunk::Words; ++w) {
+      if((*it)->words[w] & ~(*otherit)->words[w])
+	return false;
     }
-    
+
   }
 
-  Target->clear();
-  Target->insert(toKeep.begin(), toKeep.end());
+  return true;
 
 }
 
-// Debug dump functions:
+void ObjectSet::getMembers(std::vector<ShadowValue>& Out) const {
 
-static void dumpSets(OrdinaryLocalStore* Map) {
+  for(ConstChunkIt it = chunks.begin(), itend = chunks.end(); it != itend; ++it) {
 
-  errs() << "Not-old:\n";
-  for(DenseSet<ShadowValue>::iterator it = Map->es.noAliasOldObjects.begin(), itend = Map->es.noAliasOldObjects.end(); it != itend; ++it) {
+    for(uint32_t w = 0; w != ObjectSetChunk::Words; ++w) {
 
-    errs() << itcache(*it) << "\n";
-    
-  }
-  errs() << "\n\n";
+      for(uint64_t Bits = (*it)->words[w]; Bits; Bits &= Bits - 1) {
 
-  errs() << "Thread-local:\n";
-  for(DenseSet<ShadowValue>::iterator it = Map->es.threadLocalObjects.begin(), itend = Map->es.threadLocalObjects.end(); it != itend; ++it) {
+	uint64_t Key = (*it)->firstKey + (w * 64) + __builtin_ctzll(Bits);
+	Out.push_back(ShadowValue::getPtrIdx(((int32_t)(Key >> 32)) - 1, (uint32_t)Key));
 
-    errs() << itcache(*it) << "\n";
+      }
+
+    }
 
   }
-  errs() << "\n\n";
 
+}
+
+// Debug dump functions:
+
+static void dumpSet(const char* Name, const ObjectSet& Set) {
+
+  errs() << Name << ":\n";
+  std::vector<ShadowValue> Members;
+  Set.getMembers(Members);
+  for(std::vector<ShadowValue>::iterator it = Members.begin(), itend = Members.end(); it != itend; ++it) {
 
-  errs() << "Unescaped:\n";
-  for(DenseSet<ShadowValue>::iterator it = Map->es.unescapedObjects.begin(), itend = Map->es.unescapedObjects.end(); it != itend; ++it) {
-	
     errs() << itcache(*it) << "\n";
-	
+
   }
   errs() << "\n\n";
 
 }
 
+static void dumpSets(OrdinaryLocalStore* Map) {
+
+  dumpSet("Not-old", Map->es.noAliasOldObjects);
+  dumpSet("Thread-local", Map->es.threadLocalObjects);
+  dumpSet("Unescaped", Map->es.unescapedObjects);
+
+}
+
 void OrdinaryStoreExtraState::dump(OrdinaryLocalStore* Map) {
   
   dumpSets(Map);
@@ -4117,32 +4792,11 @@ void OrdinaryStoreExtraState::doMerge(OrdinaryLocalStore* toMap,
   
   // All flag sets should be big-intersected.
   
-  {
+  for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = fromBegin; it != fromEnd; ++it) {
 
-    SmallVector<DenseSet<ShadowValue>*, 4> NAOSets;
-    for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = fromBegin; it != fromEnd; ++it)
-      NAOSets.push_back(&(*it)->es.noAliasOldObjects);
-    intersectSets(&toMap->es.noAliasOldObjects, NAOSets);
-
-  }
-
-  {
-
-    SmallVector<DenseSet<ShadowValue>*, 4> TLSets;
-    for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = fromBegin; it != fromEnd; ++it)
-      TLSets.push_back(&(*it)->es.threadLocalObjects);
-    intersectSets(&toMap->es.threadLocalObjects, TLSets);
-
-
-
-  }
-
-  {
-
-    SmallVector<DenseSet<ShadowValue>*, 4> EscSets;
-    for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = fromBegin; it != fromEnd; ++it)
-      EscSets.push_back(&(*it)->es.unescapedObjects);
-    intersectSets(&toMap->es.unescapedObjects, EscSets);
+    toMap->es.noAliasOldObjects.intersectWith((*it)->es.noAliasOldObjects);
+    toMap->es.threadLocalObjects.intersectWith((*it)->es.threadLocalObjects);
+    toMap->es.unescapedObjects.intersectWith((*it)->es.unescapedObjects);
 
   }
 
@@ -4200,14 +4854,12 @@ void PeelIteration::popAllocas(OrdinaryLocalStore*) { }
 
 void InlineAttempt::popAllocas(OrdinaryLocalStore* map) {
 
-  for(uint32_t i = 0, ilim = localAllocas.size(); i != ilim; ++i) {
-
-    ShadowValue SV = ShadowValue::getPtrIdx(stack_depth, i);
-    map->es.unescapedObjects.erase(SV);
-    map->es.noAliasOldObjects.erase(SV);
-    map->es.threadLocalObjects.erase(SV);
+  if(localAllocas.empty())
+    return;
 
-  }
+  map->es.unescapedObjects.eraseFrame(stack_depth);
+  map->es.noAliasOldObjects.eraseFrame(stack_depth);
+  map->es.threadLocalObjects.eraseFrame(stack_depth);
  
 }
 
@@ -4219,6 +4871,49 @@ void ShadowBB::popStackFrame() {
 
 }
 
+bool LocStore::isDeadObject(uint32_t idx) {
+
+  // Only objects allocated during specialisation: other heap entries are globals and the like.
+  if(!GlobalIHP->heap[idx].allocValue.isInst())
+    return false;
+
+  ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(store);
+  return IVS && IVS->SetType == ValSetTypeDeallocated;
+
+}
+
+// Drop certainly-freed heap objects from this block's store, at a call return, so that the stores
+// copied and merged from here on are proportional to the live heap. A missing object reads and merges
+// the same as a freed one unless allOthersClobbered is set, when absence means clobbered instead.
+void ShadowBB::compactHeap() {
+
+  if((!GlobalIHP->heapObjectsFreed) || localStore->allOthersClobbered || !localStore->heap.hasDeadObjects())
+    return;
+
+  localStore = localStore->getWritableFrameList();
+  GlobalIHP->stats.compactedHeapObjects += localStore->heap.removeDeadObjects();
+
+}
+
+// As compactHeap, for the one object V just freed, so that objects freed within a loop body don't
+// accumulate until the next call return. Only the path to V is CoW broken.
+void ShadowBB::dropFreedObject(ShadowValue V) {
+
+  if(localStore->allOthersClobbered || (!V.isPtrIdx()) || V.getFrameNo() != -1)
+    return;
+
+  int32_t idx = V.getHeapKey();
+
+  LocStore* Store = localStore->heap.getReadableStoreFor(V);
+  if((!Store) || !Store->isDeadObject((uint32_t)idx))
+    return;
+
+  localStore = localStore->getWritableFrameList();
+  if(localStore->heap.removeObject((uint32_t)idx))
+    ++GlobalIHP->stats.compactedHeapObjects;
+
+}
+
 void ShadowBB::pushStackFrame(InlineAttempt* IA) {
 
   localStore = localStore->getWritableFrameList();
@@ -0,0 +1,136 @@
+//===-- Log.cpp -----------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// The sink behind LLPE_LOG. errs() is unbuffered, so a verbose mode writing to it directly costs a
+// system call per <<; instead each record is collected in its own string, then appended under a lock
+// to one buffered stream, written to -llpe-log-file (appended to, since batch jobs may share it) or
+// else stderr. With -llpe-log-format=jsonl each record is one JSON object per line, giving its
+// sequence number, category and text, for tools to filter; otherwise records are written as they are.
+// The buffer is flushed when the pass finishes and before forking or exiting early.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <mutex>
+
+#include <unistd.h>
+
+using namespace llvm;
+
+uint32_t llvm::logCategoryMask = 0;
+
+static std::mutex logLock;
+static raw_fd_ostream* logStream = 0;
+static bool logJSON = false;
+static uint64_t logSeq = 0;
+
+static const char* logCategoryNames[LOG_CATEGORIES] = {
+  "sharing", "overdef", "dse", "tl"
+};
+
+const char* llvm::getLogCategoryName(LogCategory C) {
+
+  return logCategoryNames[C];
+
+}
+
+// Enable the categories in Mask, writing to Path or stderr if it's empty.
+void llvm::initLog(const std::string& Path, bool JSON, uint32_t Mask) {
+
+  std::lock_guard<std::mutex> Guard(logLock);
+
+  logCategoryMask = Mask;
+  logJSON = JSON;
+
+  if(logStream) {
+    logStream->flush();
+    delete logStream;
+    logStream = 0;
+  }
+
+  if(!Mask)
+    return;
+
+  if(Path.empty()) {
+    logStream = new raw_fd_ostream(STDERR_FILENO, /* shouldClose = */ false);
+  }
+  else {
+    std::error_code error;
+    logStream = new raw_fd_ostream(Path.c_str(), error, sys::fs::F_Append);
+    if(error) {
+      errs() << "Failed to open " << Path << ": " << error.message() << "\n";
+      exit(1);
+    }
+  }
+
+  logStream->SetBufferSize(1 << 16);
+
+}
+
+void llvm::flushLog() {
+
+  std::lock_guard<std::mutex> Guard(logLock);
+  if(logStream)
+    logStream->flush();
+
+}
+
+static void writeJSONString(raw_ostream& Out, StringRef S) {
+
+  Out << '"';
+  for(StringRef::iterator it = S.begin(), itend = S.end(); it != itend; ++it) {
+
+    unsigned char c = *it;
+    if(c == '"' || c == '\\')
+      Out << '\\' << c;
+    else if(c == '\n')
+      Out << "\\n";
+    else if(c == '\t')
+      Out << "\\t";
+    else if(c < 0x20)
+      Out << format("\\u%04x", c);
+    else
+      Out << c;
+
+  }
+  Out << '"';
+
+}
+
+LogRecord::~LogRecord() {
+
+  RSO.flush();
+
+  std::lock_guard<std::mutex> Guard(logLock);
+  if(!logStream)
+    return;
+
+  if(logJSON) {
+
+    StringRef Text(text);
+    while(Text.endswith("\n"))
+      Text = Text.drop_back();
+
+    (*logStream) << "{\"seq\": " << logSeq++ << ", \"category\": \"" << logCategoryNames[category] << "\", \"text\": ";
+    writeJSONString(*logStream, Text);
+    (*logStream) << "}\n";
+
+  }
+  else {
+
+    (*logStream) << text;
+    if(text.empty() || text[text.size() - 1] != '\n')
+      (*logStream) << '\n';
+
+  }
+
+}
@@ -32,9 +32,11 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Timer.h"
 
 using namespace llvm;
 
@@ -65,6 +67,9 @@ bool InlineAttempt::analyseWithArgs(ShadowInstruction* SI, bool inLoopAnalyser,
 
   }
 
+  if(!budgetStartTime)
+    startBudget();
+
   anyChange |= analyseNoArgs(inLoopAnalyser, inAnyLoop, parent_stack_depth);
 
   return anyChange;
@@ -220,6 +225,8 @@ void PeelIteration::getInitialStore(bool inLoopAnalyser) {
 // into any child contexts as they are encountered. Parameter meanings are as for InlineAttempt::analyseWithArgs.
 bool IntegrationAttempt::analyse(bool inLoopAnalyser, bool inAnyLoop, uint32_t new_stack_depth) {
 
+  ContextTimer T(this);
+
   stack_depth = new_stack_depth;
 
   bool anyChange = false;
@@ -263,6 +270,10 @@ bool PeelAttempt::analyse(uint32_t parent_stack_depth, bool& readsTentativeData,
 
   readsTentativeData = false;
 
+  // Each peel is analysed once, front to back, as its parent reaches the loop: iteration N+1 takes
+  // iteration N's latch store (see PeelIteration::getInitialStore), which is consumed in doing so, and the
+  // code after the loop is analysed against the final iteration's exit stores straight afterwards.
+  // So there's no retained state a changed -llpe-loop-max could resume from without a fresh run.
   for(PeelIteration* PI = Iterations[0]; PI; PI = PI->getOrCreateNextIteration()) {
 
     anyChange |= PI->analyse(false, true, parent_stack_depth);
@@ -270,6 +281,14 @@ bool PeelAttempt::analyse(uint32_t parent_stack_depth, bool& readsTentativeData,
     readsTentativeData |= PI->readsTentativeData;
     containsCheckedReads |= PI->containsCheckedReads;
 
+    // Give up peeling at -llpe-max-peel-iterations; unless this iteration turns out to be
+    // the last, the loop will be treated as nonterminating and its iterations freed.
+    if(pass->maxPeelIterations && Iterations.size() >= pass->maxPeelIterations)
+      break;
+    // Likewise if the context this loop belongs to has run out of budget.
+    if(parent->isOverContextBudget())
+      break;
+
   }
 
   Iterations.back()->checkFinalIteration();
@@ -385,6 +404,419 @@ void InlineAttempt::inheritCommitBlocksAndFunctions(std::vector<BasicBlock*>& Ne
 
 }
 
+// Cheap trip-count probe (see -llpe-loop-trip-probe): predict, before peeling, that the first iteration
+// of L won't be able to resolve an exit branch in its header or latch. In that case peeling stops
+// after one iteration without establishing termination, so we may as well go straight to the general case.
+
+// Is the first-iteration value of the given operand of SII certainly unknown? Values from outside the loop
+// are read as they stand; header PHIs take their preheader value, and adding or subtracting
+// a constant (e.g. an induction variable's increment) preserves unknown-ness.
+bool IntegrationAttempt::firstIterationValueUnknown(const ShadowLoopInvar* L, ShadowInstructionInvar* SII, uint32_t OpIdx, uint32_t depth) {
+
+  ShadowInstIdx& Op = SII->operandIdxs[OpIdx];
+  ShadowValue OpV;
+
+  if(Op.blockIdx == INVALID_BLOCK_IDX) {
+
+    // Constants and globals are known; arguments may not be.
+    Argument* A = dyn_cast<Argument>(SII->I->getOperand(OpIdx));
+    if(!A)
+      return false;
+    OpV = ShadowValue(&getFunctionRoot()->argShadows[A->getArgNo()]);
+
+  }
+  else if(Op.instIdx == INVALID_INSTRUCTION_IDX) {
+
+    return false;
+
+  }
+  else if(!L->contains(getBBInvar(Op.blockIdx)->naturalScope)) {
+
+    ShadowInstruction* OpI = getInst(Op.blockIdx, Op.instIdx);
+    if(!OpI)
+      return false;
+    OpV = ShadowValue(OpI);
+
+  }
+  else {
+
+    // Don't chase through long chains: this is meant to be cheap.
+    if(depth == 2)
+      return false;
+
+    ShadowInstructionInvar* OpII = getInstInvar(Op.blockIdx, Op.instIdx);
+
+    if(PHINode* PN = dyn_cast<PHINode>(OpII->I)) {
+
+      if(Op.blockIdx != L->headerIdx)
+	return false;
+
+      BasicBlock* PreheaderBB = getBBInvar(L->preheaderIdx)->BB;
+      for(uint32_t i = 0, ilim = PN->getNumIncomingValues(); i != ilim; ++i) {
+	if(PN->getIncomingBlock(i) == PreheaderBB)
+	  return firstIterationValueUnknown(L, OpII, i, depth + 1);
+      }
+      return false;
+
+    }
+    else if(BinaryOperator* BO = dyn_cast<BinaryOperator>(OpII->I)) {
+
+      if(BO->getOpcode() != Instruction::Add && BO->getOpcode() != Instruction::Sub)
+	return false;
+
+      if(isa<Constant>(BO->getOperand(1)))
+	return firstIterationValueUnknown(L, OpII, 0, depth + 1);
+      else if(isa<Constant>(BO->getOperand(0)))
+	return firstIterationValueUnknown(L, OpII, 1, depth + 1);
+      return false;
+
+    }
+
+    return false;
+
+  }
+
+  ImprovedValSetSingle IVS;
+  if(!getImprovedValSetSingle(OpV, IVS))
+    return false;
+  return IVS.isWhollyUnknown();
+
+}
+
+bool IntegrationAttempt::loopProbablyUnbounded(const ShadowLoopInvar* L) {
+
+  // User directives about this loop's iteration take precedence.
+  if(L->alwaysIterate || L->optimisticEdge.first != 0xffffffff ||
+     pass->maxLoopIters.count(std::make_pair(&F, getBBInvar(L->headerIdx)->BB)))
+    return false;
+
+  for(std::vector<uint32_t>::const_iterator it = L->exitingBlocks.begin(), itend = L->exitingBlocks.end(); it != itend; ++it) {
+
+    if(*it != L->headerIdx && *it != L->latchIdx)
+      continue;
+
+    ShadowBBInvar* ExitingBBI = getBBInvar(*it);
+    BranchInst* BI = dyn_cast<BranchInst>(ExitingBBI->BB->getTerminator());
+    if((!BI) || !BI->isConditional())
+      continue;
+
+    ShadowInstructionInvar* TermII = &ExitingBBI->insts[ExitingBBI->insts.size() - 1];
+    ShadowInstIdx& CondIdx = TermII->operandIdxs[0];
+    if(CondIdx.blockIdx == INVALID_BLOCK_IDX || CondIdx.instIdx == INVALID_INSTRUCTION_IDX ||
+       !L->contains(getBBInvar(CondIdx.blockIdx)->naturalScope))
+      continue;
+
+    ShadowInstructionInvar* CondII = getInstInvar(CondIdx.blockIdx, CondIdx.instIdx);
+    if(!isa<ICmpInst>(CondII->I))
+      continue;
+
+    // One unknown side suffices: e.g. i < n with n unknown, or i != 0 with i starting at an unknown value.
+    if(firstIterationValueUnknown(L, CondII, 0, 0) || firstIterationValueUnknown(L, CondII, 1, 0)) {
+
+      ++pass->stats.tripProbeSkips;
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+// Find the first k >= 0 for which icmp Pred (Base + k * Step), Bound holds, where all of them have the
+// same width and Step is taken as signed. Fails if the sequence might wrap before getting there
+// (except for steps of +/-1 towards an equality, which get there whatever happens).
+static bool firstIterationSatisfying(CmpInst::Predicate Pred, const APInt& Base, const APInt& Step, const APInt& Bound, uint64_t& K) {
+
+  if(!Step)
+    return false;
+
+  if(ICmpInst::compare(Base, Bound, Pred)) {
+    K = 0;
+    return true;
+  }
+
+  unsigned W = Base.getBitWidth();
+
+  if(Pred == CmpInst::ICMP_NE) {
+    // Base == Bound, and the next value differs.
+    K = 1;
+    return true;
+  }
+
+  // Work in a width where neither the distances nor the bounds of either signedness can overflow.
+  unsigned ExtW = (W * 2) + 2;
+  APInt S = Step.sext(ExtW);
+
+  if(Pred == CmpInst::ICMP_EQ) {
+
+    if(Step.isOneValue()) {
+      K = (Bound - Base).getZExtValue();
+      return true;
+    }
+    else if(Step.isAllOnesValue()) {
+      K = (Base - Bound).getZExtValue();
+      return true;
+    }
+
+    APInt D = Bound.sext(ExtW) - Base.sext(ExtW);
+    if(!!D.srem(S))
+      return false;
+    APInt Q = D.sdiv(S);
+    if(Q.isNegative())
+      return false;
+    K = Q.getZExtValue();
+    return true;
+
+  }
+
+  bool isSigned = ICmpInst::isSigned(Pred);
+  APInt B = isSigned ? Base.sext(ExtW) : Base.zext(ExtW);
+  APInt T = isSigned ? Bound.sext(ExtW) : Bound.zext(ExtW);
+  APInt One(ExtW, 1);
+  APInt Dist(ExtW, 0);
+  APInt Mag(ExtW, 0);
+
+  switch(Pred) {
+
+  case CmpInst::ICMP_UGT: case CmpInst::ICMP_SGT:
+    T += One;
+    // Fall through
+  case CmpInst::ICMP_UGE: case CmpInst::ICMP_SGE:
+    // Only an increasing sequence gets there without wrapping.
+    if(!S.isStrictlyPositive())
+      return false;
+    Dist = T - B;
+    Mag = S;
+    break;
+
+  case CmpInst::ICMP_ULT: case CmpInst::ICMP_SLT:
+    T -= One;
+    // Fall through
+  case CmpInst::ICMP_ULE: case CmpInst::ICMP_SLE:
+    if(!S.isNegative())
+      return false;
+    Dist = B - T;
+    Mag = -S;
+    break;
+
+  default:
+    return false;
+
+  }
+
+  // Base doesn't satisfy Pred, so Dist is positive.
+  APInt Q = (Dist + Mag - One).udiv(Mag);
+  APInt End = B + (Q * S);
+
+  // Check the final value, and so every one before it, is in range.
+  if(isSigned) {
+    if(End.slt(APInt::getSignedMinValue(W).sext(ExtW)) || End.sgt(APInt::getSignedMaxValue(W).sext(ExtW)))
+      return false;
+  }
+  else {
+    if(End.isNegative() || End.ugt(APInt::getMaxValue(W).zext(ExtW)))
+      return false;
+  }
+
+  K = Q.getZExtValue();
+  return true;
+
+}
+
+// Is header phi PN an induction variable of L of the form phi [Start, preheader], [PN +/- Step, latch]
+// with constant Start and Step? If so give them and the increment instruction.
+bool IntegrationAttempt::getSimpleInductionVar(const ShadowLoopInvar* L, ShadowInstruction* PN, APInt& Start, APInt& Step, ShadowInstructionInvar*& IncII) {
+
+  ShadowInstructionInvar* PNII = PN->invar;
+  IntegerType* Ty = dyn_cast<IntegerType>(PNII->I->getType());
+  if((!Ty) || Ty->getBitWidth() > 64 || PNII->operandIdxs.size() != 2)
+    return false;
+
+  uint32_t startOp, latchOp;
+  if(PNII->operandBBs[0] == L->preheaderIdx && PNII->operandBBs[1] == L->latchIdx) {
+    startOp = 0;
+    latchOp = 1;
+  }
+  else if(PNII->operandBBs[1] == L->preheaderIdx && PNII->operandBBs[0] == L->latchIdx) {
+    startOp = 1;
+    latchOp = 0;
+  }
+  else
+    return false;
+
+  uint64_t StartVal;
+  if(!tryGetConstantIntReplacement(PN->getOperand(startOp), StartVal))
+    return false;
+
+  ShadowInstIdx& IncIdx = PNII->operandIdxs[latchOp];
+  if(IncIdx.blockIdx == INVALID_BLOCK_IDX || IncIdx.instIdx == INVALID_INSTRUCTION_IDX ||
+     getBBInvar(IncIdx.blockIdx)->naturalScope != L)
+    return false;
+
+  IncII = getInstInvar(IncIdx.blockIdx, IncIdx.instIdx);
+  BinaryOperator* BO = dyn_cast<BinaryOperator>(IncII->I);
+  if((!BO) || (BO->getOpcode() != Instruction::Add && BO->getOpcode() != Instruction::Sub))
+    return false;
+
+  uint32_t selfOp;
+  for(selfOp = 0; selfOp != 2; ++selfOp) {
+    ShadowInstIdx& Op = IncII->operandIdxs[selfOp];
+    if(Op.blockIdx == PNII->parent->idx && Op.instIdx == PNII->idx)
+      break;
+  }
+
+  if(selfOp == 2 || (selfOp == 1 && BO->getOpcode() == Instruction::Sub))
+    return false;
+
+  ConstantInt* StepCI = dyn_cast<ConstantInt>(BO->getOperand(1 - selfOp));
+  if(!StepCI)
+    return false;
+
+  Start = APInt(Ty->getBitWidth(), StartVal);
+  Step = StepCI->getValue();
+  if(BO->getOpcode() == Instruction::Sub)
+    Step = -Step;
+
+  return true;
+
+}
+
+struct SimpleInductionVar {
+
+  ShadowInstruction* PN;
+  ShadowInstructionInvar* IncII;
+  APInt Start;
+  APInt Step;
+
+};
+
+// After the general-case analysis of unpeeled loop L: its induction variables are overdef, being
+// merged across all iterations, but if L is a simple counted loop we can still say what they hold on
+// leaving it. L qualifies if its only exit is a test in the header or latch of a simple induction
+// variable (or its increment) against a constant bound; then the trip count follows from the
+// start, step and bound, and so does every simple induction variable's value at exit. Exit phis
+// read those from closedFormExitValues (see getOperandRising) instead of the general-case value.
+void IntegrationAttempt::findClosedFormExitValues(const ShadowLoopInvar* L) {
+
+  // Forget what an earlier analysis of L found (e.g. in an earlier round of an enclosing loop).
+  if(!closedFormExitValues.empty()) {
+
+    SmallVector<ShadowInstruction*, 4> Stale;
+    for(DenseMap<ShadowInstruction*, ShadowValue>::iterator it = closedFormExitValues.begin(),
+	  itend = closedFormExitValues.end(); it != itend; ++it) {
+      if(it->first->parent->invar->naturalScope == L)
+	Stale.push_back(it->first);
+    }
+
+    for(SmallVector<ShadowInstruction*, 4>::iterator it = Stale.begin(), itend = Stale.end(); it != itend; ++it)
+      closedFormExitValues.erase(*it);
+
+  }
+
+  if(L->exitingBlocks.size() != 1)
+    return;
+
+  ShadowBBInvar* ExitingBBI = getBBInvar(L->exitingBlocks[0]);
+  if(ExitingBBI->naturalScope != L || (ExitingBBI->idx != L->headerIdx && ExitingBBI->idx != L->latchIdx))
+    return;
+
+  ShadowBB* ExitingBB = getBB(*ExitingBBI);
+  if(!ExitingBB)
+    return;
+
+  BranchInst* BI = dyn_cast<BranchInst>(ExitingBBI->BB->getTerminator());
+  if((!BI) || !BI->isConditional())
+    return;
+
+  bool exitOnTrue = !L->contains(getBBInvar(ExitingBBI->succIdxs[0])->naturalScope);
+  ShadowBBInvar* ExitedBBI = getBBInvar(ExitingBBI->succIdxs[exitOnTrue ? 0 : 1]);
+  if(edgeIsDead(ExitingBBI, ExitedBBI))
+    return;
+
+  ShadowInstructionInvar* TermII = &ExitingBBI->insts.back();
+  ShadowInstIdx& CondIdx = TermII->operandIdxs[0];
+  if(CondIdx.blockIdx == INVALID_BLOCK_IDX || CondIdx.instIdx == INVALID_INSTRUCTION_IDX ||
+     getBBInvar(CondIdx.blockIdx)->naturalScope != L)
+    return;
+
+  ShadowInstruction* CondSI = getInst(CondIdx.blockIdx, CondIdx.instIdx);
+  ICmpInst* Cmp = CondSI ? dyn_cast<ICmpInst>(CondSI->invar->I) : 0;
+  if(!Cmp)
+    return;
+
+  SmallVector<SimpleInductionVar, 4> IVs;
+  ShadowBBInvar* HeaderBBI = getBBInvar(L->headerIdx);
+  ShadowBB* HeaderBB = getBB(*HeaderBBI);
+  if(!HeaderBB)
+    return;
+
+  for(uint32_t i = 0, ilim = HeaderBBI->insts.size(); i != ilim && isa<PHINode>(HeaderBBI->insts[i].I); ++i) {
+
+    SimpleInductionVar IV;
+    IV.PN = &HeaderBB->insts[i];
+    if(getSimpleInductionVar(L, IV.PN, IV.Start, IV.Step, IV.IncII))
+      IVs.push_back(IV);
+
+  }
+
+  // Which side of the comparison is an induction variable, and is it before or after the increment?
+  CmpInst::Predicate Pred = Cmp->getPredicate();
+  APInt Base, Step;
+  uint64_t BoundVal;
+  bool found = false;
+
+  for(uint32_t side = 0; side != 2 && !found; ++side) {
+
+    ShadowInstIdx& Op = CondSI->invar->operandIdxs[side];
+    for(uint32_t i = 0, ilim = IVs.size(); i != ilim && !found; ++i) {
+
+      bool isPN = Op.blockIdx == L->headerIdx && Op.instIdx == IVs[i].PN->invar->idx;
+      bool isInc = Op.blockIdx == IVs[i].IncII->parent->idx && Op.instIdx == IVs[i].IncII->idx;
+      if((!(isPN || isInc)) || !tryGetConstantIntReplacement(CondSI->getOperand(1 - side), BoundVal))
+	continue;
+
+      found = true;
+      Step = IVs[i].Step;
+      Base = isInc ? IVs[i].Start + Step : IVs[i].Start;
+      if(side == 1)
+	Pred = CmpInst::getSwappedPredicate(Pred);
+
+    }
+
+  }
+
+  if(!found)
+    return;
+
+  if(!exitOnTrue)
+    Pred = CmpInst::getInversePredicate(Pred);
+
+  uint64_t K;
+  if(!firstIterationSatisfying(Pred, Base, Step, APInt(Base.getBitWidth(), BoundVal), K))
+    return;
+
+  LFV3(errs() << "Loop " << HeaderBBI->BB->getName() << " exits after " << K << " iterations\n");
+  ++pass->stats.closedFormLoopExits;
+
+  for(SmallVector<SimpleInductionVar, 4>::iterator it = IVs.begin(), itend = IVs.end(); it != itend; ++it) {
+
+    uint32_t W = it->Start.getBitWidth();
+    Type* Ty = it->PN->invar->I->getType();
+    APInt ExitVal = it->Start + (APInt(W, K) * it->Step);
+    closedFormExitValues[it->PN] = ShadowValue::getInt(Ty, ExitVal.getZExtValue());
+
+    // The increment's last value only exists if it ran in the exiting iteration.
+    if(it->IncII->parent == ExitingBBI || ExitingBBI->idx == L->latchIdx) {
+      if(ShadowInstruction* IncSI = getInst(it->IncII))
+	closedFormExitValues[IncSI] = ShadowValue::getInt(Ty, (ExitVal + it->Step).getZExtValue());
+    }
+
+  }
+
+}
+
 // Analyse / interpret each instruction in block BBs[blockIdx]. inLoopAnalyser and inAnyLoop have the same meanings as for
 // InlineAttempt::analyseWithArgs above. skipStoreMerge means we shouldn't try to pull and merge
 // block-local stores from our predecessor blocks, usually because there is a special case here
@@ -413,15 +845,27 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
     // Now explore the loop, if possible.
     // At the moment can't ever happen inside the loop analyser.
     PeelAttempt* LPA = 0;
-    if((!inLoopAnalyser) && (LPA = getOrCreatePeelAttempt(BBL))) {
+    if((!inLoopAnalyser) && 
+       (getPeelAttempt(BBL) || !(pass->loopTripProbe && loopProbablyUnbounded(BBL))) &&
+       (LPA = getOrCreatePeelAttempt(BBL))) {
 
       // Give the preheader an extra reference in case we need that store
       // to calculate a general version of the loop body if it doesn't terminate.
       ShadowBB* PHBB = getBB(LPA->L->preheaderIdx);
       PHBB->refStores();
 
+      // Peeling and the general case below both start from PHBB's store, but the analysis is single-threaded
+      // (it shares the heap, store pools and refcounts), so they can't run side by side. Instead, note the time
+      // lost to peel attempts that didn't terminate, which is what running them concurrently could save.
+      double peelStartTime = TimeRecord::getCurrentTime(true).getWallTime();
+
       bool loopReadsTentativeData, loopContainsCheckedReads;
       LPA->analyse(stack_depth, loopReadsTentativeData, loopContainsCheckedReads);
+
+      if(!LPA->isTerminated()) {
+	++pass->stats.unterminatedPeels;
+	pass->stats.unterminatedPeelSeconds += (TimeRecord::getCurrentTime(false).getWallTime() - peelStartTime);
+      }
       readsTentativeData |= loopReadsTentativeData;
       containsCheckedReads |= loopContainsCheckedReads;  
 
@@ -476,6 +920,11 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
 
 	LPA->releaseCommittedChildren();
 
+	// The iterations of a loop that doesn't terminate won't be used again; free them
+	// now rather than when this context is committed.
+	if((!LPA->isTerminated()) && discardPeelAttempt(LPA))
+	  LPA = 0;
+
       }
 
     }
@@ -484,6 +933,7 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
     if((!LPA) || !LPA->isTerminated()) {
 
       anyChange |= analyseLoop(BBL, inLoopAnalyser);
+      findClosedFormExitValues(BBL);
 
       if(!inLoopAnalyser) {
 
@@ -625,6 +1075,8 @@ bool IntegrationAttempt::analyseExpandableCall(ShadowInstruction* SI, bool& chan
 	pass->addSharableFunction(IA);
       else if(IA->registeredSharable && IA->isUnsharable())
 	pass->removeSharableFunction(IA);
+      else if(IA->registeredSharable)
+	pass->updateSharableFunction(IA);
      
       IA->active = false;
 
@@ -642,10 +1094,19 @@ bool IntegrationAttempt::analyseExpandableCall(ShadowInstruction* SI, bool& chan
 
       doCallStoreMerge(SI);
 
+      // The TL and DSE passlets run here, as each call returns, rather than over the finished tree:
+      // their stores are threaded through sibling calls in program order just like the main store,
+      // and the child is committed (and its analysis freed) straight afterwards.
       if(!inLoopAnalyser) {
-	    
-	doTLCallMerge(SI->parent, IA);
-	doDSECallMerge(SI->parent, IA);
+
+	{
+	  PhaseTimer T(PHASE_TENTATIVE_LOADS);
+	  doTLCallMerge(SI->parent, IA);
+	}
+	{
+	  PhaseTimer T(PHASE_DSE);
+	  doDSECallMerge(SI->parent, IA);
+	}
 
 	IA->finaliseAndCommit(inLoopAnalyser);
 
@@ -671,12 +1132,16 @@ bool IntegrationAttempt::analyseInstruction(ShadowInstruction* SI, bool inLoopAn
   ShadowInstructionInvar* SII = SI->invar;
   Instruction* I = SII->I;
 
+  LLPE_EVAL_PROFILE_SCOPE(EVAL_PROFILE_ANALYSE, I);
+
   if(SI->isTerminator() && !inst_is<InvokeInst>(SI)) {
     // Call tryEvalTerminator regardless of scope.
     return tryEvaluateTerminator(SI, loadedVarargsHere);
   }
 
   bool changed = false;
+  std::string memoKey;
+  bool summariseCall = false;
 
   switch(I->getOpcode()) {
 
@@ -685,6 +1150,7 @@ bool IntegrationAttempt::analyseInstruction(ShadowInstruction* SI, bool inLoopAn
     return false;
   case Instruction::Alloca:
     executeAllocaInst(SI);
+    SI->changeStamp = pass->loopRoundClock;
     return false;
   case Instruction::Store:
     executeStoreInst(SI);
@@ -692,17 +1158,38 @@ bool IntegrationAttempt::analyseInstruction(ShadowInstruction* SI, bool inLoopAn
   case Instruction::Call: 
   case Instruction::Invoke:
     {
+
+      // Calls may define their results by various means besides tryEvaluate; assume they changed.
+      SI->changeStamp = pass->loopRoundClock;
 	
       // Certain intrinsics manifest as calls but fold like ordinary instructions.
-      if(Function* F = getCalledFunction(SI)) {
+      Function* F = getCalledFunction(SI);
+      uint8_t callClass = 0;
+      if(F) {
 	if(canConstantFoldCallTo(cast<CallInst>(I), F))
 	  break;
+	callClass = pass->getCallClass(F);
       }
 
-      if(tryPromoteOpenCall(SI))
+      if(callClass & CALLCLASS_VFS) {
+	if(tryPromoteOpenCall(SI))
+	  return false;
+	if(tryResolveVFSCall(SI))
+	  return false;
+      }
+      if((callClass & CALLCLASS_NATIVESTRING) && !inLoopAnalyser && tryNativeStringCall(SI))
 	return false;
-      if(tryResolveVFSCall(SI))
+
+      // Outside loop fixpoints, a call may have the same result as an earlier one:
+      if(!inLoopAnalyser && getCallMemoKey(SI, memoKey) && tryUseCallMemo(SI, memoKey))
 	return false;
+
+      // ...and a library entry point may have a summary from an earlier job, or be summarised for later ones.
+      if((callClass & CALLCLASS_SUMMARY) && !inLoopAnalyser) {
+	if(tryUseLibrarySummary(SI))
+	  return false;
+	summariseCall = canSummariseCall(SI);
+      }
       
       bool isExpanded = analyseExpandableCall(SI, changed, inLoopAnalyser, inAnyLoop);
       if(isExpanded) {
@@ -737,25 +1224,101 @@ bool IntegrationAttempt::analyseInstruction(ShadowInstruction* SI, bool inLoopAn
 
   }
 
-  if(!bail)
+  if(!bail) {
     changed |= tryEvaluate(ShadowValue(SI), inLoopAnalyser, loadedVarargsHere);
+    if(!memoKey.empty())
+      noteCallMemo(SI, memoKey);
+    if(summariseCall)
+      noteLibrarySummary(SI);
+  }
   return changed;
 
 }
 
+// Does load LI read a global that loop L never writes? Then every round sees the global as it was
+// on entry to the loop, so the load's result depends on its pointer operand alone.
+static bool loadsLoopInvariantGlobal(LoadInst* LI, const ShadowLoopInvar* L) {
+
+  if(!LI->isUnordered())
+    return false;
+
+  GlobalVariable* GV = dyn_cast<GlobalVariable>(GetUnderlyingObject(LI->getPointerOperand(), *GlobalTD));
+  return GV && !L->mayWriteGlobal(GV);
+
+}
+
+// Can SI keep the result it was given last loop fixpoint round? It must compute its result from its operands alone,
+// with no side-effects, and none of its operands may have changed since the round began at roundStart.
+// Phis are never kept, as their result also depends on which incoming edges are live.
+static bool canKeepLoopResult(ShadowInstruction* SI, const LoopRoundTracker* LRT) {
+
+  Instruction* I = SI->invar->I;
+  uint32_t roundStart = LRT->roundStart;
+  // Pointer comparisons may also note a runtime check.
+  if(!(isa<BinaryOperator>(I) || isa<CastInst>(I) || isa<GetElementPtrInst>(I) || isa<SelectInst>(I) ||
+       (isa<CmpInst>(I) && !I->getOperand(0)->getType()->isPointerTy()))) {
+
+    LoadInst* LI = dyn_cast<LoadInst>(I);
+    if(!(LI && loadsLoopInvariantGlobal(LI, LRT->L)))
+      return false;
+
+  }
+
+  if(!SI->i.PB)
+    return false;
+
+  for(uint32_t i = 0, ilim = SI->getNumOperands(); i != ilim; ++i) {
+
+    if(ShadowInstruction* OpSI = SI->getOperand(i).getInst()) {
+      if(OpSI->changeStamp >= roundStart)
+	return false;
+    }
+
+  }
+
+  return true;
+
+}
+
 // Analyse all instructions in block BB. Returns true if there was any change.
 bool IntegrationAttempt::analyseBlockInstructions(ShadowBB* BB, bool inLoopAnalyser, bool inAnyLoop) {
 
   bool anyChange = false;
   bool loadedVarargsHere = false;
 
+  // Within a loop fixpoint, a block analysed last round may keep some of its results.
+  LoopRoundTracker* LRT = pass->loopRoundTracker;
+  uint32_t* blockRound = 0;
+  bool analysedLastRound = false;
+  if(inLoopAnalyser && LRT && LRT->ctx == this && BB->invar->naturalScope == LRT->L) {
+    blockRound = &(LRT->blockRounds[BB->invar->idx - LRT->L->headerIdx]);
+    analysedLastRound = (*blockRound) && (*blockRound) + 1 == LRT->round;
+  }
+
+  // Dead store analysis doesn't feed back into evaluation, so outside the loop analyser it runs
+  // as a separate stage over each run of instructions evaluated so far, [dseFrom, i).
+  // It must catch up before anything that hands on or pops the block's DSE store: calls and terminators.
+  uint32_t dseFrom = 0;
+
   for(uint32_t i = 0, ilim = BB->insts.size(); i != ilim; ++i) {
 
     ShadowInstruction* SI = &(BB->insts[i]);
+
+    if(analysedLastRound && canKeepLoopResult(SI, LRT)) {
+      ++LRT->skippedEvals;
+      continue;
+    }
+
+    if((!inLoopAnalyser) && (inst_is<CallInst>(SI) || SI->isTerminator()))
+      DSEAnalyseInstructions(BB, dseFrom, i);
+
     bool bail = false;
     anyChange |= analyseInstruction(SI, inLoopAnalyser, inAnyLoop, loadedVarargsHere, bail);
-    if(bail)
+    if(bail) {
+      if(!inLoopAnalyser)
+	DSEAnalyseInstructions(BB, dseFrom, i);
       return anyChange;
+    }
 
     if(!inLoopAnalyser) {
 
@@ -764,18 +1327,20 @@ bool IntegrationAttempt::analyseBlockInstructions(ShadowBB* BB, bool inLoopAnaly
       // Check if this uses an FD or allocation:
       noteIndirectUse(ShadowValue(SI), SI->i.PB);
       
-      // Check if this load or memcpy should be checked at runtime:
+      // Check if this load or memcpy should be checked at runtime. This stays in step with evaluation
+      // as it may squash SI's result, which later instructions in this block read.
       TLAnalyseInstruction(*SI, /* commit disabled = */ false, /* second pass = */ false, /* in loop analyser = */ false);
 
-      // Update the DSE store:
-      DSEAnalyseInstruction(SI, /* commit disabled = */false, 
-			    /*disable writes=*/false, 
-			    /*enter calls =*/false, bail);
-
     }
 
   }
 
+  if(!inLoopAnalyser)
+    DSEAnalyseInstructions(BB, dseFrom, BB->insts.size());
+
+  if(blockRound)
+    *blockRound = LRT->round;
+
   return anyChange;
 
 }
@@ -839,6 +1404,7 @@ void IntegrationAttempt::releaseLatchStores(const ShadowLoopInvar* L) {
   // Release here:
 
   if(L) {
+    releaseNestedLoopResult(L);
     // Release the latch store that the header will not use again:
     if(pass->latchStoresRetained.erase(std::make_pair(this, L))) {
       ShadowBB* LBB = getBB(L->latchIdx);
@@ -849,12 +1415,118 @@ void IntegrationAttempt::releaseLatchStores(const ShadowLoopInvar* L) {
 
 }
 
+void NestedLoopResult::release() {
+
+  preheaderStore->dropReference();
+  preheaderFDStore->dropReference();
+
+  for(std::vector<NestedLoopExit>::iterator it = exits.begin(), itend = exits.end(); it != itend; ++it) {
+    it->localStore->dropReference();
+    it->fdStore->dropReference();
+  }
+
+}
+
+void IntegrationAttempt::releaseNestedLoopResult(const ShadowLoopInvar* L) {
+
+  DenseMap<std::pair<IntegrationAttempt*, const ShadowLoopInvar*>, NestedLoopResult*>::iterator findit =
+    pass->nestedLoopResults.find(std::make_pair(this, L));
+  if(findit == pass->nestedLoopResults.end())
+    return;
+
+  findit->second->release();
+  delete findit->second;
+  pass->nestedLoopResults.erase(findit);
+
+}
+
+// Has any value used in L, whether defined inside or outside it, changed since clock?
+bool IntegrationAttempt::loopInputsChangedSince(const ShadowLoopInvar* L, uint32_t clock) {
+
+  for(uint32_t i = L->headerIdx; i < (BBsOffset + nBBs) && L->contains(getBBInvar(i)->naturalScope); ++i) {
+
+    ShadowBB* BB = getBB(i);
+    if(!BB)
+      continue;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction* SI = &(BB->insts[j]);
+      for(uint32_t k = 0, klim = SI->getNumOperands(); k != klim; ++k) {
+
+	ShadowValue Op = SI->getOperand(k);
+	if(ShadowInstruction* OpSI = Op.getInst()) {
+	  if(OpSI->changeStamp >= clock)
+	    return true;
+	}
+	else if(ShadowArg* OpSA = Op.getArg()) {
+	  if(OpSA->changeStamp >= clock)
+	    return true;
+	}
+
+      }
+
+    }
+
+  }
+
+  return false;
+
+}
+
+// Loop L is nested in another loop's fixpoint analysis. If the enclosing loop's last round reached the same fixpoint
+// here and nothing L reads has changed since, re-issue the stores that fixpoint sent along L's exit edges, and
+// adjust store references and pendingEdges exactly as analysing it again would. Returns false, and discards
+// any stale result, if L must be analysed.
+bool IntegrationAttempt::tryReuseNestedLoop(const ShadowLoopInvar* L) {
+
+  DenseMap<std::pair<IntegrationAttempt*, const ShadowLoopInvar*>, NestedLoopResult*>::iterator findit =
+    pass->nestedLoopResults.find(std::make_pair(this, L));
+  if(findit == pass->nestedLoopResults.end())
+    return false;
+
+  NestedLoopResult* R = findit->second;
+  ShadowBB* PHBB = getBB(L->preheaderIdx);
+
+  bool reuse = PHBB->localStore == R->preheaderStore && PHBB->fdStore == R->preheaderFDStore;
+  for(std::vector<NestedLoopExit>::iterator it = R->exits.begin(), itend = R->exits.end(); it != itend && reuse; ++it)
+    reuse = it->BB->localStore == it->localStore && it->BB->fdStore == it->fdStore;
+
+  if(reuse)
+    reuse = !loopInputsChangedSince(L, R->clock);
+
+  if(!reuse) {
+    releaseNestedLoopResult(L);
+    return false;
+  }
+
+  LFV3(errs() << "Loop " << L->getHeader()->getName() << " unchanged since last analysis; reusing its exit stores\n");
+
+  // The header takes the preheader's edge and its store reference...
+  release_assert(pendingEdges && "Decrementing pendingEdges below zero");
+  --pendingEdges;
+  PHBB->derefStores();
+
+  // ...and each exit edge gives a reference to its successor.
+  for(std::vector<NestedLoopExit>::iterator it = R->exits.begin(), itend = R->exits.end(); it != itend; ++it) {
+    it->BB->refStores();
+    ++pendingEdges;
+  }
+
+  ++pass->stats.loopFixpoints[getBBInvar(L->headerIdx)->BB].reused;
+  return true;
+
+}
+
 // Analyse a loop's general case (i.e. trying to find a fixed-point solution regarding
 // the body, rather than analysing each individual iteration; for that see PeelAttempt::analyse)
 // nestedLoop indicates we're being analysed in the context of a loop further out,
 // either in our call or a parent call.
 bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop) {
 
+  if(nestedLoop && tryReuseNestedLoop(L))
+    return false;
+
   bool anyChange = true;
   bool firstIter = true;
   bool everChanged = false;
@@ -864,11 +1536,48 @@ bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop)
   ShadowBB* HBB = getBB(L->headerIdx);
   ShadowBB* LBB = getBB(L->latchIdx);
 
+  double startTime = TimeRecord::getCurrentTime(true).getWallTime();
+
+  // If -llpe-loop-widen-iters is given and the loop is still changing after that
+  // many rounds, widen: any set that would grow beyond one value goes overdef,
+  // which bounds the number of further rounds needed.
+  uint32_t savedPBMax = GlobalPBMax;
+  bool widened = false;
+  bool savedIntRanges = GlobalIntRanges;
+  GlobalIntRanges = false;
+
   LFV3(errs() << "Loop " << L->getHeader()->getName() << " refcount at entry: " << PHBB->localStore->refCount << "\n");
 
+  // If nested, hold the preheader's stores for the NestedLoopResult made below.
+  if(nestedLoop) {
+    ++PHBB->localStore->refCount;
+    ++PHBB->fdStore->refCount;
+  }
+  OrdinaryLocalStore* entryStore = PHBB->localStore;
+  FDStore* entryFDStore = PHBB->fdStore;
+
+  uint32_t nLoopBlocks = 0;
+  while(L->headerIdx + nLoopBlocks < (BBsOffset + nBBs) && L->contains(getBBInvar(L->headerIdx + nLoopBlocks)->naturalScope))
+    ++nLoopBlocks;
+
+  LoopRoundTracker Tracker(this, L, nLoopBlocks, pass->loopRoundTracker);
+  if(!pass->loopEvalAll)
+    pass->loopRoundTracker = &Tracker;
+
   // Stop iterating if we show that the latch edge died!
   while(anyChange && (firstIter || !edgeIsDead(getBBInvar(L->latchIdx), HBB->invar))) {
     
+    if(pass->loopWidenIters && iters == pass->loopWidenIters && !widened) {
+
+      LFV3(errs() << "Loop " << L->getHeader()->getName() << " widened after " << iters << " iterations\n");
+      widened = true;
+      GlobalPBMax = 1;
+
+      // Results kept from before widening may hold too many values.
+      std::fill(Tracker.blockRounds.begin(), Tracker.blockRounds.end(), 0);
+
+    }
+
     ++iters;
 
     // Give the preheader store an extra reference to ensure it is never modified.
@@ -941,6 +1650,9 @@ bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop)
 
     anyChange = false;
 
+    ++Tracker.round;
+    Tracker.roundStart = ++pass->loopRoundClock;
+
     for(uint32_t i = L->headerIdx; i < (BBsOffset + nBBs); ++i) {
 
       if(!L->contains(getBBInvar(i)->naturalScope))
@@ -969,6 +1681,20 @@ bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop)
 
   }
 
+  GlobalPBMax = savedPBMax;
+  GlobalIntRanges = savedIntRanges;
+  pass->loopRoundTracker = Tracker.parent;
+
+  LoopFixpointStats& loopStats = pass->stats.loopFixpoints[HBB->invar->BB];
+  ++loopStats.analyses;
+  loopStats.iterations += iters;
+  fixpointIterationsHere += iters;
+  loopStats.maxIterations = std::max(loopStats.maxIterations, iters);
+  if(widened)
+    ++loopStats.widened;
+  loopStats.skippedEvals += Tracker.skippedEvals;
+  loopStats.seconds += (TimeRecord::getCurrentTime(false).getWallTime() - startTime);
+
   if(edgeIsDead(getBBInvar(L->latchIdx), HBB->invar))
     release_assert(iters == 1 && "Loop analysis found the latch dead but not first time around?");
 
@@ -996,6 +1722,43 @@ bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop)
   if(thisLatchAlive)
     --pendingEdges;
 
+  if(nestedLoop) {
+
+    // Note the fixpoint found, in case the enclosing loop's next round gets here with nothing changed.
+    NestedLoopResult* R = new NestedLoopResult();
+    R->preheaderStore = entryStore;
+    R->preheaderFDStore = entryFDStore;
+    bool usable = true;
+
+    for(std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it = L->exitEdges.begin(),
+	  itend = L->exitEdges.end(); it != itend; ++it) {
+
+      ShadowBB* BB = getBB(it->first);
+      if((!BB) || edgeIsDead(BB->invar, getBBInvar(it->second)) || edgeBranchesToUnspecialisedCode(BB->invar, getBBInvar(it->second)))
+	continue;
+
+      if((!BB->localStore) || BB->tlStore || BB->dseStore) {
+	usable = false;
+	break;
+      }
+
+      ++BB->localStore->refCount;
+      ++BB->fdStore->refCount;
+      R->exits.push_back(NestedLoopExit(BB, BB->localStore, BB->fdStore));
+
+    }
+
+    R->clock = ++pass->loopRoundClock;
+
+    if(usable)
+      pass->nestedLoopResults[std::make_pair(this, L)] = R;
+    else {
+      R->release();
+      delete R;
+    }
+
+  }
+
   LFV3(errs() << "Loop " << L->getHeader()->getName() << " refcount at exit: " << PHBB->localStore->refCount << "\n");
   
   return everChanged;
@@ -1191,6 +1954,7 @@ void IntegrationAttempt::executeBlock(ShadowBB* BB) {
   if(inst_is<ReturnInst>(&BB->insts[BB->insts.size() - 1])) {
     if(invarInfo->frameSize != -1)
       BB->popStackFrame();
+    BB->compactHeap();
     return;
   }
 
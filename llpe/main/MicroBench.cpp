@@ -0,0 +1,408 @@
+//===-- MicroBench.cpp ----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Micro-benchmarks for the store and value-set structures, so that a change of representation can be
+// measured before running whole specialisations (test/bench.py times those). Run with
+// opt -load LLVMLLPEMain.so -llpe -llpe-microbench=all over any module, or make llpe-microbench.
+// Each benchmark drives one operation over synthetic heap objects holding 8-byte scalars, once for
+// each order of visiting the objects' slots (sequential, strided and random), and prints the mean
+// time per operation. The objects are bare heap entries with no allocation behind them, and no
+// specialisation is attempted.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<unsigned> BenchObjects("llpe-microbench-objects", cl::init(1024));
+static cl::opt<unsigned> BenchObjectSize("llpe-microbench-object-size", cl::init(64));
+static cl::opt<unsigned> BenchFanIn("llpe-microbench-fanin", cl::init(4));
+static cl::opt<unsigned> BenchDepth("llpe-microbench-depth", cl::init(4));
+static cl::opt<unsigned> BenchIters("llpe-microbench-iters", cl::init(10));
+
+enum BenchPattern {
+
+  BENCH_SEQUENTIAL,
+  BENCH_STRIDED,
+  BENCH_RANDOM,
+  BENCH_PATTERNS
+
+};
+
+static const char* patternNames[BENCH_PATTERNS] = { "sequential", "strided", "random" };
+
+static double getWallTime() {
+
+  return TimeRecord::getCurrentTime(true).getWallTime();
+
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+
+  while(b) {
+    uint32_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+
+}
+
+// A permutation of 0 .. n-1 in the given order. Random orders are the same from run to run.
+static void getOrder(BenchPattern P, uint32_t n, std::vector<uint32_t>& Order) {
+
+  Order.resize(n);
+  for(uint32_t i = 0; i != n; ++i)
+    Order[i] = i;
+
+  if(P == BENCH_STRIDED && n > 2) {
+
+    // Any stride coprime with n visits everything; take one about a third of the way round.
+    uint32_t stride = (n / 3) | 1;
+    while(gcd(stride, n) != 1)
+      stride += 2;
+    for(uint32_t i = 0; i != n; ++i)
+      Order[i] = (uint32_t)(((uint64_t)i * stride) % n);
+
+  }
+  else if(P == BENCH_RANDOM) {
+
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    for(uint32_t i = n; i > 1; --i) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      std::swap(Order[i - 1], Order[(seed >> 33) % i]);
+    }
+
+  }
+
+}
+
+static void report(const char* Bench, BenchPattern P, double Seconds, uint64_t Ops) {
+
+  outs() << format("%-14s %-10s %10.1f ns/op (%llu ops)\n", Bench, patternNames[P],
+		   Ops ? (Seconds * 1e9) / Ops : 0.0, (unsigned long long)Ops);
+
+}
+
+static ImprovedValSetSingle getScalar(uint64_t Val) {
+
+  return ImprovedValSetSingle(ImprovedVal(ShadowValue(ConstantInt::get(GInt64, Val))), ValSetTypeScalar);
+
+}
+
+// Write Val over the 8-byte slot Slot of heap object Obj, as a store instruction would.
+static void writeSlot(ShadowBB* BB, uint32_t Obj, uint32_t Slot, uint64_t Val) {
+
+  SmallVector<IVSRange, 4> Vals;
+  Vals.push_back(std::make_pair(std::make_pair((uint64_t)Slot * 8, (uint64_t)(Slot + 1) * 8), getScalar(Val)));
+  ShadowValue Ptr = ShadowValue::getPtrIdx(-1, Obj);
+  writeExtents(Vals, Ptr, Slot * 8, 8, BB);
+
+}
+
+struct MicroBench {
+
+  uint32_t firstObj;
+  uint32_t nObjs;
+  uint32_t nSlots;
+
+  MicroBench(LLPEAnalysisPass* pass);
+
+  void benchStores(BenchPattern P);
+  void benchMerge(BenchPattern P);
+  void benchMultiWrites(BenchPattern P);
+  void benchMultiReads(BenchPattern P);
+  void benchPartialVals(BenchPattern P);
+
+};
+
+// Make the heap entries every benchmark works on.
+MicroBench::MicroBench(LLPEAnalysisPass* pass) {
+
+  nObjs = std::max(1U, (unsigned)BenchObjects);
+  nSlots = std::max(1U, (unsigned)BenchObjectSize / 8);
+  firstObj = pass->heap.size();
+
+  for(uint32_t i = 0; i != nObjs; ++i) {
+
+    pass->heap.push_back(AllocData());
+    AllocData& AD = pass->heap.back();
+    AD.storeSize = nSlots * 8;
+    AD.allocIdx = pass->heap.size() - 1;
+    AD.allocVague = false;
+    AD.isCommitted = false;
+
+  }
+
+}
+
+// SharedTreeRoot::getOrCreateStoreFor: create every object in an empty map, then find each again.
+void MicroBench::benchStores(BenchPattern P) {
+
+  std::vector<uint32_t> Order;
+  getOrder(P, nObjs, Order);
+
+  double createTime = 0, lookupTime = 0;
+
+  for(uint32_t iter = 0; iter != BenchIters; ++iter) {
+
+    OrdinaryLocalStore* Map = new OrdinaryLocalStore(0);
+    bool isNewStore;
+
+    double start = getWallTime();
+    for(uint32_t i = 0; i != nObjs; ++i) {
+      ShadowValue V = ShadowValue::getPtrIdx(-1, firstObj + Order[i]);
+      LocStore* Store = Map->heap.getOrCreateStoreFor(V, &isNewStore);
+      if(isNewStore)
+	Store->store = newOverdefIVS();
+    }
+    double mid = getWallTime();
+    for(uint32_t i = 0; i != nObjs; ++i) {
+      ShadowValue V = ShadowValue::getPtrIdx(-1, firstObj + Order[i]);
+      Map->heap.getOrCreateStoreFor(V, &isNewStore);
+    }
+    double end = getWallTime();
+
+    createTime += (mid - start);
+    lookupTime += (end - mid);
+    Map->dropReference();
+
+  }
+
+  report("store-create", P, createTime, (uint64_t)nObjs * BenchIters);
+  report("store-lookup", P, lookupTime, (uint64_t)nObjs * BenchIters);
+
+}
+
+// MergeBlockVisitor::doMerge: -llpe-microbench-fanin predecessors share a map defining every slot
+// of every object, and each then writes one slot of an eighth of the objects. Reported per merge.
+void MicroBench::benchMerge(BenchPattern P) {
+
+  std::vector<uint32_t> Order;
+  getOrder(P, nObjs, Order);
+
+  uint32_t fanIn = std::max(2U, (unsigned)BenchFanIn);
+  uint32_t nWritten = std::max(1U, nObjs / 8);
+  double mergeTime = 0;
+
+  for(uint32_t iter = 0; iter != BenchIters; ++iter) {
+
+    ShadowBB* BaseBB = new ShadowBB();
+    BaseBB->localStore = new OrdinaryLocalStore(0);
+    for(uint32_t i = 0; i != nObjs; ++i) {
+      for(uint32_t j = 0; j != nSlots; ++j)
+	writeSlot(BaseBB, firstObj + i, j, 0);
+    }
+
+    std::vector<ShadowBB*> Preds;
+    for(uint32_t i = 0; i != fanIn; ++i) {
+
+      ShadowBB* BB = new ShadowBB();
+      BB->localStore = BaseBB->localStore;
+      ++BB->localStore->refCount;
+
+      // Each predecessor writes a different run of objects.
+      for(uint32_t j = 0; j != nWritten; ++j)
+	writeSlot(BB, firstObj + Order[((i * nWritten) + j) % nObjs], j % nSlots, i + 1);
+
+      Preds.push_back(BB);
+
+    }
+
+    OrdinaryMerger V(0);
+    double start = getWallTime();
+    for(uint32_t i = 0; i != fanIn; ++i)
+      V.visit(Preds[i], 0, false);
+    V.doMerge();
+    mergeTime += (getWallTime() - start);
+
+    // The merge consumed the predecessors' references.
+    V.newMap->dropReference();
+    BaseBB->localStore->dropReference();
+    for(uint32_t i = 0; i != fanIn; ++i)
+      delete Preds[i];
+    delete BaseBB;
+
+  }
+
+  report("merge", P, mergeTime, BenchIters);
+
+}
+
+// replaceRangeWithPBs and clearRange: fill each object's multi a slot at a time,
+// then clear every other slot.
+void MicroBench::benchMultiWrites(BenchPattern P) {
+
+  std::vector<uint32_t> Order;
+  getOrder(P, nSlots, Order);
+
+  double writeTime = 0, clearTime = 0;
+  uint64_t nClears = 0;
+
+  for(uint32_t iter = 0; iter != BenchIters; ++iter) {
+
+    for(uint32_t i = 0; i != nObjs; ++i) {
+
+      ImprovedValSetMulti* IVM = newIVM(nSlots * 8);
+
+      double start = getWallTime();
+      for(uint32_t j = 0; j != nSlots; ++j) {
+	SmallVector<IVSRange, 4> Vals;
+	uint64_t Offset = (uint64_t)Order[j] * 8;
+	Vals.push_back(std::make_pair(std::make_pair(Offset, Offset + 8), getScalar(j)));
+	replaceRangeWithPBs(IVM, Vals, Offset, 8);
+      }
+      double mid = getWallTime();
+      for(uint32_t j = 0; j < nSlots; j += 2, ++nClears)
+	clearRange(IVM, (uint64_t)Order[j] * 8, 8);
+      double end = getWallTime();
+
+      writeTime += (mid - start);
+      clearTime += (end - mid);
+      IVM->dropReference();
+
+    }
+
+  }
+
+  report("multi-replace", P, writeTime, (uint64_t)nObjs * nSlots * BenchIters);
+  report("multi-clear", P, clearTime, nClears);
+
+}
+
+// readValRangeMultiFrom: read each slot through a stack of -llpe-microbench-depth multis,
+// each overlaying the one below with a write to every other slot of its own.
+void MicroBench::benchMultiReads(BenchPattern P) {
+
+  std::vector<uint32_t> Order;
+  getOrder(P, nSlots, Order);
+
+  uint32_t depth = std::max(1U, (unsigned)BenchDepth);
+  uint64_t ASize = nSlots * 8;
+  double readTime = 0;
+
+  for(uint32_t iter = 0; iter != BenchIters; ++iter) {
+
+    for(uint32_t i = 0; i != nObjs; ++i) {
+
+      ImprovedValSetMulti* Top = 0;
+      for(uint32_t d = 0; d != depth; ++d) {
+
+	ImprovedValSetMulti* IVM = newIVM(ASize);
+	IVM->Underlying = Top;
+	for(uint32_t j = d % 2; j < nSlots; j += (d == 0 ? 1 : 2)) {
+	  SmallVector<IVSRange, 4> Vals;
+	  Vals.push_back(std::make_pair(std::make_pair((uint64_t)j * 8, (uint64_t)(j + 1) * 8), getScalar((d << 16) | j)));
+	  replaceRangeWithPBs(IVM, Vals, (uint64_t)j * 8, 8);
+	}
+	Top = IVM;
+
+      }
+
+      SmallVector<IVSRange, 4> Results;
+      double start = getWallTime();
+      for(uint32_t j = 0; j != nSlots; ++j) {
+	Results.clear();
+	readValRangeMultiFrom((uint64_t)Order[j] * 8, 8, Top, Results, 0, ASize);
+      }
+      readTime += (getWallTime() - start);
+
+      Top->dropReference();
+
+    }
+
+  }
+
+  report("multi-read", P, readTime, (uint64_t)nObjs * nSlots * BenchIters);
+
+}
+
+// PartialVal::combineWith: define an object's bytes one slot at a time, first every other
+// slot (whole runs of fresh bytes) and then all of them (bytes partly defined already).
+void MicroBench::benchPartialVals(BenchPattern P) {
+
+  std::vector<uint32_t> Order;
+  getOrder(P, nSlots, Order);
+
+  std::vector<uint8_t> Source(nSlots * 8);
+  for(uint32_t i = 0, ilim = Source.size(); i != ilim; ++i)
+    Source[i] = (uint8_t)i;
+
+  double combineTime = 0;
+  uint64_t nCombines = 0;
+
+  for(uint32_t iter = 0; iter != BenchIters; ++iter) {
+
+    for(uint32_t i = 0; i != nObjs; ++i) {
+
+      PartialVal PV(nSlots * 8);
+
+      double start = getWallTime();
+      for(uint32_t j = 0; j < nSlots; j += 2, ++nCombines)
+	PV.combineWith(&Source[Order[j] * 8], Order[j] * 8, (Order[j] + 1) * 8);
+      for(uint32_t j = 0; j != nSlots; ++j, ++nCombines)
+	PV.combineWith(&Source[Order[j] * 8], Order[j] * 8, (Order[j] + 1) * 8);
+      combineTime += (getWallTime() - start);
+
+    }
+
+  }
+
+  report("partialval", P, combineTime, nCombines);
+
+}
+
+// Run the benchmarks named in Names ("all" for every one).
+void LLPEAnalysisPass::runMicroBench(Module& M, const std::vector<std::string>& Names) {
+
+  static const char* benchNames[] = { "stores", "merge", "multi-write", "multi-read", "partialval", 0 };
+  typedef void (MicroBench::*BenchFn)(BenchPattern);
+  static const BenchFn benchFns[] = { &MicroBench::benchStores, &MicroBench::benchMerge, &MicroBench::benchMultiWrites,
+				      &MicroBench::benchMultiReads, &MicroBench::benchPartialVals };
+
+  bool all = std::find(Names.begin(), Names.end(), "all") != Names.end();
+  for(std::vector<std::string>::const_iterator it = Names.begin(), itend = Names.end(); it != itend; ++it) {
+
+    if(*it == "all")
+      continue;
+
+    uint32_t i;
+    for(i = 0; benchNames[i] && *it != benchNames[i]; ++i) { }
+    if(!benchNames[i]) {
+      errs() << "-llpe-microbench: unknown benchmark " << *it << " (expected all, stores, merge, multi-write, multi-read or partialval)\n";
+      exit(1);
+    }
+
+  }
+
+  MicroBench Bench(this);
+
+  outs() << "Objects: " << Bench.nObjs << " of " << (Bench.nSlots * 8) << " bytes, merge fan-in "
+	 << BenchFanIn << ", read depth " << BenchDepth << ", " << BenchIters << " iterations, "
+	 << (unsigned)(LLPE_MULTI_ROOT_LEAF) << " inline extents per multi\n";
+
+  for(uint32_t i = 0; benchNames[i]; ++i) {
+
+    if(!(all || std::find(Names.begin(), Names.end(), benchNames[i]) != Names.end()))
+      continue;
+
+    for(uint32_t P = 0; P != BENCH_PATTERNS; ++P)
+      (Bench.*benchFns[i])((BenchPattern)P);
+
+  }
+
+}
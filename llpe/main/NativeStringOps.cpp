@@ -0,0 +1,368 @@
+//===-- NativeStringOps.cpp -----------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Analysis/LLPE.h"
+#include "llvm/Analysis/LLPECopyPaste.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string.h>
+
+#define DEBUG_TYPE "llpe-misc"
+
+using namespace llvm;
+
+// Native evaluation of common libc string and memory routines (see -llpe-native-string-ops).
+// Rather than expanding e.g. strlen and analysing its implementation one instruction at a time,
+// we materialise the bytes its arguments point to from the symbolic store and run the host's
+// own routine over them. This only applies when the bytes that determine the result are all known;
+// otherwise the call is analysed as usual.
+
+// The results don't pass through the tentative loads analysis, which only sees an unexpanded call,
+// so unless the program is single threaded we only read objects no other thread can write.
+static bool canReadNatively(ShadowValue Base) {
+
+  if(GlobalIHP->programSingleThreaded)
+    return true;
+
+  ShadowGV* G = Base.getGV();
+  return G && G->G->isConstant();
+
+}
+
+// Reader that materialises a known prefix of the bytes at Base+Offset, extending it on demand
+// in doubling chunks so that a short string in a large buffer costs a short read.
+struct NativeByteReader {
+
+  ShadowValue Base;
+  uint64_t Offset;
+  uint64_t Limit;
+  ShadowBB* BB;
+  SmallVector<uint8_t, 64> Bytes;
+  bool Exhausted;
+
+  bool init(ShadowValue Ptr, ShadowBB* _BB) {
+
+    int64_t SOffset;
+    if(!getBaseAndConstantOffset(Ptr, Base, SOffset))
+      return false;
+    if(SOffset < 0 || !(Base.isGV() || Base.isPtrIdx()) || !canReadNatively(Base))
+      return false;
+
+    BB = _BB;
+    Offset = SOffset;
+    uint64_t ASize = BB->getAllocSize(Base);
+    if(ASize == ULONG_MAX || Offset > ASize)
+      return false;
+
+    Limit = ASize - Offset;
+    Exhausted = (Limit == 0);
+    return true;
+
+  }
+
+  // Append the known bytes at the start of [Offset + Bytes.size(), Offset + Bytes.size() + Size).
+  // Stops at the first byte that isn't a known constant. Returns the number of bytes added.
+  uint64_t readChunk(uint64_t Size) {
+
+    uint64_t Start = Bytes.size();
+    SmallVector<IVSRange, 4> Results;
+    readValRangeMulti(Base, Offset + Start, Size, BB, Results);
+
+    Bytes.resize(Start + Size);
+
+    uint64_t Known = 0;
+    for(SmallVector<IVSRange, 4>::iterator it = Results.begin(), itend = Results.end(); it != itend; ++it) {
+
+      uint64_t RangeStart = it->first.first - Offset;
+      uint64_t RangeSize = it->first.second - it->first.first;
+      ImprovedValSetSingle& IVS = it->second;
+
+      if(RangeStart != Start + Known || IVS.isWhollyUnknown() || IVS.Values.size() != 1 || !IVS.Values[0].V.isVal())
+	break;
+
+      uint8_t* Dest = &Bytes[RangeStart];
+
+      if(IVS.SetType == ValSetTypeScalarSplat) {
+
+	ConstantInt* SplatC = dyn_cast<ConstantInt>(IVS.Values[0].V.getVal());
+	if(!SplatC)
+	  break;
+	memset(Dest, (uint8_t)SplatC->getLimitedValue(), RangeSize);
+
+      }
+      else if(IVS.SetType == ValSetTypeScalar) {
+
+	Constant* C = dyn_cast<Constant>(IVS.Values[0].V.getVal());
+	if((!C) || isa<UndefValue>(C) || !XXXReadDataFromGlobal(C, 0, Dest, RangeSize, *GlobalTD))
+	  break;
+
+      }
+      else {
+
+	break;
+
+      }
+
+      Known += RangeSize;
+
+    }
+
+    Bytes.resize(Start + Known);
+    return Known;
+
+  }
+
+  // Try to make more bytes available. Returns false if none could be added.
+  bool extend() {
+
+    if(Exhausted)
+      return false;
+
+    uint64_t Chunk = std::min(std::max((uint64_t)Bytes.size(), (uint64_t)64), Limit - Bytes.size());
+    uint64_t Added = readChunk(Chunk);
+    if(Added != Chunk || Bytes.size() == Limit)
+      Exhausted = true;
+    return Added != 0;
+
+  }
+
+  // Make at least N bytes available if possible.
+  bool ensure(uint64_t N) {
+
+    while(Bytes.size() < N) {
+      if(!extend())
+	return false;
+    }
+    return true;
+
+  }
+
+};
+
+// Find the first occurrence of C, or of nul if alsoNul is set, in the first MaxLen bytes read by R.
+// Returns false if that depends on bytes that aren't known. Otherwise sets Found and Idx.
+static bool findByte(NativeByteReader& R, uint8_t C, bool alsoNul, uint64_t MaxLen, bool& Found, uint64_t& Idx) {
+
+  uint64_t Scanned = 0;
+
+  while(Scanned < MaxLen) {
+
+    if(Scanned == R.Bytes.size() && !R.extend())
+      return false;
+
+    uint64_t ScanLen = std::min((uint64_t)R.Bytes.size(), MaxLen) - Scanned;
+    const uint8_t* Start = R.Bytes.data() + Scanned;
+
+    const uint8_t* Hit = (const uint8_t*)memchr(Start, C, ScanLen);
+    if(alsoNul && C != 0) {
+      const uint8_t* NulHit = (const uint8_t*)memchr(Start, 0, Hit ? (Hit - Start) : ScanLen);
+      if(NulHit)
+	Hit = NulHit;
+    }
+
+    if(Hit) {
+      Found = true;
+      Idx = Scanned + (Hit - Start);
+      return true;
+    }
+
+    Scanned += ScanLen;
+
+  }
+
+  Found = false;
+  return true;
+
+}
+
+// Compare up to MaxLen bytes read by A and B, stopping after a nul if isString is set,
+// with the result convention of memcmp and strcmp. Returns false if the result isn't known.
+static bool compareBytes(NativeByteReader& A, NativeByteReader& B, bool isString, uint64_t MaxLen, int& Result) {
+
+  uint64_t Pos = 0;
+
+  while(Pos < MaxLen) {
+
+    if(!(A.ensure(Pos + 1) && B.ensure(Pos + 1)))
+      return false;
+
+    uint64_t End = std::min(std::min((uint64_t)A.Bytes.size(), (uint64_t)B.Bytes.size()), MaxLen);
+    const uint8_t* AStart = A.Bytes.data() + Pos;
+    const uint8_t* BStart = B.Bytes.data() + Pos;
+
+    bool sawNul = false;
+    if(isString) {
+      if(const uint8_t* Nul = (const uint8_t*)memchr(AStart, 0, End - Pos)) {
+	End = Pos + (Nul - AStart) + 1;
+	sawNul = true;
+      }
+    }
+
+    if(memcmp(AStart, BStart, End - Pos)) {
+
+      // Pin down the differing byte: the host's result magnitude isn't specified.
+      uint64_t i = 0;
+      while(AStart[i] == BStart[i])
+	++i;
+      Result = (int)AStart[i] - (int)BStart[i];
+      return true;
+
+    }
+
+    if(sawNul)
+      break;
+
+    Pos = End;
+
+  }
+
+  Result = 0;
+  return true;
+
+}
+
+static bool getConstantLength(ShadowValue V, uint64_t& Len) {
+
+  ConstantInt* CI = dyn_cast_or_null<ConstantInt>(getConstReplacement(V));
+  if(!CI)
+    return false;
+  Len = CI->getLimitedValue();
+  return true;
+
+}
+
+// Give SI a pointer result of Reader's base object offset by Idx.
+static void setPointerResult(ShadowInstruction* SI, NativeByteReader& Reader, uint64_t Idx) {
+
+  if(SI->i.PB)
+    deleteIV(SI->i.PB);
+
+  ImprovedValSetSingle* NewIVS = newIVS();
+  NewIVS->set(ImprovedVal(Reader.Base, Reader.Offset + Idx), ValSetTypePB);
+  SI->i.PB = NewIVS;
+
+}
+
+// Try to evaluate SI, a call to one of the routines -llpe-native-string-ops recognises, without
+// expanding it. Returns true if SI has been given a result and any side-effect.
+bool IntegrationAttempt::tryNativeStringCall(ShadowInstruction* SI) {
+
+  if(pass->nativeStringFunctions.empty() || !inst_is<CallInst>(SI))
+    return false;
+
+  Function* F = getCalledFunction(SI);
+  if(!F)
+    return false;
+
+  DenseMap<Function*, NativeStringOp>::iterator findit = pass->nativeStringFunctions.find(F);
+  if(findit == pass->nativeStringFunctions.end())
+    return false;
+
+  // Never abandon a context that has already been analysed.
+  if(getInlineAttempt(SI))
+    return false;
+
+  // Guard against unusual declarations of the same names:
+  NativeStringOp Op = findit->second;
+  uint32_t nArgs = (Op == NSO_STRLEN ? 1 : (Op == NSO_STRCMP || Op == NSO_STRCHR) ? 2 : 3);
+  Type* RetTy = F->getReturnType();
+  bool retPointer = (Op == NSO_MEMCHR || Op == NSO_STRCHR || Op == NSO_MEMCPY);
+  if(F->isVarArg() || F->arg_size() != nArgs || SI->getNumArgOperands() != nArgs ||
+     (retPointer ? !RetTy->isPointerTy() : !RetTy->isIntegerTy()))
+    return false;
+
+  Type* ResultTy = SI->invar->I->getType();
+  ShadowBB* BB = SI->parent;
+  NativeByteReader A, B;
+
+  switch(Op) {
+
+  case NSO_STRLEN:
+    {
+      bool Found;
+      uint64_t Idx;
+      if(!(A.init(SI->getCallArgOperand(0), BB) && findByte(A, 0, false, ULONG_MAX, Found, Idx) && Found))
+	return false;
+      setReplacement(SI, ConstantInt::get(ResultTy, Idx));
+      break;
+    }
+
+  case NSO_STRCMP:
+  case NSO_STRNCMP:
+  case NSO_MEMCMP:
+    {
+      uint64_t MaxLen = ULONG_MAX;
+      if(Op != NSO_STRCMP && !getConstantLength(SI->getCallArgOperand(2), MaxLen))
+	return false;
+      int Result;
+      if(!(A.init(SI->getCallArgOperand(0), BB) && B.init(SI->getCallArgOperand(1), BB) &&
+	   compareBytes(A, B, Op != NSO_MEMCMP, MaxLen, Result)))
+	return false;
+      setReplacement(SI, ConstantInt::getSigned(ResultTy, Result));
+      break;
+    }
+
+  case NSO_MEMCHR:
+  case NSO_STRCHR:
+    {
+      ConstantInt* SearchC = dyn_cast_or_null<ConstantInt>(getConstReplacement(SI->getCallArgOperand(1)));
+      uint64_t MaxLen = ULONG_MAX;
+      if((!SearchC) || (Op == NSO_MEMCHR && !getConstantLength(SI->getCallArgOperand(2), MaxLen)))
+	return false;
+
+      bool Found;
+      uint64_t Idx;
+      uint8_t SearchByte = (uint8_t)SearchC->getLimitedValue();
+      if(!(A.init(SI->getCallArgOperand(0), BB) && findByte(A, SearchByte, Op == NSO_STRCHR, MaxLen, Found, Idx)))
+	return false;
+
+      // strchr also stopped at the terminator, which only counts if that's what was sought.
+      if(Found && (Op == NSO_MEMCHR || A.Bytes[Idx] == SearchByte))
+	setPointerResult(SI, A, Idx);
+      else
+	setReplacement(SI, Constant::getNullValue(ResultTy));
+      break;
+    }
+
+  case NSO_MEMCPY:
+    {
+      // Only the length needs to be known: the copy itself is modelled just like llvm.memcpy,
+      // and the callee returns its destination.
+      uint64_t Len;
+      ShadowValue Dest = SI->getCallArgOperand(0);
+      ShadowValue SrcBase;
+      if(!(getConstantLength(SI->getCallArgOperand(2), Len) &&
+	   getBaseObject(SI->getCallArgOperand(1), SrcBase) && canReadNatively(SrcBase)))
+	return false;
+
+      executeMemcpyInst(SI);
+
+      if(SI->i.PB)
+	deleteIV(SI->i.PB);
+      SI->i.PB = 0;
+      ImprovedValSet* DestPB;
+      if(copyImprovedVal(Dest, DestPB))
+	SI->i.PB = DestPB;
+      else
+	SI->i.PB = newOverdefIVS();
+      break;
+    }
+
+  }
+
+  LPDEBUG("Natively evaluated " << itcache(SI) << "\n");
+  ++pass->stats.nativeStringCalls;
+  return true;
+
+}
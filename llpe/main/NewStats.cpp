@@ -12,6 +12,12 @@
 #include "llvm/Analysis/LLPE.h"
 
 #include "llvm/IR/Function.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+
+#include <algorithm>
+
+#include <sys/resource.h>
 
 using namespace llvm;
 
@@ -31,6 +37,21 @@ static bool isHeapPointer(ShadowValue V) {
 
 }
 
+void InlineAttempt::describeContextStats(ContextStats& CS) {
+
+  CS.parentSeqNumber = activeCaller ? (int64_t)activeCaller->parent->IA->SeqNumber : -1;
+  CS.iteration = -1;
+
+}
+
+void PeelIteration::describeContextStats(ContextStats& CS) {
+
+  CS.parentSeqNumber = parent->SeqNumber;
+  CS.loopHeader = getBBInvar(L->headerIdx)->BB->getName().str();
+  CS.iteration = iterationCount;
+
+}
+
 // Count stats for this function or loop context.
 void IntegrationAttempt::preCommitStats(bool enabledHere) {
 
@@ -42,11 +63,35 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
   if(!enabledHere)
     ++GlobalIHP->stats.disabledContexts;
 
+  ContextStats CS;
+  CS.seqNumber = SeqNumber;
+  CS.function = F.getName().str();
+  CS.stackDepth = stack_depth;
+  CS.enabled = enabledHere;
+  CS.instructions = 0;
+  CS.eliminated = 0;
+  CS.fixpointIterations = fixpointIterationsHere;
+  CS.analysisSeconds = analysisSeconds;
+  describeContextStats(CS);
+
+  GlobalStats& S = GlobalIHP->stats;
+  uint32_t checksBefore = S.condChecks + S.mallocChecks + S.fileChecks + S.threadChecks;
+
+  SmallPtrSet<void*, 16> retainedStores;
+
   for(uint32_t i = 0; i < nBBs; ++i) {
 
     if(!BBs[i])
       continue;
 
+    if(BBs[i]->localStore)
+      retainedStores.insert(BBs[i]->localStore);
+    if(BBs[i]->tlStore)
+      retainedStores.insert(BBs[i]->tlStore);
+    if(BBs[i]->dseStore)
+      retainedStores.insert(BBs[i]->dseStore);
+    CS.instructions += BBs[i]->insts.size();
+
     // Count live blocks
     ++GlobalIHP->stats.dynamicBlocks;
     // Count total instructions in live blocks.
@@ -94,6 +139,10 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
       else {
 
 	ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(SI.i.PB);
+
+	if(SI.dieStatus || (IVS && IVS->Values.size() == 1 && (IVS->SetType == ValSetTypeScalar || IVS->SetType == ValSetTypePB)))
+	  ++CS.eliminated;
+
 	if(IVS && IVS->Values.size() == 1) {
 
 	  // Count instructions successfully resolved to a constant or known symbolic pointer.
@@ -149,6 +198,10 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
 
   }
 
+  CS.checks = (S.condChecks + S.mallocChecks + S.fileChecks + S.threadChecks) - checksBefore;
+  CS.retainedStores = retainedStores.size();
+  S.contexts.push_back(CS);
+
   // Accumulate stats for our child calls:
   for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
     
@@ -190,3 +243,253 @@ void LLPEAnalysisPass::postCommitStats() {
   }
 
 }
+
+struct LoopFixpointCmp {
+
+  bool operator()(const std::pair<BasicBlock*, LoopFixpointStats>& A, const std::pair<BasicBlock*, LoopFixpointStats>& B) {
+    return A.second.iterations > B.second.iterations;
+  }
+
+};
+
+// Print loop fixpoint records, most iterations first, so the pathological loops are easy to find.
+void GlobalStats::printLoopFixpoints(raw_ostream& Out) {
+
+  std::vector<std::pair<BasicBlock*, LoopFixpointStats> > Loops(loopFixpoints.begin(), loopFixpoints.end());
+  std::sort(Loops.begin(), Loops.end(), LoopFixpointCmp());
+
+  Out << "Loop fixpoints (function / header: analyses, reused, total iterations, max iterations, widened, skipped evaluations, seconds):\n";
+
+  for(std::vector<std::pair<BasicBlock*, LoopFixpointStats> >::iterator it = Loops.begin(), 
+	itend = Loops.end(); it != itend; ++it) {
+
+    LoopFixpointStats& S = it->second;
+    Out << "  " << it->first->getParent()->getName() << " / " << it->first->getName() << ": " << S.analyses << ", " << S.reused << ", " 
+	<< S.iterations << ", " << S.maxIterations << ", " << S.widened << ", " << S.skippedEvals << ", ";
+    Out << format("%.3f", S.seconds) << "\n";
+
+  }
+
+}
+
+static double getWallTime() {
+
+  return TimeRecord::getCurrentTime(true).getWallTime();
+
+}
+
+// Charge the time since the last phase transition to the current phase, then start P.
+void GlobalStats::enterPhase(LLPEPhase P) {
+
+  double now = getWallTime();
+  if(!phaseStack.empty())
+    phaseSeconds[phaseStack.back()] += (now - phaseStartTime);
+
+  phaseStack.push_back(P);
+  phaseStartTime = now;
+
+}
+
+void GlobalStats::exitPhase() {
+
+  release_assert(!phaseStack.empty() && "Exiting phase with none active?");
+
+  double now = getWallTime();
+  phaseSeconds[phaseStack.back()] += (now - phaseStartTime);
+
+  phaseStack.pop_back();
+  phaseStartTime = now;
+
+}
+
+PhaseTimer::PhaseTimer(LLPEPhase P) {
+
+  GlobalIHP->stats.enterPhase(P);
+
+}
+
+PhaseTimer::~PhaseTimer() {
+
+  GlobalIHP->stats.exitPhase();
+
+}
+
+// Charge the time since the last context transition to the context being analysed, then start IA.
+void GlobalStats::enterContext(IntegrationAttempt* IA) {
+
+  double now = getWallTime();
+  if(!contextStack.empty())
+    contextStack.back()->analysisSeconds += (now - contextStartTime);
+
+  contextStack.push_back(IA);
+  contextStartTime = now;
+
+}
+
+void GlobalStats::exitContext() {
+
+  release_assert(!contextStack.empty() && "Exiting context with none active?");
+
+  double now = getWallTime();
+  contextStack.back()->analysisSeconds += (now - contextStartTime);
+
+  contextStack.pop_back();
+  contextStartTime = now;
+
+}
+
+ContextTimer::ContextTimer(IntegrationAttempt* IA) : active(!GlobalIHP->statsFile.empty()) {
+
+  if(active)
+    GlobalIHP->stats.enterContext(IA);
+
+}
+
+ContextTimer::~ContextTimer() {
+
+  if(active)
+    GlobalIHP->stats.exitContext();
+
+}
+
+static const char* phaseNames[PHASE_MAX] = {
+  "analysis", "tentative_loads", "dse", "benefit", "die", "commit", "postcommit", "fix_nonlocal_uses"
+};
+
+static void printCounterJSON(raw_ostream& Out, const char* Name, AllocCounter& C, uint64_t objSize, bool last = false) {
+
+  Out << "    \"" << Name << "\": { \"allocated\": " << C.allocated << ", \"live\": " << C.live << ", \"peak\": " << C.peak;
+  if(objSize)
+    Out << ", \"peak_bytes\": " << (C.peak * objSize);
+  Out << " }" << (last ? "\n" : ",\n");
+
+}
+
+// Write phase timings and allocation counters in machine-readable form, for tracking between runs.
+void GlobalStats::printPhasesJSON(raw_ostream& Out) {
+
+  Out << "{\n  \"phases\": {\n";
+  for(uint32_t i = 0; i < PHASE_MAX; ++i) {
+    Out << "    \"" << phaseNames[i] << "\": " << format("%.6f", phaseSeconds[i]);
+    Out << (i + 1 == PHASE_MAX ? "\n" : ",\n");
+  }
+  Out << "  },\n";
+
+  Out << "  \"counters\": {\n";
+  printCounterJSON(Out, "value_sets", GlobalIVSCounter, sizeof(ImprovedValSetSingle));
+  printCounterJSON(Out, "multi_value_sets", GlobalMultiCounter, sizeof(ImprovedValSetMulti));
+  printCounterJSON(Out, "heap_tree_nodes", GlobalTreeNodeCounter, sizeof(SharedTreeNode<LocStore, OrdinaryStoreExtraState>));
+  printCounterJSON(Out, "store_maps", GlobalStoreMapCounter, 0);
+  printCounterJSON(Out, "frame_chunks", GlobalFrameChunkCounter, sizeof(SharedFrameChunk<LocStore>));
+  printCounterJSON(Out, "context_shadows", GlobalContextCounter, 0, true);
+  Out << "  },\n";
+
+  Out << "  \"merges_avoided\": { \"maps\": " << GlobalMergeSharing.maps << ", \"frames\": " << GlobalMergeSharing.frames
+      << ", \"heaps\": " << GlobalMergeSharing.heaps << ", \"subtrees\": " << GlobalMergeSharing.subtrees
+      << ", \"objects\": " << GlobalMergeSharing.objects << " },\n";
+
+  Out << "  \"read_cache\": { \"hits\": " << readCacheHits << ", \"misses\": " << readCacheMisses << " },\n";
+
+  Out << "  \"flattened_multis\": " << flattenedMultis << ",\n";
+  Out << "  \"merged_functions\": { \"functions\": " << mergedFunctions << ", \"instructions\": " << mergedInstructions << " },\n";
+  Out << "  \"call_memo\": { \"hits\": " << callMemoHits << ", \"entries\": " << callMemoEntries << " },\n";
+  Out << "  \"native_string_calls\": " << nativeStringCalls << ",\n";
+  Out << "  \"trip_probe_skips\": " << tripProbeSkips << ",\n";
+  Out << "  \"discarded_peel_iterations\": " << discardedPeelIterations << ",\n";
+  Out << "  \"rerolled_loops\": { \"loops\": " << rerolledLoops << ", \"iterations\": " << rerolledIterations << " },\n";
+  Out << "  \"memcpy_bytes\": { \"copied\": " << memcpyBytesCopied << ", \"referenced\": " << memcpyBytesReferenced << " },\n";
+  Out << "  \"constant_images\": { \"images\": " << constantImages << ", \"reads\": " << constantImageReads << " },\n";
+  Out << "  \"forwarded_values\": { \"values\": " << forwardedValues << ", \"loads\": " << forwardingLoads << " },\n";
+  Out << "  \"thread_local_atomics\": " << threadLocalAtomics << ",\n";
+  Out << "  \"static_heap\": { \"allocations\": " << staticHeapAllocations << ", \"bytes\": " << staticHeapBytes << " },\n";
+  Out << "  \"multiloads_failed_early\": " << multiloadsFailedEarly << ",\n";
+  Out << "  \"constant_string_cache\": { \"hits\": " << constantStringHits << ", \"misses\": " << constantStringMisses << " },\n";
+  Out << "  \"compacted_heap_objects\": " << compactedHeapObjects << ",\n";
+  Out << "  \"unterminated_peels\": " << unterminatedPeels << ",\n";
+  Out << "  \"unterminated_peel_seconds\": " << format("%.6f", unterminatedPeelSeconds) << ",\n";
+  Out << "  \"read_only_indirect_calls\": " << readOnlyIndirectCalls << ",\n";
+  Out << "  \"user_indexed_functions\": " << userIndexedFunctions << ",\n";
+  Out << "  \"sharing_breaks\": " << sharingBreaks << ",\n";
+  Out << "  \"sharing_break_copies\": " << sharingBreakCopies << ",\n";
+  Out << "  \"deep_sharing_matches\": " << deepSharingMatches << ",\n";
+  Out << "  \"file_windows\": { \"loaded\": " << fileWindowLoads << ", \"reads\": " << fileWindowReads << " },\n";
+  Out << "  \"synth_pointer_reuses\": { \"constants\": " << synthConstantReuses << ", \"instructions\": " << synthInstructionReuses << " },\n";
+  Out << "  \"context_budgets_exceeded\": " << contextBudgetsExceeded << ",\n";
+  Out << "  \"spilled_slabs\": { \"slabs\": " << spilledSlabs << ", \"bytes\": " << spilledSlabBytes << " },\n";
+  Out << "  \"failure_counter_sites\": " << failureCounterSites << ",\n";
+  Out << "  \"shared_landing_pads\": { \"regions\": " << sharedLandingPads << ", \"blocks\": " << sharedLandingPadBlocks << " },\n";
+  Out << "  \"vector_lane_insts\": " << vectorLaneInsts << ",\n";
+  Out << "  \"summarised_allocations\": " << summarisedAllocations << ",\n";
+  Out << "  \"skipped_clobbers\": " << skippedClobbers << ",\n";
+  Out << "  \"library_summaries\": { \"hits\": " << librarySummaryHits << ", \"exported\": " << librarySummariesExported << " },\n";
+  Out << "  \"inert_store_walks_skipped\": " << inertStoreWalksSkipped << ",\n";
+  Out << "  \"read_bytes_memo_hits\": " << readBytesMemoHits << ",\n";
+  Out << "  \"int_range_cmp_folds\": " << intRangeCmpFolds << ",\n";
+  Out << "  \"implied_path_condition_checks\": " << impliedPathConditionChecks << ",\n";
+  Out << "  \"pruned_functions\": " << prunedFunctions << ",\n";
+  Out << "  \"pruned_global_variables\": " << prunedGlobalVariables << ",\n";
+  Out << "  \"closed_form_loop_exits\": " << closedFormLoopExits << ",\n";
+  Out << "  \"tabled_recursive_calls\": " << tabledRecursiveCalls << ",\n";
+  Out << "  \"merged_constant_globals\": { \"globals\": " << mergedConstantGlobals << ", \"bytes\": " << mergedConstantBytes << " },\n";
+  Out << "  \"redirected_read_buffers\": { \"buffers\": " << redirectedReadBuffers << ", \"bytes\": " << redirectedReadBytes << " },\n";
+  Out << "  \"bounded_allocations\": " << boundedAllocations << ",\n";
+  Out << "  \"read_depths\": [";
+  for(uint32_t i = 0; i < READDEPTHBUCKETS; ++i)
+    Out << (i ? ", " : "") << readDepths[i];
+  Out << "],\n";
+
+  struct rusage usage;
+  long maxRSS = 0;
+  if(!getrusage(RUSAGE_SELF, &usage))
+    maxRSS = usage.ru_maxrss;
+
+  uint64_t fixpointIterations = 0, fixpointSkippedEvals = 0;
+  for(DenseMap<BasicBlock*, LoopFixpointStats>::iterator it = loopFixpoints.begin(),
+	itend = loopFixpoints.end(); it != itend; ++it) {
+    fixpointIterations += it->second.iterations;
+    fixpointSkippedEvals += it->second.skippedEvals;
+  }
+
+  Out << "  \"contexts\": " << dynamicContexts << ",\n";
+  Out << "  \"fixpoint_iterations\": " << fixpointIterations << ",\n";
+  Out << "  \"fixpoint_skipped_evaluations\": " << fixpointSkippedEvals << ",\n";
+  Out << "  \"committed_instructions\": " << residualInstructions << ",\n";
+  Out << "  \"committed_blocks\": " << residualBlocks << ",\n";
+  Out << "  \"peak_rss_kb\": " << maxRSS << "\n";
+  Out << "}\n";
+
+}
+
+// Write one record per function or loop iteration context, for finding those that cost
+// the most analysis time for the least benefit.
+void GlobalStats::printContextsJSON(raw_ostream& Out) {
+
+  Out << "[\n";
+
+  for(uint32_t i = 0, ilim = contexts.size(); i != ilim; ++i) {
+
+    ContextStats& CS = contexts[i];
+    Out << "  { \"id\": " << CS.seqNumber << ", \"parent\": " << CS.parentSeqNumber << ", \"function\": \"";
+    Out.write_escaped(CS.function);
+    Out << "\", \"loop\": ";
+    if(CS.loopHeader.empty())
+      Out << "null";
+    else {
+      Out << "\"";
+      Out.write_escaped(CS.loopHeader);
+      Out << "\"";
+    }
+    Out << ", \"iteration\": " << CS.iteration << ", \"stack_depth\": " << CS.stackDepth
+	<< ", \"enabled\": " << (CS.enabled ? "true" : "false")
+	<< ", \"instructions\": " << CS.instructions << ", \"eliminated\": " << CS.eliminated
+	<< ", \"residual\": " << (CS.instructions - CS.eliminated) << ", \"checks\": " << CS.checks
+	<< ", \"fixpoint_iterations\": " << CS.fixpointIterations
+	<< ", \"analysis_seconds\": " << format("%.6f", CS.analysisSeconds)
+	<< ", \"retained_stores\": " << CS.retainedStores << " }";
+    Out << (i + 1 == ilim ? "\n" : ",\n");
+
+  }
+
+  Out << "]\n";
+
+}
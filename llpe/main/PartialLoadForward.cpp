@@ -111,71 +111,60 @@ Constant* llvm::intFromBytes(const uint64_t* data, unsigned data_length, unsigne
 
 }
 
-// Find out the index of the idx'th non-floating-point argument to this function.
-// This is needed because varargs calling convention splits the integer-typed and FP-typed
-// varargs.
-int64_t InlineAttempt::NonFPArgIdxToArgIdx(int64_t idx) {
+// Sort this call's varargs into the integer-typed and FP-typed lists that va_arg walks, since
+// the varargs calling convention splits them. printf-like functions look these up for every va_arg.
+void InlineAttempt::buildVarArgIdxs() {
 
   // All callers must have the same operand count, so Callers[0] is ok.
-  for(unsigned i = F.getFunctionType()->getNumParams(); i < Callers[0]->getNumArgOperands(); ++i) {
+  varArgIdxsCaller = Callers[0];
+  nonFPVarArgIdxs.clear();
+  fpVarArgIdxs.clear();
+  varArgIdxsComplete = true;
 
-    ImmutableCallSite ICS(Callers[0]->invar->I);
-
-    Type* T = ICS.getArgument(i)->getType();
-    if(T->isPointerTy() || T->isIntegerTy()) {
+  ImmutableCallSite ICS(Callers[0]->invar->I);
+  unsigned nParams = F.getFunctionType()->getNumParams();
 
-      if(idx == 0)
-	return ImprovedVal::first_any_arg + (i - F.getFunctionType()->getNumParams());
-      else
-	--idx;
+  for(unsigned i = nParams; i < Callers[0]->getNumArgOperands(); ++i) {
 
+    Type* T = ICS.getArgument(i)->getType();
+    if(T->isPointerTy() || T->isIntegerTy())
+      nonFPVarArgIdxs.push_back(ImprovedVal::first_any_arg + (i - nParams));
+    else if(T->isFloatingPointTy())
+      fpVarArgIdxs.push_back(ImprovedVal::first_any_arg + (i - nParams));
+    else {
+      // Lookups that would need to look past this are unhandled.
+      varArgIdxsComplete = false;
+      return;
     }
-    else if(T->isFloatingPointTy()) {
 
-      continue;
+  }
 
-    }
-    else {
+}
 
-      release_assert(0 && "Unhandled vararg type");
+// Find out the index of the idx'th non-floating-point argument to this function.
+int64_t InlineAttempt::NonFPArgIdxToArgIdx(int64_t idx) {
 
-    }
+  if(varArgIdxsCaller != Callers[0])
+    buildVarArgIdxs();
 
+  if(idx < 0 || idx >= (int64_t)nonFPVarArgIdxs.size()) {
+    release_assert(varArgIdxsComplete && "Unhandled vararg type");
+    return ImprovedVal::not_va_arg;
   }
-
-  return ImprovedVal::not_va_arg;
+  return nonFPVarArgIdxs[idx];
 
 }
 
 // Find the idx'th floating-point argument similar to above.
 int64_t InlineAttempt::FPArgIdxToArgIdx(int64_t idx) {
-  
-  for(unsigned i = F.getFunctionType()->getNumParams(); i < Callers[0]->getNumArgOperands(); ++i) {
-
-    ImmutableCallSite ICS(Callers[0]->invar->I);
-
-    Type* T = ICS.getArgument(i)->getType();
-    if(T->isPointerTy() || T->isIntegerTy()) {
-
-      continue;
-
-    }
-    else if(T->isFloatingPointTy()) {
 
-      if(idx == 0)
-	return ImprovedVal::first_any_arg + (i - F.getFunctionType()->getNumParams());
-      else
-	--idx;
-
-    }
-    else {
-
-      release_assert(0 && "Unhandled vararg type");
-
-    }
+  if(varArgIdxsCaller != Callers[0])
+    buildVarArgIdxs();
 
+  if(idx < 0 || idx >= (int64_t)fpVarArgIdxs.size()) {
+    release_assert(varArgIdxsComplete && "Unhandled vararg type");
+    return ImprovedVal::not_va_arg;
   }
-
-  return ImprovedVal::not_va_arg;
+  return fpVarArgIdxs[idx];
 
 }
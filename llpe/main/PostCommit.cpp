@@ -10,15 +10,25 @@
 #include "llvm/Analysis/LLPE.h"
 
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
 
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/FunctionComparator.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 
+#include <map>
+
 using namespace llvm;
 
 static cl::opt<bool> SkipPostCommit("int-skip-post-commit");
+extern cl::opt<bool> VerboseNames;
 
 // These optimisations fold a committed residual-code function into a neater form.
 // We do this as we go because in certain cases it can dramatically reduce the amount
@@ -67,109 +77,93 @@ static BasicBlock* getChainNext(BasicBlock* BB) {
 
 }
 
-template<class T, class Callback> void postCommitOptimiseBlocks(T itstart, T itend, Callback& CB, Function::iterator& firstFailedBlock) {
+// Replace a phi that merges the same constant, argument or global on every edge with that value.
+// Instructions are left alone: a common incoming instruction need not dominate the phi if
+// any predecessor is unreachable.
+static bool foldUniformPHI(PHINode* PN) {
 
-  // Zap any instructions we've created that are trivially dead.
-  // TODO: improve DIE to catch more cases like this before synthesis, or adopt
-  // on-demand synthesis to similar effect.
+  Value* V = PN->hasConstantValue();
+  if((!V) || V == PN || isa<Instruction>(V))
+    return false;
 
-  std::vector<Instruction*> Del;
+  PN->replaceAllUsesWith(V);
+  return true;
 
-  for(T it = itstart; it != itend; ++it) {
+}
 
-    BasicBlock* BB = &*it;
-    for(BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE; ++II) {
+// Delete BB's trivially-dead instructions, including phis made dead by folding. Operands that die as a result
+// are deleted too, wherever they are, so a dead expression tree goes in one visit.
+static void deleteDeadInstructions(BasicBlock* BB) {
+
+  std::vector<Instruction*> Del;
 
-      if(isInstructionTriviallyDead(&*II, GlobalTLI))
-	Del.push_back(&*II);
+  for(BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE; ++II) {
 
-    }
+    if(PHINode* PN = dyn_cast<PHINode>(&*II))
+      foldUniformPHI(PN);
+
+    if(isInstructionTriviallyDead(&*II, GlobalTLI))
+      Del.push_back(&*II);
 
   }
 
+  // Nothing in Del has users, so deleting one can't delete another.
   for(std::vector<Instruction*>::iterator Delit = Del.begin(), Delend = Del.end(); Delit != Delend; ++Delit)
     DeleteDeadInstruction(*Delit);
 
-  Del.clear();
-
-  // Now coalesce any long chains of BBs.
+}
 
-  std::vector<std::vector<BasicBlock*> > Chains;
+// Clean up committed blocks in one sweep. Each chain of blocks with a single predecessor or successor is coalesced
+// when its first block is reached, merging forwards, each block into its predecessor, so that every instruction
+// is moved once: merging backwards into the chain's last block would re-splice the growing accumulated instruction
+// list at every step. Merging folds the single-entry phis left by commit. Dead code is then deleted from the
+// merged block, so each instruction is visited once whether or not its block was merged.
+template<class T, class Callback> void postCommitOptimiseBlocks(T itstart, T itend, Callback& CB, Function::iterator& firstFailedBlock) {
 
-  DenseSet<BasicBlock*> Seen;
+  uint32_t merged = 0;
 
   for(T it = itstart; it != itend; ++it) {
 
     BasicBlock* BB = &*it;
-    if(!Seen.insert(BB).second)
-      continue;
 
-    // Find chain start:
-    while(BasicBlock* PrevBB = getChainPrev(BB))
-      BB = PrevBB;
+    // Blocks within a chain are handled from its start.
+    if(getChainPrev(BB))
+      continue;
 
-    Seen.insert(BB);
+    CB.willReplace(BB);
 
-    Chains.resize(Chains.size() + 1);
-    std::vector<BasicBlock*>& Chain = Chains.back();
-    Chain.push_back(BB);
+    BasicBlock* Cur = BB;
+    while(1) {
 
-    while(BasicBlock* NextBB = getChainNext(BB)) {
-      Chain.push_back(NextBB);
-      Seen.insert(NextBB);
-      BB = NextBB;
-    }
+      BasicBlock* Next = getChainNext(Cur);
+      if(Next) {
 
-    if(Chain.size() == 1)
-      Chains.pop_back();
-    else {
+	if((++merged) % 10000 == 0)
+	  errs() << ".";
 
-      /*
-      errs() << "Chain: ";
+	// First failed block goes away; next one takes its place.
+	bool wasFirstFailed = Function::iterator(Next) == firstFailedBlock;
+	if(wasFirstFailed)
+	  ++firstFailedBlock;
 
-      for(std::vector<BasicBlock*>::iterator it = Chain.begin(), 
-	    itend = Chain.end(); it != itend; ++it) {
+	if(MergeBlockIntoPredecessor(Next))
+	  continue;
 
-	if(it != Chain.begin())
-	  errs() << ", ";
-	
-	errs() << (*it)->getName();
+	// If the merge is refused the chain simply continues from this block.
+	if(wasFirstFailed)
+	  --firstFailedBlock;
 
       }
-      
-      errs() << "\n";
-      */
 
-    }
-
-  }
-
-  // Merge each chain found
-
-  for(std::vector<std::vector<BasicBlock*> >::iterator chainit = Chains.begin(),
-	itend = Chains.end(); chainit != itend; ++chainit) {
-
-    std::vector<BasicBlock*>& Chain = *chainit;
-
-    BasicBlock* Start = Chain[0];
-    CB.willReplace(Start);
-
-    for(unsigned i = 1, ilim = Chain.size(); i != ilim; ++i) {
-
-      if(i != 0 && (i % 10000 == 0)) 
-	errs() << ".";
+      deleteDeadInstructions(Cur);
 
-      BasicBlock* PBB = Chain.back()->getSinglePredecessor();
-
-      // First failed block goes away; next one takes its place.
-      if(Function::iterator(PBB) == firstFailedBlock)
-	++firstFailedBlock;
-
-      MergeBasicBlockIntoOnlyPred(Chain.back());
+      if(!Next)
+	break;
+      Cur = Next;
 
     }
 
-    CB.replaced(Start, Chain.back());
+    CB.replaced(BB, BB);
 
   }
 
@@ -251,6 +245,10 @@ void InlineAttempt::postCommitOptimise() {
     return;
 
   if(CommitF) {
+
+    // Re-roll first, while the chains of blocks making up each peeled iteration are still distinct.
+    if(pass->rerollMinIterations)
+      rerollPeeledLoops();
     
     PCOFunctionCB CB;
     postCommitOptimiseBlocks(CommitF->begin(), CommitF->end(), CB, firstFailedBlock);
@@ -258,13 +256,9 @@ void InlineAttempt::postCommitOptimise() {
     // Now top-sort the blocks, excluding the failed blocks by annotating them 'visited' to start with.
     {
 
-      SmallSet<BasicBlock*, 8> Visited;
-      for(Function::iterator it = firstFailedBlock, itend = CommitF->end(); it != itend; ++it)
-	Visited.insert(&*it);
-
       BasicBlock* firstBlock = &CommitF->getEntryBlock();
       std::vector<BasicBlock*> Ordered;
-      createTopOrderingFrom(firstBlock, Ordered, Visited, 0, 0);
+      createTopOrderingFrom(firstBlock, Ordered, 0, firstFailedBlock);
       std::reverse(Ordered.begin(), Ordered.end());
 
       Function::BasicBlockListType& BBL = CommitF->getBasicBlockList();
@@ -293,3 +287,641 @@ void InlineAttempt::postCommitOptimise() {
   }
    
 }
+
+// Contexts analysed separately can still commit identical residual functions, for example when
+// their arguments differed in ways that turned out not to matter. Find these by structural hash
+// and comparison (as LLVM's MergeFunctions does) and redirect users of duplicates to one copy.
+// Only internal functions are candidates: the root function's clone is externally visible.
+void LLPEAnalysisPass::mergeIdenticalCommittedFunctions() {
+
+  GlobalNumberState GN;
+  DenseMap<uint64_t, SmallVector<Function*, 1> > Buckets;
+  SmallVector<Function*, 4> Kept;
+
+  for(SmallVector<Function*, 4>::iterator it = commitFunctions.begin(),
+	itend = commitFunctions.end(); it != itend; ++it) {
+
+    Function* F = *it;
+    if(F == RootIA->CommitF || !F->hasLocalLinkage() || F->isDeclaration()) {
+      Kept.push_back(F);
+      continue;
+    }
+
+    SmallVector<Function*, 1>& Bucket = Buckets[FunctionComparator::functionHash(*F)];
+    Function* Same = 0;
+    for(SmallVector<Function*, 1>::iterator bit = Bucket.begin(), bitend = Bucket.end(); bit != bitend && !Same; ++bit) {
+      if(FunctionComparator(*bit, F, &GN).compare() == 0)
+	Same = *bit;
+    }
+
+    if(!Same) {
+      Bucket.push_back(F);
+      Kept.push_back(F);
+      continue;
+    }
+
+    ++stats.mergedFunctions;
+    stats.mergedInstructions += F->getInstructionCount();
+
+    F->replaceAllUsesWith(Same);
+    F->eraseFromParent();
+
+  }
+
+  commitFunctions = Kept;
+
+  if(stats.mergedFunctions)
+    errs() << "Merged " << stats.mergedFunctions << " identical committed functions, saving " << stats.mergedInstructions << " instructions\n";
+
+}
+
+// Is every use of pointer V, an alloca or a pointer derived from it, one that only reads through it,
+// apart from the single write Writer?
+static bool onlyReadExceptBy(Value* V, Instruction* Writer, SmallVector<Instruction*, 4>& Lifetimes) {
+
+  for(Value::user_iterator it = V->user_begin(), itend = V->user_end(); it != itend; ++it) {
+
+    Instruction* I = dyn_cast<Instruction>(*it);
+    if(!I)
+      return false;
+
+    if(I == Writer)
+      continue;
+
+    if(LoadInst* LI = dyn_cast<LoadInst>(I)) {
+      if(LI->isVolatile())
+	return false;
+    }
+    else if(isa<BitCastInst>(I) || isa<GetElementPtrInst>(I)) {
+      if(!onlyReadExceptBy(I, Writer, Lifetimes))
+	return false;
+    }
+    else if(MemTransferInst* MTI = dyn_cast<MemTransferInst>(I)) {
+      // Copying out of the buffer is fine; into it is not.
+      if(MTI->isVolatile() || MTI->getRawDest() == V)
+	return false;
+    }
+    else if(IntrinsicInst* II = dyn_cast<IntrinsicInst>(I)) {
+      if(II->getIntrinsicID() != Intrinsic::lifetime_start && II->getIntrinsicID() != Intrinsic::lifetime_end)
+	return false;
+      Lifetimes.push_back(II);
+    }
+    else
+      return false;
+
+  }
+
+  return true;
+
+}
+
+// A program that reads a file into a stack buffer and then only parses it gets a memcpy from the
+// file's bytes (the global made by getFileBytesGlobal) into the buffer for each read commit resolved.
+// Where the buffer is an alloca that nothing else writes and whose address goes nowhere but loads, it
+// may as well be the global itself: point its uses there and drop the copy, so the specialised
+// program no longer copies its input at startup. Bytes past the end of the read, which the original
+// buffer left uninitialised, read as zero. Heap buffers are left as they are, as they must stay freeable.
+void LLPEAnalysisPass::redirectReadOnlyReadBuffers() {
+
+  for(std::vector<std::pair<WeakVH, GlobalVariable*> >::iterator it = committedReadCopies.begin(),
+	itend = committedReadCopies.end(); it != itend; ++it) {
+
+    MemCpyInst* Copy = cast_or_null<MemCpyInst>((Value*)it->first);
+    if(!Copy)
+      continue;
+
+    AllocaInst* AI = dyn_cast<AllocaInst>(Copy->getRawDest()->stripPointerCasts());
+    ConstantInt* ArraySize = AI ? dyn_cast<ConstantInt>(AI->getArraySize()) : 0;
+    ConstantInt* CopySize = dyn_cast<ConstantInt>(Copy->getLength());
+    if((!ArraySize) || (!CopySize) || Copy->getRawSource()->stripPointerCasts() != it->second)
+      continue;
+
+    uint64_t AllocSize = GlobalTD->getTypeAllocSize(AI->getAllocatedType()) * ArraySize->getZExtValue();
+    if(CopySize->getZExtValue() > AllocSize)
+      continue;
+
+    // The copy's destination may be a cast of the alloca: the copy is the one write allowed.
+    SmallVector<Instruction*, 4> Lifetimes;
+    if(!onlyReadExceptBy(AI, Copy, Lifetimes))
+      continue;
+
+    // The read's bytes, padded to the buffer's size:
+    GlobalVariable* Bytes = it->second;
+    Constant* Init = Bytes->getInitializer();
+    uint64_t ReadSize = CopySize->getZExtValue();
+    GlobalVariable* Target;
+
+    if(AllocSize == GlobalTD->getTypeAllocSize(Init->getType()) && ReadSize == AllocSize) {
+      Target = Bytes;
+    }
+    else {
+
+      LLVMContext& Ctx = Init->getContext();
+      ArrayType* PaddedTy = ArrayType::get(Type::getInt8Ty(Ctx), AllocSize);
+      Constant* PaddedInit;
+      if(ConstantDataSequential* CDS = dyn_cast<ConstantDataSequential>(Init)) {
+	std::vector<uint8_t> Data(AllocSize, 0);
+	StringRef Raw = CDS->getRawDataValues();
+	std::copy(Raw.begin(), Raw.begin() + std::min((uint64_t)Raw.size(), ReadSize), Data.begin());
+	PaddedInit = ConstantDataArray::get(Ctx, ArrayRef<uint8_t>(Data));
+      }
+      else if(isa<ConstantAggregateZero>(Init))
+	PaddedInit = ConstantAggregateZero::get(PaddedTy);
+      else
+	continue;
+
+      Target = new GlobalVariable(*AI->getModule(), PaddedTy, true, GlobalValue::InternalLinkage, PaddedInit, "");
+      Target->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+    }
+
+    Target->setAlignment(std::max(Target->getAlignment(), AI->getAlignment()));
+
+    for(SmallVector<Instruction*, 4>::iterator lit = Lifetimes.begin(), litend = Lifetimes.end(); lit != litend; ++lit)
+      (*lit)->eraseFromParent();
+
+    Copy->eraseFromParent();
+    AI->replaceAllUsesWith(ConstantExpr::getPointerCast(Target, AI->getType()));
+    AI->eraseFromParent();
+
+    ++stats.redirectedReadBuffers;
+    stats.redirectedReadBytes += ReadSize;
+
+  }
+
+  committedReadCopies.clear();
+
+}
+
+// Commit makes a constant global for each file read, memcpy source and check message it emits, and
+// the same bytes often come up in many contexts or loop iterations. Constants are uniqued, so globals
+// with identical contents have the same initialiser; keep one of each, as LLVM's ConstantMerge does.
+// Only internal constants whose address is insignificant (unnamed_addr) are candidates, which covers
+// those commit creates but not objects the program can see the address of, such as argv and environment
+// strings. The program's own globals are left alone, as the analysis may still describe them.
+void LLPEAnalysisPass::mergeIdenticalConstantGlobals(Module& M) {
+
+  DenseMap<std::pair<Constant*, unsigned>, GlobalVariable*> Canonical;
+
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend;) {
+
+    GlobalVariable* GV = &*(it++);
+    if((!GV->isConstant()) || (!GV->hasLocalLinkage()) || (!GV->hasGlobalUnnamedAddr()) ||
+       (!GV->hasInitializer()) || GV->hasSection() || GV->isThreadLocal() || GV->isExternallyInitialized() ||
+       shadowGlobalsIdx.count(GV))
+      continue;
+
+    GlobalVariable*& Same = Canonical[std::make_pair(GV->getInitializer(), GV->getAlignment())];
+    if(!Same) {
+      Same = GV;
+      continue;
+    }
+
+    ++stats.mergedConstantGlobals;
+    stats.mergedConstantBytes += GlobalTD->getTypeAllocSize(GV->getValueType());
+
+    GV->replaceAllUsesWith(Same);
+    GV->eraseFromParent();
+
+  }
+
+  if(stats.mergedConstantGlobals)
+    errs() << "Merged " << stats.mergedConstantGlobals << " identical constant globals, saving " << stats.mergedConstantBytes << " bytes\n";
+
+}
+
+// Each context's unspecialised blocks carry their own copy of the function's landing pads, and as
+// exception edges are never specialised, those copies are usually identical but for the values
+// reaching them from the specialised code. With -llpe-share-landing-pads, landing pad regions (the
+// blocks reachable from a pad) that match in this way are folded into one, with a phi in the kept pad
+// selecting the values that differ according to which invoke unwound there.
+
+// Give up on regions bigger than this: large ones rarely match.
+static const uint32_t MaxSharedPadRegion = 64;
+
+struct PadRegion {
+
+  BasicBlock* Pad;
+  std::vector<BasicBlock*> Blocks;
+  DenseMap<BasicBlock*, uint32_t> BlockIdx;
+  std::vector<Instruction*> Insts;
+  DenseMap<Instruction*, uint32_t> InstIdx;
+  // Set on regions that have been kept: a phi in Pad for each operand (instruction, operand index)
+  // that differed in a region folded into this one, and the value that operand originally had.
+  std::map<std::pair<uint32_t, uint32_t>, PHINode*> PadPhis;
+  DenseMap<PHINode*, Value*> PadPhiOrig;
+
+};
+
+// Find the blocks reachable from Pad, in breadth-first successor order. Only regions that are closed,
+// entered only by unwinding to Pad, can be shared: e.g. a catch that returns to normal control flow
+// leads into blocks that have other predecessors, as does the function's common return block.
+static bool getPadRegion(BasicBlock* Pad, PadRegion& R) {
+
+  if(!isa<LandingPadInst>(Pad->getFirstNonPHI()) || isa<PHINode>(Pad->begin()) || Pad->hasAddressTaken())
+    return false;
+
+  R.Pad = Pad;
+  R.BlockIdx[Pad] = 0;
+  R.Blocks.push_back(Pad);
+
+  for(uint32_t i = 0; i != R.Blocks.size(); ++i) {
+
+    if(R.Blocks.size() > MaxSharedPadRegion)
+      return false;
+
+    Instruction* TI = R.Blocks[i]->getTerminator();
+    for(unsigned j = 0, jlim = TI->getNumSuccessors(); j != jlim; ++j) {
+
+      BasicBlock* Succ = TI->getSuccessor(j);
+      if(Succ == Pad)
+	return false;
+      if(!R.BlockIdx.count(Succ)) {
+	R.BlockIdx[Succ] = R.Blocks.size();
+	R.Blocks.push_back(Succ);
+      }
+
+    }
+
+  }
+
+  for(uint32_t i = 1, ilim = R.Blocks.size(); i != ilim; ++i) {
+
+    BasicBlock* BB = R.Blocks[i];
+    if(BB->hasAddressTaken())
+      return false;
+    for(pred_iterator PI = pred_begin(BB), PE = pred_end(BB); PI != PE; ++PI) {
+      if(!R.BlockIdx.count(*PI))
+	return false;
+    }
+
+  }
+
+  for(pred_iterator PI = pred_begin(Pad), PE = pred_end(Pad); PI != PE; ++PI) {
+    if(R.BlockIdx.count(*PI) || !isa<InvokeInst>((*PI)->getTerminator()))
+      return false;
+  }
+
+  for(std::vector<BasicBlock*>::iterator it = R.Blocks.begin(), itend = R.Blocks.end(); it != itend; ++it) {
+    for(BasicBlock::iterator II = (*it)->begin(), IE = (*it)->end(); II != IE; ++II) {
+      R.InstIdx[&*II] = R.Insts.size();
+      R.Insts.push_back(&*II);
+    }
+  }
+
+  return true;
+
+}
+
+static uint64_t hashPadRegion(PadRegion& R) {
+
+  hash_code H = hash_combine(R.Blocks.size(), R.Insts.size());
+  for(std::vector<Instruction*>::iterator it = R.Insts.begin(), itend = R.Insts.end(); it != itend; ++it)
+    H = hash_combine(H, (*it)->getOpcode(), (*it)->getNumOperands());
+  return H;
+
+}
+
+// Does region B do the same as kept region A, up to values flowing in from outside? If so,
+// list the operands that differ in Differing.
+static bool padRegionsMatch(PadRegion& A, PadRegion& B, std::vector<std::pair<uint32_t, uint32_t> >& Differing) {
+
+  if(A.Blocks.size() != B.Blocks.size() || A.Insts.size() != B.Insts.size())
+    return false;
+
+  for(uint32_t i = 0, ilim = A.Blocks.size(); i != ilim; ++i) {
+    if(A.Blocks[i]->size() != B.Blocks[i]->size())
+      return false;
+  }
+
+  for(uint32_t i = 0, ilim = A.Insts.size(); i != ilim; ++i) {
+
+    Instruction* IA = A.Insts[i];
+    Instruction* IB = B.Insts[i];
+
+    if(!IA->isSameOperationAs(IB))
+      return false;
+
+    if(LandingPadInst* LA = dyn_cast<LandingPadInst>(IA)) {
+      if(LA->isCleanup() != cast<LandingPadInst>(IB)->isCleanup())
+	return false;
+    }
+
+    if(PHINode* PA = dyn_cast<PHINode>(IA)) {
+      PHINode* PB = cast<PHINode>(IB);
+      for(unsigned k = 0, klim = PA->getNumIncomingValues(); k != klim; ++k) {
+	if(A.BlockIdx.lookup(PA->getIncomingBlock(k)) != B.BlockIdx.lookup(PB->getIncomingBlock(k)))
+	  return false;
+      }
+    }
+
+    for(unsigned k = 0, klim = IA->getNumOperands(); k != klim; ++k) {
+
+      Value* VA = IA->getOperand(k);
+      Value* VB = IB->getOperand(k);
+
+      // Operands already selected by a phi take B's value whether or not it differs.
+      bool hasPhi = false;
+      if(PHINode* PN = dyn_cast<PHINode>(VA)) {
+	DenseMap<PHINode*, Value*>::iterator findit = A.PadPhiOrig.find(PN);
+	if(findit != A.PadPhiOrig.end()) {
+	  VA = findit->second;
+	  hasPhi = true;
+	}
+      }
+
+      if(BasicBlock* BA = dyn_cast<BasicBlock>(VA)) {
+	BasicBlock* BB = dyn_cast<BasicBlock>(VB);
+	if((!BB) || A.BlockIdx.lookup(BA) != B.BlockIdx.lookup(BB) || !B.BlockIdx.count(BB))
+	  return false;
+	continue;
+      }
+
+      Instruction* OpA = dyn_cast<Instruction>(VA);
+      Instruction* OpB = dyn_cast<Instruction>(VB);
+      bool inA = OpA && A.InstIdx.count(OpA);
+      bool inB = OpB && B.InstIdx.count(OpB);
+
+      if(inA || inB) {
+	if((!inA) || (!inB) || A.InstIdx[OpA] != B.InstIdx[OpB])
+	  return false;
+	continue;
+      }
+
+      if(VA == VB || hasPhi)
+	continue;
+
+      // Differing constants may be immediates (switch cases, struct indices, intrinsic arguments)
+      // that a phi can't stand in for; other types can't be phi'd at all.
+      if((isa<Constant>(VA) && isa<Constant>(VB)) || isa<MetadataAsValue>(VA) || isa<MetadataAsValue>(VB) ||
+	 VA->getType()->isTokenTy() || isa<IntrinsicInst>(IA) || isa<LandingPadInst>(IA))
+	return false;
+
+      Differing.push_back(std::make_pair(i, k));
+
+    }
+
+  }
+
+  return true;
+
+}
+
+// Redirect B's invokes to A's pad, selecting B's values there by phis, and delete B.
+static void foldPadRegion(PadRegion& A, PadRegion& B, std::vector<std::pair<uint32_t, uint32_t> >& Differing) {
+
+  std::vector<BasicBlock*> APreds(pred_begin(A.Pad), pred_end(A.Pad));
+  std::vector<BasicBlock*> BPreds(pred_begin(B.Pad), pred_end(B.Pad));
+
+  for(std::vector<std::pair<uint32_t, uint32_t> >::iterator it = Differing.begin(), itend = Differing.end(); it != itend; ++it) {
+
+    Instruction* UserI = A.Insts[it->first];
+    Value* Orig = UserI->getOperand(it->second);
+
+    PHINode* PN = PHINode::Create(Orig->getType(), APreds.size() + BPreds.size(), VerboseNames ? "padval" : "", &*A.Pad->begin());
+    for(std::vector<BasicBlock*>::iterator PI = APreds.begin(), PE = APreds.end(); PI != PE; ++PI)
+      PN->addIncoming(Orig, *PI);
+
+    UserI->setOperand(it->second, PN);
+    A.PadPhis[*it] = PN;
+    A.PadPhiOrig[PN] = Orig;
+
+  }
+
+  for(std::map<std::pair<uint32_t, uint32_t>, PHINode*>::iterator it = A.PadPhis.begin(), itend = A.PadPhis.end(); it != itend; ++it) {
+
+    Value* BVal = B.Insts[it->first.first]->getOperand(it->first.second);
+    for(std::vector<BasicBlock*>::iterator PI = BPreds.begin(), PE = BPreds.end(); PI != PE; ++PI)
+      it->second->addIncoming(BVal, *PI);
+
+  }
+
+  for(std::vector<BasicBlock*>::iterator PI = BPreds.begin(), PE = BPreds.end(); PI != PE; ++PI)
+    cast<InvokeInst>((*PI)->getTerminator())->setUnwindDest(A.Pad);
+
+  for(std::vector<BasicBlock*>::iterator it = B.Blocks.begin(), itend = B.Blocks.end(); it != itend; ++it)
+    (*it)->dropAllReferences();
+  for(std::vector<BasicBlock*>::iterator it = B.Blocks.begin(), itend = B.Blocks.end(); it != itend; ++it)
+    (*it)->eraseFromParent();
+
+}
+
+void LLPEAnalysisPass::shareIdenticalLandingPads() {
+
+  for(SmallVector<Function*, 4>::iterator it = commitFunctions.begin(),
+	itend = commitFunctions.end(); it != itend; ++it) {
+
+    std::vector<BasicBlock*> Pads;
+    for(Function::iterator BI = (*it)->begin(), BE = (*it)->end(); BI != BE; ++BI) {
+      if(BI->isLandingPad())
+	Pads.push_back(&*BI);
+    }
+
+    if(Pads.size() < 2)
+      continue;
+
+    // Owns the kept regions.
+    std::vector<PadRegion*> Kept;
+    DenseMap<uint64_t, SmallVector<PadRegion*, 1> > Buckets;
+
+    for(std::vector<BasicBlock*>::iterator PI = Pads.begin(), PE = Pads.end(); PI != PE; ++PI) {
+
+      PadRegion* R = new PadRegion();
+      if(!getPadRegion(*PI, *R)) {
+	delete R;
+	continue;
+      }
+
+      SmallVector<PadRegion*, 1>& Bucket = Buckets[hashPadRegion(*R)];
+      bool folded = false;
+
+      for(SmallVector<PadRegion*, 1>::iterator KI = Bucket.begin(), KE = Bucket.end(); KI != KE && !folded; ++KI) {
+
+	std::vector<std::pair<uint32_t, uint32_t> > Differing;
+	if(padRegionsMatch(**KI, *R, Differing)) {
+
+	  ++stats.sharedLandingPads;
+	  stats.sharedLandingPadBlocks += R->Blocks.size();
+	  foldPadRegion(**KI, *R, Differing);
+	  folded = true;
+
+	}
+
+      }
+
+      if(folded)
+	delete R;
+      else {
+	Bucket.push_back(R);
+	Kept.push_back(R);
+      }
+
+    }
+
+    for(std::vector<PadRegion*>::iterator KI = Kept.begin(), KE = Kept.end(); KI != KE; ++KI)
+      delete *KI;
+
+  }
+
+  if(stats.sharedLandingPads)
+    errs() << "Shared " << stats.sharedLandingPads << " identical landing pad regions, removing " << stats.sharedLandingPadBlocks << " blocks\n";
+
+}
+
+// With -llpe-count-failures, give every edge from specialised to unspecialised code a counter,
+// so that we can see in production how often each check fails. Counter k lives in __llpe_fail_counters,
+// in section llpe_fail_counts, and __llpe_fail_sites[k] names its edge. A constructor hands both
+// to llpe_fail_counts_register (from runtime/failcounts.c), which dumps them at exit, or on demand.
+// Unwind edges are left alone, as their targets must begin with a landing pad.
+void LLPEAnalysisPass::instrumentFailurePaths() {
+
+  DenseSet<BasicBlock*> FailedBlocks;
+  for(std::vector<WeakVH>::iterator it = failedBlockHandles.begin(), itend = failedBlockHandles.end(); it != itend; ++it) {
+    if(*it)
+      FailedBlocks.insert(cast<BasicBlock>(*it));
+  }
+
+  std::vector<std::pair<Instruction*, unsigned> > Edges;
+
+  for(SmallVector<Function*, 4>::iterator it = commitFunctions.begin(),
+	itend = commitFunctions.end(); it != itend; ++it) {
+
+    for(Function::iterator BI = (*it)->begin(), BE = (*it)->end(); BI != BE; ++BI) {
+
+      BasicBlock* BB = &*BI;
+      if(FailedBlocks.count(BB))
+	continue;
+
+      Instruction* TI = BB->getTerminator();
+      if(!TI)
+	continue;
+
+      for(unsigned i = 0, ilim = TI->getNumSuccessors(); i != ilim; ++i) {
+
+	BasicBlock* Succ = TI->getSuccessor(i);
+	if(FailedBlocks.count(Succ) && !Succ->isEHPad() && !(isa<InvokeInst>(TI) && i == 1))
+	  Edges.push_back(std::make_pair(TI, i));
+
+      }
+
+    }
+
+  }
+
+  if(Edges.empty())
+    return;
+
+  Module& M = *getGlobalModule();
+  LLVMContext& Ctx = M.getContext();
+  Type* Int32 = Type::getInt32Ty(Ctx);
+  Type* Int64 = Type::getInt64Ty(Ctx);
+  Type* Int8Ptr = Type::getInt8PtrTy(Ctx);
+
+  ArrayType* CountersTy = ArrayType::get(Int64, Edges.size());
+  GlobalVariable* Counters = new GlobalVariable(M, CountersTy, false, GlobalValue::InternalLinkage,
+						Constant::getNullValue(CountersTy), "__llpe_fail_counters");
+  Counters->setSection("llpe_fail_counts");
+
+  std::vector<Constant*> SiteNames;
+
+  for(uint32_t k = 0, klim = Edges.size(); k != klim; ++k) {
+
+    Instruction* TI = Edges[k].first;
+    unsigned SuccIdx = Edges[k].second;
+    BasicBlock* BB = TI->getParent();
+    BasicBlock* Succ = TI->getSuccessor(SuccIdx);
+
+    BasicBlock* CountBB = BasicBlock::Create(Ctx, VerboseNames ? "failcount" : "", BB->getParent(), Succ);
+
+    Constant* Idxs[] = { ConstantInt::get(Int64, 0), ConstantInt::get(Int64, k) };
+    Constant* CounterPtr = ConstantExpr::getInBoundsGetElementPtr(CountersTy, Counters, Idxs);
+    new AtomicRMWInst(AtomicRMWInst::Add, CounterPtr, ConstantInt::get(Int64, 1), AtomicOrdering::Monotonic, SyncScope::System, CountBB);
+    BranchInst::Create(Succ, CountBB);
+
+    TI->setSuccessor(SuccIdx, CountBB);
+    for(BasicBlock::iterator II = Succ->begin(); PHINode* PN = dyn_cast<PHINode>(&*II); ++II)
+      PN->setIncomingBlock(PN->getBasicBlockIndex(BB), CountBB);
+
+    std::string Name;
+    {
+      raw_string_ostream RSO(Name);
+      RSO << BB->getParent()->getName() << ": " << BB->getName() << " -> " << Succ->getName();
+    }
+
+    Constant* NameData = ConstantDataArray::getString(Ctx, Name);
+    GlobalVariable* NameGV = new GlobalVariable(M, NameData->getType(), true, GlobalValue::PrivateLinkage, NameData, "");
+    NameGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    SiteNames.push_back(ConstantExpr::getPointerCast(NameGV, Int8Ptr));
+
+  }
+
+  ArrayType* SitesTy = ArrayType::get(Int8Ptr, SiteNames.size());
+  GlobalVariable* Sites = new GlobalVariable(M, SitesTy, true, GlobalValue::InternalLinkage,
+					     ConstantArray::get(SitesTy, SiteNames), "__llpe_fail_sites");
+
+  Type* RegisterArgs[] = { PointerType::getUnqual(Int64), PointerType::getUnqual(Int8Ptr), Int32 };
+  FunctionType* RegisterTy = FunctionType::get(Type::getVoidTy(Ctx), RegisterArgs, false);
+  Constant* Register = cast<Constant>(M.getOrInsertFunction("llpe_fail_counts_register", RegisterTy).getCallee());
+
+  Function* Init = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false), GlobalValue::InternalLinkage,
+				    "__llpe_fail_counts_init", &M);
+  BasicBlock* InitBB = BasicBlock::Create(Ctx, "", Init);
+  Constant* Zeroes[] = { ConstantInt::get(Int64, 0), ConstantInt::get(Int64, 0) };
+  Value* Args[] = { ConstantExpr::getInBoundsGetElementPtr(CountersTy, Counters, Zeroes),
+		    ConstantExpr::getInBoundsGetElementPtr(SitesTy, Sites, Zeroes),
+		    ConstantInt::get(Int32, SiteNames.size()) };
+  CallInst::Create(Register, Args, "", InitBB);
+  ReturnInst::Create(Ctx, InitBB);
+
+  appendToGlobalCtors(M, Init, 0);
+
+  stats.failureCounterSites = Edges.size();
+  errs() << "Added failure counters to " << Edges.size() << " specialised-to-unspecialised edges\n";
+
+}
+
+// Defined globals other than the root lose their external linkage, so that the outputs of several runs,
+// differing only in the input they were specialised for, can be linked into one module without clashing.
+static void internaliseForVariant(GlobalValue* GV) {
+
+  if(GV->isDeclaration() || GV->hasLocalLinkage() || GV->getName().startswith("llvm."))
+    return;
+
+  GV->setLinkage(GlobalValue::InternalLinkage);
+  GV->setVisibility(GlobalValue::DefaultVisibility);
+  if(GlobalObject* GO = dyn_cast<GlobalObject>(GV))
+    GO->setComdat(0);
+
+}
+
+// With -llpe-export-variant=tag, the specialised root is renamed root.variant.tag and is the only symbol
+// this module still exports. scripts/link-variants.py links several such modules together with a new root
+// that picks a variant by the digest of its input file at startup.
+void LLPEAnalysisPass::exportAsVariant() {
+
+  Module& M = *getGlobalModule();
+  Function* Root = RootIA->CommitF;
+
+  std::string VariantName;
+  {
+    raw_string_ostream RSO(VariantName);
+    RSO << Root->getName() << ".variant." << exportVariant;
+  }
+
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+    if(&*it != Root)
+      internaliseForVariant(&*it);
+  }
+
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it)
+    internaliseForVariant(&*it);
+
+  for(Module::alias_iterator it = M.alias_begin(), itend = M.alias_end(); it != itend; ++it)
+    internaliseForVariant(&*it);
+
+  Root->setName(VariantName);
+  Root->setLinkage(GlobalValue::ExternalLinkage);
+
+  errs() << "Exported specialised root as " << VariantName << "\n";
+
+}
@@ -7,13 +7,14 @@
 //
 //===----------------------------------------------------------------------===//
 
-// Implement a cache of textual representations of instructions, mostly for debug mode.
+// Implement a bounded cache of textual representations of instructions, mostly for debug mode.
 // Otherwise the operator<< implementation completely indexes the bitcode file on every run.
 // This is also punitively expensive for the DOT output code.
 
-// Per default this is implemented simply using LLVM's basic operator<<(Instruction&). To get an efficient
-// implementation see utils/fast-printing.patch which must be applied to VMCore/AsmWriter.cpp and 
-// LLVM_EFFICIENT_PRINTING defined to disable the simple implementations below.
+// Printing a value on its own builds a fresh slot tracker, numbering every unnamed global and, for an
+// instruction or argument, everything in its function. The PersistPrinter below keeps one
+// ModuleSlotTracker for the whole run instead, and we print a function or the globals all at once,
+// so that each function is numbered once per visit rather than once per value.
 
 #include "llvm/Analysis/LLPE.h"
 
@@ -21,40 +22,109 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/FormattedStream.h"
 
 using namespace llvm;
 
-// Build a mapping from every Instruction in F to its text representation, perhaps the brief version.
-DenseMap<const Value*, std::string>& LLPEAnalysisPass::getFunctionCache(const Function* F, bool brief) {
+namespace llvm {
+
+class PersistPrinter {
+
+  const Module* M;
+  ModuleSlotTracker* Slots;
+  // Commit adds functions and globals, which the module-level numbering must then be redone to include.
+  size_t nFunctions;
+  size_t nGlobals;
+
+ public:
+
+ PersistPrinter(const Module* _M) : M(_M), Slots(0), nFunctions(0), nGlobals(0) { }
+  ~PersistPrinter() { delete Slots; }
+
+  ModuleSlotTracker& getSlots() {
+
+    if(Slots && nFunctions == M->size() && nGlobals == M->global_size())
+      return *Slots;
+
+    delete Slots;
+    Slots = new ModuleSlotTracker(M, /* ShouldInitializeAllMetadata = */ false);
+    nFunctions = M->size();
+    nGlobals = M->global_size();
+    return *Slots;
 
-  DenseMap<const Function*, DenseMap<const Value*, std::string>* >& Map = brief ? briefFunctionTextCache : functionTextCache;
-  DenseMap<const Function*, DenseMap<const Value*, std::string>* >::iterator FI = Map.find(F);
-  
-  if(FI == Map.end()) {
-    DenseMap<const Value*, std::string>* FullMap = functionTextCache[F] = new DenseMap<const Value*, std::string>();
-    DenseMap<const Value*, std::string>* BriefMap = briefFunctionTextCache[F] = new DenseMap<const Value*, std::string>();
-    getInstructionsText(persistPrinter, F, *FullMap, *BriefMap);
-    return brief ? *BriefMap : *FullMap;
-  }
-  else {
-    return *(FI->second);
   }
 
+};
+
 }
 
-// Build a mapping for every GlobalValue to its text representation.
-void LLPEAnalysisPass::populateGVCaches(const Module* M) {
-  
-  getGVText(persistPrinter, M, GVCache, GVCacheBrief);
+// Remember V's text representations, evicting the least recently used entry if the cache is full.
+void LLPEAnalysisPass::addCachedText(const Value* V, const std::string& full, const std::string& brief) {
+
+  if(valueTextCache.count(V))
+    return;
+
+  if(valueTextCacheLimit && valueTextLRU.size() >= valueTextCacheLimit) {
+
+    valueTextCache.erase(valueTextLRU.back().V);
+    valueTextLRU.pop_back();
+
+  }
+
+  CachedValueText New;
+  valueTextLRU.push_front(New);
+  CachedValueText& Entry = valueTextLRU.front();
+  Entry.V = V;
+  Entry.full = full;
+  Entry.brief = brief;
+  valueTextCache[V] = valueTextLRU.begin();
 
 }
 
-DenseMap<const GlobalVariable*, std::string>& LLPEAnalysisPass::getGVCache(bool brief) {
+// Find or create the text representations of V, an Instruction, Argument or GlobalVariable.
+LLPEAnalysisPass::CachedValueText& LLPEAnalysisPass::getCachedText(const Value* V) {
+
+  DenseMap<const Value*, ValueTextList::iterator>::iterator findit = valueTextCache.find(V);
+  if(findit != valueTextCache.end()) {
+
+    valueTextLRU.splice(valueTextLRU.begin(), valueTextLRU, findit->second);
+    return *findit->second;
+
+  }
+
+  // Numbering a function's values is the expensive part, so describe the whole function
+  // (or all the reachable globals) while we're at it.
+  if(const GlobalVariable* GV = dyn_cast<GlobalVariable>(V)) {
+
+    DenseMap<const GlobalVariable*, std::string> GVMap, BriefGVMap;
+    getGVText(persistPrinter, GV->getParent(), GV, GVMap, BriefGVMap);
+    for(DenseMap<const GlobalVariable*, std::string>::iterator it = GVMap.begin(), itend = GVMap.end(); it != itend; ++it)
+      if(it->first != GV)
+	addCachedText(it->first, it->second, BriefGVMap[it->first]);
+    addCachedText(GV, GVMap[GV], BriefGVMap[GV]);
+
+  }
+  else {
+
+    const Function* F;
+    if(const Instruction* I = dyn_cast<Instruction>(V))
+      F = I->getParent()->getParent();
+    else
+      F = cast<Argument>(V)->getParent();
 
-  return brief ? GVCacheBrief : GVCache;
+    DenseMap<const Value*, std::string> IMap, BriefMap;
+    getInstructionsText(persistPrinter, F, IMap, BriefMap);
+    for(DenseMap<const Value*, std::string>::iterator it = IMap.begin(), itend = IMap.end(); it != itend; ++it)
+      if(it->first != V)
+	addCachedText(it->first, it->second, BriefMap[it->first]);
+    addCachedText(V, IMap[V], BriefMap[V]);
+
+  }
+
+  return valueTextLRU.front();
 
 }
 
@@ -63,23 +133,10 @@ void LLPEAnalysisPass::printValue(raw_ostream& ROS, const Value* V, bool brief)
 
   if(!cacheDisabled) {
 
-    if(isa<Instruction>(V) || isa<Argument>(V)) {
-
-      const Function* VF;
-      if(const Instruction* I = dyn_cast<Instruction>(V))
-	VF = I->getParent()->getParent();
-      else
-	VF = cast<Argument>(V)->getParent();
+    if(isa<Instruction>(V) || isa<Argument>(V) || isa<GlobalVariable>(V)) {
 
-      DenseMap<const Value*, std::string>& Map = getFunctionCache(VF, brief);
-      ROS << Map[V];
-      return;
-
-    }
-    else if(const GlobalVariable* GV = dyn_cast<GlobalVariable>(V)) {
-
-      DenseMap<const GlobalVariable*, std::string>& Map = getGVCache(brief);
-      ROS << Map[GV];
+      CachedValueText& Entry = getCachedText(V);
+      ROS << (brief ? Entry.brief : Entry.full);
       return;
 
     }
@@ -99,7 +156,10 @@ void LLPEAnalysisPass::printValue(raw_ostream& ROS, const Value* V, bool brief)
 
   }
 
-  ROS << *V;
+  if(persistPrinter)
+    V->print(ROS, persistPrinter->getSlots());
+  else
+    ROS << *V;
 
 }
 
@@ -151,8 +211,65 @@ void LLPEAnalysisPass::disableValueCache() {
 
 // Print a dead-store-elimination map entry, which indicates whether or not a particular store instruction
 // is needed, has been committed as a concrete instruction, etc.
+static void printTrackedStore(raw_ostream& RSO, TrackedStore* TS, bool brief) {
+
+  if(!TS)
+    RSO << "NULL!";
+  else if(TS->isNeeded) {
+    RSO << "[needed]";
+  }
+  else {
+    if(!TS->isCommitted)
+      RSO << itcache(TS->I, brief);
+    else if(!TS->committedInsts)
+      RSO << "[committed-unknown]";
+    else {
+      RSO << "[committed] ";
+      for(uint32_t i = 0, ilim = TS->nCommittedInsts; i != ilim; ++i) {
+	if(i != 0)
+	  RSO << ", ";
+	RSO << (*(TS->committedInsts[i]));
+      }
+      RSO << " in block " << cast<Instruction>((Value*)TS->committedInsts[0])->getParent()->getName();	  
+    }
+    RSO << " (" << TS->outstandingBytes << ")";
+  }
+
+}
+
 void DSEMapPointer::print(raw_ostream& RSO, bool brief) {
 
+  if(S) {
+
+    // Small maps are printed per writer rather than per byte range.
+    for(uint32_t i = 0, ilim = S->Entries.size(); i != ilim; ++i) {
+
+      DSESmallMapEntry& E = S->Entries[i];
+      printTrackedStore(RSO, E.Store, brief);
+      RSO << ": {";
+
+      for(uint32_t j = 0; j != DSESMALLMAPSIZE;) {
+
+	if(!(E.Bytes[j / 64] & (1ULL << (j % 64)))) {
+	  ++j;
+	  continue;
+	}
+
+	uint32_t runStart = j;
+	while(j != DSESMALLMAPSIZE && (E.Bytes[j / 64] & (1ULL << (j % 64))))
+	  ++j;
+	RSO << " " << runStart << "-" << j;
+
+      }
+
+      RSO << " }\n";
+
+    }
+
+    return;
+
+  }
+
   if(!M)
     return;
 
@@ -163,31 +280,9 @@ void DSEMapPointer::print(raw_ostream& RSO, bool brief) {
 
     for(DSEMapEntry::const_iterator eit = entry.begin(), eend = entry.end(); eit != eend; ++eit) {
 
-      TrackedStore* TS = *eit;
-
       if(eit != entry.begin())
 	RSO << ", ";
-      if(!TS)
-	RSO << "NULL!";
-      else if(TS->isNeeded) {
-	RSO << "[needed]";
-      }
-      else {
-	if(!TS->isCommitted)
-	  RSO << itcache(TS->I, brief);
-	else if(!TS->committedInsts)
-	  RSO << "[committed-unknown]";
-	else {
-	  RSO << "[committed] ";
-	  for(uint32_t i = 0, ilim = TS->nCommittedInsts; i != ilim; ++i) {
-	    if(i != 0)
-	      RSO << ", ";
-	    RSO << (*(TS->committedInsts[i]));
-	  }
-	  RSO << " in block " << cast<Instruction>((Value*)TS->committedInsts[0])->getParent()->getName();	  
-	}
-	RSO << " (" << TS->outstandingBytes << ")";
-      }
+      printTrackedStore(RSO, *eit, brief);
 
     }
 
@@ -208,15 +303,14 @@ namespace llvm {
 
 }
 
-#ifndef LLVM_EFFICIENT_PRINTING
+PersistPrinter* llvm::getPersistPrinter(Module* M) { return new PersistPrinter(M); }
 
-// Simple implementations of instruction printing if the LLVM core assembly printer
-// hasn't been patched to make this much more efficient. This becomes a problem
-// once we get beyond hundreds of instructions.
+// Print each of IF's instructions and arguments in full and briefly (omitting
+// the right-hand side of a non-void instruction).
+void llvm::getInstructionsText(PersistPrinter* PP, const Function* IF, DenseMap<const Value*, std::string>& IMap, DenseMap<const Value*, std::string>& BriefMap) {
 
-PersistPrinter* llvm::getPersistPrinter(Module*) { return new PersistPrinter(); }
-
-void llvm::getInstructionsText(PersistPrinter*, const Function* IF, DenseMap<const Value*, std::string>& IMap, DenseMap<const Value*, std::string>& BriefMap) {
+  ModuleSlotTracker& Slots = PP->getSlots();
+  Slots.incorporateFunction(*IF);
 
   for(Function::const_iterator FI = IF->begin(), FE = IF->end(); FI != FE; ++FI) {
 
@@ -227,7 +321,7 @@ void llvm::getInstructionsText(PersistPrinter*, const Function* IF, DenseMap<con
       std::string instText;
       {
 	raw_string_ostream RSO(instText);
-	RSO << *I;
+	I->print(RSO, Slots);
       }
 
       IMap[I] = instText;
@@ -245,7 +339,7 @@ void llvm::getInstructionsText(PersistPrinter*, const Function* IF, DenseMap<con
     std::string argText;
     {
       raw_string_ostream RSO(argText);
-      RSO << *AI;
+      AI->print(RSO, Slots);
     }
 
     IMap[(const Argument*)AI] = argText;
@@ -255,14 +349,20 @@ void llvm::getInstructionsText(PersistPrinter*, const Function* IF, DenseMap<con
 
 }
 
-void llvm::getGVText(PersistPrinter*, const Module* M, DenseMap<const GlobalVariable*, std::string>& GVMap, DenseMap<const GlobalVariable*, std::string>& BriefGVMap) {
+void llvm::getGVText(PersistPrinter* PP, const Module* M, const GlobalVariable* Want, DenseMap<const GlobalVariable*, std::string>& GVMap, DenseMap<const GlobalVariable*, std::string>& BriefGVMap) {
+
+  ModuleSlotTracker& Slots = PP->getSlots();
 
   for(Module::const_global_iterator it = M->global_begin(), itend = M->global_end(); it != itend; ++it) {
 
+    // Only the root's reachable globals are likely to be asked about.
+    if(!(Want == &*it || GlobalIHP->isReachableGlobal(&*it)))
+      continue;
+
     std::string GVText;
     {
       raw_string_ostream RSO(GVText);
-      RSO << *it;
+      it->print(RSO, Slots);
     }
 
     GVMap[&*it] = GVText;
@@ -271,5 +371,3 @@ void llvm::getGVText(PersistPrinter*, const Module* M, DenseMap<const GlobalVari
   }
 
 }
-
-#endif
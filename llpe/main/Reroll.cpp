@@ -0,0 +1,601 @@
+//===-- Reroll.cpp --------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+extern cl::opt<bool> VerboseNames;
+
+// Re-rolling of peeled loops (see -llpe-reroll-min-iterations). Once a context has been committed
+// to its own function, look for runs of consecutive iterations of a peeled loop whose residual code
+// is the same apart from values carried from the previous iteration and constants that advance by
+// a fixed step each time, and replace each run with a single copy of the body in a counted loop.
+// This runs while the iterations' shadow blocks still exist, since they say where each iteration
+// begins; iterations inlined into a parent with no residual function of its own have been freed
+// by the time their blocks reach one, so only loops in contexts committed out of line are treated.
+
+// How an operand of an instruction in the re-rolled body varies between iterations.
+enum RerollOperandKind {
+
+  ROK_INVARIANT, // The same value every time
+  ROK_LOCAL, // An instruction earlier in the same iteration
+  ROK_CARRIED, // An instruction in the previous iteration (or some initial value, the first time)
+  ROK_INT_STEP, // An integer constant advancing by a fixed step
+  ROK_PTR_STEP // A constant offset from a global advancing by a fixed step
+
+};
+
+struct RerollOperand {
+
+  RerollOperandKind Kind;
+  // LOCAL, CARRIED: position of the instruction within its iteration.
+  uint32_t Pos;
+  // INVARIANT: the value. CARRIED: the initial value. PTR_STEP: the global.
+  Value* V;
+  // INT_STEP, PTR_STEP: the value or offset in the first iteration, and the step.
+  APInt Start;
+  APInt Step;
+  // CARRIED, INT_STEP, PTR_STEP: the phi giving this operand (or its offset) in the new loop.
+  PHINode* PN;
+
+RerollOperand() : Kind(ROK_INVARIANT), Pos(0), V(0), PN(0) {}
+
+};
+
+struct RerollIteration {
+
+  std::vector<BasicBlock*> Blocks;
+  std::vector<Instruction*> Insts;
+
+};
+
+// Map from instructions in the candidate run to (iteration within the run, position).
+typedef DenseMap<Instruction*, std::pair<uint32_t, uint32_t> > RerollPositions;
+
+static BasicBlock* getIterationHead(PeelIteration* PI) {
+
+  ShadowBB* BB = PI->getBB(PI->L->headerIdx);
+  if((!BB) || BB->committedBlocks.empty())
+    return 0;
+  return BB->committedBlocks[0].specBlock;
+
+}
+
+// Placeholders awaiting a pointer to an object that isn't committed yet (see addPatchRequest)
+// can't be copied, as only the original will be patched.
+static bool isPatchPlaceholder(Instruction* I) {
+
+  SelectInst* SI = dyn_cast<SelectInst>(I);
+  return SI && (isa<UndefValue>(SI->getTrueValue()) || isa<UndefValue>(SI->getFalseValue()));
+
+}
+
+// Collect the blocks and instructions of the iteration running from Head to NextHead, which must
+// form a straight line. Trivially dead instructions and debug intrinsics are left out: they are
+// deleted along with the iteration rather than being copied. Fails if the iteration contains
+// anything the re-rolled loop couldn't simply repeat.
+static bool getRerollIteration(BasicBlock* Head, BasicBlock* NextHead, RerollIteration& Out) {
+
+  BasicBlock* BB = Head;
+
+  while(BB != NextHead) {
+
+    if(BB->hasAddressTaken() || (!BB->getSinglePredecessor()) || BB == &BB->getParent()->getEntryBlock())
+      return false;
+
+    FoldSingleEntryPHINodes(BB);
+
+    BranchInst* BI = dyn_cast<BranchInst>(BB->getTerminator());
+    if((!BI) || BI->isConditional())
+      return false;
+
+    for(BasicBlock::iterator II = BB->begin(), IE = BasicBlock::iterator(BI); II != IE; ++II) {
+
+      Instruction* I = &*II;
+      if(isa<DbgInfoIntrinsic>(I) || isInstructionTriviallyDead(I, GlobalTLI))
+	continue;
+
+      // Committed allocations and FDs may be referred to by code committed later.
+      if(isa<PHINode>(I) || isa<AllocaInst>(I) || I->isEHPad() || isPatchPlaceholder(I) ||
+	 GlobalIHP->committedHeapAllocations.count(I) || GlobalIHP->committedFDs.count(I))
+	return false;
+
+      Out.Insts.push_back(I);
+
+    }
+
+    Out.Blocks.push_back(BB);
+    BB = BI->getSuccessor(0);
+    if(BB == Head)
+      return false;
+
+  }
+
+  if(Out.Blocks.empty() || NextHead->getSinglePredecessor() != Out.Blocks.back())
+    return false;
+
+  FoldSingleEntryPHINodes(NextHead);
+  return true;
+
+}
+
+static bool getRerollPosition(RerollPositions& Positions, Value* V, uint32_t& Iter, uint32_t& Pos) {
+
+  Instruction* I = dyn_cast<Instruction>(V);
+  if(!I)
+    return false;
+
+  RerollPositions::iterator findit = Positions.find(I);
+  if(findit == Positions.end())
+    return false;
+
+  Iter = findit->second.first;
+  Pos = findit->second.second;
+  return true;
+
+}
+
+// Decompose a constant pointer into a global plus a constant offset.
+static bool getPointerStep(Value* V, Value*& Base, APInt& Offset) {
+
+  if((!isa<Constant>(V)) || !V->getType()->isPointerTy())
+    return false;
+
+  unsigned AS = V->getType()->getPointerAddressSpace();
+  Offset = APInt(GlobalTD->getIndexSizeInBits(AS), 0);
+  V = V->stripPointerCasts();
+
+  if(GEPOperator* GEP = dyn_cast<GEPOperator>(V)) {
+
+    if(GEP->getPointerAddressSpace() != AS || !GEP->accumulateConstantOffset(*GlobalTD, Offset))
+      return false;
+    V = GEP->getPointerOperand()->stripPointerCasts();
+
+  }
+
+  if(V->getType()->getPointerAddressSpace() != AS)
+    return false;
+
+  Base = V;
+  return isa<GlobalValue>(V);
+
+}
+
+// Whether operand OpIdx of I may be replaced by a value computed in the loop, rather than
+// being required to be a constant (e.g. an intrinsic's immediate argument or a struct index).
+static bool canVaryOperand(Instruction* I, uint32_t OpIdx) {
+
+  if(isa<IntrinsicInst>(I))
+    return false;
+
+  if(CallInst* CI = dyn_cast<CallInst>(I))
+    return OpIdx < CI->arg_size();
+
+  if(GetElementPtrInst* GEP = dyn_cast<GetElementPtrInst>(I)) {
+
+    if(OpIdx == 0)
+      return true;
+
+    gep_type_iterator GTI = gep_type_begin(GEP);
+    std::advance(GTI, OpIdx - 1);
+    return !GTI.isStruct();
+
+  }
+
+  return isa<BinaryOperator>(I) || isa<CmpInst>(I) || isa<CastInst>(I) ||
+    isa<LoadInst>(I) || isa<StoreInst>(I) || isa<SelectInst>(I);
+
+}
+
+// Given corresponding operands of the first two iterations of a run, decide how that operand varies.
+static bool classifyRerollOperand(Value* Prev, Value* Cur, bool canVary, RerollPositions& Positions, RerollOperand& Out) {
+
+  uint32_t PrevIter, PrevPos, CurIter, CurPos;
+  bool prevInRun = getRerollPosition(Positions, Prev, PrevIter, PrevPos);
+  bool curInRun = getRerollPosition(Positions, Cur, CurIter, CurPos);
+
+  if(curInRun) {
+
+    if(CurIter == 1 && prevInRun && PrevIter == 0 && PrevPos == CurPos) {
+      Out.Kind = ROK_LOCAL;
+      Out.Pos = CurPos;
+      return true;
+    }
+
+    // The first iteration's operand must come from before the run.
+    if(CurIter == 0 && !prevInRun) {
+      Out.Kind = ROK_CARRIED;
+      Out.Pos = CurPos;
+      Out.V = Prev;
+      return true;
+    }
+
+    return false;
+
+  }
+
+  if(prevInRun)
+    return false;
+
+  if(Prev == Cur) {
+    Out.Kind = ROK_INVARIANT;
+    Out.V = Prev;
+    return true;
+  }
+
+  if(!canVary)
+    return false;
+
+  ConstantInt* PrevCI = dyn_cast<ConstantInt>(Prev);
+  ConstantInt* CurCI = dyn_cast<ConstantInt>(Cur);
+  if(PrevCI && CurCI && PrevCI->getType() == CurCI->getType()) {
+    Out.Kind = ROK_INT_STEP;
+    Out.Start = PrevCI->getValue();
+    Out.Step = CurCI->getValue() - PrevCI->getValue();
+    return true;
+  }
+
+  Value *PrevBase, *CurBase;
+  APInt PrevOffset, CurOffset;
+  if(Prev->getType() == Cur->getType() && getPointerStep(Prev, PrevBase, PrevOffset) &&
+     getPointerStep(Cur, CurBase, CurOffset) && PrevBase == CurBase) {
+    Out.Kind = ROK_PTR_STEP;
+    Out.V = PrevBase;
+    Out.Start = PrevOffset;
+    Out.Step = CurOffset - PrevOffset;
+    return true;
+  }
+
+  return false;
+
+}
+
+// Check Cur, an operand in iteration K of the run, varies as Op says it should.
+static bool matchRerollOperand(RerollOperand& Op, Value* Cur, uint32_t K, std::vector<RerollIteration>& Its) {
+
+  switch(Op.Kind) {
+
+  case ROK_INVARIANT:
+    return Cur == Op.V;
+  case ROK_LOCAL:
+    return Cur == Its[K].Insts[Op.Pos];
+  case ROK_CARRIED:
+    return Cur == Its[K - 1].Insts[Op.Pos];
+  case ROK_INT_STEP:
+  case ROK_PTR_STEP:
+    {
+      APInt Expect = Op.Step;
+      Expect *= K;
+      Expect += Op.Start;
+
+      if(Op.Kind == ROK_INT_STEP) {
+	ConstantInt* CI = dyn_cast<ConstantInt>(Cur);
+	return CI && CI->getValue() == Expect;
+      }
+
+      Value* Base;
+      APInt Offset;
+      return getPointerStep(Cur, Base, Offset) && Base == Op.V && Offset == Expect;
+    }
+
+  }
+
+  return false;
+
+}
+
+// Whether the loop can use one phi for both A and B.
+static bool canSharePHI(RerollOperand& A, RerollOperand& B) {
+
+  if(A.Kind != B.Kind)
+    return false;
+
+  if(A.Kind == ROK_CARRIED)
+    return A.Pos == B.Pos && A.V == B.V;
+
+  return A.V == B.V && A.Start.getBitWidth() == B.Start.getBitWidth() && A.Start == B.Start && A.Step == B.Step;
+
+}
+
+// Try to find a run of rerollable iterations beginning with iteration Start, given each iteration's
+// first block, and re-roll it if it's at least MinIters long. Returns the iteration following the longest
+// run that matched, and sets Rerolled if it was replaced.
+static uint32_t tryRerollFrom(std::vector<BasicBlock*>& Heads, uint32_t Start, uint32_t MinIters, bool& Rerolled) {
+
+  Rerolled = false;
+
+  std::vector<RerollIteration> Its;
+  RerollPositions Positions;
+  std::vector<std::vector<RerollOperand> > Slots;
+
+  uint32_t End = Start;
+
+  for(; End + 1 < Heads.size() && Heads[End] && Heads[End + 1]; ++End) {
+
+    uint32_t K = End - Start;
+    Its.resize(K + 1);
+    RerollIteration& It = Its.back();
+
+    if((!getRerollIteration(Heads[End], Heads[End + 1], It)) || (K != 0 && It.Insts.size() != Its[0].Insts.size())) {
+      Its.pop_back();
+      break;
+    }
+
+    for(uint32_t i = 0, ilim = It.Insts.size(); i != ilim; ++i)
+      Positions[It.Insts[i]] = std::make_pair(K, i);
+
+    if(K == 0)
+      continue;
+
+    if(K == 1)
+      Slots.resize(It.Insts.size());
+
+    bool Matched = true;
+
+    for(uint32_t i = 0, ilim = It.Insts.size(); i != ilim && Matched; ++i) {
+
+      Instruction* I = It.Insts[i];
+      Instruction* FirstI = Its[0].Insts[i];
+
+      if(!I->isSameOperationAs(FirstI)) {
+	Matched = false;
+	break;
+      }
+
+      if(K == 1)
+	Slots[i].resize(I->getNumOperands());
+
+      for(uint32_t j = 0, jlim = I->getNumOperands(); j != jlim && Matched; ++j) {
+
+	if(K == 1)
+	  Matched = classifyRerollOperand(FirstI->getOperand(j), I->getOperand(j), canVaryOperand(I, j), Positions, Slots[i][j]);
+	else
+	  Matched = matchRerollOperand(Slots[i][j], I->getOperand(j), K, Its);
+
+      }
+
+    }
+
+    if(!Matched) {
+      Its.pop_back();
+      break;
+    }
+
+  }
+
+  uint32_t nIters = Its.size();
+  if(nIters < MinIters)
+    return End;
+
+  // Require the only edge into the run to come from the block before it.
+  BasicBlock* Pre = Heads[Start]->getSinglePredecessor();
+  Instruction* PreTerm = Pre->getTerminator();
+  uint32_t nEntryEdges = 0;
+  for(uint32_t i = 0, ilim = PreTerm->getNumSuccessors(); i != ilim; ++i) {
+    if(PreTerm->getSuccessor(i) == Heads[Start])
+      ++nEntryEdges;
+  }
+  if(nEntryEdges != 1)
+    return End;
+
+  // Values computed before the last iteration must not be used outside the run,
+  // and those of the last iteration only within this function.
+  DenseSet<BasicBlock*> RunBlocks;
+  for(uint32_t i = 0; i != nIters; ++i)
+    RunBlocks.insert(Its[i].Blocks.begin(), Its[i].Blocks.end());
+
+  Function* F = Heads[Start]->getParent();
+
+  for(uint32_t i = 0; i != nIters; ++i) {
+
+    for(std::vector<Instruction*>::iterator it = Its[i].Insts.begin(), itend = Its[i].Insts.end(); it != itend; ++it) {
+
+      for(Value::user_iterator UI = (*it)->user_begin(), UE = (*it)->user_end(); UI != UE; ++UI) {
+
+	Instruction* UserI = dyn_cast<Instruction>(*UI);
+	if((!UserI) || UserI->getParent()->getParent() != F)
+	  return End;
+	if(i + 1 != nIters && !RunBlocks.count(UserI->getParent()))
+	  return End;
+
+      }
+
+    }
+
+  }
+
+  // Build the loop: a counter and a phi for each carried or stepped operand, then the body
+  // copied from the first iteration of the run.
+  LLVMContext& Ctx = F->getContext();
+  BasicBlock* Exit = Heads[End];
+  BasicBlock* Loop = BasicBlock::Create(Ctx, VerboseNames ? "reroll" : "", F, Heads[Start]);
+
+  Type* CountTy = Type::getInt32Ty(Ctx);
+  PHINode* Count = PHINode::Create(CountTy, 2, VerboseNames ? "reroll.count" : "", Loop);
+  Count->addIncoming(Constant::getNullValue(CountTy), Pre);
+
+  std::vector<RerollOperand*> PHIOps;
+
+  for(uint32_t i = 0, ilim = Slots.size(); i != ilim; ++i) {
+
+    for(uint32_t j = 0, jlim = Slots[i].size(); j != jlim; ++j) {
+
+      RerollOperand& Op = Slots[i][j];
+      if(Op.Kind == ROK_INVARIANT || Op.Kind == ROK_LOCAL)
+	continue;
+
+      for(std::vector<RerollOperand*>::iterator it = PHIOps.begin(), itend = PHIOps.end(); it != itend && !Op.PN; ++it) {
+	if(canSharePHI(**it, Op))
+	  Op.PN = (*it)->PN;
+      }
+
+      if(Op.PN)
+	continue;
+
+      if(Op.Kind == ROK_CARRIED) {
+	Op.PN = PHINode::Create(Op.V->getType(), 2, "", Loop);
+	Op.PN->addIncoming(Op.V, Pre);
+      }
+      else {
+	Op.PN = PHINode::Create(IntegerType::get(Ctx, Op.Start.getBitWidth()), 2, "", Loop);
+	Op.PN->addIncoming(ConstantInt::get(Ctx, Op.Start), Pre);
+      }
+
+      PHIOps.push_back(&Op);
+
+    }
+
+  }
+
+  std::vector<Instruction*> Clones;
+
+  for(uint32_t i = 0, ilim = Its[0].Insts.size(); i != ilim; ++i) {
+
+    Instruction* I = Its[0].Insts[i];
+    Instruction* NewI = I->clone();
+
+    for(uint32_t j = 0, jlim = Slots[i].size(); j != jlim; ++j) {
+
+      RerollOperand& Op = Slots[i][j];
+
+      switch(Op.Kind) {
+
+      case ROK_INVARIANT:
+	break;
+      case ROK_LOCAL:
+	NewI->setOperand(j, Clones[Op.Pos]);
+	break;
+      case ROK_CARRIED:
+      case ROK_INT_STEP:
+	NewI->setOperand(j, Op.PN);
+	break;
+      case ROK_PTR_STEP:
+	{
+	  Type* OpTy = I->getOperand(j)->getType();
+	  Type* Int8Ptr = Type::getInt8PtrTy(Ctx, OpTy->getPointerAddressSpace());
+	  Constant* Base = ConstantExpr::getPointerCast(cast<Constant>(Op.V), Int8Ptr);
+	  Value* Ptr = GetElementPtrInst::Create(Type::getInt8Ty(Ctx), Base, Op.PN, "", Loop);
+	  if(OpTy != Int8Ptr)
+	    Ptr = CastInst::CreatePointerCast(Ptr, OpTy, "", Loop);
+	  NewI->setOperand(j, Ptr);
+	  break;
+	}
+
+      }
+
+    }
+
+    Loop->getInstList().push_back(NewI);
+    if(VerboseNames && I->hasName())
+      NewI->setName(I->getName());
+    Clones.push_back(NewI);
+
+  }
+
+  for(std::vector<RerollOperand*>::iterator it = PHIOps.begin(), itend = PHIOps.end(); it != itend; ++it) {
+
+    RerollOperand& Op = **it;
+    if(Op.Kind == ROK_CARRIED)
+      Op.PN->addIncoming(Clones[Op.Pos], Loop);
+    else
+      Op.PN->addIncoming(BinaryOperator::CreateAdd(Op.PN, ConstantInt::get(Ctx, Op.Step), "", Loop), Loop);
+
+  }
+
+  Instruction* NextCount = BinaryOperator::CreateAdd(Count, ConstantInt::get(CountTy, 1), "", Loop);
+  Count->addIncoming(NextCount, Loop);
+  Value* Again = new ICmpInst(*Loop, CmpInst::ICMP_NE, NextCount, ConstantInt::get(CountTy, nIters));
+  BranchInst::Create(Loop, Exit, Again, Loop);
+
+  PreTerm->replaceUsesOfWith(Heads[Start], Loop);
+
+  // Anything after the run that used the last iteration now uses the loop body instead.
+  RerollIteration& Last = Its.back();
+  for(uint32_t i = 0, ilim = Last.Insts.size(); i != ilim; ++i)
+    Last.Insts[i]->replaceAllUsesWith(Clones[i]);
+
+  for(uint32_t i = 0; i != nIters; ++i) {
+    for(std::vector<BasicBlock*>::iterator it = Its[i].Blocks.begin(), itend = Its[i].Blocks.end(); it != itend; ++it)
+      (*it)->dropAllReferences();
+  }
+
+  for(uint32_t i = 0; i != nIters; ++i) {
+    for(std::vector<BasicBlock*>::iterator it = Its[i].Blocks.begin(), itend = Its[i].Blocks.end(); it != itend; ++it)
+      (*it)->eraseFromParent();
+  }
+
+  ++GlobalIHP->stats.rerolledLoops;
+  GlobalIHP->stats.rerolledIterations += nIters;
+
+  Rerolled = true;
+  return End;
+
+}
+
+// Re-roll runs of matching iterations of each of this context's peeled loops; after that, loops nested
+// within iterations that weren't absorbed into a run are tried in turn.
+void IntegrationAttempt::rerollPeeledLoops() {
+
+  uint32_t MinIters = std::max(pass->rerollMinIterations, 2u);
+
+  SmallVector<PeelAttempt*, 4> Peels;
+  getOrderedPeelChildren(Peels);
+
+  for(SmallVector<PeelAttempt*, 4>::iterator it = Peels.begin(), itend = Peels.end(); it != itend; ++it) {
+
+    PeelAttempt* LPA = *it;
+    if((!LPA->isEnabled()) || !LPA->isTerminated())
+      continue;
+
+    uint32_t nIters = LPA->Iterations.size();
+    std::vector<BasicBlock*> Heads(nIters);
+    for(uint32_t i = 0; i != nIters; ++i)
+      Heads[i] = getIterationHead(LPA->Iterations[i]);
+
+    std::vector<bool> Absorbed(nIters, false);
+
+    uint32_t Start = 0;
+    while(Start + MinIters < nIters) {
+
+      bool Rerolled;
+      uint32_t End = tryRerollFrom(Heads, Start, MinIters, Rerolled);
+
+      if(Rerolled) {
+	for(uint32_t i = Start; i != End; ++i)
+	  Absorbed[i] = true;
+	Start = End;
+      }
+      else {
+	// The iteration that stopped the run may yet begin one of its own.
+	Start = std::max(Start + 1, End ? End - 1 : 0);
+      }
+
+    }
+
+    for(uint32_t i = 0; i != nIters; ++i) {
+      if(!Absorbed[i])
+	LPA->Iterations[i]->rerollPeeledLoops();
+    }
+
+  }
+
+}
@@ -74,20 +74,24 @@ void IntegrationAttempt::prepareCommit() {
 
   }
 
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it) {
+  SmallVector<PeelAttempt*, 4> Peels;
+  getOrderedPeelChildren(Peels);
 
-    unsigned iterCount = it->second->Iterations.size();
-    unsigned iterLimit = (it->second->Iterations.back()->iterStatus == IterationStatusFinal) ? iterCount : iterCount - 1;
+  for(SmallVector<PeelAttempt*, 4>::iterator it = Peels.begin(), it2 = Peels.end(); it != it2; ++it) {
 
-    if(!it->second->isEnabled()) {
+    PeelAttempt* LPA = *it;
+    unsigned iterCount = LPA->Iterations.size();
+    unsigned iterLimit = (LPA->Iterations.back()->iterStatus == IterationStatusFinal) ? iterCount : iterCount - 1;
+
+    if(!LPA->isEnabled()) {
     
-      if(it->second->isTerminated()) {
+      if(LPA->isTerminated()) {
 
 	// Loop hasn't been analysed for the general case -- do a rough and ready approximation
 	// that emits any edge that is alive in any iteration.
 
-	const ShadowLoopInvar* LInfo = it->second->L;
-	for(uint32_t i = LInfo->headerIdx; i < nBBs && it->first->contains(getBBInvar(i)->naturalScope); ++i) {
+	const ShadowLoopInvar* LInfo = LPA->L;
+	for(uint32_t i = LInfo->headerIdx; i < nBBs && LInfo->contains(getBBInvar(i)->naturalScope); ++i) {
 
 	  ShadowBB* BB = getBB(i);
 	  if(!BB) {
@@ -107,6 +111,8 @@ void IntegrationAttempt::prepareCommit() {
 
 	}
 
+	noteCFGChange();
+
       }
 
       continue;
@@ -115,7 +121,7 @@ void IntegrationAttempt::prepareCommit() {
 
     for(unsigned i = 0; i < iterLimit; ++i) {
 
-      it->second->Iterations[i]->prepareCommit();
+      LPA->Iterations[i]->prepareCommit();
 
     }
 
@@ -231,6 +237,9 @@ BasicBlock* IntegrationAttempt::createBasicBlock(LLVMContext& Ctx, const Twine&
     AddTo = 0;
   else
     AddTo = AddF;
+
+  if(isFailedBlock)
+    pass->committedFailedBlocks = true;
   
   BasicBlock* newBlock;
   if(AddTo && getFunctionRoot()->firstFailedBlock != AddTo->end() && !isFailedBlock) {
@@ -248,6 +257,12 @@ BasicBlock* IntegrationAttempt::createBasicBlock(LLVMContext& Ctx, const Twine&
 
   }
 
+  if(isFailedBlock && pass->countFailures)
+    pass->failedBlockHandles.push_back(WeakVH(newBlock));
+
+  if(!pass->blockMapFile.empty())
+    pass->committedBlockContexts.push_back(std::make_pair(WeakVH(newBlock), SeqNumber));
+
   if(!AddF) {
 
     // Commit function unknown at the moment: save the block for later addition
@@ -526,6 +541,10 @@ void IntegrationAttempt::commitCFG() {
 	if(j + 1 != BB->insts.size() && inst_is<PHINode>(SI) && inst_is<PHINode>(&BB->insts[j+1]))
 	  continue;
 
+	// Coalesced load checks all happen after the last load in the run.
+	if(checkCoalescesWithNext(BB, j))
+	  continue;
+
 	BasicBlock* breakBlock = 0;
 
 	if(pass->verbosePCs) {
@@ -573,8 +592,8 @@ Value* IntegrationAttempt::getCommittedValue(ShadowValue SV) {
     return SV.u.GV->G;
   case SHADOWVAL_INST: 
     {
-      release_assert(SV.u.I->committedVal && "Instruction depends on uncommitted instruction");
-      return SV.u.I->committedVal;
+      release_assert(SV.u.I->getCommittedVal() && "Instruction depends on uncommitted instruction");
+      return SV.u.I->getCommittedVal();
     }
   case SHADOWVAL_ARG:
     {
@@ -819,19 +838,20 @@ Value* llvm::getValAsType(Value* V, Type* Ty, BasicBlock* insertAtEnd) {
 
 }
 
-// Add an empty phi node to emitBB.
-PHINode* llvm::makePHI(Type* Ty, const Twine& Name, BasicBlock* emitBB) {
+// Add an empty phi node to emitBB, with room for NumReservedValues incoming values.
+PHINode* llvm::makePHI(Type* Ty, const Twine& Name, BasicBlock* emitBB, uint32_t NumReservedValues) {
+
+  // Usually a block's PHIs are emitted before anything else, so just append.
+  if(emitBB->empty() || isa<PHINode>(emitBB->back()))
+    return PHINode::Create(Ty, NumReservedValues, Name, emitBB);
 
   // Manually check for existing non-PHI instructions because BB->getFirstNonPHI assumes a finished block
 
   BasicBlock::iterator it = emitBB->begin();
-  while(it != emitBB->end() && isa<PHINode>(it))
+  while(isa<PHINode>(it))
     ++it;
   
-  if(it != emitBB->end())
-    return PHINode::Create(Ty, 0, Name, &*it);
-  else
-    return PHINode::Create(Ty, 0, Name, emitBB);
+  return PHINode::Create(Ty, NumReservedValues, Name, &*it);
 
 }
 
@@ -848,7 +868,8 @@ void PeelIteration::emitPHINode(ShadowBB* BB, ShadowInstruction* I, BasicBlock*
     ShadowValue SourceV = getLoopHeaderForwardedOperand(I);
 
     PHINode* NewPN;
-    I->committedVal = NewPN = makePHI(I->invar->I->getType(), VerboseNames ? "header" : "", emitBB);
+    NewPN = makePHI(I->invar->I->getType(), VerboseNames ? "header" : "", emitBB, 1);
+    I->setCommittedVal(NewPN);
     ShadowBB* SourceBB;
 
     if(iterationCount == 0) {
@@ -934,8 +955,10 @@ void IntegrationAttempt::populatePHINode(ShadowBB* BB, ShadowInstruction* I, PHI
 // Make a phi node corresponding to specialised instruction I, committing to emitBB.
 void IntegrationAttempt::emitPHINode(ShadowBB* BB, ShadowInstruction* I, BasicBlock* emitBB) {
 
+  // Reserve for the usual case of one incoming value per original predecessor.
   PHINode* NewPN;
-  I->committedVal = NewPN = makePHI(I->invar->I->getType(), "", emitBB);
+  NewPN = makePHI(I->invar->I->getType(), "", emitBB, I->invar->operandIdxs.size());
+  I->setCommittedVal(NewPN);
 
   // Special case: emitting the header PHI of a residualised loop.
   // Make an empty node for the time being; this will be revisted once the loop body is emitted
@@ -951,9 +974,9 @@ void IntegrationAttempt::fixupHeaderPHIs(ShadowBB* BB) {
 
   uint32_t i;
   for(i = 0; i < BB->insts.size() && inst_is<PHINode>(&(BB->insts[i])); ++i) {
-    if((!BB->insts[i].committedVal) || !isa<PHINode>(BB->insts[i].committedVal))
+    if((!BB->insts[i].getCommittedVal()) || !isa<PHINode>(BB->insts[i].getCommittedVal()))
       continue;
-    populatePHINode(BB, &(BB->insts[i]), cast<PHINode>(BB->insts[i].committedVal));
+    populatePHINode(BB, &(BB->insts[i]), cast<PHINode>(BB->insts[i].getCommittedVal()));
   }
 
 }
@@ -1183,6 +1206,7 @@ void IntegrationAttempt::emitTerminator(ShadowBB* BB, ShadowInstruction* I, Basi
     SmallVector<std::pair<ConstantInt*, BasicBlock*>, 1> breakSuccessors;
 
     Instruction* newTerm = I->invar->I->clone();
+    setCommittedDebugLoc(newTerm);
     emitBB->getInstList().push_back(newTerm);
 
     BasicBlock* defaultSwitchTarget = 0;
@@ -1260,22 +1284,22 @@ void IntegrationAttempt::emitTerminator(ShadowBB* BB, ShadowInstruction* I, Basi
 // Create a constant global containing the bytes read by this ReadFile call.
 static GlobalVariable* getFileBytesGlobal(ReadFile& RF) {
 
-  std::vector<Constant*> constBytes;
+  Constant* ByteArray;
   std::string errors;
   LLVMContext& Context = GInt8->getContext();
-  if(!getFileBytes(RF.name, RF.incomingOffset, RF.readSize, constBytes, Context, errors)) {
+  if(!getFileBytes(RF.getFilename(), RF.incomingOffset, RF.readSize, ByteArray, Context, errors)) {
 
-    errs() << "Failed to read file " << RF.name << " in commit\n";
+    errs() << "Failed to read file " << RF.getFilename() << " in commit\n";
     exit(1);
 
   }
 
-  ArrayType* ArrType = ArrayType::get(IntegerType::get(Context, 8), constBytes.size());
-  Constant* ByteArray = ConstantArray::get(ArrType, constBytes);
+  // Create a const global for the array. Only specialised code refers to it, so its address
+  // doesn't matter and identical copies can be merged (see mergeIdenticalConstantGlobals).
 
-  // Create a const global for the array:
-
-  return new GlobalVariable(*getGlobalModule(), ArrType, true, GlobalValue::InternalLinkage, ByteArray, "");
+  GlobalVariable* NewGV = new GlobalVariable(*getGlobalModule(), ByteArray->getType(), true, GlobalValue::InternalLinkage, ByteArray, "");
+  NewGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return NewGV;
 
 }
 
@@ -1312,6 +1336,86 @@ static void emitSeekTo(Value* FD, uint64_t Offset, BasicBlock* emitBB) {
 
 }
 
+// Emit an fseek call to reposition a stdio stream (see -llpe-stdio-model).
+static void emitStreamSeekTo(Value* Stream, uint64_t Offset, BasicBlock* emitBB) {
+
+  LLVMContext& Context = Stream->getContext();
+
+  Type* Int64Ty = IntegerType::get(Context, 64);
+  Constant* NewOffset = ConstantInt::get(Int64Ty, Offset);
+  Type* Int32Ty = IntegerType::get(Context, 32);
+  Constant* SeekSet = ConstantInt::get(Int32Ty, SEEK_SET);
+
+  Type* ArgTypes[3] = { Stream->getType(), Int64Ty, Int32Ty };
+  FunctionType* FT = FunctionType::get(/* ret = */ Int32Ty, ArrayRef<Type*>(ArgTypes, 3), false);
+
+  Constant* SeekFn = getOrInsertLocalFunction("fseek", FT);
+
+  // An existing fseek may name the FILE type differently.
+  if(Function* SeekF = dyn_cast<Function>(SeekFn)) {
+    Type* StreamTy = SeekF->getFunctionType()->getParamType(0);
+    if(StreamTy != Stream->getType())
+      Stream = new BitCastInst(Stream, StreamTy, VerboseNames ? "streamcast" : "", emitBB);
+  }
+
+  Value* CallArgs[] = { Stream, NewOffset, SeekSet };
+
+  CallInst* SeekC = CallInst::Create(SeekFn, ArrayRef<Value*>(CallArgs, 3), "", emitBB);
+  if(Function* SeekF = dyn_cast<Function>(SeekFn))
+    SeekC->setCallingConv(SeekF->getCallingConv());
+
+}
+
+// Reposition the file a resolved read used.
+static void emitReadSeekTo(ReadFile& RF, Value* FD, uint64_t Offset, BasicBlock* emitBB) {
+
+  if(RF.isStdio)
+    emitStreamSeekTo(FD, Offset, emitBB);
+  else
+    emitSeekTo(FD, Offset, emitBB);
+
+}
+
+// Get the function to call to ask lliowd whether specialised files are still valid. Normally that is the
+// client library's lliowd_ok, but with -llpe-inline-lliowd-check it is an always-inline copy of lliowd.h's
+// lliowd_ok_fast, so that once one check has passed, later ones are a load of lliowd_valid rather than a call.
+static Constant* getLliowdCheckFn(Module* M) {
+
+  LLVMContext& Context = M->getContext();
+  Type* Int32Ty = IntegerType::get(Context, 32);
+  Constant* CheckFn = cast<Constant>(M->getOrInsertFunction("lliowd_ok", Int32Ty).getCallee());
+
+  if(!GlobalIHP->inlineLliowdCheck)
+    return CheckFn;
+
+  if(Function* FastFn = M->getFunction("__llpe_lliowd_ok_fast"))
+    return FastFn;
+
+  FunctionType* FT = FunctionType::get(Int32Ty, false);
+  Function* FastFn = Function::Create(FT, GlobalValue::InternalLinkage, "__llpe_lliowd_ok_fast", M);
+  FastFn->addFnAttr(Attribute::AlwaysInline);
+
+  GlobalVariable* Valid = cast<GlobalVariable>(M->getOrInsertGlobal("lliowd_valid", Int32Ty));
+
+  BasicBlock* Entry = BasicBlock::Create(Context, "", FastFn);
+  BasicBlock* Fast = BasicBlock::Create(Context, "", FastFn);
+  BasicBlock* Slow = BasicBlock::Create(Context, "", FastFn);
+
+  LoadInst* ValidLoad = new LoadInst(Valid, "", Entry);
+  ValidLoad->setAlignment(4);
+  ValidLoad->setAtomic(AtomicOrdering::Monotonic);
+  Value* IsValid = new ICmpInst(*Entry, CmpInst::ICMP_NE, ValidLoad, Constant::getNullValue(Int32Ty));
+  createCheckBranch(IsValid, false, Fast, Slow, Entry);
+
+  ReturnInst::Create(Context, ConstantInt::get(Int32Ty, 1), Fast);
+
+  Value* SlowResult = CallInst::Create(CheckFn, ArrayRef<Value*>(), "", Slow);
+  ReturnInst::Create(Context, SlowResult, Slow);
+
+  return FastFn;
+
+}
+
 // Emit a syscall instruction. It might be resolved down to a no-op, or might require repositioning with lseek64 before execution.
 bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVector<CommittedBlock, 1>::iterator& emitBBIter) {
 
@@ -1381,7 +1485,7 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	  // Read from a regular file.
 	  // Emit a check that file specialisations are still admissible:
 	  Type* Int32Ty = IntegerType::get(Context, 32);
-	  Constant* CheckFn = cast<Constant>(F.getParent()->getOrInsertFunction("lliowd_ok", Int32Ty).getCallee());
+	  Constant* CheckFn = getLliowdCheckFn(F.getParent());
 	  Value* CheckResult = CallInst::Create(CheckFn, ArrayRef<Value*>(), "readcheck", emitBB);
       
 	  Constant* Zero32 = Constant::getNullValue(Int32Ty);
@@ -1389,8 +1493,8 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 
 	  // Seek to the right position in the break block, so that unspecialised
 	  // code finds the file pointer where it expects to.
-	  emitSeekTo(getCommittedValue(I->getCallArgOperand(0)), 
-		     it->second.incomingOffset, breakBlock);
+	  emitReadSeekTo(it->second, getCommittedValue(I->getCallArgOperand(it->second.fdArg)), 
+			 it->second.incomingOffset, breakBlock);
 
 	}
       
@@ -1400,7 +1504,7 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	  std::string message;
 	  {
 	    raw_string_ostream RSO(message);
-	    RSO << "Denied permission to use specialised files reading " << it->second.name << " in " << emitBB->getName() << "\n";
+	    RSO << "Denied permission to use specialised files reading " << it->second.getFilename() << " in " << emitBB->getName() << "\n";
 	  }
 	
 	  emitRuntimePrint(breakBlock, message, 0);
@@ -1420,13 +1524,13 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
       
 	if(breakBlock != emitBB) {
 
-	  BranchInst::Create(breakBlock, successTarget, CheckTest, emitBB);
+	  createCheckBranch(CheckTest, true, successTarget, breakBlock, emitBB);
 	  BranchInst::Create(failTarget, breakBlock);
 
 	}
 	else {
 
-	  BranchInst::Create(failTarget, successTarget, CheckTest, emitBB);
+	  createCheckBranch(CheckTest, true, successTarget, failTarget, emitBB);
 
 	}
       
@@ -1439,8 +1543,8 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
       // used without an intervening SEEK_SET)
       if(it->second.needsSeek) {
 	
-	emitSeekTo(getCommittedValue(I->getCallArgOperand(0)), 
-		   it->second.incomingOffset + it->second.readSize, emitBB);
+	emitReadSeekTo(it->second, getCommittedValue(I->getCallArgOperand(it->second.fdArg)), 
+		       it->second.incomingOffset + it->second.readSize, emitBB);
 	  
       }
 
@@ -1448,7 +1552,8 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
       // (i.e. a read() becomes a memcpy from a constant global).
       // If it's a read from a fifo then the copy was emitted *before* the check.
 
-      if(it->second.readSize > 0 && 
+      int32_t bufArg = it->second.bufArg;
+      if(it->second.readSize > 0 && bufArg != -1 &&
 	 (!(it->second.isFifo && !pass->omitChecks)) && 
 	 !(I->dieStatus & INSTSTATUS_UNUSED_WRITER)) {
 	
@@ -1467,9 +1572,9 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	Function *MemCpyFn = Intrinsic::getDeclaration(F.getParent(),
 						       Intrinsic::memcpy, 
 						       ArrayRef<Type*>(Tys, 3));
-	Value *ReadBuffer = getCommittedValue(I->getCallArgOperand(1));
+	Value *ReadBuffer = getCommittedValue(I->getCallArgOperand(bufArg));
 	release_assert(ReadBuffer && "Committing read atop dead buffer?");
-	Value *DestCast = new BitCastInst(getCommittedValue(I->getCallArgOperand(1)), VoidPtrTy, VerboseNames ? "readcast" : "", emitBB);
+	Value *DestCast = new BitCastInst(ReadBuffer, VoidPtrTy, VerboseNames ? "readcast" : "", emitBB);
 
 	Value *CallArgs[] = {
 	  DestCast, CopySource, MemcpySize,
@@ -1478,19 +1583,40 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	};
 	
 	Instruction* ReadMemcpy = CallInst::Create(MemCpyFn, ArrayRef<Value*>(CallArgs, 5), "", emitBB);
+	pass->committedReadCopies.push_back(std::make_pair(WeakVH(ReadMemcpy), ArrayGlobal));
+
+	// fgets terminates the line it read:
+	Instruction* ReadNul = 0;
+	if(it->second.nulTerminate) {
+	  Value* NulPtr = GetElementPtrInst::Create(Type::getInt8Ty(Context), DestCast, ConstantInt::get(Int64Ty, it->second.readSize),
+						    VerboseNames ? "readnul" : "", emitBB);
+	  ReadNul = new StoreInst(ConstantInt::get(Type::getInt8Ty(Context), 0), NulPtr, emitBB);
+	}
 
 	DenseMap<ShadowInstruction*, TrackedStore*>::iterator findit = pass->trackedStores.find(I);
 	if(findit != pass->trackedStores.end()) {
 
 	  findit->second->isCommitted = true;
-	  findit->second->committedInsts = new WeakVH[1];
+	  findit->second->nCommittedInsts = ReadNul ? 2 : 1;
+	  findit->second->committedInsts = new WeakVH[findit->second->nCommittedInsts];
 	  findit->second->committedInsts[0] = ReadMemcpy;
-	  findit->second->nCommittedInsts = 1;
+	  if(ReadNul)
+	    findit->second->committedInsts[1] = ReadNul;
 
 	}
 	
       }
 
+      // A successful fgets returns its buffer.
+      if(it->second.nulTerminate) {
+
+	Value* Buf = getCommittedValue(I->getCallArgOperand(bufArg));
+	if(Buf->getType() != I->getType())
+	  Buf = new BitCastInst(Buf, I->getType(), VerboseNames ? "fgetsret" : "", emitBB);
+	I->setCommittedVal(Buf);
+
+      }
+
       return true;
 
     }
@@ -1526,7 +1652,7 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 
     // Emit an lliowd_ok check, and if it fails branch to the real stat instruction.
     Type* Int32Ty = IntegerType::get(Context, 32);
-    Constant* CheckFn = cast<Constant>(F.getParent()->getOrInsertFunction("lliowd_ok", Int32Ty).getCallee());
+    Constant* CheckFn = getLliowdCheckFn(F.getParent());
     Value* CheckResult = CallInst::Create(CheckFn, ArrayRef<Value*>(), VerboseNames ? "readcheck" : "", emitBB);
 	
     Constant* Zero32 = Constant::getNullValue(Int32Ty);
@@ -1556,7 +1682,7 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
     BasicBlock* successTarget = emitBBIter->specBlock;
     
     release_assert(successTarget && failTarget && CheckTest);
-    BranchInst::Create(failTarget, successTarget, CheckTest, emitBB);
+    createCheckBranch(CheckTest, true, successTarget, failTarget, emitBB);
 
     return true;
     
@@ -1630,7 +1756,7 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 	BranchInst::Create(IA->getCommittedEntryBlock(), emitBB);
 
 	// Take the return PHI (or lack thereof) as this instruction's committed value.
-	I->committedVal = IA->returnPHI;
+	I->setCommittedVal(IA->returnPHI);
 
 	// Emit further instructions in this ShadowBB to the successor block:
 	++emitBBIter;
@@ -1733,8 +1859,9 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 	}
 
 	NewI->setDebugLoc(I->invar->I->getDebugLoc());
+	setCommittedDebugLoc(NewI);
 	  
-	I->committedVal = NewI;
+	I->setCommittedVal(NewI);
 
 	if(IA->hasFailedReturnPath()) {
 
@@ -1750,7 +1877,7 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 	  else {
 
 	    CallFailed = ExtractValueInst::Create(NewI, ArrayRef<unsigned>(1), VerboseNames ? "retfailflag" : "", emitBB);
-	    I->committedVal = ExtractValueInst::Create(NewI, ArrayRef<unsigned>(0), VerboseNames ? "ret" : "", emitBB);
+	    I->setCommittedVal(ExtractValueInst::Create(NewI, ArrayRef<unsigned>(0), VerboseNames ? "ret" : "", emitBB));
 	    
 	  }
 
@@ -1783,7 +1910,7 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 	  }
 
 	  release_assert(successTarget && failTarget && CallFailed);
-	  BranchInst::Create(successTarget, failTarget, CallFailed, emitBB);
+	  createCheckBranch(CallFailed, false, successTarget, failTarget, emitBB);
 
 	}
 
@@ -1823,7 +1950,7 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 	if(IA->returnPHI && IA->returnPHI->getNumIncomingValues() == 0) {
 	  IA->returnPHI->eraseFromParent();
 	  IA->returnPHI = 0;
-	  I->committedVal = UndefValue::get(IA->F.getFunctionType()->getReturnType());
+	  I->setCommittedVal(UndefValue::get(IA->F.getFunctionType()->getReturnType()));
 	}
 
 	// If it's an invoke instruction then this is the terminator!
@@ -1904,6 +2031,22 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 
 } // End of emit-call-instruction.
 
+// Is IA's committed code executed at most once? True of the root, and of contexts which aren't shared
+// and whose parents run at most once. Allocations within residual loops are caught by allocVague.
+static bool contextRunsOnce(IntegrationAttempt* IA) {
+
+  while(IA != GlobalIHP->getRoot()) {
+
+    IA = IA->getUniqueParent();
+    if(!IA)
+      return false;
+
+  }
+
+  return true;
+
+}
+
 // Debug check
 static void checkEmittedInst(Instruction* I) {
 
@@ -1930,7 +2073,8 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
 
   // Clone all attributes:
   Instruction* newI = I->invar->I->clone();
-  I->committedVal = newI;
+  setCommittedDebugLoc(newI);
+  I->setCommittedVal(newI);
   emitBB->getInstList().push_back(cast<Instruction>(newI));
 
   if(isa<AllocaInst>(newI))
@@ -1949,7 +2093,10 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
     Value* opV = getCommittedValueOrBlock(I, i, ignFailValue, failBlock);
     release_assert(opV);
     Type* needTy = newI->getOperand(i)->getType();
-    newI->setOperand(i, getValAsType(opV, needTy, newI));
+    opV = getValAsType(opV, needTy, newI);
+    // Constant operands usually commit as themselves; leave their uses alone.
+    if(opV != newI->getOperand(i))
+      newI->setOperand(i, opV);
 
     release_assert((!failBlock) && "Case not handled yet: invoke with ignored normal return");
 
@@ -1977,8 +2124,10 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
 
     AD->committedVal = newI;
     AD->isCommitted = true;
-    if(Base.getFrameNo() == -1)
+    if(Base.getFrameNo() == -1) {
       pass->committedHeapAllocations[newI] = Base.getHeapKey();
+      AD->committedOnce = (!AD->allocVague) && contextRunsOnce(this);
+    }
 
   }
 
@@ -2025,7 +2174,7 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
 }
 
 // Build a constexpr for (targetType)(((char*)GV) + Offset)
-Constant* llvm::getGVOffset(Constant* GV, int64_t Offset, Type* targetType) {
+static Constant* buildGVOffset(Constant* GV, int64_t Offset, Type* targetType) {
 
   Type* Int8Ptr = Type::getInt8PtrTy(GV->getContext());
   Constant* CastGV;
@@ -2053,6 +2202,22 @@ Constant* llvm::getGVOffset(Constant* GV, int64_t Offset, Type* targetType) {
 
 }
 
+// Get GV + Offset as a targetType constant. Results are cached, as building them goes through
+// LLVM's constant uniquing maps every time.
+Constant* llvm::getGVOffset(Constant* GV, int64_t Offset, Type* targetType) {
+
+  WeakVH& Cached = GlobalIHP->gvOffsets[std::make_pair(std::make_pair(GV, Offset), targetType)];
+  if(Cached) {
+    ++GlobalIHP->stats.synthConstantReuses;
+    return cast<Constant>(Cached);
+  }
+
+  Constant* Result = buildGVOffset(GV, Offset, targetType);
+  Cached = Result;
+  return Result;
+
+}
+
 // Create a pointer described by I (i.e. make gep and cast instructions).
 // May be impossible if I is not specific enough, or completely unknown. Return false in that case.
 bool IntegrationAttempt::synthCommittedPointer(ShadowValue I, SmallVector<CommittedBlock, 1>::iterator emitBB) {
@@ -2137,7 +2302,19 @@ bool IntegrationAttempt::synthCommittedPointer(ShadowValue* I, Type* targetType,
   else {
 
     Value* BaseI = getCommittedValue(Base);
-    if(!BaseI) {
+    WeakVH* Cached = 0;
+    if(BaseI) {
+
+      // Reuse a pointer already made in this block if we can.
+      Cached = &(pass->synthPointers[std::make_pair(std::make_pair(emitBB, BaseI), std::make_pair(Offset, targetType))]);
+      if(*Cached) {
+	++pass->stats.synthInstructionReuses;
+	Result = *Cached;
+	return true;
+      }
+
+    }
+    else {
 
       // Base has not been committed yet. Create a trivial select instruction that will be populated
       // with the allocation when it is committed.
@@ -2159,6 +2336,8 @@ bool IntegrationAttempt::synthCommittedPointer(ShadowValue* I, Type* targetType,
 	Result = BaseI;
       else
 	Result = CastInst::CreatePointerCast(BaseI, targetType, VerboseNames ? "synthcast" : "", emitBB);
+      if(Cached)
+	*Cached = Result;
       return true;
 
     }
@@ -2173,6 +2352,8 @@ bool IntegrationAttempt::synthCommittedPointer(ShadowValue* I, Type* targetType,
       Result = GetElementPtrInst::Create(ElTy, BaseI, GEPIdxs, VerboseNames ? "synthgep" : "", emitBB);
       if((!isa<PointerType>(targetType)) || ElTy != cast<PointerType>(targetType)->getElementType())
 	Result = CastInst::CreatePointerCast(Result, targetType, VerboseNames ? "synthcastback" : "", emitBB);
+      if(Cached)
+	*Cached = Result;
       return true;
 
     }
@@ -2198,6 +2379,9 @@ bool IntegrationAttempt::synthCommittedPointer(ShadowValue* I, Type* targetType,
       Result = (CastInst::CreatePointerCast(OffsetI, targetType, VerboseNames ? "synthcastback" : "", emitBB));
     }
 
+    if(Cached)
+      *Cached = Result;
+
   }
 
   return true;
@@ -2342,6 +2526,7 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
       // Emit memcpy from single constant.
       GlobalVariable* CopyFrom = new GlobalVariable(*getGlobalModule(), newVal->getType(), 
 						    true, GlobalValue::InternalLinkage, cast<Constant>(newVal));
+      CopyFrom->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
       Constant* CopyFromPtr = ConstantExpr::getBitCast(CopyFrom, BytePtr);
       newInstructions.push_back(emitMemcpyInst(targetPtrSynth, CopyFromPtr, elSize, emitBB));
 
@@ -2377,6 +2562,7 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
     Constant* CS = ConstantStruct::get(SType, Copy);
     GlobalVariable* GCS = new GlobalVariable(*getGlobalModule(), SType, 
 					     true, GlobalValue::InternalLinkage, CS);
+    GCS->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
     Constant* GCSPtr = ConstantExpr::getBitCast(GCS, BytePtr);
 
     newInstructions.push_back(emitMemcpyInst(targetPtrSynth, GCSPtr, lastOffset - chunkBegin->first.first, emitBB));
@@ -2389,7 +2575,8 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
 // the unique objects it writes and where it writes them?)
 bool IntegrationAttempt::canSynthMTI(ShadowInstruction* I) {
 
-  if(!GlobalIHP->memcpyValues.count(I))
+  SmallVector<IVSRange, 4>* copyValues = getMemcpyValues(I);
+  if(!copyValues)
     return false;
 
   ShadowValue IVal(I);
@@ -2404,7 +2591,7 @@ bool IntegrationAttempt::canSynthMTI(ShadowInstruction* I) {
       return false;
   }
   
-  SmallVector<IVSRange, 4>& Vals = GlobalIHP->memcpyValues[I];
+  SmallVector<IVSRange, 4>& Vals = *copyValues;
 
   // Can we describe all the copied values?
   for(SmallVector<IVSRange, 4>::iterator it = Vals.begin(),
@@ -2434,7 +2621,7 @@ bool IntegrationAttempt::trySynthMTI(ShadowInstruction* I, BasicBlock* emitBB) {
   // The method: for consecutive scalars or pointers-to-globals, synthesise a packed struct and
   // memcpy from it. For non-constant pointers and FDs, produce stores.
 
-  SmallVector<IVSRange, 4>& Vals = GlobalIHP->memcpyValues[I];
+  SmallVector<IVSRange, 4>& Vals = *getMemcpyValues(I);
   SmallVector<Instruction*, 4> newInstructions;
 
   SmallVector<IVSRange, 4>::iterator chunkBegin = Vals.begin();
@@ -2504,9 +2691,8 @@ bool IntegrationAttempt::trySynthInst(ShadowInstruction* I, BasicBlock* emitBB,
   if(IVS->Values.size() != 1)
     return false;
 
-  // AtomicRMW and AtomicCmpXchg can be assigned values and not require a runtime check
-  // if their operand was known to be thread-local; however for now emit them for their
-  // side-effects.
+  // AtomicRMW and AtomicCmpXchg must still be emitted for their side-effects;
+  // see tryEmitThreadLocalRMW for the case where that needn't be atomic.
 
   if(inst_is<AtomicRMWInst>(I) || inst_is<AtomicCmpXchgInst>(I))
     return false;
@@ -2533,6 +2719,74 @@ bool IntegrationAttempt::trySynthArg(ShadowArg* A, BasicBlock* emitBB, Value*& R
 
 }
 
+// AtomicRMW I's old value is known, and it only touches objects no other thread can see, so that
+// (unless the program is single threaded, in which case that's true of every object) isThreadLocal
+// was left TLS_NEVERCHECK by executeAtomicRMW. Then its atomicity is unobservable: use the known
+// old value and emit a plain store of the new one in its place.
+bool IntegrationAttempt::tryEmitThreadLocalRMW(ShadowInstruction* I, BasicBlock* emitBB) {
+
+  AtomicRMWInst* RMW = cast_inst<AtomicRMWInst>(I);
+  if(RMW->isVolatile())
+    return false;
+  if(I->isThreadLocal != TLS_NEVERCHECK && !pass->atomicOpIsSimple(RMW))
+    return false;
+
+  ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(I->i.PB);
+  if((!IVS) || IVS->Values.size() != 1 || IVS->SetType != ValSetTypeScalar)
+    return false;
+
+  ShadowValue IVal(I);
+  Value* OldV = trySynthVal(&IVal, I->getType(), IVS->SetType, IVS->Values[0], emitBB);
+  if(!OldV)
+    return false;
+
+  Value* PtrV = getCommittedValue(I->getOperand(0));
+  Value* ArgV = getValAsType(getCommittedValue(I->getOperand(1)), I->getType(), emitBB);
+  Value* NewV;
+
+  switch(RMW->getOperation()) {
+  case AtomicRMWInst::Xchg:
+    NewV = ArgV; break;
+  case AtomicRMWInst::Add:
+    NewV = BinaryOperator::CreateAdd(OldV, ArgV, "", emitBB); break;
+  case AtomicRMWInst::Sub:
+    NewV = BinaryOperator::CreateSub(OldV, ArgV, "", emitBB); break;
+  case AtomicRMWInst::And:
+    NewV = BinaryOperator::CreateAnd(OldV, ArgV, "", emitBB); break;
+  case AtomicRMWInst::Nand:
+    NewV = BinaryOperator::CreateNot(BinaryOperator::CreateAnd(OldV, ArgV, "", emitBB), "", emitBB); break;
+  case AtomicRMWInst::Or:
+    NewV = BinaryOperator::CreateOr(OldV, ArgV, "", emitBB); break;
+  case AtomicRMWInst::Xor:
+    NewV = BinaryOperator::CreateXor(OldV, ArgV, "", emitBB); break;
+  case AtomicRMWInst::Max:
+  case AtomicRMWInst::Min:
+  case AtomicRMWInst::UMax:
+  case AtomicRMWInst::UMin:
+    {
+      CmpInst::Predicate Pred;
+      switch(RMW->getOperation()) {
+      case AtomicRMWInst::Max: Pred = CmpInst::ICMP_SGT; break;
+      case AtomicRMWInst::Min: Pred = CmpInst::ICMP_SLT; break;
+      case AtomicRMWInst::UMax: Pred = CmpInst::ICMP_UGT; break;
+      default: Pred = CmpInst::ICMP_ULT; break;
+      }
+      Value* KeepOld = new ICmpInst(*emitBB, Pred, OldV, ArgV);
+      NewV = SelectInst::Create(KeepOld, OldV, ArgV, "", emitBB);
+      break;
+    }
+  default:
+    return false;
+  }
+
+  new StoreInst(NewV, PtrV, emitBB);
+
+  I->setCommittedVal(OldV);
+  ++pass->stats.threadLocalAtomics;
+  return true;
+
+}
+
 // Identify functions like llvm.uadd.with.overflow which are essentially arithmetic instructions.
 static bool isPureCall(ShadowInstruction* SI) {
 
@@ -2552,7 +2806,7 @@ void IntegrationAttempt::emitOrSynthInst(ShadowInstruction* I, ShadowBB* BB, Sma
 
   if(useCallPath) {
     emitCall(BB, I, emitBB);
-    if(I->committedVal)
+    if(I->getCommittedVal())
       return;
     // Else fall through to fill in a committed value:
   }
@@ -2567,6 +2821,9 @@ void IntegrationAttempt::emitOrSynthInst(ShadowInstruction* I, ShadowBB* BB, Sma
      && (!pass->resolvedReadCalls.count(I)))
     return;
 
+  if(inst_is<AtomicRMWInst>(I) && tryEmitThreadLocalRMW(I, emitBB->specBlock))
+    return;
+
   // If a runtime check is required we need the literal instruction available.
   // The second parameter specifies this doesn't catch instructions that requires custom checks
   // such as VFS operations.
@@ -2575,7 +2832,7 @@ void IntegrationAttempt::emitOrSynthInst(ShadowInstruction* I, ShadowBB* BB, Sma
     Value* V;
     if(trySynthInst(I, emitBB->specBlock, V)) {
 
-      I->committedVal = V;
+      I->setCommittedVal(V);
       return;
 
     }
@@ -2694,7 +2951,7 @@ void IntegrationAttempt::commitLoopInstructions(const ShadowLoopInvar* ScopeL, u
     for(j = 0; j < BB->insts.size() && inst_is<PHINode>(&(BB->insts[j])); ++j) {
       
       ShadowInstruction* I = &(BB->insts[j]);
-      I->committedVal = 0;
+      I->setCommittedVal(0);
       emitOrSynthInst(I, BB, emitPHIsTo);
 
     }
@@ -2721,14 +2978,22 @@ void IntegrationAttempt::commitLoopInstructions(const ShadowLoopInvar* ScopeL, u
     for(; j < BB->insts.size(); ++j) {
 
       ShadowInstruction* I = &(BB->insts[j]);
-      I->committedVal = 0;
+      I->setCommittedVal(0);
       emitOrSynthInst(I, BB, emitBlockIt);
 
       // This only emits "check as expected" checks: simple comparisons that ensure a value
       // determined during specialisation matches the real value.
       // VFS ops (and perhaps others to come) produce special checks.
-      if(requiresRuntimeCheck(ShadowValue(I), false))
-	emitBlockIt = emitOrdinaryInstCheck(emitBlockIt, I);
+      if(requiresRuntimeCheck(ShadowValue(I), false)) {
+
+	if(checkCoalescesWithNext(BB, j))
+	  continue;
+	else if(checkCoalescesWithPrev(BB, j))
+	  emitBlockIt = emitCoalescedLoadChecks(emitBlockIt, BB, j);
+	else
+	  emitBlockIt = emitOrdinaryInstCheck(emitBlockIt, I);
+
+      }
 
     }
 
@@ -2746,6 +3011,120 @@ void IntegrationAttempt::commitLoopInstructions(const ShadowLoopInvar* ScopeL, u
 
 }
 
+// With -llpe-emit-debug-locs, each committed function gets a copy of its source function's subprogram,
+// and code committed into it is described as inlined there: instructions keep their source locations,
+// with an inlinedAt chain running through the call sites of the contexts that were committed inline.
+// Profiles of the specialised program then attribute samples to the original source lines and inline stacks.
+// Returns null if the source of the function we are committed into has no debug info.
+DILocation* InlineAttempt::getDebugInlinedAt() {
+
+  if(debugInlinedAtValid)
+    return debugInlinedAt;
+  debugInlinedAtValid = true;
+
+  LLVMContext& Ctx = F.getContext();
+
+  if(commitsOutOfLine()) {
+
+    DISubprogram* OrigSP = F.getSubprogram();
+    if(!OrigSP || !CommitF)
+      return 0;
+
+    DISubprogram* SP = CommitF->getSubprogram();
+    if(!SP) {
+      SP = MDNode::replaceWithDistinct(OrigSP->clone());
+      CommitF->setSubprogram(SP);
+    }
+
+    debugInlinedAt = DILocation::get(Ctx, SP->getLine(), 0, SP);
+    return debugInlinedAt;
+
+  }
+
+  ShadowInstruction* CallSI = Callers[0];
+  IntegrationAttempt* CallerIA = CallSI->parent->IA;
+  DILocation* ParentAt = CallerIA->getFunctionRoot()->getDebugInlinedAt();
+  if(!ParentAt)
+    return 0;
+
+  DenseMap<const MDNode*, MDNode*> Cache;
+  const DebugLoc& CallLoc = CallSI->invar->I->getDebugLoc();
+  if(CallLoc)
+    debugInlinedAt = DebugLoc::appendInlinedAt(CallLoc, ParentAt, Ctx, Cache).get();
+  else if(DISubprogram* CallerSP = CallerIA->F.getSubprogram())
+    debugInlinedAt = DILocation::get(Ctx, 0, 0, CallerSP, ParentAt);
+  else
+    debugInlinedAt = ParentAt;
+
+  return debugInlinedAt;
+
+}
+
+// NewI is a copy of an instruction in this context: with -llpe-emit-debug-locs, describe its location
+// as inlined into the function we're committing to. Otherwise it keeps the original location as is.
+void IntegrationAttempt::setCommittedDebugLoc(Instruction* NewI) {
+
+  if(!pass->emitDebugLocs)
+    return;
+
+  const DebugLoc& DL = NewI->getDebugLoc();
+  if(!DL)
+    return;
+
+  if(DILocation* At = getFunctionRoot()->getDebugInlinedAt()) {
+    DenseMap<const MDNode*, MDNode*> Cache;
+    NewI->setDebugLoc(DebugLoc::appendInlinedAt(DL, At, NewI->getContext(), Cache));
+  }
+
+}
+
+// A function with a subprogram may only hold locations inside it, and calls there must have one.
+// Give anything else, such as code synthesised for checks, a line 0 location in the function itself,
+// dropping debug intrinsics that would then describe variables of another function. Also set each
+// subprogram's linkage name now that the committed functions' names are final.
+void LLPEAnalysisPass::finishCommittedDebugLocs() {
+
+  for(SmallVector<Function*, 4>::iterator it = commitFunctions.begin(), itend = commitFunctions.end(); it != itend; ++it) {
+
+    Function* CF = *it;
+    DISubprogram* SP = CF->getSubprogram();
+    if(!SP)
+      continue;
+
+    LLVMContext& Ctx = CF->getContext();
+    SP->replaceLinkageName(MDString::get(Ctx, CF->getName()));
+    DILocation* Line0 = DILocation::get(Ctx, 0, 0, SP);
+
+    for(Function::iterator BI = CF->begin(), BE = CF->end(); BI != BE; ++BI) {
+
+      for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE;) {
+
+	Instruction* I = &*(II++);
+
+	if(DILocation* L = I->getDebugLoc().get()) {
+
+	  while(L->getInlinedAt())
+	    L = L->getInlinedAt();
+	  if(L->getScope()->getSubprogram() == SP)
+	    continue;
+
+	}
+
+	if(isa<DbgInfoIntrinsic>(I)) {
+	  I->eraseFromParent();
+	  continue;
+	}
+
+	I->setDebugLoc(Line0);
+
+      }
+
+    }
+
+  }
+
+}
+
 // Apply the same debug tag to all of 'blocks'. Used to provide simple insight in GDB about the provenance
 // of specialised code that crashes.
 static void applyLocToBlocks(const DebugLoc& loc, const std::vector<BasicBlock*>& blocks) {
@@ -3022,6 +3401,8 @@ static void releaseCC(std::vector<Function*>& CommitFunctions, std::vector<Basic
 
     // This (and children) already in a function: kill it.
     unregisterCommittedAllocations(CF);
+    SmallVector<Function*, 4>& CFs = GlobalIHP->commitFunctions;
+    CFs.erase(std::remove(CFs.begin(), CFs.end(), CF), CFs.end());
     CF->dropAllReferences();
     CF->eraseFromParent();
 
@@ -3233,39 +3614,73 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
 	}
 
 	pass->indirectDIEUsers.erase(SI);
-	pass->memcpyValues.erase(SI);
+	forgetMemcpyValues(SI);
 	pass->forwardableOpenCalls.erase(SI);
 	pass->resolvedReadCalls.erase(SI);
 	pass->resolvedSeekCalls.erase(SI);
 
       }
-
-      delete BB;
       
     }
 
   }
 
-  delete[] BBs;
-  BBs = 0;
+  freeBBs();
+  GlobalContextCounter.free();
 
   commitState = COMMIT_FREED;
 
 }
 
+// Free LPA, a peel attempt that has been found not to terminate, ahead of this context's commit.
+// As with a disabled call, allocations and FDs it created are marked committed without a value.
+// Returns false if LPA has been retained for the user to inspect.
+bool IntegrationAttempt::discardPeelAttempt(PeelAttempt* LPA) {
+
+  if(IHPSaveDOTFiles)
+    return false;
+
+  for(uint32_t i = 0, ilim = LPA->Iterations.size(); i != ilim; ++i) {
+
+    PeelIteration* PI = LPA->Iterations[i];
+    PI->markAllocationsAndFDsCommitted();
+    PI->releaseMemoryPostCommit();
+    pass->IAs[PI->SeqNumber] = 0;
+
+  }
+
+  pass->stats.discardedPeelIterations += LPA->Iterations.size();
+
+  peelChildren.erase(LPA->L);
+  delete LPA;
+  noteCFGChange();
+  return true;
+
+}
+
 // Master commit entry point. inLoopAnalyser indicates that we're
 // committing in the context of some enclosing unbounded loop, so we have
 // a general-case analysis for this function instead of a per-iteration one.
 void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
 
-  countTentativeInstructions();
-  collectStats();
+  {
+    PhaseTimer T(PHASE_BENEFIT);
+
+    countTentativeInstructions();
+    collectStats();
 	
-  // This call will disable the context if it's not a good idea.
-  findProfitableIntegration();
+    // This call will disable the context if it's not a good idea.
+    findProfitableIntegration();
+
+    // Trim (or disable) it if it would overrun -llpe-max-output-insts.
+    if(isEnabled())
+      applyOutputBudget();
+  }
 
   if(isEnabled()) {
 
+    PhaseTimer T(PHASE_COMMIT);
+
     // The TL and DSE stores were backed up to deal with the possibility
     // that the context would not be committed: we don't need those after all.
     releaseBackupStores();
@@ -3283,7 +3698,15 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     findSaveSplits();
 
     // Find dead instructions.
-    runDIE();
+    {
+      PhaseTimer DT(PHASE_DIE);
+      runDIE();
+    }
+
+    if(logEnabled(LOG_TL))
+      TLDump(this);
+    if(logEnabled(LOG_DSE))
+      DSEDump(this);
 
     // Save a DOT representation if need be, for the GUI to use.
     saveDOT();
@@ -3292,11 +3715,16 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     commitCFG();
     commitArgsAndInstructions();
 
-    postCommitOptimise();
+    {
+      PhaseTimer PT(PHASE_POSTCOMMIT);
+      postCommitOptimise();
+    }
 
   }
   else {
 
+    PhaseTimer T(PHASE_COMMIT);
+
     // Save a DOT representation if need be, for the GUI to use.
     saveDOT();
 
@@ -3312,7 +3740,10 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
 
     // Must rerun tentative load and DSE analyses accounting
     // for the fact that the stage will not be committed.
-    rerunTentativeLoads(activeCaller, this, inLoopAnalyser);
+    {
+      PhaseTimer TT(PHASE_TENTATIVE_LOADS);
+      rerunTentativeLoads(activeCaller, this, inLoopAnalyser);
+    }
 
     // For now this is simply a barrier to DSE.
     setAllNeededTop(backupDSEStore);
@@ -3330,6 +3761,122 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
   // Free all ShadowBBs, ShadowInstructions and similar.
   releaseMemoryPostCommit();
 
+  // Only our parent's commit still refers to this object, to gather our committed blocks.
+  // Unless we remain available for sharing, the dependency information can go now
+  // rather than when the parent is freed.
+  if(!registeredSharable && commitState == COMMIT_FREED && !IHPSaveDOTFiles)
+    releaseSharingState();
+
+}
+
+static bool heapIndexBefore(const std::pair<Value*, uint32_t>& A, const std::pair<Value*, uint32_t>& B) {
+
+  return A.second < B.second;
+
+}
+
+// Replace committed mallocs whose objects are allocated once, have a known size and are never freed
+// with internal globals (see -llpe-static-heap). An object is only known never to be freed if its pointer
+// never escaped (so every free that might release it was analysed) and no analysed free might have
+// released it. Specialised code mustn't be able to branch to unspecialised code, which could free
+// the object without us having seen it.
+void LLPEAnalysisPass::makeHeapAllocationsStatic() {
+
+  if(heapMayBeFreedVaguely || committedFailedBlocks)
+    return;
+
+  // Visit in heap index order, as the map's order would make global creation vary from run to run.
+  std::vector<std::pair<Value*, uint32_t> > Allocs(committedHeapAllocations.begin(), committedHeapAllocations.end());
+  std::sort(Allocs.begin(), Allocs.end(), heapIndexBefore);
+
+  for(std::vector<std::pair<Value*, uint32_t> >::iterator it = Allocs.begin(), itend = Allocs.end(); it != itend; ++it) {
+
+    AllocData& AD = heap[it->second];
+    CallInst* CI = dyn_cast<CallInst>(it->first);
+    if((!CI) || AD.mayEscape || !AD.committedOnce || AD.storeSize == ULONG_MAX || AD.storeSize == 0)
+      continue;
+
+    // Only allocators with no other effect. Globals start zeroed, as calloc requires.
+    Function* CalledF = CI->getCalledFunction();
+    if((!CalledF) || !(CalledF->getName() == "malloc" || CalledF->getName() == "calloc"))
+      continue;
+
+    ArrayType* HeapTy = ArrayType::get(Type::getInt8Ty(CI->getContext()), AD.storeSize);
+    GlobalVariable* HeapGV = new GlobalVariable(*getGlobalModule(), HeapTy, false, GlobalVariable::InternalLinkage,
+						ConstantAggregateZero::get(HeapTy), "llpe.static.heap");
+    // -llpe-malloc-alignment defaults to 1, meaning unknown: be at least as aligned as a typical malloc.
+    HeapGV->setAlignment(std::max(mallocAlignment, 16U));
+
+    CI->replaceAllUsesWith(ConstantExpr::getBitCast(HeapGV, CI->getType()));
+    CI->eraseFromParent();
+
+    AD.committedVal = HeapGV;
+    committedHeapAllocations.erase(it->first);
+
+    ++stats.staticHeapAllocations;
+    stats.staticHeapBytes += AD.storeSize;
+
+  }
+
+}
+
+// With -llpe-block-map, write a line "function index context" for each surviving committed block,
+// where index is the block's position in its function and context is the SeqNumber shown by the GUI
+// and used as the id in the stats file's context records.
+void LLPEAnalysisPass::writeBlockMap() {
+
+  DenseMap<BasicBlock*, uint32_t> BlockIdx;
+  for(SmallVector<Function*, 4>::iterator it = commitFunctions.begin(), itend = commitFunctions.end(); it != itend; ++it) {
+
+    uint32_t i = 0;
+    for(Function::iterator BI = (*it)->begin(), BE = (*it)->end(); BI != BE; ++BI, ++i)
+      BlockIdx[&*BI] = i;
+
+  }
+
+  std::error_code error;
+  raw_fd_ostream Out(blockMapFile.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "Failed to open " << blockMapFile << ": " << error.message() << "\n";
+    return;
+  }
+
+  for(std::vector<std::pair<WeakVH, uint32_t> >::iterator it = committedBlockContexts.begin(),
+	itend = committedBlockContexts.end(); it != itend; ++it) {
+
+    BasicBlock* BB = cast_or_null<BasicBlock>((Value*)it->first);
+    if(!BB || !BB->getParent())
+      continue;
+
+    DenseMap<BasicBlock*, uint32_t>::iterator findit = BlockIdx.find(BB);
+    if(findit == BlockIdx.end())
+      continue;
+
+    Out << BB->getParent()->getName() << " " << findit->second << " " << it->second << "\n";
+
+  }
+
+}
+
+// Write each runtime diagnostic's message, as its site index then the printf format it would have printed
+// its reported value with, escaped to fit one line.
+void LLPEAnalysisPass::writeRuntimeReportTable() {
+
+  std::error_code error;
+  raw_fd_ostream Out(runtimeReportTable.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "Failed to open " << runtimeReportTable << ": " << error.message() << "\n";
+    return;
+  }
+
+  for(uint32_t i = 0, ilim = runtimeReports.size(); i != ilim; ++i) {
+
+    Out << i << "\t";
+    Out.write_escaped(runtimeReports[i]);
+    Out << "\n";
+
+  }
+
 }
 
 // Root commit entry point.
@@ -3372,6 +3919,27 @@ void LLPEAnalysisPass::commit() {
 
   }
 
+  if(!inputManifestFile.empty())
+    writeInputManifest();
+
+  // Before merging functions, which would delete instrumented blocks.
+  if(countFailures)
+    instrumentFailurePaths();
+
+  if(shareLandingPads)
+    shareIdenticalLandingPads();
+
+  if(staticHeap)
+    makeHeapAllocationsStatic();
+
+  redirectReadOnlyReadBuffers();
+
+  // First, so functions differing only in which copy of a constant they use can then be merged.
+  mergeIdenticalConstantGlobals(*getGlobalModule());
+
+  if(mergeIdenticalFunctions)
+    mergeIdenticalCommittedFunctions();
+
   // If requested, write verbose stats about this specialisation attempt.
   if(!statsFile.empty()) {
 
@@ -3383,9 +3951,27 @@ void LLPEAnalysisPass::commit() {
       errs() << "Failed to open " << statsFile << ": " << error.message() << "\n";
     else
       stats.print(RFO);
+
+    // Machine-readable phase timings and counters go alongside:
+    std::string jsonFile = statsFile + ".json";
+    raw_fd_ostream JFO(jsonFile.c_str(), error, sys::fs::F_None);
+    if(error)
+      errs() << "Failed to open " << jsonFile << ": " << error.message() << "\n";
+    else
+      stats.printPhasesJSON(JFO);
+
+    // As well as a record for each context:
+    std::string contextsFile = statsFile + ".contexts.json";
+    raw_fd_ostream CFO(contextsFile.c_str(), error, sys::fs::F_None);
+    if(error)
+      errs() << "Failed to open " << contextsFile << ": " << error.message() << "\n";
+    else
+      stats.printContextsJSON(CFO);
   }
 
-  // Redirect internal callers to use the specialised fuction.
+  // Redirect internal callers to use the specialised fuction. Any not yet read from a lazily loaded
+  // module must be read now, or they would keep calling the original.
+  materializeModule(*RootIA->F.getParent());
   RootIA->F.replaceAllUsesWith(RootIA->CommitF);
 
   // Also exchange names so that external users will use this new version:
@@ -3398,7 +3984,41 @@ void LLPEAnalysisPass::commit() {
   RootIA->CommitF->takeName(&(RootIA->F));
   RootIA->F.setName(oldFName);
 
+  if(!exportVariant.empty())
+    exportAsVariant();
+
+  if(emitDebugLocs)
+    finishCommittedDebugLocs();
+
+  if(!blockMapFile.empty())
+    writeBlockMap();
+
+  if(!runtimeReportTable.empty())
+    writeRuntimeReportTable();
+
+  // The GUI goes on inspecting analysis results, which refer to constants the module may not use.
+  if(!IHPSaveDOTFiles)
+    sweepDeadConstants(*RootIA->F.getParent());
+
   errs() << "\n";
 
 }
 
+// Analysis makes a great many ConstantExprs, by folding casts, GEPs and pointer arithmetic over globals
+// and by reading back stored values, that the committed module never uses. The LLVMContext keeps them
+// uniqued for the rest of the process, so once nothing will read analysis results again, destroy those
+// without a user. Constants not built on a global (e.g. ConstantInts) can't be reclaimed, which is why
+// integer results are kept as plain ShadowValue ints where possible.
+void LLPEAnalysisPass::sweepDeadConstants(Module& M) {
+
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it)
+    it->removeDeadConstantUsers();
+
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it)
+    it->removeDeadConstantUsers();
+
+  for(Module::alias_iterator it = M.alias_begin(), itend = M.alias_end(); it != itend; ++it)
+    it->removeDeadConstantUsers();
+
+}
+
@@ -103,13 +103,14 @@ static Function* getFunctionFor(Value* V) {
 // users that refer to that allocation.
 // With some cunning trickery we could get the value forwarded by function return values
 // and arguments; here we use the simpler solution of storing Fwd to a global as it is created and then
-// loading it at each non-local user.
+// loading it once in each block with a non-local user.
 // The disadvantage is this might confuse downstream alias analysis a little.
 void llvm::forwardReferences(Value* Fwd, Module* M) {
 
-  GlobalVariable* NewGV = 0;
-
-  SmallVector<std::pair<Use*, Instruction*>, 4> replaceUses;
+  // Non-local uses grouped by the block the load for them must go in, along with
+  // the instruction it must precede. Blocks are kept in the order first seen.
+  SmallVector<BasicBlock*, 4> useBlocks;
+  DenseMap<BasicBlock*, SmallVector<std::pair<Use*, Instruction*>, 4> > blockUses;
 
   for(Instruction::user_iterator UI = Fwd->user_begin(),
 	UE = Fwd->user_end(); UI != UE; ++UI) {
@@ -123,16 +124,6 @@ void llvm::forwardReferences(Value* Fwd, Module* M) {
 
 	// This user is non-local: replace it. Use aux list because Use::set invalidates a user_iterator.
 
-	if(!NewGV) {
-
-	  // Create a global and a store at the definition site.
-	  NewGV = new GlobalVariable(*M, Fwd->getType(), false, GlobalVariable::InternalLinkage, 
-				     UndefValue::get(Fwd->getType()), "specglobalfwd");
-	  Instruction* InsertLoc = getInsertLocation(Fwd);
-	  new StoreInst(Fwd, NewGV, InsertLoc);
-
-	}
-
 	Instruction* InsertBefore;
 	if(PHINode* PN = dyn_cast<PHINode>(UserI)) {
 
@@ -155,8 +146,10 @@ void llvm::forwardReferences(Value* Fwd, Module* M) {
 
 	}
 
-	Instruction* Fwd = new LoadInst(NewGV, "", InsertBefore);
-	replaceUses.push_back(std::make_pair(U, Fwd));
+	SmallVector<std::pair<Use*, Instruction*>, 4>& Uses = blockUses[InsertBefore->getParent()];
+	if(Uses.empty())
+	  useBlocks.push_back(InsertBefore->getParent());
+	Uses.push_back(std::make_pair(U, InsertBefore));
 
       }
 
@@ -164,11 +157,37 @@ void llvm::forwardReferences(Value* Fwd, Module* M) {
 
   }
 
-  // Do the actual replacements now we don't need the user_iterator.
-  for(SmallVector<std::pair<Use*, Instruction*>, 4>::iterator it = replaceUses.begin(),
-	itend = replaceUses.end(); it != itend; ++it) {
+  if(useBlocks.empty())
+    return;
+
+  // Create a global and a store at the definition site.
+  GlobalVariable* NewGV = new GlobalVariable(*M, Fwd->getType(), false, GlobalVariable::InternalLinkage, 
+					     UndefValue::get(Fwd->getType()), "specglobalfwd");
+  Instruction* InsertLoc = getInsertLocation(Fwd);
+  new StoreInst(Fwd, NewGV, InsertLoc);
+
+  ++GlobalIHP->stats.forwardedValues;
+
+  // Do the actual replacements now we don't need the user_iterator. Each block gets one load,
+  // ahead of the first instruction needing it, which dominates the rest.
+  for(SmallVector<BasicBlock*, 4>::iterator it = useBlocks.begin(), itend = useBlocks.end(); it != itend; ++it) {
 
-    it->first->set(it->second);
+    SmallVector<std::pair<Use*, Instruction*>, 4>& Uses = blockUses[*it];
+
+    SmallPtrSet<Instruction*, 4> InsertPoints;
+    for(SmallVector<std::pair<Use*, Instruction*>, 4>::iterator useit = Uses.begin(), useend = Uses.end(); useit != useend; ++useit)
+      InsertPoints.insert(useit->second);
+
+    BasicBlock::iterator First = (*it)->begin();
+    while(!InsertPoints.count(&*First))
+      ++First;
+
+    Instruction* InsertBefore = &*First;
+    Instruction* Load = new LoadInst(NewGV, "", InsertBefore);
+    ++GlobalIHP->stats.forwardingLoads;
+
+    for(SmallVector<std::pair<Use*, Instruction*>, 4>::iterator useit = Uses.begin(), useend = Uses.end(); useit != useend; ++useit)
+      useit->first->set(Load);
 
   }
 
@@ -197,38 +216,40 @@ void LLPEAnalysisPass::fixNonLocalUses() {
 
   // Similar to the above, but also take care of FDs which are always global.
 
-  for(std::vector<AllocData>::iterator it = heap.begin(),
-	itend = heap.end(); it != itend; ++it) {
+  for(uint32_t i = 0, ilim = heap.size(); i != ilim; ++i) {
+
+    AllocData& AD = heap[i];
 
-    if(!it->allocValue.isInst())
+    if(!AD.allocValue.isInst())
       continue;
 
-    if(!it->committedVal) {
+    if(!AD.committedVal) {
 
-      errs() << "Warning: heap allocation " << it->allocIdx << " not committed\n";
+      errs() << "Warning: heap allocation " << AD.allocIdx << " not committed\n";
       continue;
 
     }
 
-    patchReferences(it->PatchRefs, it->committedVal);
-    forwardReferences(it->committedVal, getGlobalModule());
+    patchReferences(AD.PatchRefs, AD.committedVal);
+    forwardReferences(AD.committedVal, getGlobalModule());
 
   }
 
-  for(std::vector<FDGlobalState>::iterator it = fds.begin(),
-	itend = fds.end(); it != itend; ++it) {
+  for(uint32_t i = 0, ilim = fds.size(); i != ilim; ++i) {
+
+    FDGlobalState& FDS = fds[i];
 
-    if(!it->CommittedVal) {
+    if(!FDS.CommittedVal) {
 
-      if(it->SI)
+      if(FDS.SI)
 	errs() << "Warning: some FD not committed\n";
 
       continue;
 
     }
 
-    patchReferences(it->PatchRefs, it->CommittedVal);
-    forwardReferences(it->CommittedVal, getGlobalModule());
+    patchReferences(FDS.PatchRefs, FDS.CommittedVal);
+    forwardReferences(FDS.CommittedVal, getGlobalModule());
 
   }
   
@@ -237,14 +258,16 @@ void LLPEAnalysisPass::fixNonLocalUses() {
 // Set all child functions to use the same commit function as this context.
 void IntegrationAttempt::inheritCommitFunction() {
 
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
-        itend = peelChildren.end(); it != itend; ++it) {
+  SmallVector<PeelAttempt*, 4> Peels;
+  getOrderedPeelChildren(Peels);
 
-    if((!it->second->isEnabled()) || !it->second->isTerminated())
+  for(SmallVector<PeelAttempt*, 4>::iterator it = Peels.begin(), itend = Peels.end(); it != itend; ++it) {
+
+    if((!(*it)->isEnabled()) || !(*it)->isTerminated())
       continue;
 
-    for(std::vector<PeelIteration*>::iterator iterit = it->second->Iterations.begin(),
-	  iteritend = it->second->Iterations.end(); iterit != iteritend; ++iterit)
+    for(std::vector<PeelIteration*>::iterator iterit = (*it)->Iterations.begin(),
+	  iteritend = (*it)->Iterations.end(); iterit != iteritend; ++iterit)
       (*iterit)->inheritCommitFunction();
     
   }
@@ -335,16 +358,19 @@ uint64_t IntegrationAttempt::findSaveSplits() {
     
   }
 
-  // Count residual instructions belonging to our child contexts.
+  // Count residual instructions belonging to our child contexts. This may create residual functions
+  // (see splitCommitHere), so go in loop order to keep the module's function order stable.
+
+  SmallVector<PeelAttempt*, 4> Peels;
+  getOrderedPeelChildren(Peels);
 
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
-	itend = peelChildren.end(); it != itend; ++it) {
+  for(SmallVector<PeelAttempt*, 4>::iterator it = Peels.begin(), itend = Peels.end(); it != itend; ++it) {
 
-    if((!it->second->isEnabled()) || !it->second->isTerminated())
+    if((!(*it)->isEnabled()) || !(*it)->isTerminated())
       continue;
 
-    for(std::vector<PeelIteration*>::iterator iterit = it->second->Iterations.begin(),
-	  iteritend = it->second->Iterations.end(); iterit != iteritend; ++iterit)
+    for(std::vector<PeelIteration*>::iterator iterit = (*it)->Iterations.begin(),
+	  iteritend = (*it)->Iterations.end(); iterit != iteritend; ++iterit)
       residualInstructionsHere += (*iterit)->findSaveSplits();
 
   }
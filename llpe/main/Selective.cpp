@@ -58,10 +58,15 @@ void InlineAttempt::setEnabled(bool en, bool skipStats) {
   if(isPathCondition)
     return;
 
+  if(enabled == en)
+    return;
+
   enabled = en;
 
-  if(!skipStats)
-    pass->getRoot()->collectStats();
+  // Our instruction counts don't depend on whether we're enabled, so only the ancestors'
+  // integration goodness needs updating for our own subtree joining or leaving theirs.
+  if((!skipStats) && integrationGoodnessValid && uniqueParent)
+    uniqueParent->updateIntegrationGoodness(en ? totalIntegrationGoodness : -totalIntegrationGoodness);
 
 }
 
@@ -73,7 +78,21 @@ void PeelIteration::setEnabled(bool en, bool skipStats) {
 
 void PeelAttempt::setEnabled(bool en, bool skipStats) {
 
+  if(skipStats || enabled == en) {
+    enabled = en;
+    return;
+  }
+
+  // As well as our iterations joining or leaving the parent's total, the parent counts the
+  // loop's blocks as its own when we're disabled, so re-evaluate its own goodness either side.
+  int64_t oldOwn = parent->getOwnIntegrationGoodness();
   enabled = en;
+  int64_t Delta = parent->getOwnIntegrationGoodness() - oldOwn;
+
+  if(integrationGoodnessValid)
+    Delta += en ? totalIntegrationGoodness : -totalIntegrationGoodness;
+
+  parent->updateIntegrationGoodness(Delta);
 
 }
 
@@ -178,3 +197,203 @@ bool IntegrationAttempt::allAncestorsEnabled() {
   return true;
 
 }
+
+// Output size budgeting (-llpe-max-output-insts). Contexts are committed bottom-up as their
+// analysis completes, so rather than choosing from the whole context tree at once we keep a
+// running estimate of the specialised instructions committed so far, and as each function context
+// is finalised disable its least beneficial loop peels, by goodness per instruction saved, until
+// it fits in what remains. If even the unpeeled version won't fit the context itself is disabled.
+// Code later released because a parent was disabled is not subtracted, so the estimate errs
+// towards overcounting.
+
+// Estimate the instructions this context will emit, excluding child calls that have already
+// been committed and so counted.
+int64_t IntegrationAttempt::estimateOutputInstructions() {
+
+  int64_t total = 0;
+
+  for(uint32_t i = BBsOffset, ilim = BBsOffset + nBBs; i != ilim; ++i) {
+
+    ShadowBBInvar* BBI = getBBInvar(i);
+    if(BBI->naturalScope != L && ((!L) || L->contains(BBI->naturalScope))) {
+
+      // Enabled child loops are counted below.
+      PeelAttempt* LPA = getPeelAttempt(immediateChildLoop(L, BBI->naturalScope));
+      if(LPA && LPA->isTerminated() && LPA->isEnabled()) {
+
+	const ShadowLoopInvar* childL = immediateChildLoop(L, BBI->naturalScope);
+	while(i != ilim && childL->contains(getBBInvar(i)->naturalScope))
+	  ++i;
+	--i;
+	continue;
+
+      }
+
+    }
+
+    ShadowBB* BB = getBB(*BBI);
+    if(!BB)
+      continue;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      if(!willBeReplacedWithConstantOrDeleted(ShadowValue(&BB->insts[j])))
+	++total;
+
+    }
+
+  }
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    if(it->second->isEnabled() && it->second->isTerminated())
+      total += it->second->estimateOutputInstructions();
+
+  }
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    if(it->second->isEnabled() && !it->second->isCommitted())
+      total += it->second->estimateOutputInstructions();
+
+  }
+
+  return total;
+
+}
+
+int64_t PeelAttempt::estimateOutputInstructions() {
+
+  int64_t total = 0;
+  for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), itend = Iterations.end(); it != itend; ++it)
+    total += (*it)->estimateOutputInstructions();
+
+  return total;
+
+}
+
+// Size of the loop if left unpeeled, i.e. as in the original program.
+int64_t PeelAttempt::getUnpeeledInstructions() {
+
+  int64_t total = 0;
+  ShadowFunctionInvar* invarInfo = parent->invarInfo;
+
+  for(uint32_t i = L->headerIdx, ilim = invarInfo->BBs.size(); i != ilim; ++i) {
+
+    ShadowBBInvar* BBI = &invarInfo->BBs[i];
+    if(!L->contains(BBI->naturalScope))
+      break;
+    total += BBI->insts.size();
+
+  }
+
+  return total;
+
+}
+
+// Find enabled loop peels that could be disabled to save space. Peels nested within
+// another candidate are only offered once their parent is known to stay.
+void IntegrationAttempt::collectBudgetCandidates(std::vector<PeelAttempt*>& Candidates) {
+
+  // In loop order, so that ties in goodness are broken the same way every run.
+  SmallVector<PeelAttempt*, 4> Peels;
+  getOrderedPeelChildren(Peels);
+
+  for(SmallVector<PeelAttempt*, 4>::iterator it = Peels.begin(), itend = Peels.end(); it != itend; ++it) {
+
+    PeelAttempt* LPA = *it;
+    if(LPA->isEnabled() && LPA->isTerminated())
+      Candidates.push_back(LPA);
+
+  }
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    if(it->second->isEnabled() && !it->second->isCommitted())
+      it->second->collectBudgetCandidates(Candidates);
+
+  }
+
+}
+
+void InlineAttempt::applyOutputBudget() {
+
+  if(!pass->maxOutputInsts)
+    return;
+
+  int64_t remaining = ((int64_t)pass->maxOutputInsts) - ((int64_t)pass->outputInsts);
+  int64_t size = estimateOutputInstructions();
+
+  // Peels that have been judged worth keeping; their children may be offered instead.
+  SmallPtrSet<PeelAttempt*, 8> Kept;
+
+  while(size > remaining) {
+
+    std::vector<PeelAttempt*> Candidates;
+    collectBudgetCandidates(Candidates);
+
+    // Expand kept peels into their iterations' own candidates:
+    for(uint32_t i = 0; i != Candidates.size(); ++i) {
+
+      PeelAttempt* LPA = Candidates[i];
+      if(!Kept.count(LPA))
+	continue;
+
+      for(std::vector<PeelIteration*>::iterator it = LPA->Iterations.begin(), 
+	    itend = LPA->Iterations.end(); it != itend; ++it)
+	(*it)->collectBudgetCandidates(Candidates);
+
+    }
+
+    // Pick the peel with the least goodness per instruction it would save.
+    PeelAttempt* Worst = 0;
+    double WorstRatio = 0;
+    bool newlyKept = false;
+
+    for(std::vector<PeelAttempt*>::iterator it = Candidates.begin(), itend = Candidates.end(); it != itend; ++it) {
+
+      PeelAttempt* LPA = *it;
+      if(Kept.count(LPA))
+	continue;
+
+      int64_t saving = LPA->estimateOutputInstructions() - LPA->getUnpeeledInstructions();
+      if(saving <= 0) {
+	Kept.insert(LPA);
+	newlyKept = true;
+	continue;
+      }
+
+      double ratio = ((double)LPA->totalIntegrationGoodness) / saving;
+      if((!Worst) || ratio < WorstRatio) {
+	Worst = LPA;
+	WorstRatio = ratio;
+      }
+
+    }
+
+    if(!Worst) {
+
+      // Kept peels may have children worth trimming:
+      if(newlyKept)
+	continue;
+
+      // Nothing left to trim that would help.
+      errs() << "Output budget exhausted: not specialising " << getShortHeader() << "\n";
+      setEnabled(false, true);
+      
+      // Root and shared contexts can't be disabled; commit them regardless.
+      if(isEnabled())
+	break;
+      return;
+
+    }
+
+    Worst->setEnabled(false, true);
+    size = estimateOutputInstructions();
+    
+  }
+
+  pass->outputInsts += size;
+
+}
@@ -16,63 +16,146 @@
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/LLPE.h"
+#include "llvm/ADT/BitVector.h"
 #include "llvm/Support/AtomicOrdering.h"
 
 using namespace llvm;
 
-// Find a topological ordering starting from BB, writing the result to Result and using Visited to keep track of visited blocks.
-// LI is the LoopInfo object for BB's parent function and MyL is the loop context we're currently exploring.
-// Child loops are handled by continuing our own top-ordering from the loop exit blocks and then independently
-// ordering the loop's blocks disregarding its latch edge.
-void llvm::createTopOrderingFrom(BasicBlock* BB, std::vector<BasicBlock*>& Result, SmallSet<BasicBlock*, 8>& Visited, LoopInfo* LI, const Loop* MyL) {
+// Switches with at least this many cases get a case value index.
+static const uint32_t MinIndexedSwitchCases = 8;
 
-  const Loop* BBL = LI ? LI->getLoopFor(BB) : 0;
-  
-  // Drifted out of scope?
-  if(MyL != BBL && ((!BBL) || (BBL->contains(MyL))))
-    return;
+// One block being explored by createTopOrderingFrom: first its loop's exit blocks, if it enters a loop
+// (exitsIdx indexes the cached exit block lists), then its successors.
+struct TopOrderFrame {
 
-  // Already been here?
-  auto insertres = Visited.insert(BB);
-  if(!insertres.second)
-    return;
+  BasicBlock* BB;
+  const Loop* MyL;
+  const Loop* BBL;
+  int32_t exitsIdx;
+  uint32_t nextExit;
+  succ_iterator SI, SE;
 
-  // Follow loop exiting edges if any.
-  // Ordering here: first the loop's successors, then the loop body (by walking to the header
-  // with succ_iterator below) and then this block, the preheader.
-  if(MyL != BBL) {
+  TopOrderFrame(BasicBlock* _BB, const Loop* _MyL, const Loop* _BBL) : BB(_BB), MyL(_MyL), BBL(_BBL), exitsIdx(-1), nextExit(0),
+								       SI(succ_begin(_BB)), SE(succ_end(_BB)) {}
+
+};
+
+struct TopOrderState {
+
+  LoopInfo* LI;
+  DenseMap<BasicBlock*, uint32_t> blockNums;
+  BitVector visited;
+  DenseMap<const Loop*, uint32_t> loopExitsIdx;
+  std::vector<SmallVector<BasicBlock*, 4> > loopExits;
+  std::vector<TopOrderFrame> stack;
+
+  // Start exploring BB if it is within MyL and not yet visited.
+  void enter(BasicBlock* BB, const Loop* MyL) {
+
+    const Loop* BBL = LI ? LI->getLoopFor(BB) : 0;
+
+    // Drifted out of scope?
+    if(MyL != BBL && ((!BBL) || (BBL->contains(MyL))))
+      return;
+
+    // Already been here?
+    uint32_t num = blockNums[BB];
+    if(visited.test(num))
+      return;
+    visited.set(num);
+
+    stack.push_back(TopOrderFrame(BB, MyL, BBL));
+
+    if(MyL != BBL) {
+
+      std::pair<DenseMap<const Loop*, uint32_t>::iterator, bool> insres = 
+	loopExitsIdx.insert(std::make_pair(BBL, (uint32_t)loopExits.size()));
+      if(insres.second) {
+	loopExits.push_back(SmallVector<BasicBlock*, 4>());
+	BBL->getExitBlocks(loopExits.back());
+      }
+      stack.back().exitsIdx = insres.first->second;
 
-    SmallVector<BasicBlock*, 4> ExitBlocks;
-    BBL->getExitBlocks(ExitBlocks);
-    for(SmallVector<BasicBlock*, 4>::iterator it = ExitBlocks.begin(), it2 = ExitBlocks.end(); it != it2; ++it) {
-      
-      createTopOrderingFrom(*it, Result, Visited, LI, MyL);
-      
     }
 
   }
 
-  // Explore all successors within this loop. This will enter a child loop if this BB is a preheader;
-  // note BBL may not equal MyL, but is certainly its child.
-  for(succ_iterator SI = succ_begin(BB), SE = succ_end(BB); SI != SE; ++SI) {
+};
+
+// Find a topological ordering starting from BB, writing the result to Result. Blocks from excludeFrom
+// to the end of BB's function are treated as already visited. LI is the LoopInfo object for BB's parent
+// function, or null to ignore loops. Child loops are handled by continuing our own top-ordering from the
+// loop exit blocks and then independently ordering the loop's blocks disregarding its latch edge.
+// The walk uses an explicit stack, as generated functions can be deep enough to overflow ours.
+void llvm::createTopOrderingFrom(BasicBlock* BB, std::vector<BasicBlock*>& Result, LoopInfo* LI, Function::iterator excludeFrom) {
+
+  Function* F = BB->getParent();
+
+  TopOrderState S;
+  S.LI = LI;
+  S.visited.resize(F->size());
+  S.blockNums.reserve(F->size());
+
+  bool excluding = false;
+  uint32_t num = 0;
+  for(Function::iterator it = F->begin(), itend = F->end(); it != itend; ++it, ++num) {
+
+    if(it == excludeFrom)
+      excluding = true;
+    S.blockNums[&*it] = num;
+    if(excluding)
+      S.visited.set(num);
 
-    createTopOrderingFrom(*SI, Result, Visited, LI, BBL);
-    
   }
 
-  Result.push_back(BB);
+  S.enter(BB, 0);
+
+  while(!S.stack.empty()) {
+
+    TopOrderFrame& Fr = S.stack.back();
+
+    // Follow loop exiting edges if any.
+    // Ordering here: first the loop's successors, then the loop body (by walking to the header
+    // with succ_iterator below) and then this block, the preheader.
+    if(Fr.exitsIdx != -1 && Fr.nextExit != S.loopExits[Fr.exitsIdx].size()) {
+
+      BasicBlock* Exit = S.loopExits[Fr.exitsIdx][Fr.nextExit++];
+      // Note Fr is invalidated by pushing a new frame.
+      S.enter(Exit, Fr.MyL);
+      continue;
+
+    }
+
+    // Explore all successors within this loop. This will enter a child loop if this BB is a preheader;
+    // note BBL may not equal MyL, but is certainly its child.
+    if(Fr.SI != Fr.SE) {
+
+      BasicBlock* Succ = *Fr.SI;
+      ++Fr.SI;
+      S.enter(Succ, Fr.BBL);
+      continue;
+
+    }
+
+    Result.push_back(Fr.BB);
+    S.stack.pop_back();
+
+  }
 
 }
 
 // Build a list of loop headers contained within L, including its own header.
-static void ignoreChildLoops(SmallSet<BasicBlock*, 1>& headers, const Loop* L) {
+static void ignoreChildLoops(SmallSet<BasicBlock*, 1>& headers, const ShadowLoopShape& L, ShadowFunctionInvar* FInfo) {
 
-  headers.insert(L->getHeader());
-  for(Loop::iterator it = L->begin(), itend = L->end(); it != itend; ++it)
-    ignoreChildLoops(headers, *it);
+  headers.insert(FInfo->BBs[L.headerIdx].BB);
+  for(std::vector<ShadowLoopShape>::const_iterator it = L.childLoops.begin(), itend = L.childLoops.end(); it != itend; ++it)
+    ignoreChildLoops(headers, *it, FInfo);
   
 }
 
@@ -87,39 +170,124 @@ const ShadowLoopInvar* LLPEAnalysisPass::applyIgnoreLoops(const ShadowLoopInvar*
 
 }
 
-// Translate the information in LoopInfo descriptor L into a ShadowLoopInvar object, which uses block-indices instead
+// Translate the information in LoopInfo descriptor L into a ShadowLoopShape, which uses block-indices instead
 // of BasicBlock* pointers.
+static void getLoopShape(const Loop* L, DenseMap<BasicBlock*, uint32_t>& BBIndices, DominatorTree* DT, ShadowLoopShape& Shape) {
+
+  release_assert(L->isLoopSimplifyForm() && L->isLCSSAForm(*DT) && "Don't forget to run loopsimplify and lcssa first!");
+
+  Shape.headerIdx = BBIndices[L->getHeader()];
+  Shape.preheaderIdx = BBIndices[L->getLoopPreheader()];
+  Shape.latchIdx = BBIndices[L->getLoopLatch()];
+  Shape.nBlocks = L->getBlocks().size();
+
+  {
+    SmallVector<BasicBlock*, 4> temp;
+    L->getExitingBlocks(temp);
+    Shape.exitingBlocks.reserve(temp.size());
+    for(unsigned i = 0; i < temp.size(); ++i)
+      Shape.exitingBlocks.push_back(BBIndices[temp[i]]);
+
+    temp.clear();
+    L->getExitBlocks(temp);
+    Shape.exitBlocks.reserve(temp.size());
+    for(unsigned i = 0; i < temp.size(); ++i)
+      Shape.exitBlocks.push_back(BBIndices[temp[i]]);
+  }
+
+  {
+    SmallVector<std::pair<BasicBlock*, BasicBlock*>, 4> exitEdges;
+    L->getExitEdges(exitEdges);
+    Shape.exitEdges.reserve(exitEdges.size());
+    for(unsigned i = 0; i < exitEdges.size(); ++i)
+      Shape.exitEdges.push_back(std::make_pair(BBIndices[const_cast<BasicBlock*>(exitEdges[i].first)], BBIndices[const_cast<BasicBlock*>(exitEdges[i].second)]));
+  }
+
+  Shape.childLoops.resize(L->getSubLoops().size());
+  uint32_t i = 0;
+  for(Loop::iterator it = L->begin(), itend = L->end(); it != itend; ++it, ++i)
+    getLoopShape(*it, BBIndices, DT, Shape.childLoops[i]);
+
+}
+
+// Build a ShadowLoopInvar from the loop structure in Shape, applying any user directives
+// that concern the loop.
+// Note a write through pointer Ptr by loop L: a write based on an alloca can't reach a global, and one based
+// on a global reaches only that global.
+static void noteLoopWrite(Value* Ptr, ShadowLoopInvar* L) {
+
+  Value* Base = GetUnderlyingObject(Ptr, *GlobalTD);
+  if(isa<AllocaInst>(Base))
+    return;
+  else if(GlobalVariable* GV = dyn_cast<GlobalVariable>(Base))
+    L->writtenGlobals.push_back(GV);
+  else
+    L->mayWriteUnknown = true;
+
+}
+
+// Note the memory block BB of loop L might write. Any call that might write memory (expanded or not)
+// or other write not through a plain pointer operand could write anything.
+static void noteLoopWrites(BasicBlock* BB, ShadowLoopInvar* L) {
+
+  for(BasicBlock::iterator it = BB->begin(), itend = BB->end(); it != itend && !L->mayWriteUnknown; ++it) {
+
+    Instruction* I = &*it;
+
+    if(!I->mayWriteToMemory())
+      continue;
+
+    if(StoreInst* SI = dyn_cast<StoreInst>(I))
+      noteLoopWrite(SI->getPointerOperand(), L);
+    else if(AtomicRMWInst* RMW = dyn_cast<AtomicRMWInst>(I))
+      noteLoopWrite(RMW->getPointerOperand(), L);
+    else if(AtomicCmpXchgInst* CX = dyn_cast<AtomicCmpXchgInst>(I))
+      noteLoopWrite(CX->getPointerOperand(), L);
+    else if(MemIntrinsic* MI = dyn_cast<MemIntrinsic>(I))
+      noteLoopWrite(MI->getDest(), L);
+    else if(isa<DbgInfoIntrinsic>(I))
+      continue;
+    else if(IntrinsicInst* II = dyn_cast<IntrinsicInst>(I)) {
+      if(II->getIntrinsicID() == Intrinsic::lifetime_start || II->getIntrinsicID() == Intrinsic::lifetime_end)
+	noteLoopWrite(II->getArgOperand(1), L);
+      else
+	L->mayWriteUnknown = true;
+    }
+    else
+      L->mayWriteUnknown = true;
+
+  }
+
+}
+
 ShadowLoopInvar* LLPEAnalysisPass::getLoopInfo(ShadowFunctionInvar* FInfo,
 					       DenseMap<BasicBlock*, uint32_t>& BBIndices, 
-					       const Loop* L,
-					       DominatorTree* DT,
+					       const ShadowLoopShape& Shape,
 					       ShadowLoopInvar* ParentLoop) {
   
-  release_assert(L->isLoopSimplifyForm() && L->isLCSSAForm(*DT) && "Don't forget to run loopsimplify and lcssa first!");
-
   ShadowLoopInvar* LInfo = new ShadowLoopInvar();
 
-  LInfo->headerIdx = BBIndices[L->getHeader()];
-  LInfo->preheaderIdx = BBIndices[L->getLoopPreheader()];
-  LInfo->latchIdx = BBIndices[L->getLoopLatch()];
-  LInfo->nBlocks = L->getBlocks().size();
+  LInfo->headerIdx = Shape.headerIdx;
+  LInfo->preheaderIdx = Shape.preheaderIdx;
+  LInfo->latchIdx = Shape.latchIdx;
+  LInfo->nBlocks = Shape.nBlocks;
   LInfo->parent = ParentLoop;
 
   // If we're supposed to ignore this loop and all children, register them now so that applyIgnoreLoops
   // does the right thing.
 
-  BasicBlock* HBB = L->getHeader();
+  BasicBlock* HBB = FInfo->BBs[Shape.headerIdx].BB;
   Function* LF = HBB->getParent();
 
   if(shouldIgnoreLoopChildren(LF, HBB))
-    ignoreChildLoops(ignoreLoops[LF], L);
+    ignoreChildLoops(ignoreLoops[LF], Shape, FInfo);
 
   // This is an edge which, if killed, means we may assume that the loop will iterate and continue investigating.
   // In other words, sooner or later the loop *must* terminate using this exit edge, even if the CFG makes
   // it appear otherwise.
   LInfo->optimisticEdge = std::make_pair(0xffffffff, 0xffffffff);
 
-  for(uint32_t i = LInfo->headerIdx, ilim = LInfo->headerIdx + L->getNumBlocks(); i != ilim; ++i) {
+  for(uint32_t i = LInfo->headerIdx, ilim = LInfo->headerIdx + Shape.nBlocks; i != ilim; ++i) {
 
     // TODO: Fix or discard outerScope. It should assign blocks to a loop scope when certain user-specified
     // loops are ignored (so their blocks inherit the parent loop's scope). However I think the support for this
@@ -140,37 +308,20 @@ ShadowLoopInvar* LLPEAnalysisPass::getLoopInfo(ShadowFunctionInvar* FInfo,
   // for certain that it exits, rather than while we can show it doesn't, as usual?
   LInfo->alwaysIterate = shouldAlwaysIterate(LF, HBB);
 
-  // Retrieve and translate more useful loop properties.
-  {
-    SmallVector<BasicBlock*, 4> temp;
-    L->getExitingBlocks(temp);
-    {
-      LInfo->exitingBlocks.reserve(temp.size());
-      for(unsigned i = 0; i < temp.size(); ++i)
-	LInfo->exitingBlocks.push_back(BBIndices[temp[i]]);
-    }
+  LInfo->exitingBlocks = Shape.exitingBlocks;
+  LInfo->exitBlocks = Shape.exitBlocks;
+  LInfo->exitEdges = Shape.exitEdges;
 
-    temp.clear();
-    L->getExitBlocks(temp);
-    {
-      LInfo->exitBlocks.reserve(temp.size());
-      for(unsigned i = 0; i < temp.size(); ++i)
-	LInfo->exitBlocks.push_back(BBIndices[temp[i]]);
-    }
-  }
-
-  {
-    SmallVector<std::pair<BasicBlock*, BasicBlock*>, 4> exitEdges;
-    L->getExitEdges(exitEdges);
-    LInfo->exitEdges.reserve(exitEdges.size());
-    for(unsigned i = 0; i < exitEdges.size(); ++i)
-      LInfo->exitEdges.push_back(std::make_pair(BBIndices[const_cast<BasicBlock*>(exitEdges[i].first)], BBIndices[const_cast<BasicBlock*>(exitEdges[i].second)]));
-  }
+  LInfo->mayWriteUnknown = false;
+  for(uint32_t i = LInfo->headerIdx, ilim = LInfo->headerIdx + Shape.nBlocks; i != ilim && !LInfo->mayWriteUnknown; ++i)
+    noteLoopWrites(FInfo->BBs[i].BB, LInfo);
+  std::sort(LInfo->writtenGlobals.begin(), LInfo->writtenGlobals.end());
+  LInfo->writtenGlobals.erase(std::unique(LInfo->writtenGlobals.begin(), LInfo->writtenGlobals.end()), LInfo->writtenGlobals.end());
 
   // Build shadow objects for each of our child loops.
-  for(Loop::iterator it = L->begin(), itend = L->end(); it != itend; ++it) {
+  for(std::vector<ShadowLoopShape>::const_iterator it = Shape.childLoops.begin(), itend = Shape.childLoops.end(); it != itend; ++it) {
 
-    ShadowLoopInvar* child = getLoopInfo(FInfo, BBIndices, *it, DT, LInfo);
+    ShadowLoopInvar* child = getLoopInfo(FInfo, BBIndices, *it, LInfo);
     LInfo->childLoops.push_back(child);
 
   }
@@ -179,7 +330,19 @@ ShadowLoopInvar* LLPEAnalysisPass::getLoopInfo(ShadowFunctionInvar* FInfo,
 
 }
 
+// Note the header of each loop in Shape.
+static void markLoopHeaders(const ShadowLoopShape& Shape, std::vector<bool>& isHeader) {
+
+  isHeader[Shape.headerIdx] = true;
+  for(std::vector<ShadowLoopShape>::const_iterator it = Shape.childLoops.begin(), itend = Shape.childLoops.end(); it != itend; ++it)
+    markLoopHeaders(*it, isHeader);
+
+}
+
 // Create shadow information for all global variables.
+// Only number the globals here. A module linked against libc has many thousands, most of which specialisation
+// never touches, so each one's size and (if it is writable) heap slot are made on first use instead; see
+// ShadowGV::init. The exception is allocateReferencedGlobals, below.
 void LLPEAnalysisPass::initShadowGlobals(Module& M, uint32_t extraSlots) {
 
   uint32_t i = 0;
@@ -188,45 +351,67 @@ void LLPEAnalysisPass::initShadowGlobals(Module& M, uint32_t extraSlots) {
   nGlobals += extraSlots;
   shadowGlobals = new ShadowGV[nGlobals];
 
-  // Assign them all numbers before computing initialisers, because the initialiser can
-  // reference another global, and getValPB will then lookup in shadowGlobalsIdx.
-
   for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it, ++i) {
 
     shadowGlobals[i].G = &*it;
+    shadowGlobals[i].initialised = false;
     shadowGlobalsIdx[&*it] = i;
 
   }
 
-  i = 0;
-  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it, ++i) {
+}
+
+// The initial store imports every heap object that exists when it is built, and a global given a slot
+// after that would read as uninitialised. So give one now to every writable global that anything refers
+// to, including path conditions and pointer arguments; the rest can only be reached by a write naming
+// them (e.g. a lock domain's clobber), which defines them before any read. Uses in bodies not yet read
+// from a lazily loaded module don't show up, so then every writable global gets a slot, unless
+// findReachableGlobals has read every reachable body and found that only unreachable code refers to it.
+void LLPEAnalysisPass::allocateReferencedGlobals(Module& M) {
 
-    // getTypeStoreSize can be expensive, so do it once here.
-    if(it->isConstant()) {
-      shadowGlobals[i].storeSize = GlobalTD->getTypeStoreSize(shadowGlobals[i].G->getType());
+  bool allUsesKnown = M.isMaterialized();
+  bool pruned = !reachableGlobals.empty();
+
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it) {
+
+    if(it->isConstant() || (allUsesKnown && it->use_empty()))
       continue;
-    }
 
-    // Non-constant global -- assign it a heap slot.
-    shadowGlobals[i].allocIdx = (int32_t)heap.size();
-    
-    heap.push_back(AllocData());
-    AllocData& AD = heap.back();
-    AD.allocIdx = heap.size() - 1;
-    AD.storeSize = GlobalTD->getTypeStoreSize(it->getType()->getElementType());
-    AD.isCommitted = true;
-    // This usually points to a malloc instruction -- here the global itself.
-    AD.allocValue = ShadowValue(&(shadowGlobals[i]));
-    AD.allocType = shadowGlobals[i].G->getType();
+    if(pruned && !isReachableGlobal(&*it) && usedOnlyFromUnreachableCode(&*it))
+      continue;
 
-    //errs() << "Init store for " << *it << " -> ";
-    //printPB(errs(), *Init);
-    //errs() << "\n";
+    shadowGlobals[getShadowGlobalIndex(&*it)].getAllocIdx();
+
+  }
+
+}
 
-    shadowGlobals[i].storeSize = AD.storeSize;
+void ShadowGV::init() {
 
+  initialised = true;
+
+  // getTypeStoreSize can be expensive, so do it once here.
+  if(G->isConstant()) {
+    storeSize = GlobalTD->getTypeStoreSize(G->getType());
+    allocIdx = -1;
+    return;
   }
 
+  // Non-constant global -- assign it a heap slot.
+  allocIdx = (int32_t)GlobalIHP->heap.size();
+
+  GlobalIHP->heap.push_back(AllocData());
+  AllocData& AD = GlobalIHP->heap.back();
+  AD.allocIdx = allocIdx;
+  AD.storeSize = GlobalTD->getTypeStoreSize(G->getType()->getElementType());
+  AD.isCommitted = true;
+  // This usually points to a malloc instruction -- here the global itself.
+  AD.allocValue = ShadowValue(this);
+  AD.allocType = G->getType();
+  AD.alignment = getGlobalAlignment(G);
+
+  storeSize = AD.storeSize;
+
 }
 
 // Look through any global aliases if possible.
@@ -256,6 +441,46 @@ static const GlobalVariable* getGlobalVar(const Value* V) {
 
 // Create shadow information for function F, including top-sorting its blocks to give them indices and thus
 // a sensible order for specialisation.
+static uint8_t getEvalKind(Instruction* I) {
+
+  switch(I->getOpcode()) {
+
+  case Instruction::ZExt:
+  case Instruction::SExt:
+  case Instruction::Trunc:
+    return EVALKIND_INTCAST;
+  case Instruction::ICmp:
+    return EVALKIND_ICMP;
+  case Instruction::FCmp:
+    return EVALKIND_FCMP;
+  case Instruction::GetElementPtr:
+    return EVALKIND_GEP;
+  case Instruction::Add:
+  case Instruction::Sub:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+    return EVALKIND_PTRARITH;
+  case Instruction::Mul:
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+    return EVALKIND_INTOP;
+  case Instruction::ExtractValue:
+    return EVALKIND_EXTRACTVALUE;
+  case Instruction::Load:
+    return EVALKIND_LOAD;
+  default:
+    return isa<CastInst>(I) ? EVALKIND_CAST : EVALKIND_GENERIC;
+
+  }
+
+}
+
 ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   // Already described?
@@ -263,25 +488,51 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
   if(findit != functionInfo.end())
     return findit->second;
 
-  // Beware! This LoopInfo instance and whatever Loop objects come from it are only alive until
-  // the next call to getAnalysis. Therefore the ShadowLoopInvar objects we make here
-  // must mirror all information we're interested in from the Loops.
-  LoopInfo* LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+  materializeBody(F);
 
   ShadowFunctionInvar* RetInfoP = new ShadowFunctionInvar();
   functionInfo[&F] = RetInfoP;
   ShadowFunctionInvar& RetInfo = *RetInfoP;
 
-  // Top-sort all blocks, including child loop. Thanks to trickery in createTopOrderingFrom,
-  // instead of giving all loop blocks an equal topsort value due to the latch edge cycle,
-  // we order the header first, then the loop body in topological order ignoring the latch, then its exit blocks.
   std::vector<BasicBlock*> TopOrderedBlocks;
-  SmallSet<BasicBlock*, 8> VisitedBlocks;
+  std::vector<ShadowLoopShape> LoopShapes;
+
+  // The block ordering and loop nest depend only on the CFG, and are the expensive part
+  // of this function, so they may be available from a previous run.
+  if(invarCacheDir.empty() || !readInvarCache(F, TopOrderedBlocks, LoopShapes)) {
+
+    // Beware! This LoopInfo instance and whatever Loop objects come from it are only alive until
+    // the next call to getAnalysis. Therefore we must take all information we're interested in from the Loops
+    // before returning.
+    LoopInfo* LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+
+    // Top-sort all blocks, including child loop. Thanks to trickery in createTopOrderingFrom,
+    // instead of giving all loop blocks an equal topsort value due to the latch edge cycle,
+    // we order the header first, then the loop body in topological order ignoring the latch, then its exit blocks.
+    createTopOrderingFrom(&F.getEntryBlock(), TopOrderedBlocks, LI, F.end());
+
+    // Since topsort gives a bottom-up ordering.
+    std::reverse(TopOrderedBlocks.begin(), TopOrderedBlocks.end());
+
+    DenseMap<BasicBlock*, uint32_t> TopIndices;
+    for(uint32_t i = 0; i < TopOrderedBlocks.size(); ++i)
+      TopIndices[TopOrderedBlocks[i]] = i;
 
-  createTopOrderingFrom(&F.getEntryBlock(), TopOrderedBlocks, VisitedBlocks, LI, /* loop = */ 0);
+    DominatorTree* thisDT = getDT(&F);
 
-  // Since topsort gives a bottom-up ordering.
-  std::reverse(TopOrderedBlocks.begin(), TopOrderedBlocks.end());
+    LoopShapes.resize(std::distance(LI->begin(), LI->end()));
+    uint32_t i = 0;
+    for(LoopInfo::iterator it = LI->begin(), it2 = LI->end(); it != it2; ++it, ++i)
+      getLoopShape(*it, TopIndices, thisDT, LoopShapes[i]);
+
+    if(!invarCacheDir.empty() && TopOrderedBlocks.size() == F.size())
+      writeInvarCache(F, TopOrderedBlocks, LoopShapes);
+
+  }
+
+  std::vector<bool> isLoopHeader(TopOrderedBlocks.size(), false);
+  for(std::vector<ShadowLoopShape>::iterator it = LoopShapes.begin(), itend = LoopShapes.end(); it != itend; ++it)
+    markLoopHeaders(*it, isLoopHeader);
 
   // Assign indices to each BB and instruction (IIndices is useful since otherwise we have to walk
   // the instruction list to get from an instruction to its index)
@@ -305,6 +556,27 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   }
 
+  // Size the operand pools, so that each instruction's operands can be a slice of one allocation:
+  {
+    uint32_t nOperands = 0, nIncoming = 0;
+    for(uint32_t i = 0; i < TopOrderedBlocks.size(); ++i) {
+      for(BasicBlock::iterator it = TopOrderedBlocks[i]->begin(), endit = TopOrderedBlocks[i]->end(); it != endit; ++it) {
+	if(PHINode* PN = dyn_cast<PHINode>(&*it)) {
+	  nOperands += PN->getNumIncomingValues();
+	  nIncoming += PN->getNumIncomingValues();
+	}
+	else {
+	  nOperands += it->getNumOperands();
+	}
+      }
+    }
+    RetInfo.operandPool = new ShadowInstIdx[nOperands];
+    RetInfo.operandBBPool = new uint32_t[nIncoming];
+  }
+
+  ShadowInstIdx* nextOperand = RetInfo.operandPool;
+  uint32_t* nextOperandBB = RetInfo.operandBBPool;
+
   // Create shadow block objects:
   ShadowBBInvar* FShadowBlocks = new ShadowBBInvar[TopOrderedBlocks.size()];
 
@@ -320,8 +592,6 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
     SBB.outerScope = 0;
     SBB.naturalScope = 0;
 
-    const Loop* BBScope =  LI->getLoopFor(BB);
-
     // Find successor block indices:
 
     succ_iterator SI = succ_begin(BB), SE = succ_end(BB);
@@ -334,6 +604,20 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
     }
 
+    // Index large switches by case value, so evaluating one needn't search its cases.
+    SBB.switchCases = 0;
+    if(SwitchInst* SwI = dyn_cast<SwitchInst>(BB->getTerminator())) {
+
+      if(SwI->getNumCases() >= MinIndexedSwitchCases) {
+
+	SBB.switchCases = new DenseMap<ConstantInt*, uint32_t>();
+	for(SwitchInst::CaseIt it = SwI->case_begin(), itend = SwI->case_end(); it != itend; ++it)
+	  (*SBB.switchCases)[it->getCaseValue()] = it->getSuccessorIndex();
+
+      }
+
+    }
+
     // Find predecessor block indices:
 
     pred_iterator PI = pred_begin(BB), PE = pred_end(BB);
@@ -346,7 +630,7 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
       
       if(SBB.predIdxs[j] > i) {
 
-	if((!BBScope) || SBB.BB != BBScope->getHeader()) {
+	if(!isLoopHeader[i]) {
 
 	  errs() << "Warning: block " << SBB.BB->getName() << " in " << F.getName() << " has predecessor " << (*PI)->getName() << " that comes after it topologically, but this is not a loop header. The program is not in well-nested natural loop form.\n";
 
@@ -368,6 +652,7 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
       SI.idx = j;
       SI.parent = &SBB;
       SI.I = I;
+      SI.evalKind = getEvalKind(I);
       
       // Get operands indices:
       uint32_t NumOperands;
@@ -375,8 +660,10 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
       if(PHINode* PN = dyn_cast<PHINode>(I)) {
 
 	NumOperands = PN->getNumIncomingValues();
-	operandIdxs = new ShadowInstIdx[NumOperands];
-	uint32_t* incomingBBs = new uint32_t[NumOperands];
+	operandIdxs = nextOperand;
+	nextOperand += NumOperands;
+	uint32_t* incomingBBs = nextOperandBB;
+	nextOperandBB += NumOperands;
 
 	for(unsigned k = 0, kend = PN->getNumIncomingValues(); k != kend; ++k) {
 
@@ -396,7 +683,8 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
       else {
 
 	NumOperands = I->getNumOperands();
-	operandIdxs = new ShadowInstIdx[NumOperands];
+	operandIdxs = nextOperand;
+	nextOperand += NumOperands;
 
 	for(unsigned k = 0, kend = I->getNumOperands(); k != kend; ++k) {
 	  
@@ -415,30 +703,6 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
       SI.operandIdxs = ImmutableArray<ShadowInstIdx>(operandIdxs, NumOperands);
 
-      // Get user indices:
-      unsigned nUsers = std::distance(I->use_begin(), I->use_end());
-
-      ShadowInstIdx* userIdxs = new ShadowInstIdx[nUsers];
-
-      Instruction::use_iterator UI;
-      unsigned k;
-      for(k = 0, UI = I->use_begin(); k != nUsers; ++k, ++UI) {
-
-	if(Instruction* UserI = dyn_cast<Instruction>(UI->getUser())) {
-
-	  userIdxs[k] = ShadowInstIdx(BBIndices[UserI->getParent()], IIndices[UserI]);
-
-	}
-	else {
-
-	  userIdxs[k] = ShadowInstIdx();
-	  
-	}
-
-      }
-
-      SI.userIdxs = ImmutableArray<ShadowInstIdx>(userIdxs, nUsers);
-
     }
 
     SBB.insts = ImmutableArray<ShadowInstructionInvar>(insts, BB->size());
@@ -447,43 +711,45 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   RetInfo.BBs = ImmutableArray<ShadowBBInvar>(FShadowBlocks, TopOrderedBlocks.size());
 
-  // Get user info for arguments:
-
-  ShadowArgInvar* Args = new ShadowArgInvar[F.arg_size()];
-
-  Function::arg_iterator AI = F.arg_begin();
-  uint32_t i = 0;
-  for(; i != F.arg_size(); ++i, ++AI) {
-
-    Argument* A = &*AI;
-    ShadowArgInvar& SArg = Args[i];
-    SArg.A = A;
-      
-    unsigned j = 0;
-    Argument::use_iterator UI = A->use_begin(), UE = A->use_end();
-
-    uint32_t nUsers = std::distance(UI, UE);
-    ShadowInstIdx* Users = new ShadowInstIdx[nUsers];
-
-    for(; UI != UE; ++UI, ++j) {
-
-      Value* UsedV = UI->getUser();
-      if(Instruction* UsedI = dyn_cast<Instruction>(UsedV)) {
-
-	Users[j] = ShadowInstIdx(BBIndices[UsedI->getParent()], IIndices[UsedI]);
-
-      }
-      else {
-
-	Users[j] = ShadowInstIdx();
+  {
+    uint32_t instsBefore = 0, succsBefore = 0;
+    for(uint32_t i = 0, ilim = TopOrderedBlocks.size(); i != ilim; ++i) {
+      FShadowBlocks[i].instsBefore = instsBefore;
+      FShadowBlocks[i].succsBefore = succsBefore;
+      instsBefore += FShadowBlocks[i].insts.size();
+      succsBefore += FShadowBlocks[i].succIdxs.size();
+    }
+  }
 
+  // Note where in each predecessor's successor list the edges into each block lie.
+  {
+    DenseMap<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, uint32_t> > edgeSlots;
+    for(uint32_t i = 0, ilim = TopOrderedBlocks.size(); i != ilim; ++i) {
+      for(uint32_t j = 0, jlim = FShadowBlocks[i].succIdxs.size(); j != jlim; ++j) {
+	std::pair<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, uint32_t> > New =
+	  std::make_pair(std::make_pair(i, FShadowBlocks[i].succIdxs[j]), std::make_pair(j, j));
+	std::pair<DenseMap<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, uint32_t> >::iterator, bool> Ins = edgeSlots.insert(New);
+	if(!Ins.second)
+	  Ins.first->second.second = j;
       }
+    }
 
+    for(uint32_t i = 0, ilim = TopOrderedBlocks.size(); i != ilim; ++i) {
+      ShadowBBInvar& SBB = FShadowBlocks[i];
+      uint32_t predSize = SBB.predIdxs.size();
+      SBB.predSlots = ImmutableArray<std::pair<uint32_t, uint32_t> >(new std::pair<uint32_t, uint32_t>[predSize], predSize);
+      for(uint32_t j = 0; j != predSize; ++j)
+	SBB.predSlots[j] = edgeSlots[std::make_pair(SBB.predIdxs[j], i)];
     }
+  }
 
-    SArg.userIdxs = ImmutableArray<ShadowInstIdx>(Users, nUsers);
+  // User indices are filled in by buildUserIdxs if and when DIE asks for them.
 
-  }
+  ShadowArgInvar* Args = new ShadowArgInvar[F.arg_size()];
+
+  Function::arg_iterator AI = F.arg_begin();
+  for(uint32_t i = 0; i != F.arg_size(); ++i, ++AI)
+    Args[i].A = &*AI;
 
   RetInfo.Args = ImmutableArray<ShadowArgInvar>(Args, F.arg_size());
 
@@ -491,10 +757,8 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
   // all loops consist of that block + L->getBlocks().size() further, contiguous blocks,
   // making is-in-loop easy to compute.
 
-  DominatorTree* thisDT = DTs[&F];
-
-  for(LoopInfo::iterator it = LI->begin(), it2 = LI->end(); it != it2; ++it) {
-    ShadowLoopInvar* newL = getLoopInfo(&RetInfo, BBIndices, *it, thisDT, 0);
+  for(std::vector<ShadowLoopShape>::iterator it = LoopShapes.begin(), itend = LoopShapes.end(); it != itend; ++it) {
+    ShadowLoopInvar* newL = getLoopInfo(&RetInfo, BBIndices, *it, 0);
     RetInfo.TopLevelLoops.push_back(newL);
   }
 
@@ -522,10 +786,106 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   }
 
+  RetInfo.memoryInert = true;
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E && RetInfo.memoryInert; ++I) {
+
+    if(isa<DbgInfoIntrinsic>(*I))
+      continue;
+
+    // Intrinsics are never expanded, but one returning a pointer passes through replaceUnavailableObjects.
+    if(isa<AllocaInst>(*I) || I->mayReadOrWriteMemory() ||
+       (isa<CallBase>(*I) && ((!isa<IntrinsicInst>(*I)) || I->getType()->isPointerTy())) ||
+       (isa<ICmpInst>(*I) && I->getOperand(0)->getType()->isPointerTy()))
+      RetInfo.memoryInert = false;
+
+  }
+
   return RetInfoP;
 
 }
 
+// Fill in the user indices of every instruction and argument in SFI. These are only needed by DIE and
+// a few commit-time queries, and many functions are analysed and then disabled or shared without
+// ever needing them, so they are built on first use rather than by getFunctionInvarInfo.
+void llvm::buildUserIdxs(ShadowFunctionInvar* SFI) {
+
+  SFI->userIdxsBuilt = true;
+  ++GlobalIHP->stats.userIndexedFunctions;
+
+  DenseMap<BasicBlock*, uint32_t> BBIndices;
+  DenseMap<Instruction*, uint32_t> IIndices;
+
+  uint32_t nUsersTotal = 0;
+
+  for(uint32_t i = 0, ilim = SFI->BBs.size(); i != ilim; ++i) {
+
+    ShadowBBInvar& SBB = SFI->BBs[i];
+    BBIndices[SBB.BB] = i;
+    for(uint32_t j = 0, jlim = SBB.insts.size(); j != jlim; ++j) {
+      IIndices[SBB.insts[j].I] = j;
+      nUsersTotal += std::distance(SBB.insts[j].I->use_begin(), SBB.insts[j].I->use_end());
+    }
+
+  }
+
+  for(uint32_t i = 0, ilim = SFI->Args.size(); i != ilim; ++i)
+    nUsersTotal += std::distance(SFI->Args[i].A->use_begin(), SFI->Args[i].A->use_end());
+
+  SFI->userPool = new ShadowInstIdx[nUsersTotal];
+  ShadowInstIdx* nextUser = SFI->userPool;
+
+  for(uint32_t i = 0, ilim = SFI->BBs.size(); i != ilim; ++i) {
+
+    ShadowBBInvar& SBB = SFI->BBs[i];
+    for(uint32_t j = 0, jlim = SBB.insts.size(); j != jlim; ++j) {
+
+      Instruction* I = SBB.insts[j].I;
+      unsigned nUsers = std::distance(I->use_begin(), I->use_end());
+
+      ShadowInstIdx* userIdxs = nextUser;
+      nextUser += nUsers;
+
+      Instruction::use_iterator UI;
+      unsigned k;
+      for(k = 0, UI = I->use_begin(); k != nUsers; ++k, ++UI) {
+
+	if(Instruction* UserI = dyn_cast<Instruction>(UI->getUser()))
+	  userIdxs[k] = ShadowInstIdx(BBIndices[UserI->getParent()], IIndices[UserI]);
+	else
+	  userIdxs[k] = ShadowInstIdx();
+
+      }
+
+      SBB.insts[j].userIdxs = ImmutableArray<ShadowInstIdx>(userIdxs, nUsers);
+
+    }
+
+  }
+
+  for(uint32_t i = 0, ilim = SFI->Args.size(); i != ilim; ++i) {
+
+    Argument* A = SFI->Args[i].A;
+    Argument::use_iterator UI = A->use_begin(), UE = A->use_end();
+
+    uint32_t nUsers = std::distance(UI, UE);
+    ShadowInstIdx* Users = nextUser;
+    nextUser += nUsers;
+
+    for(unsigned j = 0; UI != UE; ++UI, ++j) {
+
+      if(Instruction* UsedI = dyn_cast<Instruction>(UI->getUser()))
+	Users[j] = ShadowInstIdx(BBIndices[UsedI->getParent()], IIndices[UsedI]);
+      else
+	Users[j] = ShadowInstIdx();
+
+    }
+
+    SFI->Args[i].userIdxs = ImmutableArray<ShadowInstIdx>(Users, nUsers);
+
+  }
+
+}
+
 // Prepare the context-specific data structures, tying them to known invariant information.
 
 void InlineAttempt::prepareShadows() {
@@ -536,6 +896,7 @@ void InlineAttempt::prepareShadows() {
   release_assert(nBBs == invarInfo->BBs.size() && "Function contains unreachable blocks, run simplifycfg first!");
   // Create a basic-block array, initially all marked unreachable (null).
   BBs = new ShadowBB*[nBBs];
+  GlobalContextCounter.alloc();
   for(uint32_t i = 0; i < nBBs; ++i)
     BBs[i] = 0;
   // Indicates where this loop scope begins -- this is a function root, so its scope
@@ -558,6 +919,7 @@ void InlineAttempt::prepareShadows() {
     argShadows[i].invar = &(invarInfo->Args[i]);
     argShadows[i].IA = this;
     argShadows[i].dieStatus = 0;
+    argShadows[i].changeStamp = 0;
     argShadows[i].patchInst = 0;
     argShadows[i].committedVal = 0;
     
@@ -568,6 +930,7 @@ void InlineAttempt::prepareShadows() {
     argShadows[i].invar = 0;
     argShadows[i].IA = this;
     argShadows[i].dieStatus = 0;
+    argShadows[i].changeStamp = 0;
     argShadows[i].patchInst = 0;
     argShadows[i].committedVal = 0;    
 
@@ -582,6 +945,7 @@ void PeelIteration::prepareShadows() {
   invarInfo = pass->getFunctionInvarInfo(F);
   nBBs = L->nBlocks;
   BBs = new ShadowBB*[nBBs];
+  GlobalContextCounter.alloc();
   for(uint32_t i = 0; i < nBBs; ++i)
     BBs[i] = 0;
   BBsOffset = parentPA->L->headerIdx;
@@ -612,33 +976,62 @@ ShadowBBInvar* IntegrationAttempt::getBBInvar(uint32_t idx) const {
 
 }
 
+// All of a context's ShadowBBs, their instruction arrays and their successor flags come from one
+// slab, sized for all blocks in the context's scope, so a block's instructions follow its predecessor's
+// in memory and the whole lot is freed at once. Untouched parts of the slab are never initialised,
+// so blocks that are never reached cost little more than address space.
+// In spill mode large slabs are file-backed (see Spill.cpp).
+static void allocBBSlab(uint32_t nBBs, ShadowBBInvar* FirstBBI, ShadowBBInvar* LastBBI,
+			char*& Slab, ShadowInstruction*& Insts, bool*& Succs) {
+
+  uint64_t nInsts = (LastBBI->instsBefore + LastBBI->insts.size()) - FirstBBI->instsBefore;
+  uint64_t nSuccs = (LastBBI->succsBefore + LastBBI->succIdxs.size()) - FirstBBI->succsBefore;
+
+  uint64_t BBsSize = nBBs * sizeof(ShadowBB);
+  uint64_t InstsSize = nInsts * sizeof(ShadowInstruction);
+
+  Slab = (char*)allocContextSlab(BBsSize + InstsSize + nSuccs);
+  Insts = (ShadowInstruction*)(Slab + BBsSize);
+  Succs = (bool*)(Slab + BBsSize + InstsSize);
+
+}
+
 // Create a shadow basic block -- called the first time we can show blockIdx is reachable.
 ShadowBB* IntegrationAttempt::createBB(uint32_t blockIdx) {
 
   release_assert((!BBs[blockIdx - BBsOffset]) && "Creating block for the second time");
-  ShadowBB* newBB = new ShadowBB();
+
+  ShadowBBInvar* FirstBBI = &(invarInfo->BBs[BBsOffset]);
+  if(!bbSlab)
+    allocBBSlab(nBBs, FirstBBI, &(invarInfo->BBs[BBsOffset + nBBs - 1]), bbSlab, slabInsts, slabSuccs);
+
+  ShadowBB* newBB = new(&(((ShadowBB*)bbSlab)[blockIdx - BBsOffset])) ShadowBB();
   newBB->invar = &(invarInfo->BBs[blockIdx]);
   // Mark all block successors unreachable as yet.
-  newBB->succsAlive = new bool[newBB->invar->succIdxs.size()];
+  newBB->succsAlive = slabSuccs + (newBB->invar->succsBefore - FirstBBI->succsBefore);
   for(unsigned i = 0, ilim = newBB->invar->succIdxs.size(); i != ilim; ++i)
     newBB->succsAlive[i] = false;
   newBB->status = BBSTATUS_UNKNOWN;
   newBB->IA = this;
+  noteCFGChange();
 
-  ShadowInstruction* insts = new ShadowInstruction[newBB->invar->insts.size()];
+  ShadowInstruction* insts = slabInsts + (newBB->invar->instsBefore - FirstBBI->instsBefore);
   for(uint32_t i = 0, ilim = newBB->invar->insts.size(); i != ilim; ++i) {
+    new(&(insts[i])) ShadowInstruction();
     insts[i].invar = &(newBB->invar->insts[i]);
     insts[i].parent = newBB;
     insts[i].dieStatus = 0;
     insts[i].isThreadLocal = TLS_MUSTCHECK;
     insts[i].needsRuntimeCheck = RUNTIME_CHECK_NONE;
-    insts[i].typeSpecificData = 0;
+    insts[i].changeStamp = 0;
   }
 
   // Create an instruction array ready for analysis.
   newBB->insts = ImmutableArray<ShadowInstruction>(insts, newBB->invar->insts.size());
+  newBB->coldInsts = 0;
   newBB->useSpecialVarargMerge = false;
   newBB->localStore = 0;
+  newBB->walkEpoch = 0;
 
   BBs[blockIdx - BBsOffset] = newBB;
   return newBB;
@@ -651,6 +1044,25 @@ ShadowBB* IntegrationAttempt::createBB(ShadowBBInvar* BBI) {
 
 }
 
+// Destroy every block created so far and release the slab. Blocks' instructions own nothing
+// themselves: callers must first free their PBs and anything else referring to them.
+void IntegrationAttempt::freeBBs() {
+
+  for(uint32_t i = 0; BBs && i < nBBs; ++i) {
+
+    if(BBs[i])
+      BBs[i]->~ShadowBB();
+
+  }
+
+  freeContextSlab(bbSlab);
+  bbSlab = 0;
+
+  delete[] BBs;
+  BBs = 0;
+
+}
+
 // Get invariant information about BBs[blockidx][instidx]
 ShadowInstructionInvar* IntegrationAttempt::getInstInvar(uint32_t blockidx, uint32_t instidx) {
 
@@ -726,7 +1138,11 @@ ShadowInstruction* IntegrationAttempt::getInst(ShadowInstructionInvar* SII) {
 // and LLVM Constants are uniqued and live forever.
 ShadowValue ShadowValue::getInt(Type* CIT, uint64_t CIVal) {
 
-  if(CIT->isIntegerTy(8))
+  // Booleans have no compact encoding, but the context keeps true and false to hand,
+  // sparing a trip through the ConstantInt uniquing table.
+  if(CIT->isIntegerTy(1))
+    return ShadowValue((CIVal & 1) ? ConstantInt::getTrue(CIT->getContext()) : ConstantInt::getFalse(CIT->getContext()));
+  else if(CIT->isIntegerTy(8))
     return ShadowValue::getInt8((uint8_t)CIVal);
   else if(CIT->isIntegerTy(16))
     return ShadowValue::getInt16((uint16_t)CIVal);
@@ -784,7 +1200,7 @@ ShadowValue ShadowInstruction::getOperand(uint32_t i) {
 // Get this instruction's i'th user.
 ShadowInstruction* ShadowInstruction::getUser(uint32_t i) {
 
-  ShadowInstIdx& SII = invar->userIdxs[i];
+  ShadowInstIdx& SII = getUserIdxs(invar)[i];
   return &(parent->IA->BBs[SII.blockIdx]->insts[SII.instIdx]);
 
 }
@@ -810,11 +1226,17 @@ void IntegrationAttempt::copyLoopExitingDeadEdges(PeelAttempt* LPA) {
 
   }
 
+  noteCFGChange();
+
 }
 
 // Has this allocation been committed, or will it be?
 bool AllocData::isAvailable() {
 
+  // No one instruction's result stands for a summary object.
+  if(isSummary)
+    return false;
+
   if(isCommitted)
     return !!committedVal;
   else
@@ -0,0 +1,125 @@
+//===-- Spill.cpp ---------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Spill mode (-llpe-spill-file): large per-context slabs (see allocBBSlab) are mapped from a file
+// rather than taken from the heap. Contexts that are analysed but not yet committed are rarely touched,
+// so under memory pressure the kernel writes their pages back to the file and drops them, reading them
+// in again if and when commit gets round to them, where heap pages could only go to swap, if there is any.
+// The file is unlinked as soon as it is opened, and freed slabs are punched out of it.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+// Smaller slabs aren't worth a mapping of their own.
+static const uint64_t MinSpillSlabSize = 64 * 1024;
+// Grow the (sparse) file this much at a time.
+static const uint64_t SpillFileGrowth = 1ULL << 30;
+
+static int spillFD = -1;
+static uint64_t spillFileEnd = 0;
+static uint64_t spillFileSize = 0;
+
+// Precedes each slab. fileOffset is -1 for slabs on the heap.
+struct SlabHeader {
+
+  uint64_t mapSize;
+  uint64_t fileOffset;
+
+};
+
+void llvm::openSpillFile(const std::string& Path) {
+
+  spillFD = open(Path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if(spillFD == -1) {
+    errs() << "Failed to open spill file " << Path << ": " << strerror(errno) << "\n";
+    exit(1);
+  }
+
+  unlink(Path.c_str());
+
+}
+
+void* llvm::allocContextSlab(uint64_t Size) {
+
+  uint64_t Total = Size + sizeof(SlabHeader);
+
+  if(spillFD == -1 || Total < MinSpillSlabSize) {
+
+    SlabHeader* H = (SlabHeader*)::operator new(Total);
+    H->mapSize = Total;
+    H->fileOffset = (uint64_t)-1;
+    return H + 1;
+
+  }
+
+  uint64_t PageSize = getpagesize();
+  Total = (Total + (PageSize - 1)) & ~(PageSize - 1);
+
+  uint64_t Offset = spillFileEnd;
+  if(Offset + Total > spillFileSize) {
+
+    uint64_t NewSize = std::max(spillFileSize + SpillFileGrowth, Offset + Total);
+    if(ftruncate(spillFD, NewSize)) {
+      errs() << "Failed to extend spill file: " << strerror(errno) << "\n";
+      exit(1);
+    }
+    spillFileSize = NewSize;
+
+  }
+
+  void* Map = mmap(0, Total, PROT_READ | PROT_WRITE, MAP_SHARED, spillFD, Offset);
+  if(Map == MAP_FAILED) {
+    errs() << "Failed to map spill file: " << strerror(errno) << "\n";
+    exit(1);
+  }
+
+  spillFileEnd += Total;
+  ++GlobalIHP->stats.spilledSlabs;
+  GlobalIHP->stats.spilledSlabBytes += Total;
+
+  SlabHeader* H = (SlabHeader*)Map;
+  H->mapSize = Total;
+  H->fileOffset = Offset;
+  return H + 1;
+
+}
+
+void llvm::freeContextSlab(void* Slab) {
+
+  if(!Slab)
+    return;
+
+  SlabHeader* H = ((SlabHeader*)Slab) - 1;
+
+  if(H->fileOffset == (uint64_t)-1) {
+    ::operator delete(H);
+    return;
+  }
+
+  uint64_t Offset = H->fileOffset;
+  uint64_t Size = H->mapSize;
+  munmap(H, Size);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  // Give the disk space back; failure just leaves the file bigger than need be.
+  (void)fallocate(spillFD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, Offset, Size);
+#else
+  (void)Offset;
+#endif
+
+}
@@ -9,7 +9,8 @@
 
 #include "llvm/Analysis/LLPE.h"
 
-// Debugging functions that dunp the state of the tentative-load or dead-store analysis code.
+// Debugging functions that dump the state of the tentative-load or dead-store analysis code.
+// -llpe-dump-tl and -llpe-dump-dse (or -llpe-log=tl,dse) log them for each context about to be committed.
 
 namespace llvm {
 
@@ -43,7 +44,7 @@ namespace llvm {
       for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
 
 	ShadowInstruction* SI = &BB->insts[j];
-	errs() << IA->SeqNumber << " / " << itcache(SI) << ": " << SI->isThreadLocal << "\n";
+	LLPE_LOG(LOG_TL) << IA->SeqNumber << " / " << itcache(SI) << ": " << SI->isThreadLocal;
 
 	if(InlineAttempt* Child = IA->getInlineAttempt(SI))
 	  TLDump(Child);
@@ -84,7 +85,7 @@ namespace llvm {
       for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
 
 	ShadowInstruction* SI = &BB->insts[j];
-	errs() << IA->SeqNumber << " / " << itcache(SI) << ": " << SI->dieStatus << "\n";
+	LLPE_LOG(LOG_DSE) << IA->SeqNumber << " / " << itcache(SI) << ": " << SI->dieStatus;
 
 	if(InlineAttempt* Child = IA->getInlineAttempt(SI))
 	  DSEDump(Child);
@@ -43,67 +43,158 @@ static void TLProgress() {
 
 }
 
-// Allocator and shared empty-store object.
-static TLMapTy::Allocator TLMapAllocator;
-static TLMapTy TLEmptyMap(TLMapAllocator);
-TLMapPointer llvm::TLEmptyMapPtr(&TLEmptyMap);
+// Bytes beyond this offset in any object are never recorded as good, bounding the bitmap
+// at 128KB; reads from them are simply always checked.
+static const uint64_t TLBitmapMaxBytes = 1 << 20;
 
-TLLocalStore* TLMapPointer::getMapForBlock(ShadowBB* BB) {
+TLBitmap::TLBitmap(const TLBitmap& other) : NWords(other.NWords) {
 
-  return BB->tlStore;
+  if(NWords > 1) {
+    u.Heap = new uint64_t[NWords];
+    memcpy(u.Heap, other.u.Heap, NWords * sizeof(uint64_t));
+  }
+  else {
+    u.Inline = other.u.Inline;
+  }
 
 }
 
-// Copy the store entries. The entries themselves may still be shared.
-TLMapPointer TLMapPointer::getReadableCopy() {
+void TLBitmap::grow(uint32_t NewWords) {
+
+  if(NewWords <= NWords)
+    return;
 
-  TLMapTy* newMap = new TLMapTy(TLMapAllocator);
-  for(TLMapTy::iterator it = M->begin(), itend = M->end(); it != itend; ++it)
-    newMap->insert(it.start(), it.stop(), *it);
+  NewWords = std::max(NewWords, NWords * 2);
+  uint64_t* NewHeap = new uint64_t[NewWords];
+  memcpy(NewHeap, words(), NWords * sizeof(uint64_t));
+  memset(NewHeap + NWords, 0, (NewWords - NWords) * sizeof(uint64_t));
 
-  return TLMapPointer(newMap);
+  if(NWords > 1)
+    delete[] u.Heap;
+  u.Heap = NewHeap;
+  NWords = NewWords;
 
 }
 
-// Maps themselves are not shared at the moment, so just delete it.
-bool TLMapPointer::dropReference() {
+// The bits of word W that fall within [Start, Stop).
+static uint64_t TLWordMask(uint64_t W, uint64_t Start, uint64_t Stop) {
 
-  delete M;
-  M = 0;
+  uint64_t Lo = std::max(Start, W * 64) - (W * 64);
+  uint64_t Hi = std::min(Stop, (W + 1) * 64) - (W * 64);
+  uint64_t HiMask = Hi == 64 ? ~((uint64_t)0) : ((((uint64_t)1) << Hi) - 1);
+  return HiMask & ~((((uint64_t)1) << Lo) - 1);
+
+}
+
+// Are all of bytes [Start, Stop) good?
+bool TLBitmap::isGood(uint64_t Start, uint64_t Stop) const {
+
+  if(Start >= Stop)
+    return true;
+  if(Stop > ((uint64_t)NWords) * 64)
+    return false;
+
+  const uint64_t* W = words();
+  for(uint64_t i = Start / 64, ilim = ((Stop - 1) / 64) + 1; i != ilim; ++i) {
+    uint64_t Mask = TLWordMask(i, Start, Stop);
+    if((W[i] & Mask) != Mask)
+      return false;
+  }
 
   return true;
 
 }
 
-// Merge two is-known-good arrays. An offset is good if it's good in both parents.
-void TLMapPointer::mergeStores(TLMapPointer* mergeFrom, TLMapPointer* mergeTo, uint64_t ASize, TLMerger* Visitor) {
+void TLBitmap::markGood(uint64_t Start, uint64_t Stop) {
+
+  Stop = std::min(Stop, TLBitmapMaxBytes);
+  if(Start >= Stop)
+    return;
+
+  uint64_t LastWord = (Stop - 1) / 64;
+  grow(LastWord + 1);
+
+  uint64_t* W = words();
+  for(uint64_t i = Start / 64; i <= LastWord; ++i)
+    W[i] |= TLWordMask(i, Start, Stop);
+
+}
+
+// Keep only the bytes good in both this and other.
+void TLBitmap::intersect(const TLBitmap& other) {
+
+  uint64_t* W = words();
+  const uint64_t* OW = other.words();
+  uint32_t Common = std::min(NWords, other.NWords);
+
+  for(uint32_t i = 0; i != Common; ++i)
+    W[i] &= OW[i];
+  for(uint32_t i = Common; i < NWords; ++i)
+    W[i] = 0;
+
+}
+
+void TLBitmap::clear() {
 
-  // Intersect the sets per byte. The values are just booleans, so overwriting without erasing is fine.
+  memset(words(), 0, NWords * sizeof(uint64_t));
 
-  SmallVector<std::pair<uint64_t, uint64_t>, 4> keepRanges;
+}
 
-  for(TLMapTy::iterator it = mergeFrom->M->begin(), itend = mergeFrom->M->end();
-      it != itend; ++it) {
+// Print the good ranges, one per line.
+void TLBitmap::print(raw_ostream& RSO) const {
 
-    for(TLMapTy::iterator toit = mergeTo->M->find(it.start()), toitend = mergeTo->M->end();
-	toit != toitend && toit.start() < it.stop(); ++toit) {
+  uint64_t NBytes = ((uint64_t)NWords) * 64;
+  const uint64_t* W = words();
 
-      // Intersect ranges:
-      uint64_t keepStart = std::max(toit.start(), it.start());
-      uint64_t keepStop = std::min(toit.stop(), it.stop());
-      keepRanges.push_back(std::make_pair(keepStart, keepStop));
+  for(uint64_t i = 0; i < NBytes;) {
 
+    if(!(W[i / 64] & (((uint64_t)1) << (i % 64)))) {
+      ++i;
+      continue;
     }
 
+    uint64_t Stop = i;
+    while(Stop < NBytes && (W[Stop / 64] & (((uint64_t)1) << (Stop % 64))))
+      ++Stop;
+
+    RSO << i << "-" << Stop << "\n";
+    i = Stop;
+
   }
 
-  mergeTo->M->clear();
-  for(SmallVector<std::pair<uint64_t, uint64_t>, 4>::iterator it = keepRanges.begin(),
-	itend = keepRanges.end(); it != itend; ++it) {
+}
 
-    mergeTo->M->insert(it->first, it->second, true);
+// Shared empty-store object.
+static TLBitmap TLEmptyMap;
+TLMapPointer llvm::TLEmptyMapPtr(&TLEmptyMap);
 
-  }
+TLLocalStore* TLMapPointer::getMapForBlock(ShadowBB* BB) {
+
+  return BB->tlStore;
+
+}
+
+// Copy the store entries. The entries themselves may still be shared.
+TLMapPointer TLMapPointer::getReadableCopy() {
+
+  return TLMapPointer(new TLBitmap(*M));
+
+}
+
+// Maps themselves are not shared at the moment, so just delete it.
+bool TLMapPointer::dropReference() {
+
+  delete M;
+  M = 0;
+
+  return true;
+
+}
+
+// Merge two is-known-good arrays. An offset is good if it's good in both parents.
+void TLMapPointer::mergeStores(TLMapPointer* mergeFrom, TLMapPointer* mergeTo, uint64_t ASize, TLMerger* Visitor) {
+
+  mergeTo->M->intersect(*mergeFrom->M);
 
 }
 
@@ -115,7 +206,7 @@ TLMapPointer* ShadowBB::getWritableTLStore(ShadowValue O) {
   TLMapPointer* ret = tlStore->getOrCreateStoreFor(O, &isNewStore);
 
   if(isNewStore)
-    ret->M = new TLMapTy(TLMapAllocator);
+    ret->M = new TLBitmap();
 
   return ret;
 
@@ -134,6 +225,22 @@ static void markAllObjectsTentative(ShadowInstruction* SI, ShadowBB* BB) {
 
 }
 
+// As markAllObjectsTentative, but for a lock which only guards the globals in Domain.
+static void markDomainTentative(ShadowInstruction* SI, std::vector<GlobalVariable*>& Domain) {
+
+  for(std::vector<GlobalVariable*>::iterator it = Domain.begin(), itend = Domain.end(); it != itend; ++it) {
+
+    ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(*it)];
+    TLMapPointer* TLObj = SI->parent->getWritableTLStore(ShadowValue(SGV));
+    // Mark whole object tentative:
+    TLObj->M->clear();
+
+  }
+
+  SI->parent->IA->yieldState = BARRIER_HERE;
+
+}
+
 // Note that GoodPtr[Offset:Offset+Len] has been checked and need not be rechecked until another memory-ordered
 // instruction or yield point means we must assume possible inter-thread communication again.
 // Mark the good offsets as of block BB.
@@ -174,70 +281,15 @@ static void markGoodBytes(ShadowValue GoodPtr, uint64_t Len, bool contextEnabled
   if(PtrTarget.second.V.isGV() &&  PtrTarget.second.V.u.GV->G->isConstant())
     return;
 
-  SmallVector<std::pair<uint64_t, uint64_t>, 1> addRanges;
-
   TLMapPointer* store = BB->tlStore->getReadableStoreFor(PtrTarget.second.V);
   uint64_t start = PtrTarget.second.Offset + Offset;
   uint64_t stop = PtrTarget.second.Offset + Offset + Len;
 
-  if(!store) {
-   
-    addRanges.push_back(std::make_pair(start, stop));
-
-  }
-  else {
-
-    // Figure out what offsets need marking, if any.
-    TLMapTy::iterator it = store->M->find(start), itend = store->M->end();
-
-    if(it == itend || it.start() >= stop) {
-
-      addRanges.push_back(std::make_pair(start, stop));
-
-    }
-    else {
-
-      // Gap at left?
-
-      if(it.start() > start)
-	addRanges.push_back(std::make_pair(start, it.start()));
-
-      for(; it != itend && it.start() < stop; ++it) {
-    
-	// Gap to the right of this extent?
-	if(it.stop() < stop) {
-
-	  TLMapTy::iterator nextit = it;
-	  ++nextit;
-
-	  uint64_t gapend;
-	  if(nextit == itend)
-	    gapend = stop;
-	  else
-	    gapend = std::min(stop, nextit.start());
-
-	  if(it.stop() != gapend)
-	    addRanges.push_back(std::make_pair(it.stop(), gapend));
-
-	}
-
-      }
-
-    }
-
-  }
-  
-  if(!addRanges.empty()) {
-
-    TLMapPointer* writeStore = BB->getWritableTLStore(PtrTarget.second.V);
-    for(SmallVector<std::pair<uint64_t, uint64_t>, 1>::iterator it = addRanges.begin(),
-	  itend = addRanges.end(); it != itend; ++it) {
-
-      writeStore->M->insert(it->first, it->second, true);
-
-    }
+  // Only break CoW sharing if there is something new to mark.
+  if(start >= TLBitmapMaxBytes || (store && store->M->isGood(start, stop)))
+    return;
 
-  }
+  BB->getWritableTLStore(PtrTarget.second.V)->M->markGood(start, stop);
 
 }
 
@@ -263,15 +315,16 @@ static void walkPathCondition(PathConditionTypes Ty, PathCondition& Cond, bool c
 }
 
 // Mark the targets of all path condition checks at the top of BB checked.
-static void walkPathConditions(PathConditionTypes Ty, std::vector<PathCondition>& Conds, bool contextEnabled, ShadowBB* BB, uint32_t stackDepth) {
+static void walkPathConditions(PathConditionTypes Ty, std::vector<PathCondition>& Conds, PathConditionIndex& Index, bool contextEnabled, ShadowBB* BB, uint32_t stackDepth) {
 
-  for(std::vector<PathCondition>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it) {
-
-    if(stackDepth != it->fromStackIdx || BB->invar->BB != it->fromBB)
-      continue;
-
-    walkPathCondition(Ty, *it, contextEnabled, BB);
+  const PathConditionIndex::Entries* Cands = Index.findFromBlock(stackDepth, BB->invar->BB);
+  if(!Cands)
+    return;
 
+  // Implied conditions aren't checked, so they don't make anything good.
+  for(PathConditionIndex::Entries::const_iterator it = Cands->begin(), itend = Cands->end(); it != itend; ++it) {
+    if(!BB->IA->impliedPathConditions.count(&Conds[*it]))
+      walkPathCondition(Ty, Conds[*it], contextEnabled, BB);
   }
 
 }
@@ -291,9 +344,9 @@ void llvm::doTLCallMerge(ShadowBB* BB, InlineAttempt* IA) {
 // Mark the targets of all path condition checks PC at the top of BB checked.
 static void walkPathConditionsIn(PathConditions& PC, uint32_t stackIdx, ShadowBB* BB, bool contextEnabled, bool secondPass) {
 
-  walkPathConditions(PathConditionTypeIntmem, PC.IntmemPathConditions, 
+  walkPathConditions(PathConditionTypeIntmem, PC.IntmemPathConditions, PC.IntmemIndex,
 		     contextEnabled, BB, stackIdx);
-  walkPathConditions(PathConditionTypeString, PC.StringPathConditions, 
+  walkPathConditions(PathConditionTypeString, PC.StringPathConditions, PC.StringIndex,
 		     contextEnabled, BB, stackIdx);
 
   for(std::vector<PathFunc>::iterator it = PC.FuncPathConditions.begin(),
@@ -415,7 +468,8 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
       if(ReadFile* RF = SI->parent->IA->tryGetReadFile(SI)) {
 
 	// Read from file: mark buffer good.
-	markGoodBytes(SI->getCallArgOperand(1), RF->readSize, contextEnabled, SI->parent);
+	if(RF->bufArg != -1)
+	  markGoodBytes(SI->getCallArgOperand(RF->bufArg), RF->writeSize(), contextEnabled, SI->parent);
 
       }
       else if((findit = SpecialFunctionMap.find(F)) != SpecialFunctionMap.end()) {
@@ -446,6 +500,19 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
 
 	}
 
+      }
+      else if(CallI && GlobalIHP->lockDomains.count(CallI)) {
+
+	// A lock with a user-given domain: only the globals it guards may have been written
+	// by another thread, whether or not its callee is a known yield function.
+
+	// Pessimistic locks clobber their domain at specialisation time, so it is already assumed
+	// overwritten; no runtime checking required.
+	if(GlobalIHP->pessimisticLocks.count(CallI))
+	  return;
+
+	markDomainTentative(SI, GlobalIHP->lockDomains[CallI]);
+
       }
       else if(CallI && (((!F) && !GlobalIHP->programSingleThreaded) || GlobalIHP->yieldFunctions.count(F))) {
 
@@ -459,33 +526,8 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
 	  return;
 
 	}
-	
-	SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4>::iterator findit =
-	  GlobalIHP->lockDomains.find(CallI);
-
-	if(findit != GlobalIHP->lockDomains.end()) {
-
-	  // This a bit of a hack -- the user can annotate a particular yield function
-	  // as only clobbering some particular globals.
-	  
-	  for(std::vector<GlobalVariable*>::iterator it = findit->second.begin(),
-		itend = findit->second.end(); it != itend; ++it) {
-
-	    ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(*it)];
-	    ShadowValue SV(SGV);
-	    TLMapPointer* TLObj = SI->parent->getWritableTLStore(SV);
-	    // Mark whole object tentative:
-	    TLObj->M->clear();
-
-	  }
-
-	}
-	else {
-
-	  // No explicit domain given; clobbers everything.
-	  markAllObjectsTentative(SI, SI->parent);
 
-	}
+	markAllObjectsTentative(SI, SI->parent);
 
       }
 
@@ -518,20 +560,13 @@ static bool shouldCheckRead(ImprovedVal& Ptr, uint64_t Size, ShadowBB* BB) {
     return BB->tlStore->allOthersClobbered;
   }
 
-  if(verbose) {
-
-    for(TLMapTy::iterator it = Map->M->begin(), itend = Map->M->end(); it != itend; ++it) {
-
-      errs() << it.start() << "-" << it.stop() << "\n";
-
-    }
-
-  }
+  if(verbose)
+    Map->M->print(errs());
 
-  TLMapTy::iterator it = Map->M->find(Ptr.Offset);
-  bool coveredByMap = (it != Map->M->end() && ((int64_t)it.start()) <= Ptr.Offset && ((int64_t)it.stop()) >= Ptr.Offset + ((int64_t)Size));
+  if(Ptr.Offset < 0)
+    return true;
 
-  return !coveredByMap;
+  return !Map->M->isGood(Ptr.Offset, Ptr.Offset + Size);
     
 }
 
@@ -551,13 +586,13 @@ ThreadLocalState IntegrationAttempt::shouldCheckCopy(ShadowInstruction& SI, Shad
 
   // memcpyValues is unpopulated if the copy didn't "work" during specialisation,
   // so there is nothing to check.
-  DenseMap<ShadowInstruction*, SmallVector<IVSRange, 4> >::iterator findit = GlobalIHP->memcpyValues.find(&SI);
-  if(findit == GlobalIHP->memcpyValues.end() || !findit->second.size())
+  SmallVector<IVSRange, 4>* copyValues = getMemcpyValues(&SI);
+  if((!copyValues) || !copyValues->size())
     return TLS_NEVERCHECK;
 
   // Check each concrete value that was successfully read during information prop
-  for(SmallVector<IVSRange, 4>::iterator it = findit->second.begin(),
-	itend = findit->second.end(); it != itend; ++it) {
+  for(SmallVector<IVSRange, 4>::iterator it = copyValues->begin(),
+	itend = copyValues->end(); it != itend; ++it) {
 
     if(it->second.isWhollyUnknown())
       continue;
@@ -802,6 +837,28 @@ void llvm::doTLStoreMerge(ShadowBB* BB) {
 
 }
 
+// Can the TL and DSE walks pass over this call without entering it? They can if it contains nothing
+// they act on, has no stack frame or path conditions of its own and certainly returns, in which case
+// the caller's stores come back unchanged.
+bool InlineAttempt::canSkipStoreWalks() {
+
+  if((!invarInfo->memoryInert) || invarInfo->frameSize != -1 || !Callers.size())
+    return false;
+
+  if(invarInfo->pathConditions || targetCallInfo)
+    return false;
+
+  for(uint32_t i = 0; i != nBBs; ++i) {
+
+    if(BBs[i] && isa<ReturnInst>(BBs[i]->invar->BB->getTerminator()))
+      return true;
+
+  }
+
+  return false;
+
+}
+
 // Find tentative loads across this whole context.
 void InlineAttempt::findTentativeLoads(bool commitDisabledHere, bool secondPass) {
 
@@ -933,7 +990,7 @@ void IntegrationAttempt::squashUnavailableObjects(ShadowInstruction& SI, bool in
   }
   else {
 
-    // Copy instruction.
+    // Copy instruction. One that shared its source's store (see memcpySnapshots) copied no pointers or FDs.
     DenseMap<ShadowInstruction*, SmallVector<IVSRange, 4> >::iterator findit = pass->memcpyValues.find(&SI);
     if(findit != pass->memcpyValues.end()) {
 
@@ -1204,7 +1261,13 @@ void IntegrationAttempt::findTentativeLoadsInLoop(const ShadowLoopInvar* L, bool
       ShadowInstruction& SI = BB->insts[j];
       TLAnalyseInstruction(SI, commitDisabledHere, secondPass, false);
       
-      if(InlineAttempt* IA = getInlineAttempt(&SI)) {
+      InlineAttempt* IA = getInlineAttempt(&SI);
+      if(IA && IA->canSkipStoreWalks()) {
+
+	++pass->stats.inertStoreWalksSkipped;
+
+      }
+      else if(IA) {
 
 	// Pass our TLStore in:
 	IA->BBs[0]->tlStore = BB->tlStore;
@@ -1401,8 +1464,9 @@ bool IntegrationAttempt::requiresRuntimeCheck2(ShadowValue V, bool includeSpecia
     return false;
 
   // Check introduced by a user assertion, or by checking that malloc doesn't fail at runtime?
+  // Skip it if an earlier iteration of the same loop already checks the same invariant value.
   if(SI->needsRuntimeCheck == RUNTIME_CHECK_AS_EXPECTED)
-    return true;
+    return !checkMadeByFirstIteration(SI);
 
   // Check introduced by the possibility of concurrent file alteration, or a read from a FIFO
   // which might vary from our expectations?
@@ -1488,6 +1552,8 @@ void IntegrationAttempt::addCheckpointFailedBlocks() {
 
     }
 
+    coalesceVFSChecks(BB);
+
     // For each instruction in this block:
     for(uint32_t j = 0, jlim = BBI->insts.size(); j != jlim; ++j) {
 
@@ -1501,6 +1567,10 @@ void IntegrationAttempt::addCheckpointFailedBlocks() {
 	if(inst_is<PHINode>(SI) && (j + 1) != jlim && inst_is<PHINode>(&BB->insts[j+1]))
 	  continue;
 
+	// Likewise coalesced load checks only fail to the point after the first load.
+	if(checkCoalescesWithPrev(BB, j))
+	  continue;
+
      	// Note that we need unspecialised block variants available from this instruction's successor onwards.
 	// Invoke instruction? (Only an invoke could be a terminator, and also produce a value that needs checking)
 	if(j == jlim - 1)
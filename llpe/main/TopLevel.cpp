@@ -15,10 +15,24 @@
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 
+#include <atomic>
+#include <thread>
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #define DEBUG_TYPE "llpe-toplevel"
 
 using namespace llvm;
@@ -31,6 +45,13 @@ using namespace llvm;
 char LLPEAnalysisPass::ID = 0;
 
 static cl::opt<std::string> RootFunctionName("llpe-root", cl::init("main"));
+static cl::opt<unsigned> AnalysisThreads("llpe-threads", cl::init(1));
+static cl::opt<std::string> BatchManifest("llpe-batch", cl::init(""));
+static cl::opt<unsigned> BatchJobs("llpe-batch-jobs", cl::init(1));
+static cl::opt<std::string> ServerSocket("llpe-server", cl::init(""));
+static cl::list<std::string> BatchWorkers("llpe-batch-workers", cl::CommaSeparated);
+static cl::list<std::string> MicroBenches("llpe-microbench", cl::CommaSeparated);
+static cl::opt<bool> NoPruneUnreachable("llpe-no-prune-unreachable");
 
 static RegisterPass<LLPEAnalysisPass> X("llpe-analysis", "LLPE Analysis",
 						 false /* Only looks at CFG */,
@@ -58,12 +79,18 @@ InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F,
   emittedAlloca = false;
   blocksReachableOnFailure = 0;
   CommitF = 0;
+  debugInlinedAt = 0;
+  debugInlinedAtValid = false;
   targetCallInfo = 0;
   integrationGoodnessValid = false;
   backupTlStore = 0;
   backupDSEStore = 0;
   isStackTop = false;
-  DT = pass->DTs[&F];
+  overBudget = false;
+  budgetStartTime = 0;
+  budgetStartRSS = 0;
+  fdUseSummary = FDUSE_UNKNOWN;
+  varArgIdxsCaller = 0;
   if(_CI) {
     Callers.push_back(_CI);
     uniqueParent = _CI->parent->IA;
@@ -92,7 +119,7 @@ PeelIteration::PeelIteration(LLPEAnalysisPass* Pass, IntegrationAttempt* P, Peel
 PeelAttempt::PeelAttempt(LLPEAnalysisPass* Pass, IntegrationAttempt* P, Function& _F, 
 			 const ShadowLoopInvar* _L, int depth) 
   : pass(Pass), parent(P), F(_F), residualInstructions(-1), nesting_depth(depth), stack_depth(0), 
-    enabled(true), L(_L), totalIntegrationGoodness(0), integrationGoodnessValid(false)
+    enabled(true), L(_L), totalIntegrationGoodness(0), integrationGoodnessValid(false), deadRisingConsulted(false)
 {
 
   SeqNumber = Pass->IAs.size();
@@ -133,13 +160,12 @@ IntegrationAttempt::~IntegrationAttempt() {
 
       }
 
-      delete BB;
-
     }
 
   }
 
-  delete[] BBs;
+  freeBBs();
+  GlobalContextCounter.free();
 
 }
 
@@ -147,8 +173,9 @@ IntegrationAttempt::~IntegrationAttempt() {
 
 InlineAttempt::~InlineAttempt() {
   
-  if(!isUnsharable())
+  if(registeredSharable)
     pass->removeSharableFunction(this);
+  releaseSharingState();
 
   for(uint32_t i = 0; i < argShadows.size(); ++i) {
 
@@ -192,6 +219,9 @@ PeelAttempt::~PeelAttempt() {
 
 }
 
+// Set once runOnModule has created ihp_workdir.
+static bool ihpWorkdirCreated = false;
+
 // Free all memory belonging to the pass. The specialisation contexts' destructors will take care of the real work.
 void LLPEAnalysisPass::releaseMemory(void) {
   if(RootIA) {
@@ -199,16 +229,8 @@ void LLPEAnalysisPass::releaseMemory(void) {
     RootIA = 0;
   }
 
-  std::string command;
-  raw_string_ostream ROS(command);
-  ROS << "rm -rf " << ihp_workdir;
-  ROS.flush();
-  
-  if(system(command.c_str()) != 0) {
-
+  if(ihpWorkdirCreated && sys::fs::remove_directories(ihp_workdir))
     errs() << "Warning: failed to delete " << ihp_workdir << "\n";
-
-  }
   
 }
 
@@ -229,8 +251,9 @@ static bool getAllocSitesFrom(Value* V, std::vector<Value*>& sites, DenseSet<Val
   }
   else if(Argument* A = dyn_cast<Argument>(V)) {
 
+    // Calls from bodies not yet read from a lazily loaded module are invisible to us.
     Function* F = A->getParent();
-    if(F->hasAddressTaken(0)) {
+    if(F->hasAddressTaken(0) || !F->getParent()->isMaterialized()) {
 
       sites.clear();
       return false;
@@ -355,6 +378,8 @@ void LLPEAnalysisPass::createPointerArguments(InlineAttempt* IA) {
 	    if(GlobalVariable* GV = dyn_cast<GlobalVariable>(*it)) {
 	      
 	      ShadowGV* SGV = &shadowGlobals[getShadowGlobalIndex(GV)];
+	      // This needn't be a use of GV, so make sure it has a slot in the initial store.
+	      SGV->getAllocIdx();
 	      IVS->Values.push_back(ImprovedVal(ShadowValue(SGV), 0));
 
 	    }
@@ -425,17 +450,31 @@ void LLPEAnalysisPass::createPointerArguments(InlineAttempt* IA) {
 // Set up special heap objects that correspond to return values from particular functions.
 // The function has to return the same object every time (i.e. all calls must-alias other calls).
 
+static bool functionNameBefore(Function* A, Function* B) {
+
+  return A->getName() < B->getName();
+
+}
+
 void LLPEAnalysisPass::createSpecialLocations() {
 
+  // Number objects by function name rather than in the map's pointer-hash order, which varies
+  // between runs: heap indices order pointer sets and so can show in the committed program.
+  std::vector<Function*> SpecFs;
   for(SmallDenseMap<Function*, SpecialLocationDescriptor>::iterator it = specialLocations.begin(),
-	itend = specialLocations.end(); it != itend; ++it) {
+	itend = specialLocations.end(); it != itend; ++it)
+    SpecFs.push_back(it->first);
+
+  std::sort(SpecFs.begin(), SpecFs.end(), functionNameBefore);
+
+  for(std::vector<Function*>::iterator it = SpecFs.begin(), itend = SpecFs.end(); it != itend; ++it) {
     
-    it->second.heapIdx = (int32_t)heap.size();
+    specialLocations[*it].heapIdx = (int32_t)heap.size();
     heap.push_back(AllocData());
     heap.back().allocIdx = heap.size() - 1;
     heap.back().isCommitted = false;
-    heap.back().allocValue = ShadowValue(it->first);
-    heap.back().allocType = it->first->getFunctionType()->getReturnType();
+    heap.back().allocValue = ShadowValue(*it);
+    heap.back().allocType = (*it)->getFunctionType()->getReturnType();
 
   }
 
@@ -453,13 +492,241 @@ namespace llvm {
   size_t getStringPathConditionCount();
 }
 
+// Worker for buildDominatorTrees: repeatedly claim the next unbuilt function and
+// compute its dominator tree. Building a DT only reads the IR, so workers can
+// share the module freely as long as nothing modifies it meanwhile.
+struct DTBuildWorker {
+
+  std::vector<Function*>& Fs;
+  std::vector<DominatorTree*>& Results;
+  std::atomic<size_t>& nextIdx;
+
+DTBuildWorker(std::vector<Function*>& _Fs, std::vector<DominatorTree*>& _Results, std::atomic<size_t>& _nextIdx) :
+  Fs(_Fs), Results(_Results), nextIdx(_nextIdx) {}
+
+  void operator()() {
+
+    for(size_t i = nextIdx++, ilim = Fs.size(); i < ilim; i = nextIdx++) {
+      DominatorTree* NewDT = new DominatorTree();
+      NewDT->recalculate(*Fs[i]);
+      Results[i] = NewDT;
+    }
+
+  }
+
+};
+
+// Get F's dominator tree, building it if this is the first request.
+// With a lazily loaded module (llpe-driver -llpe-lazy-load) function bodies are only read from the bitcode
+// when something first looks at them: building a function's invariant info or DT, or at commit time.
+void llvm::materializeBody(Function& F) {
+
+  if(!F.isMaterializable())
+    return;
+
+  if(Error E = F.materialize()) {
+    errs() << "Failed to read the body of " << F.getName() << ": " << toString(std::move(E)) << "\n";
+    exit(1);
+  }
+
+}
+
+void llvm::materializeModule(Module& M) {
+
+  if(M.isMaterialized())
+    return;
+
+  if(Error E = M.materializeAll()) {
+    errs() << "Failed to read module bodies: " << toString(std::move(E)) << "\n";
+    exit(1);
+  }
+
+}
+
+DominatorTree* LLPEAnalysisPass::getDT(Function* F) {
+
+  DominatorTree*& DT = DTs[F];
+  if(!DT) {
+    materializeBody(*F);
+    DT = new DominatorTree();
+    DT->recalculate(*F);
+    ++stats.dominatorTrees;
+  }
+
+  return DT;
+
+}
+
+// Build a dominator tree for every defined function up front. Usually DTs are built on demand by getDT,
+// since most functions in a whole-program module are never reached, but with -llpe-threads=N we build
+// them all eagerly using N threads, except for bodies not yet read from a lazily loaded module. The analysis proper is single-threaded, since all contexts share
+// the heap, the IVS allocator and refcounted stores, but this stage is independent per function.
+void LLPEAnalysisPass::buildDominatorTrees(Module& M) {
+
+  std::vector<Function*> Fs;
+  for(Module::iterator MI = M.begin(), ME = M.end(); MI != ME; MI++) {
+
+    if(!(MI->isDeclaration() || MI->isMaterializable() || !isReachableGlobal(&*MI)))
+      Fs.push_back(&*MI);
+
+  }
+
+  std::vector<DominatorTree*> Results(Fs.size(), 0);
+  std::atomic<size_t> nextIdx(0);
+  DTBuildWorker Worker(Fs, Results, nextIdx);
+
+  unsigned nThreads = std::min((size_t)AnalysisThreads, Fs.size());
+  std::vector<std::thread> Helpers;
+  for(unsigned i = 1; i < nThreads; ++i)
+    Helpers.push_back(std::thread(Worker));
+
+  // This thread takes its share too:
+  Worker();
+
+  for(std::vector<std::thread>::iterator it = Helpers.begin(), itend = Helpers.end(); it != itend; ++it)
+    it->join();
+
+  for(uint32_t i = 0, ilim = Fs.size(); i != ilim; ++i)
+    DTs[Fs[i]] = Results[i];
+
+  stats.dominatorTrees += Fs.size();
+
+}
+
+// Add the globals C refers to, looking through constant expressions and aggregates, to Worklist.
+static void noteConstantGlobals(Constant* C, DenseSet<const Constant*>& Seen, std::vector<GlobalValue*>& Worklist) {
+
+  if(!Seen.insert(C).second)
+    return;
+
+  if(GlobalValue* GV = dyn_cast<GlobalValue>(C)) {
+    Worklist.push_back(GV);
+    return;
+  }
+
+  for(User::op_iterator it = C->op_begin(), itend = C->op_end(); it != itend; ++it) {
+    if(Constant* OpC = dyn_cast<Constant>(*it))
+      noteConstantGlobals(OpC, Seen, Worklist);
+  }
+
+}
+
+// Find everything the root can reach: functions it may call directly or whose address reachable code
+// takes, and the variables and aliases that reachable code or reachable initialisers name. A whole
+// program linked against libc is mostly code the root never reaches, so set-up that would otherwise
+// visit every function or global (eager dominator trees, initial global slots, the GUI's global text)
+// can skip the rest. Unreachable code is only ignored, never removed, so it is written out unchanged.
+// May be called again to add another root.
+void LLPEAnalysisPass::findReachableGlobals(Function& Root) {
+
+  if(reachableGlobals.count(&Root))
+    return;
+
+  std::vector<GlobalValue*> Worklist(1, &Root);
+  DenseSet<const Constant*> Seen;
+  Seen.insert(&Root);
+
+  while(!Worklist.empty()) {
+
+    GlobalValue* GV = Worklist.back();
+    Worklist.pop_back();
+
+    if(!reachableGlobals.insert(GV).second)
+      continue;
+
+    if(Function* F = dyn_cast<Function>(GV)) {
+
+      if(F->isDeclaration())
+	continue;
+
+      materializeBody(*F);
+      for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+	for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II) {
+	  for(User::op_iterator it = II->op_begin(), itend = II->op_end(); it != itend; ++it) {
+	    if(Constant* C = dyn_cast<Constant>(*it))
+	      noteConstantGlobals(C, Seen, Worklist);
+	  }
+	}
+      }
+
+      // Personality functions and the like:
+      for(User::op_iterator it = F->op_begin(), itend = F->op_end(); it != itend; ++it) {
+	if(Constant* C = dyn_cast_or_null<Constant>(*it))
+	  noteConstantGlobals(C, Seen, Worklist);
+      }
+
+    }
+    else if(GlobalVariable* GVar = dyn_cast<GlobalVariable>(GV)) {
+
+      if(GVar->hasInitializer())
+	noteConstantGlobals(GVar->getInitializer(), Seen, Worklist);
+
+    }
+    else if(GlobalAlias* GA = dyn_cast<GlobalAlias>(GV)) {
+
+      if(Constant* Aliasee = GA->getAliasee())
+	noteConstantGlobals(Aliasee, Seen, Worklist);
+
+    }
+
+  }
+
+}
+
+void LLPEAnalysisPass::countUnreachableGlobals(Module& M) {
+
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+    if(!(it->isDeclaration() || reachableGlobals.count(&*it)))
+      ++stats.prunedFunctions;
+  }
+
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it) {
+    if(!reachableGlobals.count(&*it))
+      ++stats.prunedGlobalVariables;
+  }
+
+}
+
+// Is V, or a constant built on it, only used by unreachable functions or initialisers? A constant
+// that nothing in the module uses may be held by the pass itself (e.g. made from a path condition
+// or argument specification), so that counts as a use.
+bool LLPEAnalysisPass::usedOnlyFromUnreachableCode(const Value* V) {
+
+  for(Value::const_user_iterator it = V->user_begin(), itend = V->user_end(); it != itend; ++it) {
+
+    const User* U = *it;
+    if(const Instruction* I = dyn_cast<Instruction>(U)) {
+      if(isReachableGlobal(I->getParent()->getParent()))
+	return false;
+    }
+    else if(const GlobalValue* UserGV = dyn_cast<GlobalValue>(U)) {
+      if(isReachableGlobal(UserGV))
+	return false;
+    }
+    else if(const Constant* C = dyn_cast<Constant>(U)) {
+      if(C->use_empty() || !usedOnlyFromUnreachableCode(C))
+	return false;
+    }
+    else
+      return false;
+
+  }
+
+  return true;
+
+}
+
 // Top-level entry point:
 
 bool LLPEAnalysisPass::runOnModule(Module& M) {
 
-  if(!mkdtemp(ihp_workdir)) {
-    errs() << "Failed to create " << ihp_workdir << "\n";
-    exit(1);
+  // The workdir only holds saved graphs for the GUI.
+  if(IHPSaveDOTFiles) {
+    if(!mkdtemp(ihp_workdir)) {
+      errs() << "Failed to create " << ihp_workdir << "\n";
+      exit(1);
+    }
+    ihpWorkdirCreated = true;
   }
 
   TD = &M.getDataLayout();
@@ -475,17 +742,76 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   persistPrinter = getPersistPrinter(&M);
 
   initMRInfo(&M);
+
+  if(!BatchManifest.empty()) {
+    runBatch(M);
+    return false;
+  }
+
+  if(!ServerSocket.empty()) {
+    runServer(M);
+    return false;
+  }
+
+  if(!MicroBenches.empty()) {
+    runMicroBench(M, MicroBenches);
+    return false;
+  }
   
-  for(Module::iterator MI = M.begin(), ME = M.end(); MI != ME; MI++) {
+  if(!NoPruneUnreachable) {
+    Function* Root = M.getFunction(RootFunctionName);
+    if(Root && !Root->isDeclaration())
+      findReachableGlobals(*Root);
+  }
 
-    if(!MI->isDeclaration()) {
-      DominatorTree* NewDT = new DominatorTree();
-      NewDT->recalculate(*MI);
-      DTs[&*MI] = NewDT;
-    }
+  if(AnalysisThreads > 1)
+    buildDominatorTrees(M);
 
+  specialiseRoot(M);
+
+  // Later passes and the bitcode writer expect every body present.
+  materializeModule(M);
+  flushLog();
+  return false;
+
+}
+
+static bool writeModuleTo(Module& M, const std::string& Path) {
+
+  std::error_code error;
+  raw_fd_ostream RFO(Path.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "Failed to open " << Path << ": " << error.message() << "\n";
+    return false;
   }
 
+  WriteBitcodeToFile(M, RFO);
+  RFO.close();
+  return !RFO.has_error();
+
+}
+
+// Called after commit when -llpe-fast-exit is given: write the committed module and leave at once.
+// Freeing the context tree, every ShadowBB and store and then the module itself can take longer than
+// the write on a large run, and the OS reclaims all of it anyway, so none of it is torn down.
+void LLPEAnalysisPass::fastExit(Module& M) {
+
+  bool written = writeModuleTo(M, fastExitOutput);
+
+  if(ihpWorkdirCreated && sys::fs::remove_directories(ihp_workdir))
+    errs() << "Warning: failed to delete " << ihp_workdir << "\n";
+
+  outs().flush();
+  flushLog();
+  errs().flush();
+  _exit(written ? 0 : 1);
+
+}
+
+// Analyse and commit -llpe-root according to the current options. Returns false if there is
+// nothing to specialise.
+bool LLPEAnalysisPass::specialiseRoot(Module& M) {
+
   Function* FoundF = M.getFunction(RootFunctionName);
   if((!FoundF) || FoundF->isDeclaration()) {
 
@@ -509,7 +835,18 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   uint32_t argvIdx = 0xffffffff;
   parseArgs(F, argConstants, argvIdx);
 
-  populateGVCaches(&M);
+  // Model functions are analysed in place of those they stand for, so they're reachable too.
+  if(!reachableGlobals.empty()) {
+    for(SmallDenseMap<Function*, Function*>::iterator it = modelFunctions.begin(), itend = modelFunctions.end(); it != itend; ++it)
+      findReachableGlobals(*it->second);
+    countUnreachableGlobals(M);
+  }
+
+  // Text representations are only worth caching when something will print many of them.
+  if(!(IHPSaveDOTFiles || !graphOutputDir.empty() || !graphArchivePath.empty() ||
+       verboseOverdef || verboseSharing || verbosePCs || DebugFlag))
+    disableValueCache();
+
   initSpecialFunctionsMap(M);
   // Last parameter: reserve extra GV slots for the constants that path condition parsing will produce.
   initShadowGlobals(M, getStringPathConditionCount());
@@ -525,7 +862,7 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   // Note ignored blocks and path conditions:
   parseArgsPostCreation(IA);
 
-  // Now that all globals have grabbed heap slots, insert extra locations per special function.
+  // Insert extra locations per special function.
   createSpecialLocations();
 
   argStores = new ArgStore[F.arg_size()];
@@ -558,13 +895,28 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
 
   createPointerArguments(IA);
   initGlobalFDStore();
+  allocateReferencedGlobals(M);
 
   RootIA = IA;
 
   errs() << "Interpreting";
-  IA->analyse();
+  {
+    PhaseTimer T(PHASE_ANALYSIS);
+    IA->analyse();
+  }
+
+  if(!summaryExportFile.empty())
+    writeLibrarySummaries();
+
+  // Must precede commit, which discards analysis results.
+  if(!graphOutputDir.empty() || !graphArchivePath.empty())
+    writeGraphs();
+
   IA->finaliseAndCommit(false);
-  fixNonLocalUses();
+  {
+    PhaseTimer T(PHASE_FIXNONLOCAL);
+    fixNonLocalUses();
+  }
   errs() << "\n";
   
   if(IHPSaveDOTFiles) {
@@ -572,23 +924,521 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
     // Function sharing is now decided, and hence the graph structure, so create
     // graph tags for the GUI.
     rootTag = RootIA->createTag(0);
+    buildTagSearchIndex();
 
   }
+
+#ifdef LLPE_PROFILE_EVAL
+  printEvalProfile(errs());
+#endif
     
-  return false;
+  return true;
+
+}
+
+// A job from the -llpe-batch manifest: an output bitcode file, and LLPE options that
+// override those given on the command line.
+struct BatchJob {
+
+  std::string line;
+  std::string outputFile;
+  std::vector<std::string> args;
+
+};
+
+static bool parseBatchJob(StringRef Line, BatchJob& Job) {
+
+  BumpPtrAllocator Alloc;
+  StringSaver Saver(Alloc);
+  SmallVector<const char*, 16> Tokens;
+  cl::TokenizeGNUCommandLine(Line, Saver, Tokens);
+  if(Tokens.empty())
+    return false;
+
+  Job.line = Line.str();
+  Job.outputFile = Tokens[0];
+  for(uint32_t i = 1, ilim = Tokens.size(); i != ilim; ++i)
+    Job.args.push_back(Tokens[i]);
+
+  return true;
+
+}
+
+static bool readBatchManifest(std::vector<BatchJob>& Jobs) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFile(BatchManifest);
+  if(MB.getError()) {
+    errs() << "Failed to read " << BatchManifest << ": " << MB.getError().message() << "\n";
+    return false;
+  }
+
+  // One job per line: output file then options, quoted as in a shell command line.
+  // Blank lines and those starting with # are ignored.
+  SmallVector<StringRef, 64> Lines;
+  (*MB)->getBuffer().split(Lines, '\n', -1, false);
+
+  for(SmallVector<StringRef, 64>::iterator it = Lines.begin(), itend = Lines.end(); it != itend; ++it) {
+
+    StringRef Line = it->trim();
+    if(Line.empty() || Line[0] == '#')
+      continue;
+
+    BatchJob Job;
+    if(parseBatchJob(Line, Job))
+      Jobs.push_back(Job);
+
+  }
+
+  return true;
+
+}
+
+// Apply a job's options on top of the command line's. Each option the job names is reset first,
+// so that it replaces rather than adds to the command line's setting.
+static bool applyBatchJobOptions(BatchJob& Job) {
+
+  StringMap<cl::Option*>& Opts = cl::getRegisteredOptions();
+
+  std::vector<const char*> Argv;
+  Argv.push_back("llpe-batch");
+
+  for(std::vector<std::string>::iterator it = Job.args.begin(), itend = Job.args.end(); it != itend; ++it) {
+
+    StringRef Name(*it);
+    if(Name.startswith("-")) {
+
+      Name = Name.ltrim('-');
+      Name = Name.substr(0, Name.find('='));
+      StringMap<cl::Option*>::iterator findit = Opts.find(Name);
+      if(findit != Opts.end())
+	findit->second->reset();
+
+    }
+
+    Argv.push_back(it->c_str());
+
+  }
+
+  return cl::ParseCommandLineOptions(Argv.size(), Argv.data(), "", &errs());
+
+}
+
+// Run a specialisation job in a child process: it inherits the module and everything derived from it
+// so far, and writes its committed module to the job's output file.
+static void runBatchChild(LLPEAnalysisPass* Pass, Module& M, BatchJob& Job) {
+
+  if(!applyBatchJobOptions(Job))
+    _exit(1);
+
+  if(!Pass->specialiseRoot(M))
+    _exit(1);
+
+  Pass->commit();
+
+  bool written = writeModuleTo(M, Job.outputFile);
+  flushLog();
+  _exit(written ? 0 : 1);
+
+}
+
+static void runRemoteBatch(std::vector<BatchJob>& Jobs, std::vector<uint32_t>& Failed);
+
+static void reportBatch(std::vector<BatchJob>& Jobs, std::vector<uint32_t>& Failed) {
+
+  errs() << "Batch: " << (Jobs.size() - Failed.size()) << " of " << Jobs.size() << " jobs succeeded\n";
+  std::sort(Failed.begin(), Failed.end());
+  for(std::vector<uint32_t>::iterator it = Failed.begin(), itend = Failed.end(); it != itend; ++it)
+    errs() << "Failed: " << Jobs[*it].outputFile << "\n";
+
+}
+
+// Specialise each job in the -llpe-batch manifest against this one loaded module. The work that depends
+// only on the module (reading it, mod/ref summaries and dominator trees) is done once here, then each job
+// runs in a forked child so that jobs cannot disturb one another's analysis state, -llpe-batch-jobs at a time.
+// The module given to opt is left unspecialised.
+void LLPEAnalysisPass::runBatch(Module& M) {
+
+  if(IHPSaveDOTFiles) {
+    errs() << "-llpe-batch requires -integrator-accept-all\n";
+    exit(1);
+  }
+
+  std::vector<BatchJob> Jobs;
+  if(!readBatchManifest(Jobs))
+    exit(1);
+
+  std::vector<uint32_t> Failed;
+
+  if(!BatchWorkers.empty()) {
+    runRemoteBatch(Jobs, Failed);
+    reportBatch(Jobs, Failed);
+    return;
+  }
+
+  batchMode = true;
+
+  // Every job will want these, so build them before forking.
+  buildDominatorTrees(M);
+
+  flushLog();
+  errs().flush();
+
+  std::map<pid_t, uint32_t> Running;
+  uint32_t nextJob = 0;
+  unsigned maxRunning = std::max(1U, (unsigned)BatchJobs);
+
+  while(nextJob != Jobs.size() || !Running.empty()) {
+
+    while(nextJob != Jobs.size() && Running.size() < maxRunning) {
+
+      pid_t child = fork();
+      if(child == -1) {
+	errs() << "fork failed: " << strerror(errno) << "\n";
+	exit(1);
+      }
+      else if(child == 0)
+	runBatchChild(this, M, Jobs[nextJob]);
+
+      Running[child] = nextJob++;
+
+    }
+
+    int status;
+    pid_t done = wait(&status);
+    if(done == -1) {
+      if(errno == EINTR)
+	continue;
+      errs() << "wait failed: " << strerror(errno) << "\n";
+      exit(1);
+    }
+
+    std::map<pid_t, uint32_t>::iterator findit = Running.find(done);
+    if(findit == Running.end())
+      continue;
+
+    if(!(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+      Failed.push_back(findit->second);
+    Running.erase(findit);
+
+  }
+
+  reportBatch(Jobs, Failed);
+
+}
+
+static bool readLine(int fd, std::string& Line) {
+
+  char c;
+  while(read(fd, &c, 1) == 1) {
+    if(c == '\n')
+      return true;
+    Line.push_back(c);
+  }
+
+  return !Line.empty();
+
+}
+
+static void writeString(int fd, StringRef S) {
+
+  if(write(fd, S.data(), S.size()) != (ssize_t)S.size())
+    errs() << "Server: failed to reply to client\n";
+
+}
+
+// Server and worker addresses are either a unix socket path or host:port for TCP.
+// Anything containing a slash, or without a colon, is taken to be a path.
+static bool isUnixSocketAddress(const std::string& Addr) {
+
+  return Addr.find('/') != std::string::npos || Addr.find(':') == std::string::npos;
+
+}
+
+// Returns a socket listening on (if Listen) or connected to Addr, or -1 with errno set.
+static int openSocket(const std::string& Addr, bool Listen) {
+
+  if(isUnixSocketAddress(Addr)) {
+
+    struct sockaddr_un UAddr;
+    if(Addr.size() >= sizeof(UAddr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+    memset(&UAddr, 0, sizeof(UAddr));
+    UAddr.sun_family = AF_UNIX;
+    strcpy(UAddr.sun_path, Addr.c_str());
+
+    int Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(Sock == -1)
+      return -1;
+
+    int ret;
+    if(Listen) {
+      unlink(Addr.c_str());
+      ret = bind(Sock, (struct sockaddr*)&UAddr, sizeof(UAddr));
+      if(!ret)
+	ret = listen(Sock, 16);
+    }
+    else
+      ret = connect(Sock, (struct sockaddr*)&UAddr, sizeof(UAddr));
+
+    if(ret) {
+      int savedErrno = errno;
+      close(Sock);
+      errno = savedErrno;
+      return -1;
+    }
+
+    return Sock;
+
+  }
+
+  size_t colon = Addr.rfind(':');
+  std::string Host = Addr.substr(0, colon);
+  std::string Port = Addr.substr(colon + 1);
+
+  struct addrinfo Hints;
+  memset(&Hints, 0, sizeof(Hints));
+  Hints.ai_family = AF_UNSPEC;
+  Hints.ai_socktype = SOCK_STREAM;
+  if(Listen)
+    Hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo* Res;
+  if(getaddrinfo(Host.empty() ? 0 : Host.c_str(), Port.c_str(), &Hints, &Res)) {
+    errno = EADDRNOTAVAIL;
+    return -1;
+  }
+
+  int Sock = -1;
+  for(struct addrinfo* AI = Res; AI && Sock == -1; AI = AI->ai_next) {
+
+    Sock = socket(AI->ai_family, AI->ai_socktype, AI->ai_protocol);
+    if(Sock == -1)
+      continue;
+
+    int ret;
+    if(Listen) {
+      int one = 1;
+      setsockopt(Sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      ret = bind(Sock, AI->ai_addr, AI->ai_addrlen);
+      if(!ret)
+	ret = listen(Sock, 16);
+    }
+    else
+      ret = connect(Sock, AI->ai_addr, AI->ai_addrlen);
+
+    if(ret) {
+      int savedErrno = errno;
+      close(Sock);
+      errno = savedErrno;
+      Sock = -1;
+    }
+
+  }
+
+  freeaddrinfo(Res);
+  return Sock;
+
+}
+
+// Serve specialisation jobs over the socket named by -llpe-server, keeping the module and
+// the work done by runBatch before forking warm between them. A client connects and sends one
+// job per connection, a line as in a -llpe-batch manifest, and the server replies "ok" or "failed"
+// once the job's output is written. The line "quit" stops the server. Jobs run one at a time.
+void LLPEAnalysisPass::runServer(Module& M) {
+
+  if(IHPSaveDOTFiles) {
+    errs() << "-llpe-server requires -integrator-accept-all\n";
+    exit(1);
+  }
+
+  batchMode = true;
+  buildDominatorTrees(M);
+
+  int Sock = openSocket(ServerSocket, true);
+  if(Sock == -1) {
+    errs() << "Failed to listen on " << ServerSocket << ": " << strerror(errno) << "\n";
+    exit(1);
+  }
+
+  errs() << "Serving on " << ServerSocket << "\n";
+  flushLog();
+  errs().flush();
+
+  uint32_t nJobs = 0, nFailed = 0;
+
+  while(true) {
+
+    int Conn = accept(Sock, 0, 0);
+    if(Conn == -1) {
+      if(errno == EINTR)
+	continue;
+      errs() << "accept failed: " << strerror(errno) << "\n";
+      break;
+    }
+
+    std::string Line;
+    if(!readLine(Conn, Line)) {
+      close(Conn);
+      continue;
+    }
+
+    BatchJob Job;
+    bool quit = false;
+
+    if(StringRef(Line).trim() == "quit") {
+      writeString(Conn, "bye\n");
+      quit = true;
+    }
+    else if(!parseBatchJob(StringRef(Line).trim(), Job))
+      writeString(Conn, "failed\n");
+    else {
+
+      ++nJobs;
+
+      pid_t child = fork();
+      if(child == -1) {
+	errs() << "fork failed: " << strerror(errno) << "\n";
+	exit(1);
+      }
+      else if(child == 0) {
+	close(Sock);
+	close(Conn);
+	runBatchChild(this, M, Job);
+      }
+
+      int status;
+      while(waitpid(child, &status, 0) == -1 && errno == EINTR)
+	;
+
+      bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      if(!ok) {
+	++nFailed;
+	errs() << "Failed: " << Job.outputFile << "\n";
+      }
+      writeString(Conn, ok ? "ok\n" : "failed\n");
+
+    }
+
+    close(Conn);
+    if(quit)
+      break;
+
+  }
+
+  close(Sock);
+  if(isUnixSocketAddress(ServerSocket))
+    unlink(ServerSocket.c_str());
+
+  errs() << "Server: " << (nJobs - nFailed) << " of " << nJobs << " jobs succeeded\n";
+
+}
+
+// Farm the manifest's jobs out to the -llpe-batch-workers servers instead of forking them here,
+// one job at a time per worker. Each worker is an -llpe-server, typically on another machine,
+// started on the same module and options; output files are written by the worker, so their paths
+// must mean the same thing there (e.g. a shared filesystem). Sharding a program by top-level
+// callee means giving each job its own -llpe-root and -spec-param settings. A worker that cannot
+// be reached is dropped and its job given to another; if none are left the remaining jobs fail.
+static void runRemoteBatch(std::vector<BatchJob>& Jobs, std::vector<uint32_t>& Failed) {
+
+  // Per worker, the connection and job in flight, or -1 when idle. Dead workers have Conns == -2.
+  std::vector<int> Conns(BatchWorkers.size(), -1);
+  std::vector<uint32_t> Assigned(BatchWorkers.size(), 0);
+  std::vector<uint32_t> Pending;
+  for(uint32_t i = Jobs.size(); i != 0; --i)
+    Pending.push_back(i - 1);
+
+  uint32_t nRunning = 0, nAlive = BatchWorkers.size();
+
+  while(!Pending.empty() || nRunning) {
+
+    for(uint32_t i = 0, ilim = BatchWorkers.size(); i != ilim && !Pending.empty(); ++i) {
+
+      if(Conns[i] != -1)
+	continue;
+
+      int Conn = openSocket(BatchWorkers[i], false);
+      if(Conn == -1) {
+	errs() << "Worker " << BatchWorkers[i] << " unreachable: " << strerror(errno) << "\n";
+	Conns[i] = -2;
+	--nAlive;
+	continue;
+      }
+
+      uint32_t Job = Pending.back();
+      Pending.pop_back();
+
+      writeString(Conn, Jobs[Job].line);
+      writeString(Conn, "\n");
+
+      Conns[i] = Conn;
+      Assigned[i] = Job;
+      ++nRunning;
+
+    }
+
+    if(!nAlive) {
+      Failed.insert(Failed.end(), Pending.begin(), Pending.end());
+      Pending.clear();
+    }
+
+    if(!nRunning)
+      continue;
+
+    std::vector<struct pollfd> Polls;
+    std::vector<uint32_t> PollWorkers;
+    for(uint32_t i = 0, ilim = BatchWorkers.size(); i != ilim; ++i) {
+      if(Conns[i] < 0)
+	continue;
+      struct pollfd P;
+      P.fd = Conns[i];
+      P.events = POLLIN;
+      P.revents = 0;
+      Polls.push_back(P);
+      PollWorkers.push_back(i);
+    }
+
+    if(poll(Polls.data(), Polls.size(), -1) == -1) {
+      if(errno == EINTR)
+	continue;
+      errs() << "poll failed: " << strerror(errno) << "\n";
+      exit(1);
+    }
+
+    for(uint32_t i = 0, ilim = Polls.size(); i != ilim; ++i) {
+
+      if(!Polls[i].revents)
+	continue;
+
+      uint32_t Worker = PollWorkers[i];
+      std::string Reply;
+      bool replied = readLine(Conns[Worker], Reply);
+      close(Conns[Worker]);
+      Conns[Worker] = -1;
+      --nRunning;
+
+      if(!replied) {
+	// The worker went away mid-job: retry the job elsewhere.
+	errs() << "Worker " << BatchWorkers[Worker] << " lost\n";
+	Conns[Worker] = -2;
+	--nAlive;
+	Pending.push_back(Assigned[Worker]);
+      }
+      else if(StringRef(Reply).trim() != "ok")
+	Failed.push_back(Assigned[Worker]);
+
+    }
+
+  }
 
 }
 
 void LLPEAnalysisPass::getAnalysisUsage(AnalysisUsage &AU) const {
   
   AU.addRequired<LoopInfoWrapperPass>();
-  const PassInfo* BAAInfo = lookupPassInfo(StringRef("basicaa"));
-  if(!BAAInfo) {
-    errs() << "Couldn't load Basic AA!";
-  }
-  else {
-    AU.addRequiredID(BAAInfo->getTypeInfo());
-  }
   //AU.setPreservesAll();
   
 }
@@ -71,6 +71,27 @@ static void getRecvfromBuffer(ShadowValue CS, ShadowValue& V, uint64_t& Size) {
 
 }
 
+// 'fgets' writes at most its size argument:
+static void getFgetsBuf(ShadowValue CS, ShadowValue& V, uint64_t& Size) {
+
+  if(!tryGetConstantInt(getValArgOperand(CS, 1), Size))
+    Size = MemoryLocation::UnknownSize;
+  V = getValArgOperand(CS, 0);
+
+}
+
+// 'fread' writes size * nmemb bytes:
+static void getFreadBuf(ShadowValue CS, ShadowValue& V, uint64_t& Size) {
+
+  uint64_t ItemSize, Items;
+  if(tryGetConstantInt(getValArgOperand(CS, 1), ItemSize) && tryGetConstantInt(getValArgOperand(CS, 2), Items))
+    Size = ItemSize * Items;
+  else
+    Size = MemoryLocation::UnknownSize;
+  V = getValArgOperand(CS, 0);
+
+}
+
 // Get the 'errno' global if possible:
 static void getErrno(ShadowValue CS, ShadowValue& V, uint64_t& Size) {
 
@@ -91,6 +112,7 @@ static void getErrno(ShadowValue CS, ShadowValue& V, uint64_t& Size) {
 struct IHPLocationInfo locArg0 = { 0, 0, MemoryLocation::UnknownSize };
 struct IHPLocationInfo locArg1 = { 0, 1, MemoryLocation::UnknownSize };
 struct IHPLocationInfo locArg2 = { 0, 2, MemoryLocation::UnknownSize };
+struct IHPLocationInfo locArg3 = { 0, 3, MemoryLocation::UnknownSize };
 
 // Sized parameters, These read/modify a particular argument size. This could need
 // fixing if there's a chance we're building against a different struct than the kernel
@@ -108,6 +130,8 @@ struct IHPLocationInfo locReturnVal = { getReturnVal, 0, 0 };
 struct IHPLocationInfo locPollFds = { getPollFds, 0, 0 };
 struct IHPLocationInfo locReadBuf = { getReadBuf, 0, 0 };
 struct IHPLocationInfo locRecvfromBuffer = { getRecvfromBuffer, 0, 0 };
+struct IHPLocationInfo locFgetsBuf = { getFgetsBuf, 0, 0 };
+struct IHPLocationInfo locFreadBuf = { getFreadBuf, 0, 0 };
 
 // Globals
 struct IHPLocationInfo locErrno = { getErrno, 0, 0 };
@@ -258,6 +282,96 @@ static IHPLocationMRInfo UnameMR[] = {
 
 };
 
+// Stdio calls modify the FILE as well as any buffer:
+
+static IHPLocationMRInfo FopenMR[] = {
+
+  { &locErrno },
+  { &locReturnVal },
+  { 0 }
+
+};
+
+static IHPLocationMRInfo FgetsMR[] = {
+
+  { &locErrno },
+  { &locFgetsBuf },
+  { &locArg2 },
+  { 0 }
+
+};
+
+static IHPLocationMRInfo FreadMR[] = {
+
+  { &locErrno },
+  { &locFreadBuf },
+  { &locArg3 },
+  { 0 }
+
+};
+
+// Ref descriptions, used by DSE to tell which stores a call may read. These are likewise null-terminated,
+// and a call without one may read through any pointer argument.
+
+// No memory read through the arguments (any pointer arguments are only written):
+static IHPLocationMRInfo NoRefs[] = {
+  { 0 }
+};
+
+static IHPLocationMRInfo Arg0Refs[] = {
+  { &locArg0 },
+  { 0 }
+};
+
+static IHPLocationMRInfo Arg1Refs[] = {
+  { &locArg1 },
+  { 0 }
+};
+
+static IHPLocationMRInfo Arg2Refs[] = {
+  { &locArg2 },
+  { 0 }
+};
+
+static IHPLocationMRInfo Arg3Refs[] = {
+  { &locArg3 },
+  { 0 }
+};
+
+static IHPLocationMRInfo Arg0Arg1Refs[] = {
+  { &locArg0 },
+  { &locArg1 },
+  { 0 }
+};
+
+// write and sendto read their buffer argument as read and recvfrom write it:
+static IHPLocationMRInfo WriteRefs[] = {
+  { &locReadBuf },
+  { 0 }
+};
+
+static IHPLocationMRInfo SendtoRefs[] = {
+  { &locRecvfromBuffer },
+  { &locSockaddrArg4 },
+  { 0 }
+};
+
+static IHPLocationMRInfo PollRefs[] = {
+  { &locPollFds },
+  { 0 }
+};
+
+// The address length is an in-out parameter:
+static IHPLocationMRInfo SocklenArg2Refs[] = {
+  { &locSocklenArg2 },
+  { 0 }
+};
+
+static IHPLocationMRInfo RecvfromRefs[] = {
+  { &locSocklenArg5 },
+  { 0 }
+};
+
 // This isn't very general, since TCGETS etc can alias other ioctls with different device types.
 static const IHPLocationMRInfo* getIoctlLocDetails(ShadowValue CS) {
 
@@ -358,6 +472,140 @@ static IHPFunctionInfo VFSCallFunctions[] = {
 
 };
 
+// The stdio calls described when -llpe-stdio-model is given. Without it they're treated as unknown calls,
+// which also forgets every FD's position: a stream might share an FD with a file we're tracking.
+static IHPFunctionInfo StdioCallFunctions[] = {
+
+  { "fopen", false, FopenMR, 0 },
+  { "fopen64", false, FopenMR, 0 },
+  { "fclose", false, Arg0AndErrnoMR, 0 },
+  { "fgetc", false, Arg0AndErrnoMR, 0 },
+  { "getc", false, Arg0AndErrnoMR, 0 },
+  { "_IO_getc", false, Arg0AndErrnoMR, 0 },
+  { "fgetc_unlocked", false, Arg0AndErrnoMR, 0 },
+  { "getc_unlocked", false, Arg0AndErrnoMR, 0 },
+  { "fgets", false, FgetsMR, 0 },
+  { "fgets_unlocked", false, FgetsMR, 0 },
+  { "fread", false, FreadMR, 0 },
+  { "fread_unlocked", false, FreadMR, 0 },
+  { "ungetc", false, Arg1AndErrnoMR, 0 },
+  { "fseek", false, Arg0AndErrnoMR, 0 },
+  { "fseeko", false, Arg0AndErrnoMR, 0 },
+  { "fseeko64", false, Arg0AndErrnoMR, 0 },
+  { "rewind", false, Arg0AndErrnoMR, 0 },
+  { "ftell", false, Arg0AndErrnoMR, 0 },
+  { "ftello", false, Arg0AndErrnoMR, 0 },
+  { "ftello64", false, Arg0AndErrnoMR, 0 },
+  { "feof", false, Arg0AndErrnoMR, 0 },
+  { "feof_unlocked", false, Arg0AndErrnoMR, 0 },
+  { "ferror", false, Arg0AndErrnoMR, 0 },
+  { "ferror_unlocked", false, Arg0AndErrnoMR, 0 },
+  { "clearerr", false, Arg0AndErrnoMR, 0 },
+  { "clearerr_unlocked", false, Arg0AndErrnoMR, 0 },
+  // Terminator
+  { 0, false, 0, 0 }
+
+};
+
+struct IHPFunctionRefInfo {
+
+  const char* Name;
+  const IHPLocationMRInfo* RefDetails;
+
+};
+
+// What the calls described above read through their arguments. Those not listed here (ioctl, fcntl, writev)
+// may read through any pointer argument.
+static IHPFunctionRefInfo VFSCallRefs[] = {
+
+  { "open", Arg0Refs },
+  { "read", NoRefs },
+  { "lseek", NoRefs },
+  { "llseek", NoRefs },
+  { "lseek64", NoRefs },
+  { "close", NoRefs },
+  { "clock_gettime", NoRefs },
+  { "gettimeofday", NoRefs },
+  { "time", NoRefs },
+  { "write", WriteRefs },
+  { "posix_fadvise", NoRefs },
+  { "stat", Arg0Refs },
+  { "fstat", NoRefs },
+  { "isatty", NoRefs },
+  { "__libc_sigaction", Arg1Refs },
+  { "socket", NoRefs },
+  { "bind", Arg1Refs },
+  { "listen", NoRefs },
+  { "setsockopt", Arg3Refs },
+  { "__libc_accept", SocklenArg2Refs },
+  { "poll", PollRefs },
+  { "shutdown", NoRefs },
+  { "__libc_nanosleep", Arg0Refs },
+  { "mkdir", Arg0Refs },
+  { "rmdir", Arg0Refs },
+  { "rename", Arg0Arg1Refs },
+  { "setuid", NoRefs },
+  { "getuid", NoRefs },
+  { "geteuid", NoRefs },
+  { "setgid", NoRefs },
+  { "getgid", NoRefs },
+  { "getegid", NoRefs },
+  { "closedir", Arg0Refs },
+  { "opendir", Arg0Refs },
+  { "getsockname", SocklenArg2Refs },
+  { "__libc_recvfrom", RecvfromRefs },
+  { "__libc_sendto", SendtoRefs },
+  { "mmap", NoRefs },
+  { "munmap", NoRefs },
+  { "mremap", NoRefs },
+  { "clock_getres", NoRefs },
+  { "getrlimit", NoRefs },
+  { "sigprocmask", Arg1Refs },
+  { "unlink", Arg0Refs },
+  { "__getdents64", NoRefs },
+  { "brk", NoRefs },
+  { "getpid", NoRefs },
+  { "kill", NoRefs },
+  { "uname", NoRefs },
+  { "__pthread_mutex_init", Arg0Arg1Refs },
+  { "__pthread_mutex_lock", Arg0Refs },
+  { "__pthread_mutex_trylock", Arg0Refs },
+  { "__pthread_mutex_unlock", Arg0Refs },
+  { "pthread_setcanceltype", NoRefs },
+  { "pthread_setcancelstate", NoRefs },
+  { "epoll_create", NoRefs },
+  { "dup2", NoRefs },
+  { "access", Arg0Refs },
+  // Terminator
+  { 0, 0 }
+
+};
+
+// Of the stdio calls, those that write a buffer read only their FILE; the rest read all their pointer arguments.
+static IHPFunctionRefInfo StdioCallRefs[] = {
+
+  { "fgets", Arg2Refs },
+  { "fgets_unlocked", Arg2Refs },
+  { "fread", Arg3Refs },
+  { "fread_unlocked", Arg3Refs },
+  // Terminator
+  { 0, 0 }
+
+};
+
+static void addRefInfo(DenseMap<Function*, IHPFunctionInfo>& Map, Module* M, IHPFunctionRefInfo* Refs) {
+
+  for(uint32_t i = 0; Refs[i].Name; ++i) {
+
+    Function* F = M->getFunction(Refs[i].Name);
+    DenseMap<Function*, IHPFunctionInfo>::iterator findit;
+    if(F && (findit = Map.find(F)) != Map.end())
+      findit->second.RefDetails = Refs[i].RefDetails;
+
+  }
+
+}
+
 // Populate tables relating Function* to mod-ref info, instead of looking up by name every time.
 void LLPEAnalysisPass::initMRInfo(Module* M) {
 
@@ -368,6 +616,140 @@ void LLPEAnalysisPass::initMRInfo(Module* M) {
 
   }
 
+  addRefInfo(functionMRInfo, M, VFSCallRefs);
+
+}
+
+// Parse one location of an -llpe-modref-function directive, or return null if it is malformed.
+static IHPLocationInfo* parseMRLocation(StringRef Loc) {
+
+  if(Loc == "errno")
+    return &locErrno;
+  else if(Loc == "return")
+    return &locReturnVal;
+  else if(Loc == "read-buffer")
+    return &locReadBuf;
+  else if(Loc == "poll-fds")
+    return &locPollFds;
+  else if(Loc == "recvfrom-buffer")
+    return &locRecvfromBuffer;
+  else if(Loc.startswith("arg")) {
+
+    StringRef IdxStr, SizeStr;
+    std::tie(IdxStr, SizeStr) = Loc.substr(3).split(':');
+    uint64_t Idx, Size = MemoryLocation::UnknownSize;
+    if((!IdxStr.getAsInteger(10, Idx)) && (SizeStr.empty() || !SizeStr.getAsInteger(10, Size))) {
+      IHPLocationInfo* LocInfo = new IHPLocationInfo();
+      LocInfo->getLocation = 0;
+      LocInfo->argIndex = Idx;
+      LocInfo->argSize = Size;
+      return LocInfo;
+    }
+
+  }
+
+  return 0;
+
+}
+
+// Describe a library call's mod/ref behaviour from an -llpe-modref-function directive:
+// "name,nomodref", or "name,loc[,loc...]" where each loc is one of errno, return, read-buffer,
+// poll-fds, recvfrom-buffer, argN (all of argument N) or argN:size (size bytes at argument N).
+// A loc prefixed "ref:" is read rather than written; "ref:none" says the call reads nothing through
+// its arguments, and with no ref locs it may read through any of them.
+// This replaces any description the built-in table gives.
+void LLPEAnalysisPass::addMRInfo(Module* M, const std::string& Spec) {
+
+  StringRef Rest(Spec);
+  StringRef FName;
+  std::tie(FName, Rest) = Rest.split(',');
+
+  Function* F = M->getFunction(FName);
+  if((!F) || Rest.empty()) {
+
+    errs() << "-llpe-modref-function must have form function_name,nomodref or function_name,loc[,loc...] naming an existing function\n";
+    exit(1);
+
+  }
+
+  IHPFunctionInfo& Info = functionMRInfo[F];
+  Info.Name = F->getName().data();
+  Info.NoModRef = false;
+  Info.LocationDetails = 0;
+  Info.getLocationDetailsFor = 0;
+  Info.RefDetails = 0;
+
+  if(Rest == "nomodref") {
+    Info.NoModRef = true;
+    return;
+  }
+
+  SmallVector<StringRef, 4> Locs;
+  Rest.split(Locs, ',');
+
+  std::vector<IHPLocationInfo*> ModLocs, RefLocs;
+  bool anyRefs = false;
+
+  for(uint32_t i = 0, ilim = Locs.size(); i != ilim; ++i) {
+
+    StringRef Loc = Locs[i].trim();
+    IHPLocationInfo* LocInfo;
+
+    if(Loc.startswith("ref:")) {
+
+      anyRefs = true;
+      Loc = Loc.substr(4);
+      if(Loc == "none")
+	continue;
+      if((LocInfo = parseMRLocation(Loc)))
+	RefLocs.push_back(LocInfo);
+
+    }
+    else if((LocInfo = parseMRLocation(Loc))) {
+
+      ModLocs.push_back(LocInfo);
+
+    }
+
+    if(!LocInfo) {
+
+      errs() << "-llpe-modref-function: bad location " << Loc << " for " << FName << "\n";
+      exit(1);
+
+    }
+
+  }
+
+  // Null-terminated, as for the built-in descriptions.
+  IHPLocationMRInfo* Details = new IHPLocationMRInfo[ModLocs.size() + 1];
+  for(uint32_t i = 0, ilim = ModLocs.size(); i != ilim; ++i)
+    Details[i].Location = ModLocs[i];
+  Details[ModLocs.size()].Location = 0;
+  Info.LocationDetails = Details;
+
+  if(anyRefs) {
+
+    IHPLocationMRInfo* RefDetails = new IHPLocationMRInfo[RefLocs.size() + 1];
+    for(uint32_t i = 0, ilim = RefLocs.size(); i != ilim; ++i)
+      RefDetails[i].Location = RefLocs[i];
+    RefDetails[RefLocs.size()].Location = 0;
+    Info.RefDetails = RefDetails;
+
+  }
+
+}
+
+void LLPEAnalysisPass::initStdioMRInfo(Module* M) {
+
+  for(uint32_t i = 0; StdioCallFunctions[i].Name; ++i) {
+
+    if(Function* F = M->getFunction(StdioCallFunctions[i].Name))
+      functionMRInfo[F] = StdioCallFunctions[i];
+
+  }
+
+  addRefInfo(functionMRInfo, M, StdioCallRefs);
+
 }
 
 IHPFunctionInfo* LLPEAnalysisPass::getMRInfo(Function* F) {
@@ -18,7 +18,7 @@
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Support/Debug.h"
-#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/IR/CFG.h"
 #include <fcntl.h> // For O_RDONLY et al
 #include <unistd.h>
@@ -44,6 +44,20 @@ static cl::opt<bool> ElimRedundantChecks("int-elim-read-checks");
 // Introduced checks will use memcmp rather than referring to the given file.
 static cl::opt<std::string> SpecStdIn("int-spec-stdin");
 
+template<class KeyT> static bool lookupConstantString(DenseMap<KeyT, uint32_t>& Cache, const KeyT& Key, uint32_t& Id) {
+
+  typename DenseMap<KeyT, uint32_t>::iterator findit = Cache.find(Key);
+  if(findit == Cache.end()) {
+    ++GlobalIHP->stats.constantStringMisses;
+    return false;
+  }
+
+  ++GlobalIHP->stats.constantStringHits;
+  Id = findit->second;
+  return true;
+
+}
+
 // Attempt to retrieve a constant string from Ptr, using the symbolic store as of SearchFrom if necessary. Used to get the
 // filename argument for 'open' et al.
 bool IntegrationAttempt::getConstantString(ShadowValue Ptr, ShadowInstruction* SearchFrom, std::string& Result) {
@@ -60,17 +74,29 @@ bool IntegrationAttempt::getConstantString(ShadowValue Ptr, ShadowInstruction* S
     return false;
 
   Constant* CGInit = 0;
+  // Decoded strings are cached when their bytes can't change: those in constant globals for good,
+  // and those read from a multi for as long as its stamp, which changes whenever it is written.
+  GlobalVariable* CacheGV = 0;
+  ImprovedValSetMulti* CacheIVM = 0;
+  uint32_t CachedId;
 
   if(ShadowGV* G = StrBase.getGV()) {
       
     GlobalVariable* GV = G->G;
     if(GV->isConstant()) {
 
+      CacheGV = GV;
+      if(lookupConstantString(pass->constantGVStrings, std::make_pair(GV, StrOffset), CachedId)) {
+	Result = getFDFilename(CachedId);
+	return true;
+      }
+
       Type* Int8Ptr = Type::getInt8PtrTy(GV->getContext());
       Constant* QueryCE = getGVOffset(GV, StrOffset, Int8Ptr);
 
       if(getConstantStringInfo(QueryCE, RResult)) {
 	Result = RResult.str();
+	pass->constantGVStrings[std::make_pair(GV, StrOffset)] = internFDFilename(Result);
 	return true;
       }
 
@@ -81,6 +107,22 @@ bool IntegrationAttempt::getConstantString(ShadowValue Ptr, ShadowInstruction* S
 
   }
 
+  if(!CacheGV) {
+
+    if(LocStore* Store = SearchFrom->parent->getReadableStoreFor(StrBase)) {
+
+      LocStore::simplifyStore(Store);
+      CacheIVM = dyn_cast<ImprovedValSetMulti>(Store->store);
+      if(CacheIVM && lookupConstantString(pass->storeStrings, std::make_pair(CacheIVM->Stamp, StrOffset), CachedId)) {
+	Result = getFDFilename(CachedId);
+	return true;
+      }
+
+    }
+
+  }
+
+  int64_t StartOffset = StrOffset;
   Result = "";
   
   // Try to read one character at a time until we get null or a failure.
@@ -135,6 +177,13 @@ bool IntegrationAttempt::getConstantString(ShadowValue Ptr, ShadowInstruction* S
 
   }
 
+  if(success) {
+    if(CacheGV)
+      pass->constantGVStrings[std::make_pair(CacheGV, StartOffset)] = internFDFilename(Result);
+    else if(CacheIVM)
+      pass->storeStrings[std::make_pair(CacheIVM->Stamp, StartOffset)] = internFDFilename(Result);
+  }
+
   return success;
 
 }
@@ -151,19 +200,32 @@ FDStore* ShadowBB::getWritableFDStore() {
 void FDStoreMerger::merge2(FDStore* mergeTo, FDStore* mergeFrom)  {
 
   // Simple merge rule: FDs only defined on one path or the other go away entirely,
-  // FDs with conflicting positions go to pos -1 (unknown), all others stay.
+  // FDs with conflicting positions or EOF indicators go to pos -1 (unknown), all others stay.
 
-  mergeTo->fds.resize(std::min(mergeTo->fds.size(), mergeFrom->fds.size()));
+  mergeTo->resize(std::min(mergeTo->size(), mergeFrom->size()));
 
-  for(uint32_t i = 0, ilim = mergeTo->fds.size(); i != ilim; ++i) {
+  for(uint32_t i = 0, ilim = mergeTo->size(); i != ilim; ++i) {
+
+    // Chunks the two stores share agree throughout.
+    if(mergeTo->chunks[i / FDStoreChunk::Size] == mergeFrom->chunks[i / FDStoreChunk::Size]) {
+      i = std::min(ilim, (i / FDStoreChunk::Size + 1) * FDStoreChunk::Size) - 1;
+      continue;
+    }
+
+    const FDState& From = mergeFrom->get(i);
+    const FDState& To = mergeTo->get(i);
 
-    if(mergeFrom->fds[i].pos != mergeTo->fds[i].pos)
-      mergeTo->fds[i].pos = (uint64_t)-1;
     // 'clean' means we're confident that FD positions and files are as expected;
     // there's no need to check they're as expected e.g. due to another thread using
     // the FD in the meantime, or another thread or program altering the file.
-    if(!mergeFrom->fds[i].clean)
-      mergeTo->fds[i].clean = false;
+    if(From.pos == To.pos && From.eof == To.eof && (From.clean || !To.clean))
+      continue;
+
+    FDState& WriteTo = mergeTo->getWritableFD(i);
+    if(From.pos != WriteTo.pos || From.eof != WriteTo.eof)
+      WriteTo.pos = (uint64_t)-1;
+    if(!From.clean)
+      WriteTo.clean = false;
 
   }
 
@@ -299,97 +361,243 @@ bool IntegrationAttempt::tryPromoteOpenCall(ShadowInstruction* SI) {
   if(!inst_is<CallInst>(SI))
     return false;
 
-  if(Function *SysOpen = F.getParent()->getFunction("open")) {
-    const FunctionType *FT = SysOpen->getFunctionType();
-    if (FT->getNumParams() == 2 && FT->getReturnType()->isIntegerTy(32) &&
+  Function* FCalled = getCalledFunction(SI);
+  uint8_t Kind = FCalled ? pass->getCallClassInfo(FCalled).vfsKind : (uint8_t)VFSCALL_NONE;
+
+  if(Kind == VFSCALL_FOPEN)
+    return tryPromoteFopenCall(SI, FCalled);
+
+  if(Kind != VFSCALL_OPEN)
+    return false;
+
+  const FunctionType *FT = FCalled->getFunctionType();
+  if (!(FT->getNumParams() == 2 && FT->getReturnType()->isIntegerTy(32) &&
         FT->getParamType(0)->isPointerTy() &&
         FT->getParamType(1)->isIntegerTy(32) &&
-	FT->isVarArg()) {
+        FT->isVarArg())) {
 
-      if(Function* FCalled = getCalledFunction(SI)) {
+    LPDEBUG("Unable to identify " << itcache(SI) << " as an open call because the symbol 'open' resolves to something with inappropriate type!\n");
+    return false;
 
-	if(FCalled == SysOpen) {
+  }
 
-	  if(SI->i.PB)
-	    deleteIV(SI->i.PB);
-	  SI->i.PB = newOverdefIVS();
+  if(SI->i.PB)
+    deleteIV(SI->i.PB);
+  SI->i.PB = newOverdefIVS();
 
-	  uint64_t RawMode64;
-	  if(tryGetConstantIntReplacement(SI->getCallArgOperand(1), RawMode64)) {
-	    int RawMode = (int)RawMode64;
-	    if(RawMode & O_WRONLY) {
-	      LPDEBUG("Can't promote open call " << itcache(SI) << " because it is not O_RDONLY\n");
-	      return true;
-	    }
-	  }
-	  else {
-	    LPDEBUG("Can't promote open call " << itcache(SI) << " because its mode argument can't be resolved\n");
-	    return true;
-	  }
-	  
-	  ShadowValue NameArg = SI->getCallArgOperand(0);
-	  std::string Filename;
-	  if (!getConstantString(NameArg, SI, Filename)) {
-	    LPDEBUG("Can't promote open call " << itcache(SI) << " because its filename argument is unresolved\n");
-	    return true;
-	  }
+  uint64_t RawMode64;
+  if(tryGetConstantIntReplacement(SI->getCallArgOperand(1), RawMode64)) {
+    int RawMode = (int)RawMode64;
+    if(RawMode & O_WRONLY) {
+      LPDEBUG("Can't promote open call " << itcache(SI) << " because it is not O_RDONLY\n");
+      return true;
+    }
+  }
+  else {
+    LPDEBUG("Can't promote open call " << itcache(SI) << " because its mode argument can't be resolved\n");
+    return true;
+  }
+  
+  ShadowValue NameArg = SI->getCallArgOperand(0);
+  std::string Filename;
+  if (!getConstantString(NameArg, SI, Filename)) {
+    LPDEBUG("Can't promote open call " << itcache(SI) << " because its filename argument is unresolved\n");
+    return true;
+  }
 
-	  bool exists = sys::fs::exists(Filename);
-	  pass->forwardableOpenCalls[SI] = new OpenStatus(Filename, exists);
-	  if(exists) {
+  struct stat file_stat;
+  bool exists = getSnapshotStat(Filename, file_stat) == 0;
+  pass->forwardableOpenCalls[SI] = new OpenStatus(Filename, exists);
+  if(exists) {
+
+    FDStore* FDS = SI->parent->getWritableFDStore();
+    uint32_t newId = pass->fds.size();
+    pass->fds.push_back(FDGlobalState(SI, /* not a fifo */ false));
+    if(FDS->size() <= newId)
+      FDS->resize(newId + 1);
+    FDS->getWritableFD(newId) = FDState(Filename);
+    
+    cast<ImprovedValSetSingle>(SI->i.PB)->set(ImprovedVal(ShadowValue::getFdIdx(newId)), ValSetTypeFD);
 
-	    FDStore* FDS = SI->parent->getWritableFDStore();
-	    uint32_t newId = pass->fds.size();
-	    pass->fds.push_back(FDGlobalState(SI, /* not a fifo */ false));
-	    if(FDS->fds.size() <= newId)
-	      FDS->fds.resize(newId + 1);
-	    FDS->fds[newId] = FDState(Filename);
-	    
-	    cast<ImprovedValSetSingle>(SI->i.PB)->set(ImprovedVal(ShadowValue::getFdIdx(newId)), ValSetTypeFD);
+    LPDEBUG("Successfully promoted open of file " << Filename << ": queueing initial forward attempt\n");
 
-	    LPDEBUG("Successfully promoted open of file " << Filename << ": queueing initial forward attempt\n");
+  }
+  else {
+    Constant* negOne = ConstantInt::get(SI->invar->I->getType(), (uint64_t)-1, true);
+    cast<ImprovedValSetSingle>(SI->i.PB)->set(ImprovedVal(ShadowValue(negOne)), ValSetTypeScalar);
+    LPDEBUG("Open of " << Filename << " returning ENOENT\n");
+  }
 
-	  }
-	  else {
-	    Constant* negOne = ConstantInt::get(SI->invar->I->getType(), (uint64_t)-1, true);
-	    cast<ImprovedValSetSingle>(SI->i.PB)->set(ImprovedVal(ShadowValue(negOne)), ValSetTypeScalar);
-	    LPDEBUG("Open of " << Filename << " returning ENOENT\n");
-	  }
+  // Can't share functions that open() or we'll confuse the two open points.
+  noteVFSOp();
 
-	  // Can't share functions that open() or we'll confuse the two open points.
-	  noteVFSOp();
+  return true;
 
-	  return true;
-      
-	}
-	else {
-	  
-	  LPDEBUG("Unable to identify " << itcache(SI) << " as an open call because it calls something else\n");
+}
 
-	}
+// As the open case above, for -llpe-stdio-model: a read-only fopen call's FILE* is tracked as a symbolic FD
+// in its own right, read through the calls tryResolveStdioCall models.
+bool IntegrationAttempt::tryPromoteFopenCall(ShadowInstruction* SI, Function* FCalled) {
 
-      }
-      else {
-	
-	LPDEBUG("Unable to identify " << itcache(SI) << " as an open call because its target is unknown\n");
+  if(SI->i.PB)
+    deleteIV(SI->i.PB);
+  SI->i.PB = newOverdefIVS();
 
-      }
+  std::string Mode;
+  if((!getConstantString(SI->getCallArgOperand(1), SI, Mode)) || (Mode != "r" && Mode != "rb")) {
+    LPDEBUG("Can't promote fopen call " << itcache(SI) << " because its mode is unresolved or not read-only\n");
+    return true;
+  }
 
-    }
-    else {
+  std::string Filename;
+  if (!getConstantString(SI->getCallArgOperand(0), SI, Filename)) {
+    LPDEBUG("Can't promote fopen call " << itcache(SI) << " because its filename argument is unresolved\n");
+    return true;
+  }
+
+  struct stat file_stat;
+  bool exists = getSnapshotStat(Filename, file_stat) == 0;
+  pass->forwardableOpenCalls[SI] = new OpenStatus(Filename, exists);
+  if(exists) {
 
-      LPDEBUG("Unable to identify " << itcache(SI) << " as an open call because the symbol 'open' resolves to something with inappropriate type!\n");
+    FDStore* FDS = SI->parent->getWritableFDStore();
+    uint32_t newId = pass->fds.size();
+    pass->fds.push_back(FDGlobalState(SI, /* not a fifo */ false));
+    if(FDS->size() <= newId)
+      FDS->resize(newId + 1);
+    FDS->getWritableFD(newId) = FDState(Filename);
 
-    }
+    // Pointer-sized, like an FD cast to int64.
+    cast<ImprovedValSetSingle>(SI->i.PB)->set(ImprovedVal(ShadowValue::getFdIdx64(newId)), ValSetTypeFD);
+
+    LPDEBUG("Successfully promoted fopen of file " << Filename << "\n");
 
   }
   else {
 
-    LPDEBUG("Unable to identify " << itcache(SI) << " as an open call because no symbol 'open' is in scope\n");
+    std::pair<ValSetType, ImprovedVal> Null = getValPB(Constant::getNullValue(SI->getType()));
+    cast<ImprovedValSetSingle>(SI->i.PB)->set(Null.second, Null.first);
+    LPDEBUG("fopen of " << Filename << " returning NULL\n");
 
   }
 
-  return false;
+  noteVFSOp();
+
+  return true;
+
+}
+
+// Stdio calls on a stream modelled by -llpe-stdio-model, with the position of the stream argument.
+struct StdioCallInfo {
+
+  const char* Name;
+  VFSCallKind kind;
+  uint32_t streamArg;
+
+};
+
+static StdioCallInfo StdioCalls[] = {
+
+  // Resolved by tryResolveStdioCall:
+  { "fgetc", VFSCALL_FGETC, 0 },
+  { "getc", VFSCALL_FGETC, 0 },
+  { "_IO_getc", VFSCALL_FGETC, 0 },
+  { "fgetc_unlocked", VFSCALL_FGETC, 0 },
+  { "getc_unlocked", VFSCALL_FGETC, 0 },
+  { "fgets", VFSCALL_FGETS, 2 },
+  { "fgets_unlocked", VFSCALL_FGETS, 2 },
+  { "fread", VFSCALL_FREAD, 3 },
+  { "fread_unlocked", VFSCALL_FREAD, 3 },
+  { "fclose", VFSCALL_FCLOSE, 0 },
+  { "fseek", VFSCALL_FSEEK, 0 },
+  { "fseeko", VFSCALL_FSEEK, 0 },
+  { "fseeko64", VFSCALL_FSEEK, 0 },
+  { "rewind", VFSCALL_REWIND, 0 },
+  { "ftell", VFSCALL_FTELL, 0 },
+  { "ftello", VFSCALL_FTELL, 0 },
+  { "ftello64", VFSCALL_FTELL, 0 },
+  { "feof", VFSCALL_FEOF, 0 },
+  { "feof_unlocked", VFSCALL_FEOF, 0 },
+  { "ferror", VFSCALL_FERROR, 0 },
+  { "ferror_unlocked", VFSCALL_FERROR, 0 },
+  { "clearerr", VFSCALL_CLEARERR, 0 },
+  { "clearerr_unlocked", VFSCALL_CLEARERR, 0 },
+  // Leave the stream position unknown:
+  { "ungetc", VFSCALL_STDIO_OTHER, 1 },
+  { "getline", VFSCALL_STDIO_OTHER, 2 },
+  { "getdelim", VFSCALL_STDIO_OTHER, 3 },
+  { "fscanf", VFSCALL_STDIO_OTHER, 0 },
+  { "__isoc99_fscanf", VFSCALL_STDIO_OTHER, 0 },
+  { "fsetpos", VFSCALL_STDIO_OTHER, 0 },
+  { "fgetpos", VFSCALL_STDIO_OTHER, 0 },
+  { "setvbuf", VFSCALL_STDIO_OTHER, 0 },
+  { "setbuf", VFSCALL_STDIO_OTHER, 0 },
+  { "fileno", VFSCALL_STDIO_OTHER, 0 },
+  { "fileno_unlocked", VFSCALL_STDIO_OTHER, 0 },
+  { 0, VFSCALL_NONE, 0 }
+
+};
+
+static void getStdioCallKind(StringRef Name, CallClassInfo& Info) {
+
+  for(uint32_t i = 0; StdioCalls[i].Name; ++i) {
+
+    if(Name == StdioCalls[i].Name) {
+      Info.vfsKind = StdioCalls[i].kind;
+      Info.streamArg = StdioCalls[i].streamArg;
+      return;
+    }
+
+  }
+
+}
+
+// Classify calls to F by name once, so that analysing a call to anything else, or the same call
+// again in a later loop fixpoint round, skips the VFS and native string handlers' own name tests.
+// The VFS handlers themselves switch on the vfsKind found here.
+CallClassInfo LLPEAnalysisPass::getCallClassInfo(Function* F) {
+
+  DenseMap<Function*, CallClassInfo>::iterator findit = callClasses.find(F);
+  if(findit != callClasses.end())
+    return findit->second;
+
+  CallClassInfo Info;
+  StringRef Name = F->getName();
+
+  if(Name == "open")
+    Info.vfsKind = VFSCALL_OPEN;
+  else if(Name == "read")
+    Info.vfsKind = VFSCALL_READ;
+  else if(Name == "recvfrom")
+    Info.vfsKind = VFSCALL_RECVFROM;
+  else if(Name == "llseek" || Name == "lseek" || Name == "lseek64")
+    Info.vfsKind = VFSCALL_SEEK;
+  else if(Name == "close")
+    Info.vfsKind = VFSCALL_CLOSE;
+  else if(Name == "stat")
+    Info.vfsKind = VFSCALL_STAT;
+  else if(Name == "fstat")
+    Info.vfsKind = VFSCALL_FSTAT;
+  else if(Name == "isatty")
+    Info.vfsKind = VFSCALL_ISATTY;
+  else if(modelStdio) {
+    if(Name == "fopen" || Name == "fopen64")
+      Info.vfsKind = VFSCALL_FOPEN;
+    else
+      getStdioCallKind(Name, Info);
+  }
+
+  if(Info.vfsKind != VFSCALL_NONE)
+    Info.flags |= CALLCLASS_VFS;
+
+  if(nativeStringFunctions.count(F))
+    Info.flags |= CALLCLASS_NATIVESTRING;
+
+  if(summaryFunctions.count(F))
+    Info.flags |= CALLCLASS_SUMMARY;
+
+  callClasses[F] = Info;
+  return Info;
 
 }
 
@@ -446,13 +654,17 @@ static AliasResult aliasesFD(ShadowValue V, ShadowInstruction* FD) {
 
 // Add 'Filename' to the list of files we've consumed from in generating the specialised program,
 // and therefore which must be watched for concurrent alteration to ensure correctness.
-void llvm::noteLLIODependency(std::string& Filename) {
+void llvm::noteLLIODependency(std::string& Filename, bool statted) {
   
   std::vector<std::string>::iterator findit = 
     std::find(GlobalIHP->llioDependentFiles.begin(), GlobalIHP->llioDependentFiles.end(), Filename);
 
-  if(findit == GlobalIHP->llioDependentFiles.end())
+  if(findit == GlobalIHP->llioDependentFiles.end()) {
     GlobalIHP->llioDependentFiles.push_back(Filename);
+    GlobalIHP->llioStatDependencies.push_back(statted);
+  }
+  else if(statted)
+    GlobalIHP->llioStatDependencies[findit - GlobalIHP->llioDependentFiles.begin()] = true;
   
 }
 
@@ -460,14 +672,14 @@ void llvm::noteLLIODependency(std::string& Filename) {
 bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, std::string& Filename) {
 
   struct stat file_stat;
-  int stat_ret = ::stat(Filename.c_str(), &file_stat);
+  int stat_ret = getSnapshotStat(Filename, file_stat);
 
   if(stat_ret == -1 && errno != ENOENT)
     return false;
 
   if(!Filename.empty()) {
 
-    noteLLIODependency(Filename);
+    noteLLIODependency(Filename, true);
     // Use the file-watcher daemon at runtime to check the specialisation
     // is still correct.
     SI->needsRuntimeCheck = RUNTIME_CHECK_READ_LLIOWD;
@@ -511,11 +723,14 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
   if(!F)
     return false;
 
+  CallClassInfo Info = pass->getCallClassInfo(F);
+  if(Info.vfsKind > VFSCALL_FOPEN)
+    return tryResolveStdioCall(SI, F, Info);
+
   const FunctionType *FT = F->getFunctionType();
   
-  if(!(F->getName() == "read" || F->getName() == "llseek" || F->getName() == "lseek" || 
-       F->getName() == "lseek64" || F->getName() == "close" || F->getName() == "stat" ||
-       F->getName() == "fstat" || F->getName() == "isatty" || F->getName() == "recvfrom"))
+  // open and fopen are handled by tryPromoteOpenCall.
+  if(Info.vfsKind == VFSCALL_NONE || Info.vfsKind == VFSCALL_OPEN || Info.vfsKind == VFSCALL_FOPEN)
     return false;
 
   if(SI->i.PB) {
@@ -527,7 +742,7 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
   }
   SI->i.PB = newOverdefIVS();
 
-  if(F->getName() == "stat") {
+  if(Info.vfsKind == VFSCALL_STAT) {
 
     // TODO: Add LF resolution code notifying file size. All users so far have just
     // used stat as an existence test. Similarly set errno = ENOENT as appropriate.
@@ -550,22 +765,22 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
   uint32_t FD = getFD(SI->getCallArgOperand(0));
 
-  bool perturbsFDs = F->getName() == "read" || F->getName() == "llseek" || F->getName() == "lseek" || 
-    F->getName() == "lseek64";
+  bool perturbsFDs = Info.vfsKind == VFSCALL_READ || Info.vfsKind == VFSCALL_SEEK;
  
   // Operates on an unknown FD?
   if(FD == (uint32_t)-1 && perturbsFDs) {
-    fdStore->fds.clear();
+    fdStore->clear();
     return true;
   }
 
   // Operates on an FD not opened on this path?
-  if(SI->parent->fdStore->fds.size() <= FD)
+  if(fdStore->size() <= FD)
     return true;
 
-  FDState& FDS = SI->parent->fdStore->fds[FD];
+  FDState& FDS = fdStore->getWritableFD(FD);
+  std::string Filename = FDS.getFilename();
 
-  if(F->getName() == "isatty") {
+  if(Info.vfsKind == VFSCALL_ISATTY) {
 
     // FD 0 is stdin which may or may not be terminal; no other symbolic FD can currently be a tty.
     
@@ -575,7 +790,7 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     return true;
 
   }
-  else if(F->getName() == "llseek" || F->getName() == "lseek" || F->getName() == "lseek64") {
+  else if(Info.vfsKind == VFSCALL_SEEK) {
 
     pass->resolvedSeekCalls.erase(SI);
 
@@ -606,9 +821,9 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     case SEEK_END:
       {
 	struct stat file_stat;
-	if(::stat(FDS.filename.c_str(), &file_stat) == -1) {
+	if(getSnapshotStat(Filename, file_stat) == -1) {
 	  
-	  LPDEBUG("Failed to stat " << FDS.filename << "\n");
+	  LPDEBUG("Failed to stat " << Filename << "\n");
 	  return true;
 	  
 	}
@@ -626,24 +841,24 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
     // Doesn't matter what came before, resolve this call here.
     setReplacement(SI, ConstantInt::get(FT->getParamType(1), intOffset));
-    resolveSeekCall(SI, SeekFile(FDS.filename, intOffset));
+    resolveSeekCall(SI, SeekFile(Filename, intOffset));
     FDS.pos = intOffset;
     return true;
 
   }
-  else if(F->getName() == "fstat") {
+  else if(Info.vfsKind == VFSCALL_FSTAT) {
 
-    return executeStatCall(SI, F, FDS.filename);
+    return executeStatCall(SI, F, Filename);
 
   }
-  else if(F->getName() == "close") {
+  else if(Info.vfsKind == VFSCALL_CLOSE) {
 
     noteVFSOp();
     setReplacement(SI, ConstantInt::get(FT->getReturnType(), 0));
     return true;
 
   }
-  else if(F->getName() == "read" || F->getName() == "recvfrom") {
+  else if(Info.vfsKind == VFSCALL_READ || Info.vfsKind == VFSCALL_RECVFROM) {
 
     ShadowValue readBytes = SI->getCallArgOperand(2);
     uint64_t ucBytes;
@@ -655,14 +870,14 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     
     int64_t cBytes = (int64_t)ucBytes;
 
-    if(filenameIsForbidden(FDS.filename)) {
+    if(filenameIsForbidden(Filename)) {
       FDS.pos = (uint64_t)-1;
       return true;
     }
 
     struct stat file_stat;
-    if(::stat(FDS.filename.c_str(), &file_stat) == -1) {
-      LPDEBUG("Failed to stat " << FDS.filename << "\n");
+    if(getSnapshotStat(Filename, file_stat) == -1) {
+      LPDEBUG("Failed to stat " << Filename << "\n");
       FDS.pos = (uint64_t)-1;
       return true;
     }
@@ -684,7 +899,7 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
     bool isFifo = pass->fds[FD].isFifo;
 
-    resolveReadCall(SI, ReadFile(FDS.filename, FDS.pos, cBytes, isFifo));
+    resolveReadCall(SI, ReadFile(Filename, FDS.pos, cBytes, isFifo));
     if(isFifo)
       pass->resolvedReadCalls[SI].needsSeek = false;
     
@@ -692,10 +907,10 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     setReplacement(SI, ConstantInt::get(Type::getInt64Ty(F->getContext()), cBytes));
 
     // Write the relevant data into the symbolic store.
-    executeReadInst(SI, FDS.filename, FDS.pos, cBytes);
+    executeReadInst(SI, SI->getCallArgOperand(1), Filename, FDS.pos, cBytes);
 
     if(!isFifo)
-      noteLLIODependency(FDS.filename);
+      noteLLIODependency(Filename);
 
     if(isFifo)
       SI->needsRuntimeCheck = RUNTIME_CHECK_READ_MEMCMP;
@@ -714,6 +929,301 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
   
 }
 
+// Could V be a stream we're modelling, for all we know?
+static bool mayBeStdioStream(ShadowValue V) {
+
+  ImprovedValSetSingle VPB;
+  if(!getImprovedValSetSingle(V, VPB))
+    return true;
+
+  return VPB.isWhollyUnknown() || VPB.SetType == ValSetTypeFD;
+
+}
+
+// Get the bytes from a getFileBytes result. All-zero reads come back as a ConstantAggregateZero.
+static void getReadBytes(Constant* C, SmallVector<uint8_t, 64>& Bytes) {
+
+  if(ConstantDataSequential* CDS = dyn_cast<ConstantDataSequential>(C)) {
+    StringRef Raw = CDS->getRawDataValues();
+    Bytes.append(Raw.begin(), Raw.end());
+  }
+  else {
+    Bytes.resize(cast<ArrayType>(C->getType())->getNumElements(), 0);
+  }
+
+}
+
+// Try to execute a stdio call on a stream opened by tryPromoteFopenCall (-llpe-stdio-model), using the stream's FD
+// state as tryResolveVFSCall does for read() and friends. Reads are resolved in the same way too, becoming copies
+// from the file's bytes and perhaps an fseek to keep the real FILE in step when the program is committed.
+// Return value: as for tryResolveVFSCall. Calls that can't be resolved on a modelled stream are left unexpanded.
+bool IntegrationAttempt::tryResolveStdioCall(ShadowInstruction* SI, Function* F, const CallClassInfo& Info) {
+
+  uint32_t streamArg = Info.streamArg;
+  Type* RetTy = F->getFunctionType()->getReturnType();
+
+  if(SI->i.PB) {
+
+    deleteIV(SI->i.PB);
+    pass->resolvedReadCalls.erase(SI);
+
+  }
+  SI->i.PB = newOverdefIVS();
+
+  ShadowValue Stream = SI->getCallArgOperand(streamArg);
+  uint32_t FD = getFD(Stream);
+
+  if(FD == (uint32_t)-1) {
+
+    // Not one of our streams, so analyse or clobber as usual. If it might be one after all,
+    // its position is lost; the mod/ref descriptions of these calls don't say so.
+    if(mayBeStdioStream(Stream))
+      SI->parent->getWritableFDStore()->clear();
+    return false;
+
+  }
+
+  FDStore* fdStore = SI->parent->getWritableFDStore();
+
+  // Operates on a stream not opened on this path?
+  if(fdStore->size() <= FD)
+    return true;
+
+  FDState& FDS = fdStore->getWritableFD(FD);
+  std::string Filename = FDS.getFilename();
+
+  switch(Info.vfsKind) {
+
+  case VFSCALL_FCLOSE:
+
+    noteVFSOp();
+    setReplacement(SI, ConstantInt::get(RetTy, 0));
+    return true;
+
+  case VFSCALL_FEOF:
+  case VFSCALL_FERROR:
+
+    // Resolved reads never fail.
+    if(FDS.pos != (uint64_t)-1)
+      setReplacement(SI, ConstantInt::get(RetTy, (Info.vfsKind == VFSCALL_FEOF && FDS.eof) ? 1 : 0));
+    return true;
+
+  case VFSCALL_CLEARERR:
+
+    FDS.eof = false;
+    return true;
+
+  case VFSCALL_FTELL:
+
+    if(FDS.pos != (uint64_t)-1)
+      setReplacement(SI, ConstantInt::get(RetTy, FDS.pos));
+    return true;
+
+  case VFSCALL_REWIND:
+
+    noteVFSOp();
+    FDS.pos = 0;
+    FDS.eof = false;
+    return true;
+
+  case VFSCALL_FSEEK:
+  {
+
+    // The real fseek is still made, but its result and the new position are known.
+    uint64_t intOffset;
+    uint64_t seekWhence64;
+
+    if((!tryGetConstantIntReplacement(SI->getCallArgOperand(2), seekWhence64)) || 
+       (!tryGetConstantIntReplacement(SI->getCallArgOperand(1), intOffset))) {
+    
+      FDS.pos = (uint64_t)-1;
+      return true;
+
+    }
+
+    switch((int32_t)seekWhence64) {
+    case SEEK_CUR:
+      if(FDS.pos == (uint64_t)-1)
+	return true;
+      intOffset += FDS.pos;
+      break;
+    case SEEK_END:
+      {
+	struct stat file_stat;
+	if(getSnapshotStat(Filename, file_stat) == -1) {
+	  FDS.pos = (uint64_t)-1;
+	  return true;
+	}
+	intOffset += file_stat.st_size;
+	break;
+      }
+    case SEEK_SET:
+      break;
+    default:
+      FDS.pos = (uint64_t)-1;
+      return true;
+    }
+
+    // Seeking before the start fails with EINVAL.
+    if((int64_t)intOffset < 0) {
+      FDS.pos = (uint64_t)-1;
+      return true;
+    }
+
+    noteVFSOp();
+    setReplacement(SI, ConstantInt::get(RetTy, 0));
+    FDS.pos = intOffset;
+    FDS.eof = false;
+    return true;
+
+  }
+
+  default:
+    break;
+
+  }
+
+  // Only reads remain that we can resolve.
+  bool isGetc = Info.vfsKind == VFSCALL_FGETC;
+  bool isFgets = Info.vfsKind == VFSCALL_FGETS;
+  bool isFread = Info.vfsKind == VFSCALL_FREAD;
+
+  uint64_t wantBytes = 0, itemSize = 1;
+  if(isGetc) {
+    wantBytes = 1;
+  }
+  else if(isFgets) {
+    // fgets reads at most n - 1 bytes, then writes a NUL.
+    uint64_t n;
+    if(tryGetConstantIntReplacement(SI->getCallArgOperand(1), n) && (int32_t)n >= 2)
+      wantBytes = n - 1;
+  }
+  else if(isFread) {
+    uint64_t items;
+    if(tryGetConstantIntReplacement(SI->getCallArgOperand(1), itemSize) &&
+       tryGetConstantIntReplacement(SI->getCallArgOperand(2), items) && itemSize != 0)
+      wantBytes = itemSize * items;
+  }
+
+  struct stat file_stat;
+  if(wantBytes == 0 || FDS.pos == (uint64_t)-1 || pass->fds[FD].isFifo || filenameIsForbidden(Filename) ||
+     getSnapshotStat(Filename, file_stat) == -1 || !(file_stat.st_mode & S_IFREG)) {
+
+    // Treat as an unknown call on the stream.
+    FDS.pos = (uint64_t)-1;
+    executeUnexpandedCall(SI);
+    return true;
+
+  }
+
+  uint64_t availBytes = 0;
+  if(FDS.pos < (uint64_t)file_stat.st_size)
+    availBytes = std::min(wantBytes, (uint64_t)file_stat.st_size - FDS.pos);
+
+  uint64_t readBytes = availBytes;
+  bool hitEOF = availBytes < wantBytes;
+  int32_t bufArg = -1;
+  bool nulTerminate = false;
+
+  if(isGetc) {
+
+    if(availBytes == 0) {
+      setReplacement(SI, ConstantInt::get(RetTy, (uint64_t)EOF, true));
+    }
+    else {
+
+      Constant* ByteArray;
+      std::string errors;
+      if(!getReadCallBytes(SI, Filename, FDS.pos, 1, false, ByteArray, errors)) {
+	FDS.pos = (uint64_t)-1;
+	executeUnexpandedCall(SI);
+	return true;
+      }
+
+      SmallVector<uint8_t, 64> Bytes;
+      getReadBytes(ByteArray, Bytes);
+      setReplacement(SI, ConstantInt::get(RetTy, Bytes[0]));
+
+    }
+
+  }
+  else if(isFgets) {
+
+    bufArg = 0;
+
+    if(availBytes == 0) {
+
+      // At EOF before anything is read: returns null and leaves the buffer alone.
+      setReplacement(SI, Constant::getNullValue(RetTy));
+
+    }
+    else {
+
+      // The line runs up to and including the first newline, if there is one within range.
+      Constant* ByteArray;
+      std::string errors;
+      if(!getReadCallBytes(SI, Filename, FDS.pos, availBytes, false, ByteArray, errors)) {
+	FDS.pos = (uint64_t)-1;
+	executeUnexpandedCall(SI);
+	return true;
+      }
+
+      SmallVector<uint8_t, 64> Bytes;
+      getReadBytes(ByteArray, Bytes);
+      SmallVector<uint8_t, 64>::iterator NL = std::find(Bytes.begin(), Bytes.end(), '\n');
+      if(NL != Bytes.end()) {
+	readBytes = (NL - Bytes.begin()) + 1;
+	hitEOF = false;
+      }
+
+      nulTerminate = true;
+
+      // fgets returns its buffer.
+      ImprovedValSetSingle BufSet;
+      if(getImprovedValSetSingle(SI->getCallArgOperand(0), BufSet)) {
+	deleteIV(SI->i.PB);
+	SI->i.PB = copyIV(&BufSet);
+      }
+
+    }
+
+  }
+  else {
+
+    bufArg = 0;
+    setReplacement(SI, ConstantInt::get(RetTy, readBytes / itemSize));
+
+  }
+
+  LPDEBUG("Successfully resolved " << itcache(SI) << " which reads " << readBytes << " bytes\n");
+
+  noteVFSOp();
+
+  ReadFile RF(Filename, FDS.pos, readBytes, false);
+  RF.isStdio = true;
+  RF.fdArg = streamArg;
+  RF.bufArg = bufArg;
+  RF.nulTerminate = nulTerminate;
+  resolveReadCall(SI, RF);
+
+  if(bufArg != -1 && (readBytes || nulTerminate))
+    executeReadInst(SI, SI->getCallArgOperand(bufArg), Filename, FDS.pos, readBytes, nulTerminate);
+
+  noteLLIODependency(Filename);
+  if(!FDS.clean)
+    SI->needsRuntimeCheck = RUNTIME_CHECK_READ_LLIOWD;
+
+  this->containsCheckedReads = true;
+
+  FDS.pos += readBytes;
+  FDS.eof = hitEOF;
+  if(ElimRedundantChecks)
+    FDS.clean = true;
+
+  return true;
+
+}
+
 ReadFile* IntegrationAttempt::tryGetReadFile(ShadowInstruction* CI) {
 
   DenseMap<ShadowInstruction*, ReadFile>::iterator it = pass->resolvedReadCalls.find(CI);
@@ -735,8 +1245,27 @@ WalkInstructionResult IntegrationAttempt::isVfsCallUsingFD(ShadowInstruction* VF
   if(VFSCall == FD)
     return WIRStopThisPath;
 
-  StringRef CalleeName = Callee->getName();
-  if(CalleeName == "read") {
+  CallClassInfo Info = pass->getCallClassInfo(Callee);
+
+  if(Info.vfsKind > VFSCALL_FOPEN) {
+
+    // As close and read below.
+    if(Info.vfsKind == VFSCALL_FCLOSE)
+      return ignoreClose ? WIRContinue : WIRStopThisPath;
+
+    switch(aliasesFD(VFSCall->getCallArgOperand(Info.streamArg), FD)) {
+    case MayAlias:
+    case PartialAlias:
+      return WIRStopWholeWalk;
+    case NoAlias:
+      return WIRContinue;
+    case MustAlias:
+      return WIRStopThisPath;
+    }
+
+  }
+
+  if(Info.vfsKind == VFSCALL_READ) {
     
     ShadowValue readFD = VFSCall->getCallArgOperand(0);
     
@@ -754,7 +1283,7 @@ WalkInstructionResult IntegrationAttempt::isVfsCallUsingFD(ShadowInstruction* VF
     }
     
   }
-  else if(CalleeName == "close") {
+  else if(Info.vfsKind == VFSCALL_CLOSE) {
 
     // If we're walking backwards:
     // Finding this indicates we could double-close if this path were followed for real!
@@ -763,7 +1292,7 @@ WalkInstructionResult IntegrationAttempt::isVfsCallUsingFD(ShadowInstruction* VF
     return ignoreClose ? WIRContinue : WIRStopThisPath;
     
   }
-  else if(CalleeName == "llseek" || CalleeName == "lseek" || CalleeName == "lseek64") {
+  else if(Info.vfsKind == VFSCALL_SEEK) {
     
     ShadowValue seekFD = VFSCall->getCallArgOperand(0);
     
@@ -834,6 +1363,10 @@ bool IntegrationAttempt::isUnusedReadCall(ShadowInstruction* CI) {
   DenseMap<ShadowInstruction*, ReadFile>::iterator it = pass->resolvedReadCalls.find(CI);
   if(it != pass->resolvedReadCalls.end()) {
 
+    // fgets returns its buffer, so the buffer is needed for as long as the result is.
+    if(it->second.nulTerminate)
+      return false;
+
     return CI->dieStatus & INSTSTATUS_UNUSED_WRITER || !it->second.readSize;
 
   }
@@ -912,9 +1445,70 @@ static bool callMayUseFD(ShadowInstruction* SI, ShadowInstruction* FD) {
 
 }
 
+// Could any call within this context, its loop iterations or its callees involve any FD at all?
+// Answers true when unsure, including when the instructions have been released after commit.
+bool IntegrationAttempt::containsFDUsers() {
+
+  if(!BBs)
+    return true;
+
+  for(uint32_t i = 0, ilim = nBBs; i != ilim; ++i) {
+
+    ShadowBB* BB = BBs[i];
+    if(!BB)
+      continue;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction* SI = &(BB->insts[j]);
+      if(inst_is<InvokeInst>(SI))
+	return true;
+      if((!inst_is<CallInst>(SI)) || !callMayUseFD(SI, 0))
+	continue;
+
+      InlineAttempt* IA = getInlineAttempt(SI);
+      if((!IA) || IA->mayUseFDs())
+	return true;
+
+    }
+
+  }
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i) {
+      if(it->second->Iterations[i]->containsFDUsers())
+	return true;
+    }
+
+  }
+
+  return false;
+
+}
+
+// Memoised containsFDUsers, letting FD walkers step over a call that can't be relevant
+// without walking every block of the callee.
+bool InlineAttempt::mayUseFDs() {
+
+  if(fdUseSummary == FDUSE_UNKNOWN)
+    fdUseSummary = containsFDUsers() ? FDUSE_YES : FDUSE_NO;
+
+  return fdUseSummary == FDUSE_YES;
+
+}
+
 bool SeekInstructionUnusedWalker::shouldEnterCall(ShadowInstruction* SI, void*) {
 
-  return callMayUseFD(SI, FD);
+  if(!callMayUseFD(SI, FD))
+    return false;
+
+  // Nothing inside mentions any FD: step over the call as a whole.
+  if(InlineAttempt* IA = SI->parent->IA->getInlineAttempt(SI))
+    return IA->mayUseFDs();
+
+  return true;
 
 }
 
@@ -989,7 +1583,7 @@ void IntegrationAttempt::tryKillAllVFSOps() {
 	  // so that subsequent syscalls see the file position where they expect it?
 	  DenseMap<ShadowInstruction*, ReadFile>::iterator it = pass->resolvedReadCalls.find(SI);
 	  if(it != pass->resolvedReadCalls.end()) {
-	    int32_t FD = getFD(SI->getCallArgOperand(0));
+	    int32_t FD = getFD(SI->getCallArgOperand(it->second.fdArg));
 	    if(FD == -1)
 	      continue;
 	    SeekInstructionUnusedWalker Walk(pass->fds[FD].SI, SI);
@@ -1037,46 +1631,138 @@ void IntegrationAttempt::tryKillAllVFSOps() {
 
 }
 
-// Read strFileName[realFilePos : realFilePos + realBytes] as an array of i8 typed Constants.
-// 'errors' will carry a verbose error report. Return true on success.
-bool llvm::getFileBytes(std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors) {
+// Programs commonly read files a few bytes at a time, so rather than mapping each read's range separately
+// we keep a window of each file's bytes, starting at the first read that missed it and running at least
+// FileReadAheadBytes onwards. Reads that fall within the window are sliced straight out of it.
+static const uint64_t FileReadAheadBytes = 64 * 1024;
+
+// As getFileBytes, for read call SI. A loop fixpoint evaluates the same read many times, usually with the
+// same incoming file position, so the bytes SI last produced are kept and reused if it reads the same range
+// again, saving the lookup and the uniquing of a fresh ConstantDataArray. A NUL terminator is included
+// in the array if requested.
+bool llvm::getReadCallBytes(ShadowInstruction* SI, const std::string& Filename, uint64_t Offset, uint64_t Size, bool nulTerminate, Constant*& arrayBytes, std::string& errors) {
 
-  FILE* fp = fopen(strFileName.c_str(), "r");
-  if(!fp) {
-    errors = "Couldn't open " + strFileName + ": " + strerror(errno);
+  ReadBytesMemo& Memo = GlobalIHP->readBytesMemos[std::make_pair(SI, (uint32_t)nulTerminate)];
+  uint32_t filenameId = internFDFilename(Filename);
+
+  if(Memo.bytes && Memo.filenameId == filenameId && Memo.offset == Offset && Memo.size == Size) {
+    ++GlobalIHP->stats.readBytesMemoHits;
+    arrayBytes = Memo.bytes;
+    return true;
+  }
+
+  LLVMContext& Context = SI->invar->I->getContext();
+  if(!getFileBytes(Filename, Offset, Size, arrayBytes, Context, errors))
     return false;
+
+  if(nulTerminate) {
+    // An all-zero read comes back as a ConstantAggregateZero.
+    SmallVector<uint8_t, 64> Terminated(Size + 1, 0);
+    if(ConstantDataSequential* CDS = dyn_cast<ConstantDataSequential>(arrayBytes)) {
+      StringRef Bytes = CDS->getRawDataValues();
+      std::copy(Bytes.begin(), Bytes.end(), Terminated.begin());
+    }
+    arrayBytes = ConstantDataArray::get(Context, ArrayRef<uint8_t>(Terminated));
+  }
+
+  Memo.filenameId = filenameId;
+  Memo.offset = Offset;
+  Memo.size = Size;
+  Memo.bytes = arrayBytes;
+  return true;
+
+}
+
+// Get the snapshot of Filename, stat-ing it if this is the first time it has been looked at.
+FileSnapshot* llvm::getFileSnapshot(const std::string& Filename) {
+
+  FileSnapshot*& Snap = GlobalIHP->fileSnapshots[Filename];
+  if(Snap)
+    return Snap;
+
+  Snap = new FileSnapshot();
+  Snap->statRet = ::stat(Filename.c_str(), &Snap->st);
+  if(Snap->statRet == -1)
+    Snap->statErrno = errno;
+
+  return Snap;
+
+}
+
+// As ::stat, but giving the file as it was first seen.
+int llvm::getSnapshotStat(const std::string& Filename, struct stat& St) {
+
+  FileSnapshot* Snap = getFileSnapshot(Filename);
+  if(Snap->statRet == -1) {
+    errno = Snap->statErrno;
+    return -1;
   }
 
-  int rc = fseek(fp, realFilePos, SEEK_SET);
-  if(rc == -1) {
-    errors = "Couldn't seek " + strFileName + ": " + strerror(errno);
+  St = Snap->st;
+  return 0;
+
+}
+
+// Is Other, a fresh stat of the same path, still the version this snapshot describes?
+bool FileSnapshot::matches(const struct stat& Other) const {
+
+  return statRet == 0 && st.st_dev == Other.st_dev && st.st_ino == Other.st_ino && st.st_size == Other.st_size &&
+    st.st_mtim.tv_sec == Other.st_mtim.tv_sec && st.st_mtim.tv_nsec == Other.st_mtim.tv_nsec;
+
+}
+
+// Read strFileName[realFilePos : realFilePos + realBytes] as a packed i8 array Constant.
+// The file range is sliced from the file's read-ahead window, mapping a new window if it isn't
+// covered, and its bytes handed straight to ConstantDataArray, so no per-byte ConstantInts are created.
+// Reading past EOF yields a short array, as read() would. A window is only used if the file is still
+// the version first snapshotted. 'errors' will carry a verbose error report.
+// Return true on success.
+bool llvm::getFileBytes(const std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, Constant*& arrayBytes, LLVMContext& Context, std::string& errors) {
+
+  FileSnapshot* Snap = getFileSnapshot(strFileName);
+
+  if(Snap->statRet == -1) {
+    errors = "Couldn't stat " + strFileName + ": " + strerror(Snap->statErrno);
     return false;
   }
 
-  uint64_t bytesRead = 0;
-  uint8_t buffer[4096];
-  Type* charType = IntegerType::get(Context, 8);
-  while(bytesRead < realBytes) {
-    uint64_t toRead = realBytes - bytesRead;
-    toRead = std::min(toRead, (uint64_t)4096);
-    size_t reallyRead = fread(buffer, 1, (size_t)toRead, fp);
-    if(reallyRead == 0) {
-      if(feof(fp))
-        break;
-      else {
-        errors = "Error reading from " + strFileName + ": " + strerror(errno);
-        fclose(fp);
-        return false;
-      }
+  uint64_t fileSize = (uint64_t)Snap->st.st_size;
+  uint64_t availBytes = 0;
+  if(realFilePos < fileSize)
+    availBytes = std::min(realBytes, fileSize - realFilePos);
+
+  if(availBytes == 0) {
+    arrayBytes = ConstantDataArray::get(Context, ArrayRef<uint8_t>());
+    return true;
+  }
+
+  if((!Snap->window) || realFilePos < Snap->windowStart ||
+     realFilePos + availBytes > Snap->windowStart + Snap->window->getBufferSize()) {
+
+    uint64_t windowBytes = std::min(std::max(availBytes, FileReadAheadBytes), fileSize - realFilePos);
+    ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFileSlice(strFileName, windowBytes, realFilePos);
+    if(std::error_code ec = MB.getError()) {
+      errors = "Couldn't read " + strFileName + ": " + ec.message();
+      return false;
     }
-    for(size_t i = 0; i < reallyRead; i++) {
-      Constant* byteAsConst = ConstantInt::get(charType, buffer[i]);
-      arrayBytes.push_back(byteAsConst);
+
+    struct stat file_stat;
+    if(::stat(strFileName.c_str(), &file_stat) == -1 || !Snap->matches(file_stat)) {
+      errors = strFileName + " changed during specialisation";
+      return false;
     }
-    bytesRead += reallyRead;
+
+    delete Snap->window;
+    Snap->window = MB->release();
+    Snap->windowStart = realFilePos;
+    ++GlobalIHP->stats.fileWindowLoads;
+
   }
 
-  fclose(fp);
+  ++GlobalIHP->stats.fileWindowReads;
+
+  const uint8_t* Bytes = (const uint8_t*)Snap->window->getBufferStart() + (realFilePos - Snap->windowStart);
+  arrayBytes = ConstantDataArray::get(Context, ArrayRef<uint8_t>(Bytes, availBytes));
 
   return true;
 
@@ -1092,9 +1778,31 @@ void LLPEAnalysisPass::initGlobalFDStore() {
 void IntegrationAttempt::initialiseFDStore(FDStore* S) {
 
   // Initialise stdin with position 0
-  S->fds.push_back(FDState());
-  S->fds[0].filename = SpecStdIn;
-  S->fds[0].pos = 0;
-  S->fds[0].clean = false;
+  S->resize(1);
+  S->getWritableFD(0) = FDState(SpecStdIn);
+
+}
+
+uint32_t llvm::internFDFilename(const std::string& Name) {
+
+  LLPEAnalysisPass* pass = GlobalIHP;
+  if(pass->fdFilenames.empty()) {
+    pass->fdFilenames.push_back("");
+    pass->fdFilenameIds[""] = 0;
+  }
+
+  std::pair<StringMap<uint32_t>::iterator, bool> ins = pass->fdFilenameIds.insert(std::make_pair(Name, (uint32_t)pass->fdFilenames.size()));
+  if(ins.second)
+    pass->fdFilenames.push_back(Name);
+  return ins.first->second;
+
+}
+
+const std::string& llvm::getFDFilename(uint32_t Id) {
+
+  static const std::string Empty;
+  if(Id >= GlobalIHP->fdFilenames.size())
+    return Empty;
+  return GlobalIHP->fdFilenames[Id];
 
 }
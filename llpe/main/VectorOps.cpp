@@ -0,0 +1,365 @@
+//===-- VectorOps.cpp -----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Lane-wise evaluation of vector instructions. A wholly constant vector is an ordinary scalar
+// value and goes through the constant folder like anything else, but a vector with a pointer or FD
+// in some lane, or whose lanes are only partly known, can only be described as a multi: one extent
+// per lane, as a vector load from such memory produces. Here we move lanes between values like that,
+// so that extractelement, insertelement and shufflevector are as good as the lanes they read, and
+// evaluate element-wise arithmetic, comparisons and casts one lane at a time. Vectorised string and
+// checksum loops then specialise as well as their scalar equivalents.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+#define IVSR(x, y, z) std::make_pair(std::make_pair(x, y), z)
+
+// Lanes must be whole, addressable bytes for us to find them in a multi; this excludes e.g. <8 x i1>.
+static bool getLaneLayout(Type* T, uint64_t& ESize, uint32_t& NLanes) {
+
+  VectorType* VT = dyn_cast<VectorType>(T);
+  if(!VT)
+    return false;
+
+  Type* ET = VT->getElementType();
+  uint64_t Bits = GlobalTD->getTypeSizeInBits(ET);
+  if(Bits % 8 || GlobalTD->getTypeAllocSize(ET) != Bits / 8)
+    return false;
+
+  ESize = Bits / 8;
+  NLanes = VT->getNumElements();
+  return true;
+
+}
+
+// Read IVM[Start:Start+Size] as extents relative to Start. Fails if the multi doesn't cover it all.
+static bool readMultiRange(ImprovedValSetMulti* IVM, uint64_t Start, uint64_t Size, SmallVector<IVSRange, 4>& Dest) {
+
+  uint64_t Cursor = Start, End = Start + Size;
+
+  for(ImprovedValSetMulti::MapIt it = IVM->Map.find(Start), itend = IVM->Map.end();
+      it != itend && it.start() < End; ++it) {
+
+    if(it.start() > Cursor)
+      return false;
+
+    uint64_t PieceStart = std::max((uint64_t)it.start(), Start);
+    uint64_t PieceEnd = std::min((uint64_t)it.stop(), End);
+    getIVSSubVals(it.value(), PieceStart - it.start(), PieceEnd - PieceStart, ((int64_t)it.start()) - ((int64_t)Start), Dest);
+    Cursor = PieceEnd;
+
+  }
+
+  return Cursor == End;
+
+}
+
+// Get lane Lane of vector V, whose elements are ESize bytes of type ET.
+static void getLane(ShadowValue V, uint32_t Lane, uint64_t ESize, Type* ET, ImprovedValSetSingle& Out) {
+
+  uint64_t Start = Lane * ESize;
+  SmallVector<IVSRange, 4> Extents;
+
+  ImprovedValSetMulti* IVM = 0;
+  if(V.isInst() || V.isArg())
+    IVM = dyn_cast<ImprovedValSetMulti>(getIVSRef(V));
+
+  if(IVM) {
+
+    if(!readMultiRange(IVM, Start, ESize, Extents)) {
+      Out.setOverdef();
+      return;
+    }
+
+  }
+  else {
+
+    ImprovedValSetSingle Whole;
+    if(!getImprovedValSetSingle(V, Whole)) {
+      Out.setOverdef();
+      return;
+    }
+    getIVSSubVals(Whole, Start, ESize, -((int64_t)Start), Extents);
+
+  }
+
+  if(Extents.size() == 1) {
+
+    Out = Extents[0].second;
+    if(Out.isWhollyUnknown())
+      Out.setOverdef();
+    else if(!Out.coerceToType(ET, ESize, 0))
+      Out.setOverdef();
+    return;
+
+  }
+
+  // The lane is split between extents, e.g. lanes of a vector written as scalars of another width.
+  if(Constant* C = valsToConst(Extents, ESize, ET)) {
+
+    std::pair<ValSetType, ImprovedVal> LaneVal = getValPB(C);
+    if(LaneVal.first == ValSetTypeUnknown)
+      Out.setOverdef();
+    else
+      Out.set(LaneVal.second, LaneVal.first);
+
+  }
+  else {
+
+    Out.setOverdef();
+
+  }
+
+}
+
+// The constant a lane holds, if it has exactly one value and that can be written as a constant.
+static Constant* getLaneConstant(ImprovedValSetSingle& L) {
+
+  if(L.isWhollyUnknown() || L.Values.size() != 1 || !L.Values[0].V.isVal())
+    return 0;
+
+  if(L.SetType == ValSetTypeScalar)
+    return getSingleConstant(L.Values[0].V);
+  if(L.SetType == ValSetTypePB && L.Values[0].Offset == 0 && isa<ConstantPointerNull>(L.Values[0].V.getVal()))
+    return cast<Constant>(L.Values[0].V.getVal());
+  return 0;
+
+}
+
+// Assemble a vector of type T from its lanes: a constant if they all are, and otherwise a multi.
+static void buildVector(SmallVector<ImprovedValSetSingle, 8>& Lanes, Type* T, ImprovedValSet*& NewIV) {
+
+  bool anyKnown = false;
+  SmallVector<Constant*, 8> Elts;
+
+  for(uint32_t i = 0, ilim = Lanes.size(); i != ilim; ++i) {
+
+    if(!Lanes[i].isWhollyUnknown())
+      anyKnown = true;
+    if(Elts.size() == i) {
+      if(Constant* C = getLaneConstant(Lanes[i]))
+	Elts.push_back(C);
+    }
+
+  }
+
+  if(!anyKnown) {
+    NewIV = newOverdefIVS();
+    return;
+  }
+
+  if(Elts.size() == Lanes.size()) {
+
+    ImprovedValSetSingle* NewIVS = newIVS();
+    NewIVS->set(ImprovedVal(ShadowValue(ConstantVector::get(Elts))), ValSetTypeScalar);
+    NewIV = NewIVS;
+    return;
+
+  }
+
+  uint64_t ESize;
+  uint32_t NLanes;
+  if(!getLaneLayout(T, ESize, NLanes)) {
+    NewIV = newOverdefIVS();
+    return;
+  }
+
+  ImprovedValSetMulti* IVM = newIVM(ESize * NLanes);
+  for(uint32_t i = 0; i != NLanes; ++i) {
+
+    if(Lanes[i].isWhollyUnknown())
+      Lanes[i].setOverdef();
+    IVM->Map.insert(i * ESize, (i + 1) * ESize, Lanes[i]);
+
+  }
+
+  NewIV = IVM;
+
+}
+
+static bool getLaneIndex(ShadowValue V, uint32_t NLanes, uint32_t& Idx) {
+
+  ConstantInt* CI = dyn_cast_or_null<ConstantInt>(getConstReplacement(V));
+  if(!CI || CI->getLimitedValue() >= NLanes)
+    return false;
+  Idx = (uint32_t)CI->getLimitedValue();
+  return true;
+
+}
+
+// Evaluate extractelement, insertelement and shufflevector by moving lanes, and other vector
+// instructions lane by lane if any operand is a multi (otherwise the constant folder does better).
+// Returns false to leave SI to the ordinary paths.
+bool IntegrationAttempt::tryEvaluateVectorInst(ShadowInstruction* SI, ImprovedValSet*& NewIV, bool anyMultis) {
+
+  Instruction* I = SI->invar->I;
+
+  uint64_t ESize;
+  uint32_t NLanes;
+
+  switch(I->getOpcode()) {
+
+  case Instruction::ExtractElement:
+    {
+
+      Type* ET = I->getType();
+      if(!getLaneLayout(I->getOperand(0)->getType(), ESize, NLanes))
+	return false;
+
+      ImprovedValSetSingle* NewIVS = newIVS();
+      NewIV = NewIVS;
+
+      uint32_t Idx;
+      if(!getLaneIndex(SI->getOperand(1), NLanes, Idx))
+	NewIVS->setOverdef();
+      else
+	getLane(SI->getOperand(0), Idx, ESize, ET, *NewIVS);
+
+      ++GlobalIHP->stats.vectorLaneInsts;
+      return true;
+
+    }
+
+  case Instruction::InsertElement:
+    {
+
+      Type* ET = I->getOperand(1)->getType();
+      if(!getLaneLayout(I->getType(), ESize, NLanes))
+	return false;
+
+      uint32_t Idx;
+      if(!getLaneIndex(SI->getOperand(2), NLanes, Idx)) {
+	NewIV = newOverdefIVS();
+	return true;
+      }
+
+      SmallVector<ImprovedValSetSingle, 8> Lanes(NLanes);
+      for(uint32_t i = 0; i != NLanes; ++i) {
+
+	if(i != Idx)
+	  getLane(SI->getOperand(0), i, ESize, ET, Lanes[i]);
+	else if(!getImprovedValSetSingle(SI->getOperand(1), Lanes[i]))
+	  Lanes[i].setOverdef();
+
+      }
+
+      buildVector(Lanes, I->getType(), NewIV);
+      ++GlobalIHP->stats.vectorLaneInsts;
+      return true;
+
+    }
+
+  case Instruction::ShuffleVector:
+    {
+
+      ShuffleVectorInst* SVI = cast<ShuffleVectorInst>(I);
+      uint64_t InESize;
+      uint32_t InLanes;
+      if(!getLaneLayout(SVI->getOperand(0)->getType(), InESize, InLanes))
+	return false;
+
+      Type* ET = cast<VectorType>(SVI->getType())->getElementType();
+      uint32_t OutLanes = cast<VectorType>(SVI->getType())->getNumElements();
+
+      SmallVector<ImprovedValSetSingle, 8> Lanes(OutLanes);
+      for(uint32_t i = 0; i != OutLanes; ++i) {
+
+	int M = SVI->getMaskValue(i);
+	if(M < 0)
+	  Lanes[i].set(ImprovedVal(ShadowValue(UndefValue::get(ET))), ValSetTypeScalar);
+	else if((uint32_t)M < InLanes)
+	  getLane(SI->getOperand(0), M, InESize, ET, Lanes[i]);
+	else
+	  getLane(SI->getOperand(1), M - InLanes, InESize, ET, Lanes[i]);
+
+      }
+
+      buildVector(Lanes, SVI->getType(), NewIV);
+      ++GlobalIHP->stats.vectorLaneInsts;
+      return true;
+
+    }
+
+  default:
+    break;
+
+  }
+
+  // Element-wise operations. The multi paths assume scalar integers, so these mustn't reach them.
+  if(!anyMultis)
+    return false;
+
+  VectorType* VT = dyn_cast<VectorType>(I->getType());
+  if(!VT || !(isa<BinaryOperator>(I) || isa<CmpInst>(I) || isa<CastInst>(I))) {
+    if(VT) {
+      NewIV = newOverdefIVS();
+      return true;
+    }
+    return false;
+  }
+
+  Type* OpTy = I->getOperand(0)->getType();
+  if(!getLaneLayout(OpTy, ESize, NLanes) || !isa<VectorType>(I->getOperand(I->getNumOperands() - 1)->getType())) {
+    NewIV = newOverdefIVS();
+    return true;
+  }
+
+  Type* OpET = cast<VectorType>(OpTy)->getElementType();
+  Type* ResET = VT->getElementType();
+
+  SmallVector<ImprovedValSetSingle, 8> Lanes(NLanes);
+  for(uint32_t i = 0; i != NLanes; ++i) {
+
+    Constant* LaneOps[2] = { 0, 0 };
+    bool allConst = true;
+    for(uint32_t j = 0, jlim = I->getNumOperands(); j != jlim && allConst; ++j) {
+
+      ImprovedValSetSingle L;
+      getLane(SI->getOperand(j), i, ESize, OpET, L);
+      if(!(LaneOps[j] = getLaneConstant(L)))
+	allConst = false;
+
+    }
+
+    Constant* Result = 0;
+    if(allConst) {
+
+      if(BinaryOperator* BO = dyn_cast<BinaryOperator>(I))
+	Result = ConstantFoldBinaryOpOperands(BO->getOpcode(), LaneOps[0], LaneOps[1], *GlobalTD);
+      else if(CmpInst* CI = dyn_cast<CmpInst>(I))
+	Result = ConstantFoldCompareInstOperands(CI->getPredicate(), LaneOps[0], LaneOps[1], *GlobalTD);
+      else
+	Result = ConstantFoldCastOperand(I->getOpcode(), LaneOps[0], ResET, *GlobalTD);
+
+    }
+
+    if(Result && !isa<ConstantExpr>(Result)) {
+      std::pair<ValSetType, ImprovedVal> LaneVal = getValPB(Result);
+      Lanes[i].set(LaneVal.second, LaneVal.first);
+    }
+    else {
+      Lanes[i].setOverdef();
+    }
+
+  }
+
+  buildVector(Lanes, VT, NewIV);
+  ++GlobalIHP->stats.vectorLaneInsts;
+  return true;
+
+}
@@ -0,0 +1,108 @@
+//===-- failcounts.c ------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Runtime for programs specialised with -llpe-count-failures. The specialised module registers its
+// counters (one per edge from specialised to unspecialised code) from a constructor, and we write
+// out the nonzero ones, one "count site" line each, when the program exits. The output goes to the
+// file named by $LLPE_FAIL_COUNTS (appended to, as several processes may share it), or else stderr.
+// If $LLPE_FAIL_COUNTS_SIGNAL gives a signal number, that signal dumps the counters too, so that
+// long-running programs can be sampled without stopping them.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static volatile uint64_t* fail_counters;
+static const char** fail_sites;
+static uint32_t fail_nsites;
+
+static void write_all(int fd, const char* buf, size_t len) {
+
+  while(len) {
+    ssize_t written = write(fd, buf, len);
+    if(written <= 0)
+      return;
+    buf += written;
+    len -= written;
+  }
+
+}
+
+// Only async-signal-safe calls from here on, since we may be running in a signal handler.
+static void dump_fail_counts(void) {
+
+  const char* path = getenv("LLPE_FAIL_COUNTS");
+  int fd = 2;
+  if(path) {
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(fd == -1)
+      return;
+  }
+
+  for(uint32_t i = 0; i != fail_nsites; ++i) {
+
+    uint64_t count = __atomic_load_n(&fail_counters[i], __ATOMIC_RELAXED);
+    if(!count)
+      continue;
+
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    *--p = ' ';
+    do {
+      *--p = '0' + (count % 10);
+      count /= 10;
+    } while(count);
+
+    write_all(fd, p, buf + sizeof(buf) - p);
+    write_all(fd, fail_sites[i], strlen(fail_sites[i]));
+    write_all(fd, "\n", 1);
+
+  }
+
+  if(path)
+    close(fd);
+
+}
+
+static void dump_fail_counts_on_signal(int sig) {
+
+  (void)sig;
+  dump_fail_counts();
+
+}
+
+void llpe_fail_counts_register(uint64_t* counters, const char** sites, uint32_t nsites) {
+
+  fail_counters = counters;
+  fail_sites = sites;
+  fail_nsites = nsites;
+
+  atexit(dump_fail_counts);
+
+  const char* sigstr = getenv("LLPE_FAIL_COUNTS_SIGNAL");
+  if(sigstr) {
+
+    int sig = atoi(sigstr);
+    if(sig > 0 && sig < NSIG) {
+
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = dump_fail_counts_on_signal;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      sigaction(sig, &sa, 0);
+
+    }
+
+  }
+
+}
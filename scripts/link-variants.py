@@ -0,0 +1,144 @@
+#!/usr/bin/python
+
+# Link several specialisations of one program, each made for a different version of an input file,
+# into one module that picks the right one when it starts. Each variant module should come from an LLPE
+# run with -llpe-export-variant=TAG, which renames its specialised root (main, by default) to
+# main.variant.TAG and internalises everything else so the modules can be linked without clashing.
+# We generate a new main that reads the input file, computes its FNV-1a digest and calls the variant
+# whose specialisation-time contents (given here as CONTENTS) match, or the --default variant otherwise;
+# that variant's own checks then fall back to unspecialised code wherever the contents differ.
+# Identical code in different variants is folded afterwards with opt -mergefunc unless --no-merge is given.
+#
+# Usage: link-variants.py --input-file /etc/foo.conf --variant a=a.bc=foo-a.conf --variant b=b.bc=foo-b.conf -o out.bc
+
+from __future__ import print_function
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+def fnv1a(data):
+
+	h = 0xcbf29ce484222325
+	for c in bytearray(data):
+		h ^= c
+		h = (h * 0x100000001b3) & 0xffffffffffffffff
+	return h
+
+parser = argparse.ArgumentParser(description = "Link LLPE variants with a dispatcher on an input file's digest")
+parser.add_argument("--cc", default = "clang")
+parser.add_argument("--opt", default = "opt")
+parser.add_argument("--llvm-link", default = "llvm-link")
+parser.add_argument("--root", default = "main", help = "Name the variants' roots were exported under (must take argc, argv, envp)")
+parser.add_argument("--input-file", required = True, help = "Path the program reads at runtime")
+parser.add_argument("--variant", action = "append", default = [], metavar = "TAG=MODULE=CONTENTS",
+		    help = "A variant module and the input file contents it was specialised for")
+parser.add_argument("--default", help = "Variant to run when no digest matches (default: the first)")
+parser.add_argument("--no-merge", action = "store_true", help = "Don't fold identical functions after linking")
+parser.add_argument("-o", dest = "output", required = True)
+args = parser.parse_args()
+
+variants = []
+for v in args.variant:
+	try:
+		tag, module, contents = v.split("=", 2)
+	except ValueError:
+		print("Bad --variant %s: expected TAG=MODULE=CONTENTS" % v, file = sys.stderr)
+		sys.exit(1)
+	with open(contents, "rb") as f:
+		data = f.read()
+	variants.append((tag, module, len(data), fnv1a(data)))
+
+if not variants:
+	print("No variants given", file = sys.stderr)
+	sys.exit(1)
+
+tags = [v[0] for v in variants]
+default = args.default if args.default is not None else tags[0]
+if default not in tags:
+	print("Default variant %s is not among %s" % (default, ", ".join(tags)), file = sys.stderr)
+	sys.exit(1)
+
+def c_string(s):
+	return "\"%s\"" % s.replace("\\", "\\\\").replace("\"", "\\\"")
+
+dispatcher = ["#include <fcntl.h>", "#include <stdint.h>", "#include <unistd.h>", ""]
+for i, (tag, module, size, digest) in enumerate(variants):
+	dispatcher.append("extern int variant_%d(int, char**, char**) __asm__(%s);" % (i, c_string("%s.variant.%s" % (args.root, tag))))
+
+dispatcher.append("""
+static int read_digest(uint64_t* size, uint64_t* digest) {
+
+  int fd = open(%s, O_RDONLY);
+  if(fd == -1)
+    return 0;
+
+  uint64_t h = 0xcbf29ce484222325ULL;
+  uint64_t n = 0;
+  unsigned char buf[4096];
+  ssize_t got;
+  while((got = read(fd, buf, sizeof(buf))) > 0) {
+    for(ssize_t i = 0; i != got; ++i) {
+      h ^= buf[i];
+      h *= 0x100000001b3ULL;
+    }
+    n += got;
+  }
+
+  close(fd);
+  if(got < 0)
+    return 0;
+
+  *size = n;
+  *digest = h;
+  return 1;
+
+}
+""" % c_string(args.input_file))
+
+dispatcher.append("int %s(int argc, char** argv, char** envp) {" % args.root)
+dispatcher.append("")
+dispatcher.append("  uint64_t size, digest;")
+dispatcher.append("  if(read_digest(&size, &digest)) {")
+for i, (tag, module, size, digest) in enumerate(variants):
+	dispatcher.append("    if(size == %dULL && digest == 0x%016xULL)" % (size, digest))
+	dispatcher.append("      return variant_%d(argc, argv, envp);" % i)
+dispatcher.append("  }")
+dispatcher.append("")
+dispatcher.append("  return variant_%d(argc, argv, envp);" % tags.index(default))
+dispatcher.append("")
+dispatcher.append("}")
+
+workdir = tempfile.mkdtemp(prefix = "llpe-variants-")
+
+try:
+
+	dispatch_c = os.path.join(workdir, "dispatch.c")
+	dispatch_bc = os.path.join(workdir, "dispatch.bc")
+	linked_bc = os.path.join(workdir, "linked.bc")
+
+	with open(dispatch_c, "w") as f:
+		f.write("\n".join(dispatcher) + "\n")
+
+	subprocess.check_call([args.cc, "-std=c99", "-O2", "-emit-llvm", "-c", dispatch_c, "-o", dispatch_bc])
+	subprocess.check_call([args.llvm_link, dispatch_bc] + [v[1] for v in variants] + ["-o", linked_bc])
+
+	if args.no_merge:
+		shutil.copyfile(linked_bc, args.output)
+	else:
+		subprocess.check_call([args.opt, "-mergefunc", "-globaldce", linked_bc, "-o", args.output])
+
+except subprocess.CalledProcessError as e:
+
+	print("Failed: %s" % e, file = sys.stderr)
+	sys.exit(1)
+
+finally:
+
+	shutil.rmtree(workdir)
+
+for (tag, module, size, digest) in variants:
+	print("%s: %s, %d bytes, digest %016x%s" % (tag, module, size, digest, " (default)" if tag == default else ""))
@@ -0,0 +1,144 @@
+#!/usr/bin/python
+
+# Benchmark LLPE itself (not the specialised programs: see eval/time.py for those).
+# Runs the analysis over the test/progs corpus and optionally the eval/ workloads, recording
+# wall time, peak RSS, contexts created and loop fixpoint iterations from the
+# -llpe-stats-file JSON summary. Compared against a saved baseline, exits non-zero
+# if any workload got slower or bigger than the configured thresholds.
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import os.path
+import subprocess
+import sys
+import tempfile
+import time
+
+testdir = os.path.dirname(os.path.abspath(__file__))
+progsdir = os.path.join(testdir, "progs")
+evaldir = os.path.join(testdir, "..", "eval")
+
+# eval/ specialisation scripts, all of which take extra LLPE arguments. Their prepared
+# bitcode must already exist in the directory given by --eval-dir.
+eval_scripts = ["md5sum-spec.sh", "xml-spec.sh", "printf-spec.sh"]
+
+parser = argparse.ArgumentParser(description = "Benchmark the LLPE analysis engine")
+parser.add_argument("--opt", default = "opt")
+parser.add_argument("--llpe-lib", required = True, help = "Path to the LLVMLLPEMain module")
+parser.add_argument("--driver-lib", required = True, help = "Path to the LLVMLLPEDriver module")
+parser.add_argument("--eval-dir", help = "Also run the eval/ workloads, from this directory")
+parser.add_argument("--workload", action = "append", default = [], metavar = "NAME=COMMAND",
+		    help = "Extra workload: COMMAND is run via the shell with -llpe-stats-file appended")
+parser.add_argument("--baseline", help = "Compare against results saved by --save")
+parser.add_argument("--save", help = "Write this run's results here")
+parser.add_argument("--max-time-ratio", type = float, default = 1.25)
+parser.add_argument("--max-rss-ratio", type = float, default = 1.25)
+parser.add_argument("--min-time", type = float, default = 0.5,
+		    help = "Don't flag time regressions in workloads faster than this many seconds")
+parser.add_argument("--strict-counts", action = "store_true",
+		    help = "Also fail if contexts or fixpoint iterations increase")
+args = parser.parse_args()
+
+def progs_workloads():
+
+	subprocess.check_call(["make", "-C", progsdir])
+
+	workloads = []
+	for f in sorted(os.listdir(progsdir)):
+		if not f.endswith(".bc") or f.endswith("-opt.bc"):
+			continue
+		workloads.append((f[:-3], progsdir, lambda stats, f = f: [args.opt, "-load", args.llpe_lib, "-load", args.driver_lib,
+									   "-loop-simplify", "-lcssa", "-llpe", "-integrator-accept-all",
+									   "-llpe-stats-file=%s" % stats, f, "-o", "/dev/null"]))
+	return workloads
+
+def shell_workload(name, command, cwd):
+
+	return (name, cwd, lambda stats: "%s -llpe-stats-file=%s" % (command, stats))
+
+workloads = progs_workloads()
+
+if args.eval_dir is not None:
+	for script in eval_scripts:
+		workloads.append(shell_workload(script[:-3], os.path.join(evaldir, script), args.eval_dir))
+
+for w in args.workload:
+	name, command = w.split("=", 1)
+	workloads.append(shell_workload(name, command, os.getcwd()))
+
+results = {}
+failed_runs = []
+nul = open("/dev/null", "w")
+
+for (name, cwd, command) in workloads:
+
+	statsfd, statsfile = tempfile.mkstemp(prefix = "llpe-bench-")
+	os.close(statsfd)
+
+	cmd = command(statsfile)
+	start = time.time()
+	ret = subprocess.call(cmd, cwd = cwd, stdout = nul, stderr = nul, shell = isinstance(cmd, str))
+	wall = time.time() - start
+
+	try:
+		with open(statsfile + ".json", "r") as f:
+			stats = json.load(f)
+	except (IOError, ValueError):
+		stats = None
+
+	for leftover in [statsfile, statsfile + ".json"]:
+		if os.path.exists(leftover):
+			os.unlink(leftover)
+
+	if ret != 0 or stats is None:
+		print("%-30s FAILED (exit code %d)" % (name, ret))
+		failed_runs.append(name)
+		continue
+
+	results[name] = { "wall": wall,
+			  "rss_kb": stats["peak_rss_kb"],
+			  "contexts": stats["contexts"],
+			  "fixpoint_iterations": stats["fixpoint_iterations"] }
+
+	print("%-30s %8.2fs %8d KB %6d contexts %8d fixpoint iterations" % (name, wall, stats["peak_rss_kb"], stats["contexts"], stats["fixpoint_iterations"]))
+
+if args.save is not None:
+	with open(args.save, "w") as f:
+		json.dump(results, f, indent = 2, sort_keys = True)
+
+regressions = []
+
+if args.baseline is not None:
+
+	with open(args.baseline, "r") as f:
+		baseline = json.load(f)
+
+	for name in sorted(results):
+
+		if name not in baseline:
+			continue
+
+		new = results[name]
+		old = baseline[name]
+
+		if new["wall"] >= args.min_time and new["wall"] > old["wall"] * args.max_time_ratio:
+			regressions.append("%s: wall time %.2fs -> %.2fs" % (name, old["wall"], new["wall"]))
+		if new["rss_kb"] > old["rss_kb"] * args.max_rss_ratio:
+			regressions.append("%s: peak RSS %d KB -> %d KB" % (name, old["rss_kb"], new["rss_kb"]))
+
+		for key in ["contexts", "fixpoint_iterations"]:
+			if new[key] != old[key]:
+				msg = "%s: %s %d -> %d" % (name, key, old[key], new[key])
+				if args.strict_counts and new[key] > old[key]:
+					regressions.append(msg)
+				else:
+					print("Note:", msg)
+
+for r in regressions:
+	print("REGRESSION", r)
+
+if regressions or failed_runs:
+	sys.exit(1)
@@ -1,10 +1,16 @@
+// test/scaling.py overrides this.
+#ifndef TEST_STR
+#define TEST_STR "Hello world!"
+#endif
+
+#define TEST_LEN ((int)sizeof(TEST_STR) - 1)
 
 int main(int argc, char** argv) {
 
-  char* test_str = "Hello world!";
+  char* test_str = TEST_STR;
   int result = 0;
 
-  for(int i = 0; i < 12; i++) {
+  for(int i = 0; i < TEST_LEN; i++) {
 
     result += test_str[i];
 
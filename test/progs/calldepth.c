@@ -0,0 +1,21 @@
+
+// test/scaling.py overrides this.
+#ifndef CALL_DEPTH
+#define CALL_DEPTH 8
+#endif
+
+// Each level is a separate call context, so the call depth sets how deep LLPE inlines.
+int descend(int depth, int acc) {
+
+  if(depth == 0)
+    return acc;
+
+  return descend(depth - 1, acc + depth);
+
+}
+
+int main(int argc, char** argv) {
+
+  return descend(CALL_DEPTH, 0);
+
+}
@@ -1,12 +1,19 @@
 
+// test/scaling.py overrides these.
+#ifndef OUTER_TRIPS
+#define OUTER_TRIPS 5
+#endif
+#ifndef INNER_TRIPS
+#define INNER_TRIPS 10
+#endif
 
 int main(int argc, char** argv) {
 
   int total = 0;
 
-  for(int i = 0; i < 5; i++) {
+  for(int i = 0; i < OUTER_TRIPS; i++) {
 
-    for(int j = i; j < (i+10); j++) {
+    for(int j = i; j < (i+INNER_TRIPS); j++) {
 
       for(int k = 0; k < j; k++) {
 
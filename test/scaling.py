@@ -0,0 +1,199 @@
+#!/usr/bin/python
+
+# Measure how LLPE's own cost scales. Each sweep rebuilds one test/progs program with a size parameter
+# overridden on the compiler command line (heap objects, input bytes, loop trip count, call depth),
+# specialises every build, and records analysis time and peak RSS from the -llpe-stats-file JSON summary.
+# For each step along a sweep we report the growth exponent log(t2/t1) / log(n2/n1): around 1 is linear,
+# and steps above --superlinear are flagged. Results can be saved as CSV and, with matplotlib, plotted.
+# Supersedes the ad-hoc test-bufsizes.py and timepeels.py.
+
+from __future__ import print_function
+
+import argparse
+import json
+import math
+import os
+import os.path
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+testdir = os.path.dirname(os.path.abspath(__file__))
+progsdir = os.path.join(testdir, "progs")
+
+def string_define(n):
+	return "-DTEST_STR=\"%s\"" % ("x" * n)
+
+# (name, source, what the parameter measures, function from parameter to extra compiler arguments, default points)
+sweeps = [
+	("heap-objects", "heapstress.c", "allocations", lambda n: ["-Dnallocs=%d" % n], [16, 32, 64, 128, 256, 512, 1024]),
+	("input-bytes", "arrayloop.c", "string bytes", lambda n: [string_define(n)], [16, 64, 256, 1024, 4096]),
+	("trip-count", "deepnesting.c", "inner trips", lambda n: ["-DINNER_TRIPS=%d" % n], [10, 20, 40, 80, 160]),
+	("call-depth", "calldepth.c", "call depth", lambda n: ["-DCALL_DEPTH=%d" % n], [4, 8, 16, 32, 64, 128]),
+]
+
+parser = argparse.ArgumentParser(description = "Measure how LLPE's analysis time and memory scale")
+parser.add_argument("--cc", default = "clang")
+parser.add_argument("--opt", default = "opt")
+parser.add_argument("--llpe-lib", required = True, help = "Path to the LLVMLLPEMain module")
+parser.add_argument("--driver-lib", required = True, help = "Path to the LLVMLLPEDriver module")
+parser.add_argument("--sweep", action = "append", default = [], metavar = "NAME",
+		    help = "Only run this sweep (any of %s)" % ", ".join(s[0] for s in sweeps))
+parser.add_argument("--points", action = "append", default = [], metavar = "NAME=N,N,...",
+		    help = "Override a sweep's parameter values")
+parser.add_argument("--repeat", type = int, default = 1, help = "Runs per point; the fastest is kept")
+parser.add_argument("--timeout", type = float, default = 600, help = "Give up on a sweep after a point takes this long")
+parser.add_argument("--superlinear", type = float, default = 1.5,
+		    help = "Flag steps whose time growth exponent exceeds this")
+parser.add_argument("--csv", help = "Write all points here")
+parser.add_argument("--plot", help = "Plot time and RSS against the parameter to this image (needs matplotlib)")
+args = parser.parse_args()
+
+points_override = {}
+for p in args.points:
+	name, values = p.split("=", 1)
+	points_override[name] = [int(v) for v in values.split(",")]
+
+workdir = tempfile.mkdtemp(prefix = "llpe-scaling-")
+nul = open("/dev/null", "w")
+
+def build(source, defines, out):
+
+	ltemp = out + ".ltemp"
+	# -O0 marks functions optnone unless told otherwise, which would stop mem2reg below.
+	subprocess.check_call([args.cc, "-std=c99", "-O0", "-Xclang", "-disable-O0-optnone", "-emit-llvm", "-c",
+			       os.path.join(progsdir, source), "-o", ltemp] + defines, stdout = nul, stderr = nul)
+	subprocess.check_call([args.opt, "-mem2reg", "-loop-simplify", "-lcssa", ltemp, "-o", out])
+
+# Returns (wall seconds, LLPE phase seconds, peak RSS KB, contexts) or None on failure.
+def specialise(bc):
+
+	statsfile = bc + ".stats"
+	cmd = [args.opt, "-load", args.llpe_lib, "-load", args.driver_lib, "-loop-simplify", "-lcssa", "-llpe",
+	       "-integrator-accept-all", "-llpe-stats-file=%s" % statsfile, bc, "-o", "/dev/null"]
+
+	start = time.time()
+	ret = subprocess.call(cmd, stdout = nul, stderr = nul)
+	wall = time.time() - start
+
+	try:
+		with open(statsfile + ".json", "r") as f:
+			stats = json.load(f)
+	except (IOError, ValueError):
+		stats = None
+
+	if ret != 0 or stats is None:
+		return None
+
+	return (wall, sum(stats["phases"].values()), stats["peak_rss_kb"], stats["contexts"])
+
+def exponent(n1, v1, n2, v2):
+
+	if v1 <= 0 or v2 <= 0:
+		return None
+	return math.log(float(v2) / v1) / math.log(float(n2) / n1)
+
+results = {}
+flagged = []
+failed = False
+
+try:
+
+	for (name, source, what, defines, points) in sweeps:
+
+		if args.sweep and name not in args.sweep:
+			continue
+
+		points = points_override.get(name, points)
+		print("== %s (%s, %s)" % (name, source, what))
+		print("%10s %10s %10s %10s %8s %8s %8s" % ("n", "wall s", "llpe s", "rss KB", "contexts", "t exp", "rss exp"))
+
+		rows = []
+		for n in points:
+
+			bc = os.path.join(workdir, "%s-%d.bc" % (name, n))
+			try:
+				build(source, defines(n), bc)
+			except subprocess.CalledProcessError:
+				print("%10d build FAILED" % n)
+				failed = True
+				break
+
+			best = None
+			for i in range(args.repeat):
+				r = specialise(bc)
+				if r is None:
+					best = None
+					break
+				if best is None or r[1] < best[1]:
+					best = r
+
+			if best is None:
+				print("%10d specialisation FAILED" % n)
+				failed = True
+				break
+
+			wall, llpe_secs, rss, contexts = best
+			texp = rssexp = None
+			if rows:
+				prev = rows[-1]
+				texp = exponent(prev[0], prev[2], n, llpe_secs)
+				rssexp = exponent(prev[0], prev[3], n, rss)
+
+			fmt = lambda e: "-" if e is None else "%.2f" % e
+			print("%10d %10.3f %10.3f %10d %8d %8s %8s" % (n, wall, llpe_secs, rss, contexts, fmt(texp), fmt(rssexp)))
+
+			if texp is not None and texp > args.superlinear:
+				flagged.append("%s: time grows as n^%.2f between n=%d and n=%d" % (name, texp, rows[-1][0], n))
+
+			rows.append((n, wall, llpe_secs, rss, contexts))
+
+			if wall > args.timeout:
+				print("(stopping: point took longer than %.0fs)" % args.timeout)
+				break
+
+		results[name] = (what, rows)
+
+finally:
+
+	shutil.rmtree(workdir)
+
+if args.csv is not None:
+	with open(args.csv, "w") as f:
+		f.write("sweep,n,wall_s,llpe_s,rss_kb,contexts\n")
+		for name in sorted(results):
+			for row in results[name][1]:
+				f.write("%s,%d,%.6f,%.6f,%d,%d\n" % ((name,) + row))
+
+if args.plot is not None:
+
+	import matplotlib
+	matplotlib.use("Agg")
+	import matplotlib.pyplot as plt
+
+	fig, (tax, rax) = plt.subplots(1, 2, figsize = (12, 5))
+	for name in sorted(results):
+		what, rows = results[name]
+		if not rows:
+			continue
+		ns = [r[0] for r in rows]
+		tax.plot(ns, [r[2] for r in rows], marker = "o", label = "%s (%s)" % (name, what))
+		rax.plot(ns, [r[3] for r in rows], marker = "o", label = "%s (%s)" % (name, what))
+
+	for ax, label in [(tax, "LLPE seconds"), (rax, "peak RSS (KB)")]:
+		ax.set_xscale("log")
+		ax.set_yscale("log")
+		ax.set_xlabel("n")
+		ax.set_ylabel(label)
+		ax.legend(fontsize = "small")
+
+	fig.tight_layout()
+	fig.savefig(args.plot)
+
+for f in flagged:
+	print("SUPERLINEAR", f)
+
+if failed:
+	sys.exit(1)